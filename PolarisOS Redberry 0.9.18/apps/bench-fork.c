@@ -0,0 +1,135 @@
+/**
+ * @brief bench-fork - Measure fork+exec latency against parent size.
+ *
+ * Grows the parent by touching a heap buffer, then times fork()
+ * followed by exec of a trivial program (or _exit with -n) in the
+ * child, until waitpid() returns in the parent. With copy-on-write
+ * fork the time should stay flat as the parent grows; with eager
+ * copies it grows with every page the parent has touched.
+ *
+ * Also reports how long the parent takes to write its buffer again
+ * after the child is gone, which is where copy-on-write pays for the
+ * pages it did not copy at fork time.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define PAGE_SIZE 4096
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void touch(char * buffer, size_t size, char value) {
+	for (size_t i = 0; i < size; i += PAGE_SIZE) {
+		buffer[i] = value;
+	}
+}
+
+static int compare_u64(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-n] [-i iterations] [-m max-MiB] [program]\n"
+		"\n"
+		" -n     child calls _exit() instead of exec\n"
+		" -i     forks per size (default 20)\n"
+		" -m     largest parent size in MiB (default 512)\n"
+		"\n"
+		" program defaults to /bin/true\n",
+		argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int no_exec = 0;
+	int iterations = 20;
+	size_t max_mib = 512;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ni:m:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				no_exec = 1;
+				break;
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			case 'm':
+				max_mib = atoi(optarg);
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (iterations < 1) return usage(argv);
+
+	char * program = optind < argc ? argv[optind] : "/bin/true";
+	uint64_t * samples = malloc(sizeof(uint64_t) * iterations);
+
+	printf("fork+%s, %d iterations per size\n", no_exec ? "_exit" : program, iterations);
+	printf("%8s %10s %10s %10s %12s\n", "size", "min us", "p50 us", "max us", "rewrite us");
+
+	for (size_t mib = 1; mib <= max_mib; mib *= 2) {
+		size_t size = mib << 20;
+		char * buffer = malloc(size);
+		if (!buffer) {
+			fprintf(stderr, "%s: could not allocate %zu MiB\n", argv[0], mib);
+			break;
+		}
+		touch(buffer, size, 1);
+
+		uint64_t rewrite = 0;
+		for (int i = 0; i < iterations; ++i) {
+			uint64_t before = now_us();
+			pid_t pid = fork();
+			if (pid == 0) {
+				if (!no_exec) {
+					char * args[] = {program, NULL};
+					execvp(program, args);
+				}
+				_exit(0);
+			} else if (pid < 0) {
+				perror("fork");
+				return 1;
+			}
+			int status;
+			waitpid(pid, &status, 0);
+			samples[i] = now_us() - before;
+
+			/* Pages shared with the child have to become writable again */
+			before = now_us();
+			touch(buffer, size, 2 + i);
+			rewrite += now_us() - before;
+		}
+
+		qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+		printf("%5zu MiB %10llu %10llu %10llu %12llu\n", mib,
+			(unsigned long long)samples[0],
+			(unsigned long long)samples[iterations / 2],
+			(unsigned long long)samples[iterations - 1],
+			(unsigned long long)(rewrite / iterations));
+		fflush(stdout);
+
+		free(buffer);
+	}
+
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,154 @@
+/**
+ * @brief bench-open - Path lookup rate against path depth.
+ *
+ * Builds a chain of nested directories under a scratch directory (/tmp
+ * by default) with a file at each level, then times open()+close(),
+ * stat(), and a stat() of a name that isn't there, on the file at
+ * depths from 1 to the deepest level. Each call walks every directory
+ * on the way down, so how the rate falls off with depth shows what one
+ * more path component costs.
+ *
+ * The kernel's directory entry cache can be turned off by booting with
+ * "nodcache", for comparison; its counters are in /proc/dcache.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define MAX_DEPTH 64
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * Path of the directory at @p depth, or of @p leaf inside it.
+ */
+static void make_path(char * out, size_t size, const char * base, int depth, const char * leaf) {
+	int len = snprintf(out, size, "%s/bench-open", base);
+	for (int i = 1; i < depth; ++i) {
+		len += snprintf(out + len, size - len, "/level-%02d", i);
+	}
+	if (leaf) snprintf(out + len, size - len, "/%s", leaf);
+}
+
+/**
+ * Call open()+close(), or with @p use_stat stat(), on @p path for @p ms milliseconds, returns calls per second.
+ */
+static double run(int use_stat, const char * path, int ms) {
+	uint64_t start = now_us();
+	uint64_t end = start + (uint64_t)ms * 1000;
+	uint64_t calls = 0;
+	uint64_t now;
+	struct stat st;
+
+	do {
+		for (int i = 0; i < 64; ++i) {
+			if (use_stat) {
+				stat(path, &st);
+			} else {
+				int fd = open(path, O_RDONLY);
+				if (fd >= 0) close(fd);
+			}
+		}
+		calls += 64;
+		now = now_us();
+	} while (now < end);
+
+	return (double)calls * 1e6 / (now - start);
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-d depth] [-t ms] [-p directory]\n"
+		"\n"
+		" -d     deepest level (default 16, at most %d)\n"
+		" -t     milliseconds per measurement (default 500)\n"
+		" -p     where to build the tree (default /tmp)\n",
+		argv[0], MAX_DEPTH);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int max_depth = 16;
+	int ms = 500;
+	const char * base = "/tmp";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:p:h")) != -1) {
+		switch (opt) {
+			case 'd':
+				max_depth = atoi(optarg);
+				break;
+			case 't':
+				ms = atoi(optarg);
+				break;
+			case 'p':
+				base = optarg;
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (max_depth < 1 || max_depth > MAX_DEPTH || ms < 1) return usage(argv);
+
+	char path[1024];
+
+	for (int depth = 1; depth <= max_depth; ++depth) {
+		make_path(path, sizeof(path), base, depth, NULL);
+		if (mkdir(path, 0755) < 0) {
+			fprintf(stderr, "%s: could not create %s\n", argv[0], path);
+			return 1;
+		}
+		make_path(path, sizeof(path), base, depth, "file");
+		int fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "%s: could not create %s\n", argv[0], path);
+			return 1;
+		}
+		close(fd);
+	}
+
+	printf("depth      open/s      stat/s   missing/s\n");
+	/* 1, 2, 4, ... and the deepest */
+	for (int depth = 1; ; depth *= 2) {
+		if (depth > max_depth) depth = max_depth;
+		make_path(path, sizeof(path), base, depth, "file");
+		double opens = run(0, path, ms);
+		double stats = run(1, path, ms);
+		make_path(path, sizeof(path), base, depth, "nothing-here");
+		double missing = run(1, path, ms);
+		printf("%5d %11.0f %11.0f %11.0f\n", depth, opens, stats, missing);
+		if (depth == max_depth) break;
+	}
+
+	for (int depth = max_depth; depth >= 1; --depth) {
+		make_path(path, sizeof(path), base, depth, "file");
+		unlink(path);
+		make_path(path, sizeof(path), base, depth, NULL);
+		rmdir(path);
+	}
+
+	FILE * f = fopen("/proc/dcache", "r");
+	if (f) {
+		char line[128];
+		printf("\n/proc/dcache:\n");
+		while (fgets(line, sizeof(line), f)) printf("  %s", line);
+		fclose(f);
+	}
+
+	return 0;
+}
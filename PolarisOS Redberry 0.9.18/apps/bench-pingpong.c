@@ -0,0 +1,201 @@
+/**
+ * @brief bench-pingpong - Context switch cost and cross-core TLB interference.
+ *
+ * Pairs of processes bounce a byte back and forth over pipes, so every
+ * round trip is two switches between address spaces. Meanwhile "victim"
+ * processes walk a buffer one page at a time, which only runs at full
+ * speed while their TLB entries survive. Each victim's rate is measured
+ * once alone and once with the ping-pong pairs running; when a context
+ * switch flushes the TLB of every core, the second number drops.
+ *
+ * Run with more cores than processes to see the cross-core effect, eg.
+ * under QEMU with -smp 4:
+ *
+ *     bench-pingpong -p 1 -v 2
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define PAGE_SIZE 4096
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+struct result {
+	int is_victim;
+	uint64_t count;
+};
+
+static void report(int fd, int is_victim, uint64_t count) {
+	struct result r = {is_victim, count};
+	write(fd, &r, sizeof(r));
+}
+
+/**
+ * Bounce a byte until the deadline, report round trips on @p result.
+ */
+static void ping(int result, uint64_t deadline) {
+	int to_pong[2], from_pong[2];
+	pipe(to_pong);
+	pipe(from_pong);
+
+	pid_t pong = fork();
+	if (pong == 0) {
+		close(to_pong[1]);
+		close(from_pong[0]);
+		char c;
+		while (read(to_pong[0], &c, 1) == 1) {
+			write(from_pong[1], &c, 1);
+		}
+		_exit(0);
+	}
+
+	close(to_pong[0]);
+	close(from_pong[1]);
+
+	uint64_t trips = 0;
+	char c = 'x';
+	while (1) {
+		write(to_pong[1], &c, 1);
+		read(from_pong[0], &c, 1);
+		trips++;
+		/* Don't let the clock dominate */
+		if (!(trips & 255) && now_us() >= deadline) break;
+	}
+
+	close(to_pong[1]);
+	waitpid(pong, NULL, 0);
+	report(result, 0, trips);
+}
+
+/**
+ * Touch one byte per page of a buffer until the deadline, report pages touched.
+ */
+static void victim(int result, size_t size, uint64_t deadline) {
+	volatile char * buffer = malloc(size);
+	for (size_t i = 0; i < size; i += PAGE_SIZE) buffer[i] = 0;
+
+	uint64_t pages = 0;
+	while (now_us() < deadline) {
+		for (size_t i = 0; i < size; i += PAGE_SIZE) {
+			buffer[i]++;
+		}
+		pages += size / PAGE_SIZE;
+	}
+
+	report(result, 1, pages);
+}
+
+/**
+ * Run @p pairs ping-pong pairs and @p victims victims for @p seconds.
+ */
+static void run(int pairs, int victims, size_t victim_size, int seconds, uint64_t * trips, uint64_t * pages) {
+	int result[2];
+	pipe(result);
+
+	uint64_t deadline = now_us() + (uint64_t)seconds * 1000000;
+	int children = 0;
+
+	for (int i = 0; i < pairs + victims; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(result[0]);
+			if (i < pairs) ping(result[1], deadline);
+			else victim(result[1], victim_size, deadline);
+			_exit(0);
+		} else if (pid > 0) {
+			children++;
+		}
+	}
+
+	close(result[1]);
+
+	*trips = 0;
+	*pages = 0;
+	struct result r;
+	while (read(result[0], &r, sizeof(r)) == sizeof(r)) {
+		if (r.is_victim) *pages += r.count;
+		else *trips += r.count;
+	}
+	close(result[0]);
+
+	for (int i = 0; i < children; ++i) {
+		wait(NULL);
+	}
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-p pairs] [-v victims] [-m victim-MiB] [-t seconds]\n"
+		"\n"
+		" -p     ping-pong process pairs (default 1)\n"
+		" -v     page walking processes (default 2)\n"
+		" -m     size of each victim's buffer in MiB (default 8)\n"
+		" -t     seconds per run (default 5)\n",
+		argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int pairs = 1;
+	int victims = 2;
+	size_t victim_mib = 8;
+	int seconds = 5;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:v:m:t:h")) != -1) {
+		switch (opt) {
+			case 'p':
+				pairs = atoi(optarg);
+				break;
+			case 'v':
+				victims = atoi(optarg);
+				break;
+			case 'm':
+				victim_mib = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (pairs < 1 || victims < 0 || pairs + victims > 32 || victim_mib < 1 || seconds < 1) return usage(argv);
+
+	size_t victim_size = victim_mib << 20;
+	uint64_t trips, pages, alone_trips, alone_pages;
+
+	printf("%d pair(s), %d victim(s) walking %zu MiB, %d s per run\n", pairs, victims, victim_mib, seconds);
+
+	run(pairs, 0, victim_size, seconds, &alone_trips, &pages);
+	printf("ping-pong alone:     %10.0f round trips/s, %6.2f us per switch\n",
+		(double)alone_trips / seconds,
+		alone_trips ? (double)seconds * 1e6 * pairs / (alone_trips * 2.0) : 0.0);
+
+	if (!victims) return 0;
+
+	run(0, victims, victim_size, seconds, &trips, &alone_pages);
+	printf("victims alone:       %10.0f pages/s\n", (double)alone_pages / seconds);
+
+	run(pairs, victims, victim_size, seconds, &trips, &pages);
+	printf("ping-pong + victims: %10.0f round trips/s, %10.0f pages/s (%.1f%% of alone)\n",
+		(double)trips / seconds, (double)pages / seconds,
+		alone_pages ? 100.0 * pages / alone_pages : 0.0);
+
+	return 0;
+}
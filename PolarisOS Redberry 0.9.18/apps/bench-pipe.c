@@ -0,0 +1,199 @@
+/**
+ * @brief bench-pipe - Pipe throughput at different message sizes.
+ *
+ * A child process writes messages of a fixed size into a pipe for a
+ * while and the parent reads them back out with a buffer of the same
+ * size, counting bytes until the child closes its end. This is done
+ * for 1 byte, 4KiB and 64KiB messages, or just the size given with -s.
+ *
+ * With -r a third process sits in the middle and moves the data from
+ * one pipe to a second one: first with read() and write() through a
+ * buffer of its own, then, where the kernel has it, with splice(),
+ * which hands the pipe's pages over without copying them.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#ifdef __toaru__
+#include <syscall.h>
+#include <syscall_nums.h>
+#endif
+
+#ifdef SYS_SPLICE
+DEFN_SYSCALL4(splice, SYS_SPLICE, int, int, size_t, unsigned int);
+#endif
+
+#define MAX_MESSAGE (64 * 1024)
+
+enum relay {
+	RELAY_NONE,
+	RELAY_COPY,
+	RELAY_SPLICE,
+};
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * Write @p size byte messages until the deadline, then close.
+ */
+static void writer(int fd, size_t size, uint64_t deadline) {
+	char * buffer = malloc(size);
+	memset(buffer, 'x', size);
+
+	uint64_t messages = 0;
+	while (1) {
+		if (write(fd, buffer, size) < 0) break;
+		messages++;
+		/* Don't let the clock dominate */
+		if (!(messages & 255) && now_us() >= deadline) break;
+	}
+
+	close(fd);
+}
+
+/**
+ * Move everything from @p in to @p out until @p in runs dry.
+ */
+static void relay(int in, int out, enum relay how) {
+#ifdef SYS_SPLICE
+	if (how == RELAY_SPLICE) {
+		while (syscall_splice(in, out, MAX_MESSAGE, 0) > 0);
+		return;
+	}
+#endif
+	char * buffer = malloc(MAX_MESSAGE);
+	ssize_t r;
+	while ((r = read(in, buffer, MAX_MESSAGE)) > 0) {
+		char * p = buffer;
+		while (r > 0) {
+			ssize_t w = write(out, p, r);
+			if (w <= 0) return;
+			p += w;
+			r -= w;
+		}
+	}
+}
+
+/**
+ * Run one size for @p seconds, returns bytes per second.
+ */
+static double run(size_t size, int seconds, enum relay how) {
+	int first[2];
+	pipe(first);
+
+	uint64_t start = now_us();
+	pid_t child = fork();
+	if (child == 0) {
+		close(first[0]);
+		writer(first[1], size, start + (uint64_t)seconds * 1000000);
+		_exit(0);
+	}
+	close(first[1]);
+
+	int fd = first[0];
+	pid_t middle = -1;
+	if (how != RELAY_NONE) {
+		int second[2];
+		pipe(second);
+		middle = fork();
+		if (middle == 0) {
+			close(second[0]);
+			relay(first[0], second[1], how);
+			_exit(0);
+		}
+		close(first[0]);
+		close(second[1]);
+		fd = second[0];
+	}
+
+	char * buffer = malloc(size);
+	uint64_t bytes = 0;
+	ssize_t r;
+	while ((r = read(fd, buffer, size)) > 0) {
+		bytes += r;
+	}
+	uint64_t elapsed = now_us() - start;
+
+	close(fd);
+	free(buffer);
+	waitpid(child, NULL, 0);
+	if (middle > 0) waitpid(middle, NULL, 0);
+
+	return elapsed ? (double)bytes * 1e6 / elapsed : 0.0;
+}
+
+static void report(size_t size, int seconds, enum relay how) {
+	static const char * names[] = {"direct", "read/write relay", "splice relay"};
+	double rate = run(size, seconds, how);
+	printf("%6zu bytes, %-16s %10.2f MB/s %12.0f messages/s\n",
+		size, names[how], rate / 1e6, rate / size);
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-s bytes] [-t seconds] [-r]\n"
+		"\n"
+		" -s     only this message size (default 1, 4096 and 65536)\n"
+		" -t     seconds per run (default 3)\n"
+		" -r     also pass the data through a relay process\n",
+		argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	size_t sizes[] = {1, 4096, MAX_MESSAGE};
+	size_t only = 0;
+	int seconds = 3;
+	int relays = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:t:rh")) != -1) {
+		switch (opt) {
+			case 's':
+				only = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'r':
+				relays = 1;
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (seconds < 1 || only > MAX_MESSAGE) return usage(argv);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+		size_t size = only ? only : sizes[i];
+		report(size, seconds, RELAY_NONE);
+		if (relays) {
+			report(size, seconds, RELAY_COPY);
+#ifdef SYS_SPLICE
+			report(size, seconds, RELAY_SPLICE);
+#endif
+		}
+		if (only) break;
+	}
+
+#ifndef SYS_SPLICE
+	if (relays) printf("(no splice on this system)\n");
+#endif
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/**
+ * @brief bench-sched - Scheduler stress test.
+ *
+ * Runs three loads, each for a few seconds:
+ *
+ *   yield      workers calling sched_yield() in a loop
+ *   pingpong   pairs of processes bouncing a byte over pipes
+ *   spin       many CPU-bound workers, more than there are cores
+ *
+ * For each, prints the total throughput, how evenly it was spread over
+ * the workers (Jain's fairness index, 1.0 is perfectly even, and the
+ * min/max ratio), and how the scheduler's work was spread over the
+ * cores, from /proc/schedstat: processes picked per core, how many of
+ * those were stolen from another core's queue, wakeups that moved a
+ * process to a different core, and wakeup interrupts received.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define MAX_WORKERS 256
+#define MAX_CORES   32
+
+struct core_stats {
+	unsigned long queued, switches, steals, migrations, ipis;
+};
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int read_schedstat(struct core_stats * stats) {
+	FILE * f = fopen("/proc/schedstat", "r");
+	if (!f) return 0;
+
+	char line[256];
+	int cores = 0;
+	fgets(line, sizeof(line), f); /* header */
+	while (cores < MAX_CORES && fgets(line, sizeof(line), f)) {
+		int core;
+		struct core_stats * s = &stats[cores];
+		if (sscanf(line, "%d %lu %lu %lu %lu %lu", &core, &s->queued, &s->switches, &s->steals, &s->migrations, &s->ipis) == 6) {
+			cores++;
+		}
+	}
+
+	fclose(f);
+	return cores;
+}
+
+enum load { LOAD_YIELD, LOAD_PINGPONG, LOAD_SPIN };
+
+static const char * load_names[] = { "yield", "pingpong", "spin" };
+
+/**
+ * Body of one worker, returns the amount of work done by the deadline.
+ */
+static uint64_t worker(enum load load, uint64_t deadline) {
+	uint64_t count = 0;
+
+	switch (load) {
+		case LOAD_YIELD:
+			while (1) {
+				sched_yield();
+				count++;
+				if (!(count & 63) && now_us() >= deadline) break;
+			}
+			break;
+
+		case LOAD_PINGPONG: {
+			int to_pong[2], from_pong[2];
+			pipe(to_pong);
+			pipe(from_pong);
+			pid_t pong = fork();
+			if (pong == 0) {
+				close(to_pong[1]);
+				close(from_pong[0]);
+				char c;
+				while (read(to_pong[0], &c, 1) == 1) {
+					write(from_pong[1], &c, 1);
+				}
+				_exit(0);
+			}
+			close(to_pong[0]);
+			close(from_pong[1]);
+			char c = 'x';
+			while (1) {
+				write(to_pong[1], &c, 1);
+				read(from_pong[0], &c, 1);
+				count++;
+				if (!(count & 63) && now_us() >= deadline) break;
+			}
+			close(to_pong[1]);
+			waitpid(pong, NULL, 0);
+			break;
+		}
+
+		case LOAD_SPIN:
+			while (1) {
+				for (volatile int i = 0; i < 10000; ++i);
+				count++;
+				if (now_us() >= deadline) break;
+			}
+			break;
+	}
+
+	return count;
+}
+
+static void run(enum load load, int workers, int seconds) {
+	int result[2];
+	pipe(result);
+
+	struct core_stats before[MAX_CORES], after[MAX_CORES];
+	int cores = read_schedstat(before);
+
+	uint64_t start = now_us();
+	uint64_t deadline = start + (uint64_t)seconds * 1000000;
+
+	for (int i = 0; i < workers; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(result[0]);
+			uint64_t count = worker(load, deadline);
+			write(result[1], &count, sizeof(count));
+			_exit(0);
+		}
+	}
+
+	close(result[1]);
+
+	uint64_t counts[MAX_WORKERS];
+	int n = 0;
+	while (n < workers && read(result[0], &counts[n], sizeof(uint64_t)) == sizeof(uint64_t)) n++;
+	close(result[0]);
+	while (wait(NULL) > 0);
+
+	double elapsed = (now_us() - start) / 1e6;
+	if (cores) read_schedstat(after);
+
+	/* Jain's index: (sum x)^2 / (n * sum x^2) */
+	double sum = 0, sum_sq = 0;
+	uint64_t min = n ? counts[0] : 0, max = 0;
+	for (int i = 0; i < n; ++i) {
+		sum += counts[i];
+		sum_sq += (double)counts[i] * counts[i];
+		if (counts[i] < min) min = counts[i];
+		if (counts[i] > max) max = counts[i];
+	}
+
+	printf("%-8s %3d workers: %12.0f ops/s, fairness %.3f, min/max %.3f\n",
+		load_names[load], workers, sum / elapsed,
+		sum_sq > 0 ? sum * sum / (n * sum_sq) : 0.0,
+		max ? (double)min / max : 0.0);
+
+	if (!cores) {
+		printf("         (no /proc/schedstat)\n");
+		return;
+	}
+
+	unsigned long total = 0;
+	for (int i = 0; i < cores; ++i) total += after[i].switches - before[i].switches;
+	for (int i = 0; i < cores; ++i) {
+		unsigned long switches = after[i].switches - before[i].switches;
+		printf("         core %d: %5.1f%% of %lu picks, %lu stolen, %lu migrated here, %lu ipis\n",
+			i, total ? 100.0 * switches / total : 0.0, total,
+			after[i].steals - before[i].steals,
+			after[i].migrations - before[i].migrations,
+			after[i].ipis - before[i].ipis);
+	}
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-w workers] [-l yield|pingpong|spin]\n"
+		"\n"
+		" -t     seconds per load (default 5)\n"
+		" -w     workers (default 4 per core for yield and spin, 1 per core for pingpong)\n"
+		" -l     run only this load\n",
+		argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int seconds = 5;
+	int workers = 0;
+	int only = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:w:l:h")) != -1) {
+		switch (opt) {
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				break;
+			case 'l':
+				for (int i = 0; i < 3; ++i) {
+					if (!strcmp(optarg, load_names[i])) only = i;
+				}
+				if (only == -1) return usage(argv);
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (seconds < 1 || workers < 0 || workers > MAX_WORKERS) return usage(argv);
+
+	struct core_stats stats[MAX_CORES];
+	int cores = read_schedstat(stats);
+	if (!cores) cores = 1;
+
+	for (int load = 0; load < 3; ++load) {
+		if (only != -1 && only != load) continue;
+		int n = workers ? workers : (load == LOAD_PINGPONG ? cores : cores * 4);
+		if (n > MAX_WORKERS) n = MAX_WORKERS;
+		run(load, n, seconds);
+	}
+
+	return 0;
+}
@@ -0,0 +1,309 @@
+/**
+ * @brief bench-timers - Kernel timer stress test.
+ *
+ * Runs three loads, each for a few seconds:
+ *
+ *   sleep    thousands of processes in short timed sleeps, each
+ *            sleeping a random 1/2 to 1 times the period at a time
+ *   cancel   pairs of processes bouncing a byte over pipes, waiting
+ *            with poll() and a long timeout, so every wait arms a
+ *            timer that is cancelled when the byte arrives
+ *   idle     nothing at all, to count the timer interrupts an idle
+ *            system takes
+ *
+ * For sleep, prints how many wakeups were delivered per second and
+ * how late they were: the time from the requested wakeup until the
+ * process got to run again. For all of them, prints the timer work per
+ * second from /proc/timerstat: interrupts taken, timers fired, timers
+ * cancelled before they went off, and timers moved down a level of a
+ * timing wheel, along with how many were armed at the end.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define MAX_CORES 32
+#define BUCKETS   24 /* Lateness histogram, bucket n is under 2^n microseconds */
+
+struct timer_stats {
+	unsigned long armed, interrupts, fired, cancelled, cascaded;
+};
+
+struct sleep_result {
+	uint64_t wakeups;
+	uint64_t late_max;
+	uint64_t late[BUCKETS];
+};
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int read_timerstat(struct timer_stats * stats) {
+	FILE * f = fopen("/proc/timerstat", "r");
+	if (!f) return 0;
+
+	char line[256];
+	int cores = 0;
+	fgets(line, sizeof(line), f); /* header */
+	while (cores < MAX_CORES && fgets(line, sizeof(line), f)) {
+		int core;
+		struct timer_stats * s = &stats[cores];
+		if (sscanf(line, "%d %lu %lu %lu %lu %lu", &core, &s->armed, &s->interrupts, &s->fired, &s->cancelled, &s->cascaded) == 6) {
+			cores++;
+		}
+	}
+
+	fclose(f);
+	return cores;
+}
+
+static void print_timerstat(struct timer_stats * before, struct timer_stats * after, int cores, double elapsed) {
+	if (!cores) {
+		printf("         (no /proc/timerstat)\n");
+		return;
+	}
+
+	for (int i = 0; i < cores; ++i) {
+		printf("         core %d: %8.0f irq/s %9.0f fired/s %9.0f cancelled/s %9.0f cascaded/s, %lu armed\n", i,
+			(after[i].interrupts - before[i].interrupts) / elapsed,
+			(after[i].fired - before[i].fired) / elapsed,
+			(after[i].cancelled - before[i].cancelled) / elapsed,
+			(after[i].cascaded - before[i].cascaded) / elapsed,
+			after[i].armed);
+	}
+}
+
+/**
+ * Sleep for random periods until the deadline, recording how late each wakeup was.
+ */
+static void sleeper(int result, int id, int period_ms, uint64_t deadline) {
+	struct sleep_result r;
+	memset(&r, 0, sizeof(r));
+	uint32_t seed = 2463534242U + id;
+
+	while (1) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		uint64_t length = period_ms * 500 + seed % (period_ms * 500 + 1);
+		uint64_t wanted = now_us() + length;
+		if (wanted >= deadline) break;
+
+		struct timespec ts = { length / 1000000, (length % 1000000) * 1000 };
+		nanosleep(&ts, NULL);
+
+		uint64_t late = now_us();
+		late = late > wanted ? late - wanted : 0;
+		int bucket = 0;
+		while (bucket < BUCKETS - 1 && late >= (1UL << bucket)) bucket++;
+		r.late[bucket]++;
+		if (late > r.late_max) r.late_max = late;
+		r.wakeups++;
+	}
+
+	write(result, &r, sizeof(r));
+}
+
+/**
+ * Bounce a byte until the deadline, waiting in poll() with a timeout that never expires.
+ */
+static void canceller(uint64_t deadline) {
+	int to_pong[2], from_pong[2];
+	pipe(to_pong);
+	pipe(from_pong);
+
+	pid_t pong = fork();
+	if (pong == 0) {
+		close(to_pong[1]);
+		close(from_pong[0]);
+		struct pollfd fds = { to_pong[0], POLLIN, 0 };
+		char c;
+		while (poll(&fds, 1, 10000) > 0 && read(to_pong[0], &c, 1) == 1) {
+			write(from_pong[1], &c, 1);
+		}
+		_exit(0);
+	}
+
+	close(to_pong[0]);
+	close(from_pong[1]);
+
+	struct pollfd fds = { from_pong[0], POLLIN, 0 };
+	uint64_t trips = 0;
+	char c = 'x';
+	while (1) {
+		write(to_pong[1], &c, 1);
+		if (poll(&fds, 1, 10000) <= 0) break;
+		read(from_pong[0], &c, 1);
+		trips++;
+		if (!(trips & 63) && now_us() >= deadline) break;
+	}
+
+	close(to_pong[1]);
+	waitpid(pong, NULL, 0);
+}
+
+static int percentile(uint64_t * late, uint64_t total, double fraction) {
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS; ++i) {
+		seen += late[i];
+		if (seen >= total * fraction) return i;
+	}
+	return BUCKETS - 1;
+}
+
+static void run_sleep(int workers, int period_ms, int seconds) {
+	int result[2];
+	pipe(result);
+
+	struct timer_stats before[MAX_CORES], after[MAX_CORES];
+	int cores = read_timerstat(before);
+
+	uint64_t start = now_us();
+	uint64_t deadline = start + (uint64_t)seconds * 1000000;
+	int children = 0;
+
+	for (int i = 0; i < workers; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(result[0]);
+			sleeper(result[1], i, period_ms, deadline);
+			_exit(0);
+		} else if (pid > 0) {
+			children++;
+		}
+	}
+
+	close(result[1]);
+
+	struct sleep_result total, r;
+	memset(&total, 0, sizeof(total));
+	while (read(result[0], &r, sizeof(r)) == sizeof(r)) {
+		total.wakeups += r.wakeups;
+		if (r.late_max > total.late_max) total.late_max = r.late_max;
+		for (int i = 0; i < BUCKETS; ++i) total.late[i] += r.late[i];
+	}
+	close(result[0]);
+	while (wait(NULL) > 0);
+
+	double elapsed = (now_us() - start) / 1e6;
+	if (cores) read_timerstat(after);
+
+	printf("sleep    %5d sleepers, %d ms period: %9.0f wakeups/s, late p50 < %lu us, p99 < %lu us, max %lu us\n",
+		children, period_ms, total.wakeups / elapsed,
+		1UL << percentile(total.late, total.wakeups, 0.50),
+		1UL << percentile(total.late, total.wakeups, 0.99),
+		(unsigned long)total.late_max);
+	print_timerstat(before, after, cores, elapsed);
+}
+
+static void run_cancel(int pairs, int seconds) {
+	struct timer_stats before[MAX_CORES], after[MAX_CORES];
+	int cores = read_timerstat(before);
+
+	uint64_t start = now_us();
+	uint64_t deadline = start + (uint64_t)seconds * 1000000;
+	int children = 0;
+
+	for (int i = 0; i < pairs; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			canceller(deadline);
+			_exit(0);
+		} else if (pid > 0) {
+			children++;
+		}
+	}
+
+	while (wait(NULL) > 0);
+
+	double elapsed = (now_us() - start) / 1e6;
+	if (cores) read_timerstat(after);
+
+	printf("cancel   %5d pairs\n", children);
+	print_timerstat(before, after, cores, elapsed);
+}
+
+static void run_idle(int seconds) {
+	struct timer_stats before[MAX_CORES], after[MAX_CORES];
+	int cores = read_timerstat(before);
+
+	uint64_t start = now_us();
+	sleep(seconds);
+	double elapsed = (now_us() - start) / 1e6;
+	if (cores) read_timerstat(after);
+
+	printf("idle\n");
+	print_timerstat(before, after, cores, elapsed);
+}
+
+static const char * load_names[] = { "sleep", "cancel", "idle" };
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-n sleepers] [-p period-ms] [-c pairs] [-l sleep|cancel|idle]\n"
+		"\n"
+		" -t     seconds per load (default 5)\n"
+		" -n     sleeping processes (default 1000)\n"
+		" -p     longest sleep in milliseconds (default 20)\n"
+		" -c     poll ping-pong pairs (default 4)\n"
+		" -l     run only this load\n",
+		argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int seconds = 5;
+	int sleepers = 1000;
+	int period_ms = 20;
+	int pairs = 4;
+	int only = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:n:p:c:l:h")) != -1) {
+		switch (opt) {
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'n':
+				sleepers = atoi(optarg);
+				break;
+			case 'p':
+				period_ms = atoi(optarg);
+				break;
+			case 'c':
+				pairs = atoi(optarg);
+				break;
+			case 'l':
+				for (int i = 0; i < 3; ++i) {
+					if (!strcmp(optarg, load_names[i])) only = i;
+				}
+				if (only == -1) return usage(argv);
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (seconds < 1 || sleepers < 1 || period_ms < 1 || pairs < 1) return usage(argv);
+
+	if (only == -1 || only == 0) run_sleep(sleepers, period_ms, seconds);
+	if (only == -1 || only == 1) run_cancel(pairs, seconds);
+	if (only == -1 || only == 2) run_idle(seconds);
+
+	return 0;
+}
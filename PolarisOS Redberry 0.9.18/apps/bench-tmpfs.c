@@ -0,0 +1,270 @@
+/**
+ * @brief bench-tmpfs - Big directories and big files on tmpfs.
+ *
+ * First fills one directory with 100,000 empty files (-n) and times
+ * creating them, stat()ing them in a random order, listing them with
+ * readdir(), and unlinking them again.
+ *
+ * Then writes a 2GiB file (-s, in MiB) sequentially, reads it back
+ * sequentially and with several processes at once (-j), and does
+ * random 4KiB reads and writes all over it. Where tmpfs can map a file,
+ * it is also mapped and summed through the mapping.
+ *
+ * Everything is made under a scratch directory, /tmp by default (-p),
+ * and removed at the end.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#ifdef __toaru__
+#include <sys/ioctl.h>
+/* Has to match kernel/vfs/tmpfs.c */
+#define TMPFS_IOCTL_MMAP   0x544D
+#define TMPFS_IOCTL_MUNMAP 0x544E
+struct tmpfs_mmap {
+	void * address;
+	size_t size;
+};
+#endif
+
+#define CHUNK    (1024 * 1024)
+#define PAGE     4096
+
+static uint32_t seed = 2463534242U;
+
+static uint32_t bench_random(void) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void report_rate(const char * what, uint64_t count, uint64_t start) {
+	uint64_t elapsed = now_us() - start;
+	printf("%-24s %12.0f /s\n", what, elapsed ? (double)count * 1e6 / elapsed : 0.0);
+}
+
+static void report_bytes(const char * what, uint64_t bytes, uint64_t start) {
+	uint64_t elapsed = now_us() - start;
+	printf("%-24s %12.2f MB/s\n", what, elapsed ? (double)bytes / elapsed : 0.0);
+}
+
+static int directory(const char * base, int files) {
+	char dir[512];
+	char path[600];
+	snprintf(dir, sizeof(dir), "%s/bench-tmpfs.d", base);
+	if (mkdir(dir, 0755) < 0) {
+		fprintf(stderr, "bench-tmpfs: could not create %s\n", dir);
+		return 1;
+	}
+
+	uint64_t start = now_us();
+	for (int i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "%s/file-%08d", dir, i);
+		int fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "bench-tmpfs: could not create %s\n", path);
+			return 1;
+		}
+		close(fd);
+	}
+	report_rate("create", files, start);
+
+	struct stat st;
+	start = now_us();
+	for (int i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "%s/file-%08d", dir, (int)(bench_random() % files));
+		stat(path, &st);
+	}
+	report_rate("stat, random order", files, start);
+
+	start = now_us();
+	for (int i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "%s/missing-%08d", dir, i);
+		stat(path, &st);
+	}
+	report_rate("stat, missing", files, start);
+
+	start = now_us();
+	DIR * d = opendir(dir);
+	int seen = 0;
+	struct dirent * ent;
+	while ((ent = readdir(d))) seen++;
+	closedir(d);
+	report_rate("readdir entries", seen, start);
+
+	start = now_us();
+	for (int i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "%s/file-%08d", dir, i);
+		unlink(path);
+	}
+	report_rate("unlink", files, start);
+
+	rmdir(dir);
+	return 0;
+}
+
+/**
+ * Read all of @p path with @p readers processes at once, each going
+ * through the whole file; returns bytes per second over all of them.
+ */
+static double read_all(const char * path, uint64_t size, int readers) {
+	uint64_t start = now_us();
+	for (int r = 0; r < readers; ++r) {
+		if (fork() == 0) {
+			char * buffer = malloc(CHUNK);
+			int fd = open(path, O_RDONLY);
+			while (read(fd, buffer, CHUNK) > 0);
+			close(fd);
+			_exit(0);
+		}
+	}
+	for (int r = 0; r < readers; ++r) wait(NULL);
+	uint64_t elapsed = now_us() - start;
+	return elapsed ? (double)size * readers * 1e6 / elapsed : 0.0;
+}
+
+static int large_file(const char * base, uint64_t size, int readers, int random_ops) {
+	char path[512];
+	snprintf(path, sizeof(path), "%s/bench-tmpfs.dat", base);
+
+	char * buffer = malloc(CHUNK);
+	for (size_t i = 0; i < CHUNK; ++i) buffer[i] = i;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "bench-tmpfs: could not create %s\n", path);
+		return 1;
+	}
+
+	uint64_t start = now_us();
+	for (uint64_t done = 0; done < size; done += CHUNK) {
+		if (write(fd, buffer, CHUNK) != CHUNK) {
+			fprintf(stderr, "bench-tmpfs: write failed at %llu bytes\n", (unsigned long long)done);
+			return 1;
+		}
+	}
+	report_bytes("sequential write", size, start);
+
+	lseek(fd, 0, SEEK_SET);
+	start = now_us();
+	while (read(fd, buffer, CHUNK) > 0);
+	report_bytes("sequential read", size, start);
+
+	if (readers > 1) {
+		char what[32];
+		snprintf(what, sizeof(what), "read, %d at once", readers);
+		printf("%-24s %12.2f MB/s\n", what, read_all(path, size, readers) / 1e6);
+	}
+
+	uint64_t pages = size / PAGE;
+	start = now_us();
+	for (int i = 0; i < random_ops; ++i) {
+		lseek(fd, (off_t)(((uint64_t)bench_random() << 16 ^ bench_random()) % pages) * PAGE, SEEK_SET);
+		read(fd, buffer, PAGE);
+	}
+	report_rate("random 4KiB read", random_ops, start);
+
+	start = now_us();
+	for (int i = 0; i < random_ops; ++i) {
+		lseek(fd, (off_t)(((uint64_t)bench_random() << 16 ^ bench_random()) % pages) * PAGE, SEEK_SET);
+		write(fd, buffer, PAGE);
+	}
+	report_rate("random 4KiB write", random_ops, start);
+
+#ifdef __toaru__
+	struct tmpfs_mmap map;
+	start = now_us();
+	if (ioctl(fd, TMPFS_IOCTL_MMAP, &map) == 0) {
+		uint64_t sum = 0;
+		const uint64_t * words = map.address;
+		for (uint64_t i = 0; i < size / sizeof(uint64_t); ++i) sum += words[i];
+		report_bytes("mmap and sum", size, start);
+		ioctl(fd, TMPFS_IOCTL_MUNMAP, &map);
+		if (!sum) printf("(sum was 0?)\n");
+	}
+#endif
+
+	close(fd);
+	unlink(path);
+	free(buffer);
+	return 0;
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-n files] [-s MiB] [-j readers] [-r count] [-p directory]\n"
+		"\n"
+		" -n     files in the directory test, 0 to skip it (default 100000)\n"
+		" -s     size of the large file in MiB, 0 to skip it (default 2048)\n"
+		" -j     processes reading the large file at once (default 4)\n"
+		" -r     random reads and writes (default 100000)\n"
+		" -p     where to put everything (default /tmp)\n",
+		argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int files = 100000;
+	uint64_t megabytes = 2048;
+	int readers = 4;
+	int random_ops = 100000;
+	const char * base = "/tmp";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:j:r:p:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				files = atoi(optarg);
+				break;
+			case 's':
+				megabytes = strtoull(optarg, NULL, 10);
+				break;
+			case 'j':
+				readers = atoi(optarg);
+				break;
+			case 'r':
+				random_ops = atoi(optarg);
+				break;
+			case 'p':
+				base = optarg;
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (files < 0 || readers < 1 || random_ops < 0) return usage(argv);
+
+	if (files && directory(base, files)) return 1;
+	if (megabytes && large_file(base, megabytes * 1024 * 1024, readers, random_ops)) return 1;
+
+	FILE * f = fopen("/proc/tmpfs", "r");
+	if (f) {
+		char line[128];
+		printf("\n/proc/tmpfs:\n");
+		while (fgets(line, sizeof(line), f)) printf("  %s", line);
+		fclose(f);
+	}
+
+	return 0;
+}
@@ -38,6 +38,7 @@ extern void aarch64_regs(struct regs *r);
 extern void fwcfg_load_initrd(uintptr_t * ramdisk_phys_base, size_t * ramdisk_size);
 extern void virtio_input(void);
 extern void aarch64_smp_start(void);
+extern void aarch64_string_select(void);
 
 extern char end[];
 extern char * _arch_args;
@@ -158,15 +159,61 @@ void relative_time(unsigned long seconds, unsigned long subseconds, unsigned lon
 }
 
 #define TIMER_IRQ 27
-static void set_tick(void) {
-	asm volatile (
-		"mrs x0, CNTFRQ_EL0\n"
-		"mov x1, 100\n" // without this, one second
-		"udiv x0, x0, x1\n"
-		"msr CNTV_TVAL_EL0, x0\n"
-		"mov x0, 1\n"
-		"msr CNTV_CTL_EL0, x0\n"
-		:::"x0","x1");
+#define TICK_US   10000   /* Preemption tick while something is running */
+#define IDLE_US   1000000 /* Longest an idle core sleeps with no timers due */
+
+static uint64_t timer_programmed[32]; /**< When each core's next timer interrupt is due */
+
+/**
+ * @brief Microseconds since the basis time, the clock timers run on.
+ */
+static uint64_t timer_now(void) {
+	return arch_perf_timer() / sys_timer_freq - basis_time;
+}
+
+/**
+ * @brief Program this core's timer to interrupt once at @p deadline.
+ */
+static void timer_program(uint64_t now, uint64_t deadline) {
+	uint64_t freq;
+	asm volatile ("mrs %0, CNTFRQ_EL0" : "=r"(freq));
+
+	/* Round up, so we don't arrive just before a timer is due */
+	uint64_t counts = 1;
+	if (deadline > now) counts = ((deadline - now) * freq + SUBSECONDS_PER_SECOND - 1) / SUBSECONDS_PER_SECOND;
+
+	timer_programmed[this_core->cpu_id] = deadline;
+	asm volatile ("msr CNTV_TVAL_EL0, %0" :: "r"(counts));
+	asm volatile ("msr CNTV_CTL_EL0, %0" :: "r"(1UL));
+}
+
+/**
+ * @brief Program the next timer interrupt.
+ *
+ * The interrupt comes @p limit microseconds from now, or sooner if
+ * a timer on this core's timing wheel is due before then. Running
+ * cores use the scheduler tick as the limit; idle cores have nothing
+ * to preempt and only need to wake up for timers.
+ */
+static void set_tick(uint64_t limit) {
+	extern uint64_t timer_next_deadline(void);
+	uint64_t now = timer_now();
+	uint64_t deadline = now + limit;
+	uint64_t next = timer_next_deadline();
+	if (next < deadline) deadline = next;
+	timer_program(now, deadline);
+}
+
+/**
+ * @brief A timer was armed on this core for @p deadline.
+ *
+ * Brings the next interrupt forward if it was not going to
+ * come in time.
+ */
+void arch_timer_deadline(uint64_t deadline) {
+	if (deadline < timer_programmed[this_core->cpu_id]) {
+		timer_program(timer_now(), deadline);
+	}
 }
 
 void timer_start(void) {
@@ -174,7 +221,7 @@ void timer_start(void) {
 	asm volatile ("msr DAIFSet, #0b1111");
 
 	/* Enable the local timer */
-	set_tick();
+	set_tick(TICK_US);
 
 	/* This is global, we only need to do this once... */
 	gic_regs[0] = 1;
@@ -258,6 +305,16 @@ static void exception_handlers(void) {
 	asm volatile("msr VBAR_EL1, %0" :: "r"(&_exception_vector));
 }
 
+/**
+ * @brief Is this a data abort for a write to a read-only page?
+ *
+ * Permission faults at any level (DFSC 0b0011xx) with WnR set; these
+ * are how writes to copy-on-write pages arrive.
+ */
+static int aarch64_is_write_permission_fault(uint64_t esr) {
+	return (esr & 0x3C) == 0x0C && (esr & (1 << 6));
+}
+
 void aarch64_sync_enter(struct regs * r) {
 	uint64_t esr, far, elr, spsr;
 	asm volatile ("mrs %0, ESR_EL1" : "=r"(esr));
@@ -314,6 +371,11 @@ void aarch64_sync_enter(struct regs * r) {
 		goto _resume_user;
 	}
 
+	/* Write to a page shared copy-on-write */
+	if ((esr >> 26) == 0x24 && aarch64_is_write_permission_fault(esr)) {
+		if (mmu_copy_on_write(far) == 0) goto _resume_user;
+	}
+
 	/* KVM is mad at us; usually means our code is broken or we neglected a cache. */
 	if (far == 0x1de7ec7edbadc0de) {
 		printf("kvm: blip (esr=%#zx, elr=%#zx; pid=%d [%s])\n", esr, elr, this_core->current_process->id, this_core->current_process->name);
@@ -354,7 +416,7 @@ void aarch64_interrupt_dispatch(int from_wfi) {
 	switch (irq) {
 		case TIMER_IRQ:
 			update_clock();
-			set_tick();
+			set_tick(TICK_US);
 			EOI(iar);
 			if (from_wfi) {
 				switch_next();
@@ -365,7 +427,11 @@ void aarch64_interrupt_dispatch(int from_wfi) {
 
 		case 1:
 			EOI(iar);
-			if (from_wfi) switch_next();
+			if (from_wfi) {
+				/* Leaving idle, whatever runs next needs the scheduler tick back */
+				set_tick(TICK_US);
+				switch_next();
+			}
 			break;
 
 		/* Arbitrarily chosen SGI for panic signal from another core */
@@ -419,6 +485,12 @@ void aarch64_fault_enter(struct regs * r) {
 	asm volatile ("mrs %0, ELR_EL1" : "=r"(elr));
 	asm volatile ("mrs %0, SPSR_EL1" : "=r"(spsr));
 
+	/* Kernel writing to a user page that is shared copy-on-write, eg. in a system call */
+	if ((esr >> 26) == 0x25 && aarch64_is_write_permission_fault(esr) &&
+		far < 0x800000000000 && this_core->current_process) {
+		if (mmu_copy_on_write(far) == 0) return;
+	}
+
 	arch_fatal_prepare();
 
 	dprintf("EL1-EL1 fault handler, core %d\n", this_core->cpu_id);
@@ -450,6 +522,7 @@ void aarch64_sp0_fault_enter(struct regs * r) {
  * This enables the FPU in EL0. I'm not sure if we can enable it
  * there but not in EL1... that would be nice to avoid accidentally
  * introducing FPU code in the kernel that would corrupt our FPU state.
+ * The NEON string functions in string.c save whatever they touch.
  */
 void fpu_enable(void) {
 	uint64_t cpacr_el1;
@@ -468,6 +541,18 @@ void fpu_enable(void) {
  * @brief Called in a loop by kernel idle tasks.
  */
 void arch_pause(void) {
+	extern int sched_local_work(void);
+
+	/* Nothing to preempt, so only wake up for timers */
+	set_tick(IDLE_US);
+
+	/* Something may have been queued here while we were on our way to idle,
+	 * by a core that saw us as busy and sent no SGI; don't sleep on it.
+	 * Interrupts are masked, so an SGI sent after this still ends the wfi. */
+	if (sched_local_work()) {
+		set_tick(TICK_US);
+		switch_next();
+	}
 
 	/* XXX This actually works even if we're masking interrupts, but
 	 * the interrupt function won't be called, so we'll need to change
@@ -616,6 +701,7 @@ int kmain(uintptr_t dtb_base, uintptr_t phys_base, uintptr_t rpi_tag) {
 
 	/* Set up all the other arch-specific stuff here */
 	fpu_enable();
+	aarch64_string_select();
 
 	symbols_install();
 
@@ -16,7 +16,7 @@
 #include <kernel/misc.h>
 #include <kernel/mmu.h>
 
-static volatile uint32_t *frames;
+static volatile uint64_t *frames;
 static size_t nframes;
 static size_t total_memory = 0;
 static size_t unavailable_memory = 0;
@@ -24,8 +24,13 @@ static uint64_t ram_starts_at = 0;
 
 uintptr_t aarch64_kernel_phys_base = 0;
 
-/* TODO Used for CoW later. */
-//static uint8_t * mem_refcounts = NULL;
+/**
+ * Reference counts of frames shared copy-on-write, one byte per frame.
+ * 0 means the frame has a single owner (or is not a user page), otherwise
+ * it is the number of page tables mapping it. A frame that would need more
+ * than 255 references is copied instead.
+ */
+static uint8_t * mem_refcounts = NULL;
 
 #define PAGE_SHIFT     12
 #define PAGE_SIZE      0x1000UL
@@ -37,8 +42,8 @@ uintptr_t aarch64_kernel_phys_base = 0;
 #define PHYS_MASK 0x7fffffffffUL
 #define CANONICAL_MASK 0xFFFFffffFFFFUL
 
-#define INDEX_FROM_BIT(b)  ((b) >> 5)
-#define OFFSET_FROM_BIT(b) ((b) & 0x1F)
+#define INDEX_FROM_BIT(b)  ((b) >> 6)
+#define OFFSET_FROM_BIT(b) ((b) & 0x3F)
 
 #define _pagemap __attribute__((aligned(PAGE_SIZE))) = {0}
 union PML init_page_region[512] _pagemap;
@@ -77,30 +82,307 @@ union PML kbase_pmls[65][512] _pagemap;
 #define  PTE_ATTR_B    (1UL << 3)
 #define  PTE_ATTR_C    (1UL << 2)
 
+/* ASIDs: 8 bits in TTBR0_EL1[55:48] (TCR_EL1.AS=0, A1=0) */
+#define ASID_BITS      8
+#define ASID_MASK      ((1UL << ASID_BITS) - 1)
+#define ASID_COUNT     (1UL << ASID_BITS)
+#define ASID_FIRST_GENERATION (1UL << ASID_BITS)
+#define ASID_MAX_CPUS  32 /* as processor_local_data, and asid_flush_pending has a bit per core */
+
+/* Kernel mappings only use 510 and 511, and are reached through TTBR1,
+ * so this root entry is free to hold the address space's ASID context
+ * (generation | ASID). It's stored shifted so the entry stays invalid. */
+#define ASID_SLOT      256
+
+/* Software bits, ignored by the hardware */
+#define PTE_COW        (1UL << 55) /* frame shared copy-on-write, kept read-only */
+#define PTE_COW_WRITE  (1UL << 56) /* writable once the write fault has copied it */
+
+/**
+ * Physical frame allocator.
+ *
+ * Free frames are managed by a binary buddy allocator, with a free list
+ * for each order of naturally aligned power-of-two block from a single
+ * frame up to FRAME_MAX_ORDER. The list links live in the free frames
+ * themselves, through the physical memory map, and frame_orders says
+ * which frames start a free block and of what order, so a block being
+ * freed can tell whether its buddy is free and merge with it directly.
+ * Allocating or freeing a block takes at most FRAME_MAX_ORDER steps,
+ * whatever the size of the request.
+ *
+ * The frames bitmap still has a bit for every frame, set while it
+ * is in use. mmu_frame_test reads it, and it decides who gets a frame
+ * that is being claimed from two places at once.
+ *
+ * In front of the buddy allocator, each core keeps a stack of free single
+ * frames, refilled and drained in batches, so most allocations and frees
+ * don't take zone_lock at all. Frames in a cache keep their bits set, so
+ * the allocator doesn't hand them out again, and are marked FRAME_CACHED
+ * in frame_orders so freeing one twice is harmless. A cache's lock is only
+ * ever contended by mmu_frame_set taking a cached frame out of it.
+ */
+#define FRAME_MAX_ORDER   18 /* 1GiB */
+#define FRAME_NOT_FREE    0xFF /* frame_orders entry for frames that don't start a free block */
+#define FRAME_CACHED      0xFE /* ... and for frames in a core's cache */
+#define FRAME_CACHE_SIZE  64
+#define FRAME_CACHE_ORDER 5
+#define FRAME_CACHE_BATCH (1 << FRAME_CACHE_ORDER)
+
+struct free_block {
+	struct free_block * next;
+	struct free_block * prev;
+};
+
+struct frame_cache {
+	spin_lock_t lock; /* Taken before zone_lock */
+	int count;
+	uintptr_t frames[FRAME_CACHE_SIZE]; /* relative to ram_starts_at, like everything below */
+	uint64_t refills;
+	uint64_t drains;
+} __attribute__((aligned(64)));
+
+static spin_lock_t zone_lock = { 0 };
+static struct free_block * free_lists[FRAME_MAX_ORDER + 1];
+static uint8_t * frame_orders = NULL;
+static volatile size_t frames_free = 0; /* In the free lists; frames in caches are counted by their cores */
+static struct frame_cache frame_caches[32];
+static int frame_caches_enabled = 0; /* Needs this_core, turned on by generic_startup */
+
+static inline struct free_block * frame_block(uintptr_t frame) {
+	return mmu_map_from_physical(ram_starts_at + (frame << PAGE_SHIFT));
+}
+
+static inline uintptr_t block_frame(struct free_block * block) {
+	return ((((uintptr_t)block) & PHYS_MASK) - ram_starts_at) >> PAGE_SHIFT;
+}
+
+static inline int frame_test_and_set(uintptr_t frame) {
+	uint64_t bit = 1UL << OFFSET_FROM_BIT(frame);
+	return !!(__sync_fetch_and_or(&frames[INDEX_FROM_BIT(frame)], bit) & bit);
+}
+
+static inline int frame_test(uintptr_t frame) {
+	return !!(frames[INDEX_FROM_BIT(frame)] & (1UL << OFFSET_FROM_BIT(frame)));
+}
+
+static inline int frame_test_and_clear(uintptr_t frame) {
+	uint64_t bit = 1UL << OFFSET_FROM_BIT(frame);
+	return !!(__sync_fetch_and_and(&frames[INDEX_FROM_BIT(frame)], ~bit) & bit);
+}
+
+static void frame_bits_set(uintptr_t frame, size_t count) {
+	while (count) {
+		unsigned int offset = OFFSET_FROM_BIT(frame);
+		size_t bits = count < 64 - offset ? count : 64 - offset;
+		uint64_t mask = (bits == 64 ? ~0UL : ((1UL << bits) - 1)) << offset;
+		__sync_or_and_fetch(&frames[INDEX_FROM_BIT(frame)], mask);
+		frame += bits;
+		count -= bits;
+	}
+}
+
+static void buddy_push(uintptr_t frame, int order) {
+	struct free_block * block = frame_block(frame);
+	block->prev = NULL;
+	block->next = free_lists[order];
+	if (block->next) block->next->prev = block;
+	free_lists[order] = block;
+	frame_orders[frame] = order;
+}
+
+static void buddy_unlink(uintptr_t frame, int order) {
+	struct free_block * block = frame_block(frame);
+	if (block->prev) block->prev->next = block->next;
+	else free_lists[order] = block->next;
+	if (block->next) block->next->prev = block->prev;
+	frame_orders[frame] = FRAME_NOT_FREE;
+}
+
+/**
+ * @brief Take a free block of 2^order frames. Needs zone_lock.
+ *
+ * The bits of the frames are left clear.
+ * @returns the first frame, or -1 if there is no block that big.
+ */
+static uintptr_t buddy_alloc(int order) {
+	int found = order;
+	while (found <= FRAME_MAX_ORDER && !free_lists[found]) found++;
+	if (found > FRAME_MAX_ORDER) return (uintptr_t)-1;
+
+	uintptr_t frame = block_frame(free_lists[found]);
+	buddy_unlink(frame, found);
+
+	/* Split off the halves we don't need */
+	while (found > order) {
+		found--;
+		buddy_push(frame + (1UL << found), found);
+	}
+
+	frames_free -= 1UL << order;
+	return frame;
+}
+
+/**
+ * @brief Return a block of 2^order frames, merging it with its buddies. Needs zone_lock.
+ */
+static void buddy_free(uintptr_t frame, int order) {
+	frames_free += 1UL << order;
+
+	while (order < FRAME_MAX_ORDER) {
+		uintptr_t buddy = frame ^ (1UL << order);
+		if (buddy >= nframes || frame_orders[buddy] != order) break;
+		buddy_unlink(buddy, order);
+		frame &= ~(1UL << order);
+		order++;
+	}
+
+	buddy_push(frame, order);
+}
+
+/**
+ * @brief Return the frames from @p frame up to @p end as the largest blocks that fit. Needs zone_lock.
+ */
+static void buddy_free_range(uintptr_t frame, uintptr_t end) {
+	while (frame < end) {
+		int order = 0;
+		while (order < FRAME_MAX_ORDER && !(frame & (1UL << order)) && frame + (2UL << order) <= end) order++;
+		buddy_free(frame, order);
+		frame += 1UL << order;
+	}
+}
+
+/**
+ * @brief Take one particular frame out of the free lists, if it's there. Needs zone_lock.
+ */
+static int buddy_claim(uintptr_t frame) {
+	for (int order = 0; order <= FRAME_MAX_ORDER; ++order) {
+		uintptr_t head = frame & ~((1UL << order) - 1);
+		if (frame_orders[head] != order) continue;
+
+		/* Break up the block it's in, keeping everything but the frame */
+		buddy_unlink(head, order);
+		while (order > 0) {
+			order--;
+			uintptr_t half = head + (1UL << order);
+			if (frame >= half) {
+				buddy_push(head, order);
+				head = half;
+			} else {
+				buddy_push(half, order);
+			}
+		}
+		frames_free--;
+		return 1;
+	}
+	return 0;
+}
+
+static void frame_cache_refill(struct frame_cache * cache) {
+	spin_lock(zone_lock);
+	uintptr_t frame = buddy_alloc(FRAME_CACHE_ORDER);
+	if (frame != (uintptr_t)-1) {
+		frame_bits_set(frame, FRAME_CACHE_BATCH);
+		/* Lowest frames on top */
+		for (int i = FRAME_CACHE_BATCH - 1; i >= 0; --i) {
+			frame_orders[frame + i] = FRAME_CACHED;
+			cache->frames[cache->count++] = frame + i;
+		}
+	} else {
+		/* Too fragmented for a whole batch, take what there is */
+		while (cache->count < FRAME_CACHE_BATCH && (frame = buddy_alloc(0)) != (uintptr_t)-1) {
+			frame_bits_set(frame, 1);
+			frame_orders[frame] = FRAME_CACHED;
+			cache->frames[cache->count++] = frame;
+		}
+	}
+	spin_unlock(zone_lock);
+	cache->refills++;
+}
+
+static void frame_cache_drain(struct frame_cache * cache) {
+	/* Give back the ones that have been here longest */
+	spin_lock(zone_lock);
+	for (int i = 0; i < FRAME_CACHE_BATCH; ++i) {
+		uintptr_t frame = cache->frames[i];
+		frame_orders[frame] = FRAME_NOT_FREE;
+		frame_test_and_clear(frame);
+		buddy_free(frame, 0);
+	}
+	spin_unlock(zone_lock);
+	memmove(&cache->frames[0], &cache->frames[FRAME_CACHE_BATCH], (cache->count - FRAME_CACHE_BATCH) * sizeof(uintptr_t));
+	cache->count -= FRAME_CACHE_BATCH;
+	cache->drains++;
+}
+
+/**
+ * @brief Take a free frame out of whichever core's cache has it.
+ *
+ * It may have been allocated from there in the meantime, in which
+ * case there is nothing left to take.
+ */
+static void frame_cache_claim(uintptr_t frame) {
+	for (int i = 0; i < processor_count; ++i) {
+		struct frame_cache * cache = &frame_caches[i];
+		spin_lock(cache->lock);
+		for (int j = 0; j < cache->count; ++j) {
+			if (cache->frames[j] != frame) continue;
+			memmove(&cache->frames[j], &cache->frames[j + 1], (cache->count - j - 1) * sizeof(uintptr_t));
+			cache->count--;
+			frame_orders[frame] = FRAME_NOT_FREE;
+			spin_unlock(cache->lock);
+			return;
+		}
+		spin_unlock(cache->lock);
+	}
+}
+
+/**
+ * @brief Mark a frame as in use.
+ *
+ * For frames that are already known to be taken, like the kernel's,
+ * or that are about to be used for something at a fixed address. Does
+ * nothing to a frame that is already in use; a free one sitting in a
+ * core's cache is taken out of it, so it can't be handed out again.
+ */
 void mmu_frame_set(uintptr_t frame_addr) {
 	if (frame_addr < ram_starts_at) return;
 	frame_addr -= ram_starts_at;
 	if (frame_addr < nframes * PAGE_SIZE) {
-		uint64_t frame  = frame_addr >> 12;
-		uint64_t index  = INDEX_FROM_BIT(frame);
-		uint32_t offset = OFFSET_FROM_BIT(frame);
-		__sync_or_and_fetch(&frames[index], ((uint32_t)1 << offset));
-		asm ("isb" ::: "memory");
+		uintptr_t frame = frame_addr >> PAGE_SHIFT;
+		spin_lock(zone_lock);
+		int cached = 0;
+		if (!frame_test_and_set(frame)) buddy_claim(frame);
+		else cached = frame_orders[frame] == FRAME_CACHED;
+		spin_unlock(zone_lock);
+		/* Not under zone_lock, the cache locks come first */
+		if (cached) frame_cache_claim(frame);
 	}
 }
 
-static uintptr_t lowest_available = 0;
-
+/**
+ * @brief Free a frame.
+ */
 void mmu_frame_clear(uintptr_t frame_addr) {
 	if (frame_addr < ram_starts_at) return;
 	frame_addr -= ram_starts_at;
 	if (frame_addr < nframes * PAGE_SIZE) {
-		uint64_t frame  = frame_addr >> PAGE_SHIFT;
-		uint64_t index  = INDEX_FROM_BIT(frame);
-		uint32_t offset = OFFSET_FROM_BIT(frame);
-		__sync_and_and_fetch(&frames[index], ~((uint32_t)1 << offset));
-		asm ("isb" ::: "memory");
-		if (frame < lowest_available) lowest_available = frame;
+		uintptr_t frame = frame_addr >> PAGE_SHIFT;
+
+		if (frame_caches_enabled) {
+			struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+			spin_lock(cache->lock);
+			if (frame_test(frame) && frame_orders[frame] != FRAME_CACHED) {
+				if (cache->count == FRAME_CACHE_SIZE) frame_cache_drain(cache);
+				frame_orders[frame] = FRAME_CACHED;
+				cache->frames[cache->count++] = frame;
+			}
+			spin_unlock(cache->lock);
+			return;
+		}
+
+		spin_lock(zone_lock);
+		if (frame_orders[frame] != FRAME_CACHED && frame_test_and_clear(frame)) buddy_free(frame, 0);
+		spin_unlock(zone_lock);
 	}
 }
 
@@ -112,7 +394,7 @@ int mmu_frame_test(uintptr_t frame_addr) {
 	uint64_t index  = INDEX_FROM_BIT(frame);
 	uint32_t offset = OFFSET_FROM_BIT(frame);
 	asm ("" ::: "memory");
-	return !!(frames[index] & ((uint32_t)1 << offset));
+	return !!(frames[index] & (1UL << offset));
 }
 
 static spin_lock_t frame_alloc_lock = { 0 };
@@ -121,72 +403,127 @@ static spin_lock_t mmio_space_lock = { 0 };
 static spin_lock_t module_space_lock = { 0 };
 
 void mmu_frame_release(uintptr_t frame_addr) {
-	spin_lock(frame_alloc_lock);
 	mmu_frame_clear(frame_addr);
-	spin_unlock(frame_alloc_lock);
 }
 
-uintptr_t mmu_first_n_frames(int n) {
-	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (mmu_frame_test(i + ram_starts_at + PAGE_SIZE * j)) {
-				bad = j + 1;
-			}
-		}
-		if (!bad) {
-			return (i + ram_starts_at) / PAGE_SIZE;
+/**
+ * @brief Allocate a frame.
+ * @returns the frame's physical page number; its bit is already set.
+ */
+uintptr_t mmu_allocate_a_frame(void) {
+	if (frame_caches_enabled) {
+		struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+		spin_lock(cache->lock);
+		if (!cache->count) frame_cache_refill(cache);
+		if (cache->count) {
+			uintptr_t frame = cache->frames[--cache->count];
+			frame_orders[frame] = FRAME_NOT_FREE;
+			spin_unlock(cache->lock);
+			return frame + (ram_starts_at >> PAGE_SHIFT);
 		}
+		spin_unlock(cache->lock);
 	}
 
-	arch_fatal_prepare();
-	dprintf("Failed to allocate %d contiguous frames.\n", n);
-	arch_dump_traceback();
-	arch_fatal();
-	return (uintptr_t)-1;
+	spin_lock(zone_lock);
+	uintptr_t frame = buddy_alloc(0);
+	if (frame != (uintptr_t)-1) frame_bits_set(frame, 1);
+	spin_unlock(zone_lock);
+
+	if (frame == (uintptr_t)-1) {
+		/* Other cores' caches may have a few frames left, but we can't touch those. */
+		arch_fatal_prepare();
+		dprintf("Out of memory.\n");
+		arch_dump_traceback();
+		arch_fatal();
+	}
+
+	return frame + (ram_starts_at >> PAGE_SHIFT);
 }
 
-uintptr_t mmu_first_frame(void) {
-	uintptr_t i, j;
-	for (i = INDEX_FROM_BIT(lowest_available); i < INDEX_FROM_BIT(nframes); ++i) {
-		if (frames[i] != (uint32_t)-1) {
-			for (j = 0; j < (sizeof(uint32_t)*8); ++j) {
-				uint32_t testFrame = (uint32_t)1 << j;
-				if (!(frames[i] & testFrame)) {
-					uintptr_t out = (i << 5) + j;
-					lowest_available = out + 1;
-					return out + (ram_starts_at >> 12);
-				}
-			}
-		}
+/**
+ * @brief Allocate @p n physically contiguous frames, if there is a run that long.
+ *
+ * Takes the smallest block that fits and gives back what's left of it.
+ * @returns the first frame's physical page number, or -1.
+ */
+uintptr_t mmu_try_allocate_n_frames(int n) {
+	int order = 0;
+	while ((1L << order) < n) order++;
+
+	spin_lock(zone_lock);
+	uintptr_t frame = order <= FRAME_MAX_ORDER ? buddy_alloc(order) : (uintptr_t)-1;
+	if (frame != (uintptr_t)-1) {
+		frame_bits_set(frame, n);
+		buddy_free_range(frame + n, frame + (1UL << order));
 	}
+	spin_unlock(zone_lock);
+
+	if (frame == (uintptr_t)-1) return frame;
+	return frame + (ram_starts_at >> PAGE_SHIFT);
+}
+
+/**
+ * @brief Allocate @p n physically contiguous frames, eg. for DMA.
+ * @returns the first frame's physical page number.
+ */
+uintptr_t mmu_allocate_n_frames(int n) {
+	uintptr_t frame = mmu_try_allocate_n_frames(n);
 
-	if (lowest_available != 0) {
-		lowest_available = 0;
-		return mmu_first_frame();
+	if (frame == (uintptr_t)-1) {
+		arch_fatal_prepare();
+		dprintf("Failed to allocate %d contiguous frames.\n", n);
+		arch_dump_traceback();
+		arch_fatal();
 	}
 
-	arch_fatal_prepare();
-	dprintf("Out of memory.\n");
-	arch_dump_traceback();
-	arch_fatal();
-	return (uintptr_t)-1;
+	return frame;
+}
+
+/**
+ * @brief Turn the per-core frame caches on or off.
+ *
+ * They start off, since they need this_core; generic_startup turns them
+ * on. Frames already in a cache stay there while they are off.
+ * @returns whether they were on before.
+ */
+int mmu_frame_caches_set(int enabled) {
+	int was = frame_caches_enabled;
+	frame_caches_enabled = enabled;
+	return was;
+}
+
+/* These used to find a free frame for the caller to mmu_frame_set;
+ * what they return now has been allocated already, and setting it
+ * again does nothing. */
+uintptr_t mmu_first_n_frames(int n) {
+	return mmu_allocate_n_frames(n);
+}
+
+uintptr_t mmu_first_frame(void) {
+	return mmu_allocate_a_frame();
 }
 
 void mmu_frame_allocate(union PML * page, unsigned int flags) {
+	int was_present = page->bits.present;
+
 	/* If page is not set... */
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
-		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
-		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
+		page->bits.page = mmu_allocate_a_frame();
 	}
 
 	page->bits.table_page = 1;
 	page->bits.present    = 1;
 
 	page->bits.ap = (!(flags & MMU_FLAG_WRITABLE) ? 2 : 0) | (!(flags & MMU_FLAG_KERNEL) ? 1 : 0);
+	/* A shared frame stays read-only until the write fault copies it */
+	if (page->raw & PTE_COW) {
+		if (page->bits.ap & 2) {
+			page->raw &= ~PTE_COW_WRITE;
+		} else {
+			page->raw |= PTE_COW_WRITE;
+			page->bits.ap |= 2;
+		}
+	}
 	page->bits.af = 1;
 	page->bits.sh = 2;
 	page->bits.attrindx = ((flags & MMU_FLAG_NOCACHE) | (flags & MMU_FLAG_WRITETHROUGH)) ? 0 : 1;
@@ -197,9 +534,18 @@ void mmu_frame_allocate(union PML * page, unsigned int flags) {
 		if ((flags & MMU_FLAG_WC) == MMU_FLAG_WC) {
 			page->bits.attrindx = 2;
 		}
+
+		/* User pages belong to one address space, tag them with its ASID */
+		page->raw |= PTE_NG;
 	}
 
-	asm volatile ("dsb ishst\ntlbi vmalle1is\ndsb ish\nisb" ::: "memory");
+	if (was_present) {
+		/* We don't know the address, so drop everything. */
+		asm volatile ("dsb ishst\ntlbi vmalle1is\ndsb ish\nisb" ::: "memory");
+	} else {
+		/* Invalid entries are never cached, the new one just has to be visible. */
+		asm volatile ("dsb ishst\nisb" ::: "memory");
+	}
 
 	#if 0
 	page->bits.writable = (flags & MMU_FLAG_WRITABLE) ? 1 : 0;
@@ -316,8 +662,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	spin_lock(frame_alloc_lock);
 	if (!root[pml4_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		root[pml4_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -329,8 +674,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	spin_lock(frame_alloc_lock);
 	if (!pdp[pdp_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pdp[pdp_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -347,8 +691,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	spin_lock(frame_alloc_lock);
 	if (!pd[pd_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pd[pd_entry].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -369,15 +712,18 @@ _noentry:
 	return NULL;
 }
 
-static int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t address) {
-	spin_lock(frame_alloc_lock);
-
-	/* TODO cow bits */
+static uint8_t * mmu_frame_refcount(uintptr_t page) {
+	uintptr_t index = page - (ram_starts_at >> PAGE_SHIFT);
+	if (!mem_refcounts || page < (ram_starts_at >> PAGE_SHIFT) || index >= nframes) return NULL;
+	return &mem_refcounts[index];
+}
 
-	char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
-	char * page_out = mmu_map_from_physical(newPage);
+/**
+ * @brief Copy a frame and make the copy visible to instruction fetches.
+ */
+static void mmu_copy_frame(uintptr_t dest, uintptr_t src) {
+	char * page_in = mmu_map_from_physical(src << PAGE_SHIFT);
+	char * page_out = mmu_map_from_physical(dest << PAGE_SHIFT);
 	memcpy(page_out,page_in,PAGE_SIZE);
 	asm volatile ("dmb sy\nisb" ::: "memory");
 
@@ -387,30 +733,222 @@ static int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uint
 	for (uintptr_t x = (uintptr_t)page_out; x < (uintptr_t)page_out + PAGE_SIZE; x += 64) {
 		asm volatile ("ic ivau, %0" :: "r"(x));
 	}
+	asm volatile ("dsb ish\nisb" ::: "memory");
+}
 
-	pt_out[l].raw = 0;
-	pt_out[l].bits.table_page = 1;
-	pt_out[l].bits.present = 1;
-	pt_out[l].bits.ap = pt_in[l].bits.ap;
-	pt_out[l].bits.af = pt_in[l].bits.af;
-	pt_out[l].bits.sh = pt_in[l].bits.sh;
-	pt_out[l].bits.attrindx = pt_in[l].bits.attrindx;
-	pt_out[l].bits.page = newPage >> PAGE_SHIFT;
+/**
+ * @brief Share a user page with a new page table.
+ *
+ * Both mappings become read-only and the frame's reference count goes up;
+ * the first write from either side copies it in @ref mmu_copy_on_write.
+ * The caller holds frame_alloc_lock, and has to flush the TLB before it
+ * lets go of it when @p pt_in was changed.
+ * @returns 1 if the source mapping was made read-only.
+ */
+static int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t address) {
+	uint8_t * ref = mmu_frame_refcount(pt_in[l].bits.page);
+
+	if (!ref || *ref == 255) {
+		/* Can't count another reference, copy it now */
+		uintptr_t newPage = mmu_allocate_a_frame();
+		mmu_copy_frame(newPage, pt_in[l].bits.page);
+
+		pt_out[l].raw = 0;
+		pt_out[l].bits.table_page = 1;
+		pt_out[l].bits.present = 1;
+		pt_out[l].bits.ap = (pt_in[l].raw & PTE_COW_WRITE) ? (pt_in[l].bits.ap & ~2) : pt_in[l].bits.ap;
+		pt_out[l].bits.af = pt_in[l].bits.af;
+		pt_out[l].bits.sh = pt_in[l].bits.sh;
+		pt_out[l].bits.attrindx = pt_in[l].bits.attrindx;
+		pt_out[l].bits.page = newPage;
+		pt_out[l].raw |= pt_in[l].raw & PTE_NG;
+		asm volatile ("" ::: "memory");
+		return 0;
+	}
+
+	/* Read-only pages are marked too, or making them writable later
+	 * would write through to the other owners of the frame. */
+	int downgraded = 0;
+	if (!(pt_in[l].bits.ap & 2)) {
+		pt_in[l].bits.ap |= 2;
+		pt_in[l].raw |= PTE_COW_WRITE;
+		downgraded = 1;
+	}
+	pt_in[l].raw |= PTE_COW;
+	*ref = *ref ? *ref + 1 : 2;
+	pt_out[l].raw = pt_in[l].raw;
 	asm volatile ("" ::: "memory");
+	return downgraded;
+}
 
-	spin_unlock(frame_alloc_lock);
+/**
+ * @brief Drop a page table's reference to a user page, freeing the frame
+ *        with the last one. Called with frame_alloc_lock held.
+ */
+static void free_page_maybe(union PML * pt_in, size_t l) {
+	uint8_t * ref = mmu_frame_refcount(pt_in[l].bits.page);
+
+	if (ref && *ref) {
+		/* Shared; the remaining owner writes it in place after its next fault */
+		*ref = (*ref == 2) ? 0 : *ref - 1;
+		return;
+	}
+	mmu_frame_clear((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
+}
+
+/**
+ * ASID allocation, with generation rollover.
+ *
+ * Every address space gets an ASID the first time it is switched to, and
+ * keeps it while its generation is current. When they run out, the
+ * generation is bumped, the map is cleared except for the ASIDs still
+ * live on some core, and every core flushes its own TLB before it next
+ * picks an ASID. Context switches then don't need any TLB maintenance.
+ */
+static spin_lock_t asid_lock = { 0 };
+static volatile uint64_t asid_generation = ASID_FIRST_GENERATION;
+static uint64_t asid_map[ASID_COUNT / 64] = { 1 }; /* ASID 0 is never given out */
+static uint64_t asid_next = 1;
+/* Context running on each core, 0 while a rollover is forcing it through the slow path */
+static volatile uint64_t asid_active[ASID_MAX_CPUS];
+/* Context each core was running at the last rollover */
+static uint64_t asid_reserved[ASID_MAX_CPUS];
+/* Cores that still need to drop TLB entries from an old generation; start with all */
+static volatile uint32_t asid_flush_pending = 0xFFFFFFFF;
+
+static inline uint64_t asid_context(union PML * pml) {
+	return pml[ASID_SLOT].raw >> 2;
+}
+
+static inline int asid_is_current(uint64_t context) {
+	return !((context ^ asid_generation) >> ASID_BITS);
+}
+
+static inline int asid_test_and_set(uint64_t asid) {
+	uint64_t bit = 1UL << OFFSET_FROM_BIT(asid);
+	int was_set = !!(asid_map[INDEX_FROM_BIT(asid)] & bit);
+	asid_map[INDEX_FROM_BIT(asid)] |= bit;
+	return was_set;
+}
+
+/**
+ * @brief Drop every TLB entry tagged with this address space's ASID, on all cores.
+ *
+ * Uses the ASID number whatever its generation: a core that was running it
+ * through a rollover may still be using it.
+ */
+static void mmu_invalidate_asid(union PML * pml) {
+	uint64_t context = asid_context(pml);
+	if (!context) return;
+	asm volatile ("dsb ishst\ntlbi aside1is, %0\ndsb ish\nisb" :: "r"((context & ASID_MASK) << 48) : "memory");
+}
+
+static void asid_rollover(void) {
+	memset(asid_map, 0, sizeof(asid_map));
+	asid_test_and_set(0);
+
+	for (int i = 0; i < processor_count && i < ASID_MAX_CPUS; ++i) {
+		uint64_t context = __atomic_exchange_n(&asid_active[i], 0, __ATOMIC_RELAXED);
+		/* A core that hasn't switched since the last rollover is still on its reserved one */
+		if (!context) context = asid_reserved[i];
+		asid_test_and_set(context & ASID_MASK);
+		asid_reserved[i] = context;
+	}
+
+	asid_flush_pending = 0xFFFFFFFF;
+}
+
+static uint64_t asid_new_context(uint64_t context) {
+	uint64_t generation = asid_generation;
+
+	if (context) {
+		uint64_t asid = context & ASID_MASK;
+
+		/* Still live on some core from before a rollover: keep it, in the new generation */
+		int reserved = 0;
+		for (int i = 0; i < processor_count && i < ASID_MAX_CPUS; ++i) {
+			if (asid_reserved[i] == context) {
+				asid_reserved[i] = generation | asid;
+				reserved = 1;
+			}
+		}
+		if (reserved) return generation | asid;
+
+		/* Otherwise try to get the same number back */
+		if (!asid_test_and_set(asid)) return generation | asid;
+	}
+
+	for (int pass = 0; pass < 2; ++pass) {
+		for (uint64_t i = 0; i < ASID_COUNT; ++i) {
+			uint64_t asid = (asid_next + i) & ASID_MASK;
+			if (!asid_test_and_set(asid)) {
+				asid_next = asid + 1;
+				return generation | asid;
+			}
+		}
+
+		/* Out of ASIDs; start a new generation. At most one per core stays reserved. */
+		generation += ASID_FIRST_GENERATION;
+		__atomic_store_n(&asid_generation, generation, __ATOMIC_RELAXED);
+		asid_rollover();
+		asid_next = 1;
+	}
+
+	arch_fatal_prepare();
+	dprintf("mmu: no free ASID after rollover\n");
+	arch_dump_traceback();
+	arch_fatal();
 	return 0;
 }
 
+/**
+ * @brief Get the ASID to run @p pml with on this core.
+ *
+ * The fast path only has to check the generation. The compare-exchange
+ * fails if a rollover on another core cleared our active entry meanwhile,
+ * in which case the lock is needed to pick up the new generation.
+ * @p flush is set if this core has to drop its old TLB entries first.
+ */
+static uint64_t asid_switch(union PML * pml, int * flush) {
+	int cpu = this_core->cpu_id;
+	if (cpu >= ASID_MAX_CPUS) {
+		arch_fatal_prepare();
+		dprintf("mmu: core %d has no ASID state, only %d cores are supported\n", cpu, ASID_MAX_CPUS);
+		arch_dump_traceback();
+		arch_fatal();
+	}
+	uint64_t context = asid_context(pml);
+	uint64_t old_active = __atomic_load_n(&asid_active[cpu], __ATOMIC_RELAXED);
+
+	*flush = 0;
+
+	if (old_active && context && asid_is_current(context) &&
+		__atomic_compare_exchange_n(&asid_active[cpu], &old_active, context, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		return context;
+	}
+
+	spin_lock(asid_lock);
+	context = asid_context(pml);
+	if (!context || !asid_is_current(context)) {
+		context = asid_new_context(context);
+		pml[ASID_SLOT].raw = context << 2;
+	}
+	if (asid_flush_pending & (1U << cpu)) {
+		asid_flush_pending &= ~(1U << cpu);
+		*flush = 1;
+	}
+	__atomic_store_n(&asid_active[cpu], context, __ATOMIC_RELAXED);
+	spin_unlock(asid_lock);
+
+	return context;
+}
+
 union PML * mmu_clone(union PML * from) {
 	/* Clone the current PMLs... */
 	if (!from) from = this_core->current_pml;
 
 	/* First get a page for ourselves. */
-	spin_lock(frame_alloc_lock);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 	union PML * pml4_out = mmu_map_from_physical(newPage);
 
 	/* Zero bottom half */
@@ -419,14 +957,14 @@ union PML * mmu_clone(union PML * from) {
 	/* Copy top half */
 	memcpy(&pml4_out[256], &from[256], 256 * sizeof(union PML));
 
+	/* The new address space gets its own ASID when it first runs */
+	pml4_out[ASID_SLOT].raw = 0;
+
 	/* Copy PDPs */
 	for (size_t i = 0; i < 256; ++i) {
 		if (from[i].bits.present) {
 			union PML * pdp_in = mmu_map_from_physical((uintptr_t)from[i].bits.page << PAGE_SHIFT);
-			spin_lock(frame_alloc_lock);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
-			spin_unlock(frame_alloc_lock);
+			uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 			union PML * pdp_out = mmu_map_from_physical(newPage);
 			memset(pdp_out, 0, 512 * sizeof(union PML));
 			pml4_out[i].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -435,10 +973,7 @@ union PML * mmu_clone(union PML * from) {
 			for (size_t j = 0; j < 512; ++j) {
 				if (pdp_in[j].bits.present) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
-					spin_lock(frame_alloc_lock);
-					uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-					mmu_frame_set(newPage);
-					spin_unlock(frame_alloc_lock);
+					uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 					union PML * pd_out = mmu_map_from_physical(newPage);
 					memset(pd_out, 0, 512 * sizeof(union PML));
 					pdp_out[j].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
@@ -447,27 +982,30 @@ union PML * mmu_clone(union PML * from) {
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
-							spin_lock(frame_alloc_lock);
-							uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-							mmu_frame_set(newPage);
-							spin_unlock(frame_alloc_lock);
+							uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 							union PML * pt_out = mmu_map_from_physical(newPage);
 							memset(pt_out, 0, 512 * sizeof(union PML));
 							pd_out[k].raw = (newPage) | PTE_VALID | PTE_TABLE | PTE_AF;
 
-							/* Now, finally, copy pages */
+							/* Now, finally, share pages */
+							int downgraded = 0;
+							spin_lock(frame_alloc_lock);
 							for (size_t l = 0; l < 512; ++l) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
 									if (1) { //pt_in[l].bits.user) {
-										copy_page_maybe(pt_in, pt_out, l, address);
+										downgraded |= copy_page_maybe(pt_in, pt_out, l, address);
 									} else {
 										/* If it's not a user page, just copy directly */
 										pt_out[l].raw = pt_in[l].raw;
 									}
 								} /* Else, mmap'd files? */
 							}
+							/* Other threads of the source may still have these writable in
+							 * their TLBs; that has to stop before the frames are shared. */
+							if (downgraded) mmu_invalidate_asid(from);
+							spin_unlock(frame_alloc_lock);
 						}
 					}
 				}
@@ -478,24 +1016,6 @@ union PML * mmu_clone(union PML * from) {
 	return pml4_out;
 }
 
-uintptr_t mmu_allocate_a_frame(void) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_frame();
-	mmu_frame_set(index << PAGE_SHIFT);
-	spin_unlock(frame_alloc_lock);
-	return index;
-}
-
-uintptr_t mmu_allocate_n_frames(int n) {
-	spin_lock(frame_alloc_lock);
-	uintptr_t index = mmu_first_n_frames(n);
-	for (int i = 0; i < n; ++i) {
-		mmu_frame_set((index+i) << PAGE_SHIFT);
-	}
-	spin_unlock(frame_alloc_lock);
-	return index;
-}
-
 size_t mmu_count_user(union PML * from) {
 	/* We walk 'from' and count user pages */
 	size_t out = 0;
@@ -568,17 +1088,12 @@ size_t mmu_total_memory(void) {
 }
 
 size_t mmu_used_memory(void) {
-	size_t ret = 0;
-	size_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
-		}
+	/* Frames sitting in a core's cache aren't being used for anything */
+	size_t free = frames_free;
+	for (int i = 0; i < processor_count; ++i) {
+		free += frame_caches[i].count;
 	}
-	return ret * 4 - unavailable_memory;
+	return (nframes - free) * 4 - unavailable_memory;
 }
 
 void mmu_free(union PML * from) {
@@ -605,9 +1120,8 @@ void mmu_free(union PML * from) {
 								if (pt_in[l].bits.present) {
 									/* Free only user pages */
 									if (pt_in[l].bits.ap & 1) {
-										mmu_frame_clear((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
+										free_page_maybe(pt_in,l);
 										pt_in[l].raw = 0;
-										//free_page_maybe(pt_in,l,address);
 									}
 								}
 							}
@@ -624,9 +1138,13 @@ void mmu_free(union PML * from) {
 		}
 	}
 
+	/* Its ASID is not handed out again before the next rollover, which flushes everything;
+	 * drop its entries now so they don't take up TLB space until then. */
+	mmu_invalidate_asid(from);
+	from[ASID_SLOT].raw = 0;
+
 	uintptr_t physAddr = (((uintptr_t)from) & PHYS_MASK);
 	mmu_frame_clear(physAddr);
-	asm volatile ("dsb ishst\ntlbi vmalle1is\ndsb ish\nisb" ::: "memory");
 	spin_unlock(frame_alloc_lock);
 }
 
@@ -635,23 +1153,39 @@ union PML * mmu_get_kernel_directory(void) {
 }
 
 void mmu_set_directory(union PML * new_pml) {
-	/* Set the EL0 and EL1 directy things?
-	 *   There are two of these... */
+	/* TTBR1 always has the kernel directory, whose top half every
+	 * directory shares; only the user half changes, in TTBR0, tagged
+	 * with the directory's ASID so nothing has to be flushed. */
 	if (!new_pml) new_pml = mmu_get_kernel_directory();
 	this_core->current_pml = new_pml;
 	uintptr_t pml_phys = mmu_map_to_physical(new_pml, (uintptr_t)new_pml);
 
+	int flush;
+	uint64_t context = asid_switch(new_pml, &flush);
+
+	if (flush) {
+		/* First ASID on this core since a rollover; nothing from before may be used,
+		 * so it has to be gone before the new ASID is live. Walks through the old
+		 * TTBR0 meanwhile only refill the ASID it kept through the rollover. */
+		asm volatile ("dsb nshst\ntlbi vmalle1\ndsb nsh\nisb" ::: "memory");
+	}
+
 	asm volatile (
 		"msr TTBR0_EL1,%0\n"
-		"msr TTBR1_EL1,%0\n"
-		"isb sy\n"
-		"dsb ishst\n"
-		"tlbi vmalle1is\n"
-		"dsb ish\n"
-		"isb\n" :: "r"(pml_phys) : "memory");
+		"isb\n" :: "r"(pml_phys | ((context & ASID_MASK) << 48)) : "memory");
 }
 
 void mmu_invalidate(uintptr_t addr) {
+	/* TLBI takes VA[55:12] in bits 43:0 */
+	uint64_t va = (addr >> PAGE_SHIFT) & ((1UL << 44) - 1);
+	if (addr < 0x800000000000) {
+		/* User page in the current directory, only the entry for our ASID */
+		uint64_t ttbr0;
+		asm volatile ("mrs %0, TTBR0_EL1" : "=r"(ttbr0));
+		asm volatile ("dsb ishst\ntlbi vae1is, %0\ndsb ish\nisb" :: "r"((ttbr0 & (ASID_MASK << 48)) | va) : "memory");
+	} else {
+		asm volatile ("dsb ishst\ntlbi vaae1is, %0\ndsb ish\nisb" :: "r"(va) : "memory");
+	}
 }
 
 int mmu_get_page_deep(uintptr_t virtAddr, union PML ** pml4_out, union PML ** pdp_out, union PML ** pd_out, union PML ** pt_out) {
@@ -719,9 +1253,10 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 		/* Free this page if it was present */
 		if (pt && pt->bits.present) {
 			if (pt->bits.ap & 1) {
-				mmu_frame_clear((uintptr_t)pt->bits.page << PAGE_SHIFT);
+				free_page_maybe(pt, 0);
 				pt->bits.present = 0;
 				pt->bits.ap = 0;
+				pt->raw &= ~(PTE_COW | PTE_COW_WRITE);
 			}
 
 			if (maybe_release_directory(pd, pt)) {
@@ -817,9 +1352,55 @@ void * mmu_map_module(size_t size) {
 void mmu_unmap_module(uintptr_t start_address, size_t size) {
 }
 
+/**
+ * @brief Resolve a write to a copy-on-write page.
+ *
+ * Copies the frame if it is still shared, otherwise just makes the
+ * page writable again. Returns 0 if the write can be retried, 1 if
+ * the page isn't copy-on-write or wasn't writable to begin with.
+ */
 int mmu_copy_on_write(uintptr_t address) {
-	
-	return 1;
+	union PML * page = mmu_get_page(address, 0);
+	if (!page || !page->bits.present || !(page->raw & PTE_COW)) return 1;
+
+	spin_lock(frame_alloc_lock);
+
+	/* Another thread may have resolved it while we were waiting. */
+	if (!(page->raw & PTE_COW)) {
+		spin_unlock(frame_alloc_lock);
+		return 0;
+	}
+
+	/* Shared but read-only in its own right: a real protection fault */
+	if (!(page->raw & PTE_COW_WRITE)) {
+		spin_unlock(frame_alloc_lock);
+		return 1;
+	}
+
+	union PML entry = *page;
+	entry.raw &= ~(PTE_COW | PTE_COW_WRITE);
+	entry.bits.ap &= ~2;
+
+	uint8_t * ref = mmu_frame_refcount(page->bits.page);
+	if (ref && *ref > 1) {
+		uintptr_t fresh_frame = mmu_allocate_a_frame();
+		mmu_copy_frame(fresh_frame, page->bits.page);
+		*ref = (*ref == 2) ? 0 : *ref - 1;
+		entry.bits.page = fresh_frame;
+
+		/* Break before make: the old translation must be gone before the new one appears */
+		page->raw = 0;
+		mmu_invalidate(address);
+		page->raw = entry.raw;
+		asm volatile ("dsb ishst\nisb" ::: "memory");
+	} else {
+		if (ref) *ref = 0;
+		page->raw = entry.raw;
+		mmu_invalidate(address);
+	}
+
+	spin_unlock(frame_alloc_lock);
+	return 0;
 }
 
 int mmu_validate_user_pointer(void * addr, size_t size, int flags) {
@@ -847,8 +1428,7 @@ int mmu_validate_user_pointer(void * addr, size_t size, int flags) {
 			return 0;
 		}
 		if ((page_entry->bits.ap & 2) && (flags & MMU_PTR_WRITE)) {
-			return 0;
-			//if (mmu_copy_on_write((uintptr_t)(page << 12))) return 0;
+			if (mmu_copy_on_write((uintptr_t)(page << 12))) return 0;
 		}
 	}
 
@@ -916,16 +1496,39 @@ void mmu_init(uintptr_t memaddr, size_t memsize, uintptr_t firstFreePage, uintpt
 	 * I can't be bothered to think of anything better right now... */
 	ram_starts_at = memaddr;
 	nframes = (memsize) >> 12;
-	size_t bytesOfFrames = INDEX_FROM_BIT(nframes * 8);
+	size_t bytesOfFrames = INDEX_FROM_BIT(nframes + 63) * sizeof(uint64_t);
 	bytesOfFrames = (bytesOfFrames + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
 
 	/* TODO we should figure out where the DTB ends on virt, as that's where we can
 	 *      start doing this... */
 	size_t pagesOfFrames = bytesOfFrames >> 12;
 
+	/* Copy-on-write reference counts go right after the bitmap, then the buddy orders */
+	size_t bytesOfRefcounts = (nframes + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
+	size_t bytesOfOrders = bytesOfRefcounts;
+	size_t bytesOfTables = bytesOfFrames + bytesOfRefcounts + bytesOfOrders;
+	size_t pagesOfTables = bytesOfTables >> 12;
+
+	/* The static tables cover 6MiB of that; past it (more than ~11GiB of RAM),
+	 * take more tables from the frames right after the metadata. */
+	size_t tablesNeeded = (pagesOfTables + 511) / 512;
+	size_t extraTables  = tablesNeeded > 3 ? tablesNeeded - 3 : 0;
+	if (tablesNeeded > 512) {
+		arch_fatal_prepare();
+		printf("mmu_init: %zu MiB of memory is more than the frame allocator can map.\n", memsize >> 20);
+		arch_fatal();
+	}
+	for (size_t k = 0; k < extraTables; ++k) {
+		uintptr_t table = firstFreePage + bytesOfTables + (k << 12);
+		memset(mmu_map_from_physical(table), 0, PAGE_SIZE);
+		heap_base_pd[3+k].raw = table | PTE_VALID | PTE_TABLE | PTE_AF;
+	}
+
 	/* Map pages for it... */
-	for (size_t i = 0; i < pagesOfFrames; ++i) {
-		heap_base_pt[i].raw = (firstFreePage + (i << 12)) | PTE_VALID | PTE_AF | PTE_SH_A | PTE_TABLE | (1 << 2);
+	for (size_t i = 0; i < pagesOfTables; ++i) {
+		union PML * pt = (i >> 9) < 3 ? &heap_base_pt[(i >> 9) << 9] :
+			mmu_map_from_physical(firstFreePage + bytesOfTables + (((i >> 9) - 3) << 12));
+		pt[i & 511].raw = (firstFreePage + (i << 12)) | PTE_VALID | PTE_AF | PTE_SH_A | PTE_TABLE | (1 << 2);
 	}
 
 	asm volatile ("dsb ishst\ntlbi vmalle1is\ndsb ish\nisb" ::: "memory");
@@ -934,8 +1537,14 @@ void mmu_init(uintptr_t memaddr, size_t memsize, uintptr_t firstFreePage, uintpt
 	frames = (void*)((uintptr_t)KERNEL_HEAP_START);
 	memset((void*)frames, 0x00, bytesOfFrames);
 
+	mem_refcounts = (void*)((uintptr_t)KERNEL_HEAP_START + (pagesOfFrames << 12));
+	memset(mem_refcounts, 0x00, bytesOfRefcounts);
+
+	frame_orders = (void*)((uintptr_t)mem_refcounts + bytesOfRefcounts);
+	memset(frame_orders, FRAME_NOT_FREE, bytesOfOrders);
+
 	/* Set frames as in use... */
-	for (uintptr_t i = memaddr; i < firstFreePage + bytesOfFrames; i+= PAGE_SIZE) {
+	for (uintptr_t i = memaddr; i < firstFreePage + bytesOfTables + (extraTables << 12); i+= PAGE_SIZE) {
 		mmu_frame_set(i);
 	}
 
@@ -944,9 +1553,22 @@ void mmu_init(uintptr_t memaddr, size_t memsize, uintptr_t firstFreePage, uintpt
 		mmu_frame_set(aarch64_kernel_phys_base + i);
 	}
 
-	heapStart = (char*)KERNEL_HEAP_START + bytesOfFrames;
+	/* Everything else goes to the buddy allocator, in runs of clear bits */
+	spin_lock(zone_lock);
+	for (uintptr_t i = 0; i < nframes; ) {
+		if (frame_test(i)) {
+			i++;
+			continue;
+		}
+		uintptr_t end = i;
+		while (end < nframes && !frame_test(end)) end++;
+		buddy_free_range(i, end);
+		i = end;
+	}
+	spin_unlock(zone_lock);
+
+	heapStart = (char*)KERNEL_HEAP_START + bytesOfTables;
 
-	lowest_available = (firstFreePage + bytesOfFrames) - memaddr;
 	module_base_address = endOfRamDisk + MODULE_BASE_START;
 	if (module_base_address & PAGE_LOW_MASK) {
 		module_base_address = (module_base_address & PAGE_SIZE_MASK) + PAGE_SIZE;
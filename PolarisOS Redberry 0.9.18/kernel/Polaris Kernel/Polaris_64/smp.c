@@ -18,11 +18,15 @@
 
 #include <kernel/arch/aarch64/regs.h>
 #include <kernel/arch/aarch64/dtb.h>
+#include <kernel/arch/aarch64/gic.h>
 
 extern process_t * spawn_kidle(int);
 extern void timer_start(void);
 extern void aarch64_processor_data(void);
 
+/* Cores with per-core state: processor_local_data, the frame caches and ASIDs */
+#define SMP_MAX_CPUS 32
+
 static uint32_t cpu_on = 0;
 static int method = 0;
 
@@ -39,6 +43,10 @@ volatile uintptr_t aarch64_stack      = 0;
 
 void ap_start(uint64_t core_id) {
 
+	/* Before anything that might memcpy, which can use NEON by now */
+	extern void fpu_enable(void);
+	fpu_enable();
+
 	dprintf("smp: core %zu is online\n", core_id);
 
 	extern void arch_set_core_base(uintptr_t base);
@@ -46,9 +54,6 @@ void ap_start(uint64_t core_id) {
 
 	this_core->cpu_id = core_id;
 
-	extern void fpu_enable(void);
-	fpu_enable();
-
 	aarch64_processor_data();
 
 	this_core->current_pml = mmu_get_kernel_directory();
@@ -107,6 +112,10 @@ static void start_cpu(uint32_t * node) {
 	uint32_t num = swizzle(cpuid[2]);
 	dprintf("smp: cpu node %d %#zx '%s'\n", num, (uintptr_t)node, (char *)(node));
 	if (num == 0) return;
+	if (num >= SMP_MAX_CPUS) {
+		dprintf("smp: cpu %d not started, only %d cores are supported\n", num, SMP_MAX_CPUS);
+		return;
+	}
 
 	if (method == 0x637668) {
 		_smp_mutex = 0;
@@ -259,3 +268,20 @@ void rpi_smp_init(void) {
 		processor_count = i + 1;
 	}
 }
+
+/**
+ * @brief Wake up all other cores so idle ones can look for work.
+ *
+ * SGI 1 makes a core that was waiting in its idle task reschedule;
+ * it's ignored by cores that are busy.
+ */
+void arch_wakeup_others(void) {
+	gic_send_sgi(1, -1);
+}
+
+/**
+ * @brief Wake up one core, which may be this one, to look at its ready queue.
+ */
+void arch_wakeup_core(int core) {
+	gic_send_sgi(1, core);
+}
@@ -0,0 +1,377 @@
+/**
+ * @file  kernel/arch/aarch64/string.c
+ * @brief NEON versions of memcpy, memmove and memset.
+ *
+ * aarch64_string_select installs these over the generic ones from
+ * kernel/misc/string.c once the FPU is on. Anything shorter than
+ * NEON_MIN bytes is moved with general registers, in overlapping
+ * loads and stores so there are no byte loops. Longer runs bring the
+ * destination up to a 16 byte boundary and then move 64 bytes at a
+ * time with ldp/stp of Q registers. Copies of NONTEMPORAL_MIN bytes
+ * or more use stnp, so they don't push everything else out of the
+ * caches. Zeroing with memset uses dc zva over whole zeroing blocks.
+ *
+ * The kernel doesn't save userspace's vector registers when it is
+ * entered, only when it switches tasks, so the ones used here are
+ * saved on the stack first and put back before returning.
+ *
+ * Copies go strictly from low to high addresses or strictly from high
+ * to low, so memmove uses the same code as memcpy whenever the
+ * destination is below the source.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+
+#define NEON_MIN        128
+#define NONTEMPORAL_MIN (512 * 1024)
+#define ZVA_MIN         256
+
+typedef uint64_t __attribute__((aligned(1), may_alias)) u64_u;
+typedef uint32_t __attribute__((aligned(1), may_alias)) u32_u;
+typedef uint16_t __attribute__((aligned(1), may_alias)) u16_u;
+
+static size_t zva_size = 0; /* Bytes zeroed by one dc zva, 0 if we can't use it */
+
+struct neon_state {
+	uint64_t q[8];
+} __attribute__((aligned(16)));
+
+static inline void neon_save(struct neon_state * state) {
+	asm volatile (
+		"stp q0, q1, [%0]\n"
+		"stp q2, q3, [%0, #32]\n"
+		:: "r"(state) : "memory");
+}
+
+static inline void neon_restore(struct neon_state * state) {
+	asm volatile (
+		"ldp q0, q1, [%0]\n"
+		"ldp q2, q3, [%0, #32]\n"
+		:: "r"(state) : "v0", "v1", "v2", "v3", "memory");
+}
+
+/**
+ * @brief Copy @p blocks 64 byte blocks upwards. @p d should be 16 byte aligned.
+ */
+static inline void neon_copy_forward(char * d, const char * s, size_t blocks) {
+	asm volatile (
+		"1:\n"
+		"ldp q0, q1, [%1]\n"
+		"ldp q2, q3, [%1, #32]\n"
+		"add %1, %1, #64\n"
+		"stp q0, q1, [%0]\n"
+		"stp q2, q3, [%0, #32]\n"
+		"add %0, %0, #64\n"
+		"subs %2, %2, #1\n"
+		"b.ne 1b\n"
+		: "+r"(d), "+r"(s), "+r"(blocks) :: "v0", "v1", "v2", "v3", "cc", "memory");
+}
+
+/**
+ * @brief Same, with non-temporal stores. Only for buffers that don't overlap.
+ */
+static inline void neon_copy_forward_nt(char * d, const char * s, size_t blocks) {
+	asm volatile (
+		"1:\n"
+		"ldp q0, q1, [%1]\n"
+		"ldp q2, q3, [%1, #32]\n"
+		"add %1, %1, #64\n"
+		"stnp q0, q1, [%0]\n"
+		"stnp q2, q3, [%0, #32]\n"
+		"add %0, %0, #64\n"
+		"subs %2, %2, #1\n"
+		"b.ne 1b\n"
+		: "+r"(d), "+r"(s), "+r"(blocks) :: "v0", "v1", "v2", "v3", "cc", "memory");
+}
+
+/**
+ * @brief Copy @p blocks 64 byte blocks downwards, from just below the end pointers.
+ */
+static inline void neon_copy_backward(char * d_end, const char * s_end, size_t blocks) {
+	asm volatile (
+		"1:\n"
+		"ldp q2, q3, [%1, #-32]\n"
+		"ldp q0, q1, [%1, #-64]!\n"
+		"stp q2, q3, [%0, #-32]\n"
+		"stp q0, q1, [%0, #-64]!\n"
+		"subs %2, %2, #1\n"
+		"b.ne 1b\n"
+		: "+r"(d_end), "+r"(s_end), "+r"(blocks) :: "v0", "v1", "v2", "v3", "cc", "memory");
+}
+
+/**
+ * @brief Fill @p blocks 64 byte blocks with @p v. @p d should be 16 byte aligned.
+ */
+static inline void neon_set(char * d, uint64_t v, size_t blocks) {
+	asm volatile (
+		"dup v0.2d, %2\n"
+		"1:\n"
+		"stp q0, q0, [%0]\n"
+		"stp q0, q0, [%0, #32]\n"
+		"add %0, %0, #64\n"
+		"subs %1, %1, #1\n"
+		"b.ne 1b\n"
+		: "+r"(d), "+r"(blocks) : "r"(v) : "v0", "cc", "memory");
+}
+
+static inline void neon_set_nt(char * d, uint64_t v, size_t blocks) {
+	asm volatile (
+		"dup v0.2d, %2\n"
+		"1:\n"
+		"stnp q0, q0, [%0]\n"
+		"stnp q0, q0, [%0, #32]\n"
+		"add %0, %0, #64\n"
+		"subs %1, %1, #1\n"
+		"b.ne 1b\n"
+		: "+r"(d), "+r"(blocks) : "r"(v) : "v0", "cc", "memory");
+}
+
+/**
+ * @brief Zero @p blocks zeroing blocks. @p d should be aligned to zva_size.
+ */
+static inline void zva_zero(char * d, size_t blocks) {
+	asm volatile (
+		"1:\n"
+		"dc zva, %0\n"
+		"add %0, %0, %2\n"
+		"subs %1, %1, #1\n"
+		"b.ne 1b\n"
+		: "+r"(d), "+r"(blocks) : "r"(zva_size) : "cc", "memory");
+}
+
+/**
+ * @brief Copy up to 32 bytes. Everything is loaded before anything is stored, so any overlap is fine.
+ */
+static inline void copy_small(char * d, const char * s, size_t n) {
+	if (n >= 16) {
+		uint64_t a = *(u64_u *)s;
+		uint64_t b = *(u64_u *)(s + 8);
+		uint64_t y = *(u64_u *)(s + n - 16);
+		uint64_t z = *(u64_u *)(s + n - 8);
+		*(u64_u *)d = a;
+		*(u64_u *)(d + 8) = b;
+		*(u64_u *)(d + n - 16) = y;
+		*(u64_u *)(d + n - 8) = z;
+	} else if (n >= 8) {
+		uint64_t a = *(u64_u *)s;
+		uint64_t z = *(u64_u *)(s + n - 8);
+		*(u64_u *)d = a;
+		*(u64_u *)(d + n - 8) = z;
+	} else if (n >= 4) {
+		uint32_t a = *(u32_u *)s;
+		uint32_t z = *(u32_u *)(s + n - 4);
+		*(u32_u *)d = a;
+		*(u32_u *)(d + n - 4) = z;
+	} else if (n) {
+		char a = s[0], b = s[n / 2], z = s[n - 1];
+		d[0] = a;
+		d[n / 2] = b;
+		d[n - 1] = z;
+	}
+}
+
+static inline void copy_forward_words(char * d, const char * s, size_t n) {
+	for (; n > 32; n -= 32, d += 32, s += 32) {
+		uint64_t a = *(u64_u *)s;
+		uint64_t b = *(u64_u *)(s + 8);
+		uint64_t c = *(u64_u *)(s + 16);
+		uint64_t e = *(u64_u *)(s + 24);
+		*(u64_u *)d = a;
+		*(u64_u *)(d + 8) = b;
+		*(u64_u *)(d + 16) = c;
+		*(u64_u *)(d + 24) = e;
+	}
+	copy_small(d, s, n);
+}
+
+static inline void copy_backward_words(char * d, const char * s, size_t n) {
+	for (; n > 32; n -= 32) {
+		uint64_t a = *(u64_u *)(s + n - 32);
+		uint64_t b = *(u64_u *)(s + n - 24);
+		uint64_t c = *(u64_u *)(s + n - 16);
+		uint64_t e = *(u64_u *)(s + n - 8);
+		*(u64_u *)(d + n - 32) = a;
+		*(u64_u *)(d + n - 24) = b;
+		*(u64_u *)(d + n - 16) = c;
+		*(u64_u *)(d + n - 8) = e;
+	}
+	copy_small(d, s, n);
+}
+
+static void copy_forward(char * d, const char * s, size_t n, int nontemporal) {
+	if (n < NEON_MIN) {
+		copy_forward_words(d, s, n);
+		return;
+	}
+
+	/* Bring d up to a 16 byte boundary, smallest step first */
+	size_t head = -(uintptr_t)d & 15;
+	if (head & 1) { *d = *s; d += 1; s += 1; }
+	if (head & 2) { *(u16_u *)d = *(u16_u *)s; d += 2; s += 2; }
+	if (head & 4) { *(u32_u *)d = *(u32_u *)s; d += 4; s += 4; }
+	if (head & 8) { *(u64_u *)d = *(u64_u *)s; d += 8; s += 8; }
+	n -= head;
+
+	struct neon_state state;
+	neon_save(&state);
+	if (nontemporal) {
+		neon_copy_forward_nt(d, s, n / 64);
+	} else {
+		neon_copy_forward(d, s, n / 64);
+	}
+	neon_restore(&state);
+
+	size_t done = n & ~63UL;
+	copy_forward_words(d + done, s + done, n - done);
+}
+
+static void copy_backward(char * d, const char * s, size_t n) {
+	if (n < NEON_MIN) {
+		copy_backward_words(d, s, n);
+		return;
+	}
+
+	/* Bring the end of d down to a 16 byte boundary, smallest step first */
+	char * d_end = d + n;
+	const char * s_end = s + n;
+	size_t tail = (uintptr_t)d_end & 15;
+	if (tail & 1) { d_end -= 1; s_end -= 1; *d_end = *s_end; }
+	if (tail & 2) { d_end -= 2; s_end -= 2; *(u16_u *)d_end = *(u16_u *)s_end; }
+	if (tail & 4) { d_end -= 4; s_end -= 4; *(u32_u *)d_end = *(u32_u *)s_end; }
+	if (tail & 8) { d_end -= 8; s_end -= 8; *(u64_u *)d_end = *(u64_u *)s_end; }
+	n -= tail;
+
+	struct neon_state state;
+	neon_save(&state);
+	neon_copy_backward(d_end, s_end, n / 64);
+	neon_restore(&state);
+
+	copy_backward_words(d, s, n & 63);
+}
+
+void * aarch64_memcpy(void * restrict dest, const void * restrict src, size_t n) {
+	if (n <= 32) {
+		copy_small(dest, src, n);
+	} else {
+		copy_forward(dest, src, n, n >= NONTEMPORAL_MIN);
+	}
+	return dest;
+}
+
+void * aarch64_memmove(void * dest, const void * src, size_t n) {
+	if (n <= 32) {
+		copy_small(dest, src, n);
+	} else if ((uintptr_t)dest - (uintptr_t)src >= n) {
+		/* dest is below src, or they don't overlap at all */
+		copy_forward(dest, src, n, 0);
+	} else {
+		copy_backward(dest, src, n);
+	}
+	return dest;
+}
+
+void * aarch64_memset(void * dest, int c, size_t n) {
+	char * d = dest;
+	uint64_t v = (uint8_t)c * 0x0101010101010101UL;
+
+	if (n <= 16) {
+		if (n >= 8) {
+			*(u64_u *)d = v;
+			*(u64_u *)(d + n - 8) = v;
+		} else if (n >= 4) {
+			*(u32_u *)d = v;
+			*(u32_u *)(d + n - 4) = v;
+		} else if (n) {
+			d[0] = c;
+			d[n / 2] = c;
+			d[n - 1] = c;
+		}
+		return dest;
+	}
+
+	/* Stores can overlap freely, so the ends are always done as whole words */
+	*(u64_u *)d = v;
+	*(u64_u *)(d + 8) = v;
+	*(u64_u *)(d + n - 16) = v;
+	*(u64_u *)(d + n - 8) = v;
+	if (n <= 32) return dest;
+
+	if (n < NEON_MIN) {
+		for (size_t i = 16; i < n - 16; i += 16) {
+			*(u64_u *)(d + i) = v;
+			*(u64_u *)(d + i + 8) = v;
+		}
+		return dest;
+	}
+
+	char * end = d + n;
+
+	if (!v && zva_size && n >= ZVA_MIN && n >= 2 * zva_size) {
+		char * first = (char *)(((uintptr_t)d + zva_size - 1) & ~(zva_size - 1));
+		char * last  = (char *)((uintptr_t)end & ~(zva_size - 1));
+		aarch64_memset(d, 0, first - d);
+		zva_zero(first, (last - first) / zva_size);
+		aarch64_memset(last, 0, end - last);
+		return dest;
+	}
+
+	/* The first 16 bytes are done, start from the next boundary */
+	char * p = (char *)(((uintptr_t)d + 16) & ~15UL);
+	size_t blocks = (end - p) / 64;
+
+	struct neon_state state;
+	neon_save(&state);
+	if (n >= NONTEMPORAL_MIN) {
+		neon_set_nt(p, v, blocks);
+	} else {
+		neon_set(p, v, blocks);
+	}
+	neon_restore(&state);
+
+	for (p += blocks * 64; p < end - 16; p += 16) {
+		*(u64_u *)p = v;
+		*(u64_u *)(p + 8) = v;
+	}
+
+	return dest;
+}
+
+/**
+ * @brief Switch memcpy, memmove and memset over to the versions above, if we can.
+ *
+ * Needs the FPU on, so this is called right after fpu_enable on the
+ * boot core. Everything before that used the generic versions.
+ */
+void aarch64_string_select(void) {
+	extern void * (*memcpy_impl)(void * restrict dest, const void * restrict src, size_t n);
+	extern void * (*memmove_impl)(void * dest, const void * src, size_t n);
+	extern void * (*memset_impl)(void * dest, int c, size_t n);
+
+	uint64_t pfr0;
+	asm volatile ("mrs %0, ID_AA64PFR0_EL1" : "=r"(pfr0));
+	if (((pfr0 >> 20) & 0xF) == 0xF) {
+		dprintf("string: no Advanced SIMD, using generic string functions\n");
+		return;
+	}
+
+	/* DCZID_EL0: bit 4 prohibits dc zva, bits 3:0 are log2 of the block size in words */
+	uint64_t dczid;
+	asm volatile ("mrs %0, DCZID_EL0" : "=r"(dczid));
+	zva_size = (dczid & (1 << 4)) ? 0 : (4UL << (dczid & 0xF));
+
+	memcpy_impl  = aarch64_memcpy;
+	memmove_impl = aarch64_memmove;
+	memset_impl  = aarch64_memset;
+
+	if (zva_size) {
+		dprintf("string: using NEON string functions, zeroing %zu byte blocks with dc zva\n", zva_size);
+	} else {
+		dprintf("string: using NEON string functions, dc zva not available\n");
+	}
+}
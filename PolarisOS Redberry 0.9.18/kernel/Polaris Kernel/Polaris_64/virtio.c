@@ -101,6 +101,19 @@ struct virtio_input_event {
 	uint32_t value;
 };
 
+/**
+ * @brief Zero a freshly mapped queue page.
+ *
+ * The page is mapped as device memory, which takes neither the dc zva
+ * nor the unaligned stores memset uses, so it is cleared a word at a time.
+ */
+static void virtio_queue_zero(struct virtio_queue * queue) {
+	volatile uint64_t * words = (volatile uint64_t *)queue;
+	for (size_t i = 0; i < 4096 / sizeof(uint64_t); ++i) {
+		words[i] = 0;
+	}
+}
+
 int virtio_tablet_responder(process_t * this, int irq, void * data) {
 	uint8_t cause = *(volatile uint8_t *)data;
 	if (cause == 1) {
@@ -179,7 +192,7 @@ static void virtio_tablet_thread(void * data) {
 	size_t queue_phys = mmu_allocate_a_frame() << 12;
 	struct virtio_queue * queue = mmu_map_mmio_region(queue_phys, 4096);
 	asm volatile ("isb" ::: "memory");
-	memset(queue, 0, sizeof(struct virtio_queue));
+	virtio_queue_zero(queue);
 	asm volatile ("isb" ::: "memory");
 
 	common->queue_select = 0;
@@ -335,7 +348,7 @@ static void virtio_keyboard_thread(void * data) {
 	size_t queue_phys = mmu_allocate_a_frame() << 12;
 	struct virtio_queue * queue = mmu_map_mmio_region(queue_phys, 4096);
 	asm volatile ("isb" ::: "memory");
-	memset(queue, 0, sizeof(struct virtio_queue));
+	virtio_queue_zero(queue);
 	asm volatile ("isb" ::: "memory");
 
 	common->queue_select = 0;
@@ -33,8 +33,15 @@ extern void snd_install(void);
 extern void net_install(void);
 extern void console_initialize(void);
 extern void modules_install(void);
+extern void malloc_caches_initialize(void);
+extern void malloc_benchmark(void);
+extern int mmu_frame_caches_set(int enabled);
+extern void frame_benchmark(void);
+extern void string_benchmark(void);
 
 void generic_startup(void) {
+	malloc_caches_initialize();
+	mmu_frame_caches_set(1);
 	args_parse(arch_get_cmdline());
 	initialize_process_tree();
 	shm_install();
@@ -54,6 +61,18 @@ void generic_startup(void) {
 }
 
 int generic_main(void) {
+	if (args_present("mallocbench")) {
+		malloc_benchmark();
+	}
+
+	if (args_present("framebench")) {
+		frame_benchmark();
+	}
+
+	if (args_present("stringbench")) {
+		string_benchmark();
+	}
+
 	if (args_present("root")) {
 		const char * root_type = "tar";
 		if (args_present("root_type")) {
@@ -0,0 +1,267 @@
+/**
+ * @file  kernel/misc/framebench.c
+ * @brief Physical frame allocator self-test and throughput benchmark.
+ *
+ * Boot with "framebench" on the command line to run this before init
+ * starts. Memory is first filled until only a few percent is left, then
+ * every sixteenth of those frames is released again, so what the
+ * allocator has to work with is mostly single frames scattered over all
+ * of RAM. Worker threads (up to four, one per core) then allocate and
+ * release single frames as fast as they can, keeping a few dozen each and
+ * passing some to each other so they are released on a different core
+ * than they came from. Each run is done with 1 to 4 workers, first with
+ * the per-core frame caches turned off so everything takes zone_lock,
+ * then with them on. Last, one thread allocates and releases contiguous
+ * runs of 1 to 256 frames in the same mostly full memory.
+ *
+ * Every frame carries a tag in its first word that is checked before it
+ * is released, and the used memory is compared before and after, so a
+ * frame handed out twice or lost along the way shows up at the end.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdint.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
+#include <kernel/list.h>
+#include <kernel/misc.h>
+#include <kernel/mmu.h>
+
+#define BENCH_THREADS  4
+#define BENCH_LIVE     64		/* Frames each worker holds at a time */
+#define BENCH_EXCHANGE 16		/* Slots for passing frames between workers */
+#define BENCH_MS       500		/* Length of each run */
+#define BENCH_FILL     97		/* Percent of memory to fill before releasing some */
+#define BENCH_SPREAD   16		/* ... and then one in this many of those is released */
+
+static spin_lock_t bench_lock = { 0 };
+static list_t * bench_start;	/* Workers waiting for the next run */
+static list_t * bench_done;		/* The benchmark waiting for a run to finish */
+static int bench_round = 0;
+static int bench_threads = 0;
+static int bench_finished = 0;
+static int bench_exit = 0;
+static int bench_exited = 0;
+
+static uintptr_t bench_exchange[BENCH_EXCHANGE];
+static uint64_t bench_ops[BENCH_THREADS];
+static uint64_t bench_errors = 0;
+
+static inline uintptr_t * frame_word(uintptr_t frame) {
+	return mmu_map_from_physical(frame << 12);
+}
+
+static void bench_worker(void * arg) {
+	int id = (uintptr_t)arg;
+	int seen = 0;
+	uint32_t seed = 2463534242U + id;
+	uint64_t counter = 0;
+	uintptr_t live[BENCH_LIVE] = {0};
+	uint64_t tags[BENCH_LIVE];
+
+	while (1) {
+		spin_lock(bench_lock);
+		while (bench_round == seen && !bench_exit) {
+			sleep_on_unlocking(bench_start, &bench_lock);
+			spin_lock(bench_lock);
+		}
+		seen = bench_round;
+		int run = !bench_exit && id < bench_threads;
+		int done = bench_exit;
+		spin_unlock(bench_lock);
+
+		if (done) break;
+		if (!run) continue;
+
+		uint64_t ops = 0;
+		uint64_t errors = 0;
+		uint64_t end = arch_perf_timer() + BENCH_MS * 1000UL * arch_cpu_mhz();
+
+		while (arch_perf_timer() < end) {
+			for (int i = 0; i < 256; ++i) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+
+				int slot = seed % BENCH_LIVE;
+				if (live[slot]) {
+					if (*frame_word(live[slot]) != tags[slot]) errors++;
+					if (!(seed & 15)) {
+						/* Trade with whoever used this slot last, we release what they left */
+						uintptr_t other = __sync_lock_test_and_set(&bench_exchange[(seed >> 4) % BENCH_EXCHANGE], live[slot]);
+						if (other) mmu_frame_release(other << 12);
+					} else {
+						mmu_frame_release(live[slot] << 12);
+					}
+				}
+
+				live[slot] = mmu_allocate_a_frame();
+				tags[slot] = ((uint64_t)id << 48) | ++counter;
+				*frame_word(live[slot]) = tags[slot];
+				ops++;
+			}
+		}
+
+		bench_ops[id] = ops;
+		__sync_add_and_fetch(&bench_errors, errors);
+
+		spin_lock(bench_lock);
+		bench_finished++;
+		spin_unlock(bench_lock);
+		wakeup_queue(bench_done);
+	}
+
+	for (int i = 0; i < BENCH_LIVE; ++i) {
+		if (live[i]) mmu_frame_release(live[i] << 12);
+	}
+
+	spin_lock(bench_lock);
+	bench_exited++;
+	spin_unlock(bench_lock);
+	wakeup_queue(bench_done);
+
+	task_exit(0);
+}
+
+/**
+ * Fill memory, chaining the frames through their first words.
+ * Then release every BENCH_SPREAD'th one. Returns the chain.
+ */
+static uintptr_t bench_fill(size_t * filled, size_t * released) {
+	uintptr_t head = 0;
+	size_t limit = mmu_total_memory() / 100 * BENCH_FILL;
+
+	*filled = 0;
+	while (mmu_used_memory() < limit) {
+		uintptr_t frame = mmu_allocate_a_frame();
+		*frame_word(frame) = head;
+		head = frame;
+		(*filled)++;
+	}
+
+	*released = 0;
+	uintptr_t * link = &head;
+	size_t n = 0;
+	while (*link) {
+		uintptr_t frame = *link;
+		if (++n % BENCH_SPREAD == 0) {
+			*link = *frame_word(frame);
+			mmu_frame_release(frame << 12);
+			(*released)++;
+		} else {
+			link = frame_word(frame);
+		}
+	}
+
+	return head;
+}
+
+/**
+ * Allocate and release runs of @p n contiguous frames for a while, returns runs per second.
+ */
+static uint64_t bench_contiguous(int n) {
+	uint64_t runs = 0;
+	uint64_t end = arch_perf_timer() + BENCH_MS * 1000UL * arch_cpu_mhz();
+
+	while (arch_perf_timer() < end) {
+		uintptr_t first = mmu_allocate_n_frames(n);
+		for (int i = 0; i < n; ++i) {
+			if (!mmu_frame_test((first + i) << 12)) bench_errors++;
+			mmu_frame_release((first + i) << 12);
+		}
+		runs++;
+	}
+
+	return runs * 1000 / BENCH_MS;
+}
+
+/**
+ * @brief Run the frame allocator benchmark, returns when all runs are done.
+ */
+void frame_benchmark(void) {
+	extern int mmu_frame_caches_set(int enabled);
+
+	int workers = processor_count < BENCH_THREADS ? processor_count : BENCH_THREADS;
+
+	bench_start = list_create("framebench start", NULL);
+	bench_done  = list_create("framebench done", NULL);
+
+	for (int i = 0; i < workers; ++i) {
+		spawn_worker_thread(bench_worker, "[framebench]", (void *)(uintptr_t)i);
+	}
+
+	size_t used_before = mmu_used_memory();
+	size_t filled, released;
+	uintptr_t chain = bench_fill(&filled, &released);
+
+	dprintf("framebench: filled %zu frames, released %zu of them, %zu of %zu KiB in use\n",
+		filled, released, mmu_used_memory(), mmu_total_memory());
+	dprintf("framebench: %d ms per run, alloc/release pairs per second\n", BENCH_MS);
+
+	int was_enabled = mmu_frame_caches_set(0);
+	for (int caches = 0; caches < 2; ++caches) {
+		mmu_frame_caches_set(caches);
+		uint64_t single = 0;
+
+		for (int threads = 1; threads <= workers; ++threads) {
+			spin_lock(bench_lock);
+			bench_threads = threads;
+			bench_finished = 0;
+			bench_round++;
+			spin_unlock(bench_lock);
+			wakeup_queue(bench_start);
+
+			spin_lock(bench_lock);
+			while (bench_finished < threads) {
+				sleep_on_unlocking(bench_done, &bench_lock);
+				spin_lock(bench_lock);
+			}
+			spin_unlock(bench_lock);
+
+			uint64_t total = 0;
+			for (int i = 0; i < threads; ++i) total += bench_ops[i];
+			total = total * 1000 / BENCH_MS;
+			if (threads == 1) single = total;
+
+			dprintf("framebench: %-9s %d core%s %10lu/s, %10lu per core, %3lu%% scaling\n",
+				caches ? "per-core" : "zone_lock", threads, threads == 1 ? ": " : "s:",
+				total, total / threads, single ? total * 100 / (single * threads) : 0);
+		}
+	}
+
+	for (int n = 1; n <= 256; n *= 4) {
+		dprintf("framebench: contiguous %3d frame%s %10lu/s\n", n, n == 1 ? ": " : "s:", bench_contiguous(n));
+	}
+	mmu_frame_caches_set(was_enabled);
+
+	spin_lock(bench_lock);
+	bench_exit = 1;
+	spin_unlock(bench_lock);
+	wakeup_queue(bench_start);
+
+	spin_lock(bench_lock);
+	while (bench_exited < workers) {
+		sleep_on_unlocking(bench_done, &bench_lock);
+		spin_lock(bench_lock);
+	}
+	spin_unlock(bench_lock);
+
+	for (int i = 0; i < BENCH_EXCHANGE; ++i) {
+		if (bench_exchange[i]) mmu_frame_release(bench_exchange[i] << 12);
+		bench_exchange[i] = 0;
+	}
+
+	while (chain) {
+		uintptr_t next = *frame_word(chain);
+		mmu_frame_release(chain << 12);
+		chain = next;
+	}
+
+	size_t used_after = mmu_used_memory();
+	dprintf("framebench: self-test %s, %lu bad frames, %ld KiB not given back\n",
+		bench_errors ? "FAILED" : "passed", bench_errors, (long)used_after - (long)used_before);
+}
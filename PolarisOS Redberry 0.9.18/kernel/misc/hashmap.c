@@ -11,6 +11,19 @@
 #include <kernel/list.h>
 #include <kernel/hashmap.h>
 
+struct slab_cache;
+extern struct slab_cache * slab_cache_create(const char * name, uintptr_t size);
+extern void * slab_cache_alloc(struct slab_cache * cache);
+
+/**
+ * @brief Object cache for entries; hash_val_free releases them like anything else.
+ */
+static hashmap_entry_t * hashmap_entry_alloc(void) {
+	static struct slab_cache * cache = NULL;
+	if (!cache) cache = slab_cache_create("hashmap_entry", sizeof(hashmap_entry_t));
+	return slab_cache_alloc(cache);
+}
+
 unsigned int hashmap_string_hash(const void * _key) {
 	unsigned int hash = 0;
 	char * key = (char *)_key;
@@ -86,7 +99,7 @@ void * hashmap_set(hashmap_t * map, const void * key, void * value) {
 
 	hashmap_entry_t * x = map->entries[hash];
 	if (!x) {
-		hashmap_entry_t * e = malloc(sizeof(hashmap_entry_t));
+		hashmap_entry_t * e = hashmap_entry_alloc();
 		e->key   = map->hash_key_dup(key);
 		e->value = value;
 		e->next = NULL;
@@ -104,7 +117,7 @@ void * hashmap_set(hashmap_t * map, const void * key, void * value) {
 				x = x->next;
 			}
 		} while (x);
-		hashmap_entry_t * e = malloc(sizeof(hashmap_entry_t));
+		hashmap_entry_t * e = hashmap_entry_alloc();
 		e->key   = map->hash_key_dup(key);
 		e->value = value;
 		e->next = NULL;
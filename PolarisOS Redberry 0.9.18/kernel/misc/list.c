@@ -12,6 +12,27 @@
 #include <kernel/string.h>
 #include <kernel/list.h>
 
+struct slab_cache;
+extern struct slab_cache * slab_cache_create(const char * name, uintptr_t size);
+extern void * slab_cache_alloc(struct slab_cache * cache);
+
+/**
+ * @brief Object cache for list nodes, which are freed with plain free().
+ *
+ * Created with the heap's caches, while only the boot core runs; lists
+ * made before that get their nodes from malloc.
+ */
+static struct slab_cache * list_node_cache = NULL;
+
+void list_caches_initialize(void) {
+	list_node_cache = slab_cache_create("list_node", sizeof(node_t));
+}
+
+static node_t * list_node_alloc(void) {
+	if (!list_node_cache) return malloc(sizeof(node_t));
+	return slab_cache_alloc(list_node_cache);
+}
+
 void list_destroy(list_t * list) {
 	/* Free all of the contents of a list */
 	node_t * n = list->head;
@@ -52,7 +73,7 @@ void list_append(list_t * list, node_t * node) {
 
 node_t * list_insert(list_t * list, void * item) {
 	/* Insert an item into a list */
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = list_node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -89,7 +110,7 @@ void list_append_after(list_t * list, node_t * before, node_t * node) {
 }
 
 node_t * list_insert_after(list_t * list, node_t * before, void * item) {
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = list_node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
@@ -125,7 +146,7 @@ void list_append_before(list_t * list, node_t * after, node_t * node) {
 }
 
 node_t * list_insert_before(list_t * list, node_t * after, void * item) {
-	node_t * node = malloc(sizeof(node_t));
+	node_t * node = list_node_alloc();
 	node->value = item;
 	node->next  = NULL;
 	node->prev  = NULL;
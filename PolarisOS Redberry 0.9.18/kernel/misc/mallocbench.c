@@ -0,0 +1,189 @@
+/**
+ * @file  kernel/misc/mallocbench.c
+ * @brief Kernel heap self-test and throughput benchmark.
+ *
+ * Boot with "mallocbench" on the command line to run this before init
+ * starts. Worker threads (up to four, one per core) allocate and free
+ * random sizes between 8 bytes and 2KiB as fast as they can, keeping a
+ * few dozen objects alive each and passing some of them to each other
+ * so they get freed on a different core than they came from. Each run
+ * is done with 1 to 4 workers, first with the per-CPU caches turned off
+ * so everything goes through mem_lock, then with them on.
+ *
+ * Every object carries a tag that is checked before it is freed, so an
+ * object handed to two owners at once shows up as an error at the end.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdint.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/string.h>
+#include <kernel/spinlock.h>
+#include <kernel/list.h>
+#include <kernel/misc.h>
+
+#define BENCH_THREADS  4
+#define BENCH_LIVE     64		/* Objects each worker holds at a time */
+#define BENCH_EXCHANGE 16		/* Slots for passing objects between workers */
+#define BENCH_MS       500		/* Length of each run */
+
+static spin_lock_t bench_lock = { 0 };
+static list_t * bench_start;	/* Workers waiting for the next run */
+static list_t * bench_done;		/* The benchmark waiting for a run to finish */
+static int bench_round = 0;
+static int bench_threads = 0;
+static int bench_finished = 0;
+static int bench_exit = 0;
+static int bench_exited = 0;
+
+static void * bench_exchange[BENCH_EXCHANGE];
+static uint64_t bench_ops[BENCH_THREADS];
+static uint64_t bench_errors = 0;
+
+static void bench_worker(void * arg) {
+	int id = (uintptr_t)arg;
+	int seen = 0;
+	uint32_t seed = 2463534242U + id;
+	uint64_t counter = 0;
+	void * live[BENCH_LIVE] = {0};
+	uint64_t tags[BENCH_LIVE];
+
+	while (1) {
+		spin_lock(bench_lock);
+		while (bench_round == seen && !bench_exit) {
+			sleep_on_unlocking(bench_start, &bench_lock);
+			spin_lock(bench_lock);
+		}
+		seen = bench_round;
+		int run = !bench_exit && id < bench_threads;
+		int done = bench_exit;
+		spin_unlock(bench_lock);
+
+		if (done) break;
+		if (!run) continue;
+
+		uint64_t ops = 0;
+		uint64_t errors = 0;
+		uint64_t end = arch_perf_timer() + BENCH_MS * 1000UL * arch_cpu_mhz();
+
+		while (arch_perf_timer() < end) {
+			for (int i = 0; i < 256; ++i) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+
+				int slot = seed % BENCH_LIVE;
+				if (live[slot]) {
+					if (*(uint64_t *)live[slot] != tags[slot]) errors++;
+					if (!(seed & 15)) {
+						/* Trade with whoever used this slot last, they freed what we take */
+						void * other = __sync_lock_test_and_set(&bench_exchange[(seed >> 4) % BENCH_EXCHANGE], live[slot]);
+						free(other);
+					} else {
+						free(live[slot]);
+					}
+				}
+
+				uintptr_t size = 8UL << ((seed >> 8) % 9);
+				size -= (seed >> 16) % (size / 2 + 1);
+				if (size < sizeof(uint64_t)) size = sizeof(uint64_t);
+
+				live[slot] = malloc(size);
+				tags[slot] = ((uint64_t)id << 48) | ++counter;
+				*(uint64_t *)live[slot] = tags[slot];
+				ops++;
+			}
+		}
+
+		bench_ops[id] = ops;
+		__sync_add_and_fetch(&bench_errors, errors);
+
+		spin_lock(bench_lock);
+		bench_finished++;
+		spin_unlock(bench_lock);
+		wakeup_queue(bench_done);
+	}
+
+	for (int i = 0; i < BENCH_LIVE; ++i) {
+		free(live[i]);
+	}
+
+	spin_lock(bench_lock);
+	bench_exited++;
+	spin_unlock(bench_lock);
+	wakeup_queue(bench_done);
+
+	task_exit(0);
+}
+
+/**
+ * @brief Run the heap benchmark, returns when all runs are done.
+ */
+void malloc_benchmark(void) {
+	extern int malloc_caches_set(int enabled);
+
+	int workers = processor_count < BENCH_THREADS ? processor_count : BENCH_THREADS;
+
+	bench_start = list_create("mallocbench start", NULL);
+	bench_done  = list_create("mallocbench done", NULL);
+
+	for (int i = 0; i < workers; ++i) {
+		spawn_worker_thread(bench_worker, "[mallocbench]", (void *)(uintptr_t)i);
+	}
+
+	dprintf("mallocbench: %d ms per run, alloc/free pairs per second\n", BENCH_MS);
+
+	int was_enabled = malloc_caches_set(0);
+	for (int caches = 0; caches < 2; ++caches) {
+		malloc_caches_set(caches);
+		uint64_t single = 0;
+
+		for (int threads = 1; threads <= workers; ++threads) {
+			spin_lock(bench_lock);
+			bench_threads = threads;
+			bench_finished = 0;
+			bench_round++;
+			spin_unlock(bench_lock);
+			wakeup_queue(bench_start);
+
+			spin_lock(bench_lock);
+			while (bench_finished < threads) {
+				sleep_on_unlocking(bench_done, &bench_lock);
+				spin_lock(bench_lock);
+			}
+			spin_unlock(bench_lock);
+
+			uint64_t total = 0;
+			for (int i = 0; i < threads; ++i) total += bench_ops[i];
+			total = total * 1000 / BENCH_MS;
+			if (threads == 1) single = total;
+
+			dprintf("mallocbench: %-8s %d core%s %10lu/s, %10lu per core, %3lu%% scaling\n",
+				caches ? "per-cpu" : "mem_lock", threads, threads == 1 ? ": " : "s:",
+				total, total / threads, single ? total * 100 / (single * threads) : 0);
+		}
+	}
+	malloc_caches_set(was_enabled);
+
+	spin_lock(bench_lock);
+	bench_exit = 1;
+	spin_unlock(bench_lock);
+	wakeup_queue(bench_start);
+
+	spin_lock(bench_lock);
+	while (bench_exited < workers) {
+		sleep_on_unlocking(bench_done, &bench_lock);
+		spin_lock(bench_lock);
+	}
+	spin_unlock(bench_lock);
+
+	for (int i = 0; i < BENCH_EXCHANGE; ++i) {
+		free(bench_exchange[i]);
+		bench_exchange[i] = NULL;
+	}
+
+	dprintf("mallocbench: self-test %s, %lu bad objects\n", bench_errors ? "FAILED" : "passed", bench_errors);
+}
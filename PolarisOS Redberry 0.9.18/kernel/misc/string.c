@@ -25,7 +25,7 @@ unsigned short * memsetw(unsigned short * dest, unsigned short val, int count) {
 }
 
 #if 1
-void * memcpy(void * restrict dest, const void * restrict src, size_t n) {
+void * generic_memcpy(void * restrict dest, const void * restrict src, size_t n) {
 	uint64_t * d_64 = dest;
 	const uint64_t * s_64 = src;
 
@@ -51,7 +51,7 @@ void * memcpy(void * restrict dest, const void * restrict src, size_t n) {
 }
 #else
 /* FIXME why is there an x86-specific memcpy outside of the arch dir... */
-void * memcpy(void * restrict dest, const void * restrict src, size_t n) {
+void * generic_memcpy(void * restrict dest, const void * restrict src, size_t n) {
 	asm volatile("rep movsb"
 	            : : "D"(dest), "S"(src), "c"(n)
 	            : "flags", "memory");
@@ -90,7 +90,7 @@ int strcmp(const char * a, const char * b) {
 	}
 }
 
-void * memset(void * dest, int c, size_t n) {
+void * generic_memset(void * dest, int c, size_t n) {
 	size_t i = 0;
 	for ( ; i < n; ++i ) {
 		((char *)dest)[i] = c;
@@ -98,7 +98,7 @@ void * memset(void * dest, int c, size_t n) {
 	return dest;
 }
 
-void * memmove(void * dest, const void * src, size_t n) {
+void * generic_memmove(void * dest, const void * src, size_t n) {
 	char * d = dest;
 	const char * s = src;
 
@@ -107,7 +107,7 @@ void * memmove(void * dest, const void * src, size_t n) {
 	}
 
 	if (s+n <= d || d+n <= s) {
-		return memcpy(d, s, n);
+		return generic_memcpy(d, s, n);
 	}
 
 	if (d<s) {
@@ -147,6 +147,26 @@ void * memmove(void * dest, const void * src, size_t n) {
 	return dest;
 }
 
+/*
+ * The architecture can swap in faster versions of these at boot,
+ * see aarch64_string_select. Until then, they're the ones above.
+ */
+void * (*memcpy_impl)(void * restrict dest, const void * restrict src, size_t n) = generic_memcpy;
+void * (*memmove_impl)(void * dest, const void * src, size_t n) = generic_memmove;
+void * (*memset_impl)(void * dest, int c, size_t n) = generic_memset;
+
+void * memcpy(void * restrict dest, const void * restrict src, size_t n) {
+	return memcpy_impl(dest, src, n);
+}
+
+void * memmove(void * dest, const void * src, size_t n) {
+	return memmove_impl(dest, src, n);
+}
+
+void * memset(void * dest, int c, size_t n) {
+	return memset_impl(dest, c, n);
+}
+
 void * memchr(const void * src, int c, size_t n) {
 	const unsigned char * s = src;
 	c = (unsigned char)c;
@@ -0,0 +1,169 @@
+/**
+ * @file  kernel/misc/stringbench.c
+ * @brief memcpy/memmove/memset self-test and throughput benchmark.
+ *
+ * Boot with "stringbench" on the command line to run this before init
+ * starts. First the versions the architecture picked at boot are run
+ * side by side with the generic ones from string.c on random sizes,
+ * alignments, fill bytes and (for memmove) overlaps, over identical
+ * buffers, and the buffers compared after each call. Sizes mostly stay
+ * small, with every so often one big enough for the non-temporal and
+ * dc zva paths. Then both sets are timed on sizes from 8 bytes to 4MiB;
+ * memmove is timed with the destination 64 bytes above the source, so
+ * it has to go backwards.
+ *
+ * @copyright
+ * This file is part of PolarisOS and is released under the terms
+ * Copyright (C) VDC.
+ */
+#include <stdint.h>
+#include <kernel/process.h>
+#include <kernel/printf.h>
+#include <kernel/string.h>
+#include <kernel/misc.h>
+
+#define FUZZ_ROUNDS  200000
+#define FUZZ_BUFFER  (2 * 1024 * 1024)
+#define BENCH_MAX    (4 * 1024 * 1024)
+#define BENCH_US     20000		/* Time per size and function */
+
+extern void * generic_memcpy(void * restrict dest, const void * restrict src, size_t n);
+extern void * generic_memmove(void * dest, const void * src, size_t n);
+extern void * generic_memset(void * dest, int c, size_t n);
+extern void * (*memcpy_impl)(void * restrict dest, const void * restrict src, size_t n);
+extern void * (*memmove_impl)(void * dest, const void * src, size_t n);
+extern void * (*memset_impl)(void * dest, int c, size_t n);
+
+static uint32_t seed = 2463534242U;
+
+static uint32_t bench_random(void) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static size_t fuzz_size(void) {
+	uint32_t pick = bench_random() % 1000;
+	if (pick < 400) return bench_random() % 48;
+	if (pick < 800) return bench_random() % 320;
+	if (pick < 995) return bench_random() % 8192;
+	return bench_random() % (FUZZ_BUFFER / 2 - 64);
+}
+
+/**
+ * Run one random call on both buffers, returns 0 if they still match.
+ */
+static int fuzz_one(char * a, char * b, int * op, size_t * n) {
+	*op = bench_random() % 3;
+	*n = fuzz_size();
+	size_t len = *n;
+
+	switch (*op) {
+		case 0: {
+			/* Source in the bottom half, destination in the top, they never overlap */
+			size_t src = bench_random() % (FUZZ_BUFFER / 2 - len);
+			size_t dst = FUZZ_BUFFER / 2 + bench_random() % (FUZZ_BUFFER / 2 - len);
+			generic_memcpy(a + dst, a + src, len);
+			memcpy_impl(b + dst, b + src, len);
+			size_t high = dst + len + 64 < FUZZ_BUFFER ? dst + len + 64 : FUZZ_BUFFER;
+			return memcmp(a + dst - 64, b + dst - 64, high - (dst - 64));
+		}
+		case 1: {
+			size_t src = bench_random() % (FUZZ_BUFFER - len);
+			size_t dst = src + (bench_random() % 256) - 128;
+			if (dst > FUZZ_BUFFER - len) dst = bench_random() % (FUZZ_BUFFER - len);
+			generic_memmove(a + dst, a + src, len);
+			memmove_impl(b + dst, b + src, len);
+			/* The whole window, since an overlapping copy can go wrong on either side of dst */
+			size_t low = src < dst ? src : dst;
+			return memcmp(a + low, b + low, len + (src < dst ? dst - src : src - dst));
+		}
+		default: {
+			size_t dst = bench_random() % (FUZZ_BUFFER - len);
+			int c = (bench_random() & 3) ? 0 : (int)bench_random();
+			generic_memset(a + dst, c, len);
+			memset_impl(b + dst, c, len);
+			/* Check a little on each side for stores past the ends */
+			size_t low = dst > 64 ? dst - 64 : 0;
+			size_t high = dst + len + 64 < FUZZ_BUFFER ? dst + len + 64 : FUZZ_BUFFER;
+			return memcmp(a + low, b + low, high - low);
+		}
+	}
+}
+
+static uint64_t bench_one(int function, int generic, char * dst, char * src, size_t size) {
+	uint64_t start = arch_perf_timer();
+	uint64_t end = start + BENCH_US * arch_cpu_mhz();
+	uint64_t bytes = 0;
+	uint64_t now;
+
+	do {
+		for (int i = 0; i < 16; ++i) {
+			switch (function) {
+				case 0: (generic ? generic_memcpy : memcpy_impl)(dst, src, size); break;
+				case 1: (generic ? generic_memset : memset_impl)(dst, i, size); break;
+				case 2: (generic ? generic_memmove : memmove_impl)(src + 64, src, size); break;
+			}
+			bytes += size;
+		}
+		now = arch_perf_timer();
+	} while (now < end);
+
+	/* bytes per microsecond is MB/s */
+	return bytes * arch_cpu_mhz() / (now - start);
+}
+
+/**
+ * @brief Run the string function tests and benchmarks.
+ */
+void string_benchmark(void) {
+	char * a = malloc(FUZZ_BUFFER);
+	char * b = malloc(FUZZ_BUFFER);
+
+	for (size_t i = 0; i < FUZZ_BUFFER; ++i) {
+		a[i] = b[i] = bench_random();
+	}
+
+	int failures = 0;
+	for (int round = 0; round < FUZZ_ROUNDS; ++round) {
+		int op;
+		size_t n;
+		if (fuzz_one(a, b, &op, &n)) {
+			if (failures < 8) {
+				dprintf("stringbench: %s of %zu bytes differs from the generic version (round %d)\n",
+					op == 0 ? "memcpy" : op == 1 ? "memmove" : "memset", n, round);
+			}
+			failures++;
+			/* Start over from matching buffers */
+			for (size_t i = 0; i < FUZZ_BUFFER; ++i) b[i] = a[i];
+		}
+	}
+
+	dprintf("stringbench: self-test %s, %d of %d calls differ\n", failures ? "FAILED" : "passed", failures, FUZZ_ROUNDS);
+
+	free(a);
+	free(b);
+
+	char * src = malloc(BENCH_MAX + 128);
+	char * dst = malloc(BENCH_MAX + 128);
+	for (size_t i = 0; i < BENCH_MAX + 128; ++i) {
+		src[i] = i;
+		dst[i] = 0;
+	}
+
+	dprintf("stringbench: MB/s       memcpy            memset           memmove\n");
+	dprintf("stringbench:     size  generic selected  generic selected  generic selected\n");
+	for (size_t size = 8; size <= BENCH_MAX; size *= 2) {
+		uint64_t results[6];
+		for (int function = 0; function < 3; ++function) {
+			results[function * 2] = bench_one(function, 1, dst, src, size);
+			results[function * 2 + 1] = bench_one(function, 0, dst, src, size);
+		}
+		dprintf("stringbench: %8zu %8lu %8lu %8lu %8lu %8lu %8lu\n", size,
+			results[0], results[1], results[2], results[3], results[4], results[5]);
+	}
+
+	free(src);
+	free(dst);
+}
@@ -50,21 +50,340 @@
 
 tree_t * process_tree;  /* Stores the parent-child process relationships; the root of this graph is 'init'. */
 list_t * process_list;  /* Stores all existing processes. Mostly used for sanity checking or for places where iterating over all processes is useful. */
-list_t * process_queue; /* Scheduler ready queue. This the round-robin source. The head is the next process to run. */
-list_t * sleep_queue;   /* Ordered list of processes waiting to be awoken by timeouts. The head is the earliest thread to awaken. */
+list_t * sleep_queue;   /* Never holds anything; a process in a timed sleep has this as its sleep_node owner, and is on its core's timing wheel. */
 list_t * reap_queue;    /* Processes that could not be cleaned up and need to be deleted. */
 
 struct ProcessorLocal processor_local_data[32] = {0};
 int processor_count = 1;
 
-/* The following locks protect access to the process tree, scheduler queue,
+/**
+ * Per-core ready queues. Each is a round-robin source whose head is the next
+ * process to run on that core. A process is queued on the core it last ran on,
+ * unless another core is idle; cores that run out of work steal from the longest
+ * queue. A process is in at most one queue, whose list is its sched_node owner.
+ */
+struct run_queue {
+	spin_lock_t lock;
+	list_t * queue;
+	/* Statistics, for /proc/schedstat */
+	uint64_t switches;   /* processes picked to run here */
+	uint64_t steals;     /* ... of which were taken from another core's queue */
+	uint64_t migrations; /* wakeups queued here for a process that last ran elsewhere */
+	uint64_t ipis;       /* wakeup interrupts sent to this core */
+};
+
+static struct run_queue run_queues[32];
+
+/* How many times to look again when the only ready processes are still switching away on another core */
+#define SCHED_RUNNING_RETRIES 1000
+
+/* The following locks protect access to the process tree,
  * sleeping, and the very special wait queue... */
 static spin_lock_t tree_lock = { 0 };
-static spin_lock_t process_queue_lock = { 0 };
 static spin_lock_t wait_lock_tmp = { 0 };
 static spin_lock_t sleep_lock = { 0 };
 static spin_lock_t reap_lock = { 0 };
 
+/**
+ * Per-core timing wheels, for timed sleeps and fswait timeouts.
+ *
+ * Time is counted in units of TIMER_UNIT microseconds. Each wheel has
+ * TIMER_LEVELS levels of TIMER_SLOTS slots; a slot on level n spans
+ * TIMER_SLOTS^n units. A timer goes on the lowest level that reaches its
+ * deadline and moves down a level each time the wheel comes around to its
+ * slot, so arming and cancelling are O(1) and the only memory a timer needs
+ * is the timer itself, which lives in whatever it belongs to.
+ *
+ * Timers are armed on the wheel of the core that arms them, and each core
+ * runs its own wheel from its timer interrupt. A bitmap of occupied slots
+ * per level lets a run skip straight to the next slot with anything in it,
+ * and tells the timer code when the next deadline is so it can program a
+ * one-shot interrupt for it instead of ticking.
+ */
+#define TIMER_SHIFT  7 /* 128µs units */
+#define TIMER_UNIT   (1UL << TIMER_SHIFT)
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_MASK   (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 7
+#define TIMER_RANGE  (1UL << (TIMER_BITS * TIMER_LEVELS)) /* Furthest a timer can be, in units; about 17 years */
+
+struct timer_wheel;
+
+struct timer {
+	struct timer * next;
+	struct timer ** pprev;    /* NULL when not armed */
+	uint64_t deadline;        /* microseconds, on the same clock as wakeup_sleepers */
+	uint64_t expires;         /* deadline in units, rounded up */
+	void (*callback)(struct timer *);
+	void * data;
+	struct timer_wheel * wheel; /* Where it was last armed */
+};
+
+struct timer_wheel {
+	spin_lock_t lock;
+	uint64_t clk;             /* Next unit to run */
+	uint64_t occupied[TIMER_LEVELS];
+	struct timer * slots[TIMER_LEVELS][TIMER_SLOTS];
+	struct timer * volatile running; /* Timer whose callback is being called */
+	/* Statistics, for /proc/timerstat */
+	size_t armed;
+	uint64_t runs;            /* timer interrupts */
+	uint64_t fired;
+	uint64_t cancelled;
+	uint64_t cascaded;        /* timers moved down a level */
+};
+
+static struct timer_wheel timer_wheels[32];
+
+/**
+ * The timers every process may need, allocated along with the process.
+ * A process can only be in one timed sleep and one fswait at a time.
+ */
+struct process_timers {
+	struct timer sleep;       /* sleep_until */
+	struct timer timeout;     /* fswait with a timeout */
+};
+
+#define PROCESS_ALLOC_SIZE (sizeof(process_t) + sizeof(struct process_timers))
+#define process_timers(proc) ((struct process_timers *)((process_t *)(proc) + 1))
+
+static void process_timers_init(process_t * proc);
+
+/**
+ * @brief Put a timer in the slot for its deadline. Wheel must be locked.
+ */
+static void timer_wheel_insert(struct timer_wheel * wheel, struct timer * timer) {
+	uint64_t expires = timer->expires;
+	int level = 0;
+
+	if (expires < wheel->clk) {
+		/* Already due, run it with the current unit */
+		expires = wheel->clk;
+	} else {
+		uint64_t delta = expires - wheel->clk;
+		if (delta >= TIMER_RANGE) {
+			/* Park it as far out as we can; it will be placed again from there */
+			delta = TIMER_RANGE - 1;
+			expires = wheel->clk + delta;
+		}
+		while (delta >= (1UL << (TIMER_BITS * (level + 1)))) level++;
+	}
+
+	int slot = (expires >> (TIMER_BITS * level)) & TIMER_MASK;
+	struct timer ** head = &wheel->slots[level][slot];
+	timer->next = *head;
+	if (timer->next) timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+	wheel->occupied[level] |= (1UL << slot);
+}
+
+/**
+ * @brief Take a timer out of its slot. Wheel must be locked.
+ */
+static void timer_wheel_remove(struct timer_wheel * wheel, struct timer * timer) {
+	struct timer ** first = &wheel->slots[0][0];
+
+	*timer->pprev = timer->next;
+	if (timer->next) {
+		timer->next->pprev = timer->pprev;
+	} else if (timer->pprev >= first && timer->pprev < first + TIMER_LEVELS * TIMER_SLOTS) {
+		/* It was the only one in its slot */
+		size_t index = timer->pprev - first;
+		wheel->occupied[index / TIMER_SLOTS] &= ~(1UL << (index % TIMER_SLOTS));
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/**
+ * @brief Find the next unit the wheel has work in. Wheel must be locked.
+ *
+ * That is either a timer expiring on the lowest level or a slot
+ * on a higher level coming around to be moved down, which may
+ * be earlier than any of the deadlines in it.
+ *
+ * @returns the unit, or UINT64_MAX if the wheel is empty.
+ */
+static uint64_t timer_wheel_next(struct timer_wheel * wheel) {
+	uint64_t next = UINT64_MAX;
+
+	for (int level = 0; level < TIMER_LEVELS; ++level) {
+		uint64_t occupied = wheel->occupied[level];
+		if (!occupied) continue;
+
+		/* The first slot on this level that has not come around yet */
+		int shift = TIMER_BITS * level;
+		uint64_t base = (wheel->clk + (1UL << shift) - 1) >> shift;
+		int index = base & TIMER_MASK;
+		if (index) occupied = (occupied >> index) | (occupied << (TIMER_SLOTS - index));
+
+		uint64_t when = (base + __builtin_ctzl(occupied)) << shift;
+		if (when < next) next = when;
+	}
+
+	return next;
+}
+
+/**
+ * @brief Run a core's wheel up to @p now, calling expired timers.
+ *
+ * Callbacks are called with the wheel unlocked, and may arm
+ * and cancel other timers.
+ */
+static void timer_wheel_run(struct timer_wheel * wheel, uint64_t now) {
+	uint64_t target = now >> TIMER_SHIFT;
+
+	spin_lock(wheel->lock);
+	wheel->runs++;
+
+	uint64_t unit;
+	while ((unit = timer_wheel_next(wheel)) <= target) {
+		wheel->clk = unit;
+
+		/* Every time the lowest level wraps around, move the next slot of the level above down */
+		for (int level = 1; level < TIMER_LEVELS && !(unit & ((1UL << (TIMER_BITS * level)) - 1)); ++level) {
+			int slot = (unit >> (TIMER_BITS * level)) & TIMER_MASK;
+			struct timer * timer = wheel->slots[level][slot];
+			wheel->slots[level][slot] = NULL;
+			wheel->occupied[level] &= ~(1UL << slot);
+			while (timer) {
+				struct timer * next = timer->next;
+				timer_wheel_insert(wheel, timer);
+				wheel->cascaded++;
+				timer = next;
+			}
+		}
+
+		struct timer ** slot = &wheel->slots[0][unit & TIMER_MASK];
+		while (*slot) {
+			struct timer * timer = *slot;
+			timer_wheel_remove(wheel, timer);
+			wheel->armed--;
+			wheel->fired++;
+			wheel->running = timer;
+			spin_unlock(wheel->lock);
+
+			timer->callback(timer);
+
+			spin_lock(wheel->lock);
+			wheel->running = NULL;
+		}
+
+		wheel->clk = unit + 1;
+	}
+
+	/* Nothing else is due before the target, so skip ahead */
+	if (wheel->clk <= target) wheel->clk = target + 1;
+
+	spin_unlock(wheel->lock);
+}
+
+/**
+ * @brief Disarm a timer.
+ *
+ * A callback that already started may still be running on
+ * another core, see @ref timer_cancel_sync.
+ *
+ * @returns 1 if the timer was armed, 0 if it was not.
+ */
+static int timer_cancel(struct timer * timer) {
+	struct timer_wheel * wheel;
+
+	/* Whether it is armed can only be told under the lock of its wheel */
+	for (;;) {
+		wheel = __atomic_load_n(&timer->wheel, __ATOMIC_ACQUIRE);
+		if (!wheel) return 0; /* Never armed */
+		spin_lock(wheel->lock);
+		if (timer->wheel == wheel) break;
+		/* Armed again on another core meanwhile */
+		spin_unlock(wheel->lock);
+	}
+
+	int armed = timer->pprev != NULL;
+	if (armed) {
+		timer_wheel_remove(wheel, timer);
+		wheel->armed--;
+		wheel->cancelled++;
+	}
+	spin_unlock(wheel->lock);
+	return armed;
+}
+
+/**
+ * @brief Disarm a timer and wait for its callback to finish.
+ *
+ * Needed before freeing whatever the timer is part of. Must
+ * not be called with any lock the callback takes.
+ */
+static void timer_cancel_sync(struct timer * timer) {
+	timer_cancel(timer);
+
+	struct timer_wheel * wheel = __atomic_load_n(&timer->wheel, __ATOMIC_ACQUIRE);
+	if (!wheel) return;
+
+	/* The wheel clears running under its lock once the callback has returned */
+	for (;;) {
+		spin_lock(wheel->lock);
+		int running = wheel->running == timer;
+		spin_unlock(wheel->lock);
+		if (!running) break;
+	}
+}
+
+/**
+ * @brief Arm a timer to call its callback at @p deadline microseconds.
+ *
+ * If it was already armed, its old deadline is forgotten. A timer
+ * must not be armed from two places at once.
+ */
+static void timer_arm(struct timer * timer, uint64_t deadline) {
+	extern void arch_timer_deadline(uint64_t deadline);
+
+	timer_cancel(timer);
+
+	struct timer_wheel * wheel = &timer_wheels[this_core->cpu_id];
+	spin_lock(wheel->lock);
+	timer->deadline = deadline;
+	timer->expires  = (deadline + TIMER_UNIT - 1) >> TIMER_SHIFT;
+	timer->wheel    = wheel;
+	timer_wheel_insert(wheel, timer);
+	wheel->armed++;
+	spin_unlock(wheel->lock);
+
+	/* Make sure the local timer interrupt comes in time for it */
+	arch_timer_deadline(timer->expires << TIMER_SHIFT);
+}
+
+/**
+ * @brief When this core next needs a timer interrupt, in microseconds.
+ *
+ * Called by the timer code to program the next interrupt.
+ * @returns UINT64_MAX if there are no timers armed on this core.
+ */
+uint64_t timer_next_deadline(void) {
+	struct timer_wheel * wheel = &timer_wheels[this_core->cpu_id];
+	spin_lock(wheel->lock);
+	uint64_t next = timer_wheel_next(wheel);
+	spin_unlock(wheel->lock);
+	return next == UINT64_MAX ? next : next << TIMER_SHIFT;
+}
+
+/**
+ * @brief Report timer statistics for one core.
+ *
+ * Used by /proc/timerstat.
+ */
+void timer_core_stats(int core, size_t * armed, uint64_t * runs, uint64_t * fired, uint64_t * cancelled, uint64_t * cascaded) {
+	struct timer_wheel * wheel = &timer_wheels[core];
+	*armed     = wheel->armed;
+	*runs      = wheel->runs;
+	*fired     = wheel->fired;
+	*cancelled = wheel->cancelled;
+	*cascaded  = wheel->cascaded;
+}
+
 void update_process_times(int includeSystem) {
 	uint64_t pTime = arch_perf_timer();
 	if (this_core->current_process->time_in && this_core->current_process->time_in < pTime) {
@@ -208,8 +527,10 @@ void switch_task(uint8_t reschedule) {
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create("global process list",NULL);
-	process_queue = list_create("global scheduler queue",NULL);
-	sleep_queue = list_create("global timed sleep queue",NULL);
+	for (int i = 0; i < 32; ++i) {
+		run_queues[i].queue = list_create("per-core scheduler queue",&run_queues[i]);
+	}
+	sleep_queue = list_create("timed sleep marker",NULL);
 	reap_queue = list_create("processes awaiting later cleanup",NULL);
 
 	/* TODO: PID bitset? */
@@ -337,7 +658,8 @@ void process_release_directory(page_directory_t * dir) {
 }
 
 process_t * spawn_kidle(int bsp) {
-	process_t * idle = calloc(1,sizeof(process_t));
+	process_t * idle = calloc(1,PROCESS_ALLOC_SIZE);
+	process_timers_init(idle);
 	idle->id = -1;
 	idle->name = strdup("[kidle]");
 	idle->flags = PROC_FLAG_IS_TASKLET | PROC_FLAG_STARTED | PROC_FLAG_RUNNING;
@@ -364,7 +686,7 @@ process_t * spawn_kidle(int bsp) {
 }
 
 process_t * spawn_init(void) {
-	process_t * init = calloc(1,sizeof(process_t));
+	process_t * init = calloc(1,PROCESS_ALLOC_SIZE);
 	tree_set_root(process_tree, (void*)init);
 
 	init->tree_entry = process_tree->root;
@@ -413,7 +735,7 @@ process_t * spawn_init(void) {
 	init->sleep_node.next = NULL;
 	init->sleep_node.value = init;
 
-	init->timed_sleep_node = NULL;
+	process_timers_init(init);
 
 	init->thread.page_directory = malloc(sizeof(page_directory_t));
 	init->thread.page_directory->refcount = 1;
@@ -426,7 +748,8 @@ process_t * spawn_init(void) {
 }
 
 process_t * spawn_process(volatile process_t * parent, int flags) {
-	process_t * proc = calloc(1,sizeof(process_t));
+	process_t * proc = calloc(1,PROCESS_ALLOC_SIZE);
+	process_timers_init(proc);
 
 	proc->id          = get_next_pid();
 	proc->group       = proc->id;
@@ -601,6 +924,10 @@ void process_delete(process_t * proc) {
 		free(proc->supplementary_group_list);
 	}
 
+	/* A timer that went off just as the process exited may still be looking at it */
+	timer_cancel_sync(&process_timers(proc)->sleep);
+	timer_cancel_sync(&process_timers(proc)->timeout);
+
 	/* Is someone using this process? */
 	for (int i = 0; i < processor_count; ++i) {
 		if (i == this_core->cpu_id) continue;
@@ -614,6 +941,79 @@ void process_delete(process_t * proc) {
 	process_reap(proc);
 }
 
+/**
+ * @brief Is a core sitting in its idle task?
+ */
+static int sched_core_is_idle(int core) {
+	return processor_local_data[core].kernel_idle_task &&
+		processor_local_data[core].current_process == processor_local_data[core].kernel_idle_task;
+}
+
+/**
+ * @brief Is a core known to be running something other than its idle task?
+ *
+ * A core that has just come out of sched_take empty-handed still shows
+ * what it ran last, so this is not the same as not being idle.
+ */
+static int sched_core_is_busy(int core) {
+	return processor_local_data[core].current_process &&
+		processor_local_data[core].current_process != processor_local_data[core].kernel_idle_task;
+}
+
+/**
+ * @brief Is anything waiting on this core's ready queue?
+ *
+ * The idle task asks this right before it sleeps, for anything queued
+ * here while the core was on its way to idle, which make_process_ready
+ * may have seen as busy and not woken. Taking the queue lock orders the
+ * check after the idle task became current, against the append and the
+ * look at current_process in make_process_ready.
+ */
+int sched_local_work(void) {
+	struct run_queue * rq = &run_queues[this_core->cpu_id];
+	spin_lock(rq->lock);
+	int work = rq->queue->length != 0;
+	spin_unlock(rq->lock);
+	return work;
+}
+
+/**
+ * @brief Find an idle core with nothing queued, other than @p except.
+ *
+ * Starts looking after @p except so wakeups spread out.
+ * @returns the core, or -1 if all of them are busy.
+ */
+static int sched_idle_core(int except) {
+	for (int i = 1; i <= processor_count; ++i) {
+		int core = (except + i) % processor_count;
+		if (core == except) continue;
+		if (sched_core_is_idle(core) && !run_queues[core].queue->length) return core;
+	}
+	return -1;
+}
+
+/**
+ * @brief Choose which core's queue a ready process should go on.
+ *
+ * Prefers the core the process last ran on, as its caches may still
+ * be warm, as long as it is idle. Otherwise any idle core, and if
+ * everyone is busy, the previous core unless its queue is clearly
+ * longer than ours. New processes start out near their parent.
+ */
+static int sched_pick_core(volatile process_t * proc) {
+	int local = this_core->cpu_id;
+	int prev = (proc->flags & PROC_FLAG_STARTED) ? proc->owner : local;
+	if (prev < 0 || prev >= processor_count) prev = local;
+
+	if (sched_core_is_idle(prev) && !run_queues[prev].queue->length) return prev;
+
+	int idle = sched_idle_core(prev);
+	if (idle != -1) return idle;
+
+	if (run_queues[prev].queue->length > run_queues[local].queue->length + 1) return local;
+	return prev;
+}
+
 /**
  * @brief Place an available process in the ready queue.
  *
@@ -622,6 +1022,10 @@ void process_delete(process_t * proc) {
  * marked as having been interrupted and removed from its
  * owning queue before being moved.
  *
+ * The process goes on the queue of the core chosen by
+ * @ref sched_pick_core, which is woken up unless it is
+ * known to be running something.
+ *
  * The process must not otherwise have been in a scheduling
  * queue before it is placed in the ready queue.
  */
@@ -630,12 +1034,9 @@ void make_process_ready(volatile process_t * proc) {
 	if (!sleep_lock_is_mine) spin_lock(sleep_lock);
 	if (proc->sleep_node.owner != NULL) {
 		if (proc->sleep_node.owner == sleep_queue) {
-			/* The sleep queue is slightly special... */
-			if (proc->timed_sleep_node) {
-				list_delete(sleep_queue, proc->timed_sleep_node);
-				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
-			}
+			/* Timed sleeps are on a timing wheel; if the timer beat us here, it will wake the process itself. */
+			timer_cancel(&process_timers(proc)->sleep);
+			__sync_bool_compare_and_swap((void**)&proc->sleep_node.owner, sleep_queue, NULL);
 		} else {
 			/* This was blocked on a semaphore we can interrupt. */
 			__sync_or_and_fetch(&proc->flags, PROC_FLAG_SLEEP_INT);
@@ -644,62 +1045,128 @@ void make_process_ready(volatile process_t * proc) {
 	}
 	if (!sleep_lock_is_mine) spin_unlock(sleep_lock);
 
-	spin_lock(process_queue_lock);
-	if (proc->sched_node.owner) {
-		/* There's only one ready queue, so this means the process was already ready, which
-		 * is indicative of a bug somewhere as we shouldn't be added processes to the ready
-		 * queue multiple times. */
-		spin_unlock(process_queue_lock);
+	struct run_queue * rq = &run_queues[sched_pick_core(proc)];
+	int core = rq - run_queues;
+
+	/* Claim the node and queue it under the queue lock, so two cores waking the
+	 * same process can't put it on two different queues, and nobody sees it
+	 * owned by a queue it isn't on yet. If it was already ready, that's
+	 * indicative of a bug somewhere, as we shouldn't be adding processes to
+	 * the ready queue multiple times. */
+	spin_lock(rq->lock);
+	if (!__sync_bool_compare_and_swap((void**)&proc->sched_node.owner, NULL, rq->queue)) {
+		spin_unlock(rq->lock);
 		return;
 	}
-
-	list_append(process_queue, (node_t*)&proc->sched_node);
-	spin_unlock(process_queue_lock);
-
-	arch_wakeup_others();
+	list_append(rq->queue, (node_t*)&proc->sched_node);
+	size_t queued = rq->queue->length;
+	if (proc->owner != core && (proc->flags & PROC_FLAG_STARTED)) rq->migrations++;
+	spin_unlock(rq->lock);
+
+	if (!sched_core_is_busy(core)) {
+		/* Includes ourselves, if this was an interrupt that came in while idling.
+		 * A core still on its way to idle looks busy; sched_local_work covers that. */
+		__sync_fetch_and_add(&rq->ipis, 1);
+		extern void arch_wakeup_core(int core);
+		arch_wakeup_core(core);
+	} else if (queued > 1 && sched_idle_core(core) != -1) {
+		/* There's a backlog and someone with nothing to do; let them come and steal it */
+		arch_wakeup_others();
+	}
 }
 
 /**
- * @brief Pop the next available process from the queue.
- *
- * Gets the next available process from the round-robin scheduling
- * queue. If there is no process to run, the idle task is returned.
+ * @brief Take the first process from a ready queue that can run here.
  *
- * TODO This needs more locking for SMP...
+ * Processes that are still marked as running on another core have been made
+ * ready before that core finished switching away from them; they are skipped,
+ * and @p busy is set so the caller can try again shortly.
  */
-volatile process_t * next_ready_process(void) {
-	spin_lock(process_queue_lock);
+static volatile process_t * sched_take(struct run_queue * rq, int * busy) {
+	spin_lock(rq->lock);
+
+	if (!rq->queue->head && rq->queue->length) {
+		arch_fatal_prepare();
+		printf("Queue has a length but head is NULL\n");
+		arch_dump_traceback();
+		arch_fatal();
+	}
 
-	if (!process_queue->head) {
-		if (process_queue->length) {
+	for (node_t * np = rq->queue->head; np; np = np->next) {
+		if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
 			arch_fatal_prepare();
-			printf("Queue has a length but head is NULL\n");
+			printf("Suspicious pointer in queue: %#zx\n", (uintptr_t)np);
 			arch_dump_traceback();
 			arch_fatal();
 		}
-		spin_unlock(process_queue_lock);
-		return this_core->kernel_idle_task;
+
+		volatile process_t * next = np->value;
+
+		if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) {
+			*busy = 1;
+			continue;
+		}
+
+		list_delete(rq->queue, np);
+		spin_unlock(rq->lock);
+		return next;
 	}
 
-	node_t * np = list_dequeue(process_queue);
+	spin_unlock(rq->lock);
+	return NULL;
+}
 
-	if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
-		arch_fatal_prepare();
-		printf("Suspicious pointer in queue: %#zx\n", (uintptr_t)np);
-		arch_dump_traceback();
-		arch_fatal();
+/**
+ * @brief Find work for a core whose own queue is empty.
+ *
+ * Steals from the core with the most ready processes.
+ */
+static volatile process_t * sched_steal(int * busy) {
+	int victim = -1;
+	size_t longest = 0;
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (i == this_core->cpu_id) continue;
+		size_t length = run_queues[i].queue->length;
+		if (length > longest) {
+			longest = length;
+			victim = i;
+		}
 	}
-	volatile process_t * next = np->value;
 
-	if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) {
-		/* We pulled a process too soon, switch to idle for a bit so the
-		 * core that marked this process as ready can finish switching away from it. */
-		list_append(process_queue, (node_t*)&next->sched_node);
-		spin_unlock(process_queue_lock);
+	if (victim == -1) return NULL;
+
+	volatile process_t * next = sched_take(&run_queues[victim], busy);
+	if (next) run_queues[this_core->cpu_id].steals++;
+	return next;
+}
+
+/**
+ * @brief Pop the next available process from the queue.
+ *
+ * Gets the next available process from this core's round-robin
+ * scheduling queue, or steals one from another core if there is
+ * nothing to do here. If there is no process to run, the idle
+ * task is returned.
+ */
+volatile process_t * next_ready_process(void) {
+	struct run_queue * rq = &run_queues[this_core->cpu_id];
+	volatile process_t * next = NULL;
+
+	for (int attempt = 0; attempt < SCHED_RUNNING_RETRIES; ++attempt) {
+		int busy = 0;
+		next = sched_take(rq, &busy);
+		if (!next) next = sched_steal(&busy);
+		if (next || !busy) break;
+	}
+
+	if (!next) {
+		/* Nothing, or only processes another core has yet to let go of;
+		 * we'll be woken up when there's something for us. */
 		return this_core->kernel_idle_task;
 	}
 
-	spin_unlock(process_queue_lock);
+	rq->switches++;
 
 	if (!(next->flags & PROC_FLAG_FINISHED)) {
 		__sync_or_and_fetch(&next->flags, PROC_FLAG_RUNNING);
@@ -710,6 +1177,20 @@ volatile process_t * next_ready_process(void) {
 	return next;
 }
 
+/**
+ * @brief Report scheduler statistics for one core.
+ *
+ * Used by /proc/schedstat.
+ */
+void sched_core_stats(int core, size_t * queued, uint64_t * switches, uint64_t * steals, uint64_t * migrations, uint64_t * ipis) {
+	struct run_queue * rq = &run_queues[core];
+	*queued     = rq->queue->length;
+	*switches   = rq->switches;
+	*steals     = rq->steals;
+	*migrations = rq->migrations;
+	*ipis       = rq->ipis;
+}
+
 /**
  * @brief Signal a semaphore.
  *
@@ -829,41 +1310,45 @@ int process_is_ready(process_t * proc) {
 
 int process_alert_node_locked(process_t * process, void * value);
 
+static void sleep_timer_expired(struct timer * timer) {
+	process_t * process = timer->data;
+	/* If make_process_ready got to it first, it's not asleep anymore */
+	if (__sync_bool_compare_and_swap((void**)&process->sleep_node.owner, sleep_queue, NULL)) {
+		if (!process_is_ready(process)) {
+			make_process_ready(process);
+		}
+	}
+}
+
+static void fswait_timer_expired(struct timer * timer) {
+	spin_lock(sleep_lock);
+	/* The timer is also the node the process is waiting on for its timeout */
+	if (!timer->pprev) {
+		process_alert_node_locked(timer->data, timer);
+	}
+	spin_unlock(sleep_lock);
+}
+
+static void process_timers_init(process_t * proc) {
+	struct process_timers * timers = process_timers(proc);
+	timers->sleep.callback   = sleep_timer_expired;
+	timers->sleep.data       = proc;
+	timers->timeout.callback = fswait_timer_expired;
+	timers->timeout.data     = proc;
+}
+
 /**
  * @brief Wake up processes that were sleeping on timers.
  *
- * Reschedule all processes whose timed waits have expired as of
- * the time indicated by @p seconds and @p subseconds. If the sleep
- * was part of an fswait system call timing out, the call is marked
- * as timed out before the process is rescheduled.
+ * Runs this core's timing wheel up to the time indicated by @p seconds
+ * and @p subseconds, rescheduling all processes whose timed waits have
+ * expired. If the sleep was part of an fswait system call timing out,
+ * the call is marked as timed out before the process is rescheduled.
+ *
+ * Called by each core from its own timer interrupt.
  */
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
-	spin_lock(sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-
-			if (proc->is_fswait) {
-				proc->is_fswait = -1;
-				process_alert_node_locked(proc->process,proc);
-			} else {
-				process_t * process = proc->process;
-				process->sleep_node.owner = NULL;
-				process->timed_sleep_node = NULL;
-				if (!process_is_ready(process)) {
-					make_process_ready(process);
-				}
-			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
-			}
-		}
-	}
-	spin_unlock(sleep_lock);
+	timer_wheel_run(&timer_wheels[this_core->cpu_id], (uint64_t)seconds * 1000000 + subseconds);
 }
 
 /**
@@ -874,33 +1359,12 @@ void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
  * sleep will not be resumed by the kernel.
  */
 void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds) {
-	spin_lock(sleep_lock);
 	if (this_core->current_process->sleep_node.owner) {
-		spin_unlock(sleep_lock);
 		/* Can't sleep, sleeping already */
 		return;
 	}
 	process->sleep_node.owner = sleep_queue;
-
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (!candidate) {
-			printf("null candidate?\n");
-			continue;
-		}
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = seconds;
-	proc->end_subtick = subseconds;
-	proc->is_fswait = 0;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
-	spin_unlock(sleep_lock);
+	timer_arm(&process_timers(process)->sleep, (uint64_t)seconds * 1000000 + subseconds);
 }
 
 uint8_t process_compare(void * proc_v, void * pid_v) {
@@ -1056,21 +1520,9 @@ int process_timeout_sleep(process_t * process, int timeout) {
 	unsigned long s, ss;
 	relative_time(0, timeout * 1000, &s, &ss);
 
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > s || (candidate->end_tick == s && candidate->end_subtick > ss)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = s;
-	proc->end_subtick = ss;
-	proc->is_fswait = 1;
-	list_insert(((process_t *)process)->node_waits, proc);
-	process->timeout_node = list_insert_after(sleep_queue, before, proc);
+	struct timer * timer = &process_timers(process)->timeout;
+	list_insert(process->node_waits, timer);
+	timer_arm(timer, (uint64_t)s * 1000000 + ss);
 
 	return 0;
 }
@@ -1112,8 +1564,6 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 
 	if (timeout > 0) {
 		process_timeout_sleep(process, timeout);
-	} else {
-		process->timeout_node = NULL;
 	}
 
 	process->awoken_index = -1;
@@ -1134,15 +1584,7 @@ int process_awaken_from_fswait(process_t * process, int index) {
 	free(process->node_waits);
 	process->node_waits = NULL;
 
-	if (process->timeout_node && process->timeout_node->owner == sleep_queue) {
-		sleeper_t * proc = process->timeout_node->value;
-		if (proc->is_fswait != -1) {
-			list_delete(sleep_queue, process->timeout_node);
-			free(process->timeout_node->value);
-			free(process->timeout_node);
-		}
-	}
-	process->timeout_node = NULL;
+	timer_cancel(&process_timers(process)->timeout);
 
 	make_process_ready(process);
 	spin_unlock(process->sched_lock);
@@ -1385,7 +1827,8 @@ pid_t clone(uintptr_t new_stack, uintptr_t thread_func, uintptr_t arg) {
 }
 
 process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * name, void * argp) {
-	process_t * proc = calloc(1,sizeof(process_t));
+	process_t * proc = calloc(1,PROCESS_ALLOC_SIZE);
+	process_timers_init(proc);
 
 	proc->flags = PROC_FLAG_IS_TASKLET | PROC_FLAG_STARTED;
 
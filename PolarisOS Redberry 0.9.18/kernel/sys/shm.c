@@ -119,10 +119,29 @@ static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
 	return chunk;
 }
 
+/**
+ * A chunk made by shm_map_frames: the frames belong to someone else,
+ * who gets told through @c release when the last mapping goes away.
+ * Those have no parent node.
+ */
+struct shm_borrowed {
+	shm_chunk_t chunk;
+	void (*release)(void * data);
+	void * data;
+};
+
 static int release_chunk (shm_chunk_t * chunk) {
 	if (chunk) {
 		chunk->ref_count--;
 
+		if (chunk->ref_count < 1 && !chunk->parent) {
+			struct shm_borrowed * borrowed = (struct shm_borrowed *)chunk;
+			borrowed->release(borrowed->data);
+			free(chunk->frames);
+			free(borrowed);
+			return 0;
+		}
+
 		/* Does the chunk need to be freed? */
 		if (chunk->ref_count < 1) {
 #if 0
@@ -161,7 +180,7 @@ static uintptr_t proc_sbrk(uint32_t num_pages, volatile process_t * volatile pro
 	return initial;
 }
 
-static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
+static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc, unsigned int flags) {
 	if (!chunk) {
 		return NULL;
 	}
@@ -181,7 +200,7 @@ static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
 				for (unsigned int i = 0; i < chunk->num_frames; ++i) {
 					union PML * page = mmu_get_page(last_address + (i << 12), MMU_GET_MAKE);
 					page->bits.page = chunk->frames[i];
-					mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+					mmu_frame_allocate(page, flags);
 					mapping->vaddrs[i] = last_address + (i << 12);
 				}
 
@@ -201,7 +220,7 @@ static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
 			for (unsigned int i = 0; i < chunk->num_frames; ++i) {
 				union PML * page = mmu_get_page(last_address + (i << 12), MMU_GET_MAKE);
 				page->bits.page = chunk->frames[i];
-				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+				mmu_frame_allocate(page, flags);
 				mapping->vaddrs[i] = last_address + (i << 12);
 			}
 
@@ -216,7 +235,7 @@ static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
 
 		union PML * page = mmu_get_page(new_vpage, MMU_GET_MAKE);
 		page->bits.page = chunk->frames[i];
-		mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+		mmu_frame_allocate(page, flags);
 		mapping->vaddrs[i] = new_vpage;
 	}
 
@@ -265,7 +284,7 @@ void * shm_obtain (char * path, size_t * size) {
 		chunk->ref_count++;
 	}
 
-	void * vshm_start = map_in(chunk, proc);
+	void * vshm_start = map_in(chunk, proc, MMU_FLAG_WRITABLE);
 	*size = chunk_size(chunk);
 
 	spin_unlock(bsl);
@@ -273,6 +292,26 @@ void * shm_obtain (char * path, size_t * size) {
 	return vshm_start;
 }
 
+/**
+ * @brief Unmap one of @p proc's mappings and drop its reference to the chunk. Needs bsl.
+ */
+static void unmap_out (process_t * proc, node_t * node) {
+	shm_mapping_t * mapping = (shm_mapping_t *)node->value;
+
+	/* Clear the mappings from the process's address space */
+	for (uint32_t i = 0; i < mapping->num_vaddrs; i++) {
+		union PML * page = mmu_get_page(mapping->vaddrs[i], 0);
+		page->bits.present = 0;
+		mmu_invalidate(mapping->vaddrs[i]);
+	}
+
+	/* Clean up */
+	release_chunk(mapping->chunk);
+	list_delete(proc->shm_mappings, node);
+	free(node);
+	free(mapping);
+}
+
 int shm_release (char * path) {
 	spin_lock(bsl);
 	process_t * proc = (process_t *)this_core->current_process;
@@ -303,23 +342,76 @@ int shm_release (char * path) {
 		return 1;
 	}
 
-	shm_mapping_t * mapping = (shm_mapping_t *)node->value;
+	unmap_out(proc, node);
 
-	/* Clear the mappings from the process's address space */
-	for (uint32_t i = 0; i < mapping->num_vaddrs; i++) {
-		union PML * page = mmu_get_page(mapping->vaddrs[i], 0);
-		page->bits.present = 0;
-		mmu_invalidate(mapping->vaddrs[i]);
+	spin_unlock(bsl);
+	return 0;
+}
+
+/**
+ * @brief Map frames that belong to someone else into the current process.
+ *
+ * This is how a filesystem hands out its pages without copying them; they
+ * go in the shared memory region like an shm_obtain chunk, and come out
+ * again with shm_unmap_frames or when the process exits. The caller has
+ * to keep the frames alive until @p release is called with @p data.
+ *
+ * @param frames    physical page numbers, copied
+ * @param writable  0 to map them read-only
+ * @returns where they were mapped, or NULL.
+ */
+void * shm_map_frames (uintptr_t * frames, size_t count, int writable, void (*release)(void *), void * data) {
+	if (!count) return NULL;
+
+	struct shm_borrowed * borrowed = malloc(sizeof(struct shm_borrowed));
+	borrowed->chunk.parent = NULL;
+	borrowed->chunk.lock = 0;
+	borrowed->chunk.ref_count = 1;
+	borrowed->chunk.num_frames = count;
+	borrowed->chunk.frames = malloc(sizeof(uintptr_t) * count);
+	memcpy(borrowed->chunk.frames, frames, sizeof(uintptr_t) * count);
+	borrowed->release = release;
+	borrowed->data = data;
+
+	spin_lock(bsl);
+	volatile process_t * volatile proc = this_core->current_process;
+
+	if (proc->group != 0) {
+		proc = process_from_pid(proc->group);
 	}
 
-	/* Clean up */
-	release_chunk(chunk);
-	list_delete(proc->shm_mappings, node);
-	free(node);
-	free(mapping);
+	void * vshm_start = map_in(&borrowed->chunk, proc, writable ? MMU_FLAG_WRITABLE : 0);
 
 	spin_unlock(bsl);
-	return 0;
+	return vshm_start;
+}
+
+/**
+ * @brief Undo shm_map_frames for the mapping at @p address.
+ *
+ * Only a mapping made with the same @p data is touched, so one owner
+ * can't take down another's, or a named chunk.
+ * @returns 0, or 1 if there was no such mapping.
+ */
+int shm_unmap_frames (void * address, void * data) {
+	spin_lock(bsl);
+	process_t * proc = (process_t *)this_core->current_process;
+
+	if (proc->group != 0) {
+		proc = process_from_pid(proc->group);
+	}
+
+	foreach (n, proc->shm_mappings) {
+		shm_mapping_t * m = (shm_mapping_t *)n->value;
+		if (m->vaddrs[0] != (uintptr_t)address) continue;
+		if (m->chunk->parent || ((struct shm_borrowed *)m->chunk)->data != data) break;
+		unmap_out(proc, n);
+		spin_unlock(bsl);
+		return 0;
+	}
+
+	spin_unlock(bsl);
+	return 1;
 }
 
 /* This function should only be called if the process's address space
@@ -955,6 +955,30 @@ long sys_pipe(int pipes[2]) {
 	return 0;
 }
 
+#ifdef SYS_SPLICE
+/* Only wired up once <syscall_nums.h> assigns SYS_SPLICE a number. */
+/**
+ * @brief Move data between two descriptors without copying it through userspace.
+ *
+ * One of @p fd_in and @p fd_out must be a pipe; the other can be a
+ * pipe, a file, or a socket. Returns the number of bytes moved, which
+ * may be less than @p len, or 0 at the end of the input.
+ */
+long sys_splice(int fd_in, int fd_out, size_t len, unsigned int flags) {
+	extern ssize_t unix_pipe_splice(fs_node_t * in, uint64_t * in_offset, fs_node_t * out, uint64_t * out_offset, size_t len, unsigned int flags);
+
+	if (!FD_CHECK(fd_in) || !FD_CHECK(fd_out)) return -EBADF;
+	if (!(FD_MODE(fd_in) & 01) || !(FD_MODE(fd_out) & 02)) return -EBADF;
+
+	uint64_t in_offset  = FD_OFFSET(fd_in);
+	uint64_t out_offset = FD_OFFSET(fd_out);
+	long result = unix_pipe_splice(FD_ENTRY(fd_in), &in_offset, FD_ENTRY(fd_out), &out_offset, len, flags);
+	FD_OFFSET(fd_in)  = in_offset;
+	FD_OFFSET(fd_out) = out_offset;
+	return result;
+}
+#endif
+
 long sys_signal(long signum, uintptr_t handler) {
 	if (signum >= NUMSIGNALS || signum < 0) return -EINVAL;
 	if (signum == SIGKILL || signum == SIGSTOP) return -EINVAL;
@@ -1216,6 +1240,9 @@ static scall_func syscalls[] = {
 	[SYS_SLEEPABS]     = (scall_func)(uintptr_t)sys_sleepabs,
 	[SYS_SLEEP]        = (scall_func)(uintptr_t)sys_sleep,
 	[SYS_PIPE]         = (scall_func)(uintptr_t)sys_pipe,
+#ifdef SYS_SPLICE
+	[SYS_SPLICE]       = (scall_func)(uintptr_t)sys_splice,
+#endif
 	[SYS_FSWAIT]       = (scall_func)(uintptr_t)sys_fswait,
 	[SYS_FSWAIT2]      = (scall_func)(uintptr_t)sys_fswait_timeout,
 	[SYS_FSWAIT3]      = (scall_func)(uintptr_t)sys_fswait_multi,
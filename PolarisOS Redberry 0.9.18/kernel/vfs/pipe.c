@@ -71,25 +71,25 @@ int pipe_unsize(fs_node_t * node) {
 	return out;
 }
 
-static inline void pipe_increment_read(pipe_device_t * pipe) {
-	spin_lock(pipe->ptr_lock);
-	pipe->read_ptr++;
-	if (pipe->read_ptr == pipe->size) {
-		pipe->read_ptr = 0;
-	}
-	spin_unlock(pipe->ptr_lock);
-}
-
-static inline void pipe_increment_write(pipe_device_t * pipe) {
-	spin_lock(pipe->ptr_lock);
-	pipe->write_ptr++;
-	if (pipe->write_ptr == pipe->size) {
-		pipe->write_ptr = 0;
-	}
-	spin_unlock(pipe->ptr_lock);
+/**
+ * @brief Copy @p amount bytes out at read_ptr, in at most two pieces. Needs ptr_lock.
+ */
+static void pipe_copy_out(pipe_device_t * pipe, uint8_t * buffer, size_t amount) {
+	size_t first = pipe->size - pipe->read_ptr;
+	if (first > amount) first = amount;
+	memcpy(buffer, pipe->buffer + pipe->read_ptr, first);
+	memcpy(buffer + first, pipe->buffer, amount - first);
+	pipe->read_ptr = (pipe->read_ptr + amount) % pipe->size;
 }
 
-static inline void pipe_increment_write_by(pipe_device_t * pipe, size_t amount) {
+/**
+ * @brief Copy @p amount bytes in at write_ptr, in at most two pieces. Needs ptr_lock.
+ */
+static void pipe_copy_in(pipe_device_t * pipe, const uint8_t * buffer, size_t amount) {
+	size_t first = pipe->size - pipe->write_ptr;
+	if (first > amount) first = amount;
+	memcpy(pipe->buffer + pipe->write_ptr, buffer, first);
+	memcpy(pipe->buffer, buffer + first, amount - first);
 	pipe->write_ptr = (pipe->write_ptr + amount) % pipe->size;
 }
 
@@ -108,6 +108,9 @@ static void pipe_alert_waiters(pipe_device_t * pipe) {
 	spin_unlock(pipe->alert_lock);
 }
 
+/**
+ * @brief Read whatever is in the pipe, up to @p size, blocking only if it's empty.
+ */
 ssize_t read_pipe(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	/* Retreive the pipe object associated with this file node */
 	pipe_device_t * pipe = (pipe_device_t *)node->device;
@@ -117,31 +120,33 @@ ssize_t read_pipe(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 		return 0;
 	}
 
-	size_t collected = 0;
-	while (collected == 0) {
-		spin_lock(pipe->lock_read);
-		if (pipe_unread(pipe) >= size) {
-			while (pipe_unread(pipe) > 0 && collected < size) {
-				buffer[collected] = pipe->buffer[pipe->read_ptr];
-				pipe_increment_read(pipe);
-				collected++;
-			}
-		}
-		wakeup_queue(pipe->wait_queue_writers);
-		/* Deschedule and switch */
-		if (collected == 0) {
-			if (sleep_on_unlocking(pipe->wait_queue_readers, &pipe->lock_read)) {
-				if (!collected) return -ERESTARTSYS;
-				break;
-			}
-		} else {
-			spin_unlock(pipe->lock_read);
+	if (!size) return 0;
+
+	spin_lock(pipe->ptr_lock);
+	while (!pipe_unread(pipe)) {
+		if (sleep_on_unlocking(pipe->wait_queue_readers, &pipe->ptr_lock)) {
+			return -ERESTARTSYS;
 		}
+		spin_lock(pipe->ptr_lock);
 	}
 
+	size_t collected = pipe_unread(pipe);
+	if (collected > size) collected = size;
+	pipe_copy_out(pipe, buffer, collected);
+
+	wakeup_queue(pipe->wait_queue_writers);
+	spin_unlock(pipe->ptr_lock);
+
 	return collected;
 }
 
+/**
+ * @brief Write to the pipe, blocking until there's room.
+ *
+ * Anything that fits in the buffer at all goes in in one piece, as
+ * the drivers using these write whole packets; anything larger is
+ * written as room appears.
+ */
 ssize_t write_pipe(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	/* Retreive the pipe object associated with this file node */
 	pipe_device_t * pipe = (pipe_device_t *)node->device;
@@ -152,28 +157,27 @@ ssize_t write_pipe(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer)
 	}
 
 	size_t written = 0;
+	spin_lock(pipe->ptr_lock);
 	while (written < size) {
-		spin_lock(pipe->lock_read);
-		/* These pipes enforce atomic writes, poorly. */
-		if (pipe_available(pipe) > size) {
-			while (pipe_available(pipe) > 0 && written < size) {
-				pipe->buffer[pipe->write_ptr] = buffer[written];
-				pipe_increment_write(pipe);
-				written++;
-			}
-		}
-		wakeup_queue(pipe->wait_queue_readers);
-		pipe_alert_waiters(pipe);
-		if (written < size) {
-			if (sleep_on_unlocking(pipe->wait_queue_writers, &pipe->lock_read)) {
+		size_t available = pipe_available(pipe);
+		if (!available || (size < pipe->size && available < size)) {
+			if (sleep_on_unlocking(pipe->wait_queue_writers, &pipe->ptr_lock)) {
 				if (!written) return -ERESTARTSYS;
-				break;
+				return written;
 			}
-		} else {
-			spin_unlock(pipe->lock_read);
+			spin_lock(pipe->ptr_lock);
+			continue;
 		}
+
+		size_t chunk = size - written < available ? size - written : available;
+		pipe_copy_in(pipe, buffer + written, chunk);
+		written += chunk;
+
+		wakeup_queue(pipe->wait_queue_readers);
 	}
+	spin_unlock(pipe->ptr_lock);
 
+	pipe_alert_waiters(pipe);
 	return written;
 }
 
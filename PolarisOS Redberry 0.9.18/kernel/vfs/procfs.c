@@ -352,11 +352,27 @@ static void meminfo_func(fs_node_t *node) {
 	size_t free  = total - mmu_used_memory();
 	size_t kheap = ((uintptr_t)sbrk(0) - 0xffffff0000000000UL) / 1024;
 
+	extern void malloc_heap_stats(uintptr_t * slab_total, uintptr_t * slab_used, uintptr_t * slab_cached, uintptr_t * slab_free, uintptr_t * big_total, uintptr_t * big_free);
+	uintptr_t slab_total, slab_used, slab_cached, slab_free, big_total, big_free;
+	malloc_heap_stats(&slab_total, &slab_used, &slab_cached, &slab_free, &big_total, &big_free);
+
+	/* Share of small-object pages not holding live objects: free cells, magazines, headers and page tails */
+	size_t slab_frag = slab_total ? 100 * (slab_total - slab_used) / slab_total : 0;
+
 	procfs_printf(node,
 		"MemTotal: %zu kB\n"
 		"MemFree: %zu kB\n"
 		"KHeapUse: %zu kB\n"
-		, total, free, kheap);
+		"KHeapSlab: %zu kB\n"
+		"KHeapSlabUsed: %zu kB\n"
+		"KHeapSlabCached: %zu kB\n"
+		"KHeapSlabFree: %zu kB\n"
+		"KHeapSlabFrag: %zu%%\n"
+		"KHeapBig: %zu kB\n"
+		"KHeapBigFree: %zu kB\n"
+		, total, free, kheap,
+		slab_total / 1024, slab_used / 1024, slab_cached / 1024, slab_free / 1024, slab_frag,
+		big_total / 1024, big_free / 1024);
 }
 
 #ifdef __x86_64__
@@ -563,6 +579,39 @@ static void idle_func(fs_node_t *node) {
 	}
 }
 
+static void schedstat_func(fs_node_t *node) {
+	extern void sched_core_stats(int core, size_t * queued, uint64_t * switches, uint64_t * steals, uint64_t * migrations, uint64_t * ipis);
+	procfs_printf(node, "core queued switches steals migrations ipis\n");
+	for (int i = 0; i < processor_count; ++i) {
+		size_t queued;
+		uint64_t switches, steals, migrations, ipis;
+		sched_core_stats(i, &queued, &switches, &steals, &migrations, &ipis);
+		procfs_printf(node, "%d %zu %lu %lu %lu %lu\n", i, queued, switches, steals, migrations, ipis);
+	}
+}
+
+static void slabinfo_func(fs_node_t *node) {
+	extern int slab_cache_info(int index, const char ** name, uintptr_t * size, uintptr_t * in_use, uintptr_t * cached, uintptr_t * total, uintptr_t * depot, uint64_t * refills, uint64_t * drains);
+	procfs_printf(node, "name size inuse cached total depot refills drains\n");
+	const char * name;
+	uintptr_t size, in_use, cached, total, depot;
+	uint64_t refills, drains;
+	for (int i = 0; slab_cache_info(i, &name, &size, &in_use, &cached, &total, &depot, &refills, &drains); ++i) {
+		procfs_printf(node, "%s %zu %zu %zu %zu %zu %lu %lu\n", name, size, in_use, cached, total, depot, refills, drains);
+	}
+}
+
+static void timerstat_func(fs_node_t *node) {
+	extern void timer_core_stats(int core, size_t * armed, uint64_t * runs, uint64_t * fired, uint64_t * cancelled, uint64_t * cascaded);
+	procfs_printf(node, "core armed interrupts fired cancelled cascaded\n");
+	for (int i = 0; i < processor_count; ++i) {
+		size_t armed;
+		uint64_t runs, fired, cancelled, cascaded;
+		timer_core_stats(i, &armed, &runs, &fired, &cancelled, &cascaded);
+		procfs_printf(node, "%d %zu %lu %lu %lu %lu\n", i, armed, runs, fired, cancelled, cascaded);
+	}
+}
+
 static void kallsyms_func(fs_node_t *fnode) {
 	/* This doesn't include module symbols at the moment... */
 	list_t * syms = ksym_list();
@@ -589,6 +638,9 @@ static struct procfs_entry std_entries[] = {
 	{-11,"idle",     idle_func},
 	{-12,"kallsyms", kallsyms_func},
 	{-13,"pci",      pci_func},
+	{-16,"schedstat",schedstat_func},
+	{-17,"slabinfo", slabinfo_func},
+	{-18,"timerstat",timerstat_func},
 #ifdef __x86_64__
 	{-14,"irq",      irq_func},
 	{-15,"pat",      pat_func},
@@ -493,7 +493,11 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 }
 
 int tarfs_register_init(void) {
+	extern void vfs_dcache_register(fs_node_t * (*finddir)(fs_node_t *, char *));
 	vfs_register("tar", tar_mount);
+	/* Read-only, so lookups never go stale */
+	vfs_dcache_register(finddir_tar_root);
+	vfs_dcache_register(finddir_tarfs);
 	return 0;
 }
 
@@ -5,6 +5,10 @@
  * Generally provides the filesystem for "migrated" live CDs,
  * as well as /tmp and /var.
  *
+ * Directories are hashed by name. File data lives in runs of
+ * contiguous frames, and a file can be mapped into a process
+ * straight from them with the TMPFS_IOCTL_MMAP ioctl.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -31,18 +35,89 @@
 #define TMPFS_TYPE_DIR  2
 #define TMPFS_TYPE_LINK 3
 
+/* The most frames a file grows by at once, 1MiB */
+#define TMPFS_EXTENT_MAX 256
+#define TMPFS_HASH_MIN   16
+
+#define TMPFS_IOCTL_MMAP   0x544D
+#define TMPFS_IOCTL_MUNMAP 0x544E
+
+/**
+ * Argument to TMPFS_IOCTL_MMAP, which fills it in, and
+ * TMPFS_IOCTL_MUNMAP, which wants the same @c address back.
+ */
+struct tmpfs_mmap {
+	void * address;
+	size_t size;
+};
+
+/**
+ * Blocks @c block through @c block + @c count - 1 of a file,
+ * in physically contiguous frames starting at @c frame.
+ */
+struct tmpfs_extent {
+	size_t block;
+	uintptr_t frame;
+	size_t count;
+};
+
+/**
+ * What a file or symlink is allocated as. The data is in @c extents,
+ * sorted and without gaps; the @c blocks array of the tmpfs_file is
+ * not used.
+ *
+ * @c lock covers all of it, but the data is copied in and out with only
+ * @c readers or @c writer held, so reads of one file can run at once.
+ */
+struct tmpfs_inode {
+	struct tmpfs_file file;
+	struct tmpfs_extent * extents;
+	size_t extent_count;
+	size_t extent_space;
+	int readers;
+	int writer;
+	int mappings;	/* Live TMPFS_IOCTL_MMAP mappings */
+	int unlinked;	/* Unlinked while mapped, freed with the last mapping */
+};
+
+/**
+ * An entry in a directory's hash. The list node is the entry's place
+ * in @c files, which keeps creation order for readdir.
+ */
+struct tmpfs_dirent {
+	struct tmpfs_dirent * next;
+	uint32_t hash;
+	node_t * node;
+	struct tmpfs_file * file;
+};
+
+/**
+ * What a directory is allocated as: the entries are hashed by name, and
+ * where the last readdir got to is kept so the next index is one step
+ * on rather than a walk from the start. All under @c dir.lock.
+ */
+struct tmpfs_directory {
+	struct tmpfs_dir dir;
+	struct tmpfs_dirent ** buckets;
+	size_t bucket_count;
+	node_t * cursor;
+	uint64_t cursor_index;
+};
+
 static struct tmpfs_dir * tmpfs_root = NULL;
 static volatile intptr_t tmpfs_total_blocks = 0;
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d);
+static void tmpfs_file_destroy(struct tmpfs_inode * i);
 
 static struct tmpfs_file * tmpfs_file_new(char * name) {
-	struct tmpfs_file * t = malloc(sizeof(struct tmpfs_file));
+	struct tmpfs_inode * i = malloc(sizeof(struct tmpfs_inode));
+	struct tmpfs_file * t = &i->file;
 	spin_init(t->lock);
 	t->name = strdup(name);
 	t->type = TMPFS_TYPE_FILE;
 	t->length = 0;
-	t->pointers = 2;
+	t->pointers = 0;
 	t->block_count = 0;
 	t->mask = 0;
 	t->uid = 0;
@@ -50,26 +125,83 @@ static struct tmpfs_file * tmpfs_file_new(char * name) {
 	t->atime = now();
 	t->mtime = t->atime;
 	t->ctime = t->atime;
-	t->blocks = malloc(t->pointers * sizeof(char *));
-	for (size_t i = 0; i < t->pointers; ++i) {
-		t->blocks[i] = 0;
-	}
+	t->blocks = NULL;
+	i->extents = NULL;
+	i->extent_count = 0;
+	i->extent_space = 0;
+	i->readers = 0;
+	i->writer = 0;
+	i->mappings = 0;
+	i->unlinked = 0;
 
 	return t;
 }
 
-static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
-	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->device;
+static uint32_t tmpfs_hash(const char * name) {
+	uint32_t hash = 2166136261U;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
 
-	spin_lock(d->lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(d->lock);
-			return -EEXIST; /* Already exists */
+/**
+ * @brief Find where the entry called @p name is, or would go, in its chain.
+ */
+static struct tmpfs_dirent ** tmpfs_dir_slot(struct tmpfs_directory * d, const char * name, uint32_t hash) {
+	struct tmpfs_dirent ** slot = &d->buckets[hash & (d->bucket_count - 1)];
+	while (*slot && ((*slot)->hash != hash || strcmp((*slot)->file->name, name))) {
+		slot = &(*slot)->next;
+	}
+	return slot;
+}
+
+/**
+ * @brief Add @p t to a directory, which must not have one by that name yet.
+ */
+static void tmpfs_dir_add(struct tmpfs_directory * d, struct tmpfs_file * t, uint32_t hash) {
+	if (d->dir.files->length >= d->bucket_count) {
+		/* Keep the chains short */
+		size_t count = d->bucket_count * 2;
+		struct tmpfs_dirent ** buckets = malloc(sizeof(struct tmpfs_dirent *) * count);
+		memset(buckets, 0, sizeof(struct tmpfs_dirent *) * count);
+		for (size_t b = 0; b < d->bucket_count; ++b) {
+			struct tmpfs_dirent * e = d->buckets[b];
+			while (e) {
+				struct tmpfs_dirent * next = e->next;
+				e->next = buckets[e->hash & (count - 1)];
+				buckets[e->hash & (count - 1)] = e;
+				e = next;
+			}
 		}
+		free(d->buckets);
+		d->buckets = buckets;
+		d->bucket_count = count;
 	}
-	spin_unlock(d->lock);
+
+	struct tmpfs_dirent * e = malloc(sizeof(struct tmpfs_dirent));
+	struct tmpfs_dirent ** bucket = &d->buckets[hash & (d->bucket_count - 1)];
+	e->hash = hash;
+	e->file = t;
+	e->node = list_insert(d->dir.files, t);
+	e->next = *bucket;
+	*bucket = e;
+}
+
+static void tmpfs_dir_remove(struct tmpfs_directory * d, struct tmpfs_dirent ** slot) {
+	struct tmpfs_dirent * e = *slot;
+	*slot = e->next;
+	/* Everything after it moves down an index */
+	d->cursor = NULL;
+	list_delete(d->dir.files, e->node);
+	free(e->node);
+	free(e);
+}
+
+static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
+	struct tmpfs_directory * d = (struct tmpfs_directory *)parent->device;
+	uint32_t hash = tmpfs_hash(name);
 
 	struct tmpfs_file * t = tmpfs_file_new(name);
 	t->type = TMPFS_TYPE_LINK;
@@ -80,9 +212,14 @@ static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
 	t->uid = this_core->current_process->user;
 	t->gid = this_core->current_process->user;
 
-	spin_lock(d->lock);
-	list_insert(d->files, t);
-	spin_unlock(d->lock);
+	spin_lock(d->dir.lock);
+	if (*tmpfs_dir_slot(d, name, hash)) {
+		spin_unlock(d->dir.lock);
+		tmpfs_file_destroy((struct tmpfs_inode *)t);
+		return -EEXIST; /* Already exists */
+	}
+	tmpfs_dir_add(d, t, hash);
+	spin_unlock(d->dir.lock);
 
 	return 0;
 }
@@ -111,7 +248,8 @@ static ssize_t readlink_tmpfs(fs_node_t * node, char * buf, size_t size) {
 }
 
 static struct tmpfs_dir * tmpfs_dir_new(char * name, struct tmpfs_dir * parent) {
-	struct tmpfs_dir * d = malloc(sizeof(struct tmpfs_dir));
+	struct tmpfs_directory * dir = malloc(sizeof(struct tmpfs_directory));
+	struct tmpfs_dir * d = &dir->dir;
 	spin_init(d->lock);
 	d->name = strdup(name);
 	d->type = TMPFS_TYPE_DIR;
@@ -122,55 +260,188 @@ static struct tmpfs_dir * tmpfs_dir_new(char * name, struct tmpfs_dir * parent)
 	d->mtime = d->atime;
 	d->ctime = d->atime;
 	d->files = list_create("tmpfs directory entries",d);
+	dir->bucket_count = TMPFS_HASH_MIN;
+	dir->buckets = malloc(sizeof(struct tmpfs_dirent *) * dir->bucket_count);
+	memset(dir->buckets, 0, sizeof(struct tmpfs_dirent *) * dir->bucket_count);
+	dir->cursor = NULL;
+	dir->cursor_index = 0;
 	return d;
 }
 
-static void tmpfs_file_free(struct tmpfs_file * t) {
-	spin_lock(t->lock);
+/**
+ * @brief Give a file's frames back and free it. Nothing else can see it anymore.
+ */
+static void tmpfs_file_destroy(struct tmpfs_inode * i) {
+	struct tmpfs_file * t = &i->file;
 	if (t->type == TMPFS_TYPE_LINK) {
 		/* free target string */
 		free(t->target);
 	}
-	for (size_t i = 0; i < t->block_count; ++i) {
-		mmu_frame_release((uintptr_t)t->blocks[i] * 0x1000);
-		tmpfs_total_blocks--;
+	for (size_t e = 0; e < i->extent_count; ++e) {
+		for (size_t f = 0; f < i->extents[e].count; ++f) {
+			mmu_frame_release((i->extents[e].frame + f) << 12);
+		}
+	}
+	__sync_sub_and_fetch(&tmpfs_total_blocks, t->block_count);
+	free(i->extents);
+	free(t->name);
+	free(i);
+}
+
+/**
+ * @brief Free an unlinked file, or leave that to the last process that has it mapped.
+ */
+static void tmpfs_file_free(struct tmpfs_file * t) {
+	struct tmpfs_inode * i = (struct tmpfs_inode *)t;
+	spin_lock(t->lock);
+	if (i->mappings) {
+		i->unlinked = 1;
+		spin_unlock(t->lock);
+		return;
 	}
 	spin_unlock(t->lock);
+	tmpfs_file_destroy(i);
 }
 
-static void tmpfs_file_blocks_embiggen(struct tmpfs_file * t) {
-	t->pointers *= 2;
-	t->blocks = realloc(t->blocks, sizeof(char *) * t->pointers);
+/**
+ * @brief Wait out any writer, then count ourselves as a reader.
+ */
+static void tmpfs_read_lock(struct tmpfs_inode * i) {
+	while (1) {
+		spin_lock(i->file.lock);
+		if (!i->writer) {
+			i->readers++;
+			spin_unlock(i->file.lock);
+			return;
+		}
+		spin_unlock(i->file.lock);
+		switch_task(1);
+	}
+}
+
+/**
+ * @brief Done reading, which is also when the access time moves.
+ */
+static void tmpfs_read_unlock(struct tmpfs_inode * i) {
+	spin_lock(i->file.lock);
+	i->file.atime = now();
+	i->readers--;
+	spin_unlock(i->file.lock);
 }
 
-static char * tmpfs_file_getset_block(struct tmpfs_file * t, size_t blockid, int create) {
-	if (create) {
-		while (blockid >= t->pointers) {
-			tmpfs_file_blocks_embiggen(t);
+/**
+ * @brief Take the file for ourselves: stop new readers, then wait for the ones there are.
+ */
+static void tmpfs_write_lock(struct tmpfs_inode * i) {
+	while (1) {
+		spin_lock(i->file.lock);
+		if (!i->writer) {
+			i->writer = 1;
+			spin_unlock(i->file.lock);
+			break;
 		}
-		while (blockid >= t->block_count) {
-			uintptr_t index = mmu_allocate_a_frame();
-			tmpfs_total_blocks++;
-			t->blocks[t->block_count] = index;
-			t->block_count += 1;
+		spin_unlock(i->file.lock);
+		switch_task(1);
+	}
+	while (1) {
+		spin_lock(i->file.lock);
+		int readers = i->readers;
+		spin_unlock(i->file.lock);
+		if (!readers) break;
+		switch_task(1);
+	}
+}
+
+static void tmpfs_write_unlock(struct tmpfs_inode * i) {
+	spin_lock(i->file.lock);
+	i->writer = 0;
+	spin_unlock(i->file.lock);
+}
+
+/**
+ * @brief Find the extent holding @p block, which must be one the file has.
+ */
+static size_t tmpfs_extent_find(struct tmpfs_inode * i, size_t block) {
+	size_t low = 0, high = i->extent_count;
+	while (high - low > 1) {
+		size_t middle = (low + high) / 2;
+		if (i->extents[middle].block <= block) low = middle;
+		else high = middle;
+	}
+	return low;
+}
+
+/**
+ * @brief Give a file at least @p blocks blocks. Needs the write lock.
+ *
+ * Grows by as much as the file already has, up to TMPFS_EXTENT_MAX, so a
+ * file written a page at a time still ends up in a few big extents;
+ * when memory is too broken up for a run that long, takes shorter ones.
+ */
+static void tmpfs_extents_grow(struct tmpfs_inode * i, size_t blocks) {
+	struct tmpfs_file * t = &i->file;
+
+	while (t->block_count < blocks) {
+		size_t want = blocks - t->block_count;
+		if (want < t->block_count) want = t->block_count;
+		if (want > TMPFS_EXTENT_MAX) want = TMPFS_EXTENT_MAX;
+
+		uintptr_t frame = (uintptr_t)-1;
+		while (want > 1 && (frame = mmu_try_allocate_n_frames(want)) == (uintptr_t)-1) want /= 2;
+		if (frame == (uintptr_t)-1) {
+			want = 1;
+			frame = mmu_allocate_a_frame();
 		}
-	} else {
-		if (blockid >= t->block_count) {
-			printf("tmpfs: not enough blocks?\n");
-			return NULL;
+
+		struct tmpfs_extent * last = i->extent_count ? &i->extents[i->extent_count - 1] : NULL;
+		if (last && last->frame + last->count == frame) {
+			last->count += want;
+		} else {
+			if (i->extent_count == i->extent_space) {
+				i->extent_space = i->extent_space ? i->extent_space * 2 : 4;
+				i->extents = realloc(i->extents, sizeof(struct tmpfs_extent) * i->extent_space);
+			}
+			i->extents[i->extent_count].block = t->block_count;
+			i->extents[i->extent_count].frame = frame;
+			i->extents[i->extent_count].count = want;
+			i->extent_count++;
 		}
-	}
 
-	return (char *)mmu_map_from_physical(t->blocks[blockid] << 12);
+		t->block_count += want;
+		__sync_add_and_fetch(&tmpfs_total_blocks, want);
+	}
 }
 
+/**
+ * @brief Copy between @p buffer and bytes @p offset to @p offset + @p size of a file,
+ *        which has blocks for all of them; one memcpy per extent.
+ *
+ * With a NULL @p buffer and @p write set, zeroes them instead.
+ */
+static void tmpfs_copy(struct tmpfs_inode * i, uint64_t offset, size_t size, uint8_t * buffer, int write) {
+	size_t e = tmpfs_extent_find(i, offset / BLOCKSIZE);
+	size_t done = 0;
+
+	while (done < size) {
+		struct tmpfs_extent * x = &i->extents[e++];
+		uint64_t into = offset + done - (uint64_t)x->block * BLOCKSIZE;
+		size_t chunk = x->count * BLOCKSIZE - into;
+		if (chunk > size - done) chunk = size - done;
+
+		uint8_t * data = (uint8_t *)mmu_map_from_physical(x->frame << 12) + into;
+		if (!write) memcpy(buffer + done, data, chunk);
+		else if (buffer) memcpy(data, buffer + done, chunk);
+		else memset(data, 0, chunk);
+
+		done += chunk;
+	}
+}
 
 static ssize_t read_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
-
-	spin_lock(t->lock);
+	struct tmpfs_inode * i = (struct tmpfs_inode *)(node->device);
+	struct tmpfs_file * t = &i->file;
 
-	t->atime = now();
+	tmpfs_read_lock(i);
 
 	uint64_t end;
 	if ((size_t)offset + size > t->length) {
@@ -178,80 +449,43 @@ static ssize_t read_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 	} else {
 		end = offset + size;
 	}
-	uint64_t start_block  = offset / BLOCKSIZE;
-	uint64_t end_block    = end / BLOCKSIZE;
-	uint64_t end_size     = end - end_block * BLOCKSIZE;
-	uint64_t size_to_read = end - offset;
-	if (start_block == end_block && (size_t)offset == end) {
-		spin_unlock(t->lock);
+	if ((uint64_t)offset >= end) {
+		tmpfs_read_unlock(i);
 		return 0;
 	}
-	if (start_block == end_block) {
-		void *buf = tmpfs_file_getset_block(t, start_block, 0);
-		memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), size_to_read);
-		spin_unlock(t->lock);
-		return size_to_read;
-	} else {
-		uint64_t block_offset;
-		uint64_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
-				memcpy(buffer, (uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), BLOCKSIZE - (offset % BLOCKSIZE));
-			} else {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
-				memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, BLOCKSIZE);
-			}
-		}
-		if (end_size) {
-			void *buf = tmpfs_file_getset_block(t, end_block, 0);
-			memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, end_size);
-		}
-	}
-	spin_unlock(t->lock);
-	return size_to_read;
+
+	tmpfs_copy(i, offset, end - offset, buffer, 0);
+
+	tmpfs_read_unlock(i);
+	return end - offset;
 }
 
 static ssize_t write_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
+	struct tmpfs_inode * i = (struct tmpfs_inode *)(node->device);
+	struct tmpfs_file * t = &i->file;
 
-	spin_lock(t->lock);
+	if (!size) return 0;
+
+	tmpfs_write_lock(i);
 	t->atime = now();
 	t->mtime = t->atime;
 
-	uint64_t end;
-	if ((size_t)offset + size > t->length) {
-		t->length = offset + size;
-	}
-	end = offset + size;
-	uint64_t start_block  = offset / BLOCKSIZE;
-	uint64_t end_block    = end / BLOCKSIZE;
-	uint64_t end_size     = end - end_block * BLOCKSIZE;
-	uint64_t size_to_read = end - offset;
-	if (start_block == end_block) {
-		void *buf = tmpfs_file_getset_block(t, start_block, 1);
-		memcpy((uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, size_to_read);
-		spin_unlock(t->lock);
-		return size_to_read;
-	} else {
-		uint64_t block_offset;
-		uint64_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
-				memcpy((uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, BLOCKSIZE - (offset % BLOCKSIZE));
-			} else {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
-				memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), BLOCKSIZE);
-			}
-		}
-		if (end_size) {
-			void *buf = tmpfs_file_getset_block(t, end_block, 1);
-			memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), end_size);
-		}
+	uint64_t end = offset + size;
+	tmpfs_extents_grow(i, (end + BLOCKSIZE - 1) / BLOCKSIZE);
+
+	/* Fresh frames have whatever was in them last, don't let a gap show it */
+	if ((uint64_t)offset > t->length) {
+		tmpfs_copy(i, t->length, offset - t->length, NULL, 1);
 	}
-	spin_unlock(t->lock);
-	return size_to_read;
+
+	tmpfs_copy(i, offset, size, buffer, 1);
+
+	if (end > t->length) {
+		t->length = end;
+	}
+
+	tmpfs_write_unlock(i);
+	return size;
 }
 
 static int chmod_tmpfs(fs_node_t * node, int mode) {
@@ -275,20 +509,105 @@ static int chown_tmpfs(fs_node_t * node, int uid, int gid) {
 }
 
 static int truncate_tmpfs(fs_node_t * node) {
-	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
-	spin_lock(t->lock);
-	for (size_t i = 0; i < t->block_count; ++i) {
-		mmu_frame_release((uintptr_t)t->blocks[i] * 0x1000);
-		tmpfs_total_blocks--;
-		t->blocks[i] = 0;
+	struct tmpfs_inode * i = (struct tmpfs_inode *)(node->device);
+	struct tmpfs_file * t = &i->file;
+	tmpfs_write_lock(i);
+	if (i->mappings) {
+		/* Someone is still using the frames */
+		tmpfs_write_unlock(i);
+		return -EBUSY;
 	}
+	for (size_t e = 0; e < i->extent_count; ++e) {
+		for (size_t f = 0; f < i->extents[e].count; ++f) {
+			mmu_frame_release((i->extents[e].frame + f) << 12);
+		}
+	}
+	__sync_sub_and_fetch(&tmpfs_total_blocks, t->block_count);
+	i->extent_count = 0;
 	t->block_count = 0;
 	t->length = 0;
 	t->mtime = node->atime;
+	tmpfs_write_unlock(i);
+	return 0;
+}
+
+/**
+ * @brief Called by the SHM subsystem when a mapping of the file goes away.
+ */
+static void tmpfs_unmapped(void * data) {
+	struct tmpfs_inode * i = data;
+	spin_lock(i->file.lock);
+	int gone = !--i->mappings && i->unlinked;
+	spin_unlock(i->file.lock);
+	if (gone) tmpfs_file_destroy(i);
+}
+
+/**
+ * @brief Map the whole file into the calling process, straight from its frames.
+ *
+ * The mapping is shared: stores to it land in the file, so it is only
+ * writable for someone who may write the file. It covers the length the
+ * file had at the time, rounded up to a page, and a file that's mapped
+ * somewhere can't be truncated.
+ */
+static int tmpfs_mmap(struct tmpfs_inode * i, struct tmpfs_mmap * out, int writable) {
+	extern void * shm_map_frames(uintptr_t * frames, size_t count, int writable, void (*release)(void *), void * data);
+	struct tmpfs_file * t = &i->file;
+
+	tmpfs_write_lock(i);
+	size_t count = (t->length + BLOCKSIZE - 1) / BLOCKSIZE;
+	if (!count) {
+		tmpfs_write_unlock(i);
+		return -EINVAL;
+	}
+
+	/* The rest of the last page is visible too */
+	if (t->length % BLOCKSIZE) {
+		tmpfs_copy(i, t->length, BLOCKSIZE - t->length % BLOCKSIZE, NULL, 1);
+	}
+
+	uintptr_t * frames = malloc(sizeof(uintptr_t) * count);
+	size_t n = 0;
+	for (size_t e = 0; e < i->extent_count && n < count; ++e) {
+		for (size_t f = 0; f < i->extents[e].count && n < count; ++f) {
+			frames[n++] = i->extents[e].frame + f;
+		}
+	}
+
+	spin_lock(t->lock);
+	i->mappings++;
 	spin_unlock(t->lock);
+	tmpfs_write_unlock(i);
+
+	void * address = shm_map_frames(frames, count, writable, tmpfs_unmapped, i);
+	free(frames);
+	if (!address) {
+		tmpfs_unmapped(i);
+		return -ENOMEM;
+	}
+
+	out->address = address;
+	out->size = count * BLOCKSIZE;
 	return 0;
 }
 
+static int ioctl_tmpfs(fs_node_t * node, unsigned long request, void * argp) {
+	extern int shm_unmap_frames(void * address, void * data);
+	struct tmpfs_inode * i = (struct tmpfs_inode *)(node->device);
+	struct tmpfs_mmap * arg = argp;
+
+	switch (request) {
+		case TMPFS_IOCTL_MMAP:
+			if (!arg) return -EFAULT;
+			return tmpfs_mmap(i, arg, has_permission(node, 02));
+		case TMPFS_IOCTL_MUNMAP:
+			if (!arg) return -EFAULT;
+			return shm_unmap_frames(arg->address, i) ? -EINVAL : 0;
+		default:
+			return -EINVAL;
+	}
+}
+
 static void open_tmpfs(fs_node_t * node, unsigned int flags) {
 	struct tmpfs_file * t = (struct tmpfs_file *)(node->device);
 
@@ -319,6 +638,7 @@ static fs_node_t * tmpfs_from_file(struct tmpfs_file * t) {
 	fnode->chown   = chown_tmpfs;
 	fnode->length  = t->length;
 	fnode->truncate = truncate_tmpfs;
+	fnode->ioctl   = ioctl_tmpfs;
 	fnode->nlink   = 1;
 	spin_unlock(t->lock);
 	return fnode;
@@ -330,6 +650,7 @@ static fs_node_t * tmpfs_from_link(struct tmpfs_file * t) {
 	fnode->readlink = readlink_tmpfs;
 	fnode->read     = NULL;
 	fnode->write    = NULL;
+	fnode->ioctl    = NULL;
 	fnode->create   = NULL;
 	fnode->mkdir    = NULL;
 	fnode->readdir  = NULL;
@@ -338,8 +659,7 @@ static fs_node_t * tmpfs_from_link(struct tmpfs_file * t) {
 }
 
 static struct dirent * readdir_tmpfs(fs_node_t *node, uint64_t index) {
-	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
-	uint64_t i = 0;
+	struct tmpfs_directory * d = (struct tmpfs_directory *)node->device;
 
 	if (index == 0) {
 		struct dirent * out = malloc(sizeof(struct dirent));
@@ -359,123 +679,126 @@ static struct dirent * readdir_tmpfs(fs_node_t *node, uint64_t index) {
 
 	index -= 2;
 
-	if (index >= d->files->length) return NULL;
+	spin_lock(d->dir.lock);
+	if (index >= d->dir.files->length) {
+		spin_unlock(d->dir.lock);
+		return NULL;
+	}
 
-	foreach(f, d->files) {
-		if (i == index) {
-			struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-			struct dirent * out = malloc(sizeof(struct dirent));
-			memset(out, 0x00, sizeof(struct dirent));
-			out->d_ino = (uint64_t)t;
-			strcpy(out->d_name, t->name);
-			return out;
-		} else {
-			++i;
-		}
+	/* Usually this is the one after last time */
+	node_t * f;
+	if (d->cursor && index == d->cursor_index + 1) {
+		f = d->cursor->next;
+	} else if (d->cursor && index == d->cursor_index) {
+		f = d->cursor;
+	} else {
+		f = d->dir.files->head;
+		for (uint64_t i = 0; i < index; ++i) f = f->next;
 	}
-	return NULL;
+	d->cursor = f;
+	d->cursor_index = index;
+
+	struct tmpfs_file * t = (struct tmpfs_file *)f->value;
+	struct dirent * out = malloc(sizeof(struct dirent));
+	memset(out, 0x00, sizeof(struct dirent));
+	out->d_ino = (uint64_t)t;
+	strcpy(out->d_name, t->name);
+	spin_unlock(d->dir.lock);
+	return out;
 }
 
 static fs_node_t * finddir_tmpfs(fs_node_t * node, char * name) {
 	if (!name) return NULL;
 
-	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
-
-	spin_lock(d->lock);
-
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			fs_node_t * out = NULL;
-			switch (t->type) {
-				case TMPFS_TYPE_FILE:
-					out = tmpfs_from_file(t);
-					break;
-				case TMPFS_TYPE_LINK:
-					out = tmpfs_from_link(t);
-					break;
-				case TMPFS_TYPE_DIR:
-					out = tmpfs_from_dir((struct tmpfs_dir *)t);
-					break;
-			}
-			spin_unlock(d->lock);
-			return out;
+	struct tmpfs_directory * d = (struct tmpfs_directory *)node->device;
+	uint32_t hash = tmpfs_hash(name);
+
+	spin_lock(d->dir.lock);
+
+	struct tmpfs_dirent * e = *tmpfs_dir_slot(d, name, hash);
+	fs_node_t * out = NULL;
+	if (e) {
+		struct tmpfs_file * t = e->file;
+		switch (t->type) {
+			case TMPFS_TYPE_FILE:
+				out = tmpfs_from_file(t);
+				break;
+			case TMPFS_TYPE_LINK:
+				out = tmpfs_from_link(t);
+				break;
+			case TMPFS_TYPE_DIR:
+				out = tmpfs_from_dir((struct tmpfs_dir *)t);
+				break;
 		}
 	}
 
-	spin_unlock(d->lock);
-	return NULL;
+	spin_unlock(d->dir.lock);
+	return out;
 }
 
 
 static int try_free_dir(struct tmpfs_dir * d) {
+	struct tmpfs_directory * dir = (struct tmpfs_directory *)d;
 	spin_lock(d->lock);
 	if (d->files && d->files->length != 0) {
 		spin_unlock(d->lock);
 		return 1;
 	}
 	free(d->files);
+	free(dir->buckets);
+	free(d->name);
 	spin_unlock(d->lock);
 	return 0;
 }
 
 static int unlink_tmpfs(fs_node_t * node, char * name) {
-	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
-	int i = -1, j = 0;
+	struct tmpfs_directory * d = (struct tmpfs_directory *)node->device;
+	uint32_t hash = tmpfs_hash(name);
 
-	spin_lock(d->lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			if (t->type == TMPFS_TYPE_DIR) {
-				if (try_free_dir((void*)t)) {
-					spin_unlock(d->lock);
-					return -ENOTEMPTY;
-				}
-			} else {
-				tmpfs_file_free(t);
-			}
-			free(t);
-			i = j;
-			break;
-		}
-		j++;
+	spin_lock(d->dir.lock);
+	struct tmpfs_dirent ** slot = tmpfs_dir_slot(d, name, hash);
+	if (!*slot) {
+		spin_unlock(d->dir.lock);
+		return -ENOENT;
+	}
+
+	struct tmpfs_file * t = (*slot)->file;
+	if (t->type == TMPFS_TYPE_DIR && try_free_dir((void*)t)) {
+		spin_unlock(d->dir.lock);
+		return -ENOTEMPTY;
 	}
 
-	if (i >= 0) {
-		list_remove(d->files, i);
+	tmpfs_dir_remove(d, slot);
+	spin_unlock(d->dir.lock);
+
+	if (t->type == TMPFS_TYPE_DIR) {
+		free(t);
 	} else {
-		spin_unlock(d->lock);
-		return -ENOENT;
+		tmpfs_file_free(t);
 	}
 
-	spin_unlock(d->lock);
 	return 0;
 }
 
 static int create_tmpfs(fs_node_t *parent, char *name, mode_t permission) {
 	if (!name) return -EINVAL;
 
-	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->device;
-
-	spin_lock(d->lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(d->lock);
-			return -EEXIST; /* Already exists */
-		}
-	}
-	spin_unlock(d->lock);
+	struct tmpfs_directory * d = (struct tmpfs_directory *)parent->device;
+	uint32_t hash = tmpfs_hash(name);
 
 	struct tmpfs_file * t = tmpfs_file_new(name);
 	t->mask = permission;
 	t->uid = this_core->current_process->user;
 	t->gid = this_core->current_process->user_group;
 
-	spin_lock(d->lock);
-	list_insert(d->files, t);
-	spin_unlock(d->lock);
+	spin_lock(d->dir.lock);
+	if (*tmpfs_dir_slot(d, name, hash)) {
+		spin_unlock(d->dir.lock);
+		tmpfs_file_destroy((struct tmpfs_inode *)t);
+		return -EEXIST; /* Already exists */
+	}
+	tmpfs_dir_add(d, t, hash);
+	spin_unlock(d->dir.lock);
 
 	return 0;
 }
@@ -484,26 +807,23 @@ static int mkdir_tmpfs(fs_node_t * parent, char * name, mode_t permission) {
 	if (!name) return -EINVAL;
 	if (!strlen(name)) return -EINVAL;
 
-	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->device;
+	struct tmpfs_directory * d = (struct tmpfs_directory *)parent->device;
+	uint32_t hash = tmpfs_hash(name);
 
-	spin_lock(d->lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(d->lock);
-			return -EEXIST; /* Already exists */
-		}
-	}
-	spin_unlock(d->lock);
-
-	struct tmpfs_dir * out = tmpfs_dir_new(name, d);
+	struct tmpfs_dir * out = tmpfs_dir_new(name, &d->dir);
 	out->mask = permission;
 	out->uid  = this_core->current_process->user;
 	out->gid  = this_core->current_process->user;
 
-	spin_lock(d->lock);
-	list_insert(d->files, out);
-	spin_unlock(d->lock);
+	spin_lock(d->dir.lock);
+	if (*tmpfs_dir_slot(d, name, hash)) {
+		spin_unlock(d->dir.lock);
+		try_free_dir(out);
+		free(out);
+		return -EEXIST; /* Already exists */
+	}
+	tmpfs_dir_add(d, (struct tmpfs_file *)out, hash);
+	spin_unlock(d->dir.lock);
 
 	return 0;
 }
@@ -585,7 +905,9 @@ static struct procfs_entry tmpfs_entry = {
 };
 
 void tmpfs_register_init(void) {
+	extern void vfs_dcache_register(fs_node_t * (*finddir)(fs_node_t *, char *));
 	vfs_register("tmpfs", tmpfs_mount);
+	vfs_dcache_register(finddir_tmpfs);
 	procfs_install(&tmpfs_entry);
 }
 
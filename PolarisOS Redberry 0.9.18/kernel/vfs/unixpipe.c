@@ -4,6 +4,21 @@
  *
  * Provides for unidirectional communication between processes.
  *
+ * The buffer is a ring of up to UNIX_PIPE_PAGES pages, each holding a
+ * run of unread bytes. Writes fill the newest page before taking a new
+ * one, reads empty pages from the oldest end and give them back as they
+ * run dry, so an idle pipe holds no memory at all. Both are a memcpy per
+ * page touched, not a loop over bytes.
+ *
+ * Reads return whatever is there, up to the size asked for, and only
+ * block when the pipe is empty. Writes of up to PIPE_BUF bytes go in
+ * all at once or not at all; longer ones go in as room appears.
+ *
+ * Because the data is kept in whole pages, unix_pipe_splice can move it
+ * to another pipe by handing over the pages themselves, and to or from
+ * a file or socket by having that node read into or write from the
+ * page directly, without a trip through a userspace buffer.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -14,14 +29,25 @@
 #include <kernel/printf.h>
 #include <kernel/pipe.h>
 #include <kernel/string.h>
-#include <kernel/ringbuffer.h>
 #include <kernel/process.h>
 #include <kernel/signal.h>
+#include <kernel/spinlock.h>
+#include <kernel/mmu.h>
 
 #include <sys/signal_defs.h>
 #include <sys/ioctl.h>
 
-#define UNIX_PIPE_BUFFER 4096
+#define UNIX_PIPE_PAGES 16	/* 64KiB */
+#define UNIX_PIPE_PAGE  4096
+#define UNIX_PIPE_ATOMIC 4096	/* PIPE_BUF: writes this size or smaller are never split */
+
+#define SPLICE_F_NONBLOCK 0x02
+
+struct pipe_page {
+	uintptr_t frame;	/* Physical page number */
+	uint16_t offset;	/* First unread byte */
+	uint16_t length;	/* Unread bytes from there */
+};
 
 struct unix_pipe {
 	fs_node_t * read_end;
@@ -30,58 +56,232 @@ struct unix_pipe {
 	volatile int read_closed;
 	volatile int write_closed;
 
-	ring_buffer_t * buffer;
+	spin_lock_t lock;
+	struct pipe_page pages[UNIX_PIPE_PAGES];
+	unsigned int head;	/* Oldest page */
+	unsigned int count;	/* Pages in use */
+	unsigned int reserved;	/* Slots held for splices reading into a new page */
+	int splicing;	/* A splice is writing out of the oldest page */
+	size_t unread;
+
+	list_t * wait_queue_readers;
+	list_t * wait_queue_writers;
+	/* Behind a lock of its own: select waits on it with the scheduler locked */
+	spin_lock_t alert_lock;
+	list_t * alert_waiters;
 };
 
+static inline uint8_t * page_data(struct pipe_page * page) {
+	return (uint8_t *)mmu_map_from_physical(page->frame << 12) + page->offset;
+}
+
+static inline unsigned int pipe_free_slots(struct unix_pipe * self) {
+	return UNIX_PIPE_PAGES - self->count - self->reserved;
+}
+
+static inline struct pipe_page * pipe_tail(struct unix_pipe * self) {
+	return self->count ? &self->pages[(self->head + self->count - 1) % UNIX_PIPE_PAGES] : NULL;
+}
+
+/**
+ * @brief How many more bytes fit. Needs the lock.
+ */
+static size_t pipe_room(struct unix_pipe * self) {
+	size_t room = pipe_free_slots(self) * UNIX_PIPE_PAGE;
+	struct pipe_page * tail = pipe_tail(self);
+	if (tail) room += UNIX_PIPE_PAGE - tail->offset - tail->length;
+	return room;
+}
+
+/**
+ * @brief Add a page of data at the end of the pipe. Needs the lock and a free slot.
+ */
+static void pipe_push_page(struct unix_pipe * self, uintptr_t frame, size_t offset, size_t length) {
+	struct pipe_page * page = &self->pages[(self->head + self->count) % UNIX_PIPE_PAGES];
+	page->frame  = frame;
+	page->offset = offset;
+	page->length = length;
+	self->count++;
+	self->unread += length;
+}
+
+/**
+ * @brief Take the oldest page out of the pipe. Needs the lock.
+ */
+static struct pipe_page pipe_pop_page(struct unix_pipe * self) {
+	struct pipe_page page = self->pages[self->head];
+	self->head = (self->head + 1) % UNIX_PIPE_PAGES;
+	self->count--;
+	self->unread -= page.length;
+	return page;
+}
+
+/**
+ * @brief Copy up to @p size bytes out of the pipe, or just drop them if @p buffer is NULL. Needs the lock.
+ */
+static size_t pipe_take(struct unix_pipe * self, size_t size, uint8_t * buffer) {
+	size_t collected = 0;
+	while (collected < size && self->count) {
+		struct pipe_page * page = &self->pages[self->head];
+		size_t chunk = size - collected < page->length ? size - collected : page->length;
+		if (buffer) memcpy(buffer + collected, page_data(page), chunk);
+		page->offset += chunk;
+		page->length -= chunk;
+		self->unread -= chunk;
+		collected += chunk;
+		if (!page->length) {
+			mmu_frame_release(page->frame << 12);
+			self->head = (self->head + 1) % UNIX_PIPE_PAGES;
+			self->count--;
+		}
+	}
+	return collected;
+}
+
+/**
+ * @brief Copy up to @p size bytes into the pipe, as far as there's room. Needs the lock.
+ */
+static size_t pipe_put(struct unix_pipe * self, size_t size, const uint8_t * buffer) {
+	size_t written = 0;
+	struct pipe_page * tail = pipe_tail(self);
+
+	/* Top up the last page first */
+	if (tail) {
+		size_t end = tail->offset + tail->length;
+		size_t chunk = size < UNIX_PIPE_PAGE - end ? size : UNIX_PIPE_PAGE - end;
+		memcpy((uint8_t *)mmu_map_from_physical(tail->frame << 12) + end, buffer, chunk);
+		tail->length += chunk;
+		self->unread += chunk;
+		written += chunk;
+	}
+
+	while (written < size && pipe_free_slots(self)) {
+		uintptr_t frame = mmu_allocate_a_frame();
+		size_t chunk = size - written < UNIX_PIPE_PAGE ? size - written : UNIX_PIPE_PAGE;
+		memcpy(mmu_map_from_physical(frame << 12), buffer + written, chunk);
+		pipe_push_page(self, frame, 0, chunk);
+		written += chunk;
+	}
+
+	return written;
+}
+
+static void pipe_alert_waiters(struct unix_pipe * self) {
+	spin_lock(self->alert_lock);
+	while (self->alert_waiters->head) {
+		node_t * node = list_dequeue(self->alert_waiters);
+		process_t * p = node->value;
+		free(node);
+		spin_unlock(self->alert_lock);
+
+		process_alert_node(p, self);
+
+		spin_lock(self->alert_lock);
+	}
+	spin_unlock(self->alert_lock);
+}
+
 static void close_complete(struct unix_pipe * self) {
-	ring_buffer_destroy(self->buffer);
+	while (self->count) {
+		struct pipe_page page = pipe_pop_page(self);
+		mmu_frame_release(page.frame << 12);
+	}
+
+	list_free(self->wait_queue_readers);
+	list_free(self->wait_queue_writers);
+	list_free(self->alert_waiters);
+	free(self->wait_queue_readers);
+	free(self->wait_queue_writers);
+	free(self->alert_waiters);
+	free(self);
 }
 
 static ssize_t read_unixpipe(fs_node_t * node, off_t offset, size_t size, uint8_t *buffer) {
 	struct unix_pipe * self = node->device;
-	if (self->write_closed && !ring_buffer_unread(self->buffer)) {
-		return 0;
+
+	spin_lock(self->lock);
+	while (!self->unread || self->splicing) {
+		if (!self->splicing && (self->write_closed || !size)) {
+			spin_unlock(self->lock);
+			return 0;
+		}
+		if (sleep_on_unlocking(self->wait_queue_readers, &self->lock)) {
+			return -ERESTARTSYS;
+		}
+		spin_lock(self->lock);
 	}
-	return ring_buffer_read(self->buffer, size, buffer);
+
+	size_t collected = pipe_take(self, size, buffer);
+	spin_unlock(self->lock);
+
+	wakeup_queue(self->wait_queue_writers);
+	return collected;
 }
 
 static ssize_t write_unixpipe(fs_node_t * node, off_t offset, size_t size, uint8_t *buffer) {
 	struct unix_pipe * self = node->device;
-	if (self->read_closed) {
-		send_signal(this_core->current_process->id, SIGPIPE, 1);
-		return -EPIPE;
+	size_t written = 0;
+
+	spin_lock(self->lock);
+	while (written < size) {
+		if (self->read_closed) {
+			spin_unlock(self->lock);
+			if (written) return written;
+			send_signal(this_core->current_process->id, SIGPIPE, 1);
+			return -EPIPE;
+		}
+
+		/* Small writes wait until they fit in one piece */
+		size_t room = pipe_room(self);
+		if (!room || (size <= UNIX_PIPE_ATOMIC && room < size)) {
+			if (sleep_on_unlocking(self->wait_queue_writers, &self->lock)) {
+				return written ? (ssize_t)written : -ERESTARTSYS;
+			}
+			spin_lock(self->lock);
+			continue;
+		}
+
+		written += pipe_put(self, size - written, buffer + written);
+
+		wakeup_queue(self->wait_queue_readers);
+		pipe_alert_waiters(self);
 	}
-	return ring_buffer_write(self->buffer, size, buffer);
+	spin_unlock(self->lock);
+
+	return written;
 }
 
 static void close_read_pipe(fs_node_t * node) {
 	struct unix_pipe * self = node->device;
 
-	spin_lock(self->buffer->lock);
+	/* Whichever end closes last frees the pipe, so the wakeup has to happen under the lock */
+	spin_lock(self->lock);
 	self->read_closed = 1;
-	if (!self->write_closed) {
-		ring_buffer_interrupt(self->buffer);
-	}
-	spin_unlock(self->buffer->lock);
+	int done = self->write_closed;
+	if (!done) wakeup_queue(self->wait_queue_writers);
+	spin_unlock(self->lock);
+
+	if (done) close_complete(self);
 }
 
 static void close_write_pipe(fs_node_t * node) {
 	struct unix_pipe * self = node->device;
 
-	spin_lock(self->buffer->lock);
+	spin_lock(self->lock);
 	self->write_closed = 1;
-	if (!self->read_closed) {
-		ring_buffer_interrupt(self->buffer);
-		if (!ring_buffer_unread(self->buffer)) {
-			ring_buffer_alert_waiters(self->buffer);
-		}
+	int done = self->read_closed;
+	if (!done) {
+		wakeup_queue(self->wait_queue_readers);
+		pipe_alert_waiters(self);
 	}
-	spin_unlock(self->buffer->lock);
+	spin_unlock(self->lock);
+
+	if (done) close_complete(self);
 }
 
 static int check_pipe(fs_node_t * node) {
 	struct unix_pipe * self = node->device;
-	if (ring_buffer_unread(self->buffer) > 0) {
+	if (self->unread > 0) {
 		return 0;
 	}
 	if (self->write_closed) return 0;
@@ -90,14 +290,227 @@ static int check_pipe(fs_node_t * node) {
 
 static int wait_pipe(fs_node_t * node, void * process) {
 	struct unix_pipe * self = node->device;
-	ring_buffer_select_wait(self->buffer, process);
+
+	spin_lock(self->alert_lock);
+	if (!list_find(self->alert_waiters, process)) {
+		list_insert(self->alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, self);
+	spin_unlock(self->alert_lock);
+
 	return 0;
 }
 
+static struct unix_pipe * splice_pipe(fs_node_t * node) {
+	if (node->read == read_unixpipe || node->write == write_unixpipe) return node->device;
+	return NULL;
+}
 
-int make_unix_pipe(fs_node_t ** pipes) {
-	size_t size = UNIX_PIPE_BUFFER;
+/**
+ * @brief Move pages from one pipe to another.
+ *
+ * Whole pages change hands; only a page that is split by @p len is copied.
+ */
+static ssize_t splice_pipe_to_pipe(struct unix_pipe * in, struct unix_pipe * out, size_t len, unsigned int flags) {
+	/* Always lock the two in the same order */
+	struct unix_pipe * first  = in < out ? in : out;
+	struct unix_pipe * second = in < out ? out : in;
+	size_t moved = 0;
+
+	while (1) {
+		spin_lock(first->lock);
+		spin_lock(second->lock);
+
+		if (out->read_closed) {
+			spin_unlock(second->lock);
+			spin_unlock(first->lock);
+			send_signal(this_core->current_process->id, SIGPIPE, 1);
+			return -EPIPE;
+		}
+
+		if (!in->unread || in->splicing) {
+			spin_unlock(out->lock);
+			if (!in->splicing && in->write_closed) {
+				spin_unlock(in->lock);
+				return 0;
+			}
+			if (flags & SPLICE_F_NONBLOCK) {
+				spin_unlock(in->lock);
+				return -EAGAIN;
+			}
+			if (sleep_on_unlocking(in->wait_queue_readers, &in->lock)) return -ERESTARTSYS;
+			continue;
+		}
+
+		if (!pipe_free_slots(out)) {
+			spin_unlock(in->lock);
+			if (flags & SPLICE_F_NONBLOCK) {
+				spin_unlock(out->lock);
+				return -EAGAIN;
+			}
+			if (sleep_on_unlocking(out->wait_queue_writers, &out->lock)) return -ERESTARTSYS;
+			continue;
+		}
+
+		while (moved < len && in->count && pipe_free_slots(out)) {
+			struct pipe_page * page = &in->pages[in->head];
+			if (page->length <= len - moved) {
+				struct pipe_page whole = pipe_pop_page(in);
+				pipe_push_page(out, whole.frame, whole.offset, whole.length);
+				moved += whole.length;
+			} else {
+				uintptr_t frame = mmu_allocate_a_frame();
+				size_t chunk = pipe_take(in, len - moved, mmu_map_from_physical(frame << 12));
+				pipe_push_page(out, frame, 0, chunk);
+				moved += chunk;
+			}
+		}
+
+		spin_unlock(second->lock);
+		spin_unlock(first->lock);
+		break;
+	}
+
+	wakeup_queue(in->wait_queue_writers);
+	wakeup_queue(out->wait_queue_readers);
+	pipe_alert_waiters(out);
+	return moved;
+}
+
+/**
+ * @brief Write pages out of a pipe straight into a file or socket.
+ *
+ * The pages stay in the pipe while they are written and only what was
+ * actually written is dropped after, so other readers wait meanwhile.
+ */
+static ssize_t splice_pipe_to_node(struct unix_pipe * in, fs_node_t * out, uint64_t * offset, size_t len, unsigned int flags) {
+	ssize_t moved = 0;
+
+	spin_lock(in->lock);
+	while (!in->unread || in->splicing) {
+		if (!in->splicing && in->write_closed) {
+			spin_unlock(in->lock);
+			return 0;
+		}
+		if (flags & SPLICE_F_NONBLOCK) {
+			spin_unlock(in->lock);
+			return -EAGAIN;
+		}
+		if (sleep_on_unlocking(in->wait_queue_readers, &in->lock)) return -ERESTARTSYS;
+		spin_lock(in->lock);
+	}
+	in->splicing = 1;
+
+	while ((size_t)moved < len && in->count) {
+		/* Writers only ever add to the end of this page, so it is safe to use unlocked */
+		struct pipe_page * page = &in->pages[in->head];
+		size_t chunk = len - moved < page->length ? len - moved : page->length;
+		uint8_t * data = page_data(page);
+		spin_unlock(in->lock);
 
+		ssize_t written = write_fs(out, *offset, chunk, data);
+
+		spin_lock(in->lock);
+		if (written <= 0) {
+			if (!moved) moved = written;
+			break;
+		}
+		*offset += written;
+		moved += written;
+		pipe_take(in, written, NULL);
+		wakeup_queue(in->wait_queue_writers);
+		if ((size_t)written < chunk) break;
+	}
+
+	in->splicing = 0;
+	spin_unlock(in->lock);
+
+	wakeup_queue(in->wait_queue_readers);
+	wakeup_queue(in->wait_queue_writers);
+	return moved;
+}
+
+/**
+ * @brief Read from a file or socket straight into new pages at the end of a pipe.
+ */
+static ssize_t splice_node_to_pipe(fs_node_t * in, uint64_t * offset, struct unix_pipe * out, size_t len, unsigned int flags) {
+	size_t moved = 0;
+
+	while (moved < len) {
+		spin_lock(out->lock);
+		while (!pipe_free_slots(out) && !out->read_closed) {
+			if (moved || (flags & SPLICE_F_NONBLOCK)) {
+				spin_unlock(out->lock);
+				return moved ? (ssize_t)moved : -EAGAIN;
+			}
+			if (sleep_on_unlocking(out->wait_queue_writers, &out->lock)) return -ERESTARTSYS;
+			spin_lock(out->lock);
+		}
+		if (out->read_closed) {
+			spin_unlock(out->lock);
+			if (moved) break;
+			send_signal(this_core->current_process->id, SIGPIPE, 1);
+			return -EPIPE;
+		}
+		out->reserved++;
+		spin_unlock(out->lock);
+
+		uintptr_t frame = mmu_allocate_a_frame();
+		size_t want = len - moved < UNIX_PIPE_PAGE ? len - moved : UNIX_PIPE_PAGE;
+		ssize_t got = read_fs(in, *offset, want, mmu_map_from_physical(frame << 12));
+
+		spin_lock(out->lock);
+		out->reserved--;
+		if (got <= 0) {
+			spin_unlock(out->lock);
+			mmu_frame_release(frame << 12);
+			if (!moved) return got;
+			break;
+		}
+		pipe_push_page(out, frame, 0, got);
+		pipe_alert_waiters(out);
+		spin_unlock(out->lock);
+		wakeup_queue(out->wait_queue_readers);
+
+		*offset += got;
+		moved += got;
+
+		/* A short read means that's all there is for now */
+		if ((size_t)got < want) break;
+	}
+
+	return moved;
+}
+
+/**
+ * @brief Move up to @p len bytes from @p in to @p out, at least one of which is a pipe.
+ *
+ * @param in_offset  File position to read from, advanced by what was read; unused for pipes.
+ * @param out_offset File position to write at, same.
+ * @returns bytes moved, 0 at end of input, or a negative error.
+ */
+ssize_t unix_pipe_splice(fs_node_t * in, uint64_t * in_offset, fs_node_t * out, uint64_t * out_offset, size_t len, unsigned int flags) {
+	struct unix_pipe * in_pipe  = splice_pipe(in);
+	struct unix_pipe * out_pipe = splice_pipe(out);
+
+	if (in_pipe && in->read != read_unixpipe) return -EBADF;
+	if (out_pipe && out->write != write_unixpipe) return -EBADF;
+	if (!in->read || !out->write) return -EINVAL;
+	if (!len) return 0;
+
+	if (in_pipe && out_pipe) {
+		if (in_pipe == out_pipe) return -EINVAL;
+		return splice_pipe_to_pipe(in_pipe, out_pipe, len, flags);
+	} else if (in_pipe) {
+		return splice_pipe_to_node(in_pipe, out, out_offset, len, flags);
+	} else if (out_pipe) {
+		return splice_node_to_pipe(in, in_offset, out_pipe, len, flags);
+	}
+
+	return -EINVAL;
+}
+
+int make_unix_pipe(fs_node_t ** pipes) {
 	pipes[0] = malloc(sizeof(fs_node_t));
 	pipes[1] = malloc(sizeof(fs_node_t));
 
@@ -123,12 +536,16 @@ int make_unix_pipe(fs_node_t ** pipes) {
 	pipes[0]->selectcheck = check_pipe;
 	pipes[0]->selectwait = wait_pipe;
 
-	struct unix_pipe * internals = malloc(sizeof(struct unix_pipe));
+	struct unix_pipe * internals = calloc(1, sizeof(struct unix_pipe));
 	internals->read_end = pipes[0];
 	internals->write_end = pipes[1];
 	internals->read_closed = 0;
 	internals->write_closed = 0;
-	internals->buffer = ring_buffer_create(size);
+	spin_init(internals->lock);
+	spin_init(internals->alert_lock);
+	internals->wait_queue_readers = list_create("pipe readers", internals);
+	internals->wait_queue_writers = list_create("pipe writers", internals);
+	internals->alert_waiters = list_create("pipe alert waiters", internals);
 
 	pipes[0]->device = internals;
 	pipes[1]->device = internals;
@@ -29,6 +29,8 @@
 #include <kernel/hashmap.h>
 #include <kernel/tree.h>
 #include <kernel/spinlock.h>
+#include <kernel/args.h>
+#include <kernel/procfs.h>
 
 #define MAX_SYMLINK_DEPTH 8
 #define MAX_SYMLINK_SIZE 4096
@@ -353,6 +355,246 @@ int ioctl_fs(fs_node_t *node, unsigned long request, void * argp) {
 }
 
 
+/*
+ * Directory entry cache.
+ *
+ * Remembers what finddir said for a (directory, name) pair, so walking
+ * a path a second time is a hash lookup per component instead of a
+ * finddir per component. Directories are identified by their finddir
+ * function, device and inode, since nodes themselves are throwaway
+ * copies. Failed lookups are remembered too.
+ *
+ * Only directories and symlinks are kept, and a kept node is only
+ * handed out for a component in the middle of a path: the node for
+ * the last component is what the caller gets to stat and read, so it
+ * always comes fresh from finddir, with the current size and mode.
+ * A remembered "not found" is fine anywhere.
+ *
+ * Filesystems opt in with vfs_dcache_register, for their finddir, when
+ * every change to their directories goes through create_file_fs,
+ * mkdir_fs, symlink_fs or unlink_fs here, which drop what they make
+ * stale. procfs, whose entries come and go by themselves, does not.
+ * Mounting anything empties the cache.
+ */
+#define DCACHE_BUCKETS  1024
+#define DCACHE_MAX      4096
+#define DCACHE_FILESYSTEMS 8
+
+struct dentry {
+	struct dentry * next;	/* Hash chain */
+	node_t lru;
+	uint32_t hash;
+	/* The directory this was looked up in */
+	void * finddir;
+	void * device;
+	uint64_t inode;
+	fs_node_t * node;	/* NULL if there's nothing by this name */
+	char name[];
+};
+
+static spin_lock_t dcache_lock = { 0 };
+static struct dentry * dcache_table[DCACHE_BUCKETS];
+static list_t * dcache_lru = NULL;	/* Least recently used at the head */
+static uint64_t dcache_generation = 0;	/* Bumped by every invalidation */
+static void * dcache_filesystems[DCACHE_FILESYSTEMS];
+static int dcache_filesystem_count = 0;
+static uint64_t dcache_hits = 0;
+static uint64_t dcache_misses = 0;
+static uint64_t dcache_negative = 0;
+
+/**
+ * @brief Allow directories with this finddir to be cached.
+ */
+void vfs_dcache_register(fs_node_t * (*finddir)(fs_node_t *, char *)) {
+	spin_lock(dcache_lock);
+	if (dcache_filesystem_count < DCACHE_FILESYSTEMS) {
+		dcache_filesystems[dcache_filesystem_count++] = (void *)(uintptr_t)finddir;
+	}
+	spin_unlock(dcache_lock);
+}
+
+static int dcache_usable(fs_node_t * dir) {
+	if (!dcache_lru || !(dir->flags & FS_DIRECTORY) || !dir->finddir) return 0;
+	for (int i = 0; i < dcache_filesystem_count; ++i) {
+		if (dcache_filesystems[i] == (void *)(uintptr_t)dir->finddir) return 1;
+	}
+	return 0;
+}
+
+static uint32_t dcache_hash(fs_node_t * dir, const char * name) {
+	uint32_t hash = 2166136261U;
+	while (*name) {
+		hash = (hash ^ (uint8_t)*name++) * 16777619U;
+	}
+	uint64_t id = (uintptr_t)dir->device ^ (dir->inode * 0x9E3779B97F4A7C15UL);
+	return hash ^ (uint32_t)id ^ (uint32_t)(id >> 32);
+}
+
+static struct dentry * dcache_find(fs_node_t * dir, const char * name, uint32_t hash) {
+	for (struct dentry * e = dcache_table[hash % DCACHE_BUCKETS]; e; e = e->next) {
+		if (e->hash == hash && e->device == dir->device && e->inode == dir->inode &&
+			e->finddir == (void *)(uintptr_t)dir->finddir && !strcmp(e->name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Unlink and free an entry. Needs dcache_lock.
+ */
+static void dcache_drop(struct dentry * e) {
+	struct dentry ** link = &dcache_table[e->hash % DCACHE_BUCKETS];
+	while (*link != e) link = &(*link)->next;
+	*link = e->next;
+	list_delete(dcache_lru, &e->lru);
+	if (e->node) free(e->node);
+	free(e);
+}
+
+static void dcache_insert(fs_node_t * dir, const char * name, uint32_t hash, fs_node_t * node) {
+	struct dentry * old = dcache_find(dir, name, hash);
+	if (old) dcache_drop(old);
+
+	if (dcache_lru->length >= DCACHE_MAX) {
+		dcache_drop(dcache_lru->head->value);
+	}
+
+	struct dentry * e = malloc(sizeof(struct dentry) + strlen(name) + 1);
+	e->hash    = hash;
+	e->finddir = (void *)(uintptr_t)dir->finddir;
+	e->device  = dir->device;
+	e->inode   = dir->inode;
+	e->node    = NULL;
+	strcpy(e->name, name);
+	if (node) {
+		e->node = malloc(sizeof(fs_node_t));
+		memcpy(e->node, node, sizeof(fs_node_t));
+	}
+	e->lru.value = e;
+	list_append(dcache_lru, &e->lru);
+	e->next = dcache_table[hash % DCACHE_BUCKETS];
+	dcache_table[hash % DCACHE_BUCKETS] = e;
+}
+
+/**
+ * @brief finddir_fs, through the cache.
+ *
+ * @param leaf Whether this is the last component of the path.
+ */
+static fs_node_t * dcache_finddir(fs_node_t * dir, char * name, int leaf) {
+	if (!dcache_usable(dir)) return finddir_fs(dir, name);
+
+	uint32_t hash = dcache_hash(dir, name);
+
+	spin_lock(dcache_lock);
+	struct dentry * e = dcache_find(dir, name, hash);
+	if (e && (!e->node || !leaf)) {
+		list_delete(dcache_lru, &e->lru);
+		list_append(dcache_lru, &e->lru);
+		fs_node_t * out = NULL;
+		if (e->node) {
+			out = malloc(sizeof(fs_node_t));
+			memcpy(out, e->node, sizeof(fs_node_t));
+			out->refcount = 0;
+		} else {
+			dcache_negative++;
+		}
+		dcache_hits++;
+		spin_unlock(dcache_lock);
+		return out;
+	}
+	dcache_misses++;
+	uint64_t generation = dcache_generation;
+	spin_unlock(dcache_lock);
+
+	fs_node_t * out = finddir_fs(dir, name);
+
+	/* Regular files and devices would go stale; they are only ever a leaf anyway. */
+	if (!out || (out->flags & (FS_DIRECTORY | FS_SYMLINK))) {
+		spin_lock(dcache_lock);
+		/* Unless something was created or removed while we were looking */
+		if (generation == dcache_generation) {
+			dcache_insert(dir, name, hash, out);
+		}
+		spin_unlock(dcache_lock);
+	}
+
+	return out;
+}
+
+/**
+ * @brief Forget everything cached inside a directory, and inside its subdirectories. Needs dcache_lock.
+ */
+static void dcache_purge_dir(void * finddir, void * device, uint64_t inode) {
+	for (int i = 0; i < DCACHE_BUCKETS; ++i) {
+		struct dentry * e = dcache_table[i];
+		while (e) {
+			struct dentry * next = e->next;
+			if (e->finddir == finddir && e->device == device && e->inode == inode) {
+				fs_node_t * sub = e->node;
+				e->node = NULL;
+				dcache_drop(e);
+				if (sub) {
+					if (sub->flags & FS_DIRECTORY) {
+						dcache_purge_dir((void *)(uintptr_t)sub->finddir, sub->device, sub->inode);
+						/* That may have taken anything out of this chain */
+						next = dcache_table[i];
+					}
+					free(sub);
+				}
+			}
+			e = next;
+		}
+	}
+}
+
+/**
+ * @brief Forget what was cached for @p name in @p dir, and below it if it's a directory.
+ */
+static void dcache_forget(fs_node_t * dir, char * name, fs_node_t * old) {
+	if (!dcache_usable(dir)) return;
+
+	spin_lock(dcache_lock);
+	dcache_generation++;
+	struct dentry * e = dcache_find(dir, name, dcache_hash(dir, name));
+	if (e) dcache_drop(e);
+	if (old && (old->flags & FS_DIRECTORY)) {
+		dcache_purge_dir((void *)(uintptr_t)old->finddir, old->device, old->inode);
+	}
+	spin_unlock(dcache_lock);
+}
+
+/**
+ * @brief Forget everything, for when the mount table changes.
+ */
+static void dcache_flush(void) {
+	if (!dcache_lru) return;
+
+	spin_lock(dcache_lock);
+	dcache_generation++;
+	for (int i = 0; i < DCACHE_BUCKETS; ++i) {
+		while (dcache_table[i]) dcache_drop(dcache_table[i]);
+	}
+	spin_unlock(dcache_lock);
+}
+
+static void dcache_procfs(fs_node_t * node) {
+	procfs_printf(node,
+		"Entries:\t%zu\n"
+		"Hits:\t%lu\n"
+		"NegativeHits:\t%lu\n"
+		"Misses:\t%lu\n",
+		dcache_lru ? dcache_lru->length : 0,
+		dcache_hits, dcache_negative, dcache_misses);
+}
+
+static struct procfs_entry dcache_entry = {
+	0,
+	"dcache",
+	dcache_procfs,
+};
+
 /*
  * XXX: The following two function should be replaced with
  *      one function to create children of directory nodes.
@@ -400,6 +642,7 @@ int create_file_fs(char *name, mode_t permission) {
 	int ret = 0;
 	if (parent->create) {
 		ret = parent->create(parent, f_path, permission);
+		if (!ret) dcache_forget(parent, f_path, NULL);
 	} else {
 		ret = -EINVAL;
 	}
@@ -449,7 +692,11 @@ int unlink_fs(char * name) {
 
 	int ret = 0;
 	if (parent->unlink) {
+		/* If it's a directory, anything cached inside it has to go too */
+		fs_node_t * old = dcache_usable(parent) ? finddir_fs(parent, f_path) : NULL;
 		ret = parent->unlink(parent, f_path);
+		if (!ret) dcache_forget(parent, f_path, old);
+		if (old) free(old);
 	} else {
 		ret = -EINVAL;
 	}
@@ -515,6 +762,7 @@ int mkdir_fs(char *name, mode_t permission) {
 	int ret = 0;
 	if (parent->mkdir) {
 		ret = parent->mkdir(parent, f_path, permission);
+		if (!ret) dcache_forget(parent, f_path, NULL);
 	} else {
 		ret = -EROFS;
 	}
@@ -567,6 +815,7 @@ int symlink_fs(char * target, char * name) {
 	int ret = 0;
 	if (parent->symlink) {
 		ret = parent->symlink(parent, target, f_path);
+		if (!ret) dcache_forget(parent, f_path, NULL);
 	} else {
 		ret = -EINVAL;
 	}
@@ -719,6 +968,11 @@ void vfs_install(void) {
 	tree_set_root(fs_tree, root);
 
 	fs_types = hashmap_create(5);
+
+	if (!args_present("nodcache")) {
+		dcache_lru = list_create("dentry cache", NULL);
+	}
+	procfs_install(&dcache_entry);
 }
 
 int vfs_register(const char * name, vfs_mount_callback callback) {
@@ -853,6 +1107,9 @@ void * vfs_mount(const char * path, fs_node_t * local_root) {
 
 	free(p);
 	spin_unlock(tmp_vfs_lock);
+
+	/* Paths under here may now lead somewhere else */
+	dcache_flush();
 	return ret_val;
 }
 
@@ -1096,7 +1353,7 @@ fs_node_t *kopen_recur(const char *filename, uint64_t flags, uint64_t symlink_de
 		}
 		/* We are still searching... */
 		debug_print(INFO, "... Searching for %s", path_offset);
-		fs_node_t * node_next = finddir_fs(node_ptr, path_offset);
+		fs_node_t * node_next = dcache_finddir(node_ptr, path_offset, depth + 1 == path_depth);
 		free(node_ptr); /* Always a clone or an unopened thing */
 		node_ptr = node_next;
 		/* Search the active directory for the requested directory */
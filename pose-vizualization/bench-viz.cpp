@@ -0,0 +1,466 @@
+// Headless frame time benchmark of the visualizer, no GPU and no window needed.
+//
+// Frames are rendered by Mesa's software rasterizer into an EGL pbuffer
+// (surfaceless platform) of the window size of viz:
+//
+// 1) legacy: the previous viz, grid in a display list and arrows tessellated by
+//    gluCylinder on every frame.
+// 2) vbo: the scene of viz (scene.cpp), static geometry in vertex buffers.
+//
+// Poses change every frame. Frame time includes glFinish, submit time is the
+// CPU time spent in the drawing calls before glFinish. Both renderings of the
+// same poses are compared pixel by pixel, then the triple buffer handing poses
+// from the input thread to the renderer is checked for torn or stale reads.
+//
+// The trajectory layer is measured on a generated trajectory.dat: loading,
+// building the level of detail (each level is checked against the error bound
+// of Douglas-Peucker), drawing at scrubbed positions with raw points and with
+// the level viz would use, and the live history ring.
+//
+// usage: bench-viz [<frames> [<trajectory_points>]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "linmath.h"
+#include "scene.h"
+#include "posebuffer.h"
+#include "trajectory.h"
+
+#define BENCH_WIDTH	800
+#define BENCH_HEIGHT	600
+#define BENCH_TRAJECTORY	"/tmp/bench-viz-trajectory.dat"
+
+static double monotonicTime() {
+  struct timespec tt;
+  clock_gettime(CLOCK_MONOTONIC, &tt);
+  return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static int createContext() {
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+  EGLDisplay display;
+  EGLConfig config;
+  EGLSurface surface;
+  EGLContext context;
+  EGLint major, minor, n;
+  EGLint configAttributes[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_NONE
+  };
+  EGLint surfaceAttributes[] = {EGL_WIDTH, BENCH_WIDTH, EGL_HEIGHT, BENCH_HEIGHT, EGL_NONE};
+
+  getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay == NULL) {
+    printf("%s:%d: eglGetPlatformDisplayEXT not available.\n", __FILE__, __LINE__);
+    return(-1);
+  }
+  display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (display == EGL_NO_DISPLAY || ! eglInitialize(display, &major, &minor)) {
+    printf("%s:%d: Can't initialize EGL: 0x%x\n", __FILE__, __LINE__, eglGetError());
+    return(-1);
+  }
+  if (! eglChooseConfig(display, configAttributes, &config, 1, &n) || n < 1) {
+    printf("%s:%d: No pbuffer config.\n", __FILE__, __LINE__);
+    return(-1);
+  }
+  eglBindAPI(EGL_OPENGL_API);
+  surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+  context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+  if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT || ! eglMakeCurrent(display, surface, surface, context)) {
+    printf("%s:%d: Can't make EGL context current: 0x%x\n", __FILE__, __LINE__, eglGetError());
+    return(-1);
+  }
+  printf("renderer: %s, OpenGL %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+  return(0);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// previous viz rendering
+
+static GLUquadricObj *quadratic;
+static int legacyGridList;
+
+static void legacyInit() {
+  quadratic = gluNewQuadric();
+  legacyGridList = glGenLists(1);
+  glNewList(legacyGridList, GL_COMPILE);
+  GLfloat lightPosition[] = {-20, 10, 10, 0.5};
+  glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+  glBegin(GL_QUADS);
+  glNormal3d(0, 1, 0);
+  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, GREY);
+  for (int x = 0; x < CHECKB_WIDTH - 1; x++) {
+    glVertex3d(x, CHECKB_HEIGHT, 20);
+    glVertex3d(x+0.05, CHECKB_HEIGHT, 20);
+    glVertex3d(x+0.05, 0, 20);
+    glVertex3d(x, 0, 20);
+  }
+  for (int y = 0; y < CHECKB_HEIGHT - 1; y++) {
+    glVertex3d(CHECKB_WIDTH, y, 20);
+    glVertex3d(CHECKB_WIDTH, y+0.05, 20);
+    glVertex3d(0, y+0.05, 20);
+    glVertex3d(0, y, 20);
+  }
+  glEnd();
+  glEndList();
+}
+
+static void legacyArrow(struct vizPose *p, double xoffset, double yoffset, double zoffset) {
+  double radius = 0.1;
+
+  if (p->flags == 0) return;
+  glPushMatrix();
+  glTranslated(p->position[0] + xoffset, p->position[1] + yoffset, p->position[2] + zoffset);
+  double qx = p->q[0];
+  double qy = p->q[1];
+  double qz = p->q[2];
+  double qw = p->q[3];
+  double mm[4][4] = {
+    1.0f - 2.0f*qy*qy - 2.0f*qz*qz, 2.0f*qx*qy - 2.0f*qz*qw, 2.0f*qx*qz + 2.0f*qy*qw, 0.0f,
+    2.0f*qx*qy + 2.0f*qz*qw, 1.0f - 2.0f*qx*qx - 2.0f*qz*qz, 2.0f*qy*qz - 2.0f*qx*qw, 0.0f,
+    2.0f*qx*qz - 2.0f*qy*qw, 2.0f*qy*qz + 2.0f*qx*qw, 1.0f - 2.0f*qx*qx - 2.0f*qy*qy, 0.0f,
+    0.0f, 0.0f, 0.0f, 1.0f
+  };
+  double mmt[4][4];
+  mat4x4_transpose(mmt, mm);
+  glMultMatrixd((const GLdouble*)mmt);
+  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, GREEN);
+  gluCylinder(quadratic, 0.2f, 0.1f, 0.5, 16, 16);
+  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, BLUE);
+  glRotatef(90.0f, 0.0f, 1.0f, 0.0f);
+  gluCylinder(quadratic, radius, radius, 3, 4, 4);
+  glTranslated(0, 0, 3);
+  gluCylinder(quadratic, 0.2f, 0.01f, 0.5, 16, 16);
+  glTranslated(0, 0, -3);
+  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, RED);
+  glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);
+  glTranslated(0, -2, -2);
+  gluCylinder(quadratic, radius, radius, 4, 4, 4);
+  glPopMatrix();
+}
+
+static void legacyDraw(struct vizPoses *poses) {
+  static double offsets[VIZ_MAX_ARROWS][3] = {{4, 4, 2}, {6, 4, 2}, {8, 4, 2}};
+
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glLoadIdentity();
+  gluLookAt(camera.getX(), camera.getY(), camera.getZ(),
+            checkerboard.centerx(), checkerboard.centery(), checkerboard.centerz(),
+            0.0, 1.0, 0.0);
+  // vertex arrays of the scene are not used here
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glCallList(legacyGridList);
+  for (int i = 0; i < VIZ_MAX_ARROWS; i++) legacyArrow(&poses->arrow[i], offsets[i][0], offsets[i][1], offsets[i][2]);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_NORMAL_ARRAY);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+static void makePoses(struct vizPoses *poses, int frame) {
+  double t, a;
+  int i;
+
+  t = frame / 60.0;
+  for (i = 0; i < VIZ_MAX_ARROWS; i++) {
+    a = t + i;
+    // rotation by angle a around the (1,1,1) axis
+    poses->arrow[i].q[0] = poses->arrow[i].q[1] = poses->arrow[i].q[2] = sin(a / 2) / sqrt(3);
+    poses->arrow[i].q[3] = cos(a / 2);
+    poses->arrow[i].position[0] = 3 * cos(a);
+    poses->arrow[i].position[1] = 3 * sin(a);
+    poses->arrow[i].position[2] = sin(2 * a);
+    poses->arrow[i].flags = VIZ_POSE_QUAT_SET | VIZ_POSE_POSITION_SET;
+  }
+  poses->sequence = frame;
+}
+
+static void benchFrames(const char *title, void (*draw)(struct vizPoses *poses), int frames) {
+  struct vizPoses poses;
+  std::vector<double> times;
+  double t0, t1, sum, submit;
+  int i;
+
+  // warm up
+  makePoses(&poses, 0);
+  draw(&poses);
+  glFinish();
+  submit = 0;
+  for (i = 0; i < frames; i++) {
+    makePoses(&poses, i);
+    t0 = monotonicTime();
+    draw(&poses);
+    t1 = monotonicTime();
+    glFinish();
+    submit += t1 - t0;
+    times.push_back(monotonicTime() - t0);
+  }
+  sum = 0;
+  for (i = 0; i < frames; i++) sum += times[i];
+  std::sort(times.begin(), times.end());
+  printf("%-8s %d frames: avg %6.3f ms, median %6.3f ms, p99 %6.3f ms, %6.0f fps, submit %6.1f us/frame\n",
+         title, frames, sum / frames * 1e3, times[frames / 2] * 1e3, times[frames * 99 / 100] * 1e3, frames / sum, submit / frames * 1e6);
+}
+
+// Returns the fraction of pixels differing between both renderings.
+static double compareRenderings(int frame) {
+  struct vizPoses poses;
+  std::vector<unsigned char> a(BENCH_WIDTH * BENCH_HEIGHT * 4), b(BENCH_WIDTH * BENCH_HEIGHT * 4);
+  long i, j, differ;
+
+  makePoses(&poses, frame);
+  legacyDraw(&poses);
+  glReadPixels(0, 0, BENCH_WIDTH, BENCH_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, &a[0]);
+  sceneDraw(&poses);
+  glReadPixels(0, 0, BENCH_WIDTH, BENCH_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, &b[0]);
+  differ = 0;
+  for (i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++) {
+    for (j = 0; j < 3; j++) {
+      if (abs(a[i*4+j] - b[i*4+j]) > 8) {
+        differ ++;
+        break;
+      }
+    }
+  }
+  return((double) differ / (BENCH_WIDTH * BENCH_HEIGHT));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// triple buffer
+
+static struct poseBuffer buffer;
+static volatile int writerDone;
+
+static void *writerThread(void *arg) {
+  struct vizPoses *p;
+  long long n, i;
+  int j, k;
+
+  n = *(long long *) arg;
+  for (i = 1; i <= n; i++) {
+    p = poseBufferBack(&buffer);
+    // every value carries the sequence number, a torn read mixes them
+    for (j = 0; j < VIZ_MAX_ARROWS; j++) {
+      for (k = 0; k < 4; k++) p->arrow[j].q[k] = i;
+      for (k = 0; k < 3; k++) p->arrow[j].position[k] = i;
+    }
+    p->sequence = i;
+    poseBufferPublish(&buffer);
+  }
+  __atomic_store_n(&writerDone, 1, __ATOMIC_RELEASE);
+  return(NULL);
+}
+
+// Returns number of errors.
+static long long benchPoseBuffer(long long n) {
+  struct vizPoses *p;
+  pthread_t thread;
+  long long last, reads, fresh, torn, stale;
+  int j, k, f;
+
+  poseBufferInit(&buffer);
+  writerDone = 0;
+  last = reads = fresh = torn = stale = 0;
+  pthread_create(&thread, NULL, writerThread, &n);
+  for (;;) {
+    int done = __atomic_load_n(&writerDone, __ATOMIC_ACQUIRE);
+    p = poseBufferFront(&buffer, &f);
+    reads ++;
+    if (f) {
+      fresh ++;
+      if (p->sequence <= last) stale ++;
+      last = p->sequence;
+    }
+    for (j = 0; j < VIZ_MAX_ARROWS; j++) {
+      for (k = 0; k < 4; k++) if (p->arrow[j].q[k] != p->sequence && p->sequence != 0) torn ++;
+      for (k = 0; k < 3; k++) if (p->arrow[j].position[k] != p->sequence) torn ++;
+    }
+    if (done && ! f) break;
+  }
+  pthread_join(thread, NULL);
+  if (last != n) stale ++;
+  printf("pose buffer: %lld updates, %lld reads, %lld fresh, %lld torn, %lld stale\n", n, reads, fresh, torn, stale);
+  return(torn + stale);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// trajectory
+
+// a flight in meters, 200 samples per second
+static void flightPoint(long long i, double *x, double *y, double *z) {
+  double t;
+
+  t = i / 200.0;
+  *x = 5 * cos(t / 20) + 0.5 * sin(t) + 0.001 * sin(37 * t);
+  *y = 3 * sin(t / 10) + 0.01 * t / 60;
+  *z = 1 + 0.5 * sin(t / 7);
+}
+
+static double distance2(struct trajectoryPoint *p, struct trajectoryPoint *a, struct trajectoryPoint *b) {
+  double dx, dy, dz, px, py, pz, len2, t;
+
+  dx = b->x - a->x; dy = b->y - a->y; dz = b->z - a->z;
+  px = p->x - a->x; py = p->y - a->y; pz = p->z - a->z;
+  len2 = dx*dx + dy*dy + dz*dz;
+  t = len2 > 0 ? std::max(0.0, std::min(1.0, (px*dx + py*dy + pz*dz) / len2)) : 0;
+  px -= t*dx; py -= t*dy; pz -= t*dz;
+  return(px*px + py*py + pz*pz);
+}
+
+// Returns the largest distance of a point from the decimated path.
+static double lodError(TrajectoryFile *f, const std::vector<unsigned> &kept) {
+  double d, dmax;
+  long long i, j;
+
+  dmax = 0;
+  for (j = 0; j + 1 < (long long) kept.size(); j++) {
+    for (i = kept[j] + 1; i < kept[j+1]; i++) {
+      d = distance2(f->point(i), f->point(kept[j]), f->point(kept[j+1]));
+      if (d > dmax) dmax = d;
+    }
+  }
+  return(sqrt(dmax));
+}
+
+// Average time of drawing the scene and the trajectory at 100 scrubbed positions.
+static double scrubFrameTime(TrajectoryFile *f, double pixelSize, int *level) {
+  struct vizPoses poses;
+  double t0;
+  int i;
+
+  makePoses(&poses, 0);
+  t0 = monotonicTime();
+  for (i = 0; i < 100; i++) {
+    f->cursor = (f->size() - 1) * (i + 1) / 100;
+    sceneDraw(&poses);
+    *level = f->draw(pixelSize);
+    glFinish();
+  }
+  return((monotonicTime() - t0) / 100);
+}
+
+// Returns number of failures.
+static int benchTrajectory(long long n) {
+  static TrajectoryFile file;
+  static TrajectoryHistory history;
+  struct vizPoses poses;
+  FILE *ff;
+  double x, y, z, t0, t1, eps, err, raw, lod, add, draw;
+  long long i;
+  int k, level, failures;
+
+  failures = 0;
+  ff = fopen(BENCH_TRAJECTORY, "w");
+  if (ff == NULL) {
+    printf("%s:%d: Can't create %s\n", __FILE__, __LINE__, BENCH_TRAJECTORY);
+    return(1);
+  }
+  fprintf(ff, "# x y z\n");
+  for (i = 0; i < n; i++) {
+    flightPoint(i, &x, &y, &z);
+    fprintf(ff, "%.6f %.6f %.6f\n", x, y, z);
+  }
+  fclose(ff);
+
+  t0 = monotonicTime();
+  if (file.load(BENCH_TRAJECTORY, 100, 4, 4, 2) != n) {
+    printf("FAIL: trajectory not loaded\n");
+    unlink(BENCH_TRAJECTORY);
+    return(1);
+  }
+  unlink(BENCH_TRAJECTORY);
+  t1 = monotonicTime();
+  file.buildLod(0.01);
+  printf("trajectory: %lld points loaded in %.3f s (%.0f ns/point), level of detail built in %.3f s\n",
+         n, t1 - t0, (t1 - t0) / n * 1e9, monotonicTime() - t1);
+
+  // levels are decimated from the previous level, their error adds up to 4/3 of the tolerance
+  eps = 0.01;
+  for (k = 0; k < TRAJECTORY_LOD_LEVELS; k++, eps *= 4) {
+    err = lodError(&file, file.lodIndexes(k));
+    printf("  level %d: tolerance %7.3f, %8lld points, max error %7.4f\n", k, eps, file.lodSize(k), err);
+    if (err > eps * 4 / 3 + 1e-3) {
+      printf("FAIL: level %d error above tolerance\n", k);
+      failures ++;
+    }
+  }
+
+  file.upload();
+  raw = scrubFrameTime(&file, 0, &level);
+  lod = scrubFrameTime(&file, scenePixelSize(), &level);
+  printf("  scrub frame: raw points %.3f ms, level %d (pixel %.3f) %.3f ms\n", raw * 1e3, level, scenePixelSize(), lod * 1e3);
+
+  // live path of an arrow, one point per pose, drawn every 4th pose
+  history.init(4096, 65536, 1024, 0.05);
+  makePoses(&poses, 0);
+  add = draw = 0;
+  for (i = 0; i < n; i++) {
+    flightPoint(i, &x, &y, &z);
+    t0 = monotonicTime();
+    history.add(x * 100 + 4, y * 100 + 4, z * 100 + 2);
+    add += monotonicTime() - t0;
+    if (i % 4 == 0 && i > n - 4000) {
+      t0 = monotonicTime();
+      history.draw(MAGENTA, GREY);
+      glFinish();
+      draw += monotonicTime() - t0;
+    }
+  }
+  printf("  history: %lld points added (%.0f ns/point), kept %lld recent + %lld decimated, draw %.3f ms\n",
+         n, add / n * 1e9, history.recentSize(), history.olderSize(), draw / 1000 * 1e3);
+  if (history.recentSize() > 4096 || history.olderSize() > 65536 || (n > 8192 && history.olderSize() == 0)) {
+    printf("FAIL: history rings\n");
+    failures ++;
+  }
+  return(failures);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv) {
+  double differ;
+  long long trajectoryPoints;
+  int frames, failures;
+
+  frames = argc > 1 ? atoi(argv[1]) : 300;
+  if (frames < 1) frames = 300;
+  trajectoryPoints = argc > 2 ? atoll(argv[2]) : 2000000;
+  if (createContext() != 0) return(-1);
+
+  sceneInit();
+  sceneReshape(BENCH_WIDTH, BENCH_HEIGHT);
+  legacyInit();
+
+  failures = 0;
+  benchFrames("legacy", legacyDraw, frames);
+  benchFrames("vbo", sceneDraw, frames);
+  differ = compareRenderings(17);
+  printf("pixels differing between legacy and vbo rendering: %.3f%%\n", differ * 100);
+  if (differ > 0.005) {
+    printf("FAIL: renderings differ\n");
+    failures ++;
+  }
+  if (benchPoseBuffer(1000000) != 0) {
+    printf("FAIL: pose buffer\n");
+    failures ++;
+  }
+  failures += benchTrajectory(trajectoryPoints);
+  if (failures) return(1);
+  printf("ok\n");
+  return(0);
+}
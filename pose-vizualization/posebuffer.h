@@ -0,0 +1,107 @@
+// Latest poses handed over from the input thread to the renderer.
+//
+// Lock-free triple buffer: the writer fills its private back slot and
+// swaps it with the middle one, the reader swaps the middle slot with its
+// front slot when there is something new. Neither side waits for the
+// other, the writer never overwrites what the reader is drawing and the reader
+// always gets the newest complete set of poses. A reader with nothing
+// else to do may sleep in poseBufferWait() until the next publish.
+
+#ifndef POSEBUFFER_H
+#define POSEBUFFER_H
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define VIZ_MAX_ARROWS		3
+
+// flags of struct vizPose
+#define VIZ_POSE_QUAT_SET	0x01
+#define VIZ_POSE_POSITION_SET	0x02
+
+struct vizPose {
+  double q[4];		// x,y,z,w
+  double position[3];	// in grid units
+  int flags;
+};
+
+struct vizPoses {
+  struct vizPose arrow[VIZ_MAX_ARROWS];
+  // number of the update, incremented by the writer
+  long long sequence;
+};
+
+// bit set in middle when it holds poses not seen by the reader yet
+#define POSEBUFFER_FRESH	0x4
+
+struct poseBuffer {
+  struct vizPoses slot[3];
+  // slot indexes, back and front are private to the writer and reader
+  int back;
+  int middle;
+  int front;
+  // wakes up a reader in poseBufferWait()
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static inline void poseBufferInit(struct poseBuffer *b) {
+  int i;
+
+  memset(b, 0, sizeof(*b));
+  for(i=0; i<3; i++) {
+    for(int j=0; j<VIZ_MAX_ARROWS; j++) b->slot[i].arrow[j].q[3] = 1.0;
+  }
+  b->back = 0;
+  b->middle = 1;
+  b->front = 2;
+  pthread_mutex_init(&b->mutex, NULL);
+  pthread_cond_init(&b->cond, NULL);
+}
+
+// Writer side, fill poseBufferBack() then publish it.
+static inline struct vizPoses *poseBufferBack(struct poseBuffer *b) {
+  return(&b->slot[b->back]);
+}
+
+static inline void poseBufferPublish(struct poseBuffer *b) {
+  b->back = __atomic_exchange_n(&b->middle, b->back | POSEBUFFER_FRESH, __ATOMIC_ACQ_REL) & ~POSEBUFFER_FRESH;
+  pthread_mutex_lock(&b->mutex);
+  pthread_cond_signal(&b->cond);
+  pthread_mutex_unlock(&b->mutex);
+}
+
+// Reader side, returns the newest poses, valid until the next call.
+static inline struct vizPoses *poseBufferFront(struct poseBuffer *b, int *fresh) {
+  *fresh = 0;
+  if (__atomic_load_n(&b->middle, __ATOMIC_ACQUIRE) & POSEBUFFER_FRESH) {
+    b->front = __atomic_exchange_n(&b->middle, b->front, __ATOMIC_ACQ_REL) & ~POSEBUFFER_FRESH;
+    *fresh = 1;
+  }
+  return(&b->slot[b->front]);
+}
+
+// Reader side, sleeps until fresh poses are published or timeoutMs elapsed.
+// Returns 1 when there are fresh poses for poseBufferFront().
+static inline int poseBufferWait(struct poseBuffer *b, int timeoutMs) {
+  struct timespec t;
+  int fresh;
+
+  clock_gettime(CLOCK_REALTIME, &t);
+  t.tv_sec += timeoutMs / 1000;
+  t.tv_nsec += (timeoutMs % 1000) * 1000000L;
+  if (t.tv_nsec >= 1000000000L) {
+    t.tv_sec ++;
+    t.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&b->mutex);
+  // the flag is tested under the mutex, a publish can't slip in between
+  while (! (fresh = __atomic_load_n(&b->middle, __ATOMIC_ACQUIRE) & POSEBUFFER_FRESH)) {
+    if (pthread_cond_timedwait(&b->cond, &b->mutex, &t) != 0) break;
+  }
+  pthread_mutex_unlock(&b->mutex);
+  return(fresh != 0);
+}
+
+#endif
@@ -0,0 +1,201 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+#include <cmath>
+
+#include "linmath.h"
+#include "scene.h"
+
+// Colors
+GLfloat WHITE[] = {1, 1, 1};
+GLfloat RED[] = {1, 0, 0};
+GLfloat GREEN[] = {0, 1, 0};
+GLfloat BLUE[] = {0.5, 0.5, 1};
+GLfloat MAGENTA[] = {1, 0, 1};
+GLfloat GREY[] = {0.5, 0.5, 0.5};
+
+Checkerboard checkerboard(CHECKB_WIDTH, CHECKB_HEIGHT);
+Camera camera;
+Arrows arrows[VIZ_MAX_ARROWS] = {
+  Arrows(4, 4, 2),
+  Arrows(6, 4, 2),
+  Arrows(8, 4, 2),
+};
+
+// arrow parts, shared by all arrows
+static Mesh arrowHead;		// green cone in the middle
+static Mesh arrowXShaft;
+static Mesh arrowXTip;
+static Mesh arrowYShaft;
+
+#define ARROW_RADIUS	0.1
+#define SCENE_FOVY	40.0
+
+static GLint viewportHeight = 1;
+
+////////////////////////////////////////////////////////////////////////
+
+void Mesh::upload(GLenum m, const float *vertices, int n) {
+  mode = m;
+  count = n;
+  if (vbo == 0) glGenBuffers(1, &vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferData(GL_ARRAY_BUFFER, n * 6 * sizeof(float), vertices, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void pushVertex(std::vector<float> &v, double x, double y, double z, double nx, double ny, double nz) {
+  v.push_back(x); v.push_back(y); v.push_back(z);
+  v.push_back(nx); v.push_back(ny); v.push_back(nz);
+}
+
+void Mesh::createCylinder(double base, double top, double height, int slices, int stacks) {
+  std::vector<float> v;
+  double a0, a1, z0, z1, r0, r1, nz, len;
+  int i, j;
+
+  // same vertices and normals as gluCylinder
+  nz = (base - top) / height;
+  len = sqrt(1 + nz * nz);
+  for (j = 0; j < stacks; j++) {
+    z0 = height * j / stacks;
+    z1 = height * (j + 1) / stacks;
+    r0 = base + (top - base) * j / stacks;
+    r1 = base + (top - base) * (j + 1) / stacks;
+    for (i = 0; i < slices; i++) {
+      a0 = 2 * M_PI * i / slices;
+      a1 = 2 * M_PI * (i + 1) / slices;
+      pushVertex(v, r0*sin(a0), r0*cos(a0), z0, sin(a0)/len, cos(a0)/len, nz/len);
+      pushVertex(v, r1*sin(a0), r1*cos(a0), z1, sin(a0)/len, cos(a0)/len, nz/len);
+      pushVertex(v, r1*sin(a1), r1*cos(a1), z1, sin(a1)/len, cos(a1)/len, nz/len);
+      pushVertex(v, r0*sin(a0), r0*cos(a0), z0, sin(a0)/len, cos(a0)/len, nz/len);
+      pushVertex(v, r1*sin(a1), r1*cos(a1), z1, sin(a1)/len, cos(a1)/len, nz/len);
+      pushVertex(v, r0*sin(a1), r0*cos(a1), z0, sin(a1)/len, cos(a1)/len, nz/len);
+    }
+  }
+  upload(GL_TRIANGLES, &v[0], v.size() / 6);
+}
+
+void Mesh::draw() {
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glVertexPointer(3, GL_FLOAT, 6 * sizeof(float), (void *) 0);
+  glNormalPointer(GL_FLOAT, 6 * sizeof(float), (void *) (3 * sizeof(float)));
+  glDrawArrays(mode, 0, count);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+void Arrows::draw(struct vizPose *p) {
+  if (p->flags == 0) return;
+  glPushMatrix();
+  {
+    glTranslated(getX(p), getY(p), getZ(p));
+
+    double qx = p->q[0];
+    double qy = p->q[1];
+    double qz = p->q[2];
+    double qw = p->q[3];
+    double mm[4][4] = {
+      1.0f - 2.0f*qy*qy - 2.0f*qz*qz, 2.0f*qx*qy - 2.0f*qz*qw, 2.0f*qx*qz + 2.0f*qy*qw, 0.0f,
+      2.0f*qx*qy + 2.0f*qz*qw, 1.0f - 2.0f*qx*qx - 2.0f*qz*qz, 2.0f*qy*qz - 2.0f*qx*qw, 0.0f,
+      2.0f*qx*qz - 2.0f*qy*qw, 2.0f*qy*qz + 2.0f*qx*qw, 1.0f - 2.0f*qx*qx - 2.0f*qy*qy, 0.0f,
+      0.0f, 0.0f, 0.0f, 1.0f
+    };
+    double mmt[4][4];
+    mat4x4_transpose(mmt, mm);
+    glMultMatrixd((const GLdouble*)mmt);
+
+    glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, GREEN);
+    arrowHead.draw();
+    // x
+    glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, BLUE);
+    glRotatef(90.0f, 0.0f, 1.0f, 0.0f);
+    arrowXShaft.draw();
+    glTranslated(0, 0, 3);
+    arrowXTip.draw();
+    glTranslated(0, 0, -3);
+    // y
+    glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, RED);
+    glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);
+    glTranslated(0, -2, -2);
+    arrowYShaft.draw();
+  }
+  glPopMatrix();
+}
+
+////////////////////////////////////////////////////////////////////////
+
+void Checkerboard::create() {
+  std::vector<float> v;
+  int x, y;
+
+  // grey grid lines above the scene
+  for (x = 0; x < width - 1; x++) {
+    pushVertex(v, x, height, 20, 0, 1, 0);
+    pushVertex(v, x+0.05, height, 20, 0, 1, 0);
+    pushVertex(v, x+0.05, 0, 20, 0, 1, 0);
+    pushVertex(v, x, 0, 20, 0, 1, 0);
+  }
+  for (y = 0; y < height - 1; y++) {
+    pushVertex(v, width, y, 20, 0, 1, 0);
+    pushVertex(v, width, y+0.05, 20, 0, 1, 0);
+    pushVertex(v, 0, y+0.05, 20, 0, 1, 0);
+    pushVertex(v, 0, y, 20, 0, 1, 0);
+  }
+  grid.upload(GL_QUADS, &v[0], v.size() / 6);
+}
+
+void Checkerboard::draw() {
+  GLfloat lightPosition[] = {-20, 10, 10, 0.5};
+  glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, GREY);
+  grid.draw();
+}
+
+////////////////////////////////////////////////////////////////////////
+
+void sceneInit() {
+  glEnable(GL_DEPTH_TEST);
+  glLightfv(GL_LIGHT0, GL_DIFFUSE, WHITE);
+  glLightfv(GL_LIGHT0, GL_SPECULAR, WHITE);
+  glMaterialfv(GL_FRONT, GL_SPECULAR, WHITE);
+  glMaterialf(GL_FRONT, GL_SHININESS, 30);
+  glEnable(GL_LIGHTING);
+  glEnable(GL_LIGHT0);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_NORMAL_ARRAY);
+  checkerboard.create();
+  arrowHead.createCylinder(0.2, 0.1, 0.5, 16, 16);
+  arrowXShaft.createCylinder(ARROW_RADIUS, ARROW_RADIUS, 3, 4, 4);
+  arrowXTip.createCylinder(0.2, 0.01, 0.5, 16, 16);
+  arrowYShaft.createCylinder(ARROW_RADIUS, ARROW_RADIUS, 4, 4, 4);
+}
+
+void sceneReshape(GLint w, GLint h) {
+  viewportHeight = h > 0 ? h : 1;
+  glViewport(0, 0, w, h);
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  gluPerspective(SCENE_FOVY, GLfloat(w) / GLfloat(h), 1.0, 150.0);
+  glMatrixMode(GL_MODELVIEW);
+}
+
+double scenePixelSize() {
+  return(fabs(camera.getZ() - checkerboard.centerz()) * 2 * tan(SCENE_FOVY / 2 * M_PI / 180) / viewportHeight);
+}
+
+void sceneDraw(struct vizPoses *poses) {
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glLoadIdentity();
+  gluLookAt(camera.getX(), camera.getY(), camera.getZ(),
+            checkerboard.centerx(), checkerboard.centery(), checkerboard.centerz(),
+            0.0, 1.0, 0.0);
+  checkerboard.draw();
+  for (int i = 0; i < VIZ_MAX_ARROWS; i++) {
+    arrows[i].draw(&poses->arrow[i]);
+  }
+}
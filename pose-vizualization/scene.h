@@ -0,0 +1,99 @@
+// Scene of the pose visualizer, shared by viz and bench-viz.
+//
+// Static geometry (the grid and the arrow meshes) is built into vertex
+// buffer objects once by sceneInit(), each frame is only a few draw calls.
+// It needs a current OpenGL (>= 1.5, compatibility profile) context.
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES
+#endif
+
+#ifdef __APPLE_CC__
+#include <OpenGL/gl.h>
+#include <OpenGL/glu.h>
+#else
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <GL/glext.h>
+#endif
+
+#include "posebuffer.h"
+
+#define CHECKB_WIDTH 	20
+#define CHECKB_HEIGHT	20
+
+class Camera {
+  double x,y,z;
+public:
+  Camera(): x(CHECKB_WIDTH/2), y(CHECKB_HEIGHT/2), z(50) {}
+  double getX() {return x;}
+  double getY() {return y;}
+  double getZ() {return z;}
+  void moveRight() { x += z/20;}
+  void moveLeft() { x -= z/20;}
+  void moveUp() {y += z/20;}
+  void moveDown() {y -= z/20;}
+  void moveDxy(double dx, double dy) {x += dx*z/20; y += dy*z/20; }
+  void zoomIn() {z -= 1;}
+  void zoomOut() {z += 1;}
+};
+
+// Triangles with normals in a vertex buffer, interleaved x,y,z,nx,ny,nz floats.
+class Mesh {
+  GLuint vbo;
+  GLenum mode;
+  GLsizei count;
+public:
+  Mesh(): vbo(0), mode(GL_TRIANGLES), count(0) {}
+  void upload(GLenum mode, const float *vertices, int count);
+  // cylinder or cone along z from 0 to height, like gluCylinder
+  void createCylinder(double base, double top, double height, int slices, int stacks);
+  void draw();
+};
+
+class Arrows {
+  double xoffset;
+  double yoffset;
+  double zoffset;
+public:
+  Arrows(double x, double y, double z): xoffset(x), yoffset(y), zoffset(z) {}
+  double getX(struct vizPose *p) {return p->position[0] + xoffset;}
+  double getY(struct vizPose *p) {return p->position[1] + yoffset;}
+  double getZ(struct vizPose *p) {return p->position[2] + zoffset;}
+  void draw(struct vizPose *p);
+};
+
+class Checkerboard {
+  Mesh grid;
+  int width;
+  int height;
+public:
+  Checkerboard(int width, int height): width(width), height(height) {}
+  double centerx() {return width / 2;}
+  double centery() {return height / 2;}
+  double centerz() {return 0;}
+  void create();
+  void draw();
+};
+
+extern GLfloat WHITE[];
+extern GLfloat RED[];
+extern GLfloat GREEN[];
+extern GLfloat BLUE[];
+extern GLfloat MAGENTA[];
+extern GLfloat GREY[];
+
+extern Camera camera;
+extern Checkerboard checkerboard;
+extern Arrows arrows[VIZ_MAX_ARROWS];
+
+void sceneInit();
+void sceneReshape(GLint w, GLint h);
+void sceneDraw(struct vizPoses *poses);
+// size of a pixel in grid units at the grid distance
+double scenePixelSize();
+
+#endif
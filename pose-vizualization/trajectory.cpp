@@ -0,0 +1,387 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+
+#include "trajectory.h"
+
+// chunk of raw points decimated at once when loading a file
+#define TRAJECTORY_FILE_CHUNK	4096
+
+////////////////////////////////////////////////////////////////////////
+// Douglas-Peucker
+
+static double segmentDistance2(const struct trajectoryPoint *p, const struct trajectoryPoint *a, const struct trajectoryPoint *b) {
+  double dx, dy, dz, px, py, pz, len2, t;
+
+  dx = b->x - a->x; dy = b->y - a->y; dz = b->z - a->z;
+  px = p->x - a->x; py = p->y - a->y; pz = p->z - a->z;
+  len2 = dx*dx + dy*dy + dz*dz;
+  t = len2 > 0 ? (px*dx + py*dy + pz*dz) / len2 : 0;
+  if (t < 0) t = 0;
+  if (t > 1) t = 1;
+  px -= t*dx; py -= t*dy; pz -= t*dz;
+  return(px*px + py*py + pz*pz);
+}
+
+void trajectoryDecimate(const struct trajectoryPoint *points, int n, double epsilon, unsigned base, std::vector<unsigned> &kept) {
+  std::vector<char> keep;
+  std::vector<int> stack;
+  double d, dmax, eps2;
+  int a, b, i, imax;
+
+  if (n <= 0) return;
+  if (n == 1) {
+    kept.push_back(base);
+    return;
+  }
+  keep.resize(n, 0);
+  keep[0] = keep[n-1] = 1;
+  eps2 = epsilon * epsilon;
+  // explicit stack of segments, no recursion on long straight flights
+  stack.push_back(0);
+  stack.push_back(n-1);
+  while (! stack.empty()) {
+    b = stack.back(); stack.pop_back();
+    a = stack.back(); stack.pop_back();
+    dmax = -1;
+    imax = -1;
+    for (i = a+1; i < b; i++) {
+      d = segmentDistance2(&points[i], &points[a], &points[b]);
+      if (d > dmax) {
+        dmax = d;
+        imax = i;
+      }
+    }
+    if (imax < 0 || dmax <= eps2) continue;
+    keep[imax] = 1;
+    stack.push_back(a);
+    stack.push_back(imax);
+    stack.push_back(imax);
+    stack.push_back(b);
+  }
+  for (i = 0; i < n; i++) {
+    if (keep[i]) kept.push_back(base + i);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// live history
+
+void TrajectoryHistory::init(int recent, int older, int chunkSize, double eps) {
+  recentCapacity = recent;
+  olderCapacity = older;
+  chunk = chunkSize;
+  epsilon = eps;
+  recentStart = recentCount = olderStart = olderCount = recentUploaded = olderUploaded = 0;
+  points.resize(recentCapacity + olderCapacity);
+  if (vbo == 0) glGenBuffers(1, &vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(struct trajectoryPoint), NULL, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void TrajectoryHistory::decimateOldest() {
+  std::vector<struct trajectoryPoint> tmp;
+  std::vector<unsigned> kept;
+  long long i;
+  int n;
+
+  // the last point of the chunk stays in the recent ring and links both parts
+  n = std::min((long long) chunk, recentSize() - 1);
+  for (i = 0; i <= n; i++) tmp.push_back(points[(recentStart + i) % recentCapacity]);
+  trajectoryDecimate(&tmp[0], n + 1, epsilon, 0, kept);
+  for (i = 0; i < (long long) kept.size() - 1; i++) {
+    if (olderSize() == olderCapacity) olderStart ++;
+    points[recentCapacity + olderCount % olderCapacity] = tmp[kept[i]];
+    olderCount ++;
+  }
+  recentStart += n;
+}
+
+void TrajectoryHistory::add(double x, double y, double z) {
+  struct trajectoryPoint *p;
+
+  if (recentCapacity == 0) return;
+  // orientation only updates repeat the position, keep one point for it
+  if (recentSize() > 0) {
+    p = &points[(recentCount - 1) % recentCapacity];
+    if (p->x == (float) x && p->y == (float) y && p->z == (float) z) return;
+  }
+  if (recentSize() == recentCapacity) decimateOldest();
+  p = &points[recentCount % recentCapacity];
+  p->x = x;
+  p->y = y;
+  p->z = z;
+  recentCount ++;
+}
+
+void TrajectoryHistory::uploadRing(int base, int capacity, long long uploaded, long long count) {
+  long long i, n;
+  int s;
+
+  // only points added since the last upload, at most the whole ring
+  i = std::max(uploaded, count - capacity);
+  while (i < count) {
+    s = i % capacity;
+    n = std::min(count - i, (long long) (capacity - s));
+    glBufferSubData(GL_ARRAY_BUFFER, (base + s) * sizeof(struct trajectoryPoint), n * sizeof(struct trajectoryPoint), &points[base + s]);
+    i += n;
+  }
+}
+
+void TrajectoryHistory::drawRing(int base, int capacity, long long start, long long count) {
+  GLuint bridge[2];
+  int s, first;
+
+  if (count < 2) return;
+  s = start % capacity;
+  first = std::min(count, (long long) (capacity - s));
+  glDrawArrays(GL_LINE_STRIP, base + s, first);
+  if (count > first) {
+    glDrawArrays(GL_LINE_STRIP, base, count - first);
+    bridge[0] = base + capacity - 1;
+    bridge[1] = base;
+    glDrawElements(GL_LINES, 2, GL_UNSIGNED_INT, bridge);
+  }
+}
+
+void TrajectoryHistory::draw(GLfloat *recentColor, GLfloat *olderColor) {
+  GLuint bridge[2];
+
+  if (recentCount == 0) return;
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  uploadRing(0, recentCapacity, recentUploaded, recentCount);
+  uploadRing(recentCapacity, olderCapacity, olderUploaded, olderCount);
+  recentUploaded = recentCount;
+  olderUploaded = olderCount;
+
+  glDisable(GL_LIGHTING);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glVertexPointer(3, GL_FLOAT, sizeof(struct trajectoryPoint), (void *) 0);
+  glColor3fv(olderColor);
+  drawRing(recentCapacity, olderCapacity, olderStart, olderSize());
+  if (olderSize() > 0) {
+    bridge[0] = recentCapacity + (olderCount - 1) % olderCapacity;
+    bridge[1] = recentStart % recentCapacity;
+    glDrawElements(GL_LINES, 2, GL_UNSIGNED_INT, bridge);
+  }
+  glColor3fv(recentColor);
+  drawRing(0, recentCapacity, recentStart, recentSize());
+  glEnableClientState(GL_NORMAL_ARRAY);
+  glEnable(GL_LIGHTING);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+////////////////////////////////////////////////////////////////////////
+// recorded trajectory
+
+// Parse a number at p, not going beyond end. Returns pointer after the number or NULL.
+static const char *parseNumber(const char *p, const char *end, double *v) {
+  char buf[64];
+  char *eq;
+  double r, f;
+  int sign, digits, e, esign, n;
+
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  sign = 1;
+  if (p < end && (*p == '-' || *p == '+')) {
+    if (*p == '-') sign = -1;
+    p++;
+  }
+  r = 0;
+  digits = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    r = r * 10 + (*p++ - '0');
+    digits ++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    f = 0.1;
+    while (p < end && *p >= '0' && *p <= '9') {
+      r += (*p++ - '0') * f;
+      f *= 0.1;
+      digits ++;
+    }
+  }
+  if (digits == 0) {
+    // nan, inf and other rare forms
+    for (n = 0; p < end && n < (int) sizeof(buf) - 1 && ! isspace(*p); n++) buf[n] = *p++;
+    buf[n] = 0;
+    *v = sign * strtod(buf, &eq);
+    return(eq == buf ? NULL : p);
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    esign = 1;
+    if (p < end && (*p == '-' || *p == '+')) {
+      if (*p == '-') esign = -1;
+      p++;
+    }
+    e = 0;
+    while (p < end && *p >= '0' && *p <= '9') e = e * 10 + (*p++ - '0');
+    r *= pow(10.0, esign * e);
+  }
+  *v = sign * r;
+  return(p);
+}
+
+long long TrajectoryFile::load(const char *path, double scale, double xoffset, double yoffset, double zoffset) {
+  struct trajectoryPoint tp;
+  struct stat st;
+  const char *data, *p, *q, *end;
+  double v[3];
+  int fd, i;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("%s:%d: Can't open %s\n", __FILE__, __LINE__, path);
+    return(-1);
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return(-1);
+  }
+  points.clear();
+  if (st.st_size == 0) {
+    close(fd);
+    return(0);
+  }
+  data = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    printf("%s:%d: Can't map %s\n", __FILE__, __LINE__, path);
+    return(-1);
+  }
+  madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+  end = data + st.st_size;
+  // a line has at least 2 numbers
+  points.reserve(st.st_size / 16);
+  for (p = data; p < end; p = q + 1) {
+    q = (const char *) memchr(p, '\n', end - p);
+    if (q == NULL) q = end;
+    while (p < q && isspace(*p)) p++;
+    // blank lines separate data sets, # starts a comment
+    if (p == q || *p == '#') continue;
+    v[2] = 0;
+    for (i = 0; i < 3 && p != NULL && p < q; i++) p = parseNumber(p, q, &v[i]);
+    if (i < 2 || (i == 2 && p == NULL)) continue;
+    tp.x = v[0] * scale + xoffset;
+    tp.y = v[1] * scale + yoffset;
+    tp.z = (i == 3 && p != NULL ? v[2] : 0) * scale + zoffset;
+    points.push_back(tp);
+  }
+  munmap((void *) data, st.st_size);
+  cursor = points.size() > 0 ? points.size() - 1 : 0;
+  return(points.size());
+}
+
+void TrajectoryFile::buildLod(double epsilon) {
+  std::vector<struct trajectoryPoint> tmp;
+  std::vector<unsigned> kept, *prev;
+  long long n, s, e, j;
+  double eps;
+  int k;
+
+  lodEpsilon = epsilon;
+  for (k = 0; k < TRAJECTORY_LOD_LEVELS; k++) lod[k].clear();
+  n = points.size();
+  if (n == 0) return;
+  // level 0 from raw points, coarser levels from the previous level
+  eps = epsilon;
+  prev = NULL;
+  for (k = 0; k < TRAJECTORY_LOD_LEVELS; k++, eps *= 4) {
+    tmp.clear();
+    if (prev == NULL) {
+      tmp = points;
+    } else {
+      for (j = 0; j < (long long) prev->size(); j++) tmp.push_back(points[(*prev)[j]]);
+    }
+    n = tmp.size();
+    for (s = 0; s < n - 1; s = e) {
+      e = std::min(s + TRAJECTORY_FILE_CHUNK, n - 1);
+      kept.clear();
+      trajectoryDecimate(&tmp[s], e - s + 1, eps, s, kept);
+      // the last point is the first one of the next chunk
+      kept.pop_back();
+      for (j = 0; j < (long long) kept.size(); j++) lod[k].push_back(prev == NULL ? kept[j] : (*prev)[kept[j]]);
+    }
+    lod[k].push_back(prev == NULL ? n - 1 : (*prev)[n - 1]);
+    prev = &lod[k];
+  }
+}
+
+void TrajectoryFile::upload() {
+  int k;
+
+  if (points.size() == 0) return;
+  if (vbo == 0) {
+    glGenBuffers(1, &vbo);
+    glGenBuffers(TRAJECTORY_LOD_LEVELS, ibo);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferData(GL_ARRAY_BUFFER, points.size() * sizeof(struct trajectoryPoint), &points[0], GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  for (k = 0; k < TRAJECTORY_LOD_LEVELS; k++) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[k]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, lod[k].size() * sizeof(unsigned), lod[k].size() ? &lod[k][0] : NULL, GL_STATIC_DRAW);
+  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void TrajectoryFile::scrub(long long delta) {
+  cursor += delta;
+  if (cursor >= (long long) points.size()) cursor = points.size() - 1;
+  if (cursor < 0) cursor = 0;
+}
+
+int TrajectoryFile::draw(double pixelSize) {
+  GLuint bridge[2];
+  long long tail, count;
+  double eps;
+  int level, k;
+
+  if (points.size() == 0 || vbo == 0) return(-1);
+  // levels built from levels may err by 4/3 of their tolerance
+  level = -1;
+  eps = lodEpsilon;
+  for (k = 0; k < TRAJECTORY_LOD_LEVELS && lod[k].size() > 0; k++, eps *= 4) {
+    if (eps * 4 / 3 <= pixelSize) level = k;
+  }
+  tail = std::max(0LL, cursor - TRAJECTORY_TAIL);
+
+  glDisable(GL_LIGHTING);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glVertexPointer(3, GL_FLOAT, sizeof(struct trajectoryPoint), (void *) 0);
+  glColor3fv(GREY);
+  if (level < 0) {
+    glDrawArrays(GL_LINE_STRIP, 0, tail + 1);
+  } else {
+    // kept points up to the tail, then a segment to the tail
+    count = std::upper_bound(lod[level].begin(), lod[level].end(), (unsigned) tail) - lod[level].begin();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo[level]);
+    glDrawElements(GL_LINE_STRIP, count, GL_UNSIGNED_INT, (void *) 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    bridge[0] = lod[level][count - 1];
+    bridge[1] = tail;
+    glDrawElements(GL_LINES, 2, GL_UNSIGNED_INT, bridge);
+  }
+  glColor3fv(BLUE);
+  glDrawArrays(GL_LINE_STRIP, tail, cursor - tail + 1);
+  glColor3fv(RED);
+  glPointSize(6);
+  glDrawArrays(GL_POINTS, cursor, 1);
+  glPointSize(1);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glEnableClientState(GL_NORMAL_ARRAY);
+  glEnable(GL_LIGHTING);
+  return(level);
+}
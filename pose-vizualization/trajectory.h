@@ -0,0 +1,88 @@
+// Trajectory layer of the pose visualizer.
+//
+// TrajectoryHistory keeps the path of a live arrow. The newest points are
+// kept as they came in a ring, when the ring is full its oldest chunk is
+// decimated (Douglas-Peucker) into a second, much longer ring, so long
+// flights stay visible in constant memory. Both rings live in one vertex
+// buffer, only points added since the last frame are uploaded.
+//
+// TrajectoryFile shows a recorded trajectory.dat (lines of "x y [z]", as
+// read by replay-trajectory.gnuplot). The file is mapped and parsed once,
+// all points go to the GPU once with a Douglas-Peucker level of detail
+// pyramid of index buffers. Scrubbing to any point and drawing costs the
+// same for a few or millions of points.
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <vector>
+
+#include "scene.h"
+
+struct trajectoryPoint {
+  float x, y, z;
+};
+
+// Douglas-Peucker simplification of points[0 .. n-1]. Appends to kept the indexes (plus base)
+// of points to keep, the first and the last point are always kept. No dropped point is further
+// than epsilon from the segment between its neighboring kept points.
+void trajectoryDecimate(const struct trajectoryPoint *points, int n, double epsilon, unsigned base, std::vector<unsigned> &kept);
+
+class TrajectoryHistory {
+  // recent raw points followed by older decimated points, rings in one vertex buffer
+  std::vector<struct trajectoryPoint> points;
+  int recentCapacity;
+  int olderCapacity;
+  int chunk;
+  double epsilon;
+  // number of points ever added to each ring, rings hold the last capacity of them
+  long long recentStart, recentCount;
+  long long olderStart, olderCount;
+  long long recentUploaded, olderUploaded;
+  GLuint vbo;
+
+  void decimateOldest();
+  void uploadRing(int base, int capacity, long long uploaded, long long count);
+  void drawRing(int base, int capacity, long long start, long long count);
+public:
+  TrajectoryHistory(): recentCapacity(0), olderCapacity(0), chunk(0), epsilon(0),
+                       recentStart(0), recentCount(0), olderStart(0), olderCount(0),
+                       recentUploaded(0), olderUploaded(0), vbo(0) {}
+  // epsilon is the decimation tolerance in grid units
+  void init(int recentCapacity, int olderCapacity, int chunk, double epsilon);
+  void add(double x, double y, double z);
+  long long recentSize() {return recentCount - recentStart;}
+  long long olderSize() {return olderCount - olderStart;}
+  void draw(GLfloat *recentColor, GLfloat *olderColor);
+};
+
+#define TRAJECTORY_LOD_LEVELS	8
+// points drawn exactly behind the cursor
+#define TRAJECTORY_TAIL		20
+
+class TrajectoryFile {
+  std::vector<struct trajectoryPoint> points;
+  // indexes of points kept at each level, tolerance of level k is lodEpsilon * 4^k
+  std::vector<unsigned> lod[TRAJECTORY_LOD_LEVELS];
+  double lodEpsilon;
+  GLuint vbo;
+  GLuint ibo[TRAJECTORY_LOD_LEVELS];
+public:
+  long long cursor;
+
+  TrajectoryFile(): lodEpsilon(0), vbo(0), cursor(0) {}
+  // Map and parse the file, positions are multiplied by scale and moved by offset. Returns number of points or -1.
+  long long load(const char *path, double scale, double xoffset, double yoffset, double zoffset);
+  void buildLod(double epsilon);
+  void upload();
+  long long size() {return points.size();}
+  long long lodSize(int level) {return lod[level].size();}
+  const std::vector<unsigned> &lodIndexes(int level) {return lod[level];}
+  struct trajectoryPoint *point(long long i) {return &points[i];}
+  void scrub(long long delta);
+  // Draw the path up to the cursor with the coarsest level whose tolerance is below pixelSize.
+  // Returns the level used, -1 for raw points.
+  int draw(double pixelSize);
+};
+
+#endif
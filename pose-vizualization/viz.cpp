@@ -1,6 +1,17 @@
 
 
-// g++ -lGL -lGLU -lglut viz.cpp  && (ncat -l 3333 | ./a.out)
+// make viz  && (ncat -l 3333 | ./viz [-v] [-t trajectory.dat [-s scale]])
+//
+// Poses (quat, rpy and pose lines) are read from stdin by an input thread and
+// handed over to the renderer through a triple buffer (posebuffer.h). A frame
+// is drawn from the newest poses when they change or on user input, at most
+// at vsync; in between the renderer sleeps. -v logs every 127th parsed line.
+//
+// The path of each arrow is drawn behind it (trajectory.h). With -t a recorded
+// trajectory is shown, its x y [z] are multiplied by scale (default 100, as
+// pose lines) and placed at the first arrow. Scrub through it with ',' '.'
+// (one point), '<' '>' (1%), PageUp/PageDown (10%), Home/End, space plays
+// and pauses, '+' '-' change the play speed.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,277 +23,70 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
-#include <sys/select.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "scene.h"
+
 #ifdef __APPLE_CC__
 #include <GLUT/glut.h>
 #else
 #include <GL/glut.h>
+#include <GL/glx.h>
 #endif
 #include <cmath>
+#include <algorithm>
 
 #include "linmath.h"
+#include "posebuffer.h"
+#include "trajectory.h"
 
 #define DIM(x)                          	(sizeof(x) / sizeof(x[0]))
+// how long the idle renderer sleeps waiting for poses, the latency of keys and of trajectory play
+#define VIZ_IDLE_TIMEOUT_MS			10
 
 ///////////////////////////////////////////////////////////////////////////
 
-#define CHECKB_WIDTH 	20
-#define CHECKB_HEIGHT	20
-
-// Colors
-GLfloat WHITE[] = {1, 1, 1};
-GLfloat RED[] = {1, 0, 0};
-GLfloat GREEN[] = {0, 1, 0};
-GLfloat BLUE[] = {0.5, 0.5, 1};
-GLfloat MAGENTA[] = {1, 0, 1};
-GLfloat GREY[] = {0.5, 0.5, 0.5};
-
-
-////////////////////////////////////////////////////////////////////////
-
-
-class Camera {
-  double x,y,z;
-public:
-  Camera(): x(CHECKB_WIDTH/2), y(CHECKB_HEIGHT/2), z(50) {}
-  double getX() {return x;}
-  double getY() {return y;}
-  double getZ() {return z;}
-  void moveRight() { x += z/20;}
-  void moveLeft() { x -= z/20;}
-  void moveUp() {y += z/20;}
-  void moveDown() {y -= z/20;}
-  void moveDxy(double dx, double dy) {x += dx*z/20; y += dy*z/20; }
-  void zoomIn() {z -= 1;}
-  void zoomOut() {z += 1;}
-};
-
-void wireBox(GLdouble width, GLdouble height, GLdouble depth) {
-  glPushMatrix();
-  glScalef(width, height, depth);
-  glutWireCube(1.0);
-  glPopMatrix();
-}
-
-GLUquadricObj *quadratic = gluNewQuadric();
-
-class Arrows {
-  double radius;
-  double x;
-  double y;
-  double z;
-  double xoffset;
-  double yoffset;
-  double zoffset;
-  int direction;
-  double q[4];	// x,y,z,w
-  int allsetFlag;
-  
-public:
-  Arrows(double x, double y, double z): xoffset(x), yoffset(y), zoffset(z), x(x), y(y), z(z) {
-    radius = 0.1;
-    memset(q, 0, sizeof(q));
-    q[3] = 1.0;
-    allsetFlag = 0;
-  }
-  void setQuat(double *qq) {	
-	for(int i=0; i<4; i++) q[i] = qq[i];
-	allsetFlag |= 0x01;
-  }
-  void setPose(double xx, double yy, double zz) {
-    x = xx + xoffset;
-    y = yy + yoffset;
-    z = zz + zoffset;
-    allsetFlag |= 0x02;
-    // printf("pose --> %f %f %f\n", x, y, z);
-  }
-  void update() {
-    if (allsetFlag == 0x0) return;
-    glPushMatrix();
-	{
-	  glTranslated(x, y, z);
-	  
-	  // glMultMatrixd(quaternionToMatrix(q));
-	  double qx = q[0];
-	  double qy = q[1];
-	  double qz = q[2];
-	  double qw = q[3];
-	  double mm[4][4] = {
-		1.0f - 2.0f*qy*qy - 2.0f*qz*qz, 2.0f*qx*qy - 2.0f*qz*qw, 2.0f*qx*qz + 2.0f*qy*qw, 0.0f,
-		2.0f*qx*qy + 2.0f*qz*qw, 1.0f - 2.0f*qx*qx - 2.0f*qz*qz, 2.0f*qy*qz - 2.0f*qx*qw, 0.0f,
-		2.0f*qx*qz - 2.0f*qy*qw, 2.0f*qy*qz + 2.0f*qx*qw, 1.0f - 2.0f*qx*qx - 2.0f*qy*qy, 0.0f,
-		0.0f, 0.0f, 0.0f, 1.0f
-	  };
-	  double mmt[4][4];
-	  mat4x4_transpose(mmt, mm);
-	  glMultMatrixd((const GLdouble*)mmt);
-
-#if 1
-	 
-	  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, GREEN);
-	  //gluCylinder(quadratic, radius, radius, 1, 4, 4);
-	  //glTranslated(0, 0, 1);
-	  gluCylinder(quadratic, 0.2f, 0.1f, 0.5, 16, 16);
-	  //glTranslated(0, 0, -1);
-	  // x
-	  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, BLUE);
-	  glRotatef(90.0f, 0.0f, 1.0f, 0.0f);
-	  gluCylinder(quadratic, radius, radius, 3, 4, 4);
-	  glTranslated(0, 0, 3);
-	  gluCylinder(quadratic, 0.2f, 0.01f, 0.5, 16, 16);
-	  glTranslated(0, 0, -3);
-	  // y
-	  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, RED);
-	  // glRotatef(-90.0f, 0.0f, 1.0f, 0.0f);
-	  glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);
-	  glTranslated(0, -2, -2);
-	  gluCylinder(quadratic, radius, radius, 4, 4, 4);
-	  glTranslated(0, 2, 2);
-	  //gluCylinder(quadratic, 0.2f, 0.01f, 0.5, 16, 16);
-#else
-	  // z
-	  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, GREEN);
-	  gluCylinder(quadratic, radius, radius, 1, 4, 4);
-	  glTranslated(0, 0, 1);
-	  gluCylinder(quadratic, 0.2f, 0.01f, 0.5, 16, 16);
-	  glTranslated(0, 0, -1);
-	  // x
-	  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, BLUE);
-	  glRotatef(90.0f, 0.0f, 1.0f, 0.0f);
-	  gluCylinder(quadratic, radius, radius, 1, 4, 4);
-	  glTranslated(0, 0, 1);
-	  gluCylinder(quadratic, 0.2f, 0.01f, 0.5, 16, 16);
-	  glTranslated(0, 0, -1);
-	  // y
-	  glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, RED);
-	  // glRotatef(-90.0f, 0.0f, 1.0f, 0.0f);
-	  glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);
-	  gluCylinder(quadratic, radius, radius, 1, 4, 4);
-	  glTranslated(0, 0, 1);
-	  gluCylinder(quadratic, 0.2f, 0.01f, 0.5, 16, 16);
-#endif
-	  
-	}
-    glPopMatrix();
-  }
-};
-
-
-class Checkerboard {
-  int displayListId;
-  int width;
-  int height;
-public:
-  Checkerboard(int width, int height): width(width), height(height) {}
-  double centerx() {return width / 2;}
-  double centery() {return height / 2;}
-  double centerz() {return 0;}
-  void create() {
-    displayListId = glGenLists(1);
-    glNewList(displayListId, GL_COMPILE);
-    GLfloat lightPosition[] = {-20, 10, 10, 0.5};
-    glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
-    glBegin(GL_QUADS);
-    glNormal3d(0, 1, 0);
-    /*
-    for (int x = 0; x < width - 1; x++) {
-      for (int y = 0; y < height - 1; y++) {
-        glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE,
-                     (x + y) % 2 == 0 ? RED : WHITE);
-        glVertex3d(x, y, 0);
-        glVertex3d(x+1, y, 0);
-        glVertex3d(x+1, y+1, 0);
-        glVertex3d(x, y+1, 0);
-
-      }
-    }
-    */
-
-    glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, GREY);
-    for (int x = 0; x < width - 1; x++) {
-      glVertex3d(x, height, 20);
-      glVertex3d(x+0.05, height, 20);
-      glVertex3d(x+0.05, 0, 20);
-      glVertex3d(x, 0, 20);
-    }
-    for (int y = 0; y < height - 1; y++) {
-      glVertex3d(width, y, 20);
-      glVertex3d(width, y+0.05, 20);
-      glVertex3d(0, y+0.05, 20);
-      glVertex3d(0, y, 20);
-    }
-
-#if 0
-    // full walls at 0,0
-    glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, MAGENTA);
-    glVertex3d(0, 0, 0);
-    glVertex3d(0, 1, 0);
-    glVertex3d(0, 1, 1);
-    glVertex3d(0, 0, 1);
- 
-    glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, GREY);
-    glVertex3d(0, 0, 0);
-    glVertex3d(1, 0, 0);
-    glVertex3d(1, 0, 1);
-    glVertex3d(0, 0, 1);
- #endif
-    
-    glEnd();
-    glEndList();
-  }
-  void draw() {
-    glCallList(displayListId);
-  }
-};
+// poses parsed by the input thread, drawn by the GLUT thread
+struct poseBuffer poseBuffer;
+int optVerbose;
 
-
-Checkerboard checkerboard(CHECKB_WIDTH, CHECKB_HEIGHT);
-Camera camera;
-Arrows arrows[] = {
-  Arrows(4, 4, 2),
-  Arrows(6, 4, 2),
-  Arrows(8, 4, 2),
-};
-
-
-
-void init() {
-  glEnable(GL_DEPTH_TEST);
-  glLightfv(GL_LIGHT0, GL_DIFFUSE, WHITE);
-  glLightfv(GL_LIGHT0, GL_SPECULAR, WHITE);
-  glMaterialfv(GL_FRONT, GL_SPECULAR, WHITE);
-  glMaterialf(GL_FRONT, GL_SHININESS, 30);
-  glEnable(GL_LIGHTING);
-  glEnable(GL_LIGHT0);
-  checkerboard.create();
-}
+// live paths of arrows and the recorded trajectory
+TrajectoryHistory history[VIZ_MAX_ARROWS];
+TrajectoryFile trajectory;
+int playing;
+long long playSpeed = 1;
 
 
 void display() {
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glLoadIdentity();
-  gluLookAt(camera.getX(), camera.getY(), camera.getZ(),
-            checkerboard.centerx(), checkerboard.centery(), checkerboard.centerz(),
-            0.0, 1.0, 0.0);
-  checkerboard.draw();
-  for (int i = 0; i < sizeof arrows / sizeof(Arrows); i++) {
-    arrows[i].update();
+  struct vizPoses *poses;
+  struct vizPose *p;
+  int i, fresh;
+
+  // the newest poses, there is no waiting for the input
+  poses = poseBufferFront(&poseBuffer, &fresh);
+  for (i = 0; fresh && i < VIZ_MAX_ARROWS; i++) {
+    p = &poses->arrow[i];
+    if (p->flags & VIZ_POSE_POSITION_SET) history[i].add(arrows[i].getX(p), arrows[i].getY(p), arrows[i].getZ(p));
   }
-  glFlush();
+  if (playing) trajectory.scrub(playSpeed);
+  sceneDraw(poses);
+  for (i = 0; i < VIZ_MAX_ARROWS; i++) history[i].draw(MAGENTA, GREY);
+  trajectory.draw(scenePixelSize());
   glutSwapBuffers();
 }
 
 
+void idle() {
+  // sleep until the input thread publishes fresh poses, do not spin redrawing the same frame
+  if (poseBufferWait(&poseBuffer, VIZ_IDLE_TIMEOUT_MS) || playing) glutPostRedisplay();
+}
+
+
 void reshape(GLint w, GLint h) {
-  glViewport(0, 0, w, h);
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  gluPerspective(40.0, GLfloat(w) / GLfloat(h), 1.0, 150.0);
-  glMatrixMode(GL_MODELVIEW);
+  sceneReshape(w, h);
 }
 
 
@@ -292,6 +96,10 @@ void special(int key, int, int) {
   case GLUT_KEY_RIGHT: camera.moveRight(); break;
   case GLUT_KEY_UP: camera.moveUp(); break;
   case GLUT_KEY_DOWN: camera.moveDown(); break;
+  case GLUT_KEY_PAGE_UP: trajectory.scrub(- trajectory.size() / 10); break;
+  case GLUT_KEY_PAGE_DOWN: trajectory.scrub(trajectory.size() / 10); break;
+  case GLUT_KEY_HOME: trajectory.scrub(- trajectory.size()); break;
+  case GLUT_KEY_END: trajectory.scrub(trajectory.size()); break;
   }
   glutPostRedisplay();
 }
@@ -301,7 +109,15 @@ void keyboard(unsigned char key,int x, int y) {
   case 'Q':
   case 27:  // ESC
     exit(0);
+  case ',': trajectory.scrub(-1); break;
+  case '.': trajectory.scrub(1); break;
+  case '<': trajectory.scrub(- std::max(1LL, trajectory.size() / 100)); break;
+  case '>': trajectory.scrub(std::max(1LL, trajectory.size() / 100)); break;
+  case ' ': playing = ! playing; break;
+  case '+': playSpeed *= 2; break;
+  case '-': if (playSpeed > 1) playSpeed /= 2; break;
   }  
+  glutPostRedisplay();
 }
 void MouseFunc(int button, int state, int x, int y){
     if (button == 3) {
@@ -309,6 +125,7 @@ void MouseFunc(int button, int state, int x, int y){
     } else if (button == 4) {
 	  camera.zoomOut();
     }
+    glutPostRedisplay();
 }
 void MotionFunc(int x, int y) {
   static int xx=-1;
@@ -322,6 +139,7 @@ void MotionFunc(int x, int y) {
 	camera.moveDxy(dx/10, dy/10);
   }
   xx = x; yy = y;
+  glutPostRedisplay();
 }
 
 
@@ -347,138 +165,147 @@ static void wikiEulerAnglesToQuaternion(double yaw, double pitch, double roll, d
     q[2] = cr * cp * sy - sr * sp * cy;
 }
 
-int checkInput() {
-  static char		bbb[READ_BUFFER_SIZE];
-  static int		bbbi = 0;
-
-  int 		i, n, t;
-  int64_t		tstamp;
-  char		*p, *q, *eq;
-  int 		r, d, res;
-  fd_set 		inset;
-  fd_set 		outset;
-  fd_set 		errset;
-  struct timeval 	tout;
-  static int inputPipeFd = STDIN_FILENO;
-  res = 0;
-  double 		a[16];
-  double 		b[16];
+static int arrowIndex(char *q) {
+  char *eq;
+  int i;
 
-  
-  FD_ZERO(&inset);
-  FD_SET(inputPipeFd, &inset);
-  FD_ZERO(&outset);
-  FD_ZERO(&errset);
-  FD_SET(inputPipeFd, &errset);
-  tout.tv_sec = 0;
-  tout.tv_usec = 1000;		// wait 1ms max
-  // printf("["); fflush(stdout);
-  r = select(inputPipeFd + 1, &inset, &outset, &errset, &tout);
-  // printf("]"); fflush(stdout);
-
-  if (r < 0) {
-	
-	if (errno == EINTR) return(0);
-
-	printf("Error: %s:%d: select returned %d!\n", __FILE__, __LINE__, r);
-	return(0);
-  }
+  i = strtol(q, &eq, 10);
+  if (eq == q || i<0 || i>=VIZ_MAX_ARROWS) i = 0;
+  return(i);
+}
 
-  if (r == 0) return(0);
-  // if there is some problem with stdin, do emergency landing
-  if (FD_ISSET(inputPipeFd, &errset)) return(0);
-  if (! FD_ISSET(inputPipeFd, &inset)) return(0);
-  if (bbbi >= READ_BUFFER_SIZE - 2) {
-	printf("Error: %s:%d: read buffer full before read\n", __FILE__, __LINE__);	
-	return(0);
+// Parse one input line into poses. Returns 1 if poses changed.
+int parseLine(char *line, struct vizPoses *poses) {
+  struct vizPose *p;
+  char *q, *eq;
+  double a[4];
+  int i;
+
+  q = line;
+  SKIP_BLANK(q);
+  if (strncmp(q, "quat", 4) == 0) {
+	q += 4;
+	for(i=0; i<4; i++) {
+	  a[i] = strtod(q, &eq);
+	  if (eq == q) return(0);
+	  q = eq;
+	}
+	p = &poses->arrow[arrowIndex(q)];
+	for(i=0; i<4; i++) p->q[i] = a[i];
+	p->flags |= VIZ_POSE_QUAT_SET;
+	return(1);
+  } else if (strncmp(q, "rpy", 3) == 0) {
+	q += 3;
+	for(i=0; i<3; i++) {
+	  a[i] = strtod(q, &eq);
+	  if (eq == q) return(0);
+	  q = eq;
+	}
+	p = &poses->arrow[arrowIndex(q)];
+	wikiEulerAnglesToQuaternion(a[2], a[1], a[0], p->q);
+	p->flags |= VIZ_POSE_QUAT_SET;
+	return(1);
+  } else if (strncmp(q, "pose", 4) == 0) {
+	q += 4;
+	for(i=0; i<3; i++) {
+	  a[i] = strtod(q, &eq);
+	  if (eq == q) return(0);
+	  q = eq;
+	}
+	p = &poses->arrow[arrowIndex(q)];
+	for(i=0; i<3; i++) p->position[i] = a[i]*100;
+	p->flags |= VIZ_POSE_POSITION_SET;
+	return(1);
   }
+  printf("%s:%d: Ignoring '%s'\n", __FILE__, __LINE__, line);
+  fflush(stdout);
+  return(0);
+}
 
-  n = read(inputPipeFd, bbb+bbbi, READ_BUFFER_SIZE - bbbi - 2);
-  if (n == 0) return(0);
-  if (n < 0) {
-    printf("Error: %s:%d: problem on read!\n", __FILE__, __LINE__);
-    return(0);
-  }
-  bbbi += n;
-  if (bbbi >= READ_BUFFER_SIZE) {
-	printf("Error: %s:%d: read buffer overflowed!\n", __FILE__, __LINE__);
-	bbbi = 0;
-	return(0);
-  }
-  bbb[bbbi] = 0;
-  for (;;) {
-	p = strchr(bbb, '\n');
-	// no more newlines read we are done with parsing:
-	if (p == NULL) return(res);
-	*p = 0;
-	// o.k. we have whole line, parse it
-	q = bbb;
-#if 1
-	{ static int counter = 0;
-	  if (counter ++ % 127 == 0) {
-	    printf("%s:%d: Parsing '%s'\n", __FILE__, __LINE__, bbb);
-	    fflush(stdout);
-	  }
+// Input thread, blocks in read and publishes the poses after each chunk of input.
+void *inputThread(void *arg) {
+  static char bbb[READ_BUFFER_SIZE];
+  struct vizPoses current;
+  char *p, *line;
+  int n, bbbi, changed;
+  long long counter;
+
+  memset(&current, 0, sizeof(current));
+  for(n=0; n<VIZ_MAX_ARROWS; n++) current.arrow[n].q[3] = 1.0;
+  bbbi = 0;
+  counter = 0;
+  for(;;) {
+	n = read(STDIN_FILENO, bbb+bbbi, READ_BUFFER_SIZE - bbbi - 1);
+	if (n == 0) break;
+	if (n < 0) {
+	  if (errno == EINTR) continue;
+	  printf("Error: %s:%d: problem on read!\n", __FILE__, __LINE__);
+	  break;
 	}
-#endif
-	SKIP_BLANK(q);
-	if (strncmp(q, "quat", 4) == 0) {
-	  q += 4;
-	  for(i=0; i<4; i++) {
-		a[i] = strtod(q, &eq);
-		if (eq == q) goto skip;
-		q = eq;
+	bbbi += n;
+	bbb[bbbi] = 0;
+	changed = 0;
+	line = bbb;
+	while ((p = strchr(line, '\n')) != NULL) {
+	  *p = 0;
+	  changed |= parseLine(line, &current);
+	  if (optVerbose && counter ++ % 127 == 0) {
+		printf("%s:%d: Parsed '%s'\n", __FILE__, __LINE__, line);
+		fflush(stdout);
 	  }
-	  i = strtol(q, &eq, 10);
-	  if (eq == q) i = 0;
-	  arrows[i].setQuat(a);
-	  res |= 1;
-	} else if (strncmp(q, "rpy", 3) == 0) {
-	  q += 3;
-	  for(i=0; i<3; i++) {
-		a[i] = strtod(q, &eq);
-		if (eq == q) goto skip;
-		q = eq;
-	  }
-	  wikiEulerAnglesToQuaternion(a[2], a[1], a[0], b);
-	  i = strtol(q, &eq, 10);
-	  if (eq == q) i = 0;
-	  arrows[i].setQuat(b);
-	  res |= 1;
-	} else if (strncmp(q, "pose", 4) == 0) {
-	  q += 4;
-	  for(i=0; i<3; i++) {
-		a[i] = strtod(q, &eq);
-		if (eq == q) goto skip;
-		q = eq;
-	  }
-	  i = strtol(q, &eq, 10);
-	  if (eq == q || i<0 || i>=DIM(arrows) ) i = 0;
-	  arrows[i].setPose(a[0]*100, a[1]*100, a[2]*100);
-	} else {
-	  printf("%s:%d: Ignoring '%s'\n", __FILE__, __LINE__, bbb);
-	  fflush(stdout);
+	  line = p + 1;
+	}
+	bbbi = bbb + bbbi - line;
+	if (bbbi >= READ_BUFFER_SIZE - 1) {
+	  printf("Error: %s:%d: line too long, dropped\n", __FILE__, __LINE__);
+	  bbbi = 0;
+	}
+	memmove(bbb, line, bbbi);
+	// only the newest state of a burst of lines is drawn
+	if (changed) {
+	  current.sequence ++;
+	  *poseBufferBack(&poseBuffer) = current;
+	  poseBufferPublish(&poseBuffer);
 	}
-  skip:
-	d = bbb+bbbi-p-1;
-	memmove(bbb, p+1, d);
-	bbbi = d;
   }
-  return(0);
+  return(NULL);
 }
 
 
+static void setSwapInterval() {
+#if ! defined(__APPLE_CC__)
+  typedef int (*swapIntervalFunction)(int);
+  swapIntervalFunction f;
 
-void timer(int v) {
-  checkInput();
-  glutPostRedisplay();
-  glutTimerFunc(1000/30, timer, v);
+  // render at vsync, not faster
+  f = (swapIntervalFunction) glXGetProcAddressARB((const GLubyte *) "glXSwapIntervalMESA");
+  if (f == NULL) f = (swapIntervalFunction) glXGetProcAddressARB((const GLubyte *) "glXSwapIntervalSGI");
+  if (f != NULL) f(1);
+#endif
 }
 
 
-
 int main(int argc, char** argv) {
+  pthread_t thread;
+  const char *optTrajectory;
+  double optScale;
+  int i;
+
   glutInit(&argc, argv);
+  optTrajectory = NULL;
+  optScale = 100;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-v") == 0) {
+      optVerbose = 1;
+    } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+      optTrajectory = argv[++i];
+    } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      optScale = strtod(argv[++i], NULL);
+    } else {
+      printf("usage: %s [-v] [-t trajectory.dat [-s scale]]\n", argv[0]);
+      exit(-1);
+    }
+  }
   glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
   glutInitWindowPosition(80, 80);
   glutInitWindowSize(800, 600);
@@ -489,7 +316,24 @@ int main(int argc, char** argv) {
   glutSpecialFunc(special);
   glutMouseFunc(MouseFunc);
   glutMotionFunc(MotionFunc);
-  glutTimerFunc(100, timer, 0);
-  init();
+  glutIdleFunc(idle);
+  sceneInit();
+  setSwapInterval();
+  for (i = 0; i < VIZ_MAX_ARROWS; i++) history[i].init(4096, 65536, 1024, 0.05);
+  if (optTrajectory != NULL) {
+    struct vizPose origin;
+    double t0;
+
+    memset(&origin, 0, sizeof(origin));
+    t0 = glutGet(GLUT_ELAPSED_TIME);
+    if (trajectory.load(optTrajectory, optScale, arrows[0].getX(&origin), arrows[0].getY(&origin), arrows[0].getZ(&origin)) < 0) exit(-1);
+    trajectory.buildLod(0.01);
+    trajectory.upload();
+    printf("%s: %lld points, %lld at the coarsest level, loaded in %.3f s\n", optTrajectory, trajectory.size(),
+           trajectory.lodSize(TRAJECTORY_LOD_LEVELS-1), (glutGet(GLUT_ELAPSED_TIME) - t0) / 1000.0);
+    fflush(stdout);
+  }
+  poseBufferInit(&poseBuffer);
+  pthread_create(&thread, NULL, inputThread, NULL);
   glutMainLoop();
 }
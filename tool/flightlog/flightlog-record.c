@@ -0,0 +1,251 @@
+/*
+  Record a flight log from sensor bus shared memory channels and text
+  streams.
+
+  Sensor tools publish in SENSOR_BUS_SHM mode (RASPILOT_SENSOR_BUS=shm),
+  the recorder follows their rings like any other reader, so it never
+  slows them down. With -a, all sensor bus rings found in /dev/shm are
+  recorded, including those created after the start.
+
+  Text streams, like motor commands sent by raspilot to a motor tool, are
+  recorded by putting the recorder in the pipe with -tee, e.g.:
+
+  raspilot | flightlog-record -o flight.log -tee motors | motor-esc-pigpio
+
+  copies stdin to stdout and records each line. The log is closed (with
+  its index) on SIGINT, SIGTERM or at the end of stdin in tee mode. If the
+  recorder is killed, the log is readable up to the last written chunk,
+  chunks are written at least every -f seconds.
+
+  usage: flightlog-record -o <log> [-a] [-p <poll_usec>] [-f <flush_sec>] [-tee <name>] [<channel> ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flightlog.h"
+
+#define FLIGHT_LOG_RECORD_SCAN_PERIOD	1000000000LL
+
+struct recordedChannel {
+    struct sensorBusReader	reader;
+    int				logChannel;
+};
+
+static struct recordedChannel	recorded[FLIGHT_LOG_MAX_CHANNELS];
+static int			recordedCount;
+static struct flightLogWriter	writer;
+static volatile int		stopFlag;
+
+static void stopHandler(int sig) {
+    stopFlag = 1;
+}
+
+static void usage(char *name) {
+    printf("usage: %s -o <log> [-a] [-p <poll_usec>] [-f <flush_sec>] [-tee <name>] [<channel> ...]\n", name);
+    exit(-1);
+}
+
+static int isRecorded(const char *name) {
+    const char	*s;
+    int		i;
+
+    for(i=0; i<recordedCount; i++) {
+	s = recorded[i].reader.ring->name;
+	if (s[0] == '/') s ++;
+	if (strcmp(s, name) == 0) return(1);
+    }
+    return(0);
+}
+
+static int addChannel(const char *name, int verbose) {
+    struct recordedChannel	*c;
+
+    if (recordedCount >= FLIGHT_LOG_MAX_CHANNELS - 1) return(-1);
+    c = &recorded[recordedCount];
+    if (sensorBusReaderOpen(&c->reader, name) != 0) {
+	if (verbose) printf("%s:%d: Can't open sensor bus channel %s.\n", __FILE__, __LINE__, name);
+	return(-1);
+    }
+    c->logChannel = flightLogWriterAddChannel(&writer, c->reader.ring->name, c->reader.ring->type);
+    if (c->logChannel < 0) {
+	sensorBusReaderClose(&c->reader);
+	return(-1);
+    }
+    recordedCount ++;
+    fprintf(stderr, "flightlog-record: recording %s\n", c->reader.ring->name);
+    return(0);
+}
+
+// Add sensor bus rings appearing in /dev/shm.
+static void scanChannels() {
+    DIR			*d;
+    struct dirent	*e;
+    struct stat		st;
+    uint32_t		*magic;
+    char		path[512];
+    int			fd;
+
+    d = opendir("/dev/shm");
+    if (d == NULL) return;
+    while ((e = readdir(d)) != NULL) {
+	if (e->d_name[0] == '.' || isRecorded(e->d_name)) continue;
+	snprintf(path, sizeof(path), "/dev/shm/%s", e->d_name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) continue;
+	magic = NULL;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == sizeof(struct sensorBusRing)) {
+	    magic = (uint32_t *) mmap(NULL, sizeof(*magic), PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (magic == NULL || magic == MAP_FAILED) continue;
+	if (*magic == SENSOR_BUS_MAGIC) addChannel(e->d_name, 0);
+	munmap(magic, sizeof(*magic));
+    }
+    closedir(d);
+}
+
+int main(int argc, char **argv) {
+    struct sensorBusSample	sample;
+    struct sigaction		sa;
+    struct pollfd		pfd;
+    char			*optLog, *optTee;
+    char			line[FLIGHT_LOG_TEXT_MAX+1];
+    int				i, n, count, optAll, optPollUsec, teeChannel, teeLen, teeOpen;
+    double			optFlushSec;
+    int64_t			now, lastFlush, lastScan;
+    long long			lost;
+
+    optLog = optTee = NULL;
+    optAll = 0;
+    optPollUsec = 1000;
+    optFlushSec = 1.0;
+    for(i=1; i<argc; i++) {
+	if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+	    optLog = argv[++i];
+	} else if (strcmp(argv[i], "-a") == 0) {
+	    optAll = 1;
+	} else if (strcmp(argv[i], "-p") == 0 && i+1 < argc) {
+	    optPollUsec = atoi(argv[++i]);
+	} else if (strcmp(argv[i], "-f") == 0 && i+1 < argc) {
+	    optFlushSec = atof(argv[++i]);
+	} else if (strcmp(argv[i], "-tee") == 0 && i+1 < argc) {
+	    optTee = argv[++i];
+	} else if (argv[i][0] == '-') {
+	    usage(argv[0]);
+	}
+    }
+    if (optLog == NULL) usage(argv[0]);
+    if (flightLogWriterOpen(&writer, optLog) != 0) exit(-1);
+
+    for(i=1; i<argc; i++) {
+	if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "-tee") == 0) {
+	    i ++;
+	} else if (argv[i][0] != '-') {
+	    if (addChannel(argv[i], 1) != 0) exit(-1);
+	}
+    }
+    if (optAll) scanChannels();
+
+    teeChannel = -1;
+    teeOpen = 0;
+    if (optTee != NULL) {
+	teeChannel = flightLogWriterAddChannel(&writer, optTee, SENSOR_BUS_NONE);
+	teeOpen = 1;
+    }
+    if (recordedCount == 0 && teeChannel < 0 && ! optAll) usage(argv[0]);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopHandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    teeLen = 0;
+    lastFlush = lastScan = flightLogMonotonicTime();
+    while (! stopFlag) {
+	count = 0;
+	for(i=0; i<recordedCount; i++) {
+	    while (sensorBusRead(&recorded[i].reader, &sample)) {
+		flightLogWriteSample(&writer, recorded[i].logChannel, flightLogMonotonicTime(), &sample);
+		count ++;
+	    }
+	}
+
+	if (teeOpen) {
+	    pfd.fd = 0;
+	    pfd.events = POLLIN;
+	    while (teeOpen && poll(&pfd, 1, 0) == 1) {
+		n = read(0, line + teeLen, sizeof(line) - 1 - teeLen);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+		    teeOpen = 0;
+		    stopFlag = 1;
+		    break;
+		}
+		now = flightLogMonotonicTime();
+		if (fwrite(line + teeLen, 1, n, stdout) != (size_t) n) {
+		    teeOpen = 0;
+		    stopFlag = 1;
+		}
+		teeLen += n;
+		count ++;
+		// record complete lines (or full buffers)
+		for(;;) {
+		    char *eol = (char *) memchr(line, '\n', teeLen);
+		    if (eol == NULL && teeLen < (int) sizeof(line) - 1) break;
+		    n = eol == NULL ? teeLen : eol - line + 1;
+		    flightLogWriteText(&writer, teeChannel, now, line, eol == NULL ? n : n - 1);
+		    memmove(line, line + n, teeLen - n);
+		    teeLen -= n;
+		}
+	    }
+	    fflush(stdout);
+	}
+
+	now = flightLogMonotonicTime();
+	if (now - lastFlush >= optFlushSec * 1e9) {
+	    flightLogFlush(&writer);
+	    lastFlush = now;
+	}
+	if (optAll && now - lastScan >= FLIGHT_LOG_RECORD_SCAN_PERIOD) {
+	    scanChannels();
+	    lastScan = now;
+	}
+	if (count == 0) {
+	    if (teeOpen) {
+		// wait on stdin, so a command is passed through as soon as it comes,
+		// the rings are polled when it times out
+		pfd.fd = 0;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, (optPollUsec + 999) / 1000);
+	    } else {
+		usleep(optPollUsec);
+	    }
+	}
+    }
+
+    if (teeLen > 0) flightLogWriteText(&writer, teeChannel, flightLogMonotonicTime(), line, teeLen);
+    lost = 0;
+    for(i=0; i<recordedCount; i++) {
+	if (recorded[i].reader.lost != 0) {
+	    fprintf(stderr, "flightlog-record: %s: %llu samples lost\n", recorded[i].reader.ring->name, (unsigned long long) recorded[i].reader.lost);
+	}
+	lost += recorded[i].reader.lost;
+    }
+    if (flightLogWriterClose(&writer) != 0) exit(-1);
+    fprintf(stderr, "flightlog-record: %lld records, %lld lost, %lld bytes (%.1f bytes per record, compression %.1fx)\n",
+	    writer.totalRecords, lost, writer.totalCompressedBytes,
+	    writer.totalRecords == 0 ? 0.0 : (double) writer.totalCompressedBytes / writer.totalRecords,
+	    writer.totalCompressedBytes == 0 ? 0.0 : (double) writer.totalBytes / writer.totalCompressedBytes);
+    return(0);
+}
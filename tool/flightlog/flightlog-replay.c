@@ -0,0 +1,184 @@
+/*
+  Replay a flight log. Samples are published again on their sensor bus
+  channels (in the mode given by RASPILOT_SENSOR_BUS, in text mode they
+  are printed to stdout like the original tools do), text streams are
+  printed to stdout. Records come in the recorded order, paced by their
+  recorded times divided by the speed.
+
+  -x <speed>	replay speed, 1 is real time (default), 0 as fast as possible.
+  		As fast as possible is only throttled by the consumer reading
+  		stdout, shared memory readers may lose samples.
+  -s <sec>	start <sec> seconds after the beginning of the log
+  -d <sec>	stop after <sec> seconds of the log
+  -c <channel>	replay only this channel (may be repeated)
+  -rebase	shift sample timestamps so that the log starts now
+  -l		list chunks and channels of the log instead of replaying it
+
+  e.g. RASPILOT_SENSOR_BUS=text flightlog-replay -x 10 flight.log | raspilot
+
+  usage: flightlog-replay [-x <speed>] [-s <sec>] [-d <sec>] [-c <channel>] ... [-rebase] [-l] <log>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "flightlog.h"
+
+#define FLIGHT_LOG_REPLAY_MAX_FILTER	32
+
+static void usage(char *name) {
+    printf("usage: %s [-x <speed>] [-s <sec>] [-d <sec>] [-c <channel>] ... [-rebase] [-l] <log>\n", name);
+    exit(-1);
+}
+
+static void sleepUntil(int64_t t) {
+    struct timespec	ts;
+
+    ts.tv_sec = t / 1000000000LL;
+    ts.tv_nsec = t % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) ;
+}
+
+static void listLog(struct flightLogReader *r) {
+    struct flightLogRecord	rec;
+    long long			count[FLIGHT_LOG_MAX_CHANNELS];
+    const char			*name[FLIGHT_LOG_MAX_CHANNELS];
+    int				type[FLIGHT_LOG_MAX_CHANNELS];
+    int				i, res;
+    int64_t			start;
+
+    printf("log started at %.6f%s\n", r->header.realtimeStart, r->recovered ? ", not closed, index rebuilt" : "");
+    if (r->chunks == 0) return;
+    start = r->index[0].firstTime;
+    for(i=0; i<r->chunks; i++) {
+	printf("chunk %4d: offset %10llu, %6u records, %10.3f - %10.3f s\n",
+	       i, (unsigned long long) r->index[i].offset, r->index[i].records,
+	       (r->index[i].firstTime - start) / 1e9, (r->index[i].lastTime - start) / 1e9);
+    }
+    memset(count, 0, sizeof(count));
+    memset(name, 0, sizeof(name));
+    while ((res = flightLogRead(r, &rec)) != 0) {
+	if (res < 0) continue;
+	count[rec.channel] ++;
+	name[rec.channel] = rec.name;
+	type[rec.channel] = rec.type;
+    }
+    for(i=0; i<FLIGHT_LOG_MAX_CHANNELS; i++) {
+	if (name[i] == NULL) continue;
+	printf("channel %2d: %-40s %-6s %10lld records\n", i, name[i], type[i] == SENSOR_BUS_NONE ? "text" : sensorBusTypeTextName(type[i]), count[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct flightLogReader	reader;
+    struct flightLogRecord	rec;
+    struct sensorBusChannel	*channel[FLIGHT_LOG_MAX_CHANNELS];
+    int				selected[FLIGHT_LOG_MAX_CHANNELS];
+    char			*filter[FLIGHT_LOG_REPLAY_MAX_FILTER];
+    char			*optLog;
+    int				i, res, nfilter, optRebase, optList, rebased;
+    double			optSpeed, optStart, optDuration, timestampShift;
+    int64_t			logStart, replayStart, t, lastFlush;
+    long long			count;
+
+    optLog = NULL;
+    optSpeed = 1;
+    optStart = 0;
+    optDuration = -1;
+    optRebase = optList = 0;
+    nfilter = 0;
+    for(i=1; i<argc; i++) {
+	if (strcmp(argv[i], "-x") == 0 && i+1 < argc) {
+	    optSpeed = atof(argv[++i]);
+	} else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+	    optStart = atof(argv[++i]);
+	} else if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+	    optDuration = atof(argv[++i]);
+	} else if (strcmp(argv[i], "-c") == 0 && i+1 < argc && nfilter < FLIGHT_LOG_REPLAY_MAX_FILTER) {
+	    filter[nfilter++] = argv[++i];
+	} else if (strcmp(argv[i], "-rebase") == 0) {
+	    optRebase = 1;
+	} else if (strcmp(argv[i], "-l") == 0) {
+	    optList = 1;
+	} else if (argv[i][0] == '-' || optLog != NULL) {
+	    usage(argv[0]);
+	} else {
+	    optLog = argv[i];
+	}
+    }
+    if (optLog == NULL || optSpeed < 0) usage(argv[0]);
+    if (flightLogReaderOpen(&reader, optLog) != 0) exit(-1);
+    if (reader.recovered) fprintf(stderr, "flightlog-replay: %s was not closed, replaying %d complete chunks\n", optLog, reader.chunks);
+
+    if (optList) {
+	listLog(&reader);
+	flightLogReaderClose(&reader);
+	return(0);
+    }
+    if (reader.chunks == 0) return(0);
+
+    sensorBusTextAutoFlush = 0;
+    memset(channel, 0, sizeof(channel));
+    for(i=0; i<FLIGHT_LOG_MAX_CHANNELS; i++) selected[i] = -1;
+
+    logStart = reader.index[0].firstTime + (int64_t) (optStart * 1e9);
+    if (optStart > 0) flightLogSeek(&reader, logStart);
+    replayStart = flightLogMonotonicTime();
+    lastFlush = replayStart;
+    timestampShift = 0;
+    rebased = 0;
+    count = 0;
+    while ((res = flightLogRead(&reader, &rec)) != 0) {
+	if (res < 0) continue;
+	if (optDuration >= 0 && rec.time - logStart > optDuration * 1e9) break;
+
+	if (selected[rec.channel] < 0) {
+	    selected[rec.channel] = (nfilter == 0);
+	    for(i=0; i<nfilter; i++) {
+		if (strcmp(filter[i], rec.name) == 0) selected[rec.channel] = 1;
+	    }
+	}
+	if (! selected[rec.channel]) continue;
+
+	if (optSpeed > 0) {
+	    t = replayStart + (int64_t) ((rec.time - logStart) / optSpeed);
+	    if (t > flightLogMonotonicTime()) {
+		// flush what is due before waiting
+		fflush(stdout);
+		sleepUntil(t);
+		lastFlush = t;
+	    }
+	}
+
+	if (rec.kind == FLIGHT_LOG_TEXT) {
+	    fwrite(rec.text, 1, rec.textLength, stdout);
+	    putchar('\n');
+	} else {
+	    if (channel[rec.channel] == NULL) {
+		channel[rec.channel] = sensorBusOpen(rec.name, rec.type);
+		if (channel[rec.channel] == NULL) {
+		    printf("%s:%d: Can't open sensor bus channel %s.\n", __FILE__, __LINE__, rec.name);
+		    exit(-1);
+		}
+	    }
+	    if (optRebase && ! rebased) {
+		timestampShift = sensorBusCurrentTime() - rec.sample.timestamp;
+		rebased = 1;
+	    }
+	    sensorBusPublish(channel[rec.channel], rec.sample.timestamp + timestampShift, rec.sample.confidence, rec.sample.value);
+	}
+	count ++;
+	if ((count & 0xff) == 0 && flightLogMonotonicTime() - lastFlush > 10000000LL) {
+	    fflush(stdout);
+	    lastFlush = flightLogMonotonicTime();
+	}
+    }
+    fflush(stdout);
+    t = flightLogMonotonicTime();
+    fprintf(stderr, "flightlog-replay: %lld records replayed in %.3f s\n", count, (t - replayStart) / 1e9);
+    flightLogReaderClose(&reader);
+    return(0);
+}
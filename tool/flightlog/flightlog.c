@@ -0,0 +1,562 @@
+/*
+  Flight log writer and reader, see flightlog.h for the format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "flightlog.h"
+
+// the largest encoded definition or sample record
+#define FLIGHT_LOG_RECORD_MAX	(1 + 3*10 + SENSOR_BUS_NAME_MAX + (SENSOR_BUS_MAX_VALUES + 2) * 9)
+
+int64_t flightLogMonotonicTime() {
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static int flightLogWriteAll(int fd, const void *data, size_t size) {
+    const char	*p;
+    ssize_t	r;
+
+    p = (const char *) data;
+    while (size > 0) {
+	r = write(fd, p, size);
+	if (r < 0 && errno == EINTR) continue;
+	if (r <= 0) return(-1);
+	p += r;
+	size -= r;
+    }
+    return(0);
+}
+
+static int flightLogReadAll(int fd, void *data, size_t size, uint64_t offset) {
+    char	*p;
+    ssize_t	r;
+
+    p = (char *) data;
+    while (size > 0) {
+	r = pread(fd, p, size, offset);
+	if (r < 0 && errno == EINTR) continue;
+	if (r <= 0) return(-1);
+	p += r;
+	size -= r;
+	offset += r;
+    }
+    return(0);
+}
+
+static int flightLogGrow(uint8_t **buf, int *size, int needed) {
+    uint8_t	*nbuf;
+    int		nsize;
+
+    if (needed <= *size) return(0);
+    nsize = *size == 0 ? 4096 : *size;
+    while (nsize < needed) nsize *= 2;
+    nbuf = (uint8_t *) realloc(*buf, nsize);
+    if (nbuf == NULL) return(-1);
+    *buf = nbuf;
+    *size = nsize;
+    return(0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Record encoding
+
+static uint8_t *flightLogPutVarint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+	*p++ = (v & 0x7f) | 0x80;
+	v >>= 7;
+    }
+    *p++ = v;
+    return(p);
+}
+
+static uint64_t flightLogZigzag(int64_t v) {
+    return(((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+static int64_t flightLogUnzigzag(uint64_t v) {
+    return((int64_t) (v >> 1) ^ -(int64_t) (v & 1));
+}
+
+// XOR with the previous value of the same field. Equal values give 0, close values and values
+// converted from floats give zero bytes at both ends. Only the bytes in between are stored,
+// after a byte holding the number of zero low bytes (high nibble) and of stored bytes.
+static uint8_t *flightLogPutXor(uint8_t *p, uint64_t *previous, uint64_t v) {
+    uint64_t	x;
+    int		low, n;
+
+    x = v ^ *previous;
+    *previous = v;
+    if (x == 0) {
+	*p++ = 0;
+	return(p);
+    }
+    low = __builtin_ctzll(x) / 8;
+    x >>= low * 8;
+    n = 8 - __builtin_clzll(x) / 8;
+    *p++ = (low << 4) | n;
+    while (n-- > 0) {
+	*p++ = x & 0xff;
+	x >>= 8;
+    }
+    return(p);
+}
+
+static uint64_t flightLogDoubleBits(double d) {
+    uint64_t	res;
+    memcpy(&res, &d, sizeof(res));
+    return(res);
+}
+
+static uint32_t flightLogFloatBits(float f) {
+    uint32_t	res;
+    memcpy(&res, &f, sizeof(res));
+    return(res);
+}
+
+// Decoder state of one chunk. Functions set err on truncated or malformed data.
+struct flightLogDecoder {
+    uint8_t	*p;
+    uint8_t	*end;
+    int		err;
+};
+
+static uint64_t flightLogGetVarint(struct flightLogDecoder *d) {
+    uint64_t	res;
+    int		shift;
+
+    res = 0;
+    for(shift=0; shift < 64; shift += 7) {
+	if (d->p >= d->end) break;
+	res |= (uint64_t) (*d->p & 0x7f) << shift;
+	if ((*d->p++ & 0x80) == 0) return(res);
+    }
+    d->err = 1;
+    return(0);
+}
+
+static uint64_t flightLogGetXor(struct flightLogDecoder *d, uint64_t *previous) {
+    uint64_t	x;
+    int		low, n, i;
+
+    if (d->p >= d->end) {
+	d->err = 1;
+	return(*previous);
+    }
+    low = *d->p >> 4;
+    n = *d->p++ & 0x0f;
+    if (low + n > 8 || d->p + n > d->end) {
+	d->err = 1;
+	return(*previous);
+    }
+    x = 0;
+    for(i=0; i<n; i++) x |= (uint64_t) *d->p++ << (i * 8);
+    *previous ^= x << (low * 8);
+    return(*previous);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Writer
+
+int flightLogWriterOpen(struct flightLogWriter *w, const char *path) {
+    struct flightLogFileHeader	h;
+    struct timespec		ts;
+
+    memset(w, 0, sizeof(*w));
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+	printf("%s:%d: Can't create %s: %s\n", __FILE__, __LINE__, path, strerror(errno));
+	return(-1);
+    }
+    memset(&h, 0, sizeof(h));
+    h.magic = FLIGHT_LOG_MAGIC;
+    h.version = FLIGHT_LOG_VERSION;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h.realtimeStart = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+    h.monotonicStart = flightLogMonotonicTime();
+    if (flightLogWriteAll(w->fd, &h, sizeof(h)) != 0) {
+	printf("%s:%d: Can't write %s: %s\n", __FILE__, __LINE__, path, strerror(errno));
+	close(w->fd);
+	w->fd = -1;
+	return(-1);
+    }
+    w->offset = sizeof(h);
+    return(0);
+}
+
+int flightLogWriterAddChannel(struct flightLogWriter *w, const char *name, int type) {
+    struct flightLogChannel	*c;
+
+    if (w->channelCount >= FLIGHT_LOG_MAX_CHANNELS || type < 0 || type >= SENSOR_BUS_TYPE_MAX) return(-1);
+    c = &w->channel[w->channelCount];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->type = type;
+    c->definedInChunk = -1;
+    return(w->channelCount++);
+}
+
+// Start a record, emitting the channel definition if it is its first record in the chunk.
+static uint8_t *flightLogRecordStart(struct flightLogWriter *w, int channel, int kind, int64_t time, int extra) {
+    struct flightLogChannel	*c;
+    uint8_t			*p;
+    int				n;
+
+    if (flightLogGrow(&w->buf, &w->size, w->len + FLIGHT_LOG_RECORD_MAX * 2 + extra) != 0) return(NULL);
+    if (w->records == 0) w->firstTime = w->lastTime = time;
+    c = &w->channel[channel];
+    p = w->buf + w->len;
+    if (c->definedInChunk != w->chunkNumber) {
+	c->definedInChunk = w->chunkNumber;
+	memset(c->previous, 0, sizeof(c->previous));
+	n = strlen(c->name);
+	*p++ = FLIGHT_LOG_DEFINITION;
+	p = flightLogPutVarint(p, channel);
+	p = flightLogPutVarint(p, c->type);
+	p = flightLogPutVarint(p, n);
+	memcpy(p, c->name, n);
+	p += n;
+    }
+    *p++ = kind;
+    p = flightLogPutVarint(p, channel);
+    p = flightLogPutVarint(p, flightLogZigzag(time - w->lastTime));
+    w->lastTime = time;
+    return(p);
+}
+
+static int flightLogRecordEnd(struct flightLogWriter *w, uint8_t *p) {
+    w->len = p - w->buf;
+    w->records ++;
+    w->totalRecords ++;
+    if (w->len >= FLIGHT_LOG_CHUNK_SIZE) return(flightLogFlush(w));
+    return(0);
+}
+
+int flightLogWriteSample(struct flightLogWriter *w, int channel, int64_t time, struct sensorBusSample *sample) {
+    struct flightLogChannel	*c;
+    uint8_t			*p;
+    int				i, n;
+
+    if (channel < 0 || channel >= w->channelCount || w->channel[channel].type == SENSOR_BUS_NONE) return(-1);
+    c = &w->channel[channel];
+    p = flightLogRecordStart(w, channel, FLIGHT_LOG_SAMPLE, time, 0);
+    if (p == NULL) return(-1);
+    p = flightLogPutXor(p, &c->previous[0], flightLogDoubleBits(sample->timestamp));
+    p = flightLogPutXor(p, &c->previous[1], flightLogFloatBits(sample->confidence));
+    n = sensorBusTypeValueCount(c->type);
+    for(i=0; i<n; i++) p = flightLogPutXor(p, &c->previous[i+2], flightLogDoubleBits(sample->value[i]));
+    return(flightLogRecordEnd(w, p));
+}
+
+int flightLogWriteText(struct flightLogWriter *w, int channel, int64_t time, const char *text, int len) {
+    uint8_t			*p;
+
+    if (channel < 0 || channel >= w->channelCount || w->channel[channel].type != SENSOR_BUS_NONE) return(-1);
+    if (len > FLIGHT_LOG_TEXT_MAX) len = FLIGHT_LOG_TEXT_MAX;
+    p = flightLogRecordStart(w, channel, FLIGHT_LOG_TEXT, time, len);
+    if (p == NULL) return(-1);
+    p = flightLogPutVarint(p, len);
+    memcpy(p, text, len);
+    p += len;
+    return(flightLogRecordEnd(w, p));
+}
+
+int flightLogFlush(struct flightLogWriter *w) {
+    struct flightLogChunkHeader	h;
+    struct flightLogIndexEntry	*e;
+    uLongf			clen;
+
+    if (w->records == 0) return(0);
+    if (flightLogGrow(&w->compressed, &w->compressedSize, compressBound(w->len)) != 0) return(-1);
+    clen = w->compressedSize;
+    if (compress2(w->compressed, &clen, w->buf, w->len, Z_BEST_SPEED) != Z_OK) {
+	printf("%s:%d: Can't compress chunk.\n", __FILE__, __LINE__);
+	return(-1);
+    }
+    memset(&h, 0, sizeof(h));
+    h.magic = FLIGHT_LOG_CHUNK_MAGIC;
+    h.crc = crc32(0, w->compressed, clen);
+    h.compressedSize = clen;
+    h.size = w->len;
+    h.records = w->records;
+    h.firstTime = w->firstTime;
+    h.lastTime = w->lastTime;
+    if (flightLogWriteAll(w->fd, &h, sizeof(h)) != 0 || flightLogWriteAll(w->fd, w->compressed, clen) != 0) {
+	printf("%s:%d: Can't write chunk: %s\n", __FILE__, __LINE__, strerror(errno));
+	return(-1);
+    }
+
+    if ((w->chunkNumber & (w->chunkNumber - 1)) == 0) {
+	// grow the index at powers of 2
+	e = (struct flightLogIndexEntry *) realloc(w->index, (w->chunkNumber == 0 ? 1 : w->chunkNumber * 2) * sizeof(*e));
+	if (e == NULL) return(-1);
+	w->index = e;
+    }
+    e = &w->index[w->chunkNumber];
+    memset(e, 0, sizeof(*e));
+    e->offset = w->offset;
+    e->firstTime = w->firstTime;
+    e->lastTime = w->lastTime;
+    e->records = w->records;
+
+    w->offset += sizeof(h) + clen;
+    w->totalBytes += w->len;
+    w->totalCompressedBytes += sizeof(h) + clen;
+    w->chunkNumber ++;
+    w->len = 0;
+    w->records = 0;
+    return(0);
+}
+
+int flightLogWriterClose(struct flightLogWriter *w) {
+    struct flightLogTrailer	t;
+    int				res;
+
+    res = flightLogFlush(w);
+    if (res == 0) {
+	memset(&t, 0, sizeof(t));
+	t.magic = FLIGHT_LOG_TRAILER_MAGIC;
+	t.chunks = w->chunkNumber;
+	t.indexOffset = w->offset;
+	if (flightLogWriteAll(w->fd, w->index, w->chunkNumber * sizeof(*w->index)) != 0
+	    || flightLogWriteAll(w->fd, &t, sizeof(t)) != 0
+	    ) {
+	    printf("%s:%d: Can't write index: %s\n", __FILE__, __LINE__, strerror(errno));
+	    res = -1;
+	}
+    }
+    if (close(w->fd) != 0) res = -1;
+    w->fd = -1;
+    free(w->buf);
+    free(w->compressed);
+    free(w->index);
+    w->buf = w->compressed = NULL;
+    w->index = NULL;
+    return(res);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Reader
+
+// Rebuild the index of a log which was not closed, stopping at the first incomplete chunk.
+static int flightLogScanChunks(struct flightLogReader *r, uint64_t fileSize) {
+    struct flightLogChunkHeader	h;
+    struct flightLogIndexEntry	*e;
+    uint64_t			offset;
+    int				allocated;
+
+    allocated = 0;
+    r->chunks = 0;
+    offset = sizeof(struct flightLogFileHeader);
+    while (offset + sizeof(h) <= fileSize) {
+	if (flightLogReadAll(r->fd, &h, sizeof(h), offset) != 0) break;
+	if (h.magic != FLIGHT_LOG_CHUNK_MAGIC || offset + sizeof(h) + h.compressedSize > fileSize) break;
+	if (r->chunks >= allocated) {
+	    allocated = allocated == 0 ? 64 : allocated * 2;
+	    e = (struct flightLogIndexEntry *) realloc(r->index, allocated * sizeof(*e));
+	    if (e == NULL) return(-1);
+	    r->index = e;
+	}
+	e = &r->index[r->chunks++];
+	memset(e, 0, sizeof(*e));
+	e->offset = offset;
+	e->firstTime = h.firstTime;
+	e->lastTime = h.lastTime;
+	e->records = h.records;
+	offset += sizeof(h) + h.compressedSize;
+    }
+    r->recovered = 1;
+    return(0);
+}
+
+int flightLogReaderOpen(struct flightLogReader *r, const char *path) {
+    struct flightLogTrailer	t;
+    struct stat			st;
+    uint64_t			fileSize;
+
+    memset(r, 0, sizeof(*r));
+    r->chunk = -1;
+    r->seekTime = INT64_MIN;
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+	printf("%s:%d: Can't open %s: %s\n", __FILE__, __LINE__, path, strerror(errno));
+	return(-1);
+    }
+    if (fstat(r->fd, &st) != 0
+	|| flightLogReadAll(r->fd, &r->header, sizeof(r->header), 0) != 0
+	|| r->header.magic != FLIGHT_LOG_MAGIC
+	|| r->header.version != FLIGHT_LOG_VERSION
+	) {
+	printf("%s:%d: %s is not a flight log.\n", __FILE__, __LINE__, path);
+	close(r->fd);
+	r->fd = -1;
+	return(-1);
+    }
+    fileSize = st.st_size;
+
+    if (fileSize >= sizeof(r->header) + sizeof(t)
+	&& flightLogReadAll(r->fd, &t, sizeof(t), fileSize - sizeof(t)) == 0
+	&& t.magic == FLIGHT_LOG_TRAILER_MAGIC
+	&& t.indexOffset + (uint64_t) t.chunks * sizeof(struct flightLogIndexEntry) + sizeof(t) == fileSize
+	) {
+	r->chunks = t.chunks;
+	r->index = (struct flightLogIndexEntry *) malloc((t.chunks + 1) * sizeof(struct flightLogIndexEntry));
+	if (r->index != NULL && flightLogReadAll(r->fd, r->index, t.chunks * sizeof(struct flightLogIndexEntry), t.indexOffset) == 0) return(0);
+	free(r->index);
+	r->index = NULL;
+    }
+
+    if (flightLogScanChunks(r, fileSize) != 0) {
+	flightLogReaderClose(r);
+	return(-1);
+    }
+    return(0);
+}
+
+static int flightLogLoadChunk(struct flightLogReader *r, int i) {
+    struct flightLogChunkHeader	h;
+    uLongf			len;
+
+    if (flightLogReadAll(r->fd, &h, sizeof(h), r->index[i].offset) != 0 || h.magic != FLIGHT_LOG_CHUNK_MAGIC) return(-1);
+    if (flightLogGrow(&r->compressed, &r->compressedSize, h.compressedSize) != 0) return(-1);
+    if (flightLogGrow(&r->buf, &r->size, h.size) != 0) return(-1);
+    if (flightLogReadAll(r->fd, r->compressed, h.compressedSize, r->index[i].offset + sizeof(h)) != 0) return(-1);
+    if (crc32(0, r->compressed, h.compressedSize) != h.crc) {
+	printf("%s:%d: Chunk %d: crc mismatch.\n", __FILE__, __LINE__, i);
+	return(-1);
+    }
+    len = h.size;
+    if (uncompress(r->buf, &len, r->compressed, h.compressedSize) != Z_OK || len != h.size) {
+	printf("%s:%d: Chunk %d: can't uncompress.\n", __FILE__, __LINE__, i);
+	return(-1);
+    }
+    r->chunk = i;
+    r->len = len;
+    r->pos = 0;
+    r->time = h.firstTime;
+    return(0);
+}
+
+int flightLogSeek(struct flightLogReader *r, int64_t time) {
+    int		lo, hi, mid;
+
+    // first chunk ending at or after time
+    lo = 0;
+    hi = r->chunks;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (r->index[mid].lastTime < time) lo = mid + 1;
+	else hi = mid;
+    }
+    r->chunk = lo - 1;
+    r->len = r->pos = 0;
+    r->seekTime = time;
+    return(0);
+}
+
+int flightLogRead(struct flightLogReader *r, struct flightLogRecord *rec) {
+    struct flightLogDecoder	d;
+    struct flightLogChannel	*c;
+    uint64_t			channel, type, len;
+    int				kind, i, n;
+
+    for(;;) {
+	if (r->pos >= r->len) {
+	    if (r->chunk + 1 >= r->chunks) return(0);
+	    if (flightLogLoadChunk(r, r->chunk + 1) != 0) {
+		// skip the chunk
+		r->chunk ++;
+		r->len = r->pos = 0;
+		return(-1);
+	    }
+	}
+	d.p = r->buf + r->pos;
+	d.end = r->buf + r->len;
+	d.err = 0;
+	kind = *d.p++;
+	channel = flightLogGetVarint(&d);
+	if (d.err || channel >= FLIGHT_LOG_MAX_CHANNELS) goto corrupted;
+	c = &r->channel[channel];
+
+	if (kind == FLIGHT_LOG_DEFINITION) {
+	    type = flightLogGetVarint(&d);
+	    len = flightLogGetVarint(&d);
+	    if (d.err || type >= SENSOR_BUS_TYPE_MAX || len >= SENSOR_BUS_NAME_MAX || d.p + len > d.end) goto corrupted;
+	    memcpy(c->name, d.p, len);
+	    c->name[len] = 0;
+	    d.p += len;
+	    c->type = type;
+	    c->definedInChunk = r->chunk;
+	    memset(c->previous, 0, sizeof(c->previous));
+	    r->pos = d.p - r->buf;
+	    continue;
+	}
+
+	if (c->definedInChunk != r->chunk) goto corrupted;
+	r->time += flightLogUnzigzag(flightLogGetVarint(&d));
+	rec->kind = kind;
+	rec->channel = channel;
+	rec->name = c->name;
+	rec->type = c->type;
+	rec->time = r->time;
+	if (kind == FLIGHT_LOG_SAMPLE && c->type != SENSOR_BUS_NONE) {
+	    uint64_t	bits;
+	    uint32_t	fbits;
+	    memset(&rec->sample, 0, sizeof(rec->sample));
+	    bits = flightLogGetXor(&d, &c->previous[0]);
+	    memcpy(&rec->sample.timestamp, &bits, sizeof(bits));
+	    fbits = flightLogGetXor(&d, &c->previous[1]);
+	    memcpy(&rec->sample.confidence, &fbits, sizeof(fbits));
+	    rec->sample.type = c->type;
+	    n = sensorBusTypeValueCount(c->type);
+	    for(i=0; i<n; i++) {
+		bits = flightLogGetXor(&d, &c->previous[i+2]);
+		memcpy(&rec->sample.value[i], &bits, sizeof(bits));
+	    }
+	    rec->text = NULL;
+	    rec->textLength = 0;
+	} else if (kind == FLIGHT_LOG_TEXT && c->type == SENSOR_BUS_NONE) {
+	    len = flightLogGetVarint(&d);
+	    if (d.err || len > FLIGHT_LOG_TEXT_MAX || d.p + len > d.end) goto corrupted;
+	    memcpy(r->text, d.p, len);
+	    r->text[len] = 0;
+	    d.p += len;
+	    rec->text = r->text;
+	    rec->textLength = len;
+	} else {
+	    goto corrupted;
+	}
+	if (d.err) goto corrupted;
+	r->pos = d.p - r->buf;
+	if (rec->time < r->seekTime) continue;
+	r->seekTime = INT64_MIN;
+	return(1);
+    }
+
+ corrupted:
+    printf("%s:%d: Chunk %d: corrupted record at %d.\n", __FILE__, __LINE__, r->chunk, r->pos);
+    // skip the rest of the chunk
+    r->pos = r->len;
+    return(-1);
+}
+
+void flightLogReaderClose(struct flightLogReader *r) {
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+    free(r->index);
+    free(r->buf);
+    free(r->compressed);
+    r->index = NULL;
+    r->buf = r->compressed = NULL;
+}
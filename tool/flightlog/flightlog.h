@@ -0,0 +1,176 @@
+/*
+  Flight log, a compact append-only binary log of everything published
+  during a flight, for deterministic replays.
+
+  The log holds records of channels. A channel is either a sensor bus
+  channel (its samples are recorded bit exact) or a text stream (lines,
+  e.g. motor commands sent by raspilot to a motor tool). Each record has
+  the CLOCK_MONOTONIC time in nanoseconds when it was captured, replays
+  are paced by these times.
+
+  File layout:
+
+  struct flightLogFileHeader
+  chunk*		struct flightLogChunkHeader + zlib compressed records
+  index			struct flightLogIndexEntry per chunk (written on close)
+  struct flightLogTrailer
+
+  Chunks are self contained (channel definitions are repeated in each
+  chunk which uses them), so a reader can start at any chunk. The index
+  allows seeking by time without reading the log. If the recorder did not
+  close the log (crash, power loss), the reader rebuilds the index by
+  walking chunk headers and ignores a truncated last chunk.
+
+  Inside a chunk records are encoded with varints: record kind, channel,
+  time delta from the previous record and, for samples, values XORed with
+  the previous value of the channel (repeated and slowly changing values
+  give mostly zero bits, which compress well).
+ */
+
+#ifndef FLIGHTLOG_H
+#define FLIGHTLOG_H
+
+#include <stdint.h>
+
+#include "sensorbus.h"
+
+#define FLIGHT_LOG_MAGIC		0x4c465052	// "RPFL"
+#define FLIGHT_LOG_VERSION		1
+#define FLIGHT_LOG_CHUNK_MAGIC		0x4b4e4843	// "CHNK"
+#define FLIGHT_LOG_TRAILER_MAGIC	0x58444e49	// "INDX"
+
+// uncompressed size of records after which a chunk is written
+#define FLIGHT_LOG_CHUNK_SIZE		(64*1024)
+#define FLIGHT_LOG_MAX_CHANNELS		64
+#define FLIGHT_LOG_TEXT_MAX		4096
+
+enum flightLogRecordKinds {
+    FLIGHT_LOG_DEFINITION = 0,		// only inside chunks, never returned by the reader
+    FLIGHT_LOG_SAMPLE,
+    FLIGHT_LOG_TEXT,
+};
+
+struct flightLogFileHeader {
+    uint32_t	magic;
+    uint32_t	version;
+    // CLOCK_REALTIME and CLOCK_MONOTONIC (ns) when the log was created
+    double	realtimeStart;
+    int64_t	monotonicStart;
+    uint32_t	reserved[4];
+};
+
+struct flightLogChunkHeader {
+    uint32_t	magic;
+    // crc32 of the compressed data
+    uint32_t	crc;
+    uint32_t	compressedSize;
+    uint32_t	size;
+    uint32_t	records;
+    uint32_t	reserved;
+    int64_t	firstTime;
+    int64_t	lastTime;
+};
+
+struct flightLogIndexEntry {
+    uint64_t	offset;
+    int64_t	firstTime;
+    int64_t	lastTime;
+    uint32_t	records;
+    uint32_t	reserved;
+};
+
+struct flightLogTrailer {
+    uint32_t	magic;
+    uint32_t	chunks;
+    uint64_t	indexOffset;
+};
+
+struct flightLogChannel {
+    char	name[SENSOR_BUS_NAME_MAX];
+    // sensor bus type of samples, SENSOR_BUS_NONE for text streams
+    int		type;
+    // chunk in which the definition was last written (writer) or read (reader)
+    int		definedInChunk;
+    // previous values for XOR coding, reset at each chunk
+    uint64_t	previous[SENSOR_BUS_MAX_VALUES + 2];
+};
+
+struct flightLogRecord {
+    int				kind;
+    int				channel;
+    // channel name and type, valid until the reader is closed
+    const char			*name;
+    int				type;
+    int64_t			time;
+    // FLIGHT_LOG_SAMPLE
+    struct sensorBusSample	sample;
+    // FLIGHT_LOG_TEXT, zero terminated, valid until the next read
+    char			*text;
+    int				textLength;
+};
+
+struct flightLogWriter {
+    int				fd;
+    uint64_t			offset;
+    struct flightLogChannel	channel[FLIGHT_LOG_MAX_CHANNELS];
+    int				channelCount;
+    // records of the chunk being built
+    uint8_t			*buf;
+    int				len;
+    int				size;
+    uint32_t			records;
+    int64_t			firstTime;
+    int64_t			lastTime;
+    int				chunkNumber;
+    uint8_t			*compressed;
+    int				compressedSize;
+    struct flightLogIndexEntry	*index;
+    int				indexSize;
+    // statistics
+    long long			totalRecords;
+    long long			totalBytes;
+    long long			totalCompressedBytes;
+};
+
+struct flightLogReader {
+    int				fd;
+    struct flightLogFileHeader	header;
+    struct flightLogChannel	channel[FLIGHT_LOG_MAX_CHANNELS];
+    struct flightLogIndexEntry	*index;
+    int				chunks;
+    // 1 if the index was rebuilt because the log was not closed
+    int				recovered;
+    // the current chunk
+    int				chunk;
+    uint8_t			*buf;
+    int				len;
+    int				size;
+    int				pos;
+    int64_t			time;
+    // records before this time are skipped after a seek
+    int64_t			seekTime;
+    uint8_t			*compressed;
+    int				compressedSize;
+    char			text[FLIGHT_LOG_TEXT_MAX+1];
+};
+
+int64_t flightLogMonotonicTime();
+
+int flightLogWriterOpen(struct flightLogWriter *w, const char *path);
+// Returns channel number or -1. Type is SENSOR_BUS_NONE for text streams.
+int flightLogWriterAddChannel(struct flightLogWriter *w, const char *name, int type);
+// Times of records must not decrease.
+int flightLogWriteSample(struct flightLogWriter *w, int channel, int64_t time, struct sensorBusSample *sample);
+int flightLogWriteText(struct flightLogWriter *w, int channel, int64_t time, const char *text, int len);
+// Write the current chunk even if it is not full.
+int flightLogFlush(struct flightLogWriter *w);
+int flightLogWriterClose(struct flightLogWriter *w);
+
+int flightLogReaderOpen(struct flightLogReader *r, const char *path);
+// Position the reader so that the next record read is the first one at or after time.
+int flightLogSeek(struct flightLogReader *r, int64_t time);
+// Returns 1 and the next record, 0 at the end of the log or -1 on a corrupted chunk.
+int flightLogRead(struct flightLogReader *r, struct flightLogRecord *rec);
+void flightLogReaderClose(struct flightLogReader *r);
+
+#endif
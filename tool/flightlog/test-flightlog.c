@@ -0,0 +1,303 @@
+/*
+  Test and benchmark of the flight log. A synthetic flight (IMU, compass,
+  baro, flow, sonar, pose and motor commands at their usual rates) is
+  written, read back and compared bit for bit. Then seeking, reading a log
+  which was not closed, a truncated log and a corrupted chunk are checked,
+  and the size and speed of the log are printed.
+
+  usage: test-flightlog [<seconds_of_flight> [<log>]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "flightlog.h"
+
+struct testStream {
+    const char	*name;
+    int		type;
+    double	rate;
+    int		channel;
+    double	next;
+};
+
+static struct testStream streams[] = {
+    {"raspilot.bno055.rpy", SENSOR_BUS_RPY, 100},
+    {"raspilot.bno055.lacc", SENSOR_BUS_LINEAR_ACCELERATION, 100},
+    {"raspilot.bno055.temp", SENSOR_BUS_TEMPERATURE, 1},
+    {"raspilot.hmc5883l.mag", SENSOR_BUS_MAGNETIC_FIELD, 75},
+    {"raspilot.bmp180.alt", SENSOR_BUS_ALTITUDE, 50},
+    {"raspilot.pmw3901.motion", SENSOR_BUS_MOTION, 100},
+    {"raspilot.hcsr04.dist", SENSOR_BUS_DISTANCE, 20},
+    {"raspilot.realsense-t265.pose", SENSOR_BUS_POSITION, 200},
+    {"raspilot.realsense-t265.quat", SENSOR_BUS_QUATERNION, 200},
+    {"motors", SENSOR_BUS_NONE, 400},
+};
+#define STREAMS (int)(sizeof(streams)/sizeof(streams[0]))
+
+struct testRecord {
+    int				stream;
+    int64_t			time;
+    struct sensorBusSample	sample;
+    char			text[64];
+    int				textLength;
+};
+
+static struct testRecord	*records;
+static int			recordCount;
+static int			failures;
+
+static double now() {
+    struct timespec	ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void check(int cond, const char *what) {
+    if (! cond) {
+	printf("%s:%d: FAILED: %s\n", __FILE__, __LINE__, what);
+	failures ++;
+    }
+}
+
+// Values like the tools produce them: doubles converted from sensor floats or computed in double.
+static void generateFlight(double seconds) {
+    struct testRecord	*r;
+    double		t, t0, rt0, a;
+    int			i, j, n, best, allocated;
+
+    allocated = 0;
+    t0 = 1000.0;
+    rt0 = 1700000000.0;
+    for(i=0; i<STREAMS; i++) streams[i].next = t0 + (double) i / 1000;
+    for(;;) {
+	best = 0;
+	for(i=1; i<STREAMS; i++) if (streams[i].next < streams[best].next) best = i;
+	t = streams[best].next;
+	if (t - t0 > seconds) break;
+	// jitter of the period
+	streams[best].next += (1.0 + 0.05 * sin(t * 7.3 + best)) / streams[best].rate;
+
+	if (recordCount >= allocated) {
+	    allocated = allocated == 0 ? 65536 : allocated * 2;
+	    records = (struct testRecord *) realloc(records, allocated * sizeof(*records));
+	}
+	r = &records[recordCount++];
+	memset(r, 0, sizeof(*r));
+	r->stream = best;
+	r->time = (int64_t) (t * 1e9) + (recordCount * 7919) % 50000;
+	if (recordCount > 1 && r->time <= r[-1].time) r->time = r[-1].time + 1;
+	a = t - t0;
+	if (streams[best].type == SENSOR_BUS_NONE) {
+	    r->textLength = sprintf(r->text, "mp %d %d %d %d", 1500 + (int) (40 * sin(a)), 1500 + (int) (40 * cos(a)), 1498 + (int) (35 * sin(a * 1.1)), 1502 + (int) (35 * cos(a * 0.9)));
+	    continue;
+	}
+	r->sample.timestamp = rt0 + a - 0.0004;
+	r->sample.confidence = 1.0;
+	r->sample.type = streams[best].type;
+	n = sensorBusTypeValueCount(streams[best].type);
+	for(j=0; j<n; j++) {
+	    switch (streams[best].type) {
+	    case SENSOR_BUS_POSITION:
+	    case SENSOR_BUS_QUATERNION:
+		r->sample.value[j] = (float) (sin(a * 0.3 + j) * (j + 1) + 0.001 * sin(a * 50 + j));
+		break;
+	    case SENSOR_BUS_ALTITUDE:
+		r->sample.value[j] = 10 + 0.5 * sin(a * 0.2) + 0.05 * sin(a * 131);
+		break;
+	    case SENSOR_BUS_TEMPERATURE:
+		r->sample.value[j] = 24.5;
+		break;
+	    case SENSOR_BUS_DISTANCE:
+		r->sample.value[j] = a < seconds / 2 ? 0.5 + 0.01 * floor(a * 10) : -1;
+		break;
+	    case SENSOR_BUS_MOTION:
+		r->sample.confidence = (float) (0.5 + 0.5 * sin(a));
+		r->sample.value[j] = (float) (0.01 * sin(a * 3 + j));
+		break;
+	    default:
+		// raw sensor values in 1/16 units, as BNO055 and HMC5883L give
+		r->sample.value[j] = (float) (floor(100 * sin(a * 0.5 + j) + 3 * sin(a * 97 + j)) / 16.0);
+		break;
+	    }
+	}
+    }
+}
+
+static int writeFlight(const char *path, int close, struct flightLogWriter *w) {
+    int		i;
+
+    if (flightLogWriterOpen(w, path) != 0) return(-1);
+    for(i=0; i<STREAMS; i++) streams[i].channel = flightLogWriterAddChannel(w, streams[i].name, streams[i].type);
+    for(i=0; i<recordCount; i++) {
+	if (records[i].textLength != 0) {
+	    if (flightLogWriteText(w, streams[records[i].stream].channel, records[i].time, records[i].text, records[i].textLength) != 0) return(-1);
+	} else {
+	    if (flightLogWriteSample(w, streams[records[i].stream].channel, records[i].time, &records[i].sample) != 0) return(-1);
+	}
+    }
+    if (close) return(flightLogWriterClose(w));
+    // simulate a crash, the current chunk is lost
+    free(w->buf);
+    free(w->compressed);
+    free(w->index);
+    return(0);
+}
+
+static int sameRecord(struct flightLogRecord *rec, struct testRecord *r) {
+    int		n;
+
+    if (rec->time != r->time || strcmp(rec->name, streams[r->stream].name) != 0 || rec->type != streams[r->stream].type) return(0);
+    if (r->textLength != 0) {
+	return(rec->kind == FLIGHT_LOG_TEXT && rec->textLength == r->textLength && memcmp(rec->text, r->text, r->textLength) == 0);
+    }
+    n = sensorBusTypeValueCount(rec->type);
+    return(rec->kind == FLIGHT_LOG_SAMPLE
+	   && memcmp(&rec->sample.timestamp, &r->sample.timestamp, sizeof(double)) == 0
+	   && memcmp(&rec->sample.confidence, &r->sample.confidence, sizeof(float)) == 0
+	   && rec->sample.type == r->sample.type
+	   && memcmp(rec->sample.value, r->sample.value, n * sizeof(double)) == 0);
+}
+
+// Read the whole log, returns the number of records matching records[] in order, -1 on mismatch.
+static int readFlight(const char *path, int *errors, int *recovered) {
+    struct flightLogReader	r;
+    struct flightLogRecord	rec;
+    int				res, i, n;
+
+    if (flightLogReaderOpen(&r, path) != 0) return(-1);
+    *errors = 0;
+    *recovered = r.recovered;
+    i = n = 0;
+    while ((res = flightLogRead(&r, &rec)) != 0) {
+	if (res < 0) {
+	    (*errors) ++;
+	    continue;
+	}
+	// after a corrupted chunk, resynchronize on the next record
+	while (*errors != 0 && i < recordCount && records[i].time < rec.time) i++;
+	if (i >= recordCount || ! sameRecord(&rec, &records[i])) {
+	    flightLogReaderClose(&r);
+	    return(-1);
+	}
+	i ++;
+	n ++;
+    }
+    flightLogReaderClose(&r);
+    return(n);
+}
+
+static void copyFile(const char *from, const char *to, long long size) {
+    FILE	*f, *t;
+    char	buf[65536];
+    long long	n;
+
+    f = fopen(from, "r");
+    t = fopen(to, "w");
+    while (size > 0 && (n = fread(buf, 1, size < (long long) sizeof(buf) ? size : sizeof(buf), f)) > 0) {
+	fwrite(buf, 1, n, t);
+	size -= n;
+    }
+    fclose(f);
+    fclose(t);
+}
+
+int main(int argc, char **argv) {
+    struct flightLogWriter	w;
+    struct flightLogReader	r;
+    struct flightLogRecord	rec;
+    struct flightLogIndexEntry	*index;
+    const char			*path;
+    char			tmp[1024];
+    double			seconds, t, writeTime, readTime;
+    long long			textBytes, fileSize, completeRecords;
+    int				i, j, n, errors, recovered, chunks, res;
+    FILE			*f;
+
+    seconds = argc > 1 ? atof(argv[1]) : 60;
+    path = argc > 2 ? argv[2] : "test-flightlog.log";
+    generateFlight(seconds);
+    textBytes = 0;
+    for(i=0; i<recordCount; i++) {
+	char buf[256];
+	if (records[i].textLength != 0) textBytes += records[i].textLength + 1;
+	else textBytes += sensorBusFormatText(&records[i].sample, buf, sizeof(buf));
+    }
+    printf("flight of %.0f s: %d records in %d streams\n", seconds, recordCount, STREAMS);
+
+    // write and read back
+    t = now();
+    check(writeFlight(path, 1, &w) == 0, "write log");
+    writeTime = now() - t;
+    f = fopen(path, "r");
+    fseek(f, 0, SEEK_END);
+    fileSize = ftell(f);
+    fclose(f);
+    t = now();
+    n = readFlight(path, &errors, &recovered);
+    readTime = now() - t;
+    check(n == recordCount && errors == 0 && ! recovered, "read back all records bit exact");
+    printf("log: %lld bytes, %.2f bytes per record, %d chunks; raw records %.1fx, text lines %.1fx larger\n",
+	   fileSize, (double) fileSize / recordCount, w.chunkNumber,
+	   (double) recordCount * (sizeof(struct sensorBusSample) + sizeof(int64_t)) / fileSize, (double) textBytes / fileSize);
+    printf("write: %.0f ns per record; read: %.0f ns per record, %.0fx real time\n",
+	   writeTime * 1e9 / recordCount, readTime * 1e9 / recordCount, seconds / readTime);
+
+    // seeking
+    check(flightLogReaderOpen(&r, path) == 0, "open log");
+    chunks = r.chunks;
+    for(i=0; i<200; i++) {
+	j = (long long) rand() * recordCount / RAND_MAX;
+	if (j >= recordCount) j = recordCount - 1;
+	// first record at or after its time
+	while (j > 0 && records[j-1].time == records[j].time) j --;
+	flightLogSeek(&r, records[j].time);
+	res = flightLogRead(&r, &rec);
+	if (res != 1 || ! sameRecord(&rec, &records[j])) {
+	    check(0, "seek to a record");
+	    break;
+	}
+    }
+    flightLogSeek(&r, records[recordCount-1].time + 1);
+    check(flightLogRead(&r, &rec) == 0, "seek after the end");
+    flightLogSeek(&r, 0);
+    check(flightLogRead(&r, &rec) == 1 && sameRecord(&rec, &records[0]), "seek before the beginning");
+    index = (struct flightLogIndexEntry *) malloc(chunks * sizeof(*index));
+    memcpy(index, r.index, chunks * sizeof(*index));
+    flightLogReaderClose(&r);
+
+    // not closed: no index, the chunk being built is lost
+    snprintf(tmp, sizeof(tmp), "%s.crash", path);
+    check(writeFlight(tmp, 0, &w) == 0, "write log without closing it");
+    completeRecords = 0;
+    for(i=0; i<w.chunkNumber; i++) completeRecords += index[i].records;
+    close(w.fd);
+    n = readFlight(tmp, &errors, &recovered);
+    check(n == completeRecords && errors == 0 && recovered, "read a log which was not closed");
+    printf("not closed log: %d of %d records recovered\n", n, recordCount);
+
+    // truncated in the middle of the last chunk
+    copyFile(path, tmp, index[chunks-1].offset + 100);
+    n = readFlight(tmp, &errors, &recovered);
+    check(n == recordCount - (long long) index[chunks-1].records && errors == 0 && recovered, "read a truncated log");
+
+    // corrupted chunk, the others are still readable
+    if (chunks > 2) {
+	copyFile(path, tmp, fileSize);
+	f = fopen(tmp, "r+");
+	fseek(f, index[1].offset + sizeof(struct flightLogChunkHeader) + 10, SEEK_SET);
+	fputc(fgetc(f) ^ 0x55, f);
+	fclose(f);
+	n = readFlight(tmp, &errors, &recovered);
+	check(n == recordCount - (long long) index[1].records && errors == 1, "skip a corrupted chunk");
+    }
+    unlink(tmp);
+    free(index);
+
+    if (failures == 0) printf("all tests passed\n");
+    return(failures != 0);
+}
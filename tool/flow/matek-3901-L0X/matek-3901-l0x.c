@@ -4,6 +4,11 @@
   Mateksys optical flow & lidar sensor 3901-L0X and printing
   range and motion on standard output.
 
+  Samples are published through the sensor bus (tool/sensorbus). With
+  option -shm <name>, they are published in binary form into shared
+  memory channels <name>.range and <name>.motion instead of text lines.
+  Option -record <file> saves raw serial input for later replay.
+
  */
 
 #include <stdlib.h>
@@ -13,8 +18,13 @@
 #include <termios.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 #include "msp_protocol.h"
+#include "msp.h"
+#include "sensorbus.h"
 
 int baudrateToSpeed_t(int baudrate) {
     switch (baudrate) {
@@ -109,46 +119,15 @@ void initSerialPort(int fd, int baudrate) {
 
 }
 
-uint8_t crc8_dvb_s2(uint8_t crc, unsigned char a) {
-    int ii;
-    crc ^= a;
-    for (ii = 0; ii < 8; ++ii) {
-        if (crc & 0x80) {
-            crc = (crc << 1) ^ 0xD5;
-        } else {
-            crc = crc << 1;
-        }
-    }
-    return crc;
-}
-
-uint8_t getccrc(FILE *ff, uint8_t *checksum) {
-    int c;
-    
-    c = getc(ff);
-    if (c == EOF) {
-	printf("%s:%d: Error: Unexpected end of input stream.\n", __FILE__, __LINE__);
-	exit(-1);
-    }
-    *checksum = crc8_dvb_s2(*checksum, (unsigned char)c);
-    return(c);
-}
-
-
-int mspSkipUntilMsgStart(FILE *ff) {
-    int c;
-    
-    while ((c=getc(ff)) != '$' && c != EOF) ;
-    if (c == EOF) {
-	printf("%s:%d: Error: Unexpected end of input stream.\n", __FILE__, __LINE__);
-	exit(-1);
-    }
-    ungetc(c, ff);
-}
-
 // last read altitude
 double lastRange = 0;
 
+struct sensorBusChannel *busrange;
+struct sensorBusChannel *busmotion;
+
+// CLOCK_REALTIME - CLOCK_MONOTONIC, frames are timestamped with the monotonic clock
+double clockOffset = 0;
+
 // We report motion in degrees of the angle by which viewport shifted (rotated).
 // matek has 35x35 pixels in 42 degree range, No idea from where the constant 10 comes
 // I guessed it by experimentations. Maybe matek is reporting in pixel*10?
@@ -159,111 +138,139 @@ static inline double motionToAlpha(double p) {
     return(p * FACTOR);
 }
 
-int mspScanMessage(FILE *ff) {
-    int 	i, c;
-    int 	function, payloadSize;
-    int 	quality;
-    int32_t 	rangeMm, motionX, motionY;
-    int 	ck;
-    uint8_t 	checksum;
-
-    // Scan message prefix
-    c = getc(ff);
-    if (c != '$') {
-	printf("%s:%d: Error: Message does not start with '$'.\n", __FILE__, __LINE__);
-	return(-1);
-    }
-    c = getc(ff);
-    if (c != 'X') {
-	printf("%s:%d: Error: Expected 'X'.\n", __FILE__, __LINE__);
-	ungetc(c, ff);
-	return(-1);
-    }
-    c = getc(ff);
-    if (c != '<') {
-	printf("%s:%d: Expected '<'.\n", __FILE__, __LINE__);
-	ungetc(c, ff);
-	return(-1);
-    }
+static inline int32_t getInt32(uint8_t *p) {
+    return((int32_t)(p[0] + (p[1] << 8) + (p[2] << 16) + ((uint32_t)p[3] << 24)));
+}
 
-    // Scan rest of data and compute checksum
-    checksum = 0;
-    c = getccrc(ff, &checksum);
-    function = (int16_t)(getccrc(ff, &checksum) + (getccrc(ff, &checksum) << 8)) ;
-    payloadSize = (int16_t)(getccrc(ff, &checksum) + (getccrc(ff, &checksum) << 8));
-    switch (function) {
+static double realTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_REALTIME, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static int64_t currentTimeNs() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec * 1000000000LL + tt.tv_nsec);
+}
+
+int mspProcessFrame(struct mspFrame *frame) {
+    int 		quality;
+    int32_t 		rangeMm, motionX, motionY;
+    double		t, v[2];
+
+    t = frame->timestampNs / 1000000000.0 + clockOffset;
+    switch (frame->function) {
     case MSP2_SENSOR_RANGEFINDER:
-	if (payloadSize != 5) {
-	    printf("%s:%d: MSP2_SENSOR_RANGEFINDER unexpected payloadSize %d.\n", __FILE__, __LINE__, payloadSize);
-	    return(-1);
-	}
-	quality = getccrc(ff, &checksum);
-	rangeMm = (int32_t)(getccrc(ff, &checksum) + (getccrc(ff, &checksum) << 8)  + (getccrc(ff, &checksum) << 16) + (getccrc(ff, &checksum) << 24));
-	ck = getc(ff);
-	if (ck != checksum) {
-	    printf("%s:%d: Error: wrong checksum.\n", __FILE__, __LINE__);
+	if (frame->payloadSize != 5) {
+	    printf("%s:%d: MSP2_SENSOR_RANGEFINDER unexpected payloadSize %d.\n", __FILE__, __LINE__, frame->payloadSize);
 	    return(-1);
 	}
+	quality = frame->payload[0];
+	rangeMm = getInt32(frame->payload+1);
 	// When in motion, very often it reports range -1 with quality == 255;
 	// Avoid such cases and do not report anything when out of range
 	if (rangeMm >= 20 && rangeMm <= 2000) {
-	    printf("range %5.3f %4.2f\n", rangeMm/1000.0, quality/255.0);
-	    // printf("Got MSP2_SENSOR_RANGEFINDER: quality: %3d; distanceMm: %5d\n", quality, distanceMm);
 	    lastRange = rangeMm/1000.0;
+	    sensorBusPublish(busrange, t, quality/255.0, &lastRange);
 	}
 	break;
     case MSP2_SENSOR_OPTIC_FLOW:
-	if (payloadSize != 9) {
-	    printf("%s:%d: MSP2_SENSOR_OPTIC_FLOW unexpected payloadSize %d.\n", __FILE__, __LINE__, payloadSize);
-	    return(-1);
-	}
-	quality = getccrc(ff, &checksum);
-	motionX = (int32_t)(getccrc(ff, &checksum) + (getccrc(ff, &checksum) << 8)  + (getccrc(ff, &checksum) << 16) + (getccrc(ff, &checksum) << 24));
-	motionY = (int32_t)(getccrc(ff, &checksum) + (getccrc(ff, &checksum) << 8)  + (getccrc(ff, &checksum) << 16) + (getccrc(ff, &checksum) << 24));
-	ck = getc(ff);
-	if (ck != checksum) {
-	    printf("%s:%d: Error: wrong checksum.\n", __FILE__, __LINE__);
+	if (frame->payloadSize != 9) {
+	    printf("%s:%d: MSP2_SENSOR_OPTIC_FLOW unexpected payloadSize %d.\n", __FILE__, __LINE__, frame->payloadSize);
 	    return(-1);
 	}
-	// printf("Got MSP2_SENSOR_OPTIC_FLOW: quality: %3d; motionX: %5d, motionY: %5d\n", quality, motionX, motionY);
-	// printf("pixelmotion %5.3f %5.3f %4.2f\n", -motionY/1000.0, -motionX/1000.0, quality/255.0);
-	
-	// Actually print the motion in drone frame (not the sensor frame) and translated to angles (not sensor pixels).
-	printf("motion %5.3f %5.3f %4.2f\n", motionToAlpha(-motionY), motionToAlpha(-motionX), quality/255.0);
+	quality = frame->payload[0];
+	motionX = getInt32(frame->payload+1);
+	motionY = getInt32(frame->payload+5);
+	// Actually report the motion in drone frame (not the sensor frame) and translated to angles (not sensor pixels).
+	v[0] = motionToAlpha(-motionY);
+	v[1] = motionToAlpha(-motionX);
+	sensorBusPublish(busmotion, t, quality/255.0, v);
 	break;
     default:	
-	printf("%s:%d: Unexpected message type %04x of size %d.\n", __FILE__, __LINE__, function, payloadSize);
+	printf("%s:%d: Unexpected message type %04x of size %d.\n", __FILE__, __LINE__, frame->function, frame->payloadSize);
 	return(-1);
     }
     return(0);
-
 }
 
 int main(int argc, char **argv) {
-    char	*fname;
-    FILE 	*ff;
-    int 	r;
+    char		*fname, *shmName, *recordName;
+    char		name[SENSOR_BUS_NAME_MAX];
+    int			i, fd, n;
+    FILE		*recordFile;
+    struct pollfd	pfd;
+    struct mspParser	parser;
+    struct mspFrame	frame;
+    int64_t		t;
 
-    if (argc < 2) {
-	fname = "/dev/serial0";
-    } else {
-	fname = argv[1];
+    fname = (char *) "/dev/serial0";
+    shmName = recordName = NULL;
+    for(i=1; i<argc; i++) {
+	if (strcmp(argv[i], "-shm") == 0 && i+1 < argc) {
+	    shmName = argv[++i];
+	} else if (strcmp(argv[i], "-record") == 0 && i+1 < argc) {
+	    recordName = argv[++i];
+	} else if (argv[i][0] == '-') {
+	    printf("usage: %s [-shm <shm_name>] [-record <capture_file>] [<serial_port>]\n", argv[0]);
+	    exit(-1);
+	} else {
+	    fname = argv[i];
+	}
     }
     
-    ff = fopen(fname, "rw");
-    if (ff == NULL) {
+    fd = open(fname, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
 	printf("%s:%d: Can't open serial port %s.\n", __FILE__, __LINE__, fname);
 	exit(-1);
     }
 
-    initSerialPort(fileno(ff), 115200);
+    if (shmName != NULL) {
+	sensorBusMode = SENSOR_BUS_SHM;
+    } else {
+	shmName = (char *) "raspilot.flow-matek-3901-l0x";
+    }
+    // text output is flushed once per read
+    sensorBusTextAutoFlush = 0;
+    snprintf(name, sizeof(name), "%s.range", shmName);
+    busrange = sensorBusOpen(name, SENSOR_BUS_RANGE);
+    snprintf(name, sizeof(name), "%s.motion", shmName);
+    busmotion = sensorBusOpen(name, SENSOR_BUS_MOTION);
+    if (busrange == NULL || busmotion == NULL) exit(-1);
+
+    recordFile = NULL;
+    if (recordName != NULL) {
+	recordFile = fopen(recordName, "w");
+	if (recordFile == NULL) {
+	    printf("%s:%d: Can't open capture file %s.\n", __FILE__, __LINE__, recordName);
+	    exit(-1);
+	}
+    }
 
+    initSerialPort(fd, 115200);
+    mspParserInit(&parser, 115200);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
     for(;;) {
-	r = mspScanMessage(ff);
-	if (r != 0) mspSkipUntilMsgStart(ff);
-	fflush(stdout);
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+	t = currentTimeNs();
+	clockOffset = realTime() - t / 1000000000.0;
+	n = mspParserRead(&parser, fd, t);
+	if (n < 0) {
+	    printf("%s:%d: Error: Unexpected end of input stream.\n", __FILE__, __LINE__);
+	    exit(-1);
+	}
+	if (recordFile != NULL && n > 0) {
+	    // the newest n bytes, possibly wrapped around the end of the ring
+	    for(i=n; i>0; i--) putc(parser.ring[(parser.head - i) % MSP_RING_SIZE], recordFile);
+	}
+	while (mspParserNextFrame(&parser, &frame)) mspProcessFrame(&frame);
+	sensorBusFlush();
     }
     
-    
-    fclose(ff);
+    if (recordFile != NULL) fclose(recordFile);
+    close(fd);
+    return(0);
 }
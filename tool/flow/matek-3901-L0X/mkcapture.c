@@ -0,0 +1,67 @@
+/*
+  Generate a synthetic serial capture of the 3901-L0X sensor, i.e. a
+  stream of alternating MSP2_SENSOR_RANGEFINDER and MSP2_SENSOR_OPTIC_FLOW
+  frames with occasional line noise and corrupted checksums, for
+  replay testing when no recorded capture is at hand.
+
+  usage: ./mkcapture <number_of_frames> > capture.bin
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "msp_protocol.h"
+#include "msp.h"
+
+static void putFrame(int function, uint8_t *payload, int size, int corrupt) {
+    uint8_t	hdr[5], checksum;
+    int		i;
+
+    hdr[0] = 0;
+    hdr[1] = function & 0xff;
+    hdr[2] = function >> 8;
+    hdr[3] = size & 0xff;
+    hdr[4] = size >> 8;
+    checksum = 0;
+    fputs("$X<", stdout);
+    for(i=0; i<5; i++) {
+	checksum = crc8_dvb_s2(checksum, hdr[i]);
+	putchar(hdr[i]);
+    }
+    for(i=0; i<size; i++) {
+	checksum = crc8_dvb_s2(checksum, payload[i]);
+	putchar(payload[i]);
+    }
+    putchar(corrupt ? checksum ^ 0x5a : checksum);
+}
+
+static void putInt32(uint8_t *p, int32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+int main(int argc, char **argv) {
+    int		i, j, n, valid;
+    uint8_t	payload[9];
+
+    n = argc > 1 ? atoi(argv[1]) : 1000;
+    srand(1);
+    valid = 0;
+    for(i=0; i<n; i++) {
+	if (i % 53 == 0) {
+	    // line noise, possibly including a false start of a frame
+	    for(j=rand()%8; j>=0; j--) putchar(j == 3 ? '$' : rand() % 256);
+	}
+	payload[0] = rand() % 256;
+	if (i % 2 == 0) {
+	    putInt32(payload+1, 20 + rand() % 2000);
+	    putFrame(MSP2_SENSOR_RANGEFINDER, payload, 5, i % 101 == 0);
+	} else {
+	    putInt32(payload+1, rand() % 200 - 100);
+	    putInt32(payload+5, rand() % 200 - 100);
+	    putFrame(MSP2_SENSOR_OPTIC_FLOW, payload, 9, i % 101 == 0);
+	}
+	if (i % 101 != 0) valid ++;
+    }
+    fprintf(stderr, "%d frames, %d with valid checksum\n", n, valid);
+    return(0);
+}
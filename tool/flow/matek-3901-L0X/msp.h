@@ -0,0 +1,56 @@
+/*
+  Non-blocking MSP V2 frame parser. Bytes read from the serial port are
+  stored in a ring buffer and a state machine extracts all complete
+  frames from it.
+ */
+
+#ifndef MSP_H
+#define MSP_H
+
+#include <stdint.h>
+
+#define MSP_MAX_PAYLOAD		64
+// must be a power of 2
+#define MSP_RING_SIZE		4096
+
+struct mspFrame {
+    int		function;
+    int		payloadSize;
+    uint8_t	payload[MSP_MAX_PAYLOAD];
+    // CLOCK_MONOTONIC time when the last byte of the frame arrived
+    int64_t	timestampNs;
+};
+
+struct mspParser {
+    // ring buffer, bytes between tail and head are not parsed yet
+    uint8_t	ring[MSP_RING_SIZE];
+    unsigned	head;
+    unsigned	tail;
+    // time of the last read and the duration of one byte on the line
+    int64_t	lastReadNs;
+    int64_t	byteTimeNs;
+
+    // state machine
+    int		state;
+    uint8_t	checksum;
+    struct mspFrame frame;
+    int		payloadIndex;
+
+    // statistics
+    long	frames;
+    long	checksumErrors;
+    long	skippedBytes;
+};
+
+extern const uint8_t mspCrc8DvbS2Table[256];
+
+static inline uint8_t crc8_dvb_s2(uint8_t crc, unsigned char a) {
+    return(mspCrc8DvbS2Table[crc ^ a]);
+}
+
+void mspParserInit(struct mspParser *p, int baudrate);
+int mspParserPush(struct mspParser *p, uint8_t *buf, int n, int64_t timeNs);
+int mspParserRead(struct mspParser *p, int fd, int64_t timeNs);
+int mspParserNextFrame(struct mspParser *p, struct mspFrame *frame);
+
+#endif
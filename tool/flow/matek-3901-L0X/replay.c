@@ -0,0 +1,113 @@
+/*
+  Replay a serial capture of the 3901-L0X sensor (see option -record of
+  matek-3901-l0x, or mkcapture) through the MSP parser and report how
+  many frames per second it parses. The capture is fed in chunks as
+  they would come from read() at 115200 baud, and the reconstructed
+  timestamps are checked against the arrival time of the last byte of
+  each frame.
+
+  usage: ./replay <capture_file> [<chunk_size> [<repeat>]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "msp_protocol.h"
+#include "msp.h"
+
+#define BAUDRATE 115200
+
+static int64_t nanoseconds() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec * 1000000000LL + tt.tv_nsec);
+}
+
+// the original bit serial implementation
+static uint8_t crc8_dvb_s2_bitwise(uint8_t crc, unsigned char a) {
+    int ii;
+    crc ^= a;
+    for (ii = 0; ii < 8; ++ii) {
+        if (crc & 0x80) {
+            crc = (crc << 1) ^ 0xD5;
+        } else {
+            crc = crc << 1;
+        }
+    }
+    return crc;
+}
+
+int main(int argc, char **argv) {
+    FILE		*ff;
+    uint8_t		*data;
+    long		size, offset, consumed, frames, ranges, motions, wrongTimestamps;
+    int			i, k, chunk, repeat, c;
+    struct mspParser	parser;
+    struct mspFrame	frame;
+    int64_t		t0, t;
+
+    if (argc < 2) {
+	printf("usage: %s <capture_file> [<chunk_size> [<repeat>]]\n", argv[0]);
+	exit(-1);
+    }
+    chunk = argc > 2 ? atoi(argv[2]) : 32;
+    repeat = argc > 3 ? atoi(argv[3]) : 1;
+    if (chunk <= 0 || chunk > MSP_RING_SIZE) chunk = 32;
+
+    for(c=0; c<256; c++) {
+	for(k=0; k<256; k++) {
+	    if (crc8_dvb_s2(c, k) != crc8_dvb_s2_bitwise(c, k)) {
+		printf("FAIL: crc table differs for crc %d byte %d\n", c, k);
+		exit(1);
+	    }
+	}
+    }
+
+    ff = fopen(argv[1], "r");
+    if (ff == NULL) {
+	printf("Can't open %s\n", argv[1]);
+	exit(-1);
+    }
+    fseek(ff, 0, SEEK_END);
+    size = ftell(ff);
+    fseek(ff, 0, SEEK_SET);
+    data = (uint8_t *) malloc(size + 1);
+    if (fread(data, 1, size, ff) != size) {
+	printf("Can't read %s\n", argv[1]);
+	exit(-1);
+    }
+    fclose(ff);
+
+    frames = ranges = motions = wrongTimestamps = 0;
+    t0 = nanoseconds();
+    for(i=0; i<repeat; i++) {
+	mspParserInit(&parser, BAUDRATE);
+	consumed = 0;
+	for(offset=0; offset<size; offset+=k) {
+	    k = size - offset < chunk ? size - offset : chunk;
+	    // time when the last byte of the chunk arrived
+	    t = (offset + k) * parser.byteTimeNs;
+	    mspParserPush(&parser, data+offset, k, t);
+	    while (mspParserNextFrame(&parser, &frame)) {
+		frames ++;
+		if (frame.function == MSP2_SENSOR_RANGEFINDER) ranges ++;
+		if (frame.function == MSP2_SENSOR_OPTIC_FLOW) motions ++;
+		consumed = offset + k - (parser.head - parser.tail);
+		if (frame.timestampNs != consumed * parser.byteTimeNs) wrongTimestamps ++;
+	    }
+	}
+    }
+    t = nanoseconds() - t0;
+
+    printf("%ld bytes, chunk %d, %d times: %ld frames (%ld range, %ld motion), %ld checksum errors, %ld bytes skipped\n",
+	   size, chunk, repeat, frames, ranges, motions, parser.checksumErrors * repeat, parser.skippedBytes * repeat);
+    printf("%.0f frames/sec, %.1f MB/sec, %.1f ns/frame\n",
+	   frames / (t / 1e9), (double) size * repeat / (t / 1e3), (double) t / frames);
+    if (wrongTimestamps) {
+	printf("FAIL: %ld wrong timestamps\n", wrongTimestamps);
+	return(1);
+    }
+    printf("ok\n");
+    return(0);
+}
@@ -13,13 +13,29 @@
 //   echo c0 9999 | sudo ./hw-pwm
 // shall turn servo on GPIO12 to extremities positions.
 //
+// By default each line is written to the channel's data register at once,
+// possibly in the middle of a pulse. With -sync, both channels are fed
+// from the PWM FIFO and new values are applied together at the start of
+// a PWM period (see pwmsync.h). With -shm <name>, values are also taken
+// from frames of type "pwm" (c0, c1) published to the sensor bus channel
+// <name>, the last frame before each period wins. -stats <sec> prints
+// update counts and latencies every <sec> seconds.
+//
 // based on pwm.c example from bcm2835 library
 //
 
 #include <bcm2835.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+#include "pwmsync.h"
+#include "sensorbus.h"
 
 // Specify how fine is the movement (granularity of the output). Smaller divider makes the movement smoother.
 // Seems that the value 2 is the smallest working
@@ -49,8 +65,14 @@ static int hwPwmInputFactor=10000;
 // This control when the next peak is broadcasted.
 static int hwPwmRange=24000;
 
+// period synchronized mode, its options
+static int hwPwmSync=0;
+static char *hwPwmShmName=NULL;
+static int hwPwmGuardUs=0;
+static double hwPwmStatsSec=0;
+
 void printUsageAndExit() {
-    printf("usage: hw-pwm <min_pulse_length_us> <max_pulse_length_us> <pwm_frequency> <c0_VVVV_initial_value> <c1_VVVV_initial_value>\n");
+    printf("usage: hw-pwm [-sync] [-shm <name>] [-guard <us>] [-stats <sec>] <min_pulse_length_us> <max_pulse_length_us> <pwm_frequency> <c0_VVVV_initial_value> <c1_VVVV_initial_value>\n");
     exit(0);
 }
 
@@ -62,23 +84,208 @@ int hwPwmInputToData(int value) {
     return(res);
 }
 
+// Parses a line of input. Returns 1 for the exit command, 0 with channel and value set, -1 if the line is ignored.
+int hwPwmParseLine(char *line, int *channel, int *value) {
+    char *p, *q;
+
+    // in our simple protocol line starting with 'e' means exit
+    if (line[0] == 'e' || line[0] == 'q') {
+	printf("debug: %s: Exiting\n", __FILE__);
+	return(1);
+    } else if (line[0] == 'c') {
+	// line starting with 'c' sets channel and value in the format "c0 VVVV" or "c1 VVVV".
+	// VVVV is in the range 0 - hwPwmInputFactor.
+	p = line+1;
+	*channel = strtol(p, &q, 10);
+	if (p == q) {
+	    printf("debug: %s: no channel number in: %s\n", __FILE__, line); fflush(stdout);
+	    return(-1);
+	}
+	if (*channel != PWM_CHANNEL0 && *channel != PWM_CHANNEL1) {
+	    printf("debug: %s: wrong channel, expected value %d or %d in: %s\n", __FILE__, PWM_CHANNEL0, PWM_CHANNEL1, line); fflush(stdout);
+	    return(-1);
+	}
+	p = q;
+	*value = strtol(p, &q, 10);
+	if (p == q) {
+	    printf("debug: %s: no value in line %s\n", __FILE__, line); fflush(stdout);
+	    return(-1);
+	}
+	if (PWM_INPUT_OUT_OF_RANGE(*value)) {
+	    printf("debug: %s: wrong value, expected range 0-%d in: %s\n", __FILE__, hwPwmInputFactor, line); fflush(stdout);
+	    return(-1);
+	}
+	return(0);
+    }
+    printf("debug: %s: line does not start with 'c', ignoring line: %s\n", __FILE__, line); fflush(stdout);
+    return(-1);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// period synchronized mode
+
+static uint32_t hwPwmRegisterRead(void *ctx, int reg) {
+    return(bcm2835_peri_read(bcm2835_pwm + reg));
+}
+
+static void hwPwmRegisterWrite(void *ctx, int reg, uint32_t value) {
+    bcm2835_peri_write(bcm2835_pwm + reg, value);
+}
+
+static double hwPwmMonotonicTime(void *ctx) {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static const struct pwmSyncBackend hwPwmBackend = {hwPwmRegisterRead, hwPwmRegisterWrite, hwPwmMonotonicTime};
+
+// Take the last "pwm" frame from the sensor bus. Frame timestamps are CLOCK_REALTIME.
+static void hwPwmReadShm(struct pwmSync *s, struct sensorBusReader *reader, double now) {
+    struct sensorBusSample	sample, last;
+    double			arrival;
+    int				i, n, value;
+
+    n = 0;
+    while (sensorBusRead(reader, &sample)) {
+	if (sample.type != SENSOR_BUS_PWM) continue;
+	last = sample;
+	n ++;
+    }
+    if (n == 0) return;
+    arrival = last.timestamp - (sensorBusCurrentTime() - now);
+    if (arrival > now) arrival = now;
+    for(i=0; i<PWM_SYNC_CHANNELS; i++) {
+	value = last.value[i];
+	if (PWM_INPUT_OUT_OF_RANGE(value)) {
+	    printf("debug: %s: wrong value %d for channel %d in shared memory frame\n", __FILE__, value, i); fflush(stdout);
+	    continue;
+	}
+	pwmSyncSet(s, i, hwPwmInputToData(value), arrival);
+    }
+}
+
+static void hwPwmSyncLoop(int v0, int v1) {
+    struct pwmSync		s;
+    struct sensorBusReader	reader;
+    struct pollfd		pfd;
+    struct timespec		timeout;
+    char			line[1024];
+    char			*eol;
+    int				len, n, r, stdinOpen, readerOpen, channel, value;
+    double			now, next, deadline, lastOpen, lastReport;
+
+    // wake ups around period boundaries need fine timers
+    prctl(PR_SET_TIMERSLACK, 1000);
+
+    pwmSyncInit(&s, &hwPwmBackend, NULL, hwPwmRange, (double) hwPwmRange * PWM_USE_CLOCK_DIVIDER / 19200000);
+    if (hwPwmGuardUs > 0) s.guard = hwPwmGuardUs / 1000000.0;
+    pwmSyncStart(&s, hwPwmInputToData(v0), hwPwmInputToData(v1));
+    printf("debug: %s: Period synchronized updates, guard %.0f us.\n", __FILE__, s.guard * 1e6); fflush(stdout);
+
+    stdinOpen = 1;
+    readerOpen = 0;
+    len = 0;
+    now = lastReport = hwPwmMonotonicTime(NULL);
+    lastOpen = now - 1;
+    next = pwmSyncPoll(&s);
+    for(;;) {
+	// read the sensor bus just before the pair for the next period is written
+	if (hwPwmShmName != NULL && s.phaseKnown) {
+	    deadline = s.nextBoundary - s.guard;
+	    while (deadline <= now) deadline += s.period;
+	    if (deadline < next) next = deadline;
+	}
+	if (hwPwmStatsSec > 0 && lastReport + hwPwmStatsSec < next) next = lastReport + hwPwmStatsSec;
+	if (next < now) next = now;
+	timeout.tv_sec = (time_t) (next - now);
+	timeout.tv_nsec = (long) ((next - now - timeout.tv_sec) * 1000000000.0);
+	pfd.fd = 0;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	ppoll(&pfd, stdinOpen ? 1 : 0, &timeout, NULL);
+	now = hwPwmMonotonicTime(NULL);
+
+	if (stdinOpen && (pfd.revents & (POLLIN | POLLHUP))) {
+	    n = read(0, line + len, sizeof(line) - 1 - len);
+	    if (n < 0 && errno == EINTR) continue;
+	    if (n <= 0) {
+		stdinOpen = 0;
+		if (hwPwmShmName == NULL) break;
+	    } else {
+		len += n;
+		for(;;) {
+		    eol = (char *) memchr(line, '\n', len);
+		    if (eol == NULL && len < (int) sizeof(line) - 1) break;
+		    n = eol == NULL ? len : eol - line + 1;
+		    line[n - (eol != NULL)] = 0;
+		    r = hwPwmParseLine(line, &channel, &value);
+		    if (r > 0) goto done;
+		    if (r == 0) pwmSyncSet(&s, channel, hwPwmInputToData(value), now);
+		    memmove(line, line + n, len - n);
+		    len -= n;
+		}
+	    }
+	}
+
+	if (hwPwmShmName != NULL) {
+	    if (! readerOpen && now - lastOpen >= 1) {
+		lastOpen = now;
+		readerOpen = sensorBusReaderOpen(&reader, hwPwmShmName) == 0;
+		if (readerOpen) {
+		    printf("debug: %s: Reading frames from %s.\n", __FILE__, hwPwmShmName); fflush(stdout);
+		}
+	    }
+	    if (readerOpen) hwPwmReadShm(&s, &reader, now);
+	}
+
+	next = pwmSyncPoll(&s);
+
+	if (hwPwmStatsSec > 0 && now >= lastReport + hwPwmStatsSec) {
+	    if (readerOpen && reader.lost) {
+		printf("debug: %s: %llu shared memory frames lost.\n", __FILE__, (unsigned long long) reader.lost);
+		reader.lost = 0;
+	    }
+	    pwmSyncReport(&s, stdout);
+	    lastReport = now;
+	}
+    }
+ done:
+    pwmSyncStop(&s);
+    if (readerOpen) sensorBusReaderClose(&reader);
+}
+
 int main(int argc, char **argv) {
     char	*line, *p, *q, *r, *s, *t;
     size_t	lineSize;
     int		channel;
-    int		i, v0, v1, value;
+    int		i, a, v0, v1, value;
     int 	data;
 
-    if (argc != 6) printUsageAndExit();
+    for(a=1; a<argc && argv[a][0] == '-'; a++) {
+	if (strcmp(argv[a], "-sync") == 0) {
+	    hwPwmSync = 1;
+	} else if (strcmp(argv[a], "-shm") == 0 && a+1 < argc) {
+	    hwPwmShmName = argv[++a];
+	    hwPwmSync = 1;
+	} else if (strcmp(argv[a], "-guard") == 0 && a+1 < argc) {
+	    hwPwmGuardUs = atoi(argv[++a]);
+	} else if (strcmp(argv[a], "-stats") == 0 && a+1 < argc) {
+	    hwPwmStatsSec = atof(argv[++a]);
+	} else {
+	    printUsageAndExit();
+	}
+    }
+    if (argc - a != 5) printUsageAndExit();
 
-    i = 1;
+    i = a;
     hwPwmMinPulseUs = strtol(argv[i++], &p, 10);
     hwPwmMaxPulseUs = strtol(argv[i++], &q, 10);
     hwPwmFrequency = strtol(argv[i++], &r, 10);
     v0 = strtol(argv[i++], &s, 10);
     v1 = strtol(argv[i++], &t, 10);
 
-    if (argv[1] == p || argv[2] == q || argv[3] == r || argv[4] == s || argv[5] == t) printUsageAndExit();
+    if (argv[a] == p || argv[a+1] == q || argv[a+2] == r || argv[a+3] == s || argv[a+4] == t) printUsageAndExit();
 
     if (hwPwmFrequency < 1 || hwPwmFrequency > 400) {
 	printf("debug: PWM frequency %d out of of range.\n", hwPwmFrequency);
@@ -101,15 +308,18 @@ int main(int argc, char **argv) {
     // Clock divider is set to 8. Range to 60000 the pulse will be
     // 1.2MHz/12000 = 100Hz
     bcm2835_pwm_set_clock(PWM_USE_CLOCK_DIVIDER);
-    bcm2835_pwm_set_mode(PWM_CHANNEL0, 1, 1);
-    bcm2835_pwm_set_mode(PWM_CHANNEL1, 1, 1);
-    bcm2835_pwm_set_range(PWM_CHANNEL0, hwPwmRange);
-    bcm2835_pwm_set_range(PWM_CHANNEL1, hwPwmRange);
-    usleep(10000);
+    // in synchronized mode, ranges and initial values are set by pwmSyncStart()
+    if (! hwPwmSync) {
+	bcm2835_pwm_set_mode(PWM_CHANNEL0, 1, 1);
+	bcm2835_pwm_set_mode(PWM_CHANNEL1, 1, 1);
+	bcm2835_pwm_set_range(PWM_CHANNEL0, hwPwmRange);
+	bcm2835_pwm_set_range(PWM_CHANNEL1, hwPwmRange);
+	usleep(10000);
 
-    // set initial pwm
-    bcm2835_pwm_set_data(PWM_CHANNEL0, hwPwmInputToData(v0));
-    bcm2835_pwm_set_data(PWM_CHANNEL1, hwPwmInputToData(v1));
+	// set initial pwm
+	bcm2835_pwm_set_data(PWM_CHANNEL0, hwPwmInputToData(v0));
+	bcm2835_pwm_set_data(PWM_CHANNEL1, hwPwmInputToData(v1));
+    }
 
     printf("debug: %s: Starting hw-pwm.\n", __FILE__); fflush(stdout);
     printf("debug: %s: MinPulseLength: %d us.\n", __FILE__, hwPwmMinPulseUs); fflush(stdout);
@@ -117,44 +327,21 @@ int main(int argc, char **argv) {
     printf("debug: %s: InputFactor: %d.\n", __FILE__, hwPwmInputFactor); fflush(stdout);
     printf("debug: %s: Initial values received %d,%d.\n", __FILE__, v0, v1); fflush(stdout);
     
+    if (hwPwmSync) {
+	hwPwmSyncLoop(v0, v1);
+	bcm2835_close();
+	return 0;
+    }
+
     line = NULL; lineSize = 0;
     while  (getline(&line, &lineSize, stdin) >= 0) {
-	// in our simple protocol line starting with 'e' means exit
-	if (line[0] == 'e' || line[0] == 'q') {
-	    printf("debug: %s: Exiting\n", __FILE__);
-	    break;
-	} else if (line[0] == 'c') {
-	    // line starting with 'c' sets channel and value in the format "c0 VVVV" or "c1 VVVV".
-	    // VVVV is in the range 0 - hwPwmInputFactor.
-	    p = line+1;
-	    channel = strtol(p, &q, 10);
-	    if (p == q) {
-		printf("debug: %s: no channel number in: %s\n", __FILE__, line); fflush(stdout);
-		continue;
-	    }
-	    if (channel != PWM_CHANNEL0 && channel != PWM_CHANNEL1) {
-		printf("debug: %s: wrong channel, expected value %d or %d in: %s\n", __FILE__, PWM_CHANNEL0, PWM_CHANNEL1, line); fflush(stdout);
-		continue;
-	    }
-	    p = q;
-	    value = strtol(p, &q, 10);
-	    if (p == q) {
-		printf("debug: %s: no value in line %s\n", __FILE__, line); fflush(stdout);
-		continue;
-	    }
-	    if (PWM_INPUT_OUT_OF_RANGE(value)) {
-		printf("debug: %s: wrong value, expected range 0-%d in: %s\n", __FILE__, hwPwmInputFactor, line); fflush(stdout);
-		continue;
-	    }
-	    p = q;
-	    // translate value ranging between 0 - hwPwmInputFactor to PWM .
-	    data =  hwPwmInputToData(value);
-	    // printf("debug: %s: setting channel %d to pulse %d us, data %d\n", __FILE__, channel, data*10/12, data); fflush(stdout);
-	    bcm2835_pwm_set_data(channel, data);
-	} else {
-	    printf("debug: %s: line does not start with 'c', ignoring line: %s\n", __FILE__, line); fflush(stdout);
-	    continue;
-	}
+	i = hwPwmParseLine(line, &channel, &value);
+	if (i > 0) break;
+	if (i < 0) continue;
+	// translate value ranging between 0 - hwPwmInputFactor to PWM .
+	data =  hwPwmInputToData(value);
+	// printf("debug: %s: setting channel %d to pulse %d us, data %d\n", __FILE__, channel, data*10/12, data); fflush(stdout);
+	bcm2835_pwm_set_data(channel, data);
     }
 
     bcm2835_close();
@@ -0,0 +1,254 @@
+#include <string.h>
+#include <math.h>
+
+#include "pwmsync.h"
+
+// mark/space mode, data from FIFO, repeat the last word when the FIFO is empty
+#define PWM_SYNC_CTL_FIFO_MODE		(PWM_SYNC_CTL_MSEN1 | PWM_SYNC_CTL_USEF1 | PWM_SYNC_CTL_RPTL1 | PWM_SYNC_CTL_PWEN1)
+#define PWM_SYNC_CTL_DATA_MODE		(PWM_SYNC_CTL_MSEN1 | PWM_SYNC_CTL_PWEN1)
+// errors after which the content of the FIFO is unknown
+#define PWM_SYNC_STA_ERRORS		(PWM_SYNC_STA_WERR1 | PWM_SYNC_STA_BERR)
+#define PWM_SYNC_STA_CLEAR		(PWM_SYNC_STA_WERR1 | PWM_SYNC_STA_RERR1 | PWM_SYNC_STA_GAPO1 | PWM_SYNC_STA_GAPO2 | PWM_SYNC_STA_BERR)
+// a pair not taken after so many periods is considered lost
+#define PWM_SYNC_QUEUED_TIMEOUT		4
+
+static uint32_t pwmSyncRead(struct pwmSync *s, int reg) {
+    return(s->backend->read(s->ctx, reg));
+}
+
+static void pwmSyncWrite(struct pwmSync *s, int reg, uint32_t value) {
+    s->backend->write(s->ctx, reg, value);
+}
+
+static double pwmSyncTime(struct pwmSync *s) {
+    return(s->backend->time(s->ctx));
+}
+
+static uint32_t pwmSyncControl(uint32_t channelBits) {
+    return(PWM_SYNC_CTL_CHANNEL(channelBits, 0) | PWM_SYNC_CTL_CHANNEL(channelBits, 1));
+}
+
+void pwmSyncInit(struct pwmSync *s, const struct pwmSyncBackend *backend, void *ctx, uint32_t range, double period) {
+    memset(s, 0, sizeof(*s));
+    s->backend = backend;
+    s->ctx = ctx;
+    s->range = range;
+    s->period = period;
+    s->guard = PWM_SYNC_DEFAULT_GUARD;
+    s->pollStep = PWM_SYNC_DEFAULT_POLL_STEP;
+}
+
+void pwmSyncStart(struct pwmSync *s, uint32_t data0, uint32_t data1) {
+    double	now;
+
+    // the pair has to be written at least two poll steps before the boundary
+    if (s->guard > s->period / 2) s->guard = s->period / 2;
+    if (s->guard < 3 * s->pollStep) s->guard = 3 * s->pollStep;
+
+    pwmSyncWrite(s, PWM_SYNC_REG_CTL, 0);
+    pwmSyncWrite(s, PWM_SYNC_REG_STA, PWM_SYNC_STA_CLEAR);
+    pwmSyncWrite(s, PWM_SYNC_REG_DMAC, 0);
+    pwmSyncWrite(s, PWM_SYNC_REG_RNG1, s->range);
+    pwmSyncWrite(s, PWM_SYNC_REG_RNG2, s->range);
+    pwmSyncWrite(s, PWM_SYNC_REG_CTL, PWM_SYNC_CTL_CLRF1);
+    pwmSyncWrite(s, PWM_SYNC_REG_FIF1, data0);
+    pwmSyncWrite(s, PWM_SYNC_REG_FIF1, data1);
+    // both channels start their first period now, taking the pair
+    pwmSyncWrite(s, PWM_SYNC_REG_CTL, pwmSyncControl(PWM_SYNC_CTL_FIFO_MODE));
+    now = pwmSyncTime(s);
+
+    s->written[0] = s->active[0] = data0;
+    s->written[1] = s->active[1] = data1;
+    s->pendingMask = 0;
+    s->queued = 0;
+    s->phaseKnown = 1;
+    s->phaseTime = now;
+    s->nextBoundary = now + s->period;
+    s->windowStart = now;
+}
+
+void pwmSyncStop(struct pwmSync *s) {
+    int i;
+
+    for(i=0; i<PWM_SYNC_CHANNELS; i++) {
+	if (s->pendingMask & (1 << i)) s->written[i] = s->pendingData[i];
+    }
+    s->pendingMask = 0;
+    s->queued = 0;
+    pwmSyncWrite(s, PWM_SYNC_REG_DAT1, s->written[0]);
+    pwmSyncWrite(s, PWM_SYNC_REG_DAT2, s->written[1]);
+    pwmSyncWrite(s, PWM_SYNC_REG_CTL, pwmSyncControl(PWM_SYNC_CTL_DATA_MODE));
+}
+
+void pwmSyncSet(struct pwmSync *s, int channel, uint32_t data, double arrival) {
+    if (channel < 0 || channel >= PWM_SYNC_CHANNELS) return;
+    if (data > s->range) data = s->range;
+    if (s->pendingMask & (1 << channel)) s->superseded ++;
+    s->pendingData[channel] = data;
+    s->pendingArrival[channel] = arrival;
+    s->pendingMask |= (1 << channel);
+    s->updates ++;
+}
+
+static void pwmSyncLatency(struct pwmSync *s, double latency) {
+    int b;
+
+    if (latency < 0) latency = 0;
+    b = latency / s->period * PWM_SYNC_LATENCY_RESOLUTION;
+    if (b >= PWM_SYNC_LATENCY_BUCKETS) b = PWM_SYNC_LATENCY_BUCKETS - 1;
+    s->latencyHistogram[b] ++;
+    s->latencyCount ++;
+    s->latencySum += latency;
+    if (latency > s->latencyMax) s->latencyMax = latency;
+}
+
+// move nextBoundary to the first boundary after now
+static void pwmSyncAdvance(struct pwmSync *s, double now) {
+    if (s->nextBoundary <= now) s->nextBoundary += (floor((now - s->nextBoundary) / s->period) + 1) * s->period;
+}
+
+static void pwmSyncWritePair(struct pwmSync *s, double now) {
+    int i;
+
+    for(i=0; i<PWM_SYNC_CHANNELS; i++) {
+	if (s->pendingMask & (1 << i)) s->written[i] = s->pendingData[i];
+	s->queuedArrival[i] = s->pendingArrival[i];
+    }
+    pwmSyncWrite(s, PWM_SYNC_REG_FIF1, s->written[0]);
+    pwmSyncWrite(s, PWM_SYNC_REG_FIF1, s->written[1]);
+    s->queued = 1;
+    s->queuedMask = s->pendingMask;
+    s->queuedWrite = s->queuedSeen = now;
+    s->queuedTargetKnown = s->phaseKnown;
+    s->queuedTarget = s->nextBoundary;
+    s->pendingMask = 0;
+    s->writes ++;
+}
+
+// The queued pair was taken at a boundary between queuedSeen and now.
+static void pwmSyncApplied(struct pwmSync *s, double now) {
+    double	boundary;
+    int		i;
+
+    if (now - s->queuedSeen <= 2 * s->pollStep) {
+	// polled closely enough, this is a phase measurement
+	boundary = (s->queuedSeen + now) / 2;
+	s->phaseKnown = 1;
+	s->phaseTime = now;
+	s->nextBoundary = boundary + s->period;
+    } else if (s->phaseKnown) {
+	boundary = s->nextBoundary + floor((now - s->nextBoundary) / s->period) * s->period;
+	if (boundary <= s->queuedSeen) boundary = (s->queuedSeen + now) / 2;
+    } else {
+	boundary = (s->queuedSeen + now) / 2;
+    }
+    if (s->queuedTargetKnown && boundary > s->queuedTarget + s->period / 2) s->late ++;
+    for(i=0; i<PWM_SYNC_CHANNELS; i++) {
+	s->active[i] = s->written[i];
+	if (s->queuedMask & (1 << i)) pwmSyncLatency(s, boundary - s->queuedArrival[i]);
+    }
+    s->queued = 0;
+    s->applied ++;
+    if (s->phaseKnown) pwmSyncAdvance(s, now);
+}
+
+// Drop the FIFO content. The queued values go back to pending unless newer ones came meanwhile.
+static void pwmSyncRecover(struct pwmSync *s) {
+    int i, bit;
+
+    s->errors ++;
+    pwmSyncWrite(s, PWM_SYNC_REG_CTL, pwmSyncControl(PWM_SYNC_CTL_FIFO_MODE) | PWM_SYNC_CTL_CLRF1);
+    if (! s->queued) return;
+    for(i=0; i<PWM_SYNC_CHANNELS; i++) {
+	bit = 1 << i;
+	if ((s->queuedMask & bit) && ! (s->pendingMask & bit)) {
+	    s->pendingData[i] = s->written[i];
+	    s->pendingArrival[i] = s->queuedArrival[i];
+	    s->pendingMask |= bit;
+	}
+	s->written[i] = s->active[i];
+    }
+    s->queued = 0;
+}
+
+double pwmSyncPoll(struct pwmSync *s) {
+    uint32_t	sta;
+    double	now;
+
+    now = pwmSyncTime(s);
+    s->polls ++;
+    sta = pwmSyncRead(s, PWM_SYNC_REG_STA);
+    if (sta & PWM_SYNC_STA_CLEAR) {
+	pwmSyncWrite(s, PWM_SYNC_REG_STA, sta & PWM_SYNC_STA_CLEAR);
+	if (sta & PWM_SYNC_STA_ERRORS) {
+	    pwmSyncRecover(s);
+	    sta |= PWM_SYNC_STA_EMPT1;
+	}
+    }
+
+    if (s->queued) {
+	if (sta & PWM_SYNC_STA_EMPT1) {
+	    pwmSyncApplied(s, now);
+	} else if (now - s->queuedWrite > PWM_SYNC_QUEUED_TIMEOUT * s->period) {
+	    pwmSyncRecover(s);
+	    s->phaseKnown = 0;
+	} else {
+	    // poll around the boundary until the pair is taken
+	    s->queuedSeen = now;
+	    return(now + s->pollStep);
+	}
+    }
+
+    if (s->pendingMask == 0 && s->phaseKnown && now - s->phaseTime < PWM_SYNC_PHASE_REFRESH) {
+	return(s->phaseTime + PWM_SYNC_PHASE_REFRESH);
+    }
+    if (s->phaseKnown) {
+	pwmSyncAdvance(s, now);
+	if (now < s->nextBoundary - s->guard) return(s->nextBoundary - s->guard);
+	if (s->nextBoundary - now < 2 * s->pollStep) {
+	    // too close, the boundary could come between the two words
+	    s->nextBoundary += s->period;
+	    return(s->nextBoundary - s->guard);
+	}
+    }
+    pwmSyncWritePair(s, now);
+    return(now + s->pollStep);
+}
+
+double pwmSyncLatencyQuantile(struct pwmSync *s, double q) {
+    long long	n, target;
+    double	r;
+    int		i;
+
+    if (s->latencyCount == 0) return(0);
+    target = ceil(q * s->latencyCount);
+    if (target < 1) target = 1;
+    n = 0;
+    for(i=0; i<PWM_SYNC_LATENCY_BUCKETS-1; i++) {
+	n += s->latencyHistogram[i];
+	if (n >= target) {
+	    // upper edge of the bucket
+	    r = (i + 1) * s->period / PWM_SYNC_LATENCY_RESOLUTION;
+	    return(r < s->latencyMax ? r : s->latencyMax);
+	}
+    }
+    return(s->latencyMax);
+}
+
+void pwmSyncReport(struct pwmSync *s, FILE *ff) {
+    double now, dt;
+
+    now = pwmSyncTime(s);
+    dt = now - s->windowStart;
+    fprintf(ff, "debug: pwmsync: %.1f s: %lld updates, %lld superseded, %lld writes, %lld applied, %lld late, %lld errors, %.0f polls/s\n",
+	    dt, s->updates, s->superseded, s->writes, s->applied, s->late, s->errors, dt > 0 ? s->polls / dt : 0.0);
+    fprintf(ff, "debug: pwmsync: latency us: mean %.0f, p50 %.0f, p99 %.0f, max %.0f\n",
+	    s->latencyCount ? s->latencySum / s->latencyCount * 1e6 : 0.0,
+	    pwmSyncLatencyQuantile(s, 0.5) * 1e6, pwmSyncLatencyQuantile(s, 0.99) * 1e6, s->latencyMax * 1e6);
+    fflush(ff);
+    s->updates = s->superseded = s->writes = s->applied = s->late = s->polls = s->errors = 0;
+    s->latencyCount = 0;
+    s->latencySum = s->latencyMax = 0;
+    memset(s->latencyHistogram, 0, sizeof(s->latencyHistogram));
+    s->windowStart = now;
+}
@@ -0,0 +1,152 @@
+/*
+  Period synchronized updates of both hardware PWM channels.
+
+  Both channels take their data from the PWM FIFO (USEF) and repeat the
+  last word while it is empty (RPTL). A channel reads the next word only
+  when its period starts, so a pair of words written to the FIFO is
+  applied by both channels at the same period boundary and never in the
+  middle of a pulse. The channels have the same range and are enabled by
+  one control register write, so their periods start together and the
+  FIFO words alternate between channel 0 and channel 1.
+
+  New values are double buffered. The input side only changes the
+  pending pair, which is written to the FIFO a guard time before the
+  expected period boundary. So the newest values go out and at most one
+  pair waits in the FIFO. The boundary phase is learned from the moment
+  the FIFO becomes empty, which is polled around the expected boundary.
+  Until the phase is known, pairs are written at once. When there is
+  nothing to write, the last pair is written again from time to time to
+  follow the drift between the PWM clock and the system clock.
+
+  The FIFO is fed by the CPU. DMA would have to queue words ahead of
+  the boundary, adding latency, for two words per period.
+
+  Registers are accessed through a backend, the bcm2835 library on the
+  Raspberry Pi (hw-pwm.c) or a simulation in tests (test/pwm-sim.h).
+
+  Latency of a channel update is measured from its arrival (the time
+  given to pwmSyncSet) to the estimated boundary at which the hardware
+  took it. Times are CLOCK_MONOTONIC seconds unless the backend says
+  otherwise.
+
+  The file is compiled by both gcc and g++.
+ */
+
+#ifndef PWMSYNC_H
+#define PWMSYNC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PWM_SYNC_CHANNELS		2
+
+// PWM registers, word offsets (BCM2835 ARM Peripherals, 9.6)
+#define PWM_SYNC_REG_CTL		0
+#define PWM_SYNC_REG_STA		1
+#define PWM_SYNC_REG_DMAC		2
+#define PWM_SYNC_REG_RNG1		4
+#define PWM_SYNC_REG_DAT1		5
+#define PWM_SYNC_REG_FIF1		6
+#define PWM_SYNC_REG_RNG2		8
+#define PWM_SYNC_REG_DAT2		9
+
+// CTL, channel 1 bits, channel 2 bits are shifted by 8 (except CLRF1)
+#define PWM_SYNC_CTL_PWEN1		0x0001
+#define PWM_SYNC_CTL_RPTL1		0x0004
+#define PWM_SYNC_CTL_USEF1		0x0020
+#define PWM_SYNC_CTL_CLRF1		0x0040
+#define PWM_SYNC_CTL_MSEN1		0x0080
+#define PWM_SYNC_CTL_CHANNEL_SHIFT	8
+#define PWM_SYNC_CTL_CHANNEL(bits, channel)	((uint32_t)(bits) << ((channel) * PWM_SYNC_CTL_CHANNEL_SHIFT))
+
+// STA, error bits are cleared by writing 1
+#define PWM_SYNC_STA_FULL1		0x0001
+#define PWM_SYNC_STA_EMPT1		0x0002
+#define PWM_SYNC_STA_WERR1		0x0004
+#define PWM_SYNC_STA_RERR1		0x0008
+#define PWM_SYNC_STA_GAPO1		0x0010
+#define PWM_SYNC_STA_GAPO2		0x0020
+#define PWM_SYNC_STA_BERR		0x0100
+
+#define PWM_SYNC_DEFAULT_GUARD		300e-6
+#define PWM_SYNC_DEFAULT_POLL_STEP	50e-6
+// seconds without a phase measurement after which the last pair is written again
+#define PWM_SYNC_PHASE_REFRESH		0.5
+
+// latency histogram, PWM_SYNC_LATENCY_BUCKETS buckets of period / PWM_SYNC_LATENCY_RESOLUTION
+#define PWM_SYNC_LATENCY_RESOLUTION	16
+#define PWM_SYNC_LATENCY_BUCKETS	64
+
+struct pwmSyncBackend {
+    uint32_t (*read)(void *ctx, int reg);
+    void (*write)(void *ctx, int reg, uint32_t value);
+    double (*time)(void *ctx);
+};
+
+struct pwmSync {
+    const struct pwmSyncBackend	*backend;
+    void			*ctx;
+    uint32_t			range;
+    // seconds, range / PWM clock
+    double			period;
+    // pending pair is written this long before the expected boundary
+    double			guard;
+    // FIFO is polled with this step around the expected boundary
+    double			pollStep;
+
+    // values set by the input and not written yet
+    uint32_t			pendingData[PWM_SYNC_CHANNELS];
+    double			pendingArrival[PWM_SYNC_CHANNELS];
+    int				pendingMask;
+    // pair in the FIFO, its data is in written[]
+    int				queued;
+    int				queuedMask;
+    double			queuedArrival[PWM_SYNC_CHANNELS];
+    double			queuedWrite;
+    // boundary the pair was written for, if the phase was known
+    int				queuedTargetKnown;
+    double			queuedTarget;
+    // last poll which saw the pair still in the FIFO
+    double			queuedSeen;
+    // last pair written and last pair taken by the hardware
+    uint32_t			written[PWM_SYNC_CHANNELS];
+    uint32_t			active[PWM_SYNC_CHANNELS];
+
+    int				phaseKnown;
+    // time of the last phase measurement
+    double			phaseTime;
+    double			nextBoundary;
+
+    // statistics since the last report
+    long long			updates;
+    // updates overwritten by a newer value before they were written
+    long long			superseded;
+    long long			writes;
+    long long			applied;
+    // pairs taken one or more periods after the boundary they were written for
+    long long			late;
+    long long			polls;
+    long long			errors;
+    long long			latencyCount;
+    double			latencySum;
+    double			latencyMax;
+    long long			latencyHistogram[PWM_SYNC_LATENCY_BUCKETS];
+    double			windowStart;
+};
+
+void pwmSyncInit(struct pwmSync *s, const struct pwmSyncBackend *backend, void *ctx, uint32_t range, double period);
+// Set ranges and switch both channels to FIFO mode outputting the given data.
+void pwmSyncStart(struct pwmSync *s, uint32_t data0, uint32_t data1);
+// Switch back to data register mode keeping the last values.
+void pwmSyncStop(struct pwmSync *s);
+
+void pwmSyncSet(struct pwmSync *s, int channel, uint32_t data, double arrival);
+// Check the FIFO and write the pending pair when due. Returns the time of the next call.
+double pwmSyncPoll(struct pwmSync *s);
+
+// Latency quantile (0 - 1) of the current window in seconds, from the histogram.
+double pwmSyncLatencyQuantile(struct pwmSync *s, double q);
+// Print statistics gathered since the last report and start a new window.
+void pwmSyncReport(struct pwmSync *s, FILE *ff);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+  Update latency of the period synchronized PWM mode in real time. The
+  simulated registers (pwm-sim.h) run on CLOCK_MONOTONIC, the loop sleeps
+  until the time returned by pwmSyncPoll() or the next frame, like
+  hw-pwm does. Latency is measured from the arrival of a frame to the
+  start of the first PWM period outputting it, from the simulated period
+  log, and compared to what pwmsync measures itself. The legacy data
+  register writes get the same frames for comparison of torn and split
+  periods.
+
+  usage: bench-pwmsync [seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+#include "pwm-sim.h"
+
+#define CLOCK		9600000.0
+#define FRAME_RATE	100.0
+#define BASE0		1000
+#define BASE1		13000
+
+static int compareDouble(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return(x < y ? -1 : x > y);
+}
+
+static void sleepUntil(double t) {
+    struct timespec tt;
+    tt.tv_sec = (time_t) t;
+    tt.tv_nsec = (long) ((t - tt.tv_sec) * 1e9);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tt, NULL);
+}
+
+static void run(double pwmFrequency, double seconds, int legacy) {
+    struct pwmSim	sim;
+    struct pwmSync	s;
+    double		*arrival, *latency, start, end, next, nextFrame, now, period;
+    uint32_t		range;
+    int			n, k, frames, applied, torn, split, last, i0;
+
+    range = CLOCK / pwmFrequency;
+    period = range / CLOCK;
+    n = seconds * FRAME_RATE * 2 + 2;
+    arrival = (double *) calloc(n, sizeof(double));
+    latency = (double *) calloc(n, sizeof(double));
+    srand(1);
+
+    pwmSimInit(&sim, CLOCK, 1);
+    pwmSyncInit(&s, &pwmSimBackend, &sim, range, period);
+    if (legacy) {
+	pwmSimWrite(&sim, PWM_SYNC_REG_RNG1, range);
+	pwmSimWrite(&sim, PWM_SYNC_REG_RNG2, range);
+	pwmSimWrite(&sim, PWM_SYNC_REG_DAT1, BASE0);
+	pwmSimWrite(&sim, PWM_SYNC_REG_DAT2, BASE1);
+	pwmSimWrite(&sim, PWM_SYNC_REG_CTL, PWM_SYNC_CTL_CHANNEL(0x81, 0) | PWM_SYNC_CTL_CHANNEL(0x81, 1));
+	next = 1e30;
+    } else {
+	pwmSyncStart(&s, BASE0, BASE1);
+	next = pwmSyncPoll(&s);
+    }
+    start = pwmSimTime(&sim);
+    end = start + seconds;
+    nextFrame = start + 1 / FRAME_RATE;
+    frames = 1;
+    for(;;) {
+	sleepUntil(next < nextFrame ? next : nextFrame);
+	now = pwmSimTime(&sim);
+	if (now >= end) break;
+	if (now >= nextFrame && frames < n) {
+	    arrival[frames] = now;
+	    if (legacy) {
+		pwmSimWrite(&sim, PWM_SYNC_REG_DAT1, BASE0 + frames);
+		pwmSimWrite(&sim, PWM_SYNC_REG_DAT2, BASE1 + frames);
+	    } else {
+		pwmSyncSet(&s, 0, BASE0 + frames, now);
+		pwmSyncSet(&s, 1, BASE1 + frames, now);
+	    }
+	    frames ++;
+	    nextFrame += (0.5 + rand() / (RAND_MAX + 1.0)) / FRAME_RATE;
+	}
+	if (! legacy) next = pwmSyncPoll(&s);
+    }
+    pwmSimAdvance(&sim, pwmSimTime(&sim));
+
+    applied = torn = split = 0;
+    last = 0;
+    for(k=0; k<sim.logCount[0] && k<sim.logCount[1]; k++) {
+	i0 = (int) sim.log[0][k].value - BASE0;
+	if (i0 != (int) sim.log[1][k].value - BASE1) split ++;
+	if (sim.log[0][k].torn || sim.log[1][k].torn) torn ++;
+	if (i0 > last && i0 < frames) {
+	    latency[applied ++] = sim.log[0][k].start - arrival[i0];
+	    last = i0;
+	}
+    }
+    qsort(latency, applied, sizeof(double), compareDouble);
+    printf("%-6s %3.0f Hz: %5d frames, %5d periods, %4.1f%% torn, %3d split", legacy ? "legacy" : "sync", pwmFrequency, frames - 1, k, k ? 100.0 * torn / k : 0.0, split);
+    if (applied) {
+	printf(", latency us p50 %5.0f p99 %5.0f max %5.0f", latency[applied/2] * 1e6, latency[applied*99/100] * 1e6, latency[applied-1] * 1e6);
+    }
+    printf("\n");
+    if (! legacy) {
+	printf("       %lld superseded, %lld late, %.0f polls/s, ", s.superseded, s.late, s.polls / seconds);
+	printf("measured p50 %.0f p99 %.0f max %.0f\n", pwmSyncLatencyQuantile(&s, 0.5) * 1e6, pwmSyncLatencyQuantile(&s, 0.99) * 1e6, s.latencyMax * 1e6);
+    }
+    pwmSimFree(&sim);
+    free(arrival);
+    free(latency);
+}
+
+int main(int argc, char **argv) {
+    double seconds;
+
+    seconds = argc > 1 ? atof(argv[1]) : 5;
+    // as hw-pwm does
+    prctl(PR_SET_TIMERSLACK, 1000);
+    printf("frames at %.0f Hz for %.0f s, legacy latency is to the next period start\n", FRAME_RATE, seconds);
+    run(50, seconds, 0);
+    run(50, seconds, 1);
+    run(400, seconds, 0);
+    run(400, seconds, 1);
+    return(0);
+}
@@ -0,0 +1,243 @@
+/*
+  Simulated BCM2835 PWM registers for tests of ../pwmsync. Implements
+  the pwmSyncBackend used on the Raspberry Pi by hw-pwm.c.
+
+  Both channels in mark/space mode. A channel starts a period when it is
+  enabled and then every range / clock seconds. At the start of a period
+  it takes the next FIFO word (USEF), repeats its last value if the FIFO
+  is empty (RPTL) or takes its data register. When both channels start a
+  period at the same time, channel 0 reads first. The FIFO holds 8 words,
+  writing to a full FIFO sets WERR, error bits are cleared by writing 1.
+  A data register written in the middle of a period of a channel not
+  using the FIFO changes the pulse being output, the period is marked as
+  torn.
+
+  Every period of each channel is logged with its start and value, so
+  tests can check what the servos would get. Time is either virtual, set
+  by the test in sim->now, or CLOCK_MONOTONIC. The hardware clock may be
+  off by sim->drift (relative) against the time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../pwmsync.h"
+
+#define PWM_SIM_FIFO_SIZE	8
+
+struct pwmSimPeriod {
+    double	start;
+    uint32_t	value;
+    int		torn;
+};
+
+struct pwmSim {
+    // virtual time, or CLOCK_MONOTONIC when realTime
+    double		now;
+    int			realTime;
+    // PWM clock in Hz and its relative error
+    double		clock;
+    double		drift;
+
+    uint32_t		ctl;
+    uint32_t		sta;
+    uint32_t		dmac;
+    uint32_t		range[PWM_SYNC_CHANNELS];
+    uint32_t		data[PWM_SYNC_CHANNELS];
+    uint32_t		fifo[PWM_SIM_FIFO_SIZE];
+    int			fifoHead;
+    int			fifoCount;
+    int			fifoMax;
+
+    // per channel: enable time, index of the next period, value being output
+    double		enabled[PWM_SYNC_CHANNELS];
+    long long		nextPeriod[PWM_SYNC_CHANNELS];
+    uint32_t		output[PWM_SYNC_CHANNELS];
+
+    struct pwmSimPeriod	*log[PWM_SYNC_CHANNELS];
+    int			logCount[PWM_SYNC_CHANNELS];
+    int			logSize[PWM_SYNC_CHANNELS];
+
+    long long		registerWrites;
+};
+
+static double pwmSimMonotonicTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static void pwmSimInit(struct pwmSim *sim, double clock, int realTime) {
+    memset(sim, 0, sizeof(*sim));
+    sim->clock = clock;
+    sim->realTime = realTime;
+    sim->now = realTime ? pwmSimMonotonicTime() : 1000.0;
+    sim->sta = PWM_SYNC_STA_EMPT1;
+}
+
+static void pwmSimFree(struct pwmSim *sim) {
+    int i;
+    for(i=0; i<PWM_SYNC_CHANNELS; i++) free(sim->log[i]);
+}
+
+static int pwmSimEnabled(struct pwmSim *sim, int channel) {
+    return((sim->ctl >> (channel * PWM_SYNC_CTL_CHANNEL_SHIFT)) & PWM_SYNC_CTL_PWEN1);
+}
+
+static int pwmSimChannelBits(struct pwmSim *sim, int channel, uint32_t bits) {
+    return(((sim->ctl >> (channel * PWM_SYNC_CTL_CHANNEL_SHIFT)) & bits) != 0);
+}
+
+static double pwmSimPeriodStart(struct pwmSim *sim, int channel, long long k) {
+    return(sim->enabled[channel] + k * (double) sim->range[channel] / (sim->clock * (1 + sim->drift)));
+}
+
+static void pwmSimStatus(struct pwmSim *sim) {
+    sim->sta &= ~(PWM_SYNC_STA_EMPT1 | PWM_SYNC_STA_FULL1);
+    if (sim->fifoCount == 0) sim->sta |= PWM_SYNC_STA_EMPT1;
+    if (sim->fifoCount == PWM_SIM_FIFO_SIZE) sim->sta |= PWM_SYNC_STA_FULL1;
+}
+
+static void pwmSimStartPeriod(struct pwmSim *sim, int channel, double start) {
+    struct pwmSimPeriod *p;
+
+    if (pwmSimChannelBits(sim, channel, PWM_SYNC_CTL_USEF1)) {
+	if (sim->fifoCount > 0) {
+	    sim->output[channel] = sim->fifo[sim->fifoHead];
+	    sim->fifoHead = (sim->fifoHead + 1) % PWM_SIM_FIFO_SIZE;
+	    sim->fifoCount --;
+	} else {
+	    sim->sta |= PWM_SYNC_STA_RERR1;
+	    if (! pwmSimChannelBits(sim, channel, PWM_SYNC_CTL_RPTL1)) {
+		sim->sta |= channel == 0 ? PWM_SYNC_STA_GAPO1 : PWM_SYNC_STA_GAPO2;
+		sim->output[channel] = 0;
+	    }
+	}
+    } else {
+	sim->output[channel] = sim->data[channel];
+    }
+    pwmSimStatus(sim);
+    if (sim->logCount[channel] == sim->logSize[channel]) {
+	sim->logSize[channel] = sim->logSize[channel] * 2 + 1024;
+	sim->log[channel] = (struct pwmSimPeriod *) realloc(sim->log[channel], sim->logSize[channel] * sizeof(struct pwmSimPeriod));
+    }
+    p = &sim->log[channel][sim->logCount[channel] ++];
+    p->start = start;
+    p->value = sim->output[channel];
+    p->torn = 0;
+}
+
+// run the hardware up to time t
+static void pwmSimAdvance(struct pwmSim *sim, double t) {
+    double	start, first;
+    int		i, channel;
+
+    for(;;) {
+	channel = -1;
+	first = t;
+	for(i=0; i<PWM_SYNC_CHANNELS; i++) {
+	    if (! pwmSimEnabled(sim, i) || sim->range[i] == 0) continue;
+	    start = pwmSimPeriodStart(sim, i, sim->nextPeriod[i]);
+	    if (start <= first && (channel < 0 || start < first)) {
+		channel = i;
+		first = start;
+	    }
+	}
+	if (channel < 0) break;
+	pwmSimStartPeriod(sim, channel, first);
+	sim->nextPeriod[channel] ++;
+    }
+}
+
+static double pwmSimTime(void *ctx) {
+    struct pwmSim *sim = (struct pwmSim *) ctx;
+    if (sim->realTime) sim->now = pwmSimMonotonicTime();
+    return(sim->now);
+}
+
+static uint32_t pwmSimRead(void *ctx, int reg) {
+    struct pwmSim *sim = (struct pwmSim *) ctx;
+
+    pwmSimAdvance(sim, pwmSimTime(sim));
+    switch (reg) {
+    case PWM_SYNC_REG_CTL:	return(sim->ctl);
+    case PWM_SYNC_REG_STA:	return(sim->sta);
+    case PWM_SYNC_REG_DMAC:	return(sim->dmac);
+    case PWM_SYNC_REG_RNG1:	return(sim->range[0]);
+    case PWM_SYNC_REG_DAT1:	return(sim->data[0]);
+    case PWM_SYNC_REG_RNG2:	return(sim->range[1]);
+    case PWM_SYNC_REG_DAT2:	return(sim->data[1]);
+    }
+    return(0);
+}
+
+static void pwmSimWriteData(struct pwmSim *sim, int channel, uint32_t value) {
+    struct pwmSimPeriod *p;
+
+    sim->data[channel] = value;
+    if (! pwmSimEnabled(sim, channel) || pwmSimChannelBits(sim, channel, PWM_SYNC_CTL_USEF1) || sim->logCount[channel] == 0) return;
+    p = &sim->log[channel][sim->logCount[channel] - 1];
+    if (sim->output[channel] != value && sim->now > p->start) p->torn = 1;
+    sim->output[channel] = value;
+}
+
+static void pwmSimWrite(void *ctx, int reg, uint32_t value) {
+    struct pwmSim	*sim = (struct pwmSim *) ctx;
+    uint32_t		old;
+    int			i;
+
+    pwmSimAdvance(sim, pwmSimTime(sim));
+    sim->registerWrites ++;
+    switch (reg) {
+    case PWM_SYNC_REG_CTL:
+	if (value & PWM_SYNC_CTL_CLRF1) {
+	    sim->fifoCount = 0;
+	    value &= ~PWM_SYNC_CTL_CLRF1;
+	}
+	old = sim->ctl;
+	sim->ctl = value;
+	for(i=0; i<PWM_SYNC_CHANNELS; i++) {
+	    if (pwmSimEnabled(sim, i) && ! ((old >> (i * PWM_SYNC_CTL_CHANNEL_SHIFT)) & PWM_SYNC_CTL_PWEN1)) {
+		sim->enabled[i] = sim->now;
+		sim->nextPeriod[i] = 0;
+	    }
+	}
+	pwmSimStatus(sim);
+	// channels just enabled start their first period
+	pwmSimAdvance(sim, sim->now);
+	break;
+    case PWM_SYNC_REG_STA:
+	sim->sta &= ~(value & (PWM_SYNC_STA_WERR1 | PWM_SYNC_STA_RERR1 | PWM_SYNC_STA_GAPO1 | PWM_SYNC_STA_GAPO2 | PWM_SYNC_STA_BERR));
+	break;
+    case PWM_SYNC_REG_DMAC:
+	sim->dmac = value;
+	break;
+    case PWM_SYNC_REG_RNG1:
+	sim->range[0] = value;
+	break;
+    case PWM_SYNC_REG_RNG2:
+	sim->range[1] = value;
+	break;
+    case PWM_SYNC_REG_DAT1:
+	pwmSimWriteData(sim, 0, value);
+	break;
+    case PWM_SYNC_REG_DAT2:
+	pwmSimWriteData(sim, 1, value);
+	break;
+    case PWM_SYNC_REG_FIF1:
+	if (sim->fifoCount == PWM_SIM_FIFO_SIZE) {
+	    sim->sta |= PWM_SYNC_STA_WERR1;
+	} else {
+	    sim->fifo[(sim->fifoHead + sim->fifoCount) % PWM_SIM_FIFO_SIZE] = value;
+	    sim->fifoCount ++;
+	    if (sim->fifoCount > sim->fifoMax) sim->fifoMax = sim->fifoCount;
+	}
+	pwmSimStatus(sim);
+	break;
+    }
+}
+
+static const struct pwmSyncBackend pwmSimBackend = {pwmSimRead, pwmSimWrite, pwmSimTime};
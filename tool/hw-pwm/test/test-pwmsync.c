@@ -0,0 +1,288 @@
+/*
+  Tests of the period synchronized PWM updates (../pwmsync) on simulated
+  registers (pwm-sim.h) in virtual time.
+
+  Frames carry values for both channels, frame i sets channel 0 to
+  BASE0 + i and channel 1 to BASE1 + i. From the simulated period log we
+  check that every period outputs both values of the same frame (no
+  split), no pulse is changed while being output (no tear), frames go
+  out in order, the last frame is always output and the latency from
+  arrival to the start of the first period outputting the frame is
+  within one period plus the guard time. The legacy per channel data
+  register writes are run through the same checks to show what they do.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pwm-sim.h"
+
+#define CLOCK		9600000.0
+#define BASE0		1000
+#define BASE1		13000
+
+struct testConfig {
+    double	pwmFrequency;
+    // frames per second, intervals are random between 0.5 and 1.5 of the mean
+    double	frameRate;
+    double	seconds;
+    // mean of exponential delays of poll wake ups, probability of a 2ms delay
+    double	jitter;
+    double	spikes;
+    double	drift;
+    // times (from start) when the simulated hardware raises WERR and BERR, 0 for never
+    double	werrAt;
+    double	berrAt;
+    // data register writes at frame arrival, channel 1 lineGap seconds after channel 0
+    int		legacy;
+    double	lineGap;
+};
+
+struct testResult {
+    int		frames;
+    int		periods;
+    int		split;
+    int		torn;
+    int		reordered;
+    int		applied;
+    int		lastApplied;
+    double	latencyMean;
+    double	latencyMax;
+};
+
+int failures = 0;
+
+static void check(const char *name, int ok) {
+    if (! ok) {
+	printf("FAIL %s\n", name);
+	failures ++;
+    }
+}
+
+static double uniform() {
+    return((rand() + 0.5) / (RAND_MAX + 1.0));
+}
+
+static double wakeupDelay(struct testConfig *c) {
+    double d;
+    d = c->jitter > 0 ? - c->jitter * log(uniform()) : 0;
+    if (c->spikes > 0 && uniform() < c->spikes) d += 2e-3;
+    return(d);
+}
+
+static void analyse(struct pwmSim *sim, double *arrival, int n, struct testResult *r) {
+    struct pwmSimPeriod	*p0, *p1;
+    double		latency;
+    int			k, i0, i1, last;
+
+    r->periods = sim->logCount[0] < sim->logCount[1] ? sim->logCount[0] : sim->logCount[1];
+    r->split = r->torn = r->reordered = r->applied = 0;
+    r->latencyMean = r->latencyMax = 0;
+    last = -1;
+    for(k=0; k<r->periods; k++) {
+	p0 = &sim->log[0][k];
+	p1 = &sim->log[1][k];
+	i0 = (int) p0->value - BASE0;
+	i1 = (int) p1->value - BASE1;
+	if (i0 != i1 || fabs(p0->start - p1->start) > 1e-9) r->split ++;
+	if (p0->torn || p1->torn) r->torn ++;
+	if (i0 < last) r->reordered ++;
+	if (i0 > last && i0 > 0 && i0 < n) {
+	    latency = p0->start - arrival[i0];
+	    r->latencyMean += latency;
+	    if (latency > r->latencyMax) r->latencyMax = latency;
+	    r->applied ++;
+	}
+	if (i0 > last) last = i0;
+    }
+    if (r->applied) r->latencyMean /= r->applied;
+    r->lastApplied = r->periods > 0 && sim->log[0][r->periods-1].value == (uint32_t) (BASE0 + n - 1) && sim->log[1][r->periods-1].value == (uint32_t) (BASE1 + n - 1);
+}
+
+static void runTest(const char *name, struct testConfig *c, struct pwmSim *sim, struct pwmSync *s, struct testResult *r) {
+    double	*arrival, t, start, end, next, period;
+    uint32_t	range;
+    int		i, n, werr, berr;
+
+    range = CLOCK / c->pwmFrequency;
+    period = range / CLOCK;
+    pwmSimInit(sim, CLOCK, 0);
+    sim->drift = c->drift;
+    start = sim->now;
+    end = start + c->seconds;
+
+    // frame 0 is the initial value
+    n = c->seconds * c->frameRate * 1.6 + 2;
+    arrival = (double *) calloc(n, sizeof(double));
+    arrival[0] = start;
+    t = start;
+    for(i=1; i<n; i++) {
+	t += (0.5 + uniform()) / c->frameRate;
+	if (t >= end) break;
+	arrival[i] = t;
+    }
+    n = i;
+
+    pwmSyncInit(s, &pwmSimBackend, sim, range, period);
+    if (c->legacy) {
+	pwmSimWrite(sim, PWM_SYNC_REG_RNG1, range);
+	pwmSimWrite(sim, PWM_SYNC_REG_RNG2, range);
+	pwmSimWrite(sim, PWM_SYNC_REG_DAT1, BASE0);
+	pwmSimWrite(sim, PWM_SYNC_REG_DAT2, BASE1);
+	pwmSimWrite(sim, PWM_SYNC_REG_CTL, PWM_SYNC_CTL_CHANNEL(0x81, 0) | PWM_SYNC_CTL_CHANNEL(0x81, 1));
+	for(i=1; i<n; i++) {
+	    sim->now = arrival[i];
+	    pwmSimWrite(sim, PWM_SYNC_REG_DAT1, BASE0 + i);
+	    sim->now = arrival[i] + c->lineGap;
+	    pwmSimWrite(sim, PWM_SYNC_REG_DAT2, BASE1 + i);
+	}
+	sim->now = end + 5 * period;
+	pwmSimAdvance(sim, sim->now);
+    } else {
+	pwmSyncStart(s, BASE0, BASE1);
+	next = pwmSyncPoll(s);
+	werr = berr = 0;
+	i = 1;
+	while (sim->now < end + 5 * period) {
+	    if (i < n && arrival[i] <= next) {
+		sim->now = arrival[i];
+		pwmSyncSet(s, 0, BASE0 + i, arrival[i]);
+		pwmSyncSet(s, 1, BASE1 + i, arrival[i]);
+		i ++;
+	    } else {
+		sim->now = next + wakeupDelay(c);
+	    }
+	    if (c->werrAt > 0 && ! werr && sim->now >= start + c->werrAt) {
+		sim->sta |= PWM_SYNC_STA_WERR1;
+		werr = 1;
+	    }
+	    if (c->berrAt > 0 && ! berr && sim->now >= start + c->berrAt) {
+		sim->sta |= PWM_SYNC_STA_BERR;
+		berr = 1;
+	    }
+	    next = pwmSyncPoll(s);
+	}
+    }
+    analyse(sim, arrival, n, r);
+    r->frames = n - 1;
+    printf("%-14s %5d frames, %5d periods, %4d applied, %4d split, %4d torn, latency mean %5.0f us max %5.0f us",
+	   name, r->frames, r->periods, r->applied, r->split, r->torn, r->latencyMean * 1e6, r->latencyMax * 1e6);
+    if (! c->legacy) printf(", %lld polls, %lld late, %lld errors", s->polls, s->late, s->errors);
+    printf("\n");
+    free(arrival);
+}
+
+static void checkSynchronized(const char *name, struct testConfig *c, struct pwmSim *sim, struct pwmSync *s, struct testResult *r) {
+    char msg[256];
+
+#define CHECK(what, ok) {snprintf(msg, sizeof(msg), "%s: %s", name, what); check(msg, ok);}
+    CHECK("no split periods", r->split == 0);
+    CHECK("no torn periods", r->torn == 0);
+    CHECK("frames in order", r->reordered == 0);
+    CHECK("last frame output", r->lastApplied);
+    CHECK("at most one pair queued", sim->fifoMax <= 2);
+    CHECK("DMA off", sim->dmac == 0);
+    if (c->jitter == 0 && c->spikes == 0) {
+	CHECK("latency within period + guard", r->latencyMax <= s->period + s->guard + 2 * s->pollStep);
+	// the pwmsync estimate of the boundaries is within half a poll step
+	CHECK("measured latency", fabs(s->latencyMax - r->latencyMax) <= s->pollStep);
+    }
+#undef CHECK
+}
+
+int main() {
+    struct testConfig	c, base;
+    struct testResult	r, legacy;
+    struct pwmSim	sim;
+    struct pwmSync	s;
+    uint32_t		fifoMode;
+
+    srand(1);
+    memset(&base, 0, sizeof(base));
+    base.pwmFrequency = 50;
+    base.frameRate = 200;
+    base.seconds = 10;
+
+    // initial values and register setup
+    c = base;
+    c.seconds = 0.1;
+    runTest("start", &c, &sim, &s, &r);
+    fifoMode = PWM_SYNC_CTL_CHANNEL(0xa5, 0) | PWM_SYNC_CTL_CHANNEL(0xa5, 1);
+    check("start: both channels in FIFO mode", sim.ctl == fifoMode);
+    check("start: initial values", sim.log[0][0].value == BASE0 && sim.log[1][0].value == BASE1 && sim.log[0][0].start == sim.log[1][0].start);
+    check("start: ranges", sim.range[0] == 192000 && sim.range[1] == 192000);
+    pwmSimFree(&sim);
+
+    c = base;
+    runTest("50 Hz", &c, &sim, &s, &r);
+    checkSynchronized("50 Hz", &c, &sim, &s, &r);
+    check("50 Hz: superseded frames counted", s.superseded > 0 && r.applied < r.frames);
+    check("50 Hz: no late pairs", s.late == 0 && s.errors == 0);
+    pwmSimFree(&sim);
+
+    c = base;
+    c.pwmFrequency = 400;
+    c.frameRate = 30;
+    runTest("400 Hz", &c, &sim, &s, &r);
+    checkSynchronized("400 Hz", &c, &sim, &s, &r);
+    check("400 Hz: every frame output", r.applied == r.frames);
+    check("400 Hz: no late pairs", s.late == 0);
+    pwmSimFree(&sim);
+
+    c = base;
+    c.jitter = 30e-6;
+    c.spikes = 0.01;
+    runTest("jitter", &c, &sim, &s, &r);
+    checkSynchronized("jitter", &c, &sim, &s, &r);
+    check("jitter: latency within two periods + delay", r.latencyMax <= 2 * s.period + 2e-3);
+    pwmSimFree(&sim);
+
+    // PWM clock drifting against the system clock, sparse frames rely on the phase refresh
+    c = base;
+    c.frameRate = 0.5;
+    c.seconds = 60;
+    c.drift = 500e-6;
+    runTest("drift +", &c, &sim, &s, &r);
+    checkSynchronized("drift +", &c, &sim, &s, &r);
+    check("drift +: no late pairs", s.late == 0);
+    pwmSimFree(&sim);
+    c.drift = -500e-6;
+    runTest("drift -", &c, &sim, &s, &r);
+    checkSynchronized("drift -", &c, &sim, &s, &r);
+    check("drift -: no late pairs", s.late == 0);
+    pwmSimFree(&sim);
+
+    c = base;
+    c.werrAt = 3.0;
+    c.berrAt = 6.0;
+    runTest("errors", &c, &sim, &s, &r);
+    checkSynchronized("errors", &c, &sim, &s, &r);
+    check("errors: counted and cleared", s.errors == 2 && (sim.sta & (PWM_SYNC_STA_WERR1 | PWM_SYNC_STA_BERR)) == 0);
+    check("errors: frames after errors output", r.lastApplied && r.applied > 300);
+
+    // back to data registers keeping the last values, a pending value goes out too
+    pwmSyncSet(&s, 1, 4321, sim.now);
+    pwmSyncStop(&s);
+    sim.now += 2 * s.period;
+    pwmSimAdvance(&sim, sim.now);
+    check("stop: data register mode", (sim.ctl & fifoMode) == (PWM_SYNC_CTL_CHANNEL(0x81, 0) | PWM_SYNC_CTL_CHANNEL(0x81, 1)));
+    check("stop: last values kept", sim.output[0] == BASE0 + (uint32_t) r.frames && sim.output[1] == 4321);
+    pwmSimFree(&sim);
+
+    // per channel data register writes, a text line per channel
+    c = base;
+    c.legacy = 1;
+    c.lineGap = 100e-6;
+    runTest("legacy", &c, &sim, &s, &legacy);
+    check("legacy: torn periods detected", legacy.torn > legacy.periods / 2);
+    check("legacy: split periods detected", legacy.split > 0);
+    pwmSimFree(&sim);
+
+    if (failures) {
+	printf("%d failures\n", failures);
+	return(1);
+    }
+    printf("All tests passed\n");
+    return(0);
+}
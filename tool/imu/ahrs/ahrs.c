@@ -0,0 +1,463 @@
+/*
+  Madgwick and Mahony AHRS filters in float and fixed point, see ahrs.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "ahrs.h"
+
+// Fusion's FusionDegreesToRadians(0.5f)
+#define AHRS_HALF_DEGREE		(0.5f * ((float) M_PI / 180.0f))
+#define AHRS_RADIANS_TO_DEGREES		(180.0f / (float) M_PI)
+
+// batches are prepared in groups of this many samples, a multiple of the vector width
+#define AHRS_BATCH_LANES		8
+
+// fixed point
+#define AHRS_Q30_ONE			(1LL << 30)
+#define AHRS_Q16_ONE			65536.0
+// arithmetic shift right with rounding
+#define AHRS_RSHIFT(x, s)		(((x) + (1LL << ((s) - 1))) >> (s))
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Float
+
+// Fusion's FusionFastInverseSqrt()
+static inline float ahrsFastInverseSqrt(float x) {
+    float	y;
+    int32_t	i;
+
+    memcpy(&i, &x, sizeof(i));
+    i = 0x5F1F1412 - (i >> 1);
+    memcpy(&y, &i, sizeof(y));
+    return(y * (1.69000231f - 0.714158168f * x * y * y));
+}
+
+// Half gyroscope rate in radians per second and accelerometer direction of one sample,
+// outputs are stored with the given stride so that batches are prepared in columns.
+static inline void ahrsPrepare(float gx, float gy, float gz, float ax, float ay, float az, float *halfGyro, float *direction, int *zero, int stride) {
+    float	inv;
+
+    inv = ahrsFastInverseSqrt(ax * ax + ay * ay + az * az);
+    direction[0] = ax * inv;
+    direction[stride] = ay * inv;
+    direction[2*stride] = az * inv;
+    *zero = (ax == 0.0f) & (ay == 0.0f) & (az == 0.0f);
+    halfGyro[0] = gx * AHRS_HALF_DEGREE;
+    halfGyro[stride] = gy * AHRS_HALF_DEGREE;
+    halfGyro[2*stride] = gz * AHRS_HALF_DEGREE;
+}
+
+// FusionAhrsSetHeading(ahrs, 0)
+static void ahrsZeroHeading(float *q) {
+    float	w, x, y, z, yaw, h, rw, rx, ry, rz;
+
+    w = q[0]; x = q[1]; y = q[2]; z = q[3];
+    yaw = atan2f(w * z + x * y, 0.5f - y * y - z * z);
+    h = 0.5f * yaw;
+    rw = cosf(h);
+    rx = 0.0f;
+    ry = 0.0f;
+    rz = -1.0f * sinf(h);
+    q[0] = rw * w - rx * x - ry * y - rz * z;
+    q[1] = rw * x + rx * w + ry * z - rz * y;
+    q[2] = rw * y - rx * z + ry * w + rz * x;
+    q[3] = rw * z + rx * y - ry * x + rz * w;
+}
+
+static inline void ahrsStep(struct ahrs *a, float hx, float hy, float hz, float dx, float dy, float dz, int zero, float dt) {
+    float	w, x, y, z, gx, gy, gz, fx, fy, fz, rx, ry, rz, vx, vy, vz, nw, nx, ny, nz, inv;
+
+    if (a->initialising) {
+	a->rampedGain -= a->rampedGainStep * dt;
+	if (a->rampedGain < a->gain) {
+	    a->rampedGain = a->gain;
+	    a->initialising = 0;
+	}
+    }
+
+    w = a->q[0]; x = a->q[1]; y = a->q[2]; z = a->q[3];
+    // direction of gravity indicated by the filter, scaled by 0.5
+    gx = x * z - w * y;
+    gy = y * z + w * x;
+    gz = w * w - 0.5f + z * z;
+
+    // accelerometer feedback scaled by 0.5
+    fx = fy = fz = 0.0f;
+    if (! zero) {
+	fx = dy * gz - dz * gy;
+	fy = dz * gx - dx * gz;
+	fz = dx * gy - dy * gx;
+    }
+
+    rx = hx + fx * a->rampedGain;
+    ry = hy + fy * a->rampedGain;
+    rz = hz + fz * a->rampedGain;
+    if (a->algorithm == AHRS_MAHONY && ! a->initialising) {
+	a->integral[0] += a->integralGain * fx * dt;
+	a->integral[1] += a->integralGain * fy * dt;
+	a->integral[2] += a->integralGain * fz * dt;
+	rx += a->integral[0];
+	ry += a->integral[1];
+	rz += a->integral[2];
+    }
+
+    // integrate the rate of change of the quaternion
+    vx = rx * dt;
+    vy = ry * dt;
+    vz = rz * dt;
+    nw = w + (-x * vx - y * vy - z * vz);
+    nx = x + (w * vx + y * vz - z * vy);
+    ny = y + (w * vy - x * vz + z * vx);
+    nz = z + (w * vz + x * vy - y * vx);
+
+    inv = ahrsFastInverseSqrt(nw * nw + nx * nx + ny * ny + nz * nz);
+    a->q[0] = nw * inv;
+    a->q[1] = nx * inv;
+    a->q[2] = ny * inv;
+    a->q[3] = nz * inv;
+
+    // no magnetometer, heading is zero during initialisation
+    if (a->initialising) ahrsZeroHeading(a->q);
+}
+
+// Outputs as computed from Fusion's euler angles, linear and earth accelerations by the tools.
+static void ahrsOutputFromQuaternion(const float *q, const float *acc, struct ahrsOutput *out) {
+    float	w, x, y, z, s, halfMinusYy, roll, pitch, yaw;
+    float	ww, wx, wy, wz, xy, xz, yz;
+
+    w = q[0]; x = q[1]; y = q[2]; z = q[3];
+
+    halfMinusYy = 0.5f - y * y;
+    roll = atan2f(w * x + y * z, halfMinusYy - x * x) * AHRS_RADIANS_TO_DEGREES;
+    s = 2.0f * (w * y - z * x);
+    if (s <= -1.0f) pitch = (float) M_PI / -2.0f;
+    else if (s >= 1.0f) pitch = (float) M_PI / 2.0f;
+    else pitch = asinf(s);
+    pitch = pitch * AHRS_RADIANS_TO_DEGREES;
+    yaw = atan2f(w * z + x * y, halfMinusYy - z * z) * AHRS_RADIANS_TO_DEGREES;
+    out->rpy[0] = roll*M_PI/180.0;
+    out->rpy[1] = pitch*M_PI/180.0;
+    out->rpy[2] = yaw*M_PI/180.0;
+
+    out->lacc[0] = acc[0] - 2.0f * (x * z - w * y);
+    out->lacc[1] = acc[1] - 2.0f * (y * z + w * x);
+    out->lacc[2] = acc[2] - 2.0f * (w * w - 0.5f + z * z);
+
+    ww = w * w; wx = w * x; wy = w * y; wz = w * z;
+    xy = x * y; xz = x * z; yz = y * z;
+    out->eacc[0] = 2.0f * ((ww - 0.5f + x * x) * acc[0] + (xy - wz) * acc[1] + (xz + wy) * acc[2]);
+    out->eacc[1] = 2.0f * ((xy + wz) * acc[0] + (ww - 0.5f + y * y) * acc[1] + (yz - wx) * acc[2]);
+    out->eacc[2] = (2.0f * ((xz - wy) * acc[0] + (yz + wx) * acc[1] + (ww - 0.5f + z * z) * acc[2])) - 1.0f;
+}
+
+void ahrsInit(struct ahrs *a, int algorithm) {
+    memset(a, 0, sizeof(*a));
+    a->algorithm = algorithm;
+    a->gain = AHRS_GAIN;
+    a->integralGain = algorithm == AHRS_MAHONY ? AHRS_INTEGRAL_GAIN : 0.0f;
+    a->q[0] = 1.0f;
+    a->initialising = 1;
+    a->rampedGain = AHRS_INITIAL_GAIN;
+    a->rampedGainStep = (AHRS_INITIAL_GAIN - a->gain) / AHRS_INITIALISATION_PERIOD;
+}
+
+void ahrsUpdate(struct ahrs *a, const float gyroscope[3], const float accelerometer[3], float deltaTime) {
+    float	h[3], d[3];
+    int		zero;
+
+    ahrsPrepare(gyroscope[0], gyroscope[1], gyroscope[2], accelerometer[0], accelerometer[1], accelerometer[2], h, d, &zero, 1);
+    memcpy(a->accelerometer, accelerometer, sizeof(a->accelerometer));
+    ahrsStep(a, h[0], h[1], h[2], d[0], d[1], d[2], zero, deltaTime);
+}
+
+void ahrsUpdateBatch(struct ahrs *a, const struct ahrsSample *samples, int n, struct ahrsOutput *out) {
+    float	g[3][AHRS_BATCH_BLOCK], acc[3][AHRS_BATCH_BLOCK];
+    float	h[3][AHRS_BATCH_BLOCK], d[3][AHRS_BATCH_BLOCK];
+    int		zero[AHRS_BATCH_BLOCK];
+    int		i, j, k, l, m, mm;
+
+    for(j=0; j<n; j+=m) {
+	m = n - j;
+	if (m > AHRS_BATCH_BLOCK) m = AHRS_BATCH_BLOCK;
+	// Transpose the block into columns padded to whole groups of lanes, so
+	// that the inner preparation loop has a constant count and no aliasing
+	// and gets vectorized even by the cheapest cost model of -O2.
+	mm = (m + AHRS_BATCH_LANES - 1) & ~(AHRS_BATCH_LANES - 1);
+	for(i=0; i<m; i++) {
+	    for(k=0; k<3; k++) {
+		g[k][i] = samples[j+i].gyroscope[k];
+		acc[k][i] = samples[j+i].accelerometer[k];
+	    }
+	}
+	for(; i<mm; i++) {
+	    for(k=0; k<3; k++) g[k][i] = acc[k][i] = 0.0f;
+	}
+	for(i=0; i<mm; i+=AHRS_BATCH_LANES) {
+	    for(l=i; l<i+AHRS_BATCH_LANES; l++) {
+		ahrsPrepare(g[0][l], g[1][l], g[2][l], acc[0][l], acc[1][l], acc[2][l], &h[0][l], &d[0][l], &zero[l], AHRS_BATCH_BLOCK);
+	    }
+	}
+	for(i=0; i<m; i++) {
+	    ahrsStep(a, h[0][i], h[1][i], h[2][i], d[0][i], d[1][i], d[2][i], zero[i], samples[j+i].deltaTime);
+	    if (out != NULL) {
+		ahrsOutputFromQuaternion(a->q, samples[j+i].accelerometer, &out[j+i]);
+		out[j+i].timestamp = samples[j+i].timestamp;
+	    }
+	}
+    }
+    if (n > 0) memcpy(a->accelerometer, samples[n-1].accelerometer, sizeof(a->accelerometer));
+}
+
+void ahrsGetOutput(struct ahrs *a, struct ahrsOutput *out) {
+    ahrsOutputFromQuaternion(a->q, a->accelerometer, out);
+    out->timestamp = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// Fixed point
+
+// 1 / sqrt(x / 2^32) in Q30 at the middle of each 1/32 interval of [0.25, 1)
+static const int32_t ahrsRsqrtTable[24] = {
+    2083365155, 1970666148, 1874477404, 1791125178, 1717986918, 1653133683, 1595110809, 1542797797,
+    1495315679, 1451963954, 1412176548, 1375490368, 1341522400, 1309952745, 1280511845, 1252970736,
+    1227133513, 1202831433, 1179918260, 1158266544, 1137764631, 1118314230, 1099828424, 1082230034,
+};
+
+// Inverse square root of x (> 0) without division: x is normalized by an even
+// shift to [2^30, 2^32), a table gives 5 bits and three Newton iterations the
+// rest. Returns 2^32 / sqrt(x << 2k) in Q30 and k.
+static inline int64_t ahrsRsqrt32(uint32_t x, int *k) {
+    int64_t	y, xq;
+    int		i;
+
+    *k = 0;
+    while (x < (1U << 30)) {
+	x <<= 2;
+	(*k) ++;
+    }
+    xq = x >> 2;
+    y = ahrsRsqrtTable[(x >> 27) - 8];
+    for(i=0; i<3; i++) y = (y * (3 * AHRS_Q30_ONE - ((xq * ((y * y) >> 30)) >> 30))) >> 31;
+    return(y);
+}
+
+static uint64_t ahrsIsqrt64(uint64_t x) {
+    uint64_t	res, bit;
+
+    res = 0;
+    bit = 1ULL << 62;
+    while (bit > x) bit >>= 2;
+    while (bit != 0) {
+	if (x >= res + bit) {
+	    x -= res + bit;
+	    res = (res >> 1) + bit;
+	} else {
+	    res >>= 1;
+	}
+	bit >>= 2;
+    }
+    return(res);
+}
+
+// Half gyroscope rate (Q36) and squared accelerometer norm of one sample,
+// the part of the preparation which vectorizes.
+static inline void ahrsFixedScale(int64_t gyroScale, int32_t gx, int32_t gy, int32_t gz, int32_t ax, int32_t ay, int32_t az, int64_t *halfGyro, uint32_t *sq, int stride) {
+    halfGyro[0] = gx * gyroScale;
+    halfGyro[stride] = gy * gyroScale;
+    halfGyro[2*stride] = gz * gyroScale;
+    *sq = (uint32_t) (ax * ax) + (uint32_t) (ay * ay) + (uint32_t) (az * az);
+}
+
+// Accelerometer direction in Q29.
+static inline void ahrsFixedDirection(int32_t ax, int32_t ay, int32_t az, uint32_t sq, int32_t *direction, int *zero, int stride) {
+    int64_t	y;
+    int		k;
+
+    *zero = (sq == 0);
+    if (sq == 0) {
+	direction[0] = direction[stride] = direction[2*stride] = 0;
+	return;
+    }
+    // sqrt(sq) = sqrt(sq << 2k) / 2^k, so a / sqrt(sq) in Q29 is a * y >> (17 - k)
+    y = ahrsRsqrt32(sq, &k);
+    direction[0] = (ax * y) >> (17 - k);
+    direction[stride] = (ay * y) >> (17 - k);
+    direction[2*stride] = (az * y) >> (17 - k);
+}
+
+static void ahrsFixedZeroHeading(int32_t *q) {
+    int64_t	w, x, y, z, s, c, r, cy, ch, sh;
+
+    w = q[0]; x = q[1]; y = q[2]; z = q[3];
+    // yaw = atan2(s, c), rotate by -yaw around z using half angle formulas
+    s = AHRS_RSHIFT(w * z + x * y, 30);
+    c = (AHRS_Q30_ONE >> 1) - AHRS_RSHIFT(y * y + z * z, 30);
+    r = ahrsIsqrt64(s * s + c * c);
+    if (r == 0) return;
+    cy = (c << 30) / r;
+    ch = ahrsIsqrt64((uint64_t) (AHRS_Q30_ONE + cy) << 29);
+    sh = ahrsIsqrt64((uint64_t) (AHRS_Q30_ONE - cy) << 29);
+    if (s < 0) sh = -sh;
+    q[0] = AHRS_RSHIFT(ch * w + sh * z, 30);
+    q[1] = AHRS_RSHIFT(ch * x + sh * y, 30);
+    q[2] = AHRS_RSHIFT(ch * y - sh * x, 30);
+    q[3] = AHRS_RSHIFT(ch * z - sh * w, 30);
+}
+
+static inline void ahrsFixedStep(struct ahrsFixed *a, int64_t hx, int64_t hy, int64_t hz, int64_t dx, int64_t dy, int64_t dz, int zero, uint32_t dt) {
+    int64_t	w, x, y, z, gx, gy, gz, fx, fy, fz, rx, ry, rz, vx, vy, vz, nw, nx, ny, nz, n, f;
+
+    if (a->initialising) {
+	a->rampedGain -= (int32_t) (((int64_t) a->rampedGainStep * dt) >> 32);
+	if (a->rampedGain < a->gain) {
+	    a->rampedGain = a->gain;
+	    a->initialising = 0;
+	}
+    }
+
+    w = a->q[0]; x = a->q[1]; y = a->q[2]; z = a->q[3];
+    // half gravity, Q29
+    gx = AHRS_RSHIFT(x * z - w * y, 31);
+    gy = AHRS_RSHIFT(y * z + w * x, 31);
+    gz = AHRS_RSHIFT(w * w + z * z, 31) - (1LL << 28);
+
+    // half feedback, Q29
+    fx = fy = fz = 0;
+    if (! zero) {
+	fx = AHRS_RSHIFT(dy * gz - dz * gy, 29);
+	fy = AHRS_RSHIFT(dz * gx - dx * gz, 29);
+	fz = AHRS_RSHIFT(dx * gy - dy * gx, 29);
+    }
+
+    // half rate, Q36
+    rx = hx + AHRS_RSHIFT(fx * a->rampedGain, 9);
+    ry = hy + AHRS_RSHIFT(fy * a->rampedGain, 9);
+    rz = hz + AHRS_RSHIFT(fz * a->rampedGain, 9);
+    if (a->algorithm == AHRS_MAHONY && ! a->initialising) {
+	a->integral[0] += AHRS_RSHIFT(AHRS_RSHIFT(fx * a->integralGain, 17) * dt, 24);
+	a->integral[1] += AHRS_RSHIFT(AHRS_RSHIFT(fy * a->integralGain, 17) * dt, 24);
+	a->integral[2] += AHRS_RSHIFT(AHRS_RSHIFT(fz * a->integralGain, 17) * dt, 24);
+	rx += a->integral[0];
+	ry += a->integral[1];
+	rz += a->integral[2];
+    }
+
+    // half angle of this step, Q29
+    vx = AHRS_RSHIFT(AHRS_RSHIFT(rx, 12) * dt, 27);
+    vy = AHRS_RSHIFT(AHRS_RSHIFT(ry, 12) * dt, 27);
+    vz = AHRS_RSHIFT(AHRS_RSHIFT(rz, 12) * dt, 27);
+    nw = w + AHRS_RSHIFT(-x * vx - y * vy - z * vz, 29);
+    nx = x + AHRS_RSHIFT(w * vx + y * vz - z * vy, 29);
+    ny = y + AHRS_RSHIFT(w * vy - x * vz + z * vx, 29);
+    nz = z + AHRS_RSHIFT(w * vz + x * vy - y * vx, 29);
+
+    // the norm stays close to 1, one Newton step of the inverse square root is enough
+    n = AHRS_RSHIFT(nw * nw + nx * nx + ny * ny + nz * nz, 30);
+    f = (3 * AHRS_Q30_ONE - n) >> 1;
+    a->q[0] = AHRS_RSHIFT(nw * f, 30);
+    a->q[1] = AHRS_RSHIFT(nx * f, 30);
+    a->q[2] = AHRS_RSHIFT(ny * f, 30);
+    a->q[3] = AHRS_RSHIFT(nz * f, 30);
+
+    if (a->initialising) ahrsFixedZeroHeading(a->q);
+}
+
+uint32_t ahrsFixedSeconds(double seconds) {
+    double	t;
+
+    t = seconds * 4294967296.0 + 0.5;
+    // written so that NaN fails the test too
+    if (! (t >= 0)) return(0);
+    if (t >= UINT32_MAX) return(UINT32_MAX);
+    return((uint32_t) t);
+}
+
+void ahrsFixedInit(struct ahrsFixed *a, int algorithm, double gyroscopeCountsPerDps, double accelerometerCountsPerG) {
+    memset(a, 0, sizeof(*a));
+    a->algorithm = algorithm;
+    a->gyroScale = llround(0.5 * M_PI / 180.0 / gyroscopeCountsPerDps * 68719476736.0);
+    a->accelerometerScale = 1.0 / accelerometerCountsPerG;
+    a->gain = lround(AHRS_GAIN * AHRS_Q16_ONE);
+    a->integralGain = algorithm == AHRS_MAHONY ? lround(AHRS_INTEGRAL_GAIN * AHRS_Q16_ONE) : 0;
+    a->q[0] = AHRS_Q30_ONE;
+    a->initialising = 1;
+    a->rampedGain = lround(AHRS_INITIAL_GAIN * AHRS_Q16_ONE);
+    a->rampedGainStep = lround((AHRS_INITIAL_GAIN - AHRS_GAIN) / AHRS_INITIALISATION_PERIOD * AHRS_Q16_ONE);
+}
+
+void ahrsFixedUpdate(struct ahrsFixed *a, const int16_t gyroscope[3], const int16_t accelerometer[3], uint32_t deltaTime) {
+    int64_t	h[3];
+    int32_t	d[3];
+    uint32_t	sq;
+    int		zero;
+
+    ahrsFixedScale(a->gyroScale, gyroscope[0], gyroscope[1], gyroscope[2], accelerometer[0], accelerometer[1], accelerometer[2], h, &sq, 1);
+    ahrsFixedDirection(accelerometer[0], accelerometer[1], accelerometer[2], sq, d, &zero, 1);
+    memcpy(a->accelerometer, accelerometer, sizeof(a->accelerometer));
+    ahrsFixedStep(a, h[0], h[1], h[2], d[0], d[1], d[2], zero, deltaTime);
+}
+
+void ahrsFixedGetQuaternion(struct ahrsFixed *a, float q[4]) {
+    int		i;
+
+    for(i=0; i<4; i++) q[i] = a->q[i] * (1.0f / AHRS_Q30_ONE);
+}
+
+static void ahrsFixedOutput(struct ahrsFixed *a, const int16_t *accelerometer, struct ahrsOutput *out) {
+    float	q[4], acc[3];
+
+    ahrsFixedGetQuaternion(a, q);
+    acc[0] = accelerometer[0] * a->accelerometerScale;
+    acc[1] = accelerometer[1] * a->accelerometerScale;
+    acc[2] = accelerometer[2] * a->accelerometerScale;
+    ahrsOutputFromQuaternion(q, acc, out);
+}
+
+void ahrsFixedUpdateBatch(struct ahrsFixed *a, const struct ahrsRawSample *samples, int n, struct ahrsOutput *out) {
+    int32_t	g[3][AHRS_BATCH_BLOCK], acc[3][AHRS_BATCH_BLOCK];
+    int64_t	h[3][AHRS_BATCH_BLOCK];
+    int32_t	d[3][AHRS_BATCH_BLOCK];
+    uint32_t	sq[AHRS_BATCH_BLOCK];
+    int		zero[AHRS_BATCH_BLOCK];
+    int		i, j, k, l, m, mm;
+
+    for(j=0; j<n; j+=m) {
+	m = n - j;
+	if (m > AHRS_BATCH_BLOCK) m = AHRS_BATCH_BLOCK;
+	// same layout as in ahrsUpdateBatch(), the normalisation stays scalar
+	mm = (m + AHRS_BATCH_LANES - 1) & ~(AHRS_BATCH_LANES - 1);
+	for(i=0; i<m; i++) {
+	    for(k=0; k<3; k++) {
+		g[k][i] = samples[j+i].gyroscope[k];
+		acc[k][i] = samples[j+i].accelerometer[k];
+	    }
+	}
+	for(; i<mm; i++) {
+	    for(k=0; k<3; k++) g[k][i] = acc[k][i] = 0;
+	}
+	for(i=0; i<mm; i+=AHRS_BATCH_LANES) {
+	    for(l=i; l<i+AHRS_BATCH_LANES; l++) {
+		ahrsFixedScale(a->gyroScale, g[0][l], g[1][l], g[2][l], acc[0][l], acc[1][l], acc[2][l], &h[0][l], &sq[l], AHRS_BATCH_BLOCK);
+	    }
+	}
+	for(i=0; i<m; i++) {
+	    ahrsFixedDirection(acc[0][i], acc[1][i], acc[2][i], sq[i], &d[0][i], &zero[i], AHRS_BATCH_BLOCK);
+	}
+	for(i=0; i<m; i++) {
+	    ahrsFixedStep(a, h[0][i], h[1][i], h[2][i], d[0][i], d[1][i], d[2][i], zero[i], samples[j+i].deltaTime);
+	    if (out != NULL) {
+		ahrsFixedOutput(a, samples[j+i].accelerometer, &out[j+i]);
+		out[j+i].timestamp = samples[j+i].timestamp;
+	    }
+	}
+    }
+    if (n > 0) memcpy(a->accelerometer, samples[n-1].accelerometer, sizeof(a->accelerometer));
+}
+
+void ahrsFixedGetOutput(struct ahrsFixed *a, struct ahrsOutput *out) {
+    ahrsFixedOutput(a, a->accelerometer, out);
+    out->timestamp = 0;
+}
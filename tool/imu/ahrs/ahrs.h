@@ -0,0 +1,140 @@
+/*
+  Attitude and heading reference system (AHRS) shared by IMU tools.
+
+  Two filters fuse gyroscope and accelerometer samples (no magnetometer)
+  into an attitude quaternion:
+
+  AHRS_MADGWICK	Madgwick's revised AHRS, the algorithm of the Fusion library.
+  		The gyroscope is corrected by gain times the cross product of
+  		measured and estimated gravity. The gain starts high and ramps
+  		down during the initialisation period, the heading is held at
+  		zero meanwhile. In float, it is the same computation as
+  		FusionAhrsUpdateNoMagnetometer() with default settings, done
+  		in the same order, so rpy, lacc and eacc are the same as the
+  		tools got from Fusion.
+  AHRS_MAHONY	Mahony's complementary filter, the same proportional
+  		correction plus an integral term which learns the gyroscope
+  		bias. Same initialisation.
+
+  Each filter runs in single precision float (struct ahrs) or in fixed
+  point (struct ahrsFixed) for boards without FPU. The fixed point filter
+  takes raw sensor counts, keeps the quaternion in Q2.30 and uses only
+  integer multiplications and shifts, divisions and square roots are
+  needed only while the heading is zeroed during initialisation. Euler
+  angles are computed in float when outputs are requested.
+
+  Batch updates take all samples read from a sensor FIFO in one call.
+  The per sample preprocessing (accelerometer normalisation, gyroscope
+  scaling) runs over the whole batch in loops written so that the
+  compiler vectorizes them, then the sequential filter recursion runs
+  over the prepared data. Batch and single sample updates give bit
+  identical results.
+
+  Float results are bit identical to Fusion only if no multiply-add is
+  contracted into FMA instructions, compile with -ffp-contract=off on
+  targets having them (ARMv8, x86 with -mfma).
+
+  The file is compiled by both gcc and g++.
+ */
+
+#ifndef AHRS_H
+#define AHRS_H
+
+#include <stdint.h>
+
+enum ahrsAlgorithms {
+    AHRS_MADGWICK,
+    AHRS_MAHONY,
+};
+
+// defaults of Fusion
+#define AHRS_GAIN			0.5f
+#define AHRS_INITIAL_GAIN		10.0f
+#define AHRS_INITIALISATION_PERIOD	3.0f
+// Mahony's integral gain
+#define AHRS_INTEGRAL_GAIN		0.02f
+
+// samples prepared at once by batch updates
+#define AHRS_BATCH_BLOCK		64
+
+// seconds to Q0.32 used for fixed point time steps, see ahrsFixedSeconds()
+#define AHRS_FIXED_SECONDS(s)		ahrsFixedSeconds(s)
+
+struct ahrsSample {
+    double	timestamp;
+    // seconds since the previous sample
+    float	deltaTime;
+    // degrees per second
+    float	gyroscope[3];
+    // g
+    float	accelerometer[3];
+};
+
+struct ahrsRawSample {
+    double	timestamp;
+    // seconds since the previous sample in Q0.32, see AHRS_FIXED_SECONDS()
+    uint32_t	deltaTime;
+    // sensor counts
+    int16_t	gyroscope[3];
+    int16_t	accelerometer[3];
+};
+
+// What IMU tools publish: roll, pitch, yaw in radians (converted from
+// Fusion's degrees like the tools did), linear and earth acceleration in g.
+struct ahrsOutput {
+    double	timestamp;
+    double	rpy[3];
+    double	lacc[3];
+    double	eacc[3];
+};
+
+struct ahrs {
+    int		algorithm;
+    float	gain;
+    float	integralGain;
+    // w, x, y, z
+    float	q[4];
+    float	accelerometer[3];
+    int		initialising;
+    float	rampedGain;
+    float	rampedGainStep;
+    // Mahony's integral of the correction, half radians per second
+    float	integral[3];
+};
+
+struct ahrsFixed {
+    int		algorithm;
+    // Q2.30
+    int32_t	q[4];
+    int16_t	accelerometer[3];
+    // sensor count to half radians per second in Q36
+    int64_t	gyroScale;
+    // sensor count to g, for outputs
+    float	accelerometerScale;
+    // gains in Q16
+    int32_t	gain;
+    int32_t	integralGain;
+    int		initialising;
+    int32_t	rampedGain;
+    // per second, Q16
+    int32_t	rampedGainStep;
+    // half radians per second in Q36
+    int64_t	integral[3];
+};
+
+void ahrsInit(struct ahrs *a, int algorithm);
+void ahrsUpdate(struct ahrs *a, const float gyroscope[3], const float accelerometer[3], float deltaTime);
+// Update with n samples. If out is not NULL, it receives outputs after each sample.
+void ahrsUpdateBatch(struct ahrs *a, const struct ahrsSample *samples, int n, struct ahrsOutput *out);
+void ahrsGetOutput(struct ahrs *a, struct ahrsOutput *out);
+
+// Seconds to Q0.32. Negative and NaN periods give 0, a stall of a second or more the longest period.
+uint32_t ahrsFixedSeconds(double seconds);
+// Scales are sensor counts per degree per second and per g, e.g. 131 and 16384 for MPU6050 at +-250dps and +-2g.
+void ahrsFixedInit(struct ahrsFixed *a, int algorithm, double gyroscopeCountsPerDps, double accelerometerCountsPerG);
+void ahrsFixedUpdate(struct ahrsFixed *a, const int16_t gyroscope[3], const int16_t accelerometer[3], uint32_t deltaTime);
+void ahrsFixedUpdateBatch(struct ahrsFixed *a, const struct ahrsRawSample *samples, int n, struct ahrsOutput *out);
+void ahrsFixedGetQuaternion(struct ahrsFixed *a, float q[4]);
+void ahrsFixedGetOutput(struct ahrsFixed *a, struct ahrsOutput *out);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+  Non-blocking drivers of barometers MS5611 and BMP180, see baro.h.
+
+  Compensation formulas are from the datasheets, the BMP180 one is taken
+  from the driver by Alexander Rüedlinger formerly used in gy-87/bmp180.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "baro.h"
+
+#define MS5611_CMD_RESET		0x1E
+#define MS5611_CMD_CONVERT_D1		0x40
+#define MS5611_CMD_CONVERT_D2		0x50
+#define MS5611_CMD_ADC_READ		0x00
+#define MS5611_CMD_PROM_READ		0xA0
+
+#define BMP180_REG_CHIP_ID		0xD0
+#define BMP180_CHIP_ID			0x55
+#define BMP180_REG_EEPROM		0xAA
+#define BMP180_REG_CTRL			0xF4
+#define BMP180_REG_DATA			0xF6
+#define BMP180_CMD_TEMPERATURE		0x2E
+#define BMP180_CMD_PRESSURE		0x34
+
+// maximal conversion times from datasheets, indexed by oversampling
+static double ms5611ConversionTime[5] = {0.00060, 0.00117, 0.00228, 0.00454, 0.00904};
+static double bmp180ConversionTime[4] = {0.0045, 0.0075, 0.0135, 0.0255};
+
+// do not read the result exactly at the datasheet limit
+#define BARO_CONVERSION_MARGIN		0.0001
+
+double baroPressureToAltitude(double pressure) {
+    return(44330.0 * (1.0 - pow(pressure / BARO_SEA_LEVEL_PRESSURE, 1/5.255)));
+}
+
+/////////////////////////////////////////////////////////////////////////
+// MS5611
+
+static int ms5611Init(struct baro *b) {
+    uint8_t	buf[2];
+    int		i;
+
+    if (i2cDevCommand(b->dev, MS5611_CMD_RESET) < 0) return(-1);
+    // reload of PROM after reset takes 2.8ms, it is fine to block in init
+    usleep(3000);
+    for(i=0; i<8; i++) {
+	if (i2cDevReadReg(b->dev, MS5611_CMD_PROM_READ + 2*i, 2, buf) < 0) return(-1);
+	b->prom[i] = (buf[0] << 8) | buf[1];
+    }
+    if (b->prom[1] == 0 || b->prom[1] == 0xffff) {
+	printf("%s:%d: MS5611 not responding\n", __FILE__, __LINE__);
+	return(-1);
+    }
+    b->pressureConversionTime = ms5611ConversionTime[b->oversampling] + BARO_CONVERSION_MARGIN;
+    b->temperatureConversionTime = ms5611ConversionTime[b->oversampling] + BARO_CONVERSION_MARGIN;
+    return(0);
+}
+
+static int ms5611Start(struct baro *b, int temperatureFlag) {
+    uint8_t cmd;
+    cmd = (temperatureFlag ? MS5611_CMD_CONVERT_D2 : MS5611_CMD_CONVERT_D1) + 2 * b->oversampling;
+    return(i2cDevCommand(b->dev, cmd));
+}
+
+// Returns the raw ADC value, 0 if the conversion was not finished.
+static int32_t ms5611ReadAdc(struct baro *b) {
+    uint8_t buf[3];
+    if (i2cDevReadReg(b->dev, MS5611_CMD_ADC_READ, 3, buf) < 0) return(-1);
+    return((buf[0] << 16) | (buf[1] << 8) | buf[2]);
+}
+
+static void ms5611Temperature(struct baro *b, int32_t d2) {
+    b->dT = d2 - ((int64_t)b->prom[5] << 8);
+    b->temp = 2000 + ((b->dT * b->prom[6]) >> 23);
+}
+
+// Returns pressure in Pa, temperature in degrees Celsius.
+static double ms5611Pressure(struct baro *b, int32_t d1, double *temperature) {
+    int64_t off, sens, t2, off2, sens2, tt, p;
+
+    off = ((int64_t)b->prom[2] << 16) + ((b->prom[4] * b->dT) >> 7);
+    sens = ((int64_t)b->prom[1] << 15) + ((b->prom[3] * b->dT) >> 8);
+
+    // second order compensation
+    t2 = off2 = sens2 = 0;
+    if (b->temp < 2000) {
+	tt = (b->temp - 2000) * (b->temp - 2000);
+	t2 = (b->dT * b->dT) >> 31;
+	off2 = 5 * tt / 2;
+	sens2 = 5 * tt / 4;
+	if (b->temp < -1500) {
+	    tt = (b->temp + 1500) * (b->temp + 1500);
+	    off2 += 7 * tt;
+	    sens2 += 11 * tt / 2;
+	}
+    }
+    off -= off2;
+    sens -= sens2;
+    p = (((d1 * sens) >> 21) - off) >> 15;
+    *temperature = (b->temp - t2) / 100.0;
+    return(p);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// BMP180
+
+static int bmp180Init(struct baro *b) {
+    uint8_t	buf[22];
+    int		i;
+
+    if (i2cDevReadReg(b->dev, BMP180_REG_CHIP_ID, 1, buf) < 0 || buf[0] != BMP180_CHIP_ID) {
+	printf("%s:%d: BMP180 not responding\n", __FILE__, __LINE__);
+	return(-1);
+    }
+    if (i2cDevReadReg(b->dev, BMP180_REG_EEPROM, 22, buf) < 0) return(-1);
+    for(i=0; i<11; i++) {
+	b->eeprom[i] = (buf[2*i] << 8) | buf[2*i+1];
+	// AC4, AC5, AC6 are unsigned
+	if ((i < 3 || i > 5) && b->eeprom[i] > 32767) b->eeprom[i] -= 65536;
+    }
+    b->pressureConversionTime = bmp180ConversionTime[b->oversampling] + BARO_CONVERSION_MARGIN;
+    b->temperatureConversionTime = bmp180ConversionTime[0] + BARO_CONVERSION_MARGIN;
+    return(0);
+}
+
+static int bmp180Start(struct baro *b, int temperatureFlag) {
+    uint8_t cmd;
+    cmd = temperatureFlag ? BMP180_CMD_TEMPERATURE : BMP180_CMD_PRESSURE + (b->oversampling << 6);
+    return(i2cDevWriteReg(b->dev, BMP180_REG_CTRL, cmd));
+}
+
+static int32_t bmp180ReadAdc(struct baro *b, int temperatureFlag) {
+    uint8_t buf[3];
+
+    if (temperatureFlag) {
+	if (i2cDevReadReg(b->dev, BMP180_REG_DATA, 2, buf) < 0) return(-1);
+	return((buf[0] << 8) | buf[1]);
+    }
+    if (i2cDevReadReg(b->dev, BMP180_REG_DATA, 3, buf) < 0) return(-1);
+    return(((buf[0] << 16) | (buf[1] << 8) | buf[2]) >> (8 - b->oversampling));
+}
+
+static void bmp180Temperature(struct baro *b, int32_t ut) {
+    int32_t *e, x1, x2;
+
+    e = b->eeprom;
+    x1 = ((ut - e[5]) * e[4]) >> 15;
+    x2 = (e[9] * 2048) / (x1 + e[10]);
+    b->b5 = x1 + x2;
+}
+
+static double bmp180Pressure(struct baro *b, int32_t up, double *temperature) {
+    int32_t	*e, b6, x1, x2, x3, b3, p;
+    uint32_t	b4, b7;
+
+    e = b->eeprom;
+    b6 = b->b5 - 4000;
+    x1 = (e[7] * ((b6 * b6) >> 12)) >> 11;
+    x2 = (e[1] * b6) >> 11;
+    x3 = x1 + x2;
+    b3 = ((((e[0] * 4) + x3) << b->oversampling) + 2) / 4;
+    x1 = (e[2] * b6) >> 13;
+    x2 = (e[6] * ((b6 * b6) >> 12)) >> 16;
+    x3 = ((x1 + x2) + 2) >> 2;
+    b4 = ((uint32_t)e[3] * (uint32_t)(x3 + 32768)) >> 15;
+    b7 = ((uint32_t)up - b3) * (50000 >> b->oversampling);
+    if (b7 < 0x80000000) {
+	p = (b7 * 2) / b4;
+    } else {
+	p = (b7 / b4) * 2;
+    }
+    x1 = (p >> 8) * (p >> 8);
+    x1 = (x1 * 3038) >> 16;
+    x2 = (-7357 * p) >> 16;
+    p = p + ((x1 + x2 + 3791) >> 4);
+    *temperature = ((b->b5 + 8) >> 4) / 10.0;
+    return(p);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// state machine
+
+static int baroStart(struct baro *b, int temperatureFlag) {
+    double	now;
+    int		r;
+
+    if (b->chip == BARO_MS5611) {
+	r = ms5611Start(b, temperatureFlag);
+    } else {
+	r = bmp180Start(b, temperatureFlag);
+    }
+    if (r < 0) return(-1);
+    // the conversion starts when the command transfer is finished
+    now = i2cSchedTime();
+    b->conversionStart = now;
+    if (temperatureFlag) {
+	b->state = BARO_CONVERTING_TEMPERATURE;
+	b->task.time = now + b->temperatureConversionTime;
+    } else {
+	b->state = BARO_CONVERTING_PRESSURE;
+	b->task.time = now + b->pressureConversionTime;
+    }
+    return(0);
+}
+
+static int baroFinish(struct baro *b, double now) {
+    struct baroSample	s;
+    int32_t		raw;
+    int			temperatureFlag;
+
+    temperatureFlag = (b->state == BARO_CONVERTING_TEMPERATURE);
+    b->state = BARO_IDLE;
+    if (b->chip == BARO_MS5611) {
+	raw = ms5611ReadAdc(b);
+    } else {
+	raw = bmp180ReadAdc(b, temperatureFlag);
+    }
+    if (raw < 0) return(-1);
+    if (raw == 0) {
+	// MS5611 returns 0 when the conversion was not finished, skip the sample
+	b->errors ++;
+	return(0);
+    }
+
+    if (temperatureFlag) {
+	if (b->chip == BARO_MS5611) {
+	    ms5611Temperature(b, raw);
+	} else {
+	    bmp180Temperature(b, raw);
+	}
+	b->haveTemperature = 1;
+	b->pressuresSinceTemperature = 0;
+	b->temperatures ++;
+	return(0);
+    }
+
+    if (b->chip == BARO_MS5611) {
+	s.pressure = ms5611Pressure(b, raw, &s.temperature);
+    } else {
+	s.pressure = bmp180Pressure(b, raw, &s.temperature);
+    }
+    s.time = b->conversionStart + 0.5 * b->pressureConversionTime;
+    s.conversionEnd = b->conversionStart + b->pressureConversionTime;
+    s.altitude = baroPressureToAltitude(s.pressure);
+    b->pressuresSinceTemperature ++;
+    b->pressures ++;
+    if (b->callback != NULL) b->callback(b, &s);
+    return(0);
+}
+
+static int baroStep(struct i2cSchedTask *t, double now) {
+    struct baro *b;
+
+    b = (struct baro *) t->arg;
+    if (b->state != BARO_IDLE) {
+	if (baroFinish(b, now) < 0) return(-1);
+    }
+
+    // temperature goes in between pressure samples
+    if (! b->haveTemperature || b->pressuresSinceTemperature >= b->temperatureEvery) {
+	return(baroStart(b, 1));
+    }
+    if (now < b->nextPressure) {
+	t->time = b->nextPressure;
+	return(0);
+    }
+    b->nextPressure += b->period;
+    // if we are behind (e.g. temperature took the slot), do not try to catch up
+    if (b->nextPressure < now) b->nextPressure = now;
+    return(baroStart(b, 0));
+}
+
+int baroInit(struct baro *b, int chip, struct i2cDev *dev, double rate, int oversampling, int temperatureEvery) {
+    int r;
+
+    memset(b, 0, sizeof(*b));
+    b->chip = chip;
+    b->dev = dev;
+    b->state = BARO_IDLE;
+    b->period = rate > 0 ? 1.0 / rate : 0;
+    b->temperatureEvery = temperatureEvery < 1 ? 1 : temperatureEvery;
+    b->oversampling = oversampling;
+    if (chip == BARO_MS5611) {
+	if (b->oversampling < 0 || b->oversampling > 4) b->oversampling = 4;
+	r = ms5611Init(b);
+    } else {
+	if (b->oversampling < 0 || b->oversampling > 3) b->oversampling = 3;
+	r = bmp180Init(b);
+    }
+    if (r < 0) return(-1);
+
+    b->task.name = chip == BARO_MS5611 ? "ms5611" : "bmp180";
+    b->task.step = baroStep;
+    b->task.arg = b;
+    b->task.time = b->nextPressure = i2cSchedTime();
+    return(0);
+}
@@ -0,0 +1,91 @@
+/*
+  Non-blocking drivers of barometers MS5611 and BMP180.
+
+  Each barometer is a state machine run by the I2C scheduler (i2csched.h).
+  A step starts a conversion and returns, the scheduler wakes it up when
+  the conversion is finished. Temperature is converted only every
+  temperatureEvery pressure samples, in between pressure samples are
+  compensated with the last temperature. Pressure conversions are started
+  on a fixed period, so samples are evenly spaced.
+ */
+
+#ifndef BARO_H
+#define BARO_H
+
+#include <stdint.h>
+
+#include "i2csched.h"
+
+#define BARO_MS5611_ADDRESS		0x77
+#define BARO_BMP180_ADDRESS		0x77
+
+#define BARO_SEA_LEVEL_PRESSURE		101325.0
+
+enum baroChips {
+    BARO_MS5611,
+    BARO_BMP180,
+};
+
+enum baroStates {
+    BARO_IDLE,
+    BARO_CONVERTING_PRESSURE,
+    BARO_CONVERTING_TEMPERATURE,
+};
+
+struct baroSample {
+    // middle of the pressure conversion, CLOCK_MONOTONIC
+    double	time;
+    // end of the pressure conversion
+    double	conversionEnd;
+    // Pa
+    double	pressure;
+    // degrees Celsius
+    double	temperature;
+    // meters above sea level
+    double	altitude;
+};
+
+struct baro {
+    int			chip;
+    struct i2cDev	*dev;
+    struct i2cSchedTask	task;
+    int			state;
+
+    double		period;
+    int			temperatureEvery;
+    // MS5611: 0 - 4 (OSR 256 - 4096), BMP180: 0 - 3
+    int			oversampling;
+    double		pressureConversionTime;
+    double		temperatureConversionTime;
+
+    double		nextPressure;
+    double		conversionStart;
+    int			pressuresSinceTemperature;
+    int			haveTemperature;
+
+    // MS5611 PROM, C1 - C6 are prom[1] - prom[6]
+    uint16_t		prom[8];
+    // BMP180 EEPROM, AC1 - AC6, B1, B2, MB, MC, MD
+    int32_t		eeprom[11];
+
+    // temperature compensation state, MS5611: dT, TEMP; BMP180: B5
+    int64_t		dT;
+    int64_t		temp;
+    int32_t		b5;
+
+    void		(*callback)(struct baro *b, struct baroSample *s);
+    void		*arg;
+
+    // statistics
+    long long		pressures;
+    long long		temperatures;
+    long long		errors;
+};
+
+int baroInit(struct baro *b, int chip, struct i2cDev *dev, double rate, int oversampling, int temperatureEvery);
+double baroPressureToAltitude(double pressure);
+
+// barotool.c, main of the barometer tools
+int baroToolMain(int argc, char **argv, int defaultChip);
+
+#endif
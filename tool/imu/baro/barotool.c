@@ -0,0 +1,173 @@
+/*
+  Main of the barometer tools (../gy-86/ms5611, ../gy-87/bmp180).
+
+  All barometers of the process are tasks of one I2C scheduler and go
+  through one bus owner (../i2cbus). By default a tool runs its own chip,
+  -b adds another barometer on the same bus, e.g. an MS5611 with CSB
+  high (0x76) next to a BMP180:
+
+  bmp180 -b ms5611 0x76
+
+  Each chip publishes to its own alt and temp channels. With -s the bus
+  is shared with tools locking it with the pi2c semaphores, requests are
+  sent through pi2c then (../i2cbus/i2cbus-pi2c.c).
+
+  usage: <tool> [-s] [-r <rate_Hz>] [-t <pressure_samples_per_temperature>] [-o <oversampling>] [-b <chip> <address>] [-v] [<i2c_path>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pi2c.h"
+#include "i2csched.h"
+#include "i2cbus.h"
+#include "baro.h"
+#include "sensorbus.h"
+
+// seconds between statistics printed with -v
+#define REPORT_PERIOD		10.0
+#define BARO_TOOL_MAX		2
+
+struct baroToolSensor {
+    int				chip;
+    int				address;
+    struct i2cDev		dev;
+    struct baro			baro;
+    struct sensorBusChannel	*busalt;
+    struct sensorBusChannel	*bustemp;
+};
+
+static struct baroToolSensor	baroToolSensors[BARO_TOOL_MAX];
+static int			baroToolSensorCount;
+// sensor bus timestamps are CLOCK_REALTIME, the scheduler uses CLOCK_MONOTONIC
+static double			clockOffset;
+
+static const char *baroToolChipName(int chip) {
+    return(chip == BARO_MS5611 ? "ms5611" : "bmp180");
+}
+
+static int baroToolAdd(int chip, int address) {
+    int i;
+
+    for(i=0; i<baroToolSensorCount; i++) {
+	if (baroToolSensors[i].chip == chip) {
+	    fprintf(stderr, "%s:%d: Only one %s per process, its channels are named by the chip\n", __FILE__, __LINE__, baroToolChipName(chip));
+	    return(-1);
+	}
+    }
+    if (baroToolSensorCount >= BARO_TOOL_MAX) return(-1);
+    baroToolSensors[baroToolSensorCount].chip = chip;
+    baroToolSensors[baroToolSensorCount].address = address;
+    baroToolSensorCount ++;
+    return(0);
+}
+
+static void publish(struct baro *b, struct baroSample *s) {
+    struct baroToolSensor	*bs;
+    double			t;
+
+    bs = (struct baroToolSensor *) b->arg;
+    t = s->time + clockOffset;
+    if (sensorBusPublish(bs->bustemp, t, 1.0, &s->temperature) != 0) exit(0);
+    if (sensorBusPublish(bs->busalt, t, 1.0, &s->altitude) != 0) exit(0);
+    sensorBusFlush();
+}
+
+int baroToolMain(int argc, char **argv, int defaultChip) {
+    int				i, chip, optSharedI2cFlag, optTemperatureEvery, optOversampling, optVerbose;
+    char			*optI2cPath;
+    char			name[SENSOR_BUS_NAME_MAX];
+    double			optRate, nextReport;
+    struct baroToolSensor	*bs;
+    struct i2cSched		sched;
+    struct i2cBus		bus;
+
+    optSharedI2cFlag = 0;
+    optI2cPath = (char*)"/dev/i2c-1";
+    // MS5611 as fast as possible, BMP180 at 100Hz which is as fast as possible too
+    optRate = defaultChip == BARO_MS5611 ? 1000.0 : 100.0;
+    optTemperatureEvery = 10;
+    // the highest of the chip, the driver clamps it for the others
+    optOversampling = defaultChip == BARO_MS5611 ? 4 : 3;
+    optVerbose = 0;
+    baroToolAdd(defaultChip, defaultChip == BARO_MS5611 ? BARO_MS5611_ADDRESS : BARO_BMP180_ADDRESS);
+
+    for(i=1; i<argc; i++) {
+	if (strcmp(argv[i], "-s") == 0) {
+	    // share i2c. Do not reset shared semaphores
+	    optSharedI2cFlag = 1;
+	} else if (strcmp(argv[i], "-r") == 0) {
+	    // refresh rate in Hz
+	    i++;
+	    if (i<argc) optRate = strtod(argv[i], NULL);
+	} else if (strcmp(argv[i], "-t") == 0) {
+	    // read temperature every n pressure samples
+	    i++;
+	    if (i<argc) optTemperatureEvery = atoi(argv[i]);
+	} else if (strcmp(argv[i], "-o") == 0) {
+	    // oversampling, MS5611 0 - 4 (OSR 256 - 4096), BMP180 0 - 3 (1 - 8 internal samples)
+	    i++;
+	    if (i<argc) optOversampling = atoi(argv[i]);
+	} else if (strcmp(argv[i], "-b") == 0 && i+2 < argc) {
+	    // another barometer on the same bus
+	    chip = strcmp(argv[i+1], "ms5611") == 0 ? BARO_MS5611 : strcmp(argv[i+1], "bmp180") == 0 ? BARO_BMP180 : -1;
+	    if (chip < 0 || baroToolAdd(chip, strtol(argv[i+2], NULL, 0)) != 0) {
+		fprintf(stderr, "%s:%d: Can't add barometer %s\n", __FILE__, __LINE__, argv[i+1]);
+		return(-1);
+	    }
+	    i += 2;
+	} else if (strcmp(argv[i], "-v") == 0) {
+	    optVerbose = 1;
+	} else {
+	    optI2cPath = argv[i];
+	}
+    }
+
+    if (optSharedI2cFlag) {
+	pi2cInit(optI2cPath, 1);
+	if (i2cBusOpenPi2c(&bus, optI2cPath) != 0) return(-1);
+    } else {
+	if (i2cBusOpen(&bus, optI2cPath) != 0) return(-1);
+    }
+    if (i2cSchedInit(&sched) != 0) return(-1);
+    sensorBusTextAutoFlush = 0;
+
+    for(i=0; i<baroToolSensorCount; i++) {
+	bs = &baroToolSensors[i];
+	i2cDevOpenBus(&bs->dev, &bus, bs->address);
+	if (baroInit(&bs->baro, bs->chip, &bs->dev, optRate, optOversampling, optTemperatureEvery) != 0) {
+	    fprintf(stderr, "%s:%d: Can't connect %s at 0x%02x\n", __FILE__, __LINE__, baroToolChipName(bs->chip), bs->address);
+	    return(-1);
+	}
+	bs->baro.callback = publish;
+	bs->baro.arg = bs;
+
+	snprintf(name, sizeof(name), "raspilot.baro-%s.alt", baroToolChipName(bs->chip));
+	bs->busalt = sensorBusOpen(name, SENSOR_BUS_ALTITUDE);
+	snprintf(name, sizeof(name), "raspilot.baro-%s.temp", baroToolChipName(bs->chip));
+	bs->bustemp = sensorBusOpen(name, SENSOR_BUS_TEMPERATURE);
+	if (bs->busalt == NULL || bs->bustemp == NULL) return(-1);
+	if (bs->chip == BARO_MS5611) {
+	    // the ms5611 tool always printed %g
+	    sensorBusSetTextFormat(bs->busalt, NULL, "%g");
+	    sensorBusSetTextFormat(bs->bustemp, NULL, "%g");
+	}
+
+	i2cSchedAdd(&sched, &bs->baro.task);
+    }
+    clockOffset = sensorBusCurrentTime() - i2cSchedTime();
+    nextReport = i2cSchedTime() + REPORT_PERIOD;
+
+    for(;;) {
+	if (i2cSchedRunOnce(&sched) != 0) {
+	    fprintf(stderr, "%s:%d: I2C error\n", __FILE__, __LINE__);
+	    return(-1);
+	}
+	if (optVerbose && i2cSchedTime() > nextReport) {
+	    i2cSchedReport(&sched, stderr);
+	    i2cBusReport(&bus, stderr);
+	    nextReport += REPORT_PERIOD;
+	}
+    }
+}
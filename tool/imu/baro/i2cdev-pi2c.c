@@ -0,0 +1,47 @@
+/*
+  struct i2cDev backend using the real bus through pi2c. Bus sharing with
+  other processes (pi2cInit) is handled by pi2c.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pi2c.h"
+#include "i2csched.h"
+
+static int i2cPi2cCommand(void *ctx, uint8_t cmd) {
+    int *fd = (int *) ctx;
+    if (pi2cWrite(*fd, &cmd, 1) <= 0) return(-1);
+    return(0);
+}
+
+static int i2cPi2cWriteReg(void *ctx, uint8_t reg, uint8_t value) {
+    int *fd = (int *) ctx;
+    if (pi2cWriteByteToReg(*fd, reg, value) < 0) return(-1);
+    return(0);
+}
+
+static int i2cPi2cReadReg(void *ctx, uint8_t reg, int len, uint8_t *buf) {
+    int *fd = (int *) ctx;
+    if (pi2cReadBytes(*fd, reg, len, buf) < 0) return(-1);
+    return(0);
+}
+
+static const struct i2cDevOps i2cPi2cOps = {
+    i2cPi2cCommand,
+    i2cPi2cWriteReg,
+    i2cPi2cReadReg,
+};
+
+int i2cDevOpenPi2c(struct i2cDev *d, char *path, int address) {
+    d->ops = &i2cPi2cOps;
+    d->address = address;
+    d->fd = pi2cOpen(path, address);
+    d->ctx = &d->fd;
+    d->bus = NULL;
+    if (d->fd < 0) {
+	printf("%s:%d: Can't open i2c device %s address 0x%02x\n", __FILE__, __LINE__, path, address);
+	return(-1);
+    }
+    return(0);
+}
@@ -0,0 +1,120 @@
+/*
+  Single thread scheduler of I2C device state machines, see i2csched.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "i2csched.h"
+
+double i2cSchedTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+double i2cSchedCpuTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+int i2cSchedInit(struct i2cSched *s) {
+    memset(s, 0, sizeof(*s));
+    s->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (s->timerFd < 0) {
+	printf("%s:%d: timerfd_create failed: %s\n", __FILE__, __LINE__, strerror(errno));
+	return(-1);
+    }
+    s->startTime = i2cSchedTime();
+    s->startCpu = i2cSchedCpuTime();
+    return(0);
+}
+
+int i2cSchedAdd(struct i2cSched *s, struct i2cSchedTask *t) {
+    if (s->taskCount >= I2C_SCHED_MAX_TASKS) {
+	printf("%s:%d: Too many tasks\n", __FILE__, __LINE__);
+	return(-1);
+    }
+    s->task[s->taskCount++] = t;
+    return(0);
+}
+
+int i2cSchedRunOnce(struct i2cSched *s) {
+    struct itimerspec	its;
+    struct i2cSchedTask	*t;
+    uint64_t		expirations;
+    double		earliest, now, t0, lateness;
+    int			i, r;
+
+    if (s->taskCount == 0) return(-1);
+    earliest = s->task[0]->time;
+    for(i=1; i<s->taskCount; i++) {
+	if (s->task[i]->time < earliest) earliest = s->task[i]->time;
+    }
+
+    if (earliest > i2cSchedTime()) {
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = (time_t) earliest;
+	its.it_value.tv_nsec = (earliest - its.it_value.tv_sec) * 1000000000.0;
+	if (its.it_value.tv_nsec >= 1000000000) its.it_value.tv_nsec = 999999999;
+	timerfd_settime(s->timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+	if (read(s->timerFd, &expirations, sizeof(expirations)) < 0 && errno != EINTR) {
+	    printf("%s:%d: timerfd read failed: %s\n", __FILE__, __LINE__, strerror(errno));
+	    return(-1);
+	}
+    }
+    s->wakeups ++;
+
+    now = i2cSchedTime();
+    for(i=0; i<s->taskCount; i++) {
+	t = s->task[i];
+	if (t->time > now) continue;
+	lateness = now - t->time;
+	t->latenessSum += lateness;
+	if (lateness > t->latenessMax) t->latenessMax = lateness;
+	t0 = i2cSchedTime();
+	r = t->step(t, now);
+	t->busy += i2cSchedTime() - t0;
+	t->steps ++;
+	if (r < 0) return(-1);
+    }
+    return(0);
+}
+
+void i2cSchedReport(struct i2cSched *s, FILE *ff) {
+    struct i2cSchedTask	*t;
+    double		now, cpu, elapsed;
+    int			i;
+
+    now = i2cSchedTime();
+    cpu = i2cSchedCpuTime();
+    elapsed = now - s->startTime;
+    if (elapsed <= 0) return;
+
+    fprintf(ff, "info: i2c scheduler: %.1f wakeups/s, cpu %.2f%%\n", s->wakeups / elapsed, 100.0 * (cpu - s->startCpu) / elapsed);
+    for(i=0; i<s->taskCount; i++) {
+	t = s->task[i];
+	fprintf(ff, "info:     %s: %.1f steps/s, lateness avg %.0f us max %.0f us, bus busy %.2f%%\n",
+		t->name, t->steps / elapsed, t->steps ? t->latenessSum / t->steps * 1e6 : 0.0,
+		t->latenessMax * 1e6, 100.0 * t->busy / elapsed
+	    );
+	t->steps = 0;
+	t->latenessSum = t->latenessMax = t->busy = 0;
+    }
+    fflush(ff);
+    s->wakeups = 0;
+    s->startTime = now;
+    s->startCpu = cpu;
+}
+
+void i2cSchedClose(struct i2cSched *s) {
+    if (s->timerFd >= 0) close(s->timerFd);
+    s->timerFd = -1;
+    s->taskCount = 0;
+}
@@ -0,0 +1,93 @@
+/*
+  Single thread scheduler of I2C device state machines.
+
+  Instead of a thread (or process) per sensor sleeping through conversion
+  times, each device is a task with a deadline. The scheduler sleeps on a
+  timerfd until the earliest deadline and runs the step function of every
+  due task. A step issues a few short I2C transfers (start a conversion,
+  read a result) and sets the task's next deadline. Any number of sensors
+  on the same board can share the thread.
+
+  Devices are accessed through struct i2cDev, so that drivers can run on
+  the real bus (i2cdev-pi2c.c, ../i2cbus/i2cdev-bus.c) or on a mock
+  backend in tests.
+
+  Times are CLOCK_MONOTONIC seconds.
+ */
+
+#ifndef I2CSCHED_H
+#define I2CSCHED_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define I2C_SCHED_MAX_TASKS		16
+
+struct i2cDevOps {
+    // send a single command byte (e.g. MS5611 conversion start)
+    int (*command)(void *ctx, uint8_t cmd);
+    int (*writeReg)(void *ctx, uint8_t reg, uint8_t value);
+    int (*readReg)(void *ctx, uint8_t reg, int len, uint8_t *buf);
+};
+
+struct i2cBus;
+
+struct i2cDev {
+    const struct i2cDevOps	*ops;
+    void			*ctx;
+    int				fd;
+    int				address;
+    // bus owner, if the device is accessed through ../i2cbus
+    struct i2cBus		*bus;
+};
+
+struct i2cSchedTask {
+    const char	*name;
+    // next deadline
+    double	time;
+    // Do the work due at now and set time. Returns -1 on error.
+    int		(*step)(struct i2cSchedTask *t, double now);
+    void	*arg;
+
+    // statistics since the last report
+    long long	steps;
+    double	latenessSum;
+    double	latenessMax;
+    // time spent inside step, i.e. mostly in I2C transfers
+    double	busy;
+};
+
+struct i2cSched {
+    struct i2cSchedTask	*task[I2C_SCHED_MAX_TASKS];
+    int			taskCount;
+    int			timerFd;
+    long long		wakeups;
+    double		startTime;
+    double		startCpu;
+};
+
+// All return -1 on error.
+static inline int i2cDevCommand(struct i2cDev *d, uint8_t cmd) {
+    return(d->ops->command(d->ctx, cmd));
+}
+static inline int i2cDevWriteReg(struct i2cDev *d, uint8_t reg, uint8_t value) {
+    return(d->ops->writeReg(d->ctx, reg, value));
+}
+static inline int i2cDevReadReg(struct i2cDev *d, uint8_t reg, int len, uint8_t *buf) {
+    return(d->ops->readReg(d->ctx, reg, len, buf));
+}
+
+// i2cdev-pi2c.c
+int i2cDevOpenPi2c(struct i2cDev *d, char *path, int address);
+
+double i2cSchedTime();
+double i2cSchedCpuTime();
+int i2cSchedInit(struct i2cSched *s);
+int i2cSchedAdd(struct i2cSched *s, struct i2cSchedTask *t);
+// Sleep until the earliest deadline and run all due tasks. Returns -1 if a task failed.
+int i2cSchedRunOnce(struct i2cSched *s);
+// Print statistics gathered since the last report and start a new window.
+void i2cSchedReport(struct i2cSched *s, FILE *ff);
+void i2cSchedClose(struct i2cSched *s);
+
+#endif
@@ -26,12 +26,10 @@
 #include <math.h>
 #include <sys/time.h>
 
-#include "Fusion.h"
 #include "DFRobot_BMI160.h"
-
-#ifdef SHM
-#include "raspilotshm.h"
-#endif
+#include "imufifo.h"
+#include "sensorbus.h"
+#include "ahrs/ahrs.h"
 
 #define FACTOR_GYRO_RFS2000 16.4
 #define FACTOR_GYRO_RFS1000 32.8
@@ -47,11 +45,50 @@
 #define FACTOR_GYRO FACTOR_GYRO_RFS1000
 #define FACTOR_ACC  FACTOR_ACC_S2g
 
+// Registers used by the FIFO mode
+#define BMI_FIFO_REG_FIFO_LENGTH_0	0x22
+#define BMI_FIFO_REG_FIFO_DATA		0x24
+#define BMI_FIFO_REG_ACC_CONF		0x40
+#define BMI_FIFO_REG_ACC_RANGE		0x41
+#define BMI_FIFO_REG_GYR_CONF		0x42
+#define BMI_FIFO_REG_GYR_RANGE		0x43
+#define BMI_FIFO_REG_FIFO_CONFIG_1	0x47
+#define BMI_FIFO_REG_CMD		0x7E
+
+// normal filter mode, odr is or-ed
+#define BMI_FIFO_ACC_CONF_NORMAL	0x20
+#define BMI_FIFO_GYR_CONF_NORMAL	0x20
+// ranges matching FACTOR_ACC and FACTOR_GYRO
+#define BMI_FIFO_ACC_RANGE_2G		0x03
+#define BMI_FIFO_GYR_RANGE_1000		0x01
+// gyro and accel in headerless mode
+#define BMI_FIFO_CONFIG_ACC_GYR		0xC0
+#define BMI_FIFO_CMD_FLUSH		0xB0
+// odr codes, odr = 100Hz * 2^(code-8), accelerometer maximum is 1600Hz
+#define BMI_FIFO_ODR_MIN		6
+#define BMI_FIFO_ODR_MAX		12
+
+#define BMI_FIFO_SIZE			1024
+// gyro x,y,z, accel x,y,z, little endian
+#define BMI_FIFO_FRAME			12
+// pi2cReadBytes takes 8 bit length, read whole frames only
+#define BMI_FIFO_MAX_READ		(255 / BMI_FIFO_FRAME * BMI_FIFO_FRAME)
+// seconds between statistics printed in FIFO mode
+#define BMI_FIFO_REPORT_PERIOD		10.0
+
 
 DFRobot_BMI160 bmi160;
 struct bmi160Dev dev;
 const int8_t i2c_addr = 0x69;
 
+struct sensorBusChannel 	*busrpy;
+struct sensorBusChannel 	*busrpy2;
+
+// filter state, float or fixed point depending on -fixed
+static struct ahrs		ahrs;
+static struct ahrsFixed		ahrsFixed;
+static int			optFixedFlag;
+
 static inline double doubleGetTime() {
     struct timeval  tv;
     gettimeofday(&tv, NULL);
@@ -69,26 +106,133 @@ static void taskStop(int signum) {
     exit(0);
 }
 
+static void publishAttitude(struct ahrsOutput *out, double t) {
+    double	rpy[3];    
+
+    // Print rpy in drone coordinates. This depends on how precisely the sensor is mounted on drone.
+    // TODO: Maybe print in sensor's coordinates and make translation inside raspilot.
+    // pitch - negative == nose down;      positive == nose up
+    // roll  - negative == left wing down; positive == left wing up
+    // yaw   - positive == rotated counterclockwise (view from up)
+    rpy[0] = -out->rpy[1];
+    rpy[1] = -out->rpy[0];
+    rpy[2] = out->rpy[2];
+    if (sensorBusPublish(busrpy, t, 1.0, rpy) != 0) exit(0);
+    if (busrpy2 != NULL) if (sensorBusPublish(busrpy2, t, 1.0, rpy) != 0) exit(0);
+}
+
+// Configure accel and gyro to the same output data rate and enable
+// the FIFO in headerless mode. Returns the real output data rate.
+static double bmiFifoInit(int fd, double rate) {
+    int		odr;
+
+    for(odr=BMI_FIFO_ODR_MIN; odr<BMI_FIFO_ODR_MAX && 100.0 * pow(2, odr-8) < rate; odr++) ;
+
+    pi2cWriteByteToReg(fd, BMI_FIFO_REG_ACC_CONF, BMI_FIFO_ACC_CONF_NORMAL | odr);
+    pi2cWriteByteToReg(fd, BMI_FIFO_REG_ACC_RANGE, BMI_FIFO_ACC_RANGE_2G);
+    pi2cWriteByteToReg(fd, BMI_FIFO_REG_GYR_CONF, BMI_FIFO_GYR_CONF_NORMAL | odr);
+    pi2cWriteByteToReg(fd, BMI_FIFO_REG_GYR_RANGE, BMI_FIFO_GYR_RANGE_1000);
+    pi2cWriteByteToReg(fd, BMI_FIFO_REG_FIFO_CONFIG_1, BMI_FIFO_CONFIG_ACC_GYR);
+    pi2cWriteByteToReg(fd, BMI_FIFO_REG_CMD, BMI_FIFO_CMD_FLUSH);
+
+    return(100.0 * pow(2, odr-8));
+}
+
+// Read all frames accumulated in the FIFO at each wakeup, never returns.
+static void bmiFifoLoop(int fd, double odr, double wakeupRate) {
+    struct imuFifoClock		sampleClock;
+    struct imuFifoStats		stats;
+    struct timespec		deadline;
+    struct ahrsSample		samples[BMI_FIFO_SIZE / BMI_FIFO_FRAME];
+    struct ahrsRawSample	raw[BMI_FIFO_SIZE / BMI_FIFO_FRAME];
+    struct ahrsOutput		out[BMI_FIFO_SIZE / BMI_FIFO_FRAME];
+    uint8_t			buf[BMI_FIFO_SIZE];
+    uint8_t			cc[2];
+    uint8_t			*p;
+    int				i, j, n, count, len;
+    long			periodNs;
+    double			lateness, tread, t, lastReport;
+
+    imuFifoClockInit(&sampleClock, odr);
+    imuFifoStatsInit(&stats);
+    lastReport = imuFifoMonotonicTime();
+    periodNs = 1000000000.0 / wakeupRate;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    for(;;) {
+	lateness = imuFifoSleep(&deadline, periodNs);
+
+	tread = doubleGetTime();
+	pi2cReadBytes(fd, BMI_FIFO_REG_FIFO_LENGTH_0, 2, cc);
+	count = ((cc[1] & 0x07) << 8) | cc[0];
+	if (count > BMI_FIFO_SIZE - BMI_FIFO_FRAME) {
+	    // full, oldest frames were dropped and we do not know how many
+	    pi2cWriteByteToReg(fd, BMI_FIFO_REG_CMD, BMI_FIFO_CMD_FLUSH);
+	    imuFifoClockReset(&sampleClock);
+	    stats.overflows ++;
+	    continue;
+	}
+	count -= count % BMI_FIFO_FRAME;
+	for(i=0; i<count; i+=len) {
+	    len = count - i;
+	    if (len > BMI_FIFO_MAX_READ) len = BMI_FIFO_MAX_READ;
+	    pi2cReadBytes(fd, BMI_FIFO_REG_FIFO_DATA, len, buf+i);
+	}
+
+	n = count / BMI_FIFO_FRAME;
+	t = imuFifoClockBatch(&sampleClock, n, tread);
+	// the whole burst goes to the filter at once
+	for(i=0; i<n; i++) {
+	    p = buf + i * BMI_FIFO_FRAME;
+	    for(j=0; j<3; j++) {
+		raw[i].gyroscope[j] = (int16_t)(p[2*j] | (p[2*j+1] << 8));
+		raw[i].accelerometer[j] = (int16_t)(p[6+2*j] | (p[6+2*j+1] << 8));
+		samples[i].gyroscope[j] = raw[i].gyroscope[j] / FACTOR_GYRO;
+		samples[i].accelerometer[j] = raw[i].accelerometer[j] / FACTOR_ACC;
+	    }
+	    raw[i].timestamp = samples[i].timestamp = t + i * sampleClock.period;
+	    raw[i].deltaTime = AHRS_FIXED_SECONDS(sampleClock.period);
+	    samples[i].deltaTime = sampleClock.period;
+	}
+	if (optFixedFlag) {
+	    ahrsFixedUpdateBatch(&ahrsFixed, raw, n, out);
+	} else {
+	    ahrsUpdateBatch(&ahrs, samples, n, out);
+	}
+	for(i=0; i<n; i++) publishAttitude(&out[i], out[i].timestamp);
+
+	imuFifoStatsBurst(&stats, n, lateness);
+	if (imuFifoMonotonicTime() - lastReport > BMI_FIFO_REPORT_PERIOD) {
+	    imuFifoStatsReport(&stats, &sampleClock, stderr, "bmi160 fifo");
+	    lastReport = imuFifoMonotonicTime();
+	}
+    }
+}
+
 int main(int argc, char **argv) {
     double 	t0, t1, samplePeriod;
-    FusionAhrs 	ahrs;
+    struct ahrsOutput	out;
     int		i, usleepTime;
     int16_t 	AcX,AcY,AcZ,GyX,GyY,GyZ,MgX,MgY,MgZ;
     int 	rslt;
     int16_t 	accelGyro[6]={0}; 
     int 	ii;
-    double	rpy[3];    
+    int		fifoFd;
+    double	odr;
     int		optSharedI2cFlag;
     char	*optI2cPath;
     double	optRate;
-#ifdef SHM
-    struct raspilotInputBuffer 	*shmbuf;
-    struct raspilotInputBuffer 	*shmbuf2;
-#endif
+    int		optFifoFlag;
+    double	optWakeupRate;
+    int		optAlgorithm;
 
     optSharedI2cFlag = 0;
     optI2cPath = (char*)"/dev/i2c-1";
     optRate = 1000.0; 			// default rate 1kHz
+    optFifoFlag = 0;
+    optWakeupRate = 0;			// default - odr / 4
+    optAlgorithm = AHRS_MADGWICK;
+    optFixedFlag = 0;
     
     for(i=1; i<argc; i++) {
 	if (strcmp(argv[i], "-s") == 0) {
@@ -98,6 +242,19 @@ int main(int argc, char **argv) {
 	    // refresh rate in Hz, reasonable values are up to 3000Hz.
 	    i++;
 	    if (i<argc) optRate = strtod(argv[i], NULL);
+	} else if (strcmp(argv[i], "-fifo") == 0) {
+	    // sample into the hardware FIFO at rate -r (rounded up to 100Hz * 2^n), read it in bursts
+	    optFifoFlag = 1;
+	} else if (strcmp(argv[i], "-w") == 0) {
+	    // FIFO mode wakeup rate in Hz
+	    i++;
+	    if (i<argc) optWakeupRate = strtod(argv[i], NULL);
+	} else if (strcmp(argv[i], "-mahony") == 0) {
+	    // Mahony filter, learns gyroscope bias
+	    optAlgorithm = AHRS_MAHONY;
+	} else if (strcmp(argv[i], "-fixed") == 0) {
+	    // fixed point filter on raw sensor counts
+	    optFixedFlag = 1;
 	} else {
 	    optI2cPath = argv[i];
 	}
@@ -117,15 +274,27 @@ int main(int argc, char **argv) {
     bmi160.setGyroConf(&dev);
     
 
-#ifdef SHM
-    shmbuf = raspilotShmConnect((char *)"raspilot.gyro-bmi-magwick-shm.rpy");
-    shmbuf2 = raspilotShmConnect((char *)"raspilot.gyro-bmi-magwick-shm.rpy2");
-    if (shmbuf == NULL) exit(-1);
-#endif
+    busrpy = sensorBusOpen("raspilot.gyro-bmi-magwick-shm.rpy", SENSOR_BUS_RPY);
+    if (busrpy == NULL) exit(-1);
+    // the second copy is for a second shared memory consumer, it would only duplicate text lines
+    if (sensorBusMode != SENSOR_BUS_TEXT) busrpy2 = sensorBusOpen("raspilot.gyro-bmi-magwick-shm.rpy2", SENSOR_BUS_RPY);
     
     signal(SIGINT, taskStop);
   
-    FusionAhrsInitialise(&ahrs);
+    ahrsInit(&ahrs, optAlgorithm);
+    ahrsFixedInit(&ahrsFixed, optAlgorithm, FACTOR_GYRO, FACTOR_ACC);
+
+    if (optFifoFlag) {
+	fifoFd = pi2cOpen(optI2cPath, i2c_addr);
+	if (fifoFd < 0) {
+	    fprintf(stderr, "%s:%d: pi2c bmi160 connection failed\n", __FILE__, __LINE__);
+	    exit(-1);
+	}
+	odr = bmiFifoInit(fifoFd, optRate);
+	if (optWakeupRate <= 0) optWakeupRate = odr / 4;
+	printf("debug FIFO mode: output data rate %g Hz, wakeup rate %g Hz\n", odr, optWakeupRate); fflush(stdout);
+	bmiFifoLoop(fifoFd, odr, optWakeupRate);
+    }
     
     usleepTime = 1000000 / optRate;
     usleep(usleepTime);
@@ -133,9 +302,8 @@ int main(int argc, char **argv) {
     t0 = doubleGetTime();
     i = ii = 0;
     for(;;) {
-        FusionVector gyroscope = {0.0f, 0.0f, 0.0f};     // replace this with actual gyroscope data in degrees/s
-        FusionVector accelerometer = {0.0f, 0.0f, 1.0f}; // replace this with actual accelerometer data in g
-	double temp;
+	float	gyroscope[3];		// degrees/s
+	float	accelerometer[3];	// g
 
 	// get both accel and gyro data from bmi160
 	// parameter accelGyro is the pointer to store the data
@@ -143,34 +311,20 @@ int main(int argc, char **argv) {
 	if(rslt != 0) {
 	    printf("debug Error getting data\n");
 	} else {
-	    gyroscope.axis.x = accelGyro[0] / FACTOR_GYRO;
-	    gyroscope.axis.y = accelGyro[1] / FACTOR_GYRO;
-	    gyroscope.axis.z = accelGyro[2] / FACTOR_GYRO;
-	    accelerometer.axis.x = accelGyro[3] / FACTOR_ACC;
-	    accelerometer.axis.y = accelGyro[4] / FACTOR_ACC;
-	    accelerometer.axis.z = accelGyro[5] / FACTOR_ACC;
-
 	    t1 = doubleGetTime();
 	    samplePeriod = t1 - t0;
-	    FusionAhrsUpdateNoMagnetometer(&ahrs, gyroscope, accelerometer, samplePeriod);
-	    const FusionEuler euler = FusionQuaternionToEuler(FusionAhrsGetQuaternion(&ahrs));
-
-	    // Print rpy in drone coordinates. This depends on how precisely the sensor is mounted on drone.
-	    // TODO: Maybe print in sensor's coordinates and make translation inside raspilot.
-	    // pitch - negative == nose down;      positive == nose up
-	    // roll  - negative == left wing down; positive == left wing up
-	    // yaw   - positive == rotated counterclockwise (view from up)
-	    rpy[0] = -euler.angle.pitch*M_PI/180.0;
-	    rpy[1] = -euler.angle.roll*M_PI/180.0;
-	    rpy[2] = euler.angle.yaw*M_PI/180.0;
-#ifdef SHM
-	    shmbuf->confidence = 1.0;
-	    if (raspilotShmPush(shmbuf, t1, rpy, 3) != 0) exit(0);
-	    if (shmbuf2 != NULL) if (raspilotShmPush(shmbuf2, t1, rpy, 3) != 0) exit(0);
-#else
-	    printf("rpy %9.7f %9.7f %9.7f\n", rpy[0], rpy[1], rpy[2]);
-	    fflush(stdout);
-#endif		
+	    if (optFixedFlag) {
+		ahrsFixedUpdate(&ahrsFixed, &accelGyro[0], &accelGyro[3], AHRS_FIXED_SECONDS(samplePeriod));
+		ahrsFixedGetOutput(&ahrsFixed, &out);
+	    } else {
+		for(ii=0; ii<3; ii++) {
+		    gyroscope[ii] = accelGyro[ii] / FACTOR_GYRO;
+		    accelerometer[ii] = accelGyro[3+ii] / FACTOR_ACC;
+		}
+		ahrsUpdate(&ahrs, gyroscope, accelerometer, samplePeriod);
+		ahrsGetOutput(&ahrs, &out);
+	    }
+	    publishAttitude(&out, t1);
 	    // The original stuff printed by fusion
 	    // printf("T:%6.4f: Roll %7.2f, Pitch %7.2f, Yaw %7.2f\n", samplePeriod, euler.angle.roll, euler.angle.pitch, euler.angle.yaw); fflush(stdout);
 	}
@@ -1,84 +1,48 @@
 // libraries
+#include <time.h>
 #include "bmm150.h"
 #include "bmm150_defs.h"
+#include "magcal.h"
+
+// highest data rate of the low power preset
+#define ODR		30
+// fit the ellipsoid about once per second
+#define FIT_PERIOD	30
 
 BMM150 bmm = BMM150();
-bmm150_mag_data value_offset;
+struct magcal cal;
 
 /**
-    @brief Do figure-8 calibration for a limited time to get offset values of x/y/z axis.
+    @brief Do figure-8 calibration until the ellipsoid fit converges or timeout expires.
     @param timeout - seconds of calibration period.
+    @return 0 if converged
 */
-void calibrate(int n) {
-  int i;
-    int16_t value_x_min = 0;
-    int16_t value_x_max = 0;
-    int16_t value_y_min = 0;
-    int16_t value_y_max = 0;
-    int16_t value_z_min = 0;
-    int16_t value_z_max = 0;
-    uint32_t timeStart = 0;
-
-    bmm.read_mag_data();
-    value_x_min = bmm.raw_mag_data.raw_datax;
-    value_x_max = bmm.raw_mag_data.raw_datax;
-    value_y_min = bmm.raw_mag_data.raw_datay;
-    value_y_max = bmm.raw_mag_data.raw_datay;
-    value_z_min = bmm.raw_mag_data.raw_dataz;
-    value_z_max = bmm.raw_mag_data.raw_dataz;
-    usleep(1000*100);
-
-    for(i=0; i<n; i++) {
-        bmm.read_mag_data();
-
-        /* Update x-Axis max/min value */
-        if (value_x_min > bmm.raw_mag_data.raw_datax) {
-            value_x_min = bmm.raw_mag_data.raw_datax;
-            // printf("Update value_x_min: ");
-            // printfln(value_x_min);
-
-        } else if (value_x_max < bmm.raw_mag_data.raw_datax) {
-            value_x_max = bmm.raw_mag_data.raw_datax;
-            // printf("update value_x_max: ");
-            // printfln(value_x_max);
-        }
-
-        /* Update y-Axis max/min value */
-        if (value_y_min > bmm.raw_mag_data.raw_datay) {
-            value_y_min = bmm.raw_mag_data.raw_datay;
-            // printf("Update value_y_min: ");
-            // printfln(value_y_min);
-
-        } else if (value_y_max < bmm.raw_mag_data.raw_datay) {
-            value_y_max = bmm.raw_mag_data.raw_datay;
-            // printf("update value_y_max: ");
-            // printfln(value_y_max);
+int calibrate(int timeout) {
+    struct timespec next;
+    long long i, n;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    n = (long long) timeout * ODR;
+    for(i=1; i<=n; i++) {
+        next.tv_nsec += 1000000000 / ODR;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec ++;
         }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
 
-        /* Update z-Axis max/min value */
-        if (value_z_min > bmm.raw_mag_data.raw_dataz) {
-            value_z_min = bmm.raw_mag_data.raw_dataz;
-            // printf("Update value_z_min: ");
-            // printfln(value_z_min);
-
-        } else if (value_z_max < bmm.raw_mag_data.raw_dataz) {
-            value_z_max = bmm.raw_mag_data.raw_dataz;
-            // printf("update value_z_max: ");
-            // printfln(value_z_max);
+        bmm.read_mag_data();
+        magcalAdd(&cal, bmm.raw_mag_data.raw_datax, bmm.raw_mag_data.raw_datay, bmm.raw_mag_data.raw_dataz);
+        if (i % FIT_PERIOD == 0) {
+            magcalFit(&cal);
+            magcalReport(&cal, stdout);
+            if (cal.quality.converged) return(0);
         }
-
-        printf(".");fflush(stdout);
-        usleep(1000*100);
-
     }
-
-    value_offset.x = value_x_min + (value_x_max - value_x_min) / 2;
-    value_offset.y = value_y_min + (value_y_max - value_y_min) / 2;
-    value_offset.z = value_z_min + (value_z_max - value_z_min) / 2;
-
+    return(-1);
 }
 
-void setup() {
+void setup(int timeout) {
 
     if (bmm.initialize((char*)"/dev/i2c-1") == BMM150_E_ID_NOT_CONFORM) {
         printf("Chip ID can not read!\n");
@@ -86,32 +50,35 @@ void setup() {
     } else {
         printf("Initialize done!\n");
     }
+    bmm.settings.data_rate = BMM150_DATA_RATE_30HZ;
+    bmm.set_odr(bmm.settings);
+    magcalInit(&cal);
 
     printf("Start figure-8 calibration after 3 seconds.\n");
     usleep(1000*3000);
-    calibrate(300);
+    if (calibrate(timeout) != 0) {
+        printf("Calibration not converged, more rotations in all directions are needed.\n");
+        if (! cal.valid) exit(-1);
+    }
     printf("\nCalibrate done..\n");
 
-    printf("Copy paste the following ito compass.cpp\n");
+    printf("Copy paste the following into compass.cpp\n");
     printf("\n");
-    printf("value_offset.x = %d;\n", value_offset.x);
-    printf("value_offset.y = %d;\n", value_offset.y);
-    printf("value_offset.z = %d;\n", value_offset.z);
+    magcalCorrectionPrint(&cal.correction, stdout);
     printf("\n");
     
 }
 
 void loop() {
-    bmm150_mag_data value;
-    bmm.read_mag_data();
+    float value[3];
 
-    value.x = bmm.raw_mag_data.raw_datax - value_offset.x;
-    value.y = bmm.raw_mag_data.raw_datay - value_offset.y;
-    value.z = bmm.raw_mag_data.raw_dataz - value_offset.z;
+    bmm.read_mag_data();
+    value[0] = bmm.raw_mag_data.raw_datax;
+    value[1] = bmm.raw_mag_data.raw_datay;
+    value[2] = bmm.raw_mag_data.raw_dataz;
+    magcalApply(&cal.correction, value, value, 1);
 
-    float xyHeading = atan2(value.x, value.y);
-    float zxHeading = atan2(value.z, value.x);
-    float heading = xyHeading;
+    float heading = atan2(value[0], value[1]);
 
     if (heading < 0) {
         heading += 2 * PI;
@@ -120,8 +87,6 @@ void loop() {
         heading -= 2 * PI;
     }
     float headingDegrees = heading * 180 / M_PI;
-    float xyHeadingDegrees = xyHeading * 180 / M_PI;
-    float zxHeadingDegrees = zxHeading * 180 / M_PI;
 
     printf("Heading: %f\n", headingDegrees);
 
@@ -129,8 +94,12 @@ void loop() {
 }
 
 
-int main() {
-  setup();
+int main(int argc, char **argv) {
+  int timeout;
+
+  timeout = 120;
+  if (argc > 1) timeout = atoi(argv[1]);
+  setup(timeout);
   
   usleep(100000);
 
@@ -138,4 +107,3 @@ int main() {
     loop();
   }
 }
-
@@ -4,9 +4,12 @@
 
 #include "bmm150.h"
 #include "bmm150_defs.h"
+#include "sensorbus.h"
+#include "magcal.h"
 
 BMM150 bmm = BMM150();
-bmm150_mag_data value_offset;
+struct magcalCorrection correction;
+struct sensorBusChannel *busheading;
 
 void setup() {
     if (bmm.initialize((char*)"/dev/i2c-1") == BMM150_E_ID_NOT_CONFORM) {
@@ -17,23 +20,33 @@ void setup() {
     }
 
     // Get those values by calling calibration
-    value_offset.x = -31;
-    value_offset.y = 6;
-    value_offset.z = -37;
+    double magOffset[3] = {-31, 6, -37};
+    double magMatrix[3][3] = {
+	{1, 0, 0},
+	{0, 1, 0},
+	{0, 0, 1},
+    };
+    magcalCorrectionSet(&correction, magOffset, magMatrix);
+
+    busheading = sensorBusOpen("raspilot.compass-bmm150.heading", SENSOR_BUS_HEADING);
+    if (busheading == NULL) exit(-1);
+    // the line raspilot reads from this tool
+    sensorBusSetTextFormat(busheading, "heading:", "%f");
 
 }
 
 void loop() {
-    bmm150_mag_data value;
+    float value[3];
     
     bmm.read_mag_data();
 
-    value.x = bmm.raw_mag_data.raw_datax - value_offset.x;
-    value.y = bmm.raw_mag_data.raw_datay - value_offset.y;
-    value.z = bmm.raw_mag_data.raw_dataz - value_offset.z;
+    value[0] = bmm.raw_mag_data.raw_datax;
+    value[1] = bmm.raw_mag_data.raw_datay;
+    value[2] = bmm.raw_mag_data.raw_dataz;
+    magcalApply(&correction, value, value, 1);
 
-    float xyHeading = atan2(value.x, value.y);
-    float zxHeading = atan2(value.z, value.x);
+    float xyHeading = atan2(value[0], value[1]);
+    float zxHeading = atan2(value[2], value[0]);
     float heading = xyHeading;
 
     if (heading < 0) {
@@ -48,8 +61,8 @@ void loop() {
     //float zxHeadingDegrees = zxHeading * 180 / M_PI;
     //printf("Heading: %f; xyHeading: %f; zxHeading: %f\n", headingDegrees, xyHeadingDegrees, zxHeadingDegrees);
 
-    printf("heading: %f\n", heading);
-    fflush(stdout);
+    double h = heading;
+    if (sensorBusPublish(busheading, sensorBusCurrentTime(), 1.0, &h) != 0) exit(0);
 }
 
 
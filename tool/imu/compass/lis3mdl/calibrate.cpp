@@ -1,11 +1,21 @@
+/*
+  Magnetometer calibration. Rotate the sensor in all directions (figure 8)
+  until the calibration is converged. The sensor is sampled at its full
+  rate (155Hz fast ODR), samples are fed to the ellipsoid fit in magcal.c.
+  The resulting hard- and soft-iron correction is printed as code for
+  compass.cpp.
+
+  usage: calibrate [<timeout_seconds>]
+*/
+
 #include "LIS3MDL.h"
+#include "magcal.h"
 
-#define delay(x) usleep(1000*(x))
-#define min(x,y) ((x)<(y)?(x):(y))
-#define max(x,y) ((x)>(y)?(x):(y))
+// fit the ellipsoid about twice per second
+#define FIT_PERIOD	80
 
 LIS3MDL mag;
-LIS3MDL::vector<int16_t> running_min = {32767, 32767, 32767}, running_max = {-32768, -32768, -32768};
+struct magcal cal;
 
 void setup()
 {
@@ -18,35 +28,51 @@ void setup()
   }
 
   mag.enableDefault();
+  // OM = 11 (ultra-high-performance mode for X and Y); FAST_ODR = 1 (155 Hz)
+  mag.writeReg(LIS3MDL::CTRL_REG1, 0x72);
+  magcalInit(&cal);
 }
 
-void loop()
+int calibrate(int timeout)
 {
-  mag.read();
-
-  running_min.x = min(running_min.x, mag.m.x);
-  running_min.y = min(running_min.y, mag.m.y);
-  running_min.z = min(running_min.z, mag.m.z);
-
-  running_max.x = max(running_max.x, mag.m.x);
-  running_max.y = max(running_max.y, mag.m.y);
-  running_max.z = max(running_max.z, mag.m.z);
+  long long i, n;
 
-  printf("min: {%+6d, %+6d, %+6d}   max: {%+6d, %+6d, %+6d}\n",
-	 running_min.x, running_min.y, running_min.z,
-	 running_max.x, running_max.y, running_max.z
-	 );
-  delay(100);
+  n = timeout * 155LL;
+  for(i=0; i<n; ) {
+    // wait for a new sample (ZYXDA)
+    if ((mag.readReg(LIS3MDL::STATUS_REG) & 0x08) == 0) {
+      usleep(1000);
+      continue;
+    }
+    mag.read();
+    magcalAdd(&cal, mag.m.x, mag.m.y, mag.m.z);
+    i ++;
+    if (i % FIT_PERIOD == 0) {
+      magcalFit(&cal);
+      magcalReport(&cal, stdout);
+      if (cal.quality.converged) return(0);
+    }
+  }
+  return(-1);
 }
 
+int main(int argc, char **argv) {
+  int timeout;
 
-
-int main() {
+  timeout = 120;
+  if (argc > 1) timeout = atoi(argv[1]);
 
   setup();
+  printf("Rotate the sensor in all directions (figure 8).\n");
   usleep(100000);
-  for(;;) {
-    loop();
+  if (calibrate(timeout) != 0) {
+    printf("Calibration not converged, more rotations in all directions are needed.\n");
+    if (! cal.valid) exit(-1);
   }
-}
 
+  printf("Copy paste the following into compass.cpp\n");
+  printf("\n");
+  magcalCorrectionPrint(&cal.correction, stdout);
+  printf("\n");
+  return(0);
+}
@@ -13,10 +13,14 @@ reading of 1292 corresponds to 1292 / 6842 = 0.1888 gauss.
 */
 
 #include "LIS3MDL.h"
+#include "sensorbus.h"
+#include "magcal.h"
 
 #define delay(x) usleep(1000*(x))
 
 LIS3MDL mag;
+struct magcalCorrection correction;
+struct sensorBusChannel *busmag;
 
 void setup()
 {
@@ -29,14 +33,37 @@ void setup()
   }
 
   mag.enableDefault();
+
+  // Get those values by calling calibrate, hard- and soft-iron correction
+  double magOffset[3] = {0, 0, 0};
+  double magMatrix[3][3] = {
+	{1, 0, 0},
+	{0, 1, 0},
+	{0, 0, 1},
+  };
+  magcalCorrectionSet(&correction, magOffset, magMatrix);
+
+  busmag = sensorBusOpen("raspilot.compass-lis3mdl.mag", SENSOR_BUS_MAGNETIC_FIELD);
+  if (busmag == NULL) exit(-1);
+  // the line raspilot reads from this tool
+  sensorBusSetTextFormat(busmag, "M:", "%6.0f");
 }
 
 void loop()
 {
+  float v[3];
+  double m[3];
+
   mag.read();
 
-  printf("M: %6d %6d %6d\n", mag.m.x, mag.m.y, mag.m.z);
-  fflush(stdout);
+  v[0] = mag.m.x;
+  v[1] = mag.m.y;
+  v[2] = mag.m.z;
+  magcalApply(&correction, v, v, 1);
+  m[0] = v[0];
+  m[1] = v[1];
+  m[2] = v[2];
+  if (sensorBusPublish(busmag, sensorBusCurrentTime(), 1.0, m) != 0) exit(0);
   delay(100);
 }
 
@@ -0,0 +1,386 @@
+/*
+  Magnetometer calibration engine, see magcal.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "magcal.h"
+
+#define MAGCAL_RING_MASK		(MAGCAL_RING_SIZE - 1)
+// rebuild running sums from the ring after this many samples to bound rounding drift
+#define MAGCAL_REBUILD_PERIOD		(16 * MAGCAL_RING_SIZE)
+// stored samples are at least this far (relative to the field strength) from
+// the last MAGCAL_SPACING_HISTORY stored ones, so that a resting sensor does
+// not flush the ring with noise
+#define MAGCAL_SPACING			0.03
+#define MAGCAL_SPACING_HISTORY		16
+// move the working frame when the fitted center or radius is this far from it
+#define MAGCAL_RECENTER			0.1
+#define MAGCAL_MIN_SAMPLES		(4 * MAGCAL_PARAMS)
+
+static void magcalRow(struct magcal *m, float *s, double d[MAGCAL_PARAMS]) {
+    double u, v, w;
+
+    u = (s[0] - m->origin[0]) / m->scale;
+    v = (s[1] - m->origin[1]) / m->scale;
+    w = (s[2] - m->origin[2]) / m->scale;
+    d[0] = u * u;
+    d[1] = v * v;
+    d[2] = w * w;
+    d[3] = 2 * u * v;
+    d[4] = 2 * u * w;
+    d[5] = 2 * v * w;
+    d[6] = 2 * u;
+    d[7] = 2 * v;
+    d[8] = 2 * w;
+}
+
+static void magcalAccumulate(struct magcal *m, float *s, double sign) {
+    double	d[MAGCAL_PARAMS];
+    int		i, j;
+
+    magcalRow(m, s, d);
+    for(i=0; i<MAGCAL_PARAMS; i++) {
+	for(j=i; j<MAGCAL_PARAMS; j++) m->ata[i][j] += sign * d[i] * d[j];
+	m->atb[i] += sign * d[i];
+    }
+    m->sumsSamples += sign;
+}
+
+static int magcalRingLength(struct magcal *m) {
+    if (m->count < MAGCAL_RING_SIZE) return(m->count);
+    return(MAGCAL_RING_SIZE);
+}
+
+static void magcalRebuild(struct magcal *m) {
+    int i, n;
+
+    memset(m->ata, 0, sizeof(m->ata));
+    memset(m->atb, 0, sizeof(m->atb));
+    m->sumsSamples = 0;
+    n = magcalRingLength(m);
+    for(i=0; i<n; i++) magcalAccumulate(m, m->ring[i], 1.0);
+    m->lastRebuild = m->count;
+}
+
+void magcalInit(struct magcal *m) {
+    memset(m, 0, sizeof(*m));
+    magcalCorrectionIdentity(&m->correction);
+}
+
+int magcalAdd(struct magcal *m, double x, double y, double z) {
+    float	*s;
+    double	dx, dy, dz;
+    long long	i;
+
+    m->offered ++;
+    if (m->scale == 0) {
+	// until the first fit, work around zero with the scale of the first sample
+	m->scale = sqrt(x*x + y*y + z*z);
+	if (m->scale == 0) m->scale = 1;
+    }
+    if (m->minSpacing > 0) {
+	for(i=m->count-1; i>=0 && i>=m->count-MAGCAL_SPACING_HISTORY; i--) {
+	    s = m->ring[i & MAGCAL_RING_MASK];
+	    dx = x - s[0];
+	    dy = y - s[1];
+	    dz = z - s[2];
+	    if (dx*dx + dy*dy + dz*dz < m->minSpacing * m->minSpacing) return(0);
+	}
+    }
+
+    s = m->ring[m->count & MAGCAL_RING_MASK];
+    if (m->count >= MAGCAL_RING_SIZE) magcalAccumulate(m, s, -1.0);
+    s[0] = x;
+    s[1] = y;
+    s[2] = z;
+    magcalAccumulate(m, s, 1.0);
+    m->count ++;
+    if (m->count - m->lastRebuild >= MAGCAL_REBUILD_PERIOD) magcalRebuild(m);
+    return(1);
+}
+
+// Solve the symmetric positive definite system (upper triangle given) by Cholesky decomposition.
+static int magcalSolve(double a[MAGCAL_PARAMS][MAGCAL_PARAMS], double b[MAGCAL_PARAMS], double x[MAGCAL_PARAMS]) {
+    double	l[MAGCAL_PARAMS][MAGCAL_PARAMS];
+    double	s, maxDiag;
+    int		i, j, k;
+
+    maxDiag = 0;
+    for(i=0; i<MAGCAL_PARAMS; i++) if (a[i][i] > maxDiag) maxDiag = a[i][i];
+    if (maxDiag <= 0) return(-1);
+
+    for(i=0; i<MAGCAL_PARAMS; i++) {
+	for(j=0; j<=i; j++) {
+	    s = a[j][i];
+	    for(k=0; k<j; k++) s -= l[i][k] * l[j][k];
+	    if (i == j) {
+		if (s <= 1e-12 * maxDiag) return(-1);
+		l[i][i] = sqrt(s);
+	    } else {
+		l[i][j] = s / l[j][j];
+	    }
+	}
+    }
+    for(i=0; i<MAGCAL_PARAMS; i++) {
+	s = b[i];
+	for(k=0; k<i; k++) s -= l[i][k] * x[k];
+	x[i] = s / l[i][i];
+    }
+    for(i=MAGCAL_PARAMS-1; i>=0; i--) {
+	s = x[i];
+	for(k=i+1; k<MAGCAL_PARAMS; k++) s -= l[k][i] * x[k];
+	x[i] = s / l[i][i];
+    }
+    return(0);
+}
+
+// Eigenvalues and eigenvectors (columns of v) of a symmetric 3x3 matrix, cyclic Jacobi.
+static void magcalEigen3(double a[3][3], double lambda[3], double v[3][3]) {
+    double	m[3][3], theta, t, c, s, mpq, mpp, mqq, mkp, mkq, vkp, vkq;
+    int		sweep, p, q, k;
+
+    memcpy(m, a, sizeof(m));
+    for(p=0; p<3; p++) for(q=0; q<3; q++) v[p][q] = (p == q);
+
+    for(sweep=0; sweep<50; sweep++) {
+	if (fabs(m[0][1]) + fabs(m[0][2]) + fabs(m[1][2]) < 1e-15 * (fabs(m[0][0]) + fabs(m[1][1]) + fabs(m[2][2]))) break;
+	for(p=0; p<2; p++) {
+	    for(q=p+1; q<3; q++) {
+		mpq = m[p][q];
+		if (mpq == 0) continue;
+		mpp = m[p][p];
+		mqq = m[q][q];
+		theta = (mqq - mpp) / (2 * mpq);
+		t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+		c = 1 / sqrt(t * t + 1);
+		s = t * c;
+		for(k=0; k<3; k++) {
+		    if (k == p || k == q) continue;
+		    mkp = m[k][p];
+		    mkq = m[k][q];
+		    m[k][p] = m[p][k] = c * mkp - s * mkq;
+		    m[k][q] = m[q][k] = s * mkp + c * mkq;
+		}
+		m[p][p] = mpp - t * mpq;
+		m[q][q] = mqq + t * mpq;
+		m[p][q] = m[q][p] = 0;
+		for(k=0; k<3; k++) {
+		    vkp = v[k][p];
+		    vkq = v[k][q];
+		    v[k][p] = c * vkp - s * vkq;
+		    v[k][q] = s * vkp + c * vkq;
+		}
+	    }
+	}
+    }
+    for(p=0; p<3; p++) lambda[p] = m[p][p];
+}
+
+static void magcalEvaluate(struct magcal *m) {
+    struct magcalQuality	*q;
+    char			bins[MAGCAL_COVERAGE_BINS];
+    double			in[3], out[3], r, e, sum2, az, el;
+    int				i, n, a, b, covered;
+
+    q = &m->quality;
+    memset(bins, 0, sizeof(bins));
+    n = magcalRingLength(m);
+    sum2 = 0;
+    q->residualMax = 0;
+    for(i=0; i<n; i++) {
+	in[0] = m->ring[i][0];
+	in[1] = m->ring[i][1];
+	in[2] = m->ring[i][2];
+	magcalApply1(&m->correction, in, out);
+	r = sqrt(out[0]*out[0] + out[1]*out[1] + out[2]*out[2]);
+	e = r / m->correction.fieldStrength - 1;
+	sum2 += e * e;
+	if (fabs(e) > q->residualMax) q->residualMax = fabs(e);
+	if (r == 0) continue;
+	az = atan2(out[1], out[0]);
+	el = out[2] / r;
+	a = (az + M_PI) / (2 * M_PI) * MAGCAL_AZIMUTH_BINS;
+	b = (el + 1) / 2 * MAGCAL_ELEVATION_BINS;
+	if (a >= MAGCAL_AZIMUTH_BINS) a = MAGCAL_AZIMUTH_BINS - 1;
+	if (b >= MAGCAL_ELEVATION_BINS) b = MAGCAL_ELEVATION_BINS - 1;
+	if (a < 0) a = 0;
+	if (b < 0) b = 0;
+	bins[b * MAGCAL_AZIMUTH_BINS + a] = 1;
+    }
+    covered = 0;
+    for(i=0; i<MAGCAL_COVERAGE_BINS; i++) covered += bins[i];
+    q->samples = n;
+    q->coverage = (double) covered / MAGCAL_COVERAGE_BINS;
+    q->residualRms = n ? sqrt(sum2 / n) : 0;
+    q->converged = (q->coverage >= MAGCAL_CONVERGED_COVERAGE
+		    && q->residualRms <= MAGCAL_CONVERGED_RESIDUAL
+		    && m->stableFits >= MAGCAL_CONVERGED_FITS
+	);
+}
+
+int magcalFit(struct magcal *m) {
+    struct magcalCorrection	k;
+    double			p[MAGCAL_PARAMS], a[3][3], ai[3][3], c[3], mm[3][3];
+    double			lambda[3], v[3][3], w[3][3], det, bc, r, rmin, rmax, change;
+    int				i, j, l, stable;
+
+    // until a fit succeeds again, the previous correction and quality stay, but are not converged
+    stable = m->stableFits;
+    m->quality.converged = 0;
+    m->stableFits = 0;
+    if (magcalRingLength(m) < MAGCAL_MIN_SAMPLES) return(-1);
+    if (magcalSolve(m->ata, m->atb, p) != 0) return(-1);
+
+    a[0][0] = p[0]; a[0][1] = p[3]; a[0][2] = p[4];
+    a[1][0] = p[3]; a[1][1] = p[1]; a[1][2] = p[5];
+    a[2][0] = p[4]; a[2][1] = p[5]; a[2][2] = p[2];
+
+    // center c = - A^-1 b
+    ai[0][0] = a[1][1]*a[2][2] - a[1][2]*a[2][1];
+    ai[0][1] = a[0][2]*a[2][1] - a[0][1]*a[2][2];
+    ai[0][2] = a[0][1]*a[1][2] - a[0][2]*a[1][1];
+    ai[1][0] = a[1][2]*a[2][0] - a[1][0]*a[2][2];
+    ai[1][1] = a[0][0]*a[2][2] - a[0][2]*a[2][0];
+    ai[1][2] = a[0][2]*a[1][0] - a[0][0]*a[1][2];
+    ai[2][0] = a[1][0]*a[2][1] - a[1][1]*a[2][0];
+    ai[2][1] = a[0][1]*a[2][0] - a[0][0]*a[2][1];
+    ai[2][2] = a[0][0]*a[1][1] - a[0][1]*a[1][0];
+    det = a[0][0]*ai[0][0] + a[0][1]*ai[1][0] + a[0][2]*ai[2][0];
+    if (det == 0) return(-1);
+    for(i=0; i<3; i++) c[i] = - (ai[i][0]*p[6] + ai[i][1]*p[7] + ai[i][2]*p[8]) / det;
+
+    // in coordinates centered at c: y' A y = 1 - b.c, A is negative definite
+    // when the origin is outside of the ellipsoid
+    bc = 1 - (p[6]*c[0] + p[7]*c[1] + p[8]*c[2]);
+    if (bc == 0) return(-1);
+    for(i=0; i<3; i++) for(j=0; j<3; j++) mm[i][j] = a[i][j] / bc;
+
+    magcalEigen3(mm, lambda, v);
+    if (lambda[0] <= 0 || lambda[1] <= 0 || lambda[2] <= 0) return(-1);
+
+    // radius of the sphere with the same volume as the ellipsoid
+    r = pow(lambda[0] * lambda[1] * lambda[2], -1.0/6.0);
+    rmin = rmax = 1 / sqrt(lambda[0]);
+    for(i=1; i<3; i++) {
+	if (1 / sqrt(lambda[i]) < rmin) rmin = 1 / sqrt(lambda[i]);
+	if (1 / sqrt(lambda[i]) > rmax) rmax = 1 / sqrt(lambda[i]);
+    }
+    // w = r * sqrt(M)
+    for(i=0; i<3; i++) {
+	for(j=0; j<3; j++) {
+	    w[i][j] = 0;
+	    for(l=0; l<3; l++) w[i][j] += v[i][l] * sqrt(lambda[l]) * v[j][l];
+	    w[i][j] *= r;
+	}
+    }
+
+    for(i=0; i<3; i++) c[i] = m->origin[i] + m->scale * c[i];
+    magcalCorrectionSet(&k, c, w);
+    k.fieldStrength = r * m->scale;
+
+    if (m->valid) {
+	change = 0;
+	for(i=0; i<3; i++) {
+	    change = fmax(change, fabs(k.offset[i] - m->correction.offset[i]) / k.fieldStrength);
+	    for(j=0; j<3; j++) change = fmax(change, fabs(k.matrix[i][j] - m->correction.matrix[i][j]));
+	}
+	stable = (change < MAGCAL_CONVERGED_CHANGE) ? stable + 1 : 0;
+    }
+    m->stableFits = stable;
+    m->correction = k;
+    m->valid = 1;
+    m->fits ++;
+    m->minSpacing = MAGCAL_SPACING * k.fieldStrength;
+    magcalEvaluate(m);
+    m->quality.anisotropy = rmax / rmin;
+
+    // keep the working frame close to the ellipsoid for good conditioning
+    change = 0;
+    for(i=0; i<3; i++) change += (c[i] - m->origin[i]) * (c[i] - m->origin[i]);
+    if (sqrt(change) > MAGCAL_RECENTER * k.fieldStrength || fabs(k.fieldStrength / m->scale - 1) > MAGCAL_RECENTER) {
+	memcpy(m->origin, c, sizeof(m->origin));
+	m->scale = k.fieldStrength;
+	magcalRebuild(m);
+    }
+    return(0);
+}
+
+void magcalCorrectionSet(struct magcalCorrection *k, double offset[3], double matrix[3][3]) {
+    int i, j;
+
+    memcpy(k->offset, offset, sizeof(k->offset));
+    memcpy(k->matrix, matrix, sizeof(k->matrix));
+    k->fieldStrength = 0;
+    for(i=0; i<3; i++) {
+	for(j=0; j<3; j++) k->fmatrix[i][j] = matrix[i][j];
+	k->fbias[i] = - (matrix[i][0]*offset[0] + matrix[i][1]*offset[1] + matrix[i][2]*offset[2]);
+    }
+}
+
+void magcalCorrectionIdentity(struct magcalCorrection *k) {
+    double offset[3] = {0, 0, 0};
+    double matrix[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+
+    magcalCorrectionSet(k, offset, matrix);
+}
+
+// One line progress report for calibration tools.
+void magcalReport(struct magcal *m, FILE *ff) {
+    struct magcalQuality *q;
+
+    q = &m->quality;
+    if (! m->valid) {
+	fprintf(ff, "samples %lld/%lld, no fit yet\n", m->count, m->offered);
+    } else {
+	fprintf(ff, "samples %lld/%lld, coverage %3.0f%%, residual rms %5.3f max %5.3f, field %.1f, anisotropy %5.3f%s\n",
+		m->count, m->offered, q->coverage * 100, q->residualRms, q->residualMax,
+		m->correction.fieldStrength, q->anisotropy, q->converged ? ", converged" : ""
+	    );
+    }
+    fflush(ff);
+}
+
+// Print the correction as C code to be pasted into a compass tool.
+void magcalCorrectionPrint(struct magcalCorrection *k, FILE *ff) {
+    int i;
+
+    fprintf(ff, "    double magOffset[3] = {%.3f, %.3f, %.3f};\n", k->offset[0], k->offset[1], k->offset[2]);
+    fprintf(ff, "    double magMatrix[3][3] = {\n");
+    for(i=0; i<3; i++) {
+	fprintf(ff, "\t{%.6f, %.6f, %.6f},\n", k->matrix[i][0], k->matrix[i][1], k->matrix[i][2]);
+    }
+    fprintf(ff, "    };\n");
+}
+
+// The offset is folded into the bias, so each output is three multiply-adds
+// of single precision floats. At -O3 GCC vectorizes this loop (NEON on the
+// Pi, SSE on x86), about 3x faster than at -O2. Hand written vector shuffles
+// were measured slower. The Makefiles of the tools build it with -O3.
+void magcalApply(struct magcalCorrection *k, float *in, float *out, int n) {
+    float	m00, m01, m02, m10, m11, m12, m20, m21, m22, b0, b1, b2, x, y, z;
+    int		i;
+
+    m00 = k->fmatrix[0][0]; m01 = k->fmatrix[0][1]; m02 = k->fmatrix[0][2];
+    m10 = k->fmatrix[1][0]; m11 = k->fmatrix[1][1]; m12 = k->fmatrix[1][2];
+    m20 = k->fmatrix[2][0]; m21 = k->fmatrix[2][1]; m22 = k->fmatrix[2][2];
+    b0 = k->fbias[0]; b1 = k->fbias[1]; b2 = k->fbias[2];
+    for(i=0; i<n; i++) {
+	x = in[3*i];
+	y = in[3*i+1];
+	z = in[3*i+2];
+	out[3*i] = m00 * x + m01 * y + m02 * z + b0;
+	out[3*i+1] = m10 * x + m11 * y + m12 * z + b1;
+	out[3*i+2] = m20 * x + m21 * y + m22 * z + b2;
+    }
+}
+
+void magcalApply1(struct magcalCorrection *k, double in[3], double out[3]) {
+    double	d[3];
+    int		i;
+
+    for(i=0; i<3; i++) d[i] = in[i] - k->offset[i];
+    for(i=0; i<3; i++) out[i] = k->matrix[i][0]*d[0] + k->matrix[i][1]*d[1] + k->matrix[i][2]*d[2];
+}
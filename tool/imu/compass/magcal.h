@@ -0,0 +1,109 @@
+/*
+  Magnetometer calibration engine shared by compass tools.
+
+  Raw magnetometer readings of a rotated sensor lie on an ellipsoid. Its
+  center is the hard-iron offset, its shape the soft-iron distortion. The
+  engine fits a general ellipsoid
+
+      A x.x + 2 b.x = 1
+
+  by least squares. The normal equations are kept as running sums, so
+  adding a sample is O(1) and a fit only solves a 9x9 system. Samples are
+  also stored in a fixed ring. Sums of samples leaving the ring are
+  subtracted (sliding window), and the ring is used to compute coverage
+  and fit quality and to rebuild the sums when the working frame moves.
+
+  The resulting correction
+
+      corrected = matrix * (raw - offset)
+
+  maps the ellipsoid onto a sphere of radius fieldStrength (raw units).
+  magcalApply() applies it to blocks of live data as one fused affine
+  transform, written so that the compiler vectorizes it.
+
+  The file is compiled by both gcc and g++.
+ */
+
+#ifndef MAGCAL_H
+#define MAGCAL_H
+
+#include <stdio.h>
+
+// must be a power of 2
+#define MAGCAL_RING_SIZE		2048
+#define MAGCAL_PARAMS			9
+// coverage is counted in 12 azimuth x 6 (equal area) elevation bins
+#define MAGCAL_AZIMUTH_BINS		12
+#define MAGCAL_ELEVATION_BINS		6
+#define MAGCAL_COVERAGE_BINS		(MAGCAL_AZIMUTH_BINS * MAGCAL_ELEVATION_BINS)
+
+// minimal coverage and maximal relative residual of a converged fit
+#define MAGCAL_CONVERGED_COVERAGE	0.60
+#define MAGCAL_CONVERGED_RESIDUAL	0.05
+// the fit is converged when the correction moved by less than this
+// (relative to the field strength) in MAGCAL_CONVERGED_FITS consecutive fits
+#define MAGCAL_CONVERGED_CHANGE		0.005
+#define MAGCAL_CONVERGED_FITS		3
+
+struct magcalCorrection {
+    double		offset[3];
+    double		matrix[3][3];
+    double		fieldStrength;
+    // the same as one affine transform in single precision: out = fmatrix * raw + fbias
+    float		fmatrix[3][3];
+    float		fbias[3];
+};
+
+struct magcalQuality {
+    int		samples;
+    // fraction of covered direction bins, 0 - 1
+    double	coverage;
+    // deviation of corrected samples from the sphere, relative to fieldStrength
+    double	residualRms;
+    double	residualMax;
+    // ratio of the longest and shortest ellipsoid axes (1 means no soft iron)
+    double	anisotropy;
+    int		converged;
+};
+
+struct magcal {
+    float			ring[MAGCAL_RING_SIZE][3];
+    // number of samples ever stored into the ring
+    long long			count;
+    // samples offered by magcalAdd, including those not stored
+    long long			offered;
+    // samples closer than this to the last stored one are not stored
+    double			minSpacing;
+
+    // the fit works with u = (x - origin) / scale
+    double			origin[3];
+    double			scale;
+    // upper triangle of D'D and D'1
+    double			ata[MAGCAL_PARAMS][MAGCAL_PARAMS];
+    double			atb[MAGCAL_PARAMS];
+    long long			sumsSamples;
+    long long			lastRebuild;
+
+    int				valid;
+    int				fits;
+    int				stableFits;
+    struct magcalCorrection	correction;
+    struct magcalQuality	quality;
+};
+
+void magcalInit(struct magcal *m);
+// Returns 1 if the sample was stored into the ring.
+int magcalAdd(struct magcal *m, double x, double y, double z);
+// Returns 0 and updates m->correction and m->quality on success, -1 if the
+// samples do not determine an ellipsoid (yet).
+int magcalFit(struct magcal *m);
+void magcalReport(struct magcal *m, FILE *ff);
+
+void magcalCorrectionSet(struct magcalCorrection *k, double offset[3], double matrix[3][3]);
+void magcalCorrectionIdentity(struct magcalCorrection *k);
+void magcalCorrectionPrint(struct magcalCorrection *k, FILE *ff);
+// Apply correction to n interleaved xyz samples, in and out may be the same array.
+void magcalApply(struct magcalCorrection *k, float *in, float *out, int n);
+void magcalApply1(struct magcalCorrection *k, double in[3], double out[3]);
+
+#endif
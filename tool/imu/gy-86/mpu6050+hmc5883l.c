@@ -9,6 +9,7 @@
 #include "Fusion.h"
 #include "pi2c.h"
 #include "MPU6050.h"
+#include "sensorbus.h"
 
 static inline double doubleGetTime() {
   struct timespec tt;
@@ -26,6 +27,8 @@ int main(int argc, char **argv) {
     int		magFd;
     uint8_t	mm[6];
     int16_t 	AcX,AcY,AcZ,GyX,GyY,GyZ,MgX,MgY,MgZ;
+    double	rpy[3];
+    struct sensorBusChannel 	*busrpy;
 
     int		optSharedI2cFlag;
     char	*optI2cPath;
@@ -115,6 +118,11 @@ int main(int argc, char **argv) {
     usleepTime = 1000000 / optRate;
     usleep(usleepTime);
 
+    busrpy = sensorBusOpen("raspilot.gyro-mpu6050-hmc5883l.rpy", SENSOR_BUS_RPY);
+    if (busrpy == NULL) exit(-1);
+    // this tool always printed 5 decimals
+    sensorBusSetTextFormat(busrpy, NULL, "%7.5f");
+
     t0 = doubleGetTime();
     i = 0;
     for(;;) {
@@ -156,8 +164,10 @@ int main(int argc, char **argv) {
 
 	// Print rpy in drone coordinates. This depends on how precisely the sensor is mounted on drone.
 	// TODO: Maybe print in sensor's coordinates and make translation inside raspilot.
-	printf("rpy %7.5f %7.5f %7.5f\n", euler.angle.pitch*M_PI/180.0, euler.angle.roll*M_PI/180.0, euler.angle.yaw*M_PI/180.0);
-	fflush(stdout);
+	rpy[0] = euler.angle.pitch*M_PI/180.0;
+	rpy[1] = euler.angle.roll*M_PI/180.0;
+	rpy[2] = euler.angle.yaw*M_PI/180.0;
+	if (sensorBusPublish(busrpy, t1, 1.0, rpy) != 0) taskStop(0);
 
 	t0 = t1;
 
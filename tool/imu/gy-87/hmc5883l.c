@@ -8,23 +8,38 @@
 
 #include "pi2c.h"
 #include "MPU6050.h"
+#include "i2cbus.h"
+#include "sensorbus.h"
 
-static inline double doubleGetTime() {
-  struct timespec tt;
-  clock_gettime(CLOCK_REALTIME, &tt);
-  return(tt.tv_sec + tt.tv_nsec/1000000000.0);
-}
+#define HMC5883L_ADDR 0x1e
+
+struct sensorBusChannel 	*busmag;
+// sensor bus timestamps are CLOCK_REALTIME, the bus uses CLOCK_MONOTONIC
+double				clockOffset;
 
 static void taskStop(int signum) {
     exit(0);
 }
 
-int main(int argc, char **argv) {
-    double 	t0, t1, samplePeriod;
-    int		i, usleepTime;
-    int		magFd;
-    uint8_t	mm[6];
+static void magSample(struct i2cBusPoll *p, double t, uint8_t *mm, int len) {
     int16_t 	MgX,MgY,MgZ;
+    double	mag[3];
+
+    MgX = ((int16_t)mm[0] << 8) | mm[1];
+    MgY = ((int16_t)mm[2] << 8) | mm[3];
+    MgZ = ((int16_t)mm[4] << 8) | mm[5];
+
+    mag[0] = MgX;
+    mag[1] = MgY;
+    mag[2] = MgZ;
+    if (sensorBusPublish(busmag, t + clockOffset, 1.0, mag) != 0) taskStop(0);
+}
+
+int main(int argc, char **argv) {
+    int			i;
+    struct i2cBus	bus;
+    struct i2cBusPoll	poll;
+    struct i2cSched	sched;
 
     int		optSharedI2cFlag;
     char	*optI2cPath;
@@ -67,46 +82,41 @@ int main(int argc, char **argv) {
   
     usleep(1000);
     
-    // connect to magnetometer
-    magFd = pi2cOpen(optI2cPath, 0x1e);
-    if (magFd < 0) {
-	fprintf(stderr, "pi2c magnetometer connection failed\n");
+    // connect to magnetometer, register reads go through the bus owner as single I2C_RDWR transfers,
+    // or through pi2c taking its semaphores when the bus is shared
+    if ((optSharedI2cFlag ? i2cBusOpenPi2c(&bus, optI2cPath) : i2cBusOpen(&bus, optI2cPath)) != 0) {
+	fprintf(stderr, "magnetometer connection failed\n");
 	return(-1);
     }
     // 75Hz refresh rate
-    pi2cWriteByteToReg(magFd, 0x00, 0x74);
+    i2cBusWriteByte(&bus, HMC5883L_ADDR, 0x00, 0x74);
     // gain
-    pi2cWriteByteToReg(magFd, 0x01, 0x40);
+    i2cBusWriteByte(&bus, HMC5883L_ADDR, 0x01, 0x40);
     // continuous mode
-    pi2cWriteByteToReg(magFd, 0x02, 0x00);
+    if (i2cBusWriteByte(&bus, HMC5883L_ADDR, 0x02, 0x00) != 0) {
+	fprintf(stderr, "magnetometer not responding\n");
+	return(-1);
+    }
     
-    usleepTime = 1000000 / optRate;
     usleep(100000);
 
-    double mgPerDigit = 0.92f;
-
-    t0 = doubleGetTime();
-    i = 0;
-    for(;;) {
-	// read magnetometer
-	// pi2cWriteBytesToReg(magFd, 0x03, 0, NULL);
-	pi2cReadBytes(magFd, 0x03, 6, mm);
-	t1 = doubleGetTime();
-
-	MgX = ((int16_t)mm[0] << 8) | mm[1];
-	MgY = ((int16_t)mm[2] << 8) | mm[3];
-	MgZ = ((int16_t)mm[4] << 8) | mm[5];
-
-	printf("mag %d %d %d\n", MgX, MgY, MgZ);
-	fflush(stdout);
+    busmag = sensorBusOpen("raspilot.compass-hmc5883l.mag", SENSOR_BUS_MAGNETIC_FIELD);
+    if (busmag == NULL) exit(-1);
 
-	samplePeriod = t1 - t0;
-	t0 = t1;
-	if (samplePeriod > 1.0/optRate && usleepTime > 0) usleepTime--;
-	else if (samplePeriod < 1.0/optRate) usleepTime++;
-	usleep(usleepTime);
+    // data registers are read periodically, the scheduler sleeps in between
+    if (i2cSchedInit(&sched) != 0) return(-1);
+    i2cBusPollInit(&poll, &bus, HMC5883L_ADDR, 0x03, 6, optRate);
+    poll.callback = magSample;
+    i2cBusTaskInit(&bus);
+    i2cSchedAdd(&sched, &poll.task);
+    i2cSchedAdd(&sched, &bus.task);
+    clockOffset = sensorBusCurrentTime() - i2cSchedTime();
 
-	// if (i++ % 1000 == 0) printf("debug usleepTime == %d\n", usleepTime);
+    for(;;) {
+	if (i2cSchedRunOnce(&sched) != 0) {
+	    fprintf(stderr, "%s:%d: I2C error\n", __FILE__, __LINE__);
+	    taskStop(0);
+	}
     }
 
     taskStop(0);
@@ -6,13 +6,47 @@
 #include <string.h>
 #include <signal.h>
 
-#include "Fusion.h"
 #include "pi2c.h"
 #include "MPU6050.h"
 
-#ifdef SHM
-#include "raspilotshm.h"
-#endif
+#include "imufifo.h"
+#include "sensorbus.h"
+#include "ahrs/ahrs.h"
+
+#define MPU6050_I2C_ADDRESS		0x68
+
+// Registers used by the FIFO mode
+#define MPU_FIFO_REG_SMPLRT_DIV		0x19
+#define MPU_FIFO_REG_FIFO_EN		0x23
+#define MPU_FIFO_REG_USER_CTRL		0x6A
+#define MPU_FIFO_REG_FIFO_COUNTH	0x72
+#define MPU_FIFO_REG_FIFO_R_W		0x74
+
+// FIFO_EN: XG, YG, ZG and ACCEL
+#define MPU_FIFO_EN_ACCEL_GYRO		0x78
+#define MPU_FIFO_USER_CTRL_FIFO_EN	0x40
+#define MPU_FIFO_USER_CTRL_FIFO_RESET	0x04
+
+#define MPU_FIFO_SIZE			1024
+// accel x,y,z, gyro x,y,z, big endian
+#define MPU_FIFO_PACKET			12
+// pi2cReadBytes takes 8 bit length, read whole packets only
+#define MPU_FIFO_MAX_READ		(255 / MPU_FIFO_PACKET * MPU_FIFO_PACKET)
+// seconds between statistics printed in FIFO mode
+#define MPU_FIFO_REPORT_PERIOD		10.0
+
+// +-250dps and +-2g
+#define MPU_GYRO_COUNTS_PER_DPS		131.0
+#define MPU_ACCEL_COUNTS_PER_G		16384.0
+
+struct sensorBusChannel 	*busrpy;
+struct sensorBusChannel 	*buslacc;
+struct sensorBusChannel 	*buseacc;
+
+// filter state, float or fixed point depending on -fixed
+static struct ahrs		ahrs;
+static struct ahrsFixed		ahrsFixed;
+static int			optFixedFlag;
 
 static inline double doubleGetTime() {
   struct timespec tt;
@@ -25,32 +59,139 @@ static void taskStop(int signum) {
     exit(0);
 }
 
+// roll  - negative == left wing down; positive == left wing up
+// pitch - negative == nose down;      positive == nose up
+// yaw   - positive == rotated counterclockwise (view from up)
+static void publishAttitude(struct ahrsOutput *out, double t) {
+    if (busrpy != NULL && sensorBusPublish(busrpy, t, 1.0, out->rpy) != 0) taskStop(0);
+    if (buslacc != NULL && sensorBusPublish(buslacc, t, 1.0, out->lacc) != 0) taskStop(0);
+    if (buseacc != NULL && sensorBusPublish(buseacc, t, 1.0, out->eacc) != 0) taskStop(0);
+    sensorBusFlush();
+}
+
+static void mpuFifoReset(int fd) {
+    pi2cWriteByteToReg(fd, MPU_FIFO_REG_USER_CTRL, 0);
+    pi2cWriteByteToReg(fd, MPU_FIFO_REG_USER_CTRL, MPU_FIFO_USER_CTRL_FIFO_RESET);
+    pi2cWriteByteToReg(fd, MPU_FIFO_REG_USER_CTRL, MPU_FIFO_USER_CTRL_FIFO_EN);
+}
+
+// Configure the sample rate divider and the FIFO. Returns the real output data rate.
+static double mpuFifoInit(int fd, double rate, int dlpfMode) {
+    double	gyroRate;
+    int		div;
+
+    // gyroscope output rate is 8kHz with DLPF disabled, 1kHz otherwise
+    gyroRate = (dlpfMode == 0 || dlpfMode == 7) ? 8000.0 : 1000.0;
+    div = (int) (gyroRate / rate + 0.5) - 1;
+    if (div < 0) div = 0;
+    if (div > 255) div = 255;
+
+    pi2cWriteByteToReg(fd, MPU_FIFO_REG_USER_CTRL, 0);
+    pi2cWriteByteToReg(fd, MPU_FIFO_REG_FIFO_EN, 0);
+    pi2cWriteByteToReg(fd, MPU_FIFO_REG_SMPLRT_DIV, div);
+    pi2cWriteByteToReg(fd, MPU_FIFO_REG_FIFO_EN, MPU_FIFO_EN_ACCEL_GYRO);
+    mpuFifoReset(fd);
+
+    // accelerometer is sampled at 1kHz max, above that accel samples repeat
+    if (gyroRate / (div+1) > 1000.0) printf("debug Warning: accelerometer output rate is limited to 1kHz\n");
+    return(gyroRate / (div+1));
+}
+
+// Read all samples accumulated in the FIFO at each wakeup, never returns.
+static void mpuFifoLoop(int fd, double odr, double wakeupRate) {
+    struct imuFifoClock		sampleClock;
+    struct imuFifoStats		stats;
+    struct timespec		deadline;
+    struct ahrsSample		samples[MPU_FIFO_SIZE / MPU_FIFO_PACKET];
+    struct ahrsRawSample	raw[MPU_FIFO_SIZE / MPU_FIFO_PACKET];
+    struct ahrsOutput		out[MPU_FIFO_SIZE / MPU_FIFO_PACKET];
+    uint8_t			buf[MPU_FIFO_SIZE];
+    uint8_t			cc[2];
+    uint8_t			*p;
+    int				i, j, n, count, len;
+    long			periodNs;
+    double			lateness, tread, t, lastReport;
+
+    imuFifoClockInit(&sampleClock, odr);
+    imuFifoStatsInit(&stats);
+    lastReport = imuFifoMonotonicTime();
+    periodNs = 1000000000.0 / wakeupRate;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    for(;;) {
+	lateness = imuFifoSleep(&deadline, periodNs);
+
+	tread = doubleGetTime();
+	pi2cReadBytes(fd, MPU_FIFO_REG_FIFO_COUNTH, 2, cc);
+	count = (cc[0] << 8) | cc[1];
+	if (count > MPU_FIFO_SIZE - MPU_FIFO_PACKET) {
+	    // overflown, packet boundaries are lost
+	    mpuFifoReset(fd);
+	    imuFifoClockReset(&sampleClock);
+	    stats.overflows ++;
+	    continue;
+	}
+	count -= count % MPU_FIFO_PACKET;
+	for(i=0; i<count; i+=len) {
+	    len = count - i;
+	    if (len > MPU_FIFO_MAX_READ) len = MPU_FIFO_MAX_READ;
+	    pi2cReadBytes(fd, MPU_FIFO_REG_FIFO_R_W, len, buf+i);
+	}
+
+	n = count / MPU_FIFO_PACKET;
+	t = imuFifoClockBatch(&sampleClock, n, tread);
+	// the whole burst goes to the filter at once
+	for(i=0; i<n; i++) {
+	    p = buf + i * MPU_FIFO_PACKET;
+	    for(j=0; j<3; j++) {
+		raw[i].accelerometer[j] = (int16_t)((p[2*j] << 8) | p[2*j+1]);
+		raw[i].gyroscope[j] = (int16_t)((p[6+2*j] << 8) | p[6+2*j+1]);
+		samples[i].accelerometer[j] = raw[i].accelerometer[j] / MPU_ACCEL_COUNTS_PER_G;
+		samples[i].gyroscope[j] = raw[i].gyroscope[j] / MPU_GYRO_COUNTS_PER_DPS;
+	    }
+	    raw[i].timestamp = samples[i].timestamp = t + i * sampleClock.period;
+	    raw[i].deltaTime = AHRS_FIXED_SECONDS(sampleClock.period);
+	    samples[i].deltaTime = sampleClock.period;
+	}
+	if (optFixedFlag) {
+	    ahrsFixedUpdateBatch(&ahrsFixed, raw, n, out);
+	} else {
+	    ahrsUpdateBatch(&ahrs, samples, n, out);
+	}
+	for(i=0; i<n; i++) publishAttitude(&out[i], out[i].timestamp);
+
+	imuFifoStatsBurst(&stats, n, lateness);
+	if (imuFifoMonotonicTime() - lastReport > MPU_FIFO_REPORT_PERIOD) {
+	    imuFifoStatsReport(&stats, &sampleClock, stderr, "mpu6050 fifo");
+	    lastReport = imuFifoMonotonicTime();
+	}
+    }
+}
+
 int main(int argc, char **argv) {
     double 	t0, t1, samplePeriod;
-    FusionAhrs 	ahrs;
+    struct ahrsOutput	out;
     int		i, usleepTime;
     int16_t 	AcX,AcY,AcZ,GyX,GyY,GyZ,MgX,MgY,MgZ;
-    FusionEuler euler;
-    FusionVector facc;
+    int		fifoFd;
+    double	odr;
     
     int		optSharedI2cFlag;
     char	*optI2cPath;
     double	optRate;
     int		optDLPFilterMode;
-    double	rpy[3];    
-    double	lacc[3];    
-    double	eacc[3];    
-
-#ifdef SHM
-    struct raspilotInputBuffer 	*shmrpy;
-    struct raspilotInputBuffer 	*shmlacc;
-    struct raspilotInputBuffer 	*shmeacc;
-#endif
+    int		optFifoFlag;
+    double	optWakeupRate;
+    int		optAlgorithm;
 
     optSharedI2cFlag = 0;
     optI2cPath = (char*)"/dev/i2c-1";
     optRate = 1000.0; 			// default rate 1kHz
     optDLPFilterMode = 0;		// default - no filter
+    optFifoFlag = 0;
+    optWakeupRate = 0;			// default - optRate / 4
+    optAlgorithm = AHRS_MADGWICK;
+    optFixedFlag = 0;
     
     for(i=1; i<argc; i++) {
 	if (strcmp(argv[i], "-s") == 0) {
@@ -64,6 +205,19 @@ int main(int argc, char **argv) {
 	    // DLPFilterMode
 	    i++;
 	    if (i<argc) optDLPFilterMode = strtol(argv[i], NULL, 10);
+	} else if (strcmp(argv[i], "-fifo") == 0) {
+	    // sample into the hardware FIFO at rate -r, read it in bursts
+	    optFifoFlag = 1;
+	} else if (strcmp(argv[i], "-w") == 0) {
+	    // FIFO mode wakeup rate in Hz
+	    i++;
+	    if (i<argc) optWakeupRate = strtod(argv[i], NULL);
+	} else if (strcmp(argv[i], "-mahony") == 0) {
+	    // Mahony filter, learns gyroscope bias
+	    optAlgorithm = AHRS_MAHONY;
+	} else if (strcmp(argv[i], "-fixed") == 0) {
+	    // fixed point filter on raw sensor counts
+	    optFixedFlag = 1;
 	} else {
 	    optI2cPath = argv[i];
 	}
@@ -81,12 +235,12 @@ int main(int argc, char **argv) {
     // MPU6050_write_reg (0x37, 2);
     // MPU6050_write_reg (0x6B, 0);
     
-#ifdef SHM
-    shmrpy = raspilotShmConnect((char *)"raspilot.gyro-mpu6050-magwick-shm.rpy");
-    shmlacc = raspilotShmConnect((char *)"raspilot.gyro-mpu6050-magwick-shm.lacc");
-    shmeacc = raspilotShmConnect((char *)"raspilot.gyro-mpu6050-magwick-shm.eacc");
-    if (shmrpy == NULL && shmlacc == NULL && shmeacc == NULL) exit(-1);
-#endif
+    // text output is flushed once per sample in publishAttitude
+    sensorBusTextAutoFlush = 0;
+    busrpy = sensorBusOpen("raspilot.gyro-mpu6050-magwick-shm.rpy", SENSOR_BUS_RPY);
+    buslacc = sensorBusOpen("raspilot.gyro-mpu6050-magwick-shm.lacc", SENSOR_BUS_LINEAR_ACCELERATION);
+    buseacc = sensorBusOpen("raspilot.gyro-mpu6050-magwick-shm.eacc", SENSOR_BUS_EARTH_ACCELERATION);
+    if (busrpy == NULL && buslacc == NULL && buseacc == NULL) exit(-1);
     
     signal(SIGINT, taskStop);
   
@@ -97,7 +251,20 @@ int main(int argc, char **argv) {
     mpu.setDLPFMode(optDLPFilterMode);
     mpu.setFullScaleGyroRange(MPU6050_GYRO_FS_250);
     mpu.setFullScaleAccelRange(MPU6050_ACCEL_FS_2);
-    FusionAhrsInitialise(&ahrs);
+    ahrsInit(&ahrs, optAlgorithm);
+    ahrsFixedInit(&ahrsFixed, optAlgorithm, MPU_GYRO_COUNTS_PER_DPS, MPU_ACCEL_COUNTS_PER_G);
+
+    if (optFifoFlag) {
+	fifoFd = pi2cOpen(optI2cPath, MPU6050_I2C_ADDRESS);
+	if (fifoFd < 0) {
+	    fprintf(stderr, "pi2c mpu6050 connection failed\n");
+	    return(-1);
+	}
+	odr = mpuFifoInit(fifoFd, optRate, optDLPFilterMode);
+	if (optWakeupRate <= 0) optWakeupRate = odr / 4;
+	printf("debug FIFO mode: output data rate %g Hz, wakeup rate %g Hz\n", odr, optWakeupRate); fflush(stdout);
+	mpuFifoLoop(fifoFd, odr, optWakeupRate);
+    }
     
     usleepTime = 1000000 / optRate;
     usleep(usleepTime);
@@ -105,62 +272,30 @@ int main(int argc, char **argv) {
     t0 = doubleGetTime();
     i = 0;
     for(;;) {
-        FusionVector gyroscope = {0.0f, 0.0f, 0.0f};     // replace this with actual gyroscope data in degrees/s
-        FusionVector accelerometer = {0.0f, 0.0f, 1.0f}; // replace this with actual accelerometer data in g
-	double temp;
+	float	gyroscope[3];		// degrees/s
+	float	accelerometer[3];	// g
 
 	mpu.getMotion6(&AcX, &AcY, &AcZ, &GyX, &GyY, &GyZ);
-	accelerometer.axis.x = AcX / 16384.0; 
-	accelerometer.axis.y = AcY / 16384.0; 
-	accelerometer.axis.z = AcZ / 16384.0; 
-	gyroscope.axis.x = GyX /  131.0;
-	gyroscope.axis.y = GyY / 131.0;
-	gyroscope.axis.z = GyZ / 131.0;
-	
 	t1 = doubleGetTime();
 	samplePeriod = t1 - t0;
-        FusionAhrsUpdateNoMagnetometer(&ahrs, gyroscope, accelerometer, samplePeriod);
-	
-        euler = FusionQuaternionToEuler(FusionAhrsGetQuaternion(&ahrs));
-	// roll  - negative == left wing down; positive == left wing up
-	// pitch - negative == nose down;      positive == nose up
-	// yaw   - positive == rotated counterclockwise (view from up)
-	rpy[0] = euler.angle.roll*M_PI/180.0;
-	rpy[1] = euler.angle.pitch*M_PI/180.0;
-	rpy[2] = euler.angle.yaw*M_PI/180.0;
-	
-	facc = FusionAhrsGetLinearAcceleration(&ahrs);
-	lacc[0] = facc.axis.x;
-	lacc[1] = facc.axis.y;
-	lacc[2] = facc.axis.z;
-	
-	facc = FusionAhrsGetEarthAcceleration(&ahrs);
-	eacc[0] = facc.axis.x;
-	eacc[1] = facc.axis.y;
-	eacc[2] = facc.axis.z;
-	
-#ifdef SHM
-	if (shmrpy != NULL) {
-	    shmrpy->confidence = 1.0;
-	    if (raspilotShmPush(shmrpy, t1, rpy, 3) != 0) taskStop(0);
-	    // printf("debug: shm-rpy %g: %9.7f %9.7f %9.7f\n", t1, rpy[0], rpy[1], rpy[2]);
-	}
-	if (shmlacc != NULL) {
-	    shmlacc->confidence = 1.0;
-	    if (raspilotShmPush(shmlacc, t1, lacc, 3) != 0) taskStop(0);
-	    // printf("debug: shm-lacc %g: %9.7f %9.7f %9.7f\n", t1, lacc[0], lacc[1], lacc[2]);
-	}
-	if (shmeacc != NULL) {
-	    shmeacc->confidence = 1.0;
-	    if (raspilotShmPush(shmeacc, t1, eacc, 3) != 0) taskStop(0);
-	    // printf("debug: shm-eacc %g: %9.7f %9.7f %9.7f\n", t1, eacc[0], eacc[1], eacc[2]);
+	if (optFixedFlag) {
+	    int16_t	rawGyroscope[3] = {GyX, GyY, GyZ};
+	    int16_t	rawAccelerometer[3] = {AcX, AcY, AcZ};
+
+	    ahrsFixedUpdate(&ahrsFixed, rawGyroscope, rawAccelerometer, AHRS_FIXED_SECONDS(samplePeriod));
+	    ahrsFixedGetOutput(&ahrsFixed, &out);
+	} else {
+	    accelerometer[0] = AcX / MPU_ACCEL_COUNTS_PER_G;
+	    accelerometer[1] = AcY / MPU_ACCEL_COUNTS_PER_G;
+	    accelerometer[2] = AcZ / MPU_ACCEL_COUNTS_PER_G;
+	    gyroscope[0] = GyX / MPU_GYRO_COUNTS_PER_DPS;
+	    gyroscope[1] = GyY / MPU_GYRO_COUNTS_PER_DPS;
+	    gyroscope[2] = GyZ / MPU_GYRO_COUNTS_PER_DPS;
+	    ahrsUpdate(&ahrs, gyroscope, accelerometer, samplePeriod);
+	    ahrsGetOutput(&ahrs, &out);
 	}
-#else
-	printf("rpy %9.7f %9.7f %9.7f\n", rpy[0], rpy[1], rpy[2]);
-	printf("lacc %9.7f %9.7f %9.7f\n", lacc[0], lacc[1], lacc[2]);
-	printf("eacc %9.7f %9.7f %9.7f\n", eacc[0], eacc[1], eacc[2]);
-	fflush(stdout);
-#endif	
+	publishAttitude(&out, t1);
+
 	// The original stuff printed by fusion
 	//printf("T:%6.4f: Roll %7.2f, Pitch %7.2f, Yaw %7.2f\n", samplePeriod, euler.angle.roll, euler.angle.pitch, euler.angle.yaw);
 
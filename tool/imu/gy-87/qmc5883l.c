@@ -8,6 +8,8 @@
 
 #include "pi2c.h"
 #include "MPU6050.h"
+#include "i2cbus.h"
+#include "sensorbus.h"
 
 /* The default I2C address of this chip */
 #define QMC5883L_ADDR 0x0D
@@ -54,25 +56,44 @@
 #define QMC5883L_CONFIG_CONT    0b00000001
 
 
-static inline double doubleGetTime() {
-  struct timespec tt;
-  clock_gettime(CLOCK_REALTIME, &tt);
-  return(tt.tv_sec + tt.tv_nsec/1000000000.0);
-}
+struct sensorBusChannel 	*busmag;
+struct i2cBusRequest		magData;
+uint8_t				mm[6];
+// sensor bus timestamps are CLOCK_REALTIME, the bus uses CLOCK_MONOTONIC
+double				clockOffset;
 
 static void taskStop(int signum) {
     exit(0);
 }
 
-int main(int argc, char **argv) {
-    double 	t0, t1, samplePeriod;
-    int		i, r, usleepTime;
-    int		magFd;
-    uint8_t	mm[6];
+static void magDataRead(struct i2cBusRequest *r, int status) {
     int16_t 	MgX,MgY,MgZ;
+    double	mag[3];
+
+    if (status != 0) return;
+    MgX = ((int16_t)mm[1] << 8) | mm[0];
+    MgY = ((int16_t)mm[3] << 8) | mm[2];
+    MgZ = ((int16_t)mm[5] << 8) | mm[4];
+
+    // return as roll, pitch, yaw. Raspilot shall be configured in the way that he knows that only yaw is valid.
+    mag[0] = MgX;
+    mag[1] = MgY;
+    mag[2] = MgZ;
+    if (sensorBusPublish(busmag, r->completed + clockOffset, 1.0, mag) != 0) taskStop(0);
+}
+
+static void magStatusRead(struct i2cBusPoll *p, double t, uint8_t *status, int len) {
+    if ((status[0] & QMC5883L_STATUS_DRDY) == 0 || magData.pending) return;
+    magData.deadline = t + p->deadline;
+    i2cBusSubmit(p->bus, &magData);
+}
+
+int main(int argc, char **argv) {
+    int			i;
+    struct i2cBus	bus;
+    struct i2cBusPoll	poll;
+    struct i2cSched	sched;
 
-    char	*calibrationFile;
-    
     int		optSharedI2cFlag;
     char	*optI2cPath;
     double	optRate;
@@ -115,49 +136,46 @@ int main(int argc, char **argv) {
   
     usleep(1000);
     
-    // connect to magnetometer
-    magFd = pi2cOpen(optI2cPath, 0x0d);
-    if (magFd < 0) {
-	fprintf(stderr, "pi2c magnetometer connection failed\n");
+    // connect to magnetometer, register reads go through the bus owner as single I2C_RDWR transfers,
+    // or through pi2c taking its semaphores when the bus is shared
+    if ((optSharedI2cFlag ? i2cBusOpenPi2c(&bus, optI2cPath) : i2cBusOpen(&bus, optI2cPath)) != 0) {
+	fprintf(stderr, "magnetometer connection failed\n");
 	return(-1);
     }
     
-    pi2cWriteByteToReg(magFd, QMC5883L_RESET, 0x01);
-    pi2cWriteByteToReg(magFd, QMC5883L_CONFIG,  QMC5883L_CONFIG_OS512 | QMC5883L_CONFIG_2GAUSS | QMC5883L_CONFIG_50HZ | QMC5883L_CONFIG_CONT);
+    i2cBusWriteByte(&bus, QMC5883L_ADDR, QMC5883L_RESET, 0x01);
+    if (i2cBusWriteByte(&bus, QMC5883L_ADDR, QMC5883L_CONFIG,  QMC5883L_CONFIG_OS512 | QMC5883L_CONFIG_2GAUSS | QMC5883L_CONFIG_50HZ | QMC5883L_CONFIG_CONT) != 0) {
+	fprintf(stderr, "magnetometer not responding\n");
+	return(-1);
+    }
 
-    usleepTime = 1000000 / optRate;
     usleep(100000);
 
-    t0 = doubleGetTime();
-    i = 0;
+    busmag = sensorBusOpen("raspilot.compass-qmc5883l.mag", SENSOR_BUS_MAGNETIC_FIELD);
+    if (busmag == NULL) exit(-1);
+
+    // status is polled at twice the rate, data are read when ready
+    memset(&magData, 0, sizeof(magData));
+    magData.address = QMC5883L_ADDR;
+    magData.op = I2C_BUS_READ;
+    magData.reg = QMC5883L_X_LSB;
+    magData.len = 6;
+    magData.buf = mm;
+    magData.done = magDataRead;
+    if (i2cSchedInit(&sched) != 0) return(-1);
+    i2cBusPollInit(&poll, &bus, QMC5883L_ADDR, QMC5883L_STATUS, 1, 2 * optRate);
+    poll.callback = magStatusRead;
+    i2cBusTaskInit(&bus);
+    i2cSchedAdd(&sched, &poll.task);
+    i2cSchedAdd(&sched, &bus.task);
+    clockOffset = sensorBusCurrentTime() - i2cSchedTime();
+
     for(;;) {
-	// read magnetometer
-	uint8_t status;
-	for(;;) {
-	    pi2cReadBytes(magFd, QMC5883L_STATUS, 1, &status);
-	    if (status & QMC5883L_STATUS_DRDY) break;
-	    usleep(1000);
+	if (i2cSchedRunOnce(&sched) != 0) {
+	    fprintf(stderr, "%s:%d: I2C error\n", __FILE__, __LINE__);
+	    taskStop(0);
 	}
-
-	pi2cReadBytes(magFd, QMC5883L_X_LSB, 6, mm);
-	t1 = doubleGetTime();
-	MgX = ((int16_t)mm[1] << 8) | mm[0];
-	MgY = ((int16_t)mm[3] << 8) | mm[2];
-	MgZ = ((int16_t)mm[5] << 8) | mm[4];
-
-	// return as roll, pitch, yaw. Raspilot shall be configured in the way that he knows that only yaw is valid.
-	printf("mag %d %d %d\n", MgX, MgY, MgZ);
-	fflush(stdout);
-
-	samplePeriod = t1 - t0;
-	t0 = t1;
-	if (samplePeriod > 1.0/optRate && usleepTime > 0) usleepTime--;
-	else if (samplePeriod < 1.0/optRate) usleepTime++;
-	usleep(usleepTime);
-	// if (i++ % 1000 == 0) printf("debug usleepTime == %d\n", usleepTime);
     }
 
     taskStop(0);
 }
-
-
@@ -0,0 +1,71 @@
+/*
+  Bus backend going through pi2c, for buses shared with tools not using
+  the bus owner yet (-s). Those serialize their accesses with the pi2c
+  semaphores, and pi2c takes them around each of its calls, so a request
+  is sent with pi2c calls instead of a combined I2C_RDWR transfer. The
+  bus sends one request per transfer then, batching is lost but the
+  deadline ordering and the statistics stay.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/i2c.h>
+
+#include "pi2c.h"
+#include "i2cbus.h"
+
+#define I2C_BUS_PI2C_ADDRESSES		128
+
+struct i2cBusPi2c {
+    char	*path;
+    // pi2c file descriptors by device address, opened on first use
+    int		fd[I2C_BUS_PI2C_ADDRESSES];
+};
+
+static int i2cBusPi2cFd(struct i2cBusPi2c *p, int address) {
+    if (address < 0 || address >= I2C_BUS_PI2C_ADDRESSES) return(-1);
+    if (p->fd[address] < 0) p->fd[address] = pi2cOpen(p->path, address);
+    return(p->fd[address]);
+}
+
+static int i2cBusPi2cTransfer(void *ctx, struct i2c_msg *msgs, int n) {
+    struct i2cBusPi2c	*p;
+    int			i, fd;
+
+    p = (struct i2cBusPi2c *) ctx;
+    for(i=0; i<n; i++) {
+	fd = i2cBusPi2cFd(p, msgs[i].addr);
+	if (fd < 0) return(-ENXIO);
+	if (msgs[i].flags & I2C_M_RD) {
+	    // only register reads, i.e. reads following a one byte write
+	    return(-EOPNOTSUPP);
+	}
+	if (i+1 < n && (msgs[i+1].flags & I2C_M_RD) && msgs[i+1].addr == msgs[i].addr && msgs[i].len == 1) {
+	    if (msgs[i+1].len > 255) return(-EINVAL);
+	    if (pi2cReadBytes(fd, msgs[i].buf[0], msgs[i+1].len, msgs[i+1].buf) < 0) return(-EIO);
+	    i ++;
+	} else {
+	    if (pi2cWrite(fd, msgs[i].buf, msgs[i].len) != msgs[i].len) return(-EIO);
+	}
+    }
+    return(n);
+}
+
+static const struct i2cBusBackend i2cBusPi2cBackend = {
+    i2cBusPi2cTransfer,
+};
+
+int i2cBusOpenPi2c(struct i2cBus *bus, char *path) {
+    struct i2cBusPi2c	*p;
+    int			i;
+
+    p = (struct i2cBusPi2c *) malloc(sizeof(*p));
+    if (p == NULL) return(-1);
+    p->path = path;
+    for(i=0; i<I2C_BUS_PI2C_ADDRESSES; i++) p->fd[i] = -1;
+    i2cBusInit(bus, &i2cBusPi2cBackend, p);
+    bus->maxRequests = 1;
+    return(0);
+}
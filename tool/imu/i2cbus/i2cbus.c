@@ -0,0 +1,345 @@
+/*
+  Bus owner batching I2C requests into I2C_RDWR transfers, see i2cbus.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "i2cbus.h"
+
+// task time of a bus without pending requests
+#define I2C_BUS_IDLE			1e12
+// wake up from timerfd takes up to this long
+#define I2C_BUS_WAKEUP_LATENCY		0.0001
+
+/////////////////////////////////////////////////////////////////////////
+// linux backend
+
+static int i2cBusLinuxTransfer(void *ctx, struct i2c_msg *msgs, int n) {
+    struct i2c_rdwr_ioctl_data	d;
+    int				*fd;
+
+    fd = (int *) ctx;
+    d.msgs = msgs;
+    d.nmsgs = n;
+    if (ioctl(*fd, I2C_RDWR, &d) < 0) return(-errno);
+    return(n);
+}
+
+static const struct i2cBusBackend i2cBusLinuxBackend = {
+    i2cBusLinuxTransfer,
+};
+
+int i2cBusOpen(struct i2cBus *bus, char *path) {
+    unsigned long	funcs;
+    int			fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+	printf("%s:%d: Can't open %s: %s\n", __FILE__, __LINE__, path, strerror(errno));
+	return(-1);
+    }
+    if (ioctl(fd, I2C_FUNCS, &funcs) < 0 || (funcs & I2C_FUNC_I2C) == 0) {
+	printf("%s:%d: %s does not support combined I2C transfers\n", __FILE__, __LINE__, path);
+	close(fd);
+	return(-1);
+    }
+    i2cBusInit(bus, &i2cBusLinuxBackend, NULL);
+    bus->fd = fd;
+    bus->ctx = &bus->fd;
+    return(0);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// queue
+
+void i2cBusInit(struct i2cBus *bus, const struct i2cBusBackend *backend, void *ctx) {
+    memset(bus, 0, sizeof(*bus));
+    bus->backend = backend;
+    bus->ctx = ctx;
+    bus->fd = -1;
+    bus->clock = I2C_BUS_DEFAULT_CLOCK;
+    bus->maxReads = I2C_BUS_MAX_MSGS;
+    bus->maxRequests = I2C_BUS_MAX_MSGS;
+    bus->task.name = "i2cbus";
+    bus->task.time = I2C_BUS_IDLE;
+    bus->windowStart = i2cSchedTime();
+}
+
+void i2cBusClose(struct i2cBus *bus) {
+    i2cBusFlush(bus);
+    if (bus->fd >= 0) close(bus->fd);
+    bus->fd = -1;
+}
+
+static void i2cBusUpdateTaskTime(struct i2cBus *bus) {
+    if (bus->queueCount == 0) {
+	bus->task.time = I2C_BUS_IDLE;
+    } else {
+	// leave time for one more transfer possibly in progress and for ours
+	bus->task.time = bus->queue[0]->deadline - 2 * bus->transferTimeAvg - I2C_BUS_WAKEUP_LATENCY;
+    }
+}
+
+int i2cBusSubmit(struct i2cBus *bus, struct i2cBusRequest *r) {
+    int i;
+
+    if (r->pending) {
+	printf("%s:%d: Request for 0x%02x submitted twice\n", __FILE__, __LINE__, r->address);
+	return(-1);
+    }
+    if (r->op == I2C_BUS_READ) {
+	if (r->len <= 0 || r->len > 0xffff || r->buf == NULL) return(-1);
+    } else {
+	if (r->len < 0 || r->len > I2C_BUS_MAX_WRITE || (r->reg < 0 && r->len == 0)) return(-1);
+	r->data[0] = r->reg;
+	if (r->len > 0) memcpy(r->data+1, r->buf, r->len);
+    }
+    if (bus->queueCount >= I2C_BUS_MAX_QUEUE) i2cBusFlush(bus);
+
+    r->submitted = i2cSchedTime();
+    r->status = 0;
+    r->pending = 1;
+    // keep the queue ordered by deadline, requests with equal deadlines in submission order
+    for(i=bus->queueCount; i>0 && bus->queue[i-1]->deadline > r->deadline; i--) bus->queue[i] = bus->queue[i-1];
+    bus->queue[i] = r;
+    bus->queueCount ++;
+    bus->requests ++;
+    if (i == 0) i2cBusUpdateTaskTime(bus);
+    return(0);
+}
+
+// Fill messages of a request. Returns the number of messages.
+static int i2cBusRequestMsgs(struct i2cBusRequest *r, struct i2c_msg *m) {
+    if (r->op == I2C_BUS_WRITE) {
+	m[0].addr = r->address;
+	m[0].flags = 0;
+	if (r->reg >= 0) {
+	    m[0].len = r->len + 1;
+	    m[0].buf = r->data;
+	} else {
+	    m[0].len = r->len;
+	    m[0].buf = r->data + 1;
+	}
+	return(1);
+    }
+    if (r->reg < 0) {
+	m[0].addr = r->address;
+	m[0].flags = I2C_M_RD;
+	m[0].len = r->len;
+	m[0].buf = r->buf;
+	return(1);
+    }
+    r->data[0] = r->reg;
+    m[0].addr = r->address;
+    m[0].flags = 0;
+    m[0].len = 1;
+    m[0].buf = r->data;
+    m[1].addr = r->address;
+    m[1].flags = I2C_M_RD;
+    m[1].len = r->len;
+    m[1].buf = r->buf;
+    return(2);
+}
+
+double i2cBusWireTime(struct i2cBus *bus, struct i2c_msg *msgs, int n) {
+    long	bits;
+    int		i;
+
+    // stop condition
+    bits = 1;
+    for(i=0; i<n; i++) {
+	// (repeated) start, address byte and ack, data bytes with acks
+	bits += 1 + 9 + 9 * msgs[i].len;
+    }
+    return(bits / bus->clock);
+}
+
+static int i2cBusTransfer(struct i2cBus *bus, struct i2c_msg *msgs, int n) {
+    double	t0, t;
+    int		i, r;
+
+    t0 = i2cSchedTime();
+    r = bus->backend->transfer(bus->ctx, msgs, n);
+    t = i2cSchedTime() - t0;
+
+    bus->transfers ++;
+    bus->messages += n;
+    for(i=0; i<n; i++) bus->bytes += msgs[i].len;
+    bus->wireTime += i2cBusWireTime(bus, msgs, n);
+    bus->transferTime += t;
+    if (bus->transferTimeAvg == 0) bus->transferTimeAvg = t;
+    bus->transferTimeAvg = 0.9 * bus->transferTimeAvg + 0.1 * t;
+    return(r);
+}
+
+int i2cBusFlush(struct i2cBus *bus) {
+    struct i2c_msg		msgs[I2C_BUS_MAX_MSGS];
+    struct i2cBusRequest	*batch[I2C_BUS_MAX_MSGS];
+    int				i, n, m, k, need, reads, r, failed;
+    double			now;
+
+    failed = 0;
+    while (bus->queueCount > 0) {
+	// take requests with the earliest deadlines fitting into one transfer
+	n = m = reads = 0;
+	while (n < bus->queueCount && n < bus->maxRequests && reads < bus->maxReads) {
+	    batch[n] = bus->queue[n];
+	    need = (batch[n]->op == I2C_BUS_READ && batch[n]->reg >= 0) ? 2 : 1;
+	    if (m + need > I2C_BUS_MAX_MSGS) break;
+	    if (batch[n]->op == I2C_BUS_READ) reads ++;
+	    m += i2cBusRequestMsgs(batch[n], &msgs[m]);
+	    n ++;
+	}
+
+	r = i2cBusTransfer(bus, msgs, m);
+	if (r == -EOPNOTSUPP && reads > 1) {
+	    printf("%s:%d: Info: the adapter accepts a read only as the last message of a transfer.\n", __FILE__, __LINE__);
+	    bus->maxReads = 1;
+	    continue;
+	}
+	if (r < 0 && n > 1) {
+	    // a device not acknowledging aborts the whole transfer, find which one
+	    for(i=0; i<n; i++) {
+		k = i2cBusRequestMsgs(batch[i], msgs);
+		batch[i]->status = i2cBusTransfer(bus, msgs, k) < 0 ? -1 : 0;
+	    }
+	} else {
+	    for(i=0; i<n; i++) batch[i]->status = r < 0 ? -1 : 0;
+	}
+
+	// remove the batch from the queue before callbacks, they may submit again
+	bus->queueCount -= n;
+	memmove(&bus->queue[0], &bus->queue[n], bus->queueCount * sizeof(bus->queue[0]));
+	now = i2cSchedTime();
+	for(i=0; i<n; i++) {
+	    batch[i]->completed = now;
+	    batch[i]->pending = 0;
+	    if (batch[i]->deadline > 0 && now > batch[i]->deadline) bus->deadlineMisses ++;
+	    if (batch[i]->status < 0) {
+		bus->errors ++;
+		failed ++;
+	    }
+	}
+	for(i=0; i<n; i++) {
+	    if (batch[i]->done != NULL) batch[i]->done(batch[i], batch[i]->status);
+	}
+    }
+    i2cBusUpdateTaskTime(bus);
+    return(failed);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// synchronous access
+
+static int i2cBusSync(struct i2cBus *bus, int op, int address, int reg, int len, uint8_t *buf) {
+    struct i2cBusRequest r;
+
+    memset(&r, 0, sizeof(r));
+    r.address = address;
+    r.op = op;
+    r.reg = reg;
+    r.len = len;
+    r.buf = buf;
+    r.deadline = 0;
+    if (i2cBusSubmit(bus, &r) < 0) return(-1);
+    i2cBusFlush(bus);
+    return(r.status);
+}
+
+int i2cBusRead(struct i2cBus *bus, int address, int reg, int len, uint8_t *buf) {
+    return(i2cBusSync(bus, I2C_BUS_READ, address, reg, len, buf));
+}
+
+int i2cBusWrite(struct i2cBus *bus, int address, int reg, int len, uint8_t *data) {
+    return(i2cBusSync(bus, I2C_BUS_WRITE, address, reg, len, data));
+}
+
+int i2cBusWriteByte(struct i2cBus *bus, int address, int reg, uint8_t value) {
+    return(i2cBusSync(bus, I2C_BUS_WRITE, address, reg, 1, &value));
+}
+
+/////////////////////////////////////////////////////////////////////////
+// scheduler tasks
+
+static int i2cBusTaskStep(struct i2cSchedTask *t, double now) {
+    struct i2cBus *bus;
+
+    bus = (struct i2cBus *) t->arg;
+    // failed requests are reported to their owners
+    i2cBusFlush(bus);
+    return(0);
+}
+
+void i2cBusTaskInit(struct i2cBus *bus) {
+    bus->task.step = i2cBusTaskStep;
+    bus->task.arg = bus;
+    i2cBusUpdateTaskTime(bus);
+}
+
+static void i2cBusPollDone(struct i2cBusRequest *r, int status) {
+    struct i2cBusPoll *p;
+
+    p = (struct i2cBusPoll *) r->arg;
+    if (status < 0) return;
+    p->samples ++;
+    if (p->callback != NULL) p->callback(p, r->completed, p->buf, r->len);
+}
+
+static int i2cBusPollStep(struct i2cSchedTask *t, double now) {
+    struct i2cBusPoll *p;
+
+    p = (struct i2cBusPoll *) t->arg;
+    if (p->req.pending) {
+	p->overruns ++;
+    } else {
+	p->req.deadline = now + p->deadline;
+	if (i2cBusSubmit(p->bus, &p->req) < 0) return(-1);
+    }
+    t->time += p->period;
+    // if we are behind, do not try to catch up
+    if (t->time < now) t->time = now + p->period;
+    return(0);
+}
+
+void i2cBusPollInit(struct i2cBusPoll *p, struct i2cBus *bus, int address, int reg, int len, double rate) {
+    memset(p, 0, sizeof(*p));
+    p->bus = bus;
+    p->period = 1.0 / rate;
+    p->deadline = p->period / 2;
+    p->req.address = address;
+    p->req.op = I2C_BUS_READ;
+    p->req.reg = reg;
+    p->req.len = len < I2C_BUS_MAX_POLL ? len : I2C_BUS_MAX_POLL;
+    p->req.buf = p->buf;
+    p->req.done = i2cBusPollDone;
+    p->req.arg = p;
+    p->task.name = "poll";
+    p->task.step = i2cBusPollStep;
+    p->task.arg = p;
+    p->task.time = i2cSchedTime();
+}
+
+void i2cBusReport(struct i2cBus *bus, FILE *ff) {
+    double now, elapsed;
+
+    now = i2cSchedTime();
+    elapsed = now - bus->windowStart;
+    if (elapsed <= 0) return;
+    fprintf(ff, "info: i2c bus: %.1f requests/s in %.1f transfers/s, %.1f messages/transfer, utilization %.2f%%, in ioctl %.2f%%, deadline misses %lld, errors %lld\n",
+	    bus->requests / elapsed, bus->transfers / elapsed, bus->transfers ? (double) bus->messages / bus->transfers : 0.0,
+	    100.0 * bus->wireTime / elapsed, 100.0 * bus->transferTime / elapsed, bus->deadlineMisses, bus->errors
+	);
+    fflush(ff);
+    bus->requests = bus->transfers = bus->messages = bus->bytes = 0;
+    bus->deadlineMisses = bus->errors = 0;
+    bus->wireTime = bus->transferTime = 0;
+    bus->windowStart = now;
+}
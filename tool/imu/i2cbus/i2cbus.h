@@ -0,0 +1,164 @@
+/*
+  Bus owner for one I2C adapter (/dev/i2c-N).
+
+  Drivers do not open the adapter themselves. They submit requests (a
+  register read or write on a device address) with a deadline. The bus
+  keeps the pending requests ordered by deadline and sends them with as
+  few I2C_RDWR ioctls as possible. One ioctl carries up to
+  I2C_BUS_MAX_MSGS messages from any number of devices, so the syscall is
+  paid once per batch instead of twice per register read (pi2c writes the
+  register address and reads the data in two syscalls and locks a
+  semaphore around them).
+
+  Each ioctl is atomic on the bus (messages are joined by repeated
+  starts), so no locking against other processes using the bus owner is
+  needed either. Tools not ported yet lock the bus with the pi2c
+  semaphores. A bus shared with them (-s) is opened with i2cBusOpenPi2c,
+  which sends each request with pi2c calls taking the semaphores.
+
+  The bus is flushed either synchronously (i2cBusRead/i2cBusWrite) or as
+  a task of the I2C scheduler (i2csched.h), which wakes up shortly before
+  the earliest pending deadline. Periodic register block reads
+  (struct i2cBusPoll) are scheduler tasks submitting requests, so polls of
+  several sensors released close together share one ioctl.
+
+  Bus utilization is accounted from the number of bits on the wire at
+  the configured bus clock.
+
+  Some adapters (i2c-bcm2835 of the Raspberry Pi) accept a read message
+  only as the last message of a transfer. The bus finds out on the first
+  rejected transfer and from then on ends every batch by its first read.
+
+  Times are CLOCK_MONOTONIC seconds as in i2csched.h.
+ */
+
+#ifndef I2CBUS_H
+#define I2CBUS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/i2c.h>
+
+#include "i2csched.h"
+
+// I2C_RDRW_IOCTL_MAX_MSGS of linux/i2c-dev.h
+#define I2C_BUS_MAX_MSGS		42
+#define I2C_BUS_MAX_QUEUE		64
+#define I2C_BUS_MAX_WRITE		16
+#define I2C_BUS_MAX_POLL		32
+
+#define I2C_BUS_DEFAULT_CLOCK		400000.0
+
+enum i2cBusOps {
+    I2C_BUS_READ,
+    I2C_BUS_WRITE,
+};
+
+struct i2cBusRequest {
+    int		address;
+    int		op;
+    // register address sent before data; -1 for none (plain command or read)
+    int		reg;
+    int		len;
+    // destination of a read
+    uint8_t	*buf;
+    // register address followed by data of a write, filled by submit
+    uint8_t	data[I2C_BUS_MAX_WRITE+1];
+    // 0 for as soon as possible
+    double	deadline;
+    // called after the transfer, status is 0 or -1
+    void	(*done)(struct i2cBusRequest *r, int status);
+    void	*arg;
+
+    // filled by the bus
+    double	submitted;
+    double	completed;
+    int		status;
+    int		pending;
+};
+
+struct i2cBusBackend {
+    // Perform messages as a single combined transfer. Returns n or -errno.
+    int (*transfer)(void *ctx, struct i2c_msg *msgs, int n);
+};
+
+struct i2cBus {
+    const struct i2cBusBackend	*backend;
+    void			*ctx;
+    int				fd;
+    double			clock;
+    // reads allowed in one transfer, 1 on adapters accepting a read only as the last message
+    int				maxReads;
+    // requests sent in one transfer, 1 on backends that can't send a transfer atomically
+    int				maxRequests;
+
+    // pending requests ordered by deadline
+    struct i2cBusRequest	*queue[I2C_BUS_MAX_QUEUE];
+    int				queueCount;
+
+    // scheduler task flushing the queue, see i2cBusTaskInit
+    struct i2cSchedTask		task;
+    // average duration of a transfer, used to wake up before deadlines
+    double			transferTimeAvg;
+
+    // statistics since the last report
+    long long			transfers;
+    long long			messages;
+    long long			requests;
+    long long			bytes;
+    long long			deadlineMisses;
+    long long			errors;
+    // estimated time the bus was driven, from bits on the wire
+    double			wireTime;
+    // time spent in transfers (ioctls)
+    double			transferTime;
+    double			windowStart;
+};
+
+// Periodic read of a register block, e.g. magnetometer data registers.
+struct i2cBusPoll {
+    struct i2cBus		*bus;
+    struct i2cSchedTask		task;
+    struct i2cBusRequest	req;
+    uint8_t			buf[I2C_BUS_MAX_POLL];
+    double			period;
+    // the read has to be finished this long after its release
+    double			deadline;
+    void			(*callback)(struct i2cBusPoll *p, double time, uint8_t *data, int len);
+    void			*arg;
+
+    long long			samples;
+    // releases skipped because the previous read was still pending
+    long long			overruns;
+};
+
+int i2cBusOpen(struct i2cBus *bus, char *path);
+void i2cBusInit(struct i2cBus *bus, const struct i2cBusBackend *backend, void *ctx);
+void i2cBusClose(struct i2cBus *bus);
+
+// Queue a request. Returns -1 if the request is invalid.
+int i2cBusSubmit(struct i2cBus *bus, struct i2cBusRequest *r);
+// Send all queued requests. Returns the number of failed requests.
+int i2cBusFlush(struct i2cBus *bus);
+
+// Synchronous access, pending requests are sent in the same batch. All return -1 on error.
+int i2cBusRead(struct i2cBus *bus, int address, int reg, int len, uint8_t *buf);
+int i2cBusWrite(struct i2cBus *bus, int address, int reg, int len, uint8_t *data);
+int i2cBusWriteByte(struct i2cBus *bus, int address, int reg, uint8_t value);
+
+// Make the bus a scheduler task flushing the queue before the earliest deadline.
+void i2cBusTaskInit(struct i2cBus *bus);
+void i2cBusPollInit(struct i2cBusPoll *p, struct i2cBus *bus, int address, int reg, int len, double rate);
+
+// Estimated time on the wire of a transfer.
+double i2cBusWireTime(struct i2cBus *bus, struct i2c_msg *msgs, int n);
+// Print statistics gathered since the last report and start a new window.
+void i2cBusReport(struct i2cBus *bus, FILE *ff);
+
+// i2cbus-pi2c.c, a bus shared with tools using pi2c; the caller does pi2cInit
+int i2cBusOpenPi2c(struct i2cBus *bus, char *path);
+
+// i2cdev-bus.c, struct i2cDev backend (synchronous) on a bus
+int i2cDevOpenBus(struct i2cDev *d, struct i2cBus *bus, int address);
+
+#endif
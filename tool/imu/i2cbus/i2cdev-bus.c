@@ -0,0 +1,41 @@
+/*
+  struct i2cDev backend on a bus owner (i2cbus.h). Transfers are
+  synchronous, so drivers timing conversions from the end of a command
+  (../baro) keep working. A register read is one ioctl instead of two and
+  requests queued by other devices go with it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "i2cbus.h"
+
+static int i2cBusDevCommand(void *ctx, uint8_t cmd) {
+    struct i2cDev *d = (struct i2cDev *) ctx;
+    return(i2cBusWrite(d->bus, d->address, cmd, 0, NULL));
+}
+
+static int i2cBusDevWriteReg(void *ctx, uint8_t reg, uint8_t value) {
+    struct i2cDev *d = (struct i2cDev *) ctx;
+    return(i2cBusWriteByte(d->bus, d->address, reg, value));
+}
+
+static int i2cBusDevReadReg(void *ctx, uint8_t reg, int len, uint8_t *buf) {
+    struct i2cDev *d = (struct i2cDev *) ctx;
+    return(i2cBusRead(d->bus, d->address, reg, len, buf));
+}
+
+static const struct i2cDevOps i2cBusDevOps = {
+    i2cBusDevCommand,
+    i2cBusDevWriteReg,
+    i2cBusDevReadReg,
+};
+
+int i2cDevOpenBus(struct i2cDev *d, struct i2cBus *bus, int address) {
+    d->ops = &i2cBusDevOps;
+    d->ctx = d;
+    d->fd = bus->fd;
+    d->address = address;
+    d->bus = bus;
+    return(0);
+}
@@ -0,0 +1,167 @@
+/*
+  Helpers shared by IMU drivers reading samples from the sensor's hardware
+  FIFO.
+
+  The sensor samples at its own output data rate (ODR). We wake up at a
+  lower rate, read all accumulated samples in one burst and reconstruct
+  their timestamps from the ODR. The sensor oscillator is not exact, so the
+  sample period is re-estimated from a long baseline and the phase is
+  slowly pulled toward the time of reading (a simple software PLL).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// fraction of the phase error corrected per burst
+#define IMU_FIFO_CLOCK_GAIN		0.1
+// re-anchor when the reconstructed time is off by more periods than this
+#define IMU_FIFO_CLOCK_MAX_ERROR	4.0
+// the estimated period may differ from the nominal one at most by this
+#define IMU_FIFO_CLOCK_TOLERANCE	0.1
+// number of samples after which the period estimate is used, the estimate
+// keeps improving as the baseline grows
+#define IMU_FIFO_CLOCK_BASELINE		100
+
+struct imuFifoClock {
+    double	nominalPeriod;
+    double	period;
+    // reconstructed time of the last sample returned
+    double	lastStamp;
+    int		anchored;
+    double	anchorTime;
+    long long	anchorSamples;
+    // residuals between reconstructed and observed time of the newest sample
+    double	residualSum2;
+    double	residualMax;
+    long	residualCount;
+};
+
+struct imuFifoStats {
+    double	startTime;
+    double	startCpu;
+    long long	samples;
+    long long	bursts;
+    long long	overflows;
+    // wakeup lateness against the scheduled deadline
+    double	latenessSum;
+    double	latenessSum2;
+    double	latenessMax;
+};
+
+static inline double imuFifoMonotonicTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static inline double imuFifoCpuTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static inline void imuFifoClockReset(struct imuFifoClock *c) {
+    c->anchored = 0;
+}
+
+static inline void imuFifoClockInit(struct imuFifoClock *c, double odr) {
+    memset(c, 0, sizeof(*c));
+    c->nominalPeriod = c->period = 1.0 / odr;
+}
+
+// n samples were read from the FIFO, readTime is the time when the FIFO
+// count was read. Returns the timestamp of the first (oldest) sample, the
+// k-th sample is at first + k * c->period.
+static inline double imuFifoClockBatch(struct imuFifoClock *c, int n, double readTime) {
+    double	newest, predicted, residual, p;
+
+    if (n <= 0) return(c->lastStamp);
+
+    // the newest sample was taken somewhere within the last period
+    newest = readTime - 0.5 * c->period;
+    predicted = c->lastStamp + n * c->period;
+    residual = newest - predicted;
+
+    if (! c->anchored || fabs(residual) > IMU_FIFO_CLOCK_MAX_ERROR * c->period) {
+	c->anchored = 1;
+	c->anchorTime = newest;
+	c->anchorSamples = 0;
+	c->lastStamp = newest - n * c->period;
+    } else {
+	c->residualSum2 += residual * residual;
+	if (fabs(residual) > c->residualMax) c->residualMax = fabs(residual);
+	c->residualCount ++;
+	c->lastStamp += IMU_FIFO_CLOCK_GAIN * residual;
+	c->anchorSamples += n;
+	if (c->anchorSamples >= IMU_FIFO_CLOCK_BASELINE) {
+	    p = (newest - c->anchorTime) / c->anchorSamples;
+	    if (fabs(p - c->nominalPeriod) < IMU_FIFO_CLOCK_TOLERANCE * c->nominalPeriod) c->period = p;
+	}
+    }
+
+    p = c->lastStamp + c->period;
+    c->lastStamp += n * c->period;
+    return(p);
+}
+
+static inline void imuFifoStatsInit(struct imuFifoStats *s) {
+    memset(s, 0, sizeof(*s));
+    s->startTime = imuFifoMonotonicTime();
+    s->startCpu = imuFifoCpuTime();
+}
+
+static inline void imuFifoStatsBurst(struct imuFifoStats *s, int n, double lateness) {
+    s->samples += n;
+    s->bursts ++;
+    s->latenessSum += lateness;
+    s->latenessSum2 += lateness * lateness;
+    if (lateness > s->latenessMax) s->latenessMax = lateness;
+}
+
+// Print statistics gathered since the last report and start a new window.
+static inline void imuFifoStatsReport(struct imuFifoStats *s, struct imuFifoClock *c, FILE *ff, const char *name) {
+    double	t, cpu, elapsed, avg, dev;
+
+    t = imuFifoMonotonicTime();
+    cpu = imuFifoCpuTime();
+    elapsed = t - s->startTime;
+    if (elapsed <= 0 || s->bursts == 0) return;
+
+    avg = s->latenessSum / s->bursts;
+    dev = sqrt(fmax(0, s->latenessSum2 / s->bursts - avg * avg));
+    fprintf(ff, "info: %s: rate %.1f Hz (odr %.1f Hz), %.1f samples/burst, wakeup jitter avg %.0f us dev %.0f us max %.0f us, ",
+	    name, s->samples / elapsed, 1.0 / c->period, (double)s->samples / s->bursts,
+	    avg * 1e6, dev * 1e6, s->latenessMax * 1e6
+	);
+    fprintf(ff, "timestamp residual rms %.0f us max %.0f us, overflows %lld, cpu %.1f%%\n",
+	    c->residualCount ? sqrt(c->residualSum2 / c->residualCount) * 1e6 : 0.0, c->residualMax * 1e6,
+	    s->overflows, 100.0 * (cpu - s->startCpu) / elapsed
+	);
+    fflush(ff);
+
+    imuFifoStatsInit(s);
+    c->residualSum2 = c->residualMax = 0;
+    c->residualCount = 0;
+}
+
+// Sleep until the absolute CLOCK_MONOTONIC deadline and advance it by period.
+// Returns how late we woke up.
+static inline double imuFifoSleep(struct timespec *deadline, long periodNs) {
+    struct timespec	now;
+    double		lateness;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) != 0) ;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lateness = (now.tv_sec - deadline->tv_sec) + (now.tv_nsec - deadline->tv_nsec) / 1000000000.0;
+
+    deadline->tv_nsec += periodNs;
+    while (deadline->tv_nsec >= 1000000000) {
+	deadline->tv_nsec -= 1000000000;
+	deadline->tv_sec ++;
+    }
+    // if we are far behind (e.g. process was stopped), do not try to catch up
+    if (lateness > 0.1) *deadline = now;
+    return(lateness);
+}
@@ -6,13 +6,11 @@
 #include <string.h>
 #include <signal.h>
 
-#include "Fusion.h"
 #include "pi2c.h"
 #include "MPU6050.h"
 
-#ifdef SHM
-#include "raspilotshm.h"
-#endif
+#include "sensorbus.h"
+#include "ahrs.h"
 
 static inline double doubleGetTime() {
   struct timespec tt;
@@ -27,7 +25,8 @@ static void taskStop(int signum) {
 
 int main(int argc, char **argv) {
     double 	t0, t1, samplePeriod;
-    FusionAhrs 	ahrs;
+    struct ahrs	ahrs;
+    struct ahrsOutput	out;
     int		i, usleepTime;
     int16_t 	AcX,AcY,AcZ,GyX,GyY,GyZ,MgX,MgY,MgZ;
 
@@ -36,10 +35,8 @@ int main(int argc, char **argv) {
     double	optRate;
     double	rpy[3];    
 
-#ifdef SHM
-    struct raspilotInputBuffer 	*shmbuf;
-    struct raspilotInputBuffer 	*shmbuf2;
-#endif
+    struct sensorBusChannel 	*busrpy;
+    struct sensorBusChannel 	*busrpy2;
 
     optSharedI2cFlag = 0;
     optI2cPath = (char*)"/dev/i2c-1";
@@ -70,11 +67,11 @@ int main(int argc, char **argv) {
     // MPU6050_write_reg (0x37, 2);
     // MPU6050_write_reg (0x6B, 0);
     
-#ifdef SHM
-    shmbuf = raspilotShmConnect((char *)"raspilot.gyro-mpu6050-magwick-shm.rpy");
-    shmbuf2 = raspilotShmConnect((char *)"raspilot.gyro-mpu6050-magwick-shm.rpy2");
-    if (shmbuf == NULL) exit(-1);
-#endif
+    busrpy = sensorBusOpen("raspilot.gyro-mpu6050-magwick-shm.rpy", SENSOR_BUS_RPY);
+    if (busrpy == NULL) exit(-1);
+    // the second copy is for a second shared memory consumer, it would only duplicate text lines
+    busrpy2 = NULL;
+    if (sensorBusMode != SENSOR_BUS_TEXT) busrpy2 = sensorBusOpen("raspilot.gyro-mpu6050-magwick-shm.rpy2", SENSOR_BUS_RPY);
     
     signal(SIGINT, taskStop);
   
@@ -84,7 +81,7 @@ int main(int argc, char **argv) {
     mpu.setDLPFMode(0);
     mpu.setFullScaleGyroRange(MPU6050_GYRO_FS_250);
     mpu.setFullScaleAccelRange(MPU6050_ACCEL_FS_2);
-    FusionAhrsInitialise(&ahrs);
+    ahrsInit(&ahrs, AHRS_MADGWICK);
     
     usleepTime = 1000000 / optRate;
     usleep(usleepTime);
@@ -92,39 +89,32 @@ int main(int argc, char **argv) {
     t0 = doubleGetTime();
     i = 0;
     for(;;) {
-        FusionVector gyroscope = {0.0f, 0.0f, 0.0f};     // replace this with actual gyroscope data in degrees/s
-        FusionVector accelerometer = {0.0f, 0.0f, 1.0f}; // replace this with actual accelerometer data in g
-	double temp;
+	float	gyroscope[3];		// degrees/s
+	float	accelerometer[3];	// g
 
 	mpu.getMotion6(&AcX, &AcY, &AcZ, &GyX, &GyY, &GyZ);
-	accelerometer.axis.x = AcX / 16384.0; 
-	accelerometer.axis.y = AcY / 16384.0; 
-	accelerometer.axis.z = AcZ / 16384.0; 
-	gyroscope.axis.x = GyX /  131.0;
-	gyroscope.axis.y = GyY / 131.0;
-	gyroscope.axis.z = GyZ / 131.0;
+	accelerometer[0] = AcX / 16384.0; 
+	accelerometer[1] = AcY / 16384.0; 
+	accelerometer[2] = AcZ / 16384.0; 
+	gyroscope[0] = GyX /  131.0;
+	gyroscope[1] = GyY / 131.0;
+	gyroscope[2] = GyZ / 131.0;
 	
 	t1 = doubleGetTime();
 	samplePeriod = t1 - t0;
-        FusionAhrsUpdateNoMagnetometer(&ahrs, gyroscope, accelerometer, samplePeriod);
-        const FusionEuler euler = FusionQuaternionToEuler(FusionAhrsGetQuaternion(&ahrs));
+	ahrsUpdate(&ahrs, gyroscope, accelerometer, samplePeriod);
+	ahrsGetOutput(&ahrs, &out);
 
 	// pitch - negative == nose down;      positive == nose up
 	// roll  - negative == left wing down; positive == left wing up
 	// yaw   - positive == rotated counterclockwise (view from up)
-	rpy[0] = euler.angle.pitch*M_PI/180.0;
-	rpy[1] = euler.angle.roll*M_PI/180.0;
-	rpy[2] = euler.angle.yaw*M_PI/180.0;
+	rpy[0] = out.rpy[1];
+	rpy[1] = out.rpy[0];
+	rpy[2] = out.rpy[2];
 	
-#ifdef SHM
-	shmbuf->confidence = 1.0;
-	if (raspilotShmPush(shmbuf, t1, rpy, 3) != 0) taskStop(0);
-	if (shmbuf2 != NULL) if (raspilotShmPush(shmbuf2, t1, rpy, 3) != 0) taskStop(0);
+	if (sensorBusPublish(busrpy, t1, 1.0, rpy) != 0) taskStop(0);
+	if (busrpy2 != NULL) if (sensorBusPublish(busrpy2, t1, 1.0, rpy) != 0) taskStop(0);
 	// printf("debug: rpy %g: %9.7f %9.7f %9.7f\n", t1, rpy[0], rpy[1], rpy[2]);
-#else
-	printf("rpy %9.7f %9.7f %9.7f\n", rpy[0], rpy[1], rpy[2]);
-	fflush(stdout);
-#endif	
 	// The original stuff printed by fusion
 	//printf("T:%6.4f: Roll %7.2f, Pitch %7.2f, Yaw %7.2f\n", samplePeriod, euler.angle.roll, euler.angle.pitch, euler.angle.yaw);
 
@@ -7,6 +7,7 @@
 #include <sys/time.h>
 #include "pi2c.h"
 #include "MPU6050_6Axis_MotionApps20.h"
+#include "sensorbus.h"
 
 // class default I2C address is 0x68
 // specific I2C addresses may be passed as a parameter here
@@ -14,6 +15,9 @@
 // AD0 high = 0x69
 MPU6050 mpu;
 
+struct sensorBusChannel *busquat;
+struct sensorBusChannel *busrpy;
+
 // uncomment "OUTPUT_READABLE_QUATERNION" if you want to see the actual
 // quaternion components in a [w, x, y, z] format (not best for parsing
 // on a remote host such as Processing or something though)
@@ -104,6 +108,12 @@ static void setup(int argc, char **argv) {
   }
 
   if (optSharedI2cFlag) pi2cInit(i2cpath, optSharedI2cFlag);
+
+  // loop() flushes text output once per packet
+  sensorBusTextAutoFlush = 0;
+  busquat = sensorBusOpen("raspilot.gyro-mpu6050-dmp.quat", SENSOR_BUS_QUATERNION);
+  busrpy = sensorBusOpen("raspilot.gyro-mpu6050-dmp.rpy", SENSOR_BUS_RPY);
+  if (busquat == NULL || busrpy == NULL) exit(-1);
   
   // initialize device
   printf("Initializing I2C devices...\n");
@@ -175,6 +185,10 @@ static void setup(int argc, char **argv) {
 static int ncount = 0;
 
 static int loop() {
+  double quat[4];
+  double rpy[3];
+  double t;
+
   // if programming failed, don't try to do anything
   if (!dmpReady) return(0);
   // get current FIFO count
@@ -190,6 +204,7 @@ static int loop() {
   } else if (fifoCount >= 42) {
     // read a packet from FIFO
     mpu.getFIFOBytes(fifoBuffer, packetSize);
+    t = sensorBusCurrentTime();
 
 #if 0
     // I've added this for calibration
@@ -216,7 +231,10 @@ static int loop() {
       //       I
       //   o   I
       //holes  pins     
-      printf("quat %9.7f %9.7f %9.7f %9.7f\n", -q.y, q.x, q.z, q.w);
+      quat[0] = -q.y;
+      quat[1] = q.x;
+      quat[2] = q.z;
+      quat[3] = q.w;
 #elif 1
       // This is for the following orientation of MPU development board:
       //    front of the drone
@@ -225,18 +243,25 @@ static int loop() {
       //   I   
       //   I   o
       // pins holes
-      printf("quat %9.7f %9.7f %9.7f %9.7f\n", q.y, -q.x, q.z, q.w);
+      quat[0] = q.y;
+      quat[1] = -q.x;
+      quat[2] = q.z;
+      quat[3] = q.w;
 #endif
+      sensorBusPublish(busquat, t, 1.0, quat);
     }
     
     if (printRpy) {
       mpu.dmpGetGravity(&gravity, &q);
       mpu.dmpGetYawPitchRoll(ypr, &q, &gravity);
-      printf("rpy %9.7f %9.7f %9.7f\n", -ypr[1], ypr[2], -ypr[0]);
+      rpy[0] = -ypr[1];
+      rpy[1] = ypr[2];
+      rpy[2] = -ypr[0];
+      sensorBusPublish(busrpy, t, 1.0, rpy);
     }    
     
     
-    fflush(stdout);
+    sensorBusFlush();
     ncount ++;
     return(1);
   }
@@ -0,0 +1,154 @@
+/*
+  Synthetic IMU motion for tests and benchmarks of ../ahrs. The true
+  attitude is a smooth function of time (swinging roll and pitch, slowly
+  turning yaw). Gyroscope samples are the exact mean body rates over each
+  sample period, accelerometer samples are the gravity plus a small linear
+  acceleration in body frame. Both get noise and an optional gyroscope
+  bias and are quantized to MPU6050 counts (+-250dps, +-2g), float samples
+  are converted from counts like the tools do.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../ahrs/ahrs.h"
+
+#define AHRS_MOTION_GYRO_COUNTS		131.0
+#define AHRS_MOTION_ACCEL_COUNTS	16384.0
+
+struct ahrsMotion {
+    int				n;
+    double			rate;
+    struct ahrsSample		*samples;
+    struct ahrsRawSample	*raw;
+    // true attitude (w, x, y, z) at each sample and its roll, pitch, yaw in radians
+    double			(*truth)[4];
+    double			(*truthRpy)[3];
+};
+
+struct ahrsMotionParams {
+    double	rollAmplitude;
+    double	pitchAmplitude;
+    double	yawRate;
+    // roll and pitch swing frequencies in Hz
+    double	frequency;
+    // linear acceleration amplitude in g
+    double	linearAcceleration;
+    double	gyroBias;
+    double	gyroNoise;
+    double	accelNoise;
+};
+
+static double ahrsMotionGaussian() {
+    double u, v;
+    u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return(sqrt(-2 * log(u)) * cos(2 * M_PI * v));
+}
+
+static void ahrsMotionQuaternion(double roll, double pitch, double yaw, double q[4]) {
+    double cr, sr, cp, sp, cy, sy;
+
+    cr = cos(roll / 2); sr = sin(roll / 2);
+    cp = cos(pitch / 2); sp = sin(pitch / 2);
+    cy = cos(yaw / 2); sy = sin(yaw / 2);
+    q[0] = cr * cp * cy + sr * sp * sy;
+    q[1] = sr * cp * cy - cr * sp * sy;
+    q[2] = cr * sp * cy + sr * cp * sy;
+    q[3] = cr * cp * sy - sr * sp * cy;
+}
+
+static void ahrsMotionAttitude(struct ahrsMotionParams *p, double t, double rpy[3]) {
+    rpy[0] = p->rollAmplitude * sin(2 * M_PI * p->frequency * t) * sin(2 * M_PI * 0.05 * t);
+    rpy[1] = p->pitchAmplitude * sin(2 * M_PI * p->frequency * 0.77 * t + 1);
+    rpy[2] = remainder(p->yawRate * t, 2 * M_PI);
+}
+
+// rotate earth frame vector v into body frame of attitude q
+static void ahrsMotionToBody(double q[4], double v[3], double r[3]) {
+    double w, x, y, z;
+
+    w = q[0]; x = q[1]; y = q[2]; z = q[3];
+    r[0] = (1 - 2*(y*y + z*z)) * v[0] + 2*(x*y + w*z) * v[1] + 2*(x*z - w*y) * v[2];
+    r[1] = 2*(x*y - w*z) * v[0] + (1 - 2*(x*x + z*z)) * v[1] + 2*(y*z + w*x) * v[2];
+    r[2] = 2*(x*z + w*y) * v[0] + 2*(y*z - w*x) * v[1] + (1 - 2*(x*x + y*y)) * v[2];
+}
+
+static int16_t ahrsMotionCounts(double v) {
+    v = floor(v + 0.5);
+    if (v > 32767) v = 32767;
+    if (v < -32768) v = -32768;
+    return((int16_t) v);
+}
+
+static void ahrsMotionGenerate(struct ahrsMotion *m, struct ahrsMotionParams *p, double seconds, double rate, unsigned seed) {
+    double	q0[4], q1[4], d[4], rpy[3], t, dt, s, angle, g[3], acc[3], lin[3], linBody[3];
+    int		i, j;
+
+    srand(seed);
+    m->rate = rate;
+    m->n = seconds * rate;
+    m->samples = (struct ahrsSample *) calloc(m->n, sizeof(*m->samples));
+    m->raw = (struct ahrsRawSample *) calloc(m->n, sizeof(*m->raw));
+    m->truth = (double (*)[4]) calloc(m->n, sizeof(*m->truth));
+    m->truthRpy = (double (*)[3]) calloc(m->n, sizeof(*m->truthRpy));
+    dt = 1.0 / rate;
+    ahrsMotionAttitude(p, 0, rpy);
+    ahrsMotionQuaternion(rpy[0], rpy[1], rpy[2], q0);
+    for(i=0; i<m->n; i++) {
+	t = (i + 1) * dt;
+	ahrsMotionAttitude(p, t, rpy);
+	ahrsMotionQuaternion(rpy[0], rpy[1], rpy[2], q1);
+	// body rate: q1 = q0 * d
+	d[0] = q0[0]*q1[0] + q0[1]*q1[1] + q0[2]*q1[2] + q0[3]*q1[3];
+	d[1] = q0[0]*q1[1] - q0[1]*q1[0] - q0[2]*q1[3] + q0[3]*q1[2];
+	d[2] = q0[0]*q1[2] + q0[1]*q1[3] - q0[2]*q1[0] - q0[3]*q1[1];
+	d[3] = q0[0]*q1[3] - q0[1]*q1[2] + q0[2]*q1[1] - q0[3]*q1[0];
+	if (d[0] < 0) for(j=0; j<4; j++) d[j] = -d[j];
+	s = sqrt(d[1]*d[1] + d[2]*d[2] + d[3]*d[3]);
+	angle = 2 * atan2(s, d[0]);
+	for(j=0; j<3; j++) g[j] = s == 0 ? 0 : d[j+1] / s * angle / dt * 180 / M_PI;
+
+	// gravity (up) and linear acceleration in body frame
+	acc[0] = 2 * (q1[1]*q1[3] - q1[0]*q1[2]);
+	acc[1] = 2 * (q1[2]*q1[3] + q1[0]*q1[1]);
+	acc[2] = 2 * (q1[0]*q1[0] - 0.5 + q1[3]*q1[3]);
+	lin[0] = p->linearAcceleration * sin(2 * M_PI * 0.7 * t);
+	lin[1] = p->linearAcceleration * cos(2 * M_PI * 0.4 * t);
+	lin[2] = p->linearAcceleration * 0.5 * sin(2 * M_PI * 1.3 * t);
+	ahrsMotionToBody(q1, lin, linBody);
+
+	m->raw[i].timestamp = m->samples[i].timestamp = 1700000000.0 + t;
+	m->raw[i].deltaTime = AHRS_FIXED_SECONDS(dt);
+	m->samples[i].deltaTime = dt;
+	for(j=0; j<3; j++) {
+	    m->raw[i].gyroscope[j] = ahrsMotionCounts((g[j] + p->gyroBias + p->gyroNoise * ahrsMotionGaussian()) * AHRS_MOTION_GYRO_COUNTS);
+	    m->raw[i].accelerometer[j] = ahrsMotionCounts((acc[j] + linBody[j] + p->accelNoise * ahrsMotionGaussian()) * AHRS_MOTION_ACCEL_COUNTS);
+	    m->samples[i].gyroscope[j] = m->raw[i].gyroscope[j] / AHRS_MOTION_GYRO_COUNTS;
+	    m->samples[i].accelerometer[j] = m->raw[i].accelerometer[j] / AHRS_MOTION_ACCEL_COUNTS;
+	}
+	memcpy(m->truth[i], q1, sizeof(q1));
+	memcpy(m->truthRpy[i], rpy, sizeof(rpy));
+	memcpy(q0, q1, sizeof(q0));
+    }
+}
+
+static void ahrsMotionFree(struct ahrsMotion *m) {
+    free(m->samples);
+    free(m->raw);
+    free(m->truth);
+    free(m->truthRpy);
+}
+
+static void ahrsMotionDefaultParams(struct ahrsMotionParams *p) {
+    memset(p, 0, sizeof(*p));
+    p->rollAmplitude = 40 * M_PI / 180;
+    p->pitchAmplitude = 30 * M_PI / 180;
+    p->yawRate = 20 * M_PI / 180;
+    p->frequency = 0.5;
+    p->linearAcceleration = 0.05;
+    p->gyroNoise = 0.05;
+    p->accelNoise = 0.003;
+}
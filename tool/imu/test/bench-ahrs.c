@@ -0,0 +1,103 @@
+/*
+  Benchmark of the AHRS filters. Time per sample of Madgwick and Mahony
+  in float and fixed point, updated sample by sample (as the tools did
+  with Fusion) and in FIFO sized batches, without outputs and with the
+  rpy/lacc/eacc outputs published by the tools.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "ahrs-motion.h"
+
+#define RATE		1000.0
+#define SECONDS		20
+#define REPEAT		5
+// samples per FIFO read, MPU6050 FIFO holds 1024 bytes = 85 samples
+#define FIFO_SAMPLES	85
+
+static struct ahrsMotion	m;
+static struct ahrsOutput	*out;
+static volatile float		sink;
+
+static double monotonicTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static double runFloat(int algorithm, int batch, int outputs) {
+    struct ahrs		a;
+    double		t0, best;
+    int			r, i, k;
+
+    best = 1e9;
+    for(r=0; r<REPEAT; r++) {
+	ahrsInit(&a, algorithm);
+	t0 = monotonicTime();
+	if (batch) {
+	    for(i=0; i<m.n; i+=k) {
+		k = m.n - i < FIFO_SAMPLES ? m.n - i : FIFO_SAMPLES;
+		ahrsUpdateBatch(&a, m.samples + i, k, outputs ? out + i : NULL);
+	    }
+	} else {
+	    for(i=0; i<m.n; i++) {
+		ahrsUpdate(&a, m.samples[i].gyroscope, m.samples[i].accelerometer, m.samples[i].deltaTime);
+		if (outputs) ahrsGetOutput(&a, &out[i]);
+	    }
+	}
+	best = fmin(best, monotonicTime() - t0);
+	sink = a.q[0];
+    }
+    return(best / m.n * 1e9);
+}
+
+static double runFixed(int algorithm, int batch, int outputs) {
+    struct ahrsFixed	a;
+    double		t0, best;
+    int			r, i, k;
+
+    best = 1e9;
+    for(r=0; r<REPEAT; r++) {
+	ahrsFixedInit(&a, algorithm, AHRS_MOTION_GYRO_COUNTS, AHRS_MOTION_ACCEL_COUNTS);
+	t0 = monotonicTime();
+	if (batch) {
+	    for(i=0; i<m.n; i+=k) {
+		k = m.n - i < FIFO_SAMPLES ? m.n - i : FIFO_SAMPLES;
+		ahrsFixedUpdateBatch(&a, m.raw + i, k, outputs ? out + i : NULL);
+	    }
+	} else {
+	    for(i=0; i<m.n; i++) {
+		ahrsFixedUpdate(&a, m.raw[i].gyroscope, m.raw[i].accelerometer, m.raw[i].deltaTime);
+		if (outputs) ahrsFixedGetOutput(&a, &out[i]);
+	    }
+	}
+	best = fmin(best, monotonicTime() - t0);
+	sink = a.q[0];
+    }
+    return(best / m.n * 1e9);
+}
+
+int main() {
+    struct ahrsMotionParams	p;
+    const char			*names[] = {"madgwick", "mahony"};
+    int				alg, outputs;
+
+    ahrsMotionDefaultParams(&p);
+    ahrsMotionGenerate(&m, &p, SECONDS, RATE, 1);
+    out = (struct ahrsOutput *) calloc(m.n, sizeof(*out));
+    printf("%d samples, batches of %d, ns per sample:\n", m.n, FIFO_SAMPLES);
+    printf("%-8s %-8s %10s %10s %10s %10s\n", "filter", "outputs", "float", "float", "fixed", "fixed");
+    printf("%-8s %-8s %10s %10s %10s %10s\n", "", "", "single", "batch", "single", "batch");
+    for(outputs=0; outputs<2; outputs++) {
+	for(alg=AHRS_MADGWICK; alg<=AHRS_MAHONY; alg++) {
+	    printf("%-8s %-8s %10.1f %10.1f %10.1f %10.1f\n", names[alg], outputs ? "yes" : "no",
+		   runFloat(alg, 0, outputs), runFloat(alg, 1, outputs), runFixed(alg, 0, outputs), runFixed(alg, 1, outputs));
+	}
+    }
+    free(out);
+    ahrsMotionFree(&m);
+    return(0);
+}
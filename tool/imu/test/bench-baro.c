@@ -0,0 +1,114 @@
+/*
+  Benchmark of barometer drivers on the mock I2C backend (each transfer
+  takes 100us of bus time, conversions take the datasheet time).
+
+  blocking:	the previous way, temperature and pressure for each sample,
+		usleep for each conversion (10ms for MS5611 OSR 4096 as in the
+		MS5611 library, 5ms and 26ms for BMP180 as in gy-87/bmp180.c).
+  event:	../baro state machine on the I2C scheduler, temperature every
+		10th pressure sample, as fast as possible.
+
+  Reports pressure sample rate, latency from the end of the pressure
+  conversion to the sample being available and CPU use.
+
+  usage: bench-baro [<seconds>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mock-baro.h"
+
+#define TRANSFER_TIME	0.0001
+
+struct benchResult {
+    long long	samples;
+    double	latencySum;
+    double	latencyMax;
+};
+
+static struct mockBaro	mock;
+
+static void account(struct benchResult *r) {
+    double latency;
+
+    latency = i2cSchedTime() - mock.conversionEnd;
+    r->samples ++;
+    r->latencySum += latency;
+    if (latency > r->latencyMax) r->latencyMax = latency;
+}
+
+static void report(const char *name, struct benchResult *r, double seconds, double cpu) {
+    printf("%-20s: %6.1f Hz, latency avg %5.0f us max %5.0f us, cpu %.2f%%, early reads %lld\n",
+	   name, r->samples / seconds, r->samples ? r->latencySum / r->samples * 1e6 : 0.0,
+	   r->latencyMax * 1e6, 100.0 * cpu / seconds, mock.earlyReads);
+}
+
+static void blocking(const char *name, int chip, double seconds) {
+    struct benchResult	r = {0};
+    struct i2cDev	dev;
+    uint8_t		buf[3];
+    double		t0, cpu0;
+
+    mockBaroInit(&mock, &dev, chip, TRANSFER_TIME);
+    t0 = i2cSchedTime();
+    cpu0 = i2cSchedCpuTime();
+    while (i2cSchedTime() - t0 < seconds) {
+	if (chip == BARO_MS5611) {
+	    i2cDevCommand(&dev, 0x58);
+	    usleep(10000);
+	    i2cDevReadReg(&dev, 0x00, 3, buf);
+	    i2cDevCommand(&dev, 0x48);
+	    usleep(10000);
+	    i2cDevReadReg(&dev, 0x00, 3, buf);
+	} else {
+	    i2cDevWriteReg(&dev, 0xF4, 0x2E);
+	    usleep(5000);
+	    i2cDevReadReg(&dev, 0xF6, 2, buf);
+	    i2cDevWriteReg(&dev, 0xF4, 0xF4);
+	    usleep(26000);
+	    i2cDevReadReg(&dev, 0xF6, 3, buf);
+	}
+	account(&r);
+    }
+    report(name, &r, seconds, i2cSchedCpuTime() - cpu0);
+}
+
+static void eventCallback(struct baro *b, struct baroSample *s) {
+    account((struct benchResult *) b->arg);
+}
+
+static void event(const char *name, int chip, double seconds) {
+    struct benchResult	r = {0};
+    struct i2cSched	s;
+    struct i2cDev	dev;
+    struct baro		b;
+    double		t0, cpu0;
+
+    mockBaroInit(&mock, &dev, chip, TRANSFER_TIME);
+    i2cSchedInit(&s);
+    baroInit(&b, chip, &dev, 0, -1, 10);
+    b.callback = eventCallback;
+    b.arg = &r;
+    i2cSchedAdd(&s, &b.task);
+    t0 = i2cSchedTime();
+    cpu0 = i2cSchedCpuTime();
+    while (i2cSchedTime() - t0 < seconds) {
+	if (i2cSchedRunOnce(&s) < 0) break;
+    }
+    report(name, &r, seconds, i2cSchedCpuTime() - cpu0);
+    i2cSchedClose(&s);
+}
+
+int main(int argc, char **argv) {
+    double seconds;
+
+    seconds = 3;
+    if (argc > 1) seconds = strtod(argv[1], NULL);
+
+    blocking("ms5611 blocking", BARO_MS5611, seconds);
+    event("ms5611 event", BARO_MS5611, seconds);
+    blocking("bmp180 blocking", BARO_BMP180, seconds);
+    event("bmp180 event", BARO_BMP180, seconds);
+    return(0);
+}
@@ -0,0 +1,112 @@
+/*
+  Benchmark of I2C transactions per second on the fake adapter. A
+  transaction is a 6 byte register block read, as of a magnetometer or
+  an accelerometer, from one of 8 devices.
+
+  pi2c:		register address and data in two transfers with a process
+		shared semaphore around them, as pi2cReadBytes does
+  rdwr:		i2cBusRead, both messages in one I2C_RDWR transfer
+  batched:	8 reads (one per device) submitted, then flushed together
+  read-last:	batched on an adapter accepting a read only as the last
+		message (i2c-bcm2835), i.e. one read per transfer
+
+  Adapters: "cpu" has no transfer cost, so only the software overhead is
+  measured. "syscall" costs 20us per transfer (the ioctl and the driver
+  setting up the controller). "400kHz" adds the time on the wire.
+
+  usage: bench-i2cbus [<seconds>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <semaphore.h>
+
+#include "fake-i2c.h"
+
+#define DEVICES		8
+#define BLOCK		6
+
+enum benchModes {
+    BENCH_PI2C,
+    BENCH_RDWR,
+    BENCH_BATCHED,
+    BENCH_READ_LAST,
+};
+
+static const char	*modeNames[] = {"pi2c", "rdwr", "batched", "read-last"};
+static sem_t		busSemaphore;
+
+static void pi2cStyleRead(struct fakeI2c *f, int address, uint8_t reg, uint8_t *buf) {
+    struct i2c_msg m;
+
+    sem_wait(&busSemaphore);
+    m.addr = address;
+    m.flags = 0;
+    m.len = 1;
+    m.buf = &reg;
+    fakeI2cTransfer(f, &m, 1);
+    m.flags = I2C_M_RD;
+    m.len = BLOCK;
+    m.buf = buf;
+    fakeI2cTransfer(f, &m, 1);
+    sem_post(&busSemaphore);
+}
+
+static void bench(const char *adapter, double overhead, double clock, int mode, double seconds) {
+    struct fakeI2c		f;
+    struct i2cBus		bus;
+    struct i2cBusRequest	r[DEVICES];
+    uint8_t			buf[DEVICES][BLOCK];
+    long long			transactions;
+    double			t0, t;
+    int				i;
+
+    fakeI2cInit(&f, overhead, clock);
+    f.readLastOnly = (mode == BENCH_READ_LAST);
+    for(i=0; i<DEVICES; i++) fakeI2cAddDevice(&f, 0x10 + i);
+    fakeI2cBusInit(&bus, &f);
+    memset(r, 0, sizeof(r));
+    for(i=0; i<DEVICES; i++) {
+	r[i].address = 0x10 + i;
+	r[i].op = I2C_BUS_READ;
+	r[i].reg = 0x03;
+	r[i].len = BLOCK;
+	r[i].buf = buf[i];
+    }
+
+    transactions = 0;
+    t0 = i2cSchedTime();
+    do {
+	// check time only every 8 transactions to keep it out of the measurement
+	for(i=0; i<DEVICES; i++) {
+	    if (mode == BENCH_PI2C) {
+		pi2cStyleRead(&f, 0x10 + i, 0x03, buf[i]);
+	    } else if (mode == BENCH_RDWR) {
+		i2cBusRead(&bus, 0x10 + i, 0x03, BLOCK, buf[i]);
+	    } else {
+		// reversed deadlines, the worst case for the queue insertion
+		r[i].deadline = t0 + 0.001 * (DEVICES - i);
+		i2cBusSubmit(&bus, &r[i]);
+	    }
+	}
+	if (mode == BENCH_BATCHED || mode == BENCH_READ_LAST) i2cBusFlush(&bus);
+	transactions += DEVICES;
+	t = i2cSchedTime() - t0;
+    } while (t < seconds);
+
+    printf("%-8s %-10s: %9.0f transactions/s, %.2f transfers/transaction, %5.2f us/transaction\n",
+	   adapter, modeNames[mode], transactions / t, (double) f.transfers / transactions, t / transactions * 1e6);
+}
+
+int main(int argc, char **argv) {
+    double	seconds;
+    int		mode;
+
+    seconds = 1;
+    if (argc > 1) seconds = strtod(argv[1], NULL);
+    sem_init(&busSemaphore, 1, 1);
+
+    for(mode=BENCH_PI2C; mode<=BENCH_READ_LAST; mode++) bench("cpu", 0, 0, mode, seconds);
+    for(mode=BENCH_PI2C; mode<=BENCH_READ_LAST; mode++) bench("syscall", 0.00002, 0, mode, seconds);
+    for(mode=BENCH_PI2C; mode<=BENCH_READ_LAST; mode++) bench("400kHz", 0.00002, 400000, mode, seconds);
+    return(0);
+}
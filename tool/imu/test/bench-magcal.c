@@ -0,0 +1,150 @@
+/*
+  Benchmark of the magnetometer calibration engine.
+
+  1) Iterations to converge: a tumbling sensor is sampled at 155Hz (LIS3MDL
+     fast ODR) and the fit is run every n samples. Reports the number of
+     samples and fits needed until the calibration is converged.
+  2) Time per sample of magcalAdd, time of magcalFit and time per sample
+     of the fused correction (magcalApply) against subtracting the offset
+     and multiplying by the matrix in double precision (magcalApply1).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../compass/magcal.h"
+
+#define FIELD		450.0
+#define RATE		155.0
+#define SEEDS		10
+#define APPLY_SAMPLES	1024
+
+static struct magcal	cal;
+static float		data[3*APPLY_SAMPLES];
+static float		result[3*APPLY_SAMPLES];
+
+static double monotonicTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static double gaussian() {
+    double u, v;
+    u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return(sqrt(-2 * log(u)) * cos(2 * M_PI * v));
+}
+
+// distorted reading of a tumbling sensor at time t
+static void sample(double t, double phase, double raw[3]) {
+    static double	offset[3] = {120, -340, 85};
+    static double	matrix[3][3] = {{1.10, 0.08, -0.03}, {0.05, 0.92, 0.06}, {-0.02, 0.04, 1.04}};
+    double		h[3], az, el;
+    int			i;
+
+    az = 1.3 * t + phase;
+    el = asin(sin(0.37 * t + 2 * phase));
+    h[0] = FIELD * cos(el) * cos(az);
+    h[1] = FIELD * cos(el) * sin(az);
+    h[2] = FIELD * sin(el);
+    for(i=0; i<3; i++) raw[i] = matrix[i][0]*h[0] + matrix[i][1]*h[1] + matrix[i][2]*h[2] + offset[i] + 3.0 * gaussian();
+}
+
+static void converge(int fitEvery) {
+    double	raw[3], samples, fits, maxSamples;
+    long	i;
+    int		seed, ok;
+
+    samples = fits = maxSamples = 0;
+    ok = 0;
+    for(seed=0; seed<SEEDS; seed++) {
+	srand(seed + 1);
+	magcalInit(&cal);
+	for(i=0; i<RATE * 120; i++) {
+	    sample(i / RATE, seed * 0.7, raw);
+	    magcalAdd(&cal, raw[0], raw[1], raw[2]);
+	    if (i % fitEvery == fitEvery - 1 && magcalFit(&cal) == 0 && cal.quality.converged) break;
+	}
+	if (! cal.quality.converged) continue;
+	ok ++;
+	samples += i + 1;
+	fits += cal.fits;
+	if (i + 1 > maxSamples) maxSamples = i + 1;
+    }
+    printf("fit every %4d samples: converged %d/%d, avg %6.0f samples (%4.1f s), max %6.0f samples, avg %5.1f fits\n",
+	   fitEvery, ok, SEEDS, ok ? samples / ok : 0, ok ? samples / ok / RATE : 0, maxSamples, ok ? fits / ok : 0);
+}
+
+static void unfusedApply(struct magcalCorrection *k, float *in, float *out, int n) {
+    double	x[3], y[3];
+    int		i;
+
+    for(i=0; i<n; i++) {
+	x[0] = in[3*i];
+	x[1] = in[3*i+1];
+	x[2] = in[3*i+2];
+	magcalApply1(k, x, y);
+	out[3*i] = y[0];
+	out[3*i+1] = y[1];
+	out[3*i+2] = y[2];
+    }
+}
+
+int main() {
+    double	raw[3], t0, tAdd, tFit, tApply, tUnfused, sink;
+    long	i, n;
+
+    converge(25);
+    converge(50);
+    converge(100);
+    converge(200);
+
+    // start with a calibrated engine, so that close samples are not stored
+    srand(1);
+    magcalInit(&cal);
+    for(i=0; i<5000; i++) {
+	sample(i / RATE, 0, raw);
+	magcalAdd(&cal, raw[0], raw[1], raw[2]);
+    }
+    magcalFit(&cal);
+    n = 1000000;
+    t0 = monotonicTime();
+    for(i=0; i<n; i++) {
+	sample(i / RATE, 0, raw);
+	magcalAdd(&cal, raw[0], raw[1], raw[2]);
+    }
+    tAdd = (monotonicTime() - t0) / n;
+    // the same without magcalAdd, to subtract the cost of generating samples
+    t0 = monotonicTime();
+    sink = 0;
+    for(i=0; i<n; i++) {
+	sample(i / RATE, 0, raw);
+	sink += raw[0];
+    }
+    tAdd -= (monotonicTime() - t0) / n;
+
+    n = 1000;
+    t0 = monotonicTime();
+    for(i=0; i<n; i++) magcalFit(&cal);
+    tFit = (monotonicTime() - t0) / n;
+
+    for(i=0; i<3*APPLY_SAMPLES; i++) data[i] = 1000.0 * rand() / RAND_MAX - 500;
+    n = 2000;
+    t0 = monotonicTime();
+    for(i=0; i<n; i++) magcalApply(&cal.correction, data, result, APPLY_SAMPLES);
+    tApply = (monotonicTime() - t0) / n / APPLY_SAMPLES;
+    sink += result[7];
+    t0 = monotonicTime();
+    for(i=0; i<n; i++) unfusedApply(&cal.correction, data, result, APPLY_SAMPLES);
+    tUnfused = (monotonicTime() - t0) / n / APPLY_SAMPLES;
+    sink += result[7];
+
+    printf("magcalAdd %.0f ns/sample (%lld of %lld samples stored), magcalFit %.1f us (%d ring samples)\n",
+	   tAdd * 1e9, cal.count, cal.offered, tFit * 1e6, cal.quality.samples);
+    printf("correction: fused %.2f ns/sample, unfused %.2f ns/sample%s\n",
+	   tApply * 1e9, tUnfused * 1e9, sink == 0.123 ? " " : "");
+    return(0);
+}
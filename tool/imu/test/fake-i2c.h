@@ -0,0 +1,133 @@
+/*
+  Fake /dev/i2c adapter for tests of ../i2cbus. It takes the same
+  messages as the I2C_RDWR ioctl. Devices are register files with an auto
+  incremented register pointer, like most sensors. A message to an absent
+  address fails the whole transfer as on a real adapter.
+
+  Each transfer costs transferOverhead seconds (syscall and driver setup)
+  and, if clock is set, the time on the wire. Both are busy waited, so
+  the caller sees them as time spent in the ioctl.
+
+  With readLastOnly the adapter behaves like i2c-bcm2835 and rejects
+  transfers with a read message other than the last one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <linux/i2c.h>
+
+#include "../baro/i2csched.h"
+#include "../i2cbus/i2cbus.h"
+
+#define FAKE_I2C_MAX_DEVICES	8
+
+struct fakeI2cDevice {
+    int		address;
+    uint8_t	regs[256];
+    uint8_t	pointer;
+    // called before a read from the register pointer, e.g. to produce new data
+    void	(*onRead)(struct fakeI2cDevice *d);
+    void	*arg;
+    long long	reads;
+    long long	writes;
+};
+
+struct fakeI2c {
+    struct fakeI2cDevice	dev[FAKE_I2C_MAX_DEVICES];
+    int				devCount;
+    double			transferOverhead;
+    double			clock;
+    int				readLastOnly;
+
+    long long			transfers;
+    long long			messages;
+    long long			nacks;
+    long long			rejected;
+};
+
+static inline void fakeI2cInit(struct fakeI2c *f, double transferOverhead, double clock) {
+    memset(f, 0, sizeof(*f));
+    f->transferOverhead = transferOverhead;
+    f->clock = clock;
+}
+
+static inline struct fakeI2cDevice *fakeI2cAddDevice(struct fakeI2c *f, int address) {
+    struct fakeI2cDevice *d;
+
+    if (f->devCount >= FAKE_I2C_MAX_DEVICES) return(NULL);
+    d = &f->dev[f->devCount++];
+    memset(d, 0, sizeof(*d));
+    d->address = address;
+    return(d);
+}
+
+static inline struct fakeI2cDevice *fakeI2cFindDevice(struct fakeI2c *f, int address) {
+    int i;
+    for(i=0; i<f->devCount; i++) {
+	if (f->dev[i].address == address) return(&f->dev[i]);
+    }
+    return(NULL);
+}
+
+static inline void fakeI2cSpin(double seconds) {
+    double t;
+
+    if (seconds <= 0) return;
+    t = i2cSchedTime() + seconds;
+    while (i2cSchedTime() < t) ;
+}
+
+static int fakeI2cTransfer(void *ctx, struct i2c_msg *msgs, int n) {
+    struct fakeI2c		*f = (struct fakeI2c *) ctx;
+    struct fakeI2cDevice	*d;
+    long			bits;
+    int				i, j, r;
+
+    f->transfers ++;
+    if (n <= 0 || n > I2C_BUS_MAX_MSGS) return(-EINVAL);
+    if (f->readLastOnly) {
+	for(i=0; i<n-1; i++) {
+	    if (msgs[i].flags & I2C_M_RD) {
+		f->rejected ++;
+		return(-EOPNOTSUPP);
+	    }
+	}
+    }
+
+    r = n;
+    bits = 1;
+    for(i=0; i<n; i++) {
+	bits += 10;
+	d = fakeI2cFindDevice(f, msgs[i].addr);
+	if (d == NULL) {
+	    // address not acknowledged, the adapter stops here
+	    f->nacks ++;
+	    r = -ENXIO;
+	    break;
+	}
+	f->messages ++;
+	bits += 9 * msgs[i].len;
+	if (msgs[i].flags & I2C_M_RD) {
+	    d->reads ++;
+	    if (d->onRead != NULL) d->onRead(d);
+	    for(j=0; j<msgs[i].len; j++) msgs[i].buf[j] = d->regs[d->pointer++];
+	} else if (msgs[i].len > 0) {
+	    d->writes ++;
+	    d->pointer = msgs[i].buf[0];
+	    for(j=1; j<msgs[i].len; j++) d->regs[d->pointer++] = msgs[i].buf[j];
+	}
+    }
+    fakeI2cSpin(f->transferOverhead + (f->clock > 0 ? bits / f->clock : 0));
+    return(r);
+}
+
+static const struct i2cBusBackend fakeI2cBackend = {
+    fakeI2cTransfer,
+};
+
+static inline void fakeI2cBusInit(struct i2cBus *bus, struct fakeI2c *f) {
+    i2cBusInit(bus, &fakeI2cBackend, f);
+    if (f->clock > 0) bus->clock = f->clock;
+}
@@ -0,0 +1,173 @@
+/*
+  Mock I2C backend emulating MS5611 and BMP180 barometers for tests of
+  ../baro. Conversions take the datasheet maximal time. Reading a result
+  too early behaves like the real chip (MS5611 returns 0, BMP180 returns
+  the previous result) and is counted. Each transfer takes transferTime
+  seconds of (sleeping) bus time.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../baro/i2csched.h"
+#include "../baro/baro.h"
+
+struct mockBaro {
+    int		chip;
+    double	transferTime;
+    int		converting;
+    int		temperatureFlag;
+    double	conversionEnd;
+    int		oversampling;
+    // values returned by conversions
+    uint32_t	rawPressure;
+    uint32_t	rawTemperature;
+    uint32_t	lastResult;
+    uint16_t	prom[8];
+    int32_t	eeprom[11];
+
+    long long	transfers;
+    long long	earlyReads;
+};
+
+static double mockMs5611ConversionTime[5] = {0.00060, 0.00117, 0.00228, 0.00454, 0.00904};
+static double mockBmp180ConversionTime[4] = {0.0045, 0.0075, 0.0135, 0.0255};
+
+static inline void mockBaroTransfer(struct mockBaro *m) {
+    struct timespec ts;
+
+    m->transfers ++;
+    if (m->transferTime <= 0) return;
+    ts.tv_sec = 0;
+    ts.tv_nsec = m->transferTime * 1e9;
+    nanosleep(&ts, NULL);
+}
+
+static inline void mockBaroConvert(struct mockBaro *m, int temperatureFlag, double duration) {
+    m->converting = 1;
+    m->temperatureFlag = temperatureFlag;
+    m->conversionEnd = i2cSchedTime() + duration;
+}
+
+// Returns 0 if the conversion is finished and stores its result into lastResult.
+static inline int mockBaroResult(struct mockBaro *m) {
+    if (! m->converting) return(0);
+    if (i2cSchedTime() < m->conversionEnd) {
+	m->earlyReads ++;
+	m->converting = 0;
+	return(-1);
+    }
+    m->converting = 0;
+    if (m->temperatureFlag) {
+	m->lastResult = m->rawTemperature;
+    } else if (m->chip == BARO_BMP180) {
+	m->lastResult = m->rawPressure << (8 - m->oversampling);
+    } else {
+	m->lastResult = m->rawPressure;
+    }
+    return(0);
+}
+
+static int mockBaroCommand(void *ctx, uint8_t cmd) {
+    struct mockBaro *m = (struct mockBaro *) ctx;
+
+    mockBaroTransfer(m);
+    if (m->chip != BARO_MS5611) return(-1);
+    if (cmd >= 0x40 && cmd <= 0x48) {
+	m->oversampling = (cmd - 0x40) / 2;
+	mockBaroConvert(m, 0, mockMs5611ConversionTime[m->oversampling]);
+    } else if (cmd >= 0x50 && cmd <= 0x58) {
+	m->oversampling = (cmd - 0x50) / 2;
+	mockBaroConvert(m, 1, mockMs5611ConversionTime[m->oversampling]);
+    }
+    return(0);
+}
+
+static int mockBaroWriteReg(void *ctx, uint8_t reg, uint8_t value) {
+    struct mockBaro *m = (struct mockBaro *) ctx;
+
+    mockBaroTransfer(m);
+    if (m->chip != BARO_BMP180 || reg != 0xF4) return(-1);
+    if (value == 0x2E) {
+	mockBaroConvert(m, 1, mockBmp180ConversionTime[0]);
+    } else {
+	m->oversampling = value >> 6;
+	mockBaroConvert(m, 0, mockBmp180ConversionTime[m->oversampling]);
+    }
+    return(0);
+}
+
+static int mockBaroReadReg(void *ctx, uint8_t reg, int len, uint8_t *buf) {
+    struct mockBaro	*m = (struct mockBaro *) ctx;
+    uint32_t		v;
+    int			i;
+
+    mockBaroTransfer(m);
+    memset(buf, 0, len);
+    if (m->chip == BARO_MS5611) {
+	if (reg == 0x00 && len == 3) {
+	    v = mockBaroResult(m) == 0 ? m->lastResult : 0;
+	    buf[0] = v >> 16;
+	    buf[1] = v >> 8;
+	    buf[2] = v;
+	} else if (reg >= 0xA0 && reg <= 0xAE && len == 2) {
+	    v = m->prom[(reg - 0xA0) / 2];
+	    buf[0] = v >> 8;
+	    buf[1] = v;
+	}
+	return(0);
+    }
+    if (reg == 0xD0) {
+	buf[0] = 0x55;
+    } else if (reg == 0xAA && len == 22) {
+	for(i=0; i<11; i++) {
+	    buf[2*i] = (m->eeprom[i] >> 8) & 0xff;
+	    buf[2*i+1] = m->eeprom[i] & 0xff;
+	}
+    } else if (reg == 0xF6) {
+	// too early read returns the previous result
+	mockBaroResult(m);
+	v = m->lastResult;
+	if (len == 2) {
+	    buf[0] = v >> 8;
+	    buf[1] = v;
+	} else {
+	    buf[0] = v >> 16;
+	    buf[1] = v >> 8;
+	    buf[2] = v;
+	}
+    }
+    return(0);
+}
+
+static const struct i2cDevOps mockBaroOps = {
+    mockBaroCommand,
+    mockBaroWriteReg,
+    mockBaroReadReg,
+};
+
+// Mock chips return the examples from datasheets.
+static inline void mockBaroInit(struct mockBaro *m, struct i2cDev *dev, int chip, double transferTime) {
+    static uint16_t ms5611Prom[8] = {0, 40127, 36924, 23317, 23282, 33464, 28312, 0};
+    static int32_t bmp180Eeprom[11] = {408, -72, -14383, 32741, 32757, 23153, 6190, 4, -32768, -8711, 2868};
+
+    memset(m, 0, sizeof(*m));
+    m->chip = chip;
+    m->transferTime = transferTime;
+    if (chip == BARO_MS5611) {
+	memcpy(m->prom, ms5611Prom, sizeof(m->prom));
+	m->rawPressure = 9085466;
+	m->rawTemperature = 8569150;
+    } else {
+	memcpy(m->eeprom, bmp180Eeprom, sizeof(m->eeprom));
+	m->rawPressure = 23843;
+	m->rawTemperature = 27898;
+    }
+    dev->ops = &mockBaroOps;
+    dev->ctx = m;
+    dev->fd = -1;
+    dev->address = 0x77;
+    dev->bus = NULL;
+}
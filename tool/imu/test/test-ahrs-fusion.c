@@ -0,0 +1,100 @@
+/*
+  Compares AHRS_MADGWICK with the Fusion library the IMU tools used before.
+  Both filters get the same synthetic samples, Fusion's outputs are
+  converted like publishAttitude() in gy-87/mpu6050.c did. All rpy, lacc
+  and eacc values have to be the same bit by bit.
+
+  Needs the Fusion library, see the Makefile.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Fusion.h"
+#include "ahrs-motion.h"
+
+#define RATE		1000.0
+
+int failures = 0;
+
+static void check(const char *name, int ok) {
+    if (! ok) {
+	printf("FAIL %s\n", name);
+	failures ++;
+    }
+}
+
+// what publishAttitude() computed from Fusion
+static void fusionOutput(FusionAhrs *ahrs, struct ahrsOutput *out) {
+    FusionEuler		euler;
+    FusionVector	facc;
+    int			i;
+
+    euler = FusionQuaternionToEuler(FusionAhrsGetQuaternion(ahrs));
+    out->rpy[0] = euler.angle.roll*M_PI/180.0;
+    out->rpy[1] = euler.angle.pitch*M_PI/180.0;
+    out->rpy[2] = euler.angle.yaw*M_PI/180.0;
+    facc = FusionAhrsGetLinearAcceleration(ahrs);
+    for(i=0; i<3; i++) out->lacc[i] = facc.array[i];
+    facc = FusionAhrsGetEarthAcceleration(ahrs);
+    for(i=0; i<3; i++) out->eacc[i] = facc.array[i];
+}
+
+static void compare(const char *name, struct ahrsMotion *m) {
+    FusionAhrs		fusion;
+    FusionVector	gyroscope, accelerometer;
+    struct ahrs		a;
+    struct ahrsOutput	fo, ao;
+    int			i, j, same, firstDifference;
+
+    FusionAhrsInitialise(&fusion);
+    ahrsInit(&a, AHRS_MADGWICK);
+    same = 0;
+    firstDifference = -1;
+    for(i=0; i<m->n; i++) {
+	for(j=0; j<3; j++) {
+	    gyroscope.array[j] = m->samples[i].gyroscope[j];
+	    accelerometer.array[j] = m->samples[i].accelerometer[j];
+	}
+	FusionAhrsUpdateNoMagnetometer(&fusion, gyroscope, accelerometer, m->samples[i].deltaTime);
+	fusionOutput(&fusion, &fo);
+	ahrsUpdate(&a, m->samples[i].gyroscope, m->samples[i].accelerometer, m->samples[i].deltaTime);
+	ahrsGetOutput(&a, &ao);
+	if (memcmp(fo.rpy, ao.rpy, sizeof(fo.rpy)) == 0 && memcmp(fo.lacc, ao.lacc, sizeof(fo.lacc)) == 0 && memcmp(fo.eacc, ao.eacc, sizeof(fo.eacc)) == 0) {
+	    same ++;
+	} else if (firstDifference < 0) {
+	    firstDifference = i;
+	    printf("%s: first difference at sample %d: fusion rpy %.9g %.9g %.9g, ahrs rpy %.9g %.9g %.9g\n", name, i,
+		   fo.rpy[0], fo.rpy[1], fo.rpy[2], ao.rpy[0], ao.rpy[1], ao.rpy[2]);
+	}
+    }
+    printf("%s: %d of %d outputs identical\n", name, same, m->n);
+    check(name, same == m->n);
+}
+
+int main() {
+    struct ahrsMotionParams	p;
+    struct ahrsMotion		m;
+
+    ahrsMotionDefaultParams(&p);
+    ahrsMotionGenerate(&m, &p, 30, RATE, 1);
+    compare("motion", &m);
+    ahrsMotionFree(&m);
+
+    // fast rotations, accelerometer saturating, zero samples
+    p.rollAmplitude = p.pitchAmplitude = 170 * M_PI / 180;
+    p.yawRate = 200 * M_PI / 180;
+    p.linearAcceleration = 1.5;
+    ahrsMotionGenerate(&m, &p, 10, RATE, 2);
+    memset(m.samples[5000].accelerometer, 0, sizeof(m.samples[5000].accelerometer));
+    compare("extreme", &m);
+    ahrsMotionFree(&m);
+
+    if (failures) {
+	printf("%d failures\n", failures);
+	return(1);
+    }
+    printf("All tests passed\n");
+    return(0);
+}
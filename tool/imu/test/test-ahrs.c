@@ -0,0 +1,268 @@
+/*
+  Tests of the AHRS filters on synthetic motion (ahrs-motion.h).
+
+  - batch updates give bit identical results to single sample updates,
+  - roll and pitch of all filters follow the true attitude,
+  - fixed point filters follow their float versions,
+  - initialisation levels a tilted sensor and holds the heading at zero,
+  - Mahony's integral term removes the error caused by a gyroscope bias,
+  - a zero accelerometer sample is ignored.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "ahrs-motion.h"
+
+#define RATE		1000.0
+#define DEG		(180.0 / M_PI)
+
+int failures = 0;
+
+static const char *algorithmNames[] = {"madgwick", "mahony"};
+
+static void check(const char *name, int ok) {
+    if (! ok) {
+	printf("FAIL %s\n", name);
+	failures ++;
+    }
+}
+
+static void runFloat(struct ahrsMotion *m, int algorithm, struct ahrsOutput *out) {
+    struct ahrs		a;
+
+    ahrsInit(&a, algorithm);
+    ahrsUpdateBatch(&a, m->samples, m->n, out);
+}
+
+static void runFixed(struct ahrsMotion *m, int algorithm, struct ahrsOutput *out) {
+    struct ahrsFixed	a;
+
+    ahrsFixedInit(&a, algorithm, AHRS_MOTION_GYRO_COUNTS, AHRS_MOTION_ACCEL_COUNTS);
+    ahrsFixedUpdateBatch(&a, m->raw, m->n, out);
+}
+
+// Roll and pitch errors in degrees after skip seconds.
+static void attitudeError(struct ahrsMotion *m, struct ahrsOutput *out, double skip, double *rms, double *max) {
+    double	e, sum2;
+    int		i, j, n;
+
+    sum2 = *max = 0;
+    n = 0;
+    for(i=skip*m->rate; i<m->n; i++) {
+	for(j=0; j<2; j++) {
+	    e = fabs(remainder(out[i].rpy[j] - m->truthRpy[i][j], 2 * M_PI)) * DEG;
+	    sum2 += e * e;
+	    if (e > *max) *max = e;
+	    n ++;
+	}
+    }
+    *rms = sqrt(sum2 / n);
+}
+
+static void testBatch(struct ahrsMotion *m) {
+    struct ahrsOutput	*batch, *single;
+    struct ahrs		a, b;
+    struct ahrsFixed	fa, fb;
+    int			alg, i, j, k, same, sameState;
+
+    batch = (struct ahrsOutput *) calloc(m->n, sizeof(*batch));
+    single = (struct ahrsOutput *) calloc(m->n, sizeof(*single));
+    for(alg=AHRS_MADGWICK; alg<=AHRS_MAHONY; alg++) {
+	// float, bursts of random length like FIFO reads
+	ahrsInit(&a, alg);
+	ahrsInit(&b, alg);
+	for(i=0; i<m->n; i+=k) {
+	    k = 1 + rand() % 150;
+	    if (i + k > m->n) k = m->n - i;
+	    ahrsUpdateBatch(&a, m->samples + i, k, batch + i);
+	}
+	for(i=0; i<m->n; i++) {
+	    ahrsUpdate(&b, m->samples[i].gyroscope, m->samples[i].accelerometer, m->samples[i].deltaTime);
+	    ahrsGetOutput(&b, &single[i]);
+	    single[i].timestamp = m->samples[i].timestamp;
+	}
+	same = 1;
+	for(i=0; i<m->n; i++) same &= memcmp(&batch[i], &single[i], sizeof(batch[i])) == 0;
+	sameState = memcmp(&a, &b, sizeof(a)) == 0;
+	printf("%-8s float batch: outputs %s, state %s\n", algorithmNames[alg], same ? "identical" : "DIFFERENT", sameState ? "identical" : "DIFFERENT");
+	check("float batch outputs", same);
+	check("float batch state", sameState);
+
+	// fixed point
+	ahrsFixedInit(&fa, alg, AHRS_MOTION_GYRO_COUNTS, AHRS_MOTION_ACCEL_COUNTS);
+	ahrsFixedInit(&fb, alg, AHRS_MOTION_GYRO_COUNTS, AHRS_MOTION_ACCEL_COUNTS);
+	for(i=0; i<m->n; i+=k) {
+	    k = 1 + rand() % 150;
+	    if (i + k > m->n) k = m->n - i;
+	    ahrsFixedUpdateBatch(&fa, m->raw + i, k, batch + i);
+	}
+	for(i=0; i<m->n; i++) {
+	    ahrsFixedUpdate(&fb, m->raw[i].gyroscope, m->raw[i].accelerometer, m->raw[i].deltaTime);
+	    ahrsFixedGetOutput(&fb, &single[i]);
+	    single[i].timestamp = m->raw[i].timestamp;
+	}
+	same = 1;
+	for(i=0; i<m->n; i++) same &= memcmp(&batch[i], &single[i], sizeof(batch[i])) == 0;
+	sameState = 1;
+	for(j=0; j<4; j++) sameState &= fa.q[j] == fb.q[j];
+	for(j=0; j<3; j++) sameState &= fa.integral[j] == fb.integral[j];
+	printf("%-8s fixed batch: outputs %s, state %s\n", algorithmNames[alg], same ? "identical" : "DIFFERENT", sameState ? "identical" : "DIFFERENT");
+	check("fixed batch outputs", same);
+	check("fixed batch state", sameState);
+    }
+    free(batch);
+    free(single);
+}
+
+static void testAccuracy(struct ahrsMotion *m) {
+    struct ahrsOutput	*fl, *fx;
+    double		rms, max, d, dmax, yawMax;
+    int			alg, i, j;
+
+    fl = (struct ahrsOutput *) calloc(m->n, sizeof(*fl));
+    fx = (struct ahrsOutput *) calloc(m->n, sizeof(*fx));
+    for(alg=AHRS_MADGWICK; alg<=AHRS_MAHONY; alg++) {
+	runFloat(m, alg, fl);
+	attitudeError(m, fl, AHRS_INITIALISATION_PERIOD, &rms, &max);
+	printf("%-8s float: roll/pitch error rms %.3f max %.3f deg\n", algorithmNames[alg], rms, max);
+	check("float accuracy", rms < 1.0 && max < 3.0);
+
+	runFixed(m, alg, fx);
+	attitudeError(m, fx, AHRS_INITIALISATION_PERIOD, &rms, &max);
+	// yaw is not observable without magnetometer, a small difference
+	// left at the end of the initialisation persists
+	dmax = yawMax = 0;
+	for(i=0; i<m->n; i++) {
+	    for(j=0; j<2; j++) {
+		d = fabs(remainder(fx[i].rpy[j] - fl[i].rpy[j], 2 * M_PI)) * DEG;
+		if (d > dmax) dmax = d;
+	    }
+	    d = fabs(remainder(fx[i].rpy[2] - fl[i].rpy[2], 2 * M_PI)) * DEG;
+	    if (d > yawMax) yawMax = d;
+	}
+	printf("%-8s fixed: roll/pitch error rms %.3f max %.3f deg, max difference from float %.4f deg, yaw %.4f deg\n", algorithmNames[alg], rms, max, dmax, yawMax);
+	check("fixed accuracy", rms < 1.0 && max < 3.0);
+	check("fixed follows float", dmax < 0.05 && yawMax < 0.5);
+    }
+    free(fl);
+    free(fx);
+}
+
+static void testInitialisation() {
+    struct ahrsMotionParams	p;
+    struct ahrsMotion		m;
+    struct ahrsOutput		*out;
+    double			yawMax;
+    int				alg, i, fixed;
+
+    // resting sensor rolled by 30 and pitched by -20 degrees, rotated by 100 degrees
+    memset(&p, 0, sizeof(p));
+    ahrsMotionGenerate(&m, &p, 4, RATE, 2);
+    for(i=0; i<m.n; i++) {
+	double q[4], acc[3], up[3] = {0, 0, 1};
+	int j;
+	ahrsMotionQuaternion(30 / DEG, -20 / DEG, 100 / DEG, q);
+	ahrsMotionToBody(q, up, acc);
+	for(j=0; j<3; j++) {
+	    m.raw[i].accelerometer[j] = ahrsMotionCounts(acc[j] * AHRS_MOTION_ACCEL_COUNTS);
+	    m.samples[i].accelerometer[j] = m.raw[i].accelerometer[j] / AHRS_MOTION_ACCEL_COUNTS;
+	}
+    }
+    out = (struct ahrsOutput *) calloc(m.n, sizeof(*out));
+    for(fixed=0; fixed<2; fixed++) {
+	for(alg=AHRS_MADGWICK; alg<=AHRS_MAHONY; alg++) {
+	    if (fixed) runFixed(&m, alg, out);
+	    else runFloat(&m, alg, out);
+	    yawMax = 0;
+	    for(i=0; i<AHRS_INITIALISATION_PERIOD * RATE - 1; i++) yawMax = fmax(yawMax, fabs(out[i].rpy[2]));
+	    i = AHRS_INITIALISATION_PERIOD * RATE;
+	    printf("%-8s %s initialisation: after %.0f s roll %.3f pitch %.3f deg, max yaw %.2g deg\n", algorithmNames[alg], fixed ? "fixed" : "float",
+		   AHRS_INITIALISATION_PERIOD, out[i].rpy[0] * DEG, out[i].rpy[1] * DEG, yawMax * DEG);
+	    check("initialisation roll", fabs(out[i].rpy[0] * DEG - 30) < 0.2);
+	    check("initialisation pitch", fabs(out[i].rpy[1] * DEG + 20) < 0.2);
+	    check("initialisation heading", yawMax * DEG < 0.01);
+	}
+    }
+    free(out);
+    ahrsMotionFree(&m);
+}
+
+static void testGyroBias() {
+    struct ahrsMotionParams	p;
+    struct ahrsMotion		m;
+    struct ahrsOutput		*out;
+    double			rms[2], max[2], frms, fmax_;
+    int				alg;
+
+    ahrsMotionDefaultParams(&p);
+    p.gyroBias = 1.0;
+    ahrsMotionGenerate(&m, &p, 60, RATE, 3);
+    out = (struct ahrsOutput *) calloc(m.n, sizeof(*out));
+    for(alg=AHRS_MADGWICK; alg<=AHRS_MAHONY; alg++) {
+	runFloat(&m, alg, out);
+	attitudeError(&m, out, 40, &rms[alg], &max[alg]);
+	runFixed(&m, alg, out);
+	attitudeError(&m, out, 40, &frms, &fmax_);
+	printf("%-8s gyro bias 1 dps: roll/pitch error rms %.3f max %.3f deg (fixed rms %.3f max %.3f)\n", algorithmNames[alg], rms[alg], max[alg], frms, fmax_);
+	if (alg == AHRS_MAHONY) check("mahony removes fixed bias", frms < rms[AHRS_MADGWICK] / 2);
+    }
+    check("mahony removes bias", rms[AHRS_MAHONY] < rms[AHRS_MADGWICK] / 2);
+    free(out);
+    ahrsMotionFree(&m);
+}
+
+static void testZeroAccelerometer(struct ahrsMotion *m) {
+    struct ahrs		a;
+    struct ahrsFixed	f;
+    struct ahrsOutput	o, fo;
+    float		zero[3] = {0, 0, 0};
+    int16_t		rawZero[3] = {0, 0, 0};
+    int			i;
+
+    ahrsInit(&a, AHRS_MADGWICK);
+    ahrsFixedInit(&f, AHRS_MADGWICK, AHRS_MOTION_GYRO_COUNTS, AHRS_MOTION_ACCEL_COUNTS);
+    for(i=0; i<m->n; i++) {
+	if (i % 100 == 50) {
+	    ahrsUpdate(&a, m->samples[i].gyroscope, zero, m->samples[i].deltaTime);
+	    ahrsFixedUpdate(&f, m->raw[i].gyroscope, rawZero, m->raw[i].deltaTime);
+	} else {
+	    ahrsUpdate(&a, m->samples[i].gyroscope, m->samples[i].accelerometer, m->samples[i].deltaTime);
+	    ahrsFixedUpdate(&f, m->raw[i].gyroscope, m->raw[i].accelerometer, m->raw[i].deltaTime);
+	}
+    }
+    ahrsGetOutput(&a, &o);
+    ahrsFixedGetOutput(&f, &fo);
+    check("zero accelerometer float", ! isnan(o.rpy[0]) && fabs(remainder(o.rpy[0] - m->truthRpy[m->n-1][0], 2 * M_PI)) * DEG < 3);
+    check("zero accelerometer fixed", ! isnan(fo.rpy[0]) && fabs(remainder(fo.rpy[0] - m->truthRpy[m->n-1][0], 2 * M_PI)) * DEG < 3);
+}
+
+// periods of stalled or stepped back clocks must not wrap around
+static void testFixedSeconds() {
+    check("fixed seconds", AHRS_FIXED_SECONDS(0.001) == 4294967);
+    check("fixed seconds negative", AHRS_FIXED_SECONDS(-0.001) == 0);
+    check("fixed seconds nan", AHRS_FIXED_SECONDS(NAN) == 0);
+    check("fixed seconds stall", AHRS_FIXED_SECONDS(1.5) == UINT32_MAX);
+}
+
+int main() {
+    struct ahrsMotionParams	p;
+    struct ahrsMotion		m;
+
+    ahrsMotionDefaultParams(&p);
+    ahrsMotionGenerate(&m, &p, 30, RATE, 1);
+    testBatch(&m);
+    testAccuracy(&m);
+    testInitialisation();
+    testGyroBias();
+    testZeroAccelerometer(&m);
+    testFixedSeconds();
+    ahrsMotionFree(&m);
+    if (failures) {
+	printf("%d failures\n", failures);
+	return(1);
+    }
+    printf("All tests passed\n");
+    return(0);
+}
@@ -0,0 +1,154 @@
+/*
+  Tests of the non-blocking barometer drivers (../baro) on the mock I2C
+  backend. Checks compensation against datasheet examples, the sample
+  rate, the interleaving of temperature conversions, that no result is
+  read before its conversion is finished, and sharing of one scheduler
+  thread by several sensors.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "mock-baro.h"
+
+int failures = 0;
+
+struct collected {
+    long long	samples;
+    double	pressure;
+    double	temperature;
+    double	latencyMax;
+};
+
+static void check(const char *name, int ok) {
+    if (! ok) {
+	printf("FAIL %s\n", name);
+	failures ++;
+    }
+}
+
+static void collect(struct baro *b, struct baroSample *s) {
+    struct collected	*c;
+    double		latency;
+
+    c = (struct collected *) b->arg;
+    c->samples ++;
+    c->pressure = s->pressure;
+    c->temperature = s->temperature;
+    latency = i2cSchedTime() - s->conversionEnd;
+    if (latency > c->latencyMax) c->latencyMax = latency;
+}
+
+// another sensor sharing the thread, e.g. a magnetometer read at 200Hz
+static int otherStep(struct i2cSchedTask *t, double now) {
+    t->time += 0.005;
+    return(0);
+}
+
+static void run(struct i2cSched *s, double seconds) {
+    double t0;
+
+    t0 = i2cSchedTime();
+    while (i2cSchedTime() - t0 < seconds) {
+	if (i2cSchedRunOnce(s) < 0) {
+	    printf("FAIL scheduler step\n");
+	    failures ++;
+	    return;
+	}
+    }
+}
+
+static void testDatasheet(int chip, int oversampling, double pressure, double temperature) {
+    struct i2cSched	s;
+    struct i2cDev	dev;
+    struct mockBaro	m;
+    struct baro		b;
+    struct collected	c = {0};
+
+    mockBaroInit(&m, &dev, chip, 0);
+    i2cSchedInit(&s);
+    check("datasheet init", baroInit(&b, chip, &dev, 0, oversampling, 1) == 0);
+    b.callback = collect;
+    b.arg = &c;
+    i2cSchedAdd(&s, &b.task);
+    while (c.samples < 3 && failures == 0) i2cSchedRunOnce(&s);
+    i2cSchedClose(&s);
+    printf("%-24s: pressure %.0f Pa, temperature %.2f C\n", b.task.name, c.pressure, c.temperature);
+    check("datasheet pressure", fabs(c.pressure - pressure) < 0.5);
+    check("datasheet temperature", fabs(c.temperature - temperature) < 0.005);
+}
+
+static void testRate(int chip, double rate, int temperatureEvery, double transferTime) {
+    struct i2cSched	s;
+    struct i2cDev	dev;
+    struct mockBaro	m;
+    struct baro		b;
+    struct collected	c = {0};
+    double		seconds, expectedTemperatures;
+
+    seconds = 2.0;
+    mockBaroInit(&m, &dev, chip, transferTime);
+    i2cSchedInit(&s);
+    baroInit(&b, chip, &dev, rate, -1, temperatureEvery);
+    b.callback = collect;
+    b.arg = &c;
+    i2cSchedAdd(&s, &b.task);
+    run(&s, seconds);
+    i2cSchedClose(&s);
+
+    expectedTemperatures = c.samples / (double) temperatureEvery;
+    printf("%-24s: %.0f Hz requested, %.1f Hz pressure, %lld temperatures, %lld early reads, latency max %.0f us\n",
+	   b.task.name, rate, c.samples / seconds, b.temperatures, m.earlyReads, c.latencyMax * 1e6);
+    check("rate", fabs(c.samples / seconds - rate) < rate * 0.05);
+    check("temperature interleaving", fabs(b.temperatures - expectedTemperatures) <= 2);
+    check("early reads", m.earlyReads == 0 && b.errors == 0);
+}
+
+static void testShared() {
+    struct i2cSched		s;
+    struct i2cDev		dev1, dev2;
+    struct mockBaro		m1, m2;
+    struct baro			b1, b2;
+    struct collected		c1 = {0}, c2 = {0};
+    struct i2cSchedTask		other = {0};
+    double			seconds;
+
+    seconds = 2.0;
+    mockBaroInit(&m1, &dev1, BARO_MS5611, 0.0001);
+    mockBaroInit(&m2, &dev2, BARO_BMP180, 0.0001);
+    i2cSchedInit(&s);
+    baroInit(&b1, BARO_MS5611, &dev1, 80, -1, 10);
+    baroInit(&b2, BARO_BMP180, &dev2, 30, -1, 10);
+    b1.callback = b2.callback = collect;
+    b1.arg = &c1;
+    b2.arg = &c2;
+    other.name = "other";
+    other.step = otherStep;
+    other.time = i2cSchedTime();
+    i2cSchedAdd(&s, &b1.task);
+    i2cSchedAdd(&s, &b2.task);
+    i2cSchedAdd(&s, &other);
+    run(&s, seconds);
+    printf("%-24s: ms5611 %.1f Hz, bmp180 %.1f Hz, other %.1f Hz, early reads %lld\n", "shared thread",
+	   c1.samples / seconds, c2.samples / seconds, other.steps / seconds, m1.earlyReads + m2.earlyReads);
+    check("shared ms5611 rate", fabs(c1.samples / seconds - 80) < 80 * 0.05);
+    check("shared bmp180 rate", fabs(c2.samples / seconds - 30) < 30 * 0.05);
+    check("shared other rate", fabs(other.steps / seconds - 200) < 200 * 0.05);
+    check("shared early reads", m1.earlyReads + m2.earlyReads == 0);
+    i2cSchedClose(&s);
+}
+
+int main() {
+    testDatasheet(BARO_MS5611, 4, 100009, 20.07);
+    testDatasheet(BARO_BMP180, 0, 69964, 15.0);
+    testRate(BARO_MS5611, 50, 10, 0);
+    testRate(BARO_MS5611, 80, 20, 0.0001);
+    testRate(BARO_BMP180, 30, 10, 0.0001);
+    testShared();
+    if (failures) {
+	printf("%d failures\n", failures);
+	return(1);
+    }
+    printf("All tests passed\n");
+    return(0);
+}
@@ -0,0 +1,236 @@
+/*
+  Tests of the I2C bus owner (../i2cbus) on the fake adapter. Checks
+  register access, batching of requests into transfers, deadline order,
+  isolation of a device not acknowledging, the fallback for adapters
+  accepting a read only as the last message, periodic polls sharing
+  transfers under the scheduler and the utilization accounting.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "fake-i2c.h"
+
+#define MAX_REQUESTS	64
+
+int failures = 0;
+
+struct completion {
+    int		order[MAX_REQUESTS];
+    int		count;
+};
+
+static void check(const char *name, int ok) {
+    if (! ok) {
+	printf("FAIL %s\n", name);
+	failures ++;
+    }
+}
+
+static void record(struct i2cBusRequest *r, int status) {
+    struct completion *c;
+
+    c = (struct completion *) r->arg;
+    if (c->count < MAX_REQUESTS) c->order[c->count++] = r->reg;
+}
+
+// data registers counting samples, e.g. a magnetometer
+static void countSample(struct fakeI2cDevice *d) {
+    d->regs[0] ++;
+}
+
+static void setupRead(struct i2cBusRequest *r, int address, int reg, int len, uint8_t *buf, double deadline, struct completion *c) {
+    memset(r, 0, sizeof(*r));
+    r->address = address;
+    r->op = I2C_BUS_READ;
+    r->reg = reg;
+    r->len = len;
+    r->buf = buf;
+    r->deadline = deadline;
+    r->done = record;
+    r->arg = c;
+}
+
+static void testAccess() {
+    struct fakeI2c		f;
+    struct i2cBus		bus;
+    struct i2cDev		dev;
+    uint8_t			data[4] = {1, 2, 3, 4};
+    uint8_t			buf[4];
+
+    fakeI2cInit(&f, 0, 0);
+    fakeI2cAddDevice(&f, 0x1e);
+    fakeI2cBusInit(&bus, &f);
+    check("write", i2cBusWrite(&bus, 0x1e, 0x10, 4, data) == 0);
+    check("write byte", i2cBusWriteByte(&bus, 0x1e, 0x12, 9) == 0);
+    check("read", i2cBusRead(&bus, 0x1e, 0x10, 4, buf) == 0);
+    check("read data", buf[0] == 1 && buf[1] == 2 && buf[2] == 9 && buf[3] == 4);
+    check("read is one transfer", f.transfers == 3);
+    check("absent device", i2cBusRead(&bus, 0x50, 0x00, 1, buf) < 0);
+
+    i2cDevOpenBus(&dev, &bus, 0x1e);
+    check("dev read", i2cDevReadReg(&dev, 0x11, 1, buf) == 0 && buf[0] == 2);
+    check("dev command", i2cDevCommand(&dev, 0x13) == 0 && fakeI2cFindDevice(&f, 0x1e)->pointer == 0x13);
+    printf("%-24s: %lld transfers, %lld messages\n", "access", f.transfers, f.messages);
+}
+
+static void testBatching() {
+    struct fakeI2c		f;
+    struct i2cBus		bus;
+    struct i2cBusRequest	r[30];
+    struct completion		c = {{0}};
+    uint8_t			buf[30][6];
+    double			deadline, firstMax, restMin;
+    int				i;
+
+    fakeI2cInit(&f, 0, 0);
+    for(i=0; i<4; i++) fakeI2cAddDevice(&f, 0x10 + i);
+    fakeI2cBusInit(&bus, &f);
+
+    // 30 register reads are 60 messages, i.e. two transfers of 21 and 9 reads
+    for(i=0; i<30; i++) {
+	// deadlines in scrambled order, reg identifies the request
+	deadline = 1.0 + ((i * 17) % 30);
+	setupRead(&r[i], 0x10 + i % 4, i, 6, buf[i], deadline, &c);
+	i2cBusSubmit(&bus, &r[i]);
+    }
+    check("batch flush", i2cBusFlush(&bus) == 0);
+    check("batch transfers", f.transfers == 2);
+    check("batch completions", c.count == 30);
+
+    // requests in the first transfer have earlier deadlines than all others
+    firstMax = 0;
+    restMin = 1e9;
+    for(i=0; i<c.count; i++) {
+	deadline = r[c.order[i]].deadline;
+	if (i < 21 && deadline > firstMax) firstMax = deadline;
+	if (i >= 21 && deadline < restMin) restMin = deadline;
+    }
+    check("deadline order", firstMax < restMin);
+    printf("%-24s: 30 reads in %lld transfers, last deadline of first transfer %.0f, first of second %.0f\n",
+	   "batching", f.transfers, firstMax, restMin);
+}
+
+static void testNack() {
+    struct fakeI2c		f;
+    struct i2cBus		bus;
+    struct i2cBusRequest	r[5];
+    struct completion		c = {{0}};
+    uint8_t			buf[5][2];
+    int				i, failed;
+
+    fakeI2cInit(&f, 0, 0);
+    fakeI2cAddDevice(&f, 0x10);
+    fakeI2cAddDevice(&f, 0x11);
+    fakeI2cBusInit(&bus, &f);
+    for(i=0; i<5; i++) {
+	setupRead(&r[i], i == 2 ? 0x50 : 0x10 + i % 2, i, 2, buf[i], 1.0 + i, &c);
+	i2cBusSubmit(&bus, &r[i]);
+    }
+    failed = i2cBusFlush(&bus);
+    check("nack failed count", failed == 1);
+    check("nack isolated", r[2].status < 0 && r[0].status == 0 && r[1].status == 0 && r[3].status == 0 && r[4].status == 0);
+    check("nack errors", bus.errors == 1);
+    printf("%-24s: %d failed of 5, %lld transfers\n", "nack", failed, f.transfers);
+}
+
+static void testReadLastOnly() {
+    struct fakeI2c		f;
+    struct i2cBus		bus;
+    struct i2cBusRequest	r[5], w[3];
+    struct completion		c = {{0}};
+    uint8_t			buf[5][2];
+    uint8_t			v;
+    int				i;
+
+    fakeI2cInit(&f, 0, 0);
+    f.readLastOnly = 1;
+    fakeI2cAddDevice(&f, 0x10);
+    fakeI2cBusInit(&bus, &f);
+    v = 7;
+    for(i=0; i<3; i++) {
+	memset(&w[i], 0, sizeof(w[i]));
+	w[i].address = 0x10;
+	w[i].op = I2C_BUS_WRITE;
+	w[i].reg = 0x20 + i;
+	w[i].len = 1;
+	w[i].buf = &v;
+	w[i].deadline = 1.0 + 2 * i;
+	i2cBusSubmit(&bus, &w[i]);
+    }
+    for(i=0; i<5; i++) {
+	setupRead(&r[i], 0x10, i, 2, buf[i], 2.0 + i, &c);
+	i2cBusSubmit(&bus, &r[i]);
+    }
+    check("read last flush", i2cBusFlush(&bus) == 0);
+    check("read last fallback", bus.maxReads == 1 && f.rejected == 1);
+    // one rejected transfer, then one transfer per read with writes due before it
+    check("read last transfers", f.transfers == 6);
+    printf("%-24s: 5 reads and 3 writes in %lld transfers (1 rejected)\n", "read last only", f.transfers);
+}
+
+static void testPolls() {
+    struct fakeI2c		f;
+    struct i2cBus		bus;
+    struct i2cSched		s;
+    struct i2cBusPoll		p[3];
+    double			rates[3] = {200, 100, 50};
+    double			seconds, t0, expectedWire, period;
+    long long			requests, transfers, messages;
+    int				i;
+
+    fakeI2cInit(&f, 0.00005, 400000);
+    fakeI2cBusInit(&bus, &f);
+    i2cSchedInit(&s);
+    for(i=0; i<3; i++) {
+	fakeI2cAddDevice(&f, 0x10 + i)->onRead = countSample;
+	i2cBusPollInit(&p[i], &bus, 0x10 + i, 0x00, 6, rates[i]);
+	i2cSchedAdd(&s, &p[i].task);
+    }
+    i2cBusTaskInit(&bus);
+    i2cSchedAdd(&s, &bus.task);
+
+    seconds = 2.0;
+    t0 = i2cSchedTime();
+    while (i2cSchedTime() - t0 < seconds) {
+	if (i2cSchedRunOnce(&s) < 0) {
+	    printf("FAIL scheduler step\n");
+	    failures ++;
+	    break;
+	}
+    }
+    // send requests released just before the end
+    i2cBusFlush(&bus);
+    period = i2cSchedTime() - bus.windowStart;
+    requests = bus.requests;
+    transfers = bus.transfers;
+    messages = bus.messages;
+    // every read is 2 messages: 1 + 9 + 9 bits for the register, 10 + 6 * 9 bits for data, 1 stop bit per transfer
+    expectedWire = (requests * (19 + 64) + transfers) / 400000.0;
+    printf("%-24s: %.1f, %.1f, %.1f Hz, %lld requests in %lld transfers, utilization %.2f%%, misses %lld, overruns %lld\n",
+	   "polls", p[0].samples / seconds, p[1].samples / seconds, p[2].samples / seconds, requests, transfers,
+	   100.0 * bus.wireTime / period, bus.deadlineMisses, p[0].overruns + p[1].overruns + p[2].overruns);
+    for(i=0; i<3; i++) check("poll rate", fabs(p[i].samples / seconds - rates[i]) < rates[i] * 0.05);
+    check("poll data", p[0].buf[0] == (uint8_t) f.dev[0].reads);
+    check("polls share transfers", transfers < requests * 0.75);
+    check("poll messages", messages == 2 * requests);
+    // allow for a few late wakeups on a loaded machine
+    check("poll deadlines", bus.deadlineMisses <= requests / 100);
+    check("utilization", fabs(bus.wireTime - expectedWire) < expectedWire * 1e-6);
+    i2cBusReport(&bus, stdout);
+    i2cSchedClose(&s);
+}
+
+int main() {
+    testAccess();
+    testBatching();
+    testNack();
+    testReadLastOnly();
+    testPolls();
+    if (failures) {
+	printf("%d failures\n", failures);
+	return(1);
+    }
+    printf("All tests passed\n");
+    return(0);
+}
@@ -0,0 +1,70 @@
+/*
+  Simulation of the FIFO timestamp reconstruction from imufifo.h. A sensor
+  with an inexact oscillator fills a FIFO, a reader wakes up with random
+  lateness and reads everything accumulated. Reconstructed timestamps are
+  compared with true sample times.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../imufifo.h"
+
+int failures = 0;
+
+// returns max error of reconstructed timestamps after the settling time
+static double simulate(char *name, double odr, double drift, double wakeupRate, double maxLateness, int overflowAt) {
+    struct imuFifoClock	c;
+    double		truePeriod, t, tread, first, err, maxErr, settled;
+    long long		produced, consumed, k;
+    int			i, n;
+
+    srand(1);
+    imuFifoClockInit(&c, odr);
+    truePeriod = 1.0 / (odr * (1.0 + drift));
+    // sensor starts at some phase
+    produced = consumed = 0;
+    maxErr = 0;
+    settled = 5.0;
+    for(i=0; i<wakeupRate * 30; i++) {
+	tread = 0.123 + i / wakeupRate + maxLateness * rand() / RAND_MAX;
+	// samples taken at 0.0005 + k * truePeriod
+	while (0.0005 + produced * truePeriod <= tread) produced ++;
+	if (i == overflowAt) {
+	    // samples lost, reader resets the fifo
+	    consumed = produced;
+	    imuFifoClockReset(&c);
+	    continue;
+	}
+	n = produced - consumed;
+	first = imuFifoClockBatch(&c, n, tread);
+	for(k=0; k<n; k++) {
+	    t = first + k * c.period;
+	    err = fabs(t - (0.0005 + (consumed + k) * truePeriod));
+	    if (tread > settled && err > maxErr) maxErr = err;
+	}
+	consumed += n;
+    }
+    printf("%-24s: odr %6.1f Hz, estimated %7.2f Hz, max timestamp error %4.0f us\n", name, odr * (1.0 + drift), 1.0 / c.period, maxErr * 1e6);
+    if (fabs(1.0 / c.period - odr * (1.0 + drift)) > odr * 0.001) {
+	printf("FAIL %s: period estimate\n", name);
+	failures ++;
+    }
+    return(maxErr);
+}
+
+int main() {
+    // reconstructed time must be within one sample period from the truth
+    if (simulate("exact", 1000, 0, 250, 0.0002, -1) > 0.001) failures ++;
+    if (simulate("fast oscillator", 1000, 0.03, 250, 0.0002, -1) > 0.001) failures ++;
+    if (simulate("slow oscillator", 1600, -0.04, 400, 0.0003, -1) > 1/1600.0) failures ++;
+    if (simulate("late wakeups", 1000, 0.01, 100, 0.002, -1) > 0.001) failures ++;
+    if (simulate("overflow", 1000, 0.01, 250, 0.0002, 2000) > 0.001) failures ++;
+
+    if (failures) {
+	printf("%d failures\n", failures);
+	return(1);
+    }
+    printf("All tests passed\n");
+    return(0);
+}
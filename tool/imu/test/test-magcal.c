@@ -0,0 +1,246 @@
+/*
+  Tests of the magnetometer calibration engine on synthetic data. Earth
+  field vectors of a tumbling sensor are distorted by known soft- and
+  hard-iron errors and noise. The fit must recover a correction mapping
+  them back onto a sphere.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../compass/magcal.h"
+
+#define FIELD		450.0
+#define RATE		155.0
+
+int failures = 0;
+
+struct distortion {
+    double	offset[3];
+    double	matrix[3][3];
+    double	noise;
+};
+
+static double gaussian() {
+    double u, v;
+    u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return(sqrt(-2 * log(u)) * cos(2 * M_PI * v));
+}
+
+// Direction of the earth field in sensor frame at time t of a figure-8 like tumbling.
+static void tumble(double t, double h[3], int planar) {
+    double az, el;
+
+    az = 1.3 * t;
+    el = planar ? 0.05 * sin(2.1 * t) : asin(sin(0.37 * t));
+    h[0] = FIELD * cos(el) * cos(az);
+    h[1] = FIELD * cos(el) * sin(az);
+    h[2] = FIELD * sin(el);
+}
+
+static void distort(struct distortion *d, double h[3], double raw[3]) {
+    int i;
+    for(i=0; i<3; i++) {
+	raw[i] = d->matrix[i][0]*h[0] + d->matrix[i][1]*h[1] + d->matrix[i][2]*h[2] + d->offset[i] + d->noise * gaussian();
+    }
+}
+
+static void check(const char *name, int ok) {
+    if (! ok) {
+	printf("FAIL %s\n", name);
+	failures ++;
+    }
+}
+
+// Max relative deviation of corrected true samples (without noise) from the fitted sphere.
+static double sphereError(struct magcal *m, struct distortion *d) {
+    struct distortion	clean;
+    double		h[3], raw[3], out[3], e, maxErr;
+    int			i;
+
+    clean = *d;
+    clean.noise = 0;
+    maxErr = 0;
+    for(i=0; i<2000; i++) {
+	tumble(i * 0.1, h, 0);
+	distort(&clean, h, raw);
+	magcalApply1(&m->correction, raw, out);
+	e = fabs(sqrt(out[0]*out[0] + out[1]*out[1] + out[2]*out[2]) / m->correction.fieldStrength - 1);
+	if (e > maxErr) maxErr = e;
+    }
+    return(maxErr);
+}
+
+static double offsetError(struct magcal *m, struct distortion *d) {
+    double	e;
+    int		i;
+
+    e = 0;
+    for(i=0; i<3; i++) e += (m->correction.offset[i] - d->offset[i]) * (m->correction.offset[i] - d->offset[i]);
+    return(sqrt(e) / FIELD);
+}
+
+// Feed samples at full rate, fit every fitEvery samples. Returns number of
+// samples offered until convergence or -1.
+static long stream(struct magcal *m, struct distortion *d, double t0, double seconds, int planar, int fitEvery) {
+    double	h[3], raw[3];
+    long	i, n;
+
+    n = seconds * RATE;
+    for(i=0; i<n; i++) {
+	tumble(t0 + i / RATE, h, planar);
+	distort(d, h, raw);
+	magcalAdd(m, raw[0], raw[1], raw[2]);
+	if (i % fitEvery == fitEvery - 1 && magcalFit(m) == 0 && m->quality.converged) return(i + 1);
+    }
+    return(-1);
+}
+
+static void report(const char *name, struct magcal *m, struct distortion *d, long samples) {
+    printf("%-24s: %6ld samples, coverage %3.0f%%, residual rms %.4f max %.4f, anisotropy %.3f, offset error %.4f, sphere error %.4f\n",
+	   name, samples, m->quality.coverage * 100, m->quality.residualRms, m->quality.residualMax,
+	   m->quality.anisotropy, offsetError(m, d), sphereError(m, d)
+	);
+}
+
+static struct distortion *defaultDistortion() {
+    static struct distortion d = {
+	{120, -340, 85},
+	{
+	    {1.10, 0.08, -0.03},
+	    {0.05, 0.92, 0.06},
+	    {-0.02, 0.04, 1.04},
+	},
+	3.0,
+    };
+    return(&d);
+}
+
+static void testEllipsoid() {
+    static struct magcal	m;
+    struct distortion		*d;
+    long			n;
+
+    srand(1);
+    d = defaultDistortion();
+    magcalInit(&m);
+    n = stream(&m, d, 0, 60, 0, 50);
+    report("ellipsoid", &m, d, n);
+    check("ellipsoid converged", n > 0);
+    check("ellipsoid offset", offsetError(&m, d) < 0.01);
+    check("ellipsoid sphere", sphereError(&m, d) < 0.01);
+    check("ellipsoid anisotropy", m.quality.anisotropy > 1.1);
+}
+
+static void testLargeHardIron() {
+    static struct magcal	m;
+    struct distortion		d;
+    long			n;
+
+    srand(2);
+    d = *defaultDistortion();
+    d.offset[0] = 3 * FIELD;
+    d.offset[1] = -2 * FIELD;
+    d.offset[2] = FIELD;
+    magcalInit(&m);
+    n = stream(&m, &d, 0, 60, 0, 50);
+    report("large hard iron", &m, &d, n);
+    check("large hard iron converged", n > 0);
+    check("large hard iron offset", offsetError(&m, &d) < 0.01);
+}
+
+static void testPlanar() {
+    static struct magcal	m;
+    struct distortion		*d;
+    long			n;
+
+    srand(3);
+    d = defaultDistortion();
+    magcalInit(&m);
+    n = stream(&m, d, 0, 30, 1, 50);
+    magcalFit(&m);
+    printf("%-24s: fit %s, coverage %3.0f%%, converged %d\n", "planar rotation", m.valid ? "found" : "not found", m.quality.coverage * 100, m.quality.converged);
+    check("planar not converged", n < 0 && ! m.quality.converged);
+    check("planar coverage", m.quality.coverage < MAGCAL_CONVERGED_COVERAGE);
+}
+
+static void testResting() {
+    static struct magcal	m;
+    struct distortion		*d;
+    double			h[3], raw[3];
+    long			i, n;
+
+    // a sensor resting for a long time after calibration must not flush the ring
+    srand(4);
+    d = defaultDistortion();
+    magcalInit(&m);
+    n = stream(&m, d, 0, 60, 0, 50);
+    check("resting converged", n > 0);
+    tumble(0, h, 0);
+    for(i=0; i<100000; i++) {
+	distort(d, h, raw);
+	magcalAdd(&m, raw[0], raw[1], raw[2]);
+    }
+    check("resting fit", magcalFit(&m) == 0);
+    printf("%-24s: stored %lld of %lld samples, coverage %3.0f%%\n", "resting", m.count, m.offered, m.quality.coverage * 100);
+    check("resting coverage", m.quality.coverage >= MAGCAL_CONVERGED_COVERAGE);
+    check("resting offset", offsetError(&m, d) < 0.01);
+}
+
+static void testTracking() {
+    static struct magcal	m;
+    struct distortion		d;
+    long			n;
+
+    // hard iron changes (e.g. sensor moved on the frame), the sliding window must follow
+    srand(5);
+    d = *defaultDistortion();
+    magcalInit(&m);
+    n = stream(&m, &d, 0, 60, 0, 50);
+    check("tracking converged", n > 0);
+    d.offset[0] += 200;
+    d.offset[2] -= 150;
+    stream(&m, &d, 100, 120, 0, 1000000);
+    magcalFit(&m);
+    report("tracking", &m, &d, n);
+    check("tracking offset", offsetError(&m, &d) < 0.01);
+}
+
+static void testApply() {
+    struct magcalCorrection	k;
+    double			offset[3] = {12.5, -300, 41};
+    double			matrix[3][3] = {{1.1, 0.1, -0.2}, {0.1, 0.9, 0.05}, {-0.2, 0.05, 1.02}};
+    double			in[3], out[3], err;
+    float			v[3*100];
+    int				i, j;
+
+    magcalCorrectionSet(&k, offset, matrix);
+    srand(6);
+    for(i=0; i<3*100; i++) v[i] = 1000.0 * rand() / RAND_MAX - 500;
+    err = 0;
+    for(i=0; i<100; i++) {
+	for(j=0; j<3; j++) in[j] = v[3*i+j];
+	magcalApply1(&k, in, out);
+	magcalApply(&k, &v[3*i], &v[3*i], 1);
+	for(j=0; j<3; j++) err = fmax(err, fabs(v[3*i+j] - out[j]));
+    }
+    printf("%-24s: max difference from scalar %g\n", "fused apply", err);
+    check("fused apply", err < 1e-3);
+}
+
+int main() {
+    testEllipsoid();
+    testLargeHardIron();
+    testPlanar();
+    testResting();
+    testTracking();
+    testApply();
+    if (failures) {
+	printf("%d failures\n", failures);
+	return(1);
+    }
+    printf("All tests passed\n");
+    return(0);
+}
@@ -0,0 +1,387 @@
+/*
+  Per frame latency and CPU of rs-pose output paths, on a stubbed frame
+  source (no camera and no librealsense needed).
+
+  The source generates T265 like pose frames (a circle flown with a
+  wobbling attitude) at the given rate. Frames go through:
+
+  1) text: the previous rs-pose, a processing thread blocked in the
+     equivalent of wait_for_frames (mutex + condition), quaternion to
+     Euler conversion, pose and rpy lines written to a pipe. The reader
+     parses the lines and converts rpy back to a quaternion like
+     pose-vizualization/viz.cpp.
+  2) binary: the frame callback fills a struct rsPoseRecord in the
+     source thread and writes it to the pipe. The reader takes the
+     quaternion from the record.
+
+  Latency is measured from the frame generation to the moment the
+  reader has the quaternion, CPU is user + system time of the whole
+  process per frame (source, processing and reader). Quaternions
+  obtained by the reader are compared with the exact rotation. The text
+  path is wrong near pitch +-90 degrees (gimbal lock, T265 mounted
+  pointing downward sees it when the drone is level), its wrong frames
+  are only reported. Any lost frame or wrong quaternion of the binary
+  path is a failure.
+
+  usage: bench-rs-pose [<rate_Hz> [<seconds>]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "sensorbus.h"
+#include "rs-pose-record.h"
+
+#define BENCH_MAX_FRAMES	(1<<20)
+// frames waiting for wait_for_frames, must be a power of 2
+#define BENCH_QUEUE_SIZE	16
+
+enum benchModes {
+    BENCH_TEXT,
+    BENCH_BINARY,
+};
+
+struct benchFrame {
+    uint32_t	sequence;
+    double	timestamp;
+    float	translation[3];
+    float	velocity[3];
+    float	acceleration[3];
+    float	rotation[4];
+};
+
+int			mode;
+int			pipeFd[2];
+double			*generated;
+long			frameCount;
+
+// frame queue between the source and the processing thread of the text mode
+pthread_mutex_t		queueMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t		queueCond = PTHREAD_COND_INITIALIZER;
+struct benchFrame	queue[BENCH_QUEUE_SIZE];
+unsigned		queueHead, queueTail;
+int			sourceDone;
+
+// reader results
+long			received;
+double			latencySum, latencyMax;
+double			quatErrorMax;
+long			quatWrong;
+
+static double monotonicTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static double cpuTime() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return(ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+}
+
+static void writeAll(void *buf, int n) {
+    char	*p;
+    int		r;
+
+    p = (char *) buf;
+    while (n > 0) {
+	r = write(pipeFd[1], p, n);
+	if (r <= 0) {
+	    printf("%s:%d: Write to pipe failed.\n", __FILE__, __LINE__);
+	    exit(-1);
+	}
+	p += r;
+	n -= r;
+    }
+}
+
+static void makeFrame(struct benchFrame *f, uint32_t sequence) {
+    double	t, roll, pitch, yaw, cr, sr, cp, sp, cy, sy;
+
+    t = sequence / 200.0;
+    f->sequence = sequence;
+    f->timestamp = t * 1000;
+    f->translation[0] = cos(t);
+    f->translation[1] = 0.5 * sin(0.3 * t);
+    f->translation[2] = sin(t);
+    f->velocity[0] = -sin(t);
+    f->velocity[1] = 0.15 * cos(0.3 * t);
+    f->velocity[2] = cos(t);
+    f->acceleration[0] = -cos(t);
+    f->acceleration[1] = -0.045 * sin(0.3 * t);
+    f->acceleration[2] = -sin(t);
+    roll = 0.3 * sin(1.7 * t);
+    pitch = 0.4 * sin(1.1 * t);
+    yaw = fmod(t, 2 * M_PI) - M_PI;
+    cr = cos(roll / 2); sr = sin(roll / 2);
+    cp = cos(pitch / 2); sp = sin(pitch / 2);
+    cy = cos(yaw / 2); sy = sin(yaw / 2);
+    f->rotation[0] = sr * cp * cy - cr * sp * sy;
+    f->rotation[1] = cr * sp * cy + sr * cp * sy;
+    f->rotation[2] = cr * cp * sy - sr * sp * cy;
+    f->rotation[3] = cr * cp * cy + sr * sp * sy;
+}
+
+/////////////////////////////////////////////////////////////////////////
+// previous rs-pose: Euler angles and text
+
+static void wikiQuaternionToEulerAngles(quat q, double *yaw, double *pitch, double *roll) {
+    double x, y, z, w;
+    double sinr_cosp, cosr_cosp, sinp, siny_cosp, cosy_cosp;
+
+    x = q[0];
+    y = q[1];
+    z = q[2];
+    w = q[3];
+    sinr_cosp = 2 * (w * x + y * z);
+    cosr_cosp = 1 - 2 * (x * x + y * y);
+    *roll = atan2(sinr_cosp, cosr_cosp);
+    sinp = 2 * (w * y - z * x);
+    if (fabs(sinp) >= 1) {
+	*pitch = - copysign(M_PI / 2, sinp);
+    } else {
+	*pitch = - asin(sinp);
+    }
+    siny_cosp = 2 * (w * z + x * y);
+    cosy_cosp = 1 - 2 * (y * y + z * z);
+    *yaw = atan2(siny_cosp, cosy_cosp);
+}
+
+// as in pose-vizualization/viz.cpp
+static void wikiEulerAnglesToQuaternion(double yaw, double pitch, double roll, double *q) {
+    double cy, sy, cp, sp, cr, sr;
+
+    cy = cos(yaw * 0.5);
+    sy = sin(yaw * 0.5);
+    cp = cos(-pitch * 0.5);
+    sp = sin(-pitch * 0.5);
+    cr = cos(roll * 0.5);
+    sr = sin(roll * 0.5);
+    q[3] = cr * cp * cy + sr * sp * sy;
+    q[0] = sr * cp * cy - cr * sp * sy;
+    q[1] = cr * sp * cy + sr * cp * sy;
+    q[2] = cr * cp * sy - sr * sp * cy;
+}
+
+static void textProcessFrame(struct benchFrame *f) {
+    struct sensorBusSample	s;
+    char			buf[512];
+    quat			q;
+    double			roll, pitch, yaw;
+    int				n;
+
+    memset(&s, 0, sizeof(s));
+    s.timestamp = f->timestamp;
+    s.confidence = 1.0;
+    s.type = SENSOR_BUS_POSITION;
+    rsPoseTranslate(s.value, f->translation[0], f->translation[1], f->translation[2]);
+    n = sensorBusFormatText(&s, buf, sizeof(buf));
+    rsPoseRotate(q, f->rotation[0], f->rotation[1], f->rotation[2], f->rotation[3]);
+    wikiQuaternionToEulerAngles(q, &yaw, &pitch, &roll);
+    s.type = SENSOR_BUS_RPY;
+    s.value[0] = roll;
+    s.value[1] = pitch;
+    s.value[2] = yaw;
+    n += sensorBusFormatText(&s, buf+n, sizeof(buf)-n);
+    writeAll(buf, n);
+}
+
+static void *textProcessThread(void *arg) {
+    struct benchFrame	f;
+
+    for(;;) {
+	pthread_mutex_lock(&queueMutex);
+	while (queueHead == queueTail && ! sourceDone) pthread_cond_wait(&queueCond, &queueMutex);
+	if (queueHead == queueTail) {
+	    pthread_mutex_unlock(&queueMutex);
+	    break;
+	}
+	f = queue[queueTail++ & (BENCH_QUEUE_SIZE-1)];
+	pthread_mutex_unlock(&queueMutex);
+	textProcessFrame(&f);
+    }
+    close(pipeFd[1]);
+    return(NULL);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// frame callback and binary records
+
+static void binaryFrameCallback(struct benchFrame *f) {
+    struct rsPoseRecord r;
+
+    rsPoseRecordFill(&r, f->sequence, f->timestamp, monotonicTime(),
+		     f->translation, f->velocity, f->acceleration, f->rotation, 3, 1);
+    writeAll(&r, sizeof(r));
+}
+
+/////////////////////////////////////////////////////////////////////////
+// reader
+
+static void readerGotQuaternion(uint32_t sequence, double *q) {
+    struct benchFrame	f;
+    quat		e;
+    double		latency, err, errNeg;
+    int			i;
+
+    latency = monotonicTime() - generated[sequence];
+    received ++;
+    latencySum += latency;
+    if (latency > latencyMax) latencyMax = latency;
+    makeFrame(&f, sequence);
+    rsPoseRotate(e, f.rotation[0], f.rotation[1], f.rotation[2], f.rotation[3]);
+    // q and -q are the same rotation
+    err = errNeg = 0;
+    for(i=0; i<4; i++) {
+	err = fmax(err, fabs(q[i] - e[i]));
+	errNeg = fmax(errNeg, fabs(q[i] + e[i]));
+    }
+    err = fmin(err, errNeg);
+    if (err > quatErrorMax) quatErrorMax = err;
+    // text keeps 7 decimals of Euler angles, records keep floats
+    if (err > 1e-5) quatWrong ++;
+}
+
+static void *readerThread(void *arg) {
+    static char		buf[1<<16];
+    struct rsPoseRecord	*r;
+    char		*p, *eol, *eq;
+    double		a[3], q[4];
+    uint32_t		sequence;
+    int			n, len, i, j;
+
+    len = 0;
+    sequence = 0;
+    for(;;) {
+	n = read(pipeFd[0], buf+len, sizeof(buf)-len-1);
+	if (n <= 0) break;
+	len += n;
+	if (mode == BENCH_BINARY) {
+	    for(i=0; i+(int)sizeof(*r)<=len; i+=sizeof(*r)) {
+		r = (struct rsPoseRecord *) (buf+i);
+		if (r->magic != RS_POSE_RECORD_MAGIC || r->size != sizeof(*r)) {
+		    printf("%s:%d: Wrong record.\n", __FILE__, __LINE__);
+		    exit(-1);
+		}
+		for(j=0; j<4; j++) q[j] = r->rotation[j];
+		readerGotQuaternion(r->sequence, q);
+	    }
+	} else {
+	    buf[len] = 0;
+	    for(i=0; (eol = strchr(buf+i, '\n')) != NULL; i = eol - buf + 1) {
+		*eol = 0;
+		p = buf+i;
+		while (*p == ' ') p++;
+		if (strncmp(p, "rpy", 3) != 0) continue;
+		p += 3;
+		for(j=0; j<3; j++) {
+		    a[j] = strtod(p, &eq);
+		    p = eq;
+		}
+		wikiEulerAnglesToQuaternion(a[2], a[1], a[0], q);
+		readerGotQuaternion(sequence++, q);
+	    }
+	}
+	memmove(buf, buf+i, len-i);
+	len -= i;
+    }
+    return(NULL);
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+// Returns number of failures.
+static int run(char *title, int m, double rate, double seconds) {
+    struct benchFrame	f;
+    struct timespec	next;
+    pthread_t		reader, processor;
+    double		cpu0, cpu;
+    long		i;
+
+    mode = m;
+    frameCount = rate * seconds;
+    if (frameCount > BENCH_MAX_FRAMES) frameCount = BENCH_MAX_FRAMES;
+    received = 0;
+    latencySum = latencyMax = quatErrorMax = 0;
+    quatWrong = 0;
+    queueHead = queueTail = sourceDone = 0;
+    if (pipe(pipeFd) != 0) {
+	printf("%s:%d: Can't create pipe.\n", __FILE__, __LINE__);
+	exit(-1);
+    }
+
+    cpu0 = cpuTime();
+    pthread_create(&reader, NULL, readerThread, NULL);
+    if (mode == BENCH_TEXT) pthread_create(&processor, NULL, textProcessThread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for(i=0; i<frameCount; i++) {
+	next.tv_nsec += 1000000000 / rate;
+	while (next.tv_nsec >= 1000000000) {
+	    next.tv_nsec -= 1000000000;
+	    next.tv_sec ++;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	makeFrame(&f, i);
+	generated[i] = monotonicTime();
+	if (mode == BENCH_BINARY) {
+	    binaryFrameCallback(&f);
+	} else {
+	    // a full queue drops the frame, reported as lost by the reader
+	    pthread_mutex_lock(&queueMutex);
+	    if (queueHead - queueTail < BENCH_QUEUE_SIZE) queue[queueHead++ & (BENCH_QUEUE_SIZE-1)] = f;
+	    pthread_cond_signal(&queueCond);
+	    pthread_mutex_unlock(&queueMutex);
+	}
+    }
+    if (mode == BENCH_BINARY) {
+	close(pipeFd[1]);
+    } else {
+	pthread_mutex_lock(&queueMutex);
+	sourceDone = 1;
+	pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueMutex);
+	pthread_join(processor, NULL);
+    }
+    pthread_join(reader, NULL);
+    close(pipeFd[0]);
+    cpu = cpuTime() - cpu0;
+
+    printf("%-8s %ld frames at %.0f Hz: latency avg %6.1f us, max %6.1f us, cpu %5.1f us/frame, %ld wrong quaternions (max error %.1e)\n",
+	   title, received, rate, latencySum / received * 1e6, latencyMax * 1e6, cpu / frameCount * 1e6, quatWrong, quatErrorMax);
+    if (received != frameCount) {
+	printf("FAIL: %ld frames lost\n", frameCount - received);
+	return(1);
+    }
+    if (mode == BENCH_BINARY && quatWrong != 0) {
+	printf("FAIL: wrong quaternion\n");
+	return(1);
+    }
+    return(0);
+}
+
+int main(int argc, char **argv) {
+    double	rate, seconds;
+    int		failures;
+
+    rate = argc > 1 ? strtod(argv[1], NULL) : 200;
+    seconds = argc > 2 ? strtod(argv[2], NULL) : 3;
+    if (rate <= 0 || seconds <= 0) {
+	printf("usage: %s [<rate_Hz> [<seconds>]]\n", argv[0]);
+	exit(-1);
+    }
+    generated = (double *) malloc(BENCH_MAX_FRAMES * sizeof(double));
+
+    failures = 0;
+    failures += run("text", BENCH_TEXT, rate, seconds);
+    failures += run("binary", BENCH_BINARY, rate, seconds);
+    if (failures) return(1);
+    printf("ok\n");
+    return(0);
+}
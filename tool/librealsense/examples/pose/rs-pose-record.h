@@ -0,0 +1,100 @@
+/*
+  Binary pose record of rs-pose (option -b).
+
+  One fixed-layout record is written per pose frame, with the orientation
+  as a quaternion (no Euler angle conversion) and everything else the
+  T265 reports about the frame. Vectors and the quaternion are already
+  translated to the raspilot coordinate system (see rsPoseTranslate and
+  rsPoseRotate), i.e. rotation is what rs-pose publishes as rpy and
+  translation what it publishes as pose.
+
+  Records are written in host byte order, consumers check magic, version
+  and size of the first record and then read sizeof(struct rsPoseRecord)
+  bytes at a time.
+ */
+
+#ifndef RS_POSE_RECORD_H
+#define RS_POSE_RECORD_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "linmath2.h"
+
+#define RS_POSE_RECORD_MAGIC		0x65736f70	// "pose"
+#define RS_POSE_RECORD_VERSION		1
+
+struct rsPoseRecord {
+    uint32_t	magic;
+    uint16_t	version;
+    uint16_t	size;
+    // frame number, consecutive unless frames were dropped
+    uint32_t	sequence;
+    // 0 - failed, 1 - low, 2 - medium, 3 - high (rs2_pose)
+    uint16_t	trackerConfidence;
+    uint16_t	mapperConfidence;
+    // device clock of the frame in milliseconds
+    double	deviceTimestamp;
+    // CLOCK_REALTIME seconds when the frame was received, like other raspilot timestamps
+    double	hostTimestamp;
+    // x, y, z, w
+    float	rotation[4];
+    // meters, m/s and m/s^2
+    float	translation[3];
+    float	velocity[3];
+    float	acceleration[3];
+    float	reserved;
+};
+
+// the layout is fixed, consumers may be compiled separately
+typedef char rsPoseRecordSizeCheck[sizeof(struct rsPoseRecord) == 88 ? 1 : -1];
+
+// Rotation of the sensor mounting, T265 pointing downward and usb connector on the right side of the drone.
+// rotate around an axis -->  R = [sin(alpha/2)*x, sin(alpha/2)*y, sin(alpha/2)*z, cos(alpha/2)]
+static quat rsPoseMountRotation = {0, -0.70710678118655, 0, 0.70710678118655};
+
+// I determined the translation by experimenting, I have no idea why the translation is like that.
+static inline void rsPoseTranslate(vec3 r, double x, double y, double z) {
+    r[0] = -z;
+    r[1] = -x;
+    r[2] = y;
+}
+
+static inline void rsPoseRotate(quat r, double x, double y, double z, double w) {
+    quat q;
+
+    q[0] = -z;
+    q[1] = -x;
+    q[2] = y;
+    q[3] = w;
+    quat_mul(r, q, rsPoseMountRotation);
+}
+
+// Fill the record from values of rs2_pose in the T265 coordinate system.
+static inline void rsPoseRecordFill(struct rsPoseRecord *r, uint32_t sequence, double deviceTimestamp, double hostTimestamp,
+                                    const float translation[3], const float velocity[3], const float acceleration[3],
+                                    const float rotation[4], int trackerConfidence, int mapperConfidence) {
+    quat	q;
+    vec3	v;
+    int		i;
+
+    memset(r, 0, sizeof(*r));
+    r->magic = RS_POSE_RECORD_MAGIC;
+    r->version = RS_POSE_RECORD_VERSION;
+    r->size = sizeof(*r);
+    r->sequence = sequence;
+    r->trackerConfidence = trackerConfidence;
+    r->mapperConfidence = mapperConfidence;
+    r->deviceTimestamp = deviceTimestamp;
+    r->hostTimestamp = hostTimestamp;
+    rsPoseRotate(q, rotation[0], rotation[1], rotation[2], rotation[3]);
+    for(i=0; i<4; i++) r->rotation[i] = q[i];
+    rsPoseTranslate(v, translation[0], translation[1], translation[2]);
+    for(i=0; i<3; i++) r->translation[i] = v[i];
+    rsPoseTranslate(v, velocity[0], velocity[1], velocity[2]);
+    for(i=0; i<3; i++) r->velocity[i] = v[i];
+    rsPoseTranslate(v, acceleration[0], acceleration[1], acceleration[2]);
+    for(i=0; i<3; i++) r->acceleration[i] = v[i];
+}
+
+#endif
@@ -3,6 +3,18 @@
 
 cd ~/dev/raspilot/tool/librealsense/build/examples/pose ; make ; /usr/bin/c++  -pedantic -g -Wno-missing-field-initializers -Wno-switch -Wno-multichar -Wsequence-point -Wformat -Wformat-security -mfpu=neon -mfloat-abi=hard -ftree-vectorize -latomic -pthread -O3 -DNDEBUG -rdynamic CMakeFiles/rs-pose.dir/rs-pose.cpp.o -o rs-pose  -Wl,-rpath,/home/vittek/dev/raspilot/tool/librealsense/build: ../../librealsense2.so.2.50.0 -latomic
 
+ Samples are published through the sensor bus, add tool/sensorbus/sensorbus.c to
+ the sources of the example and tool/sensorbus to its include directories.
+
+ usage: rs-pose [-b] [-q]
+
+ -b  write binary records (struct rsPoseRecord, rs-pose-record.h) to stdout instead of
+     publishing pose and rpy, the orientation stays a quaternion
+ -q  publish the orientation as quat instead of rpy
+
+ Frames are processed in the librealsense callback, bench-rs-pose compares it with the
+ previous wait_for_frames loop and text output on a stubbed frame source.
+
 */
 
 // License: Apache 2.0. See LICENSE file in root directory.
@@ -13,16 +25,28 @@ cd ~/dev/raspilot/tool/librealsense/build/examples/pose ; make ; /usr/bin/c++  -
 #include "example-utils.hpp"
 
 #include "string.h"
+#include <signal.h>
+#include <unistd.h>
 #include "linmath2.h"
+#include "sensorbus.h"
+#include "rs-pose-record.h"
+
+struct sensorBusChannel *buspose;
+struct sensorBusChannel *busrpy;
+struct sensorBusChannel *busquat;
+
+// output options
+int optBinary;
+int optQuaternion;
 
-// rotate around an axis -->  R = [sin(alpha/2)*x, sin(alpha/2)*y, sin(alpha/2)*z, cos(alpha/2)]
-quat rotation = {0, -0.70710678118655, 0, 0.70710678118655};
+volatile sig_atomic_t stopFlag;
 
 // Translate pose and orientation to raspilot coordinate system and print it.
 // The reported position/orientation must be in CS_GBASE coordinate system.
 // The reported orientation is directly the orientation of the drone, raspilot is not doing any additional
 // transformation on it, you have to take into  account the orientation how the sensor is mounted on the drone.
 // The position is the position of the sensor in the same coordinate system as the orientation.
+// See rsPoseTranslate and rsPoseRotate in rs-pose-record.h.
 
 static void wikiQuaternionToEulerAngles(quat q, double *yaw, double *pitch, double *roll) {
     double x, y, z, w;
@@ -55,34 +79,107 @@ static void wikiQuaternionToEulerAngles(quat q, double *yaw, double *pitch, doub
 }
 
 
-// Teh translation used here is for T265 pointing downward and usb connector is on the right side of the drone.
-// I determined the translation by experimenting, I have no idea why the translation is like that.
-void translateAndPrintPose(double x, double y, double z) {
-  vec3 r, p;
-  p[0] = -z;
-  p[1] = -x;
-  p[2] = y;
-  printf("pose %f %f %f\n", p[0], p[1], p[2]);
+int translateAndPrintPose(double t, double x, double y, double z) {
+  double p[3];
+  rsPoseTranslate(p, x, y, z);
+  return(sensorBusPublish(buspose, t, 1.0, p));
 }
-void translateAndPrintOrientation(double x, double y, double z, double w) {
-  quat p, q, i;
+int translateAndPrintOrientation(double t, double x, double y, double z, double w) {
+  quat p;
   double roll, pitch, yaw;
-  q[0] = -z;
-  q[1] = -x;
-  q[2] = y;
-  q[3] = w;
-  quat_mul(p, q, rotation);
+  double rpy[3];
+  rsPoseRotate(p, x, y, z, w);
   // printf("quat %f %f %f %f\n", p[0], p[1], p[2], p[3]);
+  // the quaternion goes out as it is, only raspilot needs Euler angles
+  if (optQuaternion) return(sensorBusPublish(busquat, t, 1.0, p));
   wikiQuaternionToEulerAngles(p, &yaw, &pitch, &roll);
-  printf("rpy %f %f %f\n", roll, pitch, yaw);
+  rpy[0] = roll;
+  rpy[1] = pitch;
+  rpy[2] = yaw;
+  return(sensorBusPublish(busrpy, t, 1.0, rpy));
+}
+
+int writePoseRecord(double t, const rs2::frame &f, rs2_pose &pose) {
+  struct rsPoseRecord r;
+  rsPoseRecordFill(&r, (uint32_t) f.get_frame_number(), f.get_timestamp(), t,
+                   &pose.translation.x, &pose.velocity.x, &pose.acceleration.x, &pose.rotation.x,
+                   pose.tracker_confidence, pose.mapper_confidence);
+  if (fwrite(&r, sizeof(r), 1, stdout) != 1) return(-1);
+  if (fflush(stdout) != 0) return(-1);
+  return(0);
+}
+
+// Called from the librealsense thread for each pose frame, as soon as it arrives.
+void poseFrameCallback(const rs2::frame &frame) {
+  double t;
+  int r;
+
+  if (stopFlag) return;
+  auto f = frame.as<rs2::pose_frame>();
+  // with more streams enabled frames come as framesets
+  if (auto fs = frame.as<rs2::frameset>()) f = fs.first_or_default(RS2_STREAM_POSE).as<rs2::pose_frame>();
+  if (! f) return;
+  auto pose_data = f.get_pose_data();
+  t = sensorBusCurrentTime();
+  if (optBinary) {
+    r = writePoseRecord(t, f, pose_data);
+  } else {
+    r = translateAndPrintPose(t, pose_data.translation.x, pose_data.translation.y, pose_data.translation.z);
+    r |= translateAndPrintOrientation(t, pose_data.rotation.x, pose_data.rotation.y, pose_data.rotation.z, pose_data.rotation.w);
+    sensorBusFlush();
+  }
+  // the reader closed our output
+  if (r != 0) stopFlag = 1;
+}
+
+void taskStop(int signum) {
+  stopFlag = 1;
 }
 
 int main(int argc, char * argv[]) try
 {
+    int i;
+
+    optBinary = 0;
+    optQuaternion = 0;
+    for(i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            // binary struct rsPoseRecord to stdout, see rs-pose-record.h
+            optBinary = 1;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            // quat instead of rpy
+            optQuaternion = 1;
+        } else {
+            printf("usage: %s [-b] [-q]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     std::string serial;
     if (!device_with_streams({ RS2_STREAM_POSE}, serial))
         return EXIT_SUCCESS;
 
+    if (optBinary) {
+        // a record is written at once, not split by stdio
+        setvbuf(stdout, NULL, _IOFBF, sizeof(struct rsPoseRecord) * 16);
+    } else {
+        sensorBusTextAutoFlush = 0;
+        buspose = sensorBusOpen("raspilot.realsense-t265.pose", SENSOR_BUS_POSITION);
+        if (optQuaternion) {
+            busquat = sensorBusOpen("raspilot.realsense-t265.quat", SENSOR_BUS_QUATERNION);
+        } else {
+            busrpy = sensorBusOpen("raspilot.realsense-t265.rpy", SENSOR_BUS_RPY);
+            // this tool always printed %f
+            sensorBusSetTextFormat(busrpy, NULL, "%f");
+        }
+        if (buspose == NULL || (busrpy == NULL && busquat == NULL)) return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, taskStop);
+    signal(SIGTERM, taskStop);
+    // a closed pipe is reported by a failed write
+    signal(SIGPIPE, SIG_IGN);
+
     // Declare RealSense pipeline, encapsulating the actual device and sensors
     rs2::pipeline pipe;
     // Create a configuration for configuring the pipeline with a non default profile
@@ -91,26 +188,12 @@ int main(int argc, char * argv[]) try
         cfg.enable_device(serial);
     // Add pose stream
     cfg.enable_stream(RS2_STREAM_POSE, RS2_FORMAT_6DOF);
-    // Start pipeline with chosen configuration
-    pipe.start(cfg);
-
-    // Main loop
-    while (true)
-    {
-        // Wait for the next set of frames from the camera
-        auto frames = pipe.wait_for_frames();
-        // Get a frame from the pose stream
-        auto f = frames.first_or_default(RS2_STREAM_POSE);
-        // Cast the frame to pose_frame and get its data
-        auto pose_data = f.as<rs2::pose_frame>().get_pose_data();
-
-        // Print the x, y, z values of the translation, relative to initial position
-        //std::cout << "\r" << "Device Position: " << std::setprecision(3) << std::fixed << pose_data.translation.x << " " <<
-        //    pose_data.translation.y << " " << pose_data.translation.z << " (meters)";
-	translateAndPrintPose(pose_data.translation.x, pose_data.translation.y, pose_data.translation.z);
-	translateAndPrintOrientation(pose_data.rotation.x, pose_data.rotation.y, pose_data.rotation.z, pose_data.rotation.w);
-	fflush(stdout);
-    }
+    // Start pipeline with chosen configuration. Frames are delivered to the callback
+    // as soon as they arrive instead of being queued for wait_for_frames.
+    pipe.start(cfg, poseFrameCallback);
+
+    while (! stopFlag) usleep(100000);
+    pipe.stop();
 
     return EXIT_SUCCESS;
 }
@@ -1,7 +1,16 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
@@ -26,6 +35,7 @@
 #endif
 
 int debug = 0;
+int motorRealTimeMode = 0;
 
 // TODO: Maybe replace pipes with shared memory
 
@@ -34,11 +44,13 @@ int debug = 0;
 Motor controller is a separate task teking some argument determining number and connection of each motor.
 A usual invocation is 
 
-  motor <input pipe> <output_pipe> <pin0> ... <pin_n> 
+  motor [-rt <cpu>] <input pipe> <output_pipe> <pin0> ... <pin_n> 
 
 where <input pipe>/<output_pipe> can be '-' for stdin/stdout
 respectively, n is the number of motors and pin_i is the connection to
-i-th motor. 
+i-th motor. Option -rt runs the task in real time mode, i.e. pinned to the
+core <cpu> with SCHED_FIFO priority, locked memory and debug output written
+by a separate low priority thread.
 
 When started this task is reading <input_pipe> (or stdin) for the lines containign one of the following commands:
 
@@ -50,6 +62,11 @@ When started this task is reading <input_pipe> (or stdin) for the lines containi
   "land" - try to land (without gyro it means sending some constant pwm for some time then exit)
   "info" - get status informations (not yet implemented)
   "ping<n>" - answer with "pong<n>" to stdout (used to determine communication latency)
+  "mfac<f>" - set the factor <f> corresponding to full throttle in "mt" commands
+  "3d0", "3d1" - switch 3D mode (reverse rotation for negative throttles) off/on
+  "slew<s>" - limit the change of throttle to <s> per second (0 means no limit)
+  "tlin<k>" - thrust linearization, 0 means throttle proportional to thrust, 1 means square root of thrust
+  "mcal<i> <p0> ... <pk>" - calibrate motor i, p_j is the throttle sent for thrust j/k
 
 */
 
@@ -61,14 +78,24 @@ When started this task is reading <input_pipe> (or stdin) for the lines containi
 #define MOTOR_EMERGENCY_LANDING_TIME_SECONDS 	1
 #endif
 
+// real time mode parameters
+#define MOTOR_RT_PRIORITY			80
+#define MOTOR_LOG_RING_SIZE			256
+#define MOTOR_LOG_MSG_SIZE			512
+#define MOTOR_LOG_DRAIN_USLEEP			10000
+#define MOTOR_PREFAULT_STACK_SIZE		(128*1024)
+
 int motorShutdownInProgress = 0;
 int motorEmergencyLandingInProgress = 0;
 int motorStandBy = 1;
 
 int motorPins[MOTOR_MAX];
 double motorThrottle[MOTOR_MAX];
+int motorCommand[MOTOR_MAX];
 int motorMax = 0;
 double motorThrottleFactor = 0;
+struct motorThrottleStage motorStage;
+uint64_t motorLastSendUsec = 0;
 
 int inputPipeFd;
 int outputPipeFd;
@@ -100,26 +127,322 @@ static char *sprintTime_st(long long int utime) {
     return(res);
 }
 
+//////////////////////////////////////////////////////////////////////////////////////
+// Real time mode. The control loop runs pinned to one core with SCHED_FIFO priority
+// and locked memory. Debug output is written into a lock-free single producer ring
+// drained by a low priority thread, so that the control loop never blocks on stdout.
+
+static char		motorLogRing[MOTOR_LOG_RING_SIZE][MOTOR_LOG_MSG_SIZE];
+// head is written only by the control loop, tail only by the drain thread
+static unsigned		motorLogHead = 0;
+static unsigned		motorLogTail = 0;
+static unsigned		motorLogDropped = 0;
+static int		motorLogStop = 0;
+static pthread_t	motorLogThread;
+
+void motorDebugPrintf(const char *fmt, ...) {
+    va_list	ap;
+    unsigned	head, tail;
+
+    va_start(ap, fmt);
+    if (! motorRealTimeMode) {
+	vprintf(fmt, ap);
+	fflush(stdout);
+    } else {
+	head = __atomic_load_n(&motorLogHead, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&motorLogTail, __ATOMIC_ACQUIRE);
+	if (head - tail >= MOTOR_LOG_RING_SIZE) {
+	    __atomic_add_fetch(&motorLogDropped, 1, __ATOMIC_RELAXED);
+	} else {
+	    vsnprintf(motorLogRing[head % MOTOR_LOG_RING_SIZE], MOTOR_LOG_MSG_SIZE, fmt, ap);
+	    __atomic_store_n(&motorLogHead, head+1, __ATOMIC_RELEASE);
+	}
+    }
+    va_end(ap);
+}
+
+static void motorLogDrain() {
+    unsigned	head, tail, dropped;
+
+    tail = __atomic_load_n(&motorLogTail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&motorLogHead, __ATOMIC_ACQUIRE);
+    while (tail != head) {
+	fputs(motorLogRing[tail % MOTOR_LOG_RING_SIZE], stdout);
+	tail ++;
+	__atomic_store_n(&motorLogTail, tail, __ATOMIC_RELEASE);
+    }
+    dropped = __atomic_exchange_n(&motorLogDropped, 0, __ATOMIC_RELAXED);
+    if (dropped) printf("debug Warning: %s:%d: %u debug messages dropped.\n", __FILE__, __LINE__, dropped);
+    fflush(stdout);
+}
+
+static void *motorLogDrainThread(void *arg) {
+    while (! __atomic_load_n(&motorLogStop, __ATOMIC_ACQUIRE)) {
+	motorLogDrain();
+	usleep(MOTOR_LOG_DRAIN_USLEEP);
+    }
+    motorLogDrain();
+    return(NULL);
+}
+
+// Touch the stack we will ever need, so that it is mapped and locked before
+// the control loop starts.
+static int motorPrefaultStack() {
+    volatile char	stack[MOTOR_PREFAULT_STACK_SIZE];
+    int			i, pageSize;
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    for(i=0; i<MOTOR_PREFAULT_STACK_SIZE; i+=pageSize) stack[i] = 0;
+    return(stack[0]);
+}
+
+// Switch the calling thread into real time mode on the given cpu. Returns the number of
+// steps which failed (usually because of missing privileges), the rest stays in effect.
+int motorRealTimeInit(int cpu, int priority) {
+    int			i, r, res, ncpu;
+    cpu_set_t		set;
+    struct sched_param	param;
+
+    res = 0;
+    motorLogStop = 0;
+    r = pthread_create(&motorLogThread, NULL, motorLogDrainThread, NULL);
+    if (r != 0) {
+	printf("debug Error: %s:%d: can't create log thread, real time mode not activated.\n", __FILE__, __LINE__);
+	fflush(stdout);
+	return(-1);
+    }
+    motorRealTimeMode = 1;
+
+    // keep the drain thread away from the real time core
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 1) {
+	CPU_ZERO(&set);
+	for(i=0; i<ncpu; i++) if (i != cpu) CPU_SET(i, &set);
+	pthread_setaffinity_np(motorLogThread, sizeof(set), &set);
+    }
+
+    // never give memory back to the system and never use mmap for malloc, so that
+    // allocations after mlockall do not fault
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+	motorDebugPrintf("debug Warning: %s:%d: mlockall failed: %s\n", __FILE__, __LINE__, strerror(errno));
+	res ++;
+    }
+    motorPrefaultStack();
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+	motorDebugPrintf("debug Warning: %s:%d: can't set affinity to cpu %d: %s\n", __FILE__, __LINE__, cpu, strerror(errno));
+	res ++;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+	motorDebugPrintf("debug Warning: %s:%d: can't set SCHED_FIFO priority %d: %s\n", __FILE__, __LINE__, priority, strerror(errno));
+	res ++;
+    }
+    return(res);
+}
+
+// Flush pending debug messages and return to direct output.
+void motorRealTimeFinalize() {
+    if (! motorRealTimeMode) return;
+    __atomic_store_n(&motorLogStop, 1, __ATOMIC_RELEASE);
+    pthread_join(motorLogThread, NULL);
+    motorRealTimeMode = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// Throttle stage. Translates normalized throttles into integer commands of the motor
+// implementation. All loops run over all MOTOR_MAX motors with no data dependent
+// branches, so that the compiler can vectorize them. Throttle and command arrays
+// passed to the stage must have MOTOR_MAX elements.
+
+// Piecewise linear interpolation in a table of evenly spaced points, u in <0,1>.
+static double motorLutInterpolate(double *points, int pointsMax, double u) {
+    int		j;
+    double	x;
+
+    x = u * (pointsMax - 1);
+    j = x;
+    if (j > pointsMax - 2) j = pointsMax - 2;
+    return(points[j] + (x - j) * (points[j+1] - points[j]));
+}
+
+static void motorThrottleStageBuildLut(struct motorThrottleStage *s, int motor) {
+    int		j;
+    double	u, k;
+
+    k = s->thrustLinearization;
+    for(j=0; j<=MOTOR_LUT_SEGMENTS; j++) {
+	u = (double) j / MOTOR_LUT_SEGMENTS;
+	// Expert says that the throttle shall be square root from thrust.
+	// My experiments do not confirm that, so it is configurable.
+	u = (1 - k) * u + k * sqrt(u);
+	s->lut[motor][j] = motorLutInterpolate(s->calibration[motor], s->calibrationPointsMax[motor], u);
+    }
+}
+
+void motorThrottleStageInit(struct motorThrottleStage *s, struct motorCommandRange *range) {
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->range = *range;
+    for(i=0; i<MOTOR_MAX; i++) {
+	s->calibrationPointsMax[i] = 2;
+	s->calibration[i][0] = 0;
+	s->calibration[i][1] = 1;
+	motorThrottleStageBuildLut(s, i);
+    }
+}
+
+void motorThrottleStageSet3dMode(struct motorThrottleStage *s, int mode3dFlag) {
+    int i;
+
+    s->mode3d = mode3dFlag;
+    // a reverse throttle left from 3D mode would be slewed from as a forward one
+    if (! mode3dFlag) {
+	for(i=0; i<MOTOR_MAX; i++) {
+	    if (s->lastThrottle[i] < 0) s->lastThrottle[i] = 0;
+	}
+    }
+}
+
+void motorThrottleStageSetSlewRate(struct motorThrottleStage *s, double slewRate) {
+    if (slewRate < 0) slewRate = 0;
+    s->slewRate = slewRate;
+}
+
+void motorThrottleStageSetThrustLinearization(struct motorThrottleStage *s, double k) {
+    int i;
+
+    if (k < 0) k = 0;
+    if (k > 1) k = 1;
+    s->thrustLinearization = k;
+    for(i=0; i<MOTOR_MAX; i++) motorThrottleStageBuildLut(s, i);
+}
+
+// Set calibration of one motor. Points are throttles sent for evenly spaced
+// (linearized) thrusts from 0 to 1. They must be non-decreasing values from <0,1>.
+int motorThrottleStageSetCalibration(struct motorThrottleStage *s, int motor, double points[], int pointsMax) {
+    int i;
+
+    if (motor < 0 || motor >= MOTOR_MAX) return(-1);
+    if (pointsMax < 2 || pointsMax > MOTOR_CAL_POINTS_MAX) return(-1);
+    for(i=0; i<pointsMax; i++) {
+	if (! (points[i] >= 0 && points[i] <= 1)) return(-1);
+	if (i > 0 && points[i] < points[i-1]) return(-1);
+    }
+    memcpy(s->calibration[motor], points, pointsMax * sizeof(points[0]));
+    s->calibrationPointsMax[motor] = pointsMax;
+    motorThrottleStageBuildLut(s, motor);
+    return(0);
+}
+
+// Forget slew rate history, next computed throttles will be exactly 'throttle'.
+void motorThrottleStageReset(struct motorThrottleStage *s, double throttle[]) {
+    int		i;
+    double	t, lo;
+
+    lo = s->mode3d ? -1 : 0;
+    for(i=0; i<MOTOR_MAX; i++) {
+	t = throttle[i];
+	s->lastThrottle[i] = (t < lo || t != t) ? lo : (t > 1 ? 1 : t);
+    }
+}
+
+void motorThrottleStageCompute(struct motorThrottleStage *s, double throttle[], double dtSec, int command[]) {
+    int		i, j;
+    int		index[MOTOR_MAX];
+    double	t, x, up, down, last, lo, maxStep;
+    double	limited[MOTOR_MAX], frac[MOTOR_MAX], y0[MOTOR_MAX], y1[MOTOR_MAX];
+    double	base, span, forwardBase, forwardSpan, reverseBase, reverseSpan;
+
+    lo = s->mode3d ? -1 : 0;
+    // a throttle never changes by more than 2, so this disables limiting
+    maxStep = (s->slewRate > 0 && dtSec >= 0) ? s->slewRate * dtSec : 2;
+
+    // clamp and limit slew rate
+    for(i=0; i<MOTOR_MAX; i++) {
+	t = throttle[i];
+	last = s->lastThrottle[i];
+	// NaN fails the first comparison and ends as 'lo'
+	t = t >= lo ? t : lo;
+	t = t <= 1 ? t : 1;
+	up = last + maxStep;
+	down = last - maxStep;
+	t = t <= up ? t : up;
+	t = t >= down ? t : down;
+	limited[i] = t;
+    }
+    memcpy(s->lastThrottle, limited, sizeof(s->lastThrottle));
+
+    // compute lut positions
+    for(i=0; i<MOTOR_MAX; i++) {
+	t = limited[i];
+	x = fabs(t) * MOTOR_LUT_SEGMENTS;
+	// throttle 1 is interpolated within the last segment
+	j = x;
+	j -= (j == MOTOR_LUT_SEGMENTS);
+	index[i] = j;
+	frac[i] = x - j;
+    }
+
+    // gather table entries
+    for(i=0; i<MOTOR_MAX; i++) {
+	y0[i] = s->lut[i][index[i]];
+	y1[i] = s->lut[i][index[i]+1];
+    }
+
+    // interpolate and map to implementation commands
+    if (s->mode3d) {
+	forwardBase = s->range.min3d;
+	forwardSpan = s->range.max3d - s->range.min3d;
+	reverseBase = s->range.min3dReverse;
+	reverseSpan = s->range.max3dReverse - s->range.min3dReverse;
+    } else {
+	forwardBase = reverseBase = s->range.min;
+	forwardSpan = reverseSpan = s->range.max - s->range.min;
+    }
+    for(i=0; i<MOTOR_MAX; i++) {
+	x = y0[i] + frac[i] * (y1[i] - y0[i]);
+	base = limited[i] < 0 ? reverseBase : forwardBase;
+	span = limited[i] < 0 ? reverseSpan : forwardSpan;
+	command[i] = x * span + base;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+
 static void motorSendThrottles() {
     int 	i;
+    unsigned	n;
     uint64_t 	t;
+    double	dt;
+    char	buf[MOTOR_LOG_MSG_SIZE];
 
+    t = currentTimestampUsec();
+    dt = motorLastSendUsec == 0 ? -1 : (t - motorLastSendUsec) / 1000000.0;
+    motorLastSendUsec = t;
+    motorThrottleStageCompute(&motorStage, motorThrottle, dt, motorCommand);
     if (debug) {
-	t = currentTimestampUsec();
-	printf("debug %s: motorSendThrottles: ", sprintTime_st(t));
-	for(i=0; i<motorMax; i++) printf("%f ", motorThrottle[i]);
-	printf("\n");
-	fflush(stdout);
+	n = snprintf(buf, sizeof(buf), "debug %s: motorSendThrottles: ", sprintTime_st(t));
+	for(i=0; i<motorMax && n < sizeof(buf); i++) n += snprintf(buf+n, sizeof(buf)-n, "%f->%d ", motorThrottle[i], motorCommand[i]);
+	motorDebugPrintf("%s\n", buf);
     }
-    motorImplementationSendThrottles(motorPins, motorMax, motorThrottle);
+    motorImplementationSendThrottles(motorPins, motorMax, motorCommand);
 }
 
 static void motorStartEmergencyLanding() {
     int i;
     // This is some emergency stop. If there is an error on the input, try to land with minimal damage.
-    printf("debug motor: emergency landing\n"); fflush(stdout);
+    motorDebugPrintf("debug motor: emergency landing\n");
     motorEmergencyLandingInProgress = 1;
     for(i=0; i<motorMax; i++) motorThrottle[i] = motorThrottleSafeLand[i];
+    motorThrottleStageReset(&motorStage, motorThrottle);
     // send zero throttles several time for case dshot frame is missed or so
     for(i=0; i<10; i++) {
 	motorSendThrottles();
@@ -206,7 +529,7 @@ int readThrustFromInputPipe() {
 	// Anyway for now we do nothing if select was just interrupted
 	if (errno == EINTR) return(0);
 	// this probably means some more serious error, do emergency landing
-	printf("debug Error: %s:%d: select returned %d, errno == %d, emergency landing!\n", __FILE__, __LINE__, r, errno);
+	motorDebugPrintf("debug Error: %s:%d: select returned %d, errno == %d, emergency landing!\n", __FILE__, __LINE__, r, errno);
 	goto emergencyLanding;
     }
     // check for timeout expired.
@@ -214,25 +537,24 @@ int readThrustFromInputPipe() {
     // for resending last command and a longer one to actual timeout and panic!
     if (r == 0) {
 	if (motorStandBy) return(1);
-	printf("debug Error: %s:%d: select returned 0 == timeout, errno == %d, emergency landing!\n", __FILE__, __LINE__, errno);
-	printf("debug Current timestamp == %s\n", sprintTime_st(currentTimestampUsec()));
-	fflush(stdout);
+	motorDebugPrintf("debug Error: %s:%d: select returned 0 == timeout, errno == %d, emergency landing!\n", __FILE__, __LINE__, errno);
+	motorDebugPrintf("debug Current timestamp == %s\n", sprintTime_st(currentTimestampUsec()));
 	goto emergencyLanding;
     }
     // if there is some problem with stdin, do emergency landing
     if (FD_ISSET(inputPipeFd, &errset)) {
-	printf("debug Error: %s:%d: select reported exception on stdin, emergency landing!\n", __FILE__, __LINE__);	
+	motorDebugPrintf("debug Error: %s:%d: select reported exception on stdin, emergency landing!\n", __FILE__, __LINE__);	
 	goto emergencyLanding;
     }
     
     // Hmm. what to do if nothing is signaled, no timeout, no error and still there is
     // nothing on stdin?
     if (! FD_ISSET(inputPipeFd, &inset)) {
-	printf("debug Error: %s:%d: select reported no input on stdin, emergency landing!\n", __FILE__, __LINE__);	
+	motorDebugPrintf("debug Error: %s:%d: select reported no input on stdin, emergency landing!\n", __FILE__, __LINE__);	
 	goto emergencyLanding;
     }
     if (bbbi >= MOTOR_READ_BUFFER_SIZE - 2) {
-	printf("debug Error: %s:%d: read buffer full before read, emergency landing!\n", __FILE__, __LINE__);	
+	motorDebugPrintf("debug Error: %s:%d: read buffer full before read, emergency landing!\n", __FILE__, __LINE__);	
 	goto emergencyLanding;
     }
     // o.k. we have something on stdin
@@ -241,13 +563,13 @@ int readThrustFromInputPipe() {
 	// surprising this seems to happens when the writing end of pipe is closed
 	usleep(10000);
 	if (motorStandBy) return(1);
-	printf("debug Error: %s:%d: read has read nothing!\n", __FILE__, __LINE__);
+	motorDebugPrintf("debug Error: %s:%d: read has read nothing!\n", __FILE__, __LINE__);
 	// return(0);
 	goto emergencyLanding;
     }
     bbbi += n;
     if (bbbi >= MOTOR_READ_BUFFER_SIZE) {
-	printf("debug Error: %s:%d: read buffer overflowed! Emergency landing!\n", __FILE__, __LINE__);		
+	motorDebugPrintf("debug Error: %s:%d: read buffer overflowed! Emergency landing!\n", __FILE__, __LINE__);		
 	goto emergencyLanding;
     }
     bbb[bbbi] = 0;
@@ -261,8 +583,7 @@ int readThrustFromInputPipe() {
 	if (debug) {
 	    uint64_t 	t;
 	    t = currentTimestampUsec();
-	    printf("debug %s: %s:%d: Parsing '%s'\n", sprintTime_st(t), __FILE__, __LINE__, bbb);
-	    fflush(stdout);
+	    motorDebugPrintf("debug %s: %s:%d: Parsing '%s'\n", sprintTime_st(t), __FILE__, __LINE__, bbb);
 	}
 #if 0
 	    uint64_t 	t;
@@ -291,8 +612,7 @@ int readThrustFromInputPipe() {
 #else
 		    t = strtoint(q, &eq);
 		    if (motorThrottleFactor == 0 && t != 0) {
-			printf("debug %s: %s:%d: Motor throttle factor not set while parsing '%s'\n", sprintTime_st(t), __FILE__, __LINE__, bbb);
-			fflush(stdout);
+			motorDebugPrintf("debug %s: %s:%d: Motor throttle factor not set while parsing '%s'\n", sprintTime_st(currentTimestampUsec()), __FILE__, __LINE__, bbb);
 			t = 0;
 		    } else {
 			t = t * motorThrottleFactor;
@@ -305,10 +625,10 @@ int readThrustFromInputPipe() {
 			if (t < -1 || t > 1) {
 			    parsedOkFlag = 0;
 			} else {
-			    if (t <= 0) t = 0;
-			    // Expert says that the throttle shall be square root from thrust.
-			    // My experiments do not confirm that
-			    motorThrottle[i] = t; // sqrt(t);
+			    // negative throttles mean reverse rotation in 3D mode
+			    if (t <= 0 && ! motorStage.mode3d) t = 0;
+			    // thrust curve and calibration are applied in motorSendThrottles
+			    motorThrottle[i] = t;
 			}
 		    }
 		}
@@ -318,21 +638,23 @@ int readThrustFromInputPipe() {
 	    if (parsedOkFlag) {
 		res |= 1;
 	    } else {
-		printf("debug Error: %s:%d: In line: %s\n", __FILE__, __LINE__, bbb);
+		motorDebugPrintf("debug Error: %s:%d: In line: %s\n", __FILE__, __LINE__, bbb);
 		goto emergencyLanding;
 	    }
 	} else if (q[0] == 's' && q[1] == 't' && q[2] == 'a' && q[3] == 'n') {
 	    // stand bye. This happens when raspilot exits, wait until a new connection happens
 	    motorStandBy = 1;
 	    for(i=0; i<motorMax; i++) motorThrottle[i] =  0;
+	    motorThrottleStageReset(&motorStage, motorThrottle);
 	    res |= 1;
 	} else if (q[0] == 'e' && q[1] == 'x' && q[2] == 'i' && q[3] == 't') {
 	    motorShutdownInProgress = 1;
 	    for(i=0; i<motorMax; i++) motorThrottle[i] =  0;
+	    motorThrottleStageReset(&motorStage, motorThrottle);
 	    res |= 1;
 	} else if (q[0] == 'l' && q[1] == 'a' && q[2] == 'n' && q[3] == 'd') {
 	    // raspilot asked for emergency landing
-	    printf("debug Warning: %s:%d: autopilot asked for Emergency landing!\n", __FILE__, __LINE__);	
+	    motorDebugPrintf("debug Warning: %s:%d: autopilot asked for Emergency landing!\n", __FILE__, __LINE__);	
 	    goto emergencyLanding;
 	} else if (q[0] == 'p' && q[1] == 'i' && q[2] == 'n' && q[3] == 'g') {
 	    tstamp = atoll(q+4);
@@ -345,10 +667,12 @@ int readThrustFromInputPipe() {
 	} else if (q[0] == '3' && q[1] == 'd' && q[2] == '0') {
 	    // no 3d mode
 	    motorImplementationSet3dModeAndSpinDirection(motorPins, motorMax, 0, 0);
+	    motorThrottleStageSet3dMode(&motorStage, 0);
 	    res |= 0;
 	} else if (q[0] == '3' && q[1] == 'd' && q[2] == '1') {
 	    // set 3d mode
 	    motorImplementationSet3dModeAndSpinDirection(motorPins, motorMax, 1, 0);
+	    motorThrottleStageSet3dMode(&motorStage, 1);
 	    res |= 0;
 	} else if (q[0] == 'm' && q[1] == 'f' && q[2] == 'a' && q[3] == 'c') {
 	    // set factor for throttles sent as integers
@@ -359,12 +683,37 @@ int readThrustFromInputPipe() {
 		motorThrottleFactor = 0;
 	    }
 	    res |= 0;
+	} else if (q[0] == 's' && q[1] == 'l' && q[2] == 'e' && q[3] == 'w') {
+	    // set max throttle change per second, 0 == unlimited
+	    t = strtod(q+4, &eq);
+	    motorThrottleStageSetSlewRate(&motorStage, t);
+	    res |= 0;
+	} else if (q[0] == 't' && q[1] == 'l' && q[2] == 'i' && q[3] == 'n') {
+	    // set thrust linearization, 0 == linear, 1 == square root
+	    t = strtod(q+4, &eq);
+	    motorThrottleStageSetThrustLinearization(&motorStage, t);
+	    res |= 0;
+	} else if (q[0] == 'm' && q[1] == 'c' && q[2] == 'a' && q[3] == 'l' && isdigit(q[4])) {
+	    // set calibration points of one motor
+	    double	points[MOTOR_CAL_POINTS_MAX];
+	    q += 4;
+	    d = strtol(q, &eq, 10);
+	    q = eq;
+	    for(n=0; n<MOTOR_CAL_POINTS_MAX; n++) {
+		points[n] = strtod(q, &eq);
+		if (eq == q) break;
+		q = eq;
+	    }
+	    if (d >= motorMax || motorThrottleStageSetCalibration(&motorStage, d, points, n) != 0) {
+		motorDebugPrintf("debug Error: %s:%d: wrong calibration: %s\n", __FILE__, __LINE__, bbb);
+	    }
+	    res |= 0;
 	} else if (q[0] == 0) {
 	    // empty line, ignore
 	    res |= 0;
 	} else {
 	    // some wrong input, do emergency landing
-	    printf("debug Error: %s:%d: wrong input line: %s! Emergency landing!\n", __FILE__, __LINE__, bbb);
+	    motorDebugPrintf("debug Error: %s:%d: wrong input line: %s! Emergency landing!\n", __FILE__, __LINE__, bbb);
 	    goto emergencyLanding;
 	}
 
@@ -400,23 +749,23 @@ void pinalert(int gpio, int level, uint32_t tick) {
     printf("debug get %d pin level %d\n", gpio, level);
 }
 
+#ifndef MOTOR_COMMON_NO_MAIN
 int main(int argc, char *argv[]) {
-    int i, r, g;
+    int 			i, r, g, rtCpu;
+    struct motorCommandRange	range;
+
+    rtCpu = -1;
+    if (argc >= 3 && strcmp(argv[1], "-rt") == 0) {
+	rtCpu = atoi(argv[2]);
+	argc -= 2;
+	argv += 2;
+    }
     
     if (argc < 3) {
-	printf("debug Usage: motor <input_pipe_path> <output_pipe_path> <gpio_0> ... <gpion>\n");
+	printf("debug Usage: motor [-rt <cpu>] <input_pipe_path> <output_pipe_path> <gpio_0> ... <gpion>\n");
 	exit(-1);
     }
 
-    /* TODO: set affinity
-	cpu_set_t set;
-	CPU_ZERO(&set);
-        // By default set this process to the core 2
-	CPU_SET(2, &set);
-	r = sched_setaffinity(getpid(),sizeof(set),&set);
-	if (r != 0) printf("debug Warning: can't set process affinity.\n");
-    */
-    
     signal(SIGINT, motorStopInterrupt);
     
     if (strcmp(argv[1], "-") == 0) {
@@ -449,6 +798,11 @@ int main(int argc, char *argv[]) {
     motorMax = i;
    
     motorImplementationInitialize(motorPins, motorMax);
+    motorImplementationGetCommandRange(&range);
+    motorThrottleStageInit(&motorStage, &range);
+
+    // go real time after initialization, which may sleep and print a lot
+    if (rtCpu >= 0) motorRealTimeInit(rtCpu, MOTOR_RT_PRIORITY);
 
     motorSendThrottles();
     // This is the main loop reading and executing PWMs
@@ -461,6 +815,7 @@ int main(int argc, char *argv[]) {
     
     // send min_width to motors to stop them before exit
     for(i=0; i<motorMax; i++) motorThrottle[i] = 0;
+    motorThrottleStageReset(&motorStage, motorThrottle);
     // for case of missed dshot frames
     // also make this to take longer than raspilot exit/shutdown sequence (which is 0.5s) in order
     // not to receive SIGPIPE there.
@@ -469,6 +824,8 @@ int main(int argc, char *argv[]) {
 	usleep(10000);
     }
 
+    motorRealTimeFinalize();
     motorImplementationFinalize(motorPins, motorMax);
     return 0;
 }
+#endif
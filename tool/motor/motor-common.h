@@ -3,17 +3,68 @@
 
 #define MOTOR_MAX		64
 
+// Number of segments of per motor throttle lookup tables. Keep it a
+// power of 2, so that the identity table maps throttles exactly.
+#define MOTOR_LUT_SEGMENTS	32
+// Max number of calibration points accepted by "mcal" command.
+#define MOTOR_CAL_POINTS_MAX	(MOTOR_LUT_SEGMENTS+1)
+
 // motor-common.c exports a variable indicating debug level
 extern int debug;
+// and a flag indicating that real time mode is active
+extern int motorRealTimeMode;
+
+// debug output which does not block the control loop in real time mode
+void motorDebugPrintf(const char *fmt, ...);
+int motorRealTimeInit(int cpu, int priority);
+void motorRealTimeFinalize();
+
+// Each motor implementation tells which integer commands correspond
+// to zero and full throttle in normal and in 3D mode. In 3D mode
+// positive throttles are mapped to range <min3d, max3d> and negative
+// throttles to <min3dReverse, max3dReverse>.
+struct motorCommandRange {
+    int		min;
+    int		max;
+    int		min3d;
+    int		max3d;
+    int		min3dReverse;
+    int		max3dReverse;
+};
+
+// Throttle stage translating normalized throttles into integer
+// commands for all motors at once. Thrust curve and per motor
+// calibration are folded into 'lut', which is rebuilt only when one
+// of them changes.
+struct motorThrottleStage {
+    struct motorCommandRange	range;
+    int				mode3d;
+    // max throttle change per second, 0 == unlimited
+    double			slewRate;
+    // 0 == linear throttle, 1 == throttle is square root of thrust
+    double			thrustLinearization;
+    int				calibrationPointsMax[MOTOR_MAX];
+    double			calibration[MOTOR_MAX][MOTOR_CAL_POINTS_MAX];
+    double			lut[MOTOR_MAX][MOTOR_LUT_SEGMENTS+1];
+    // throttles sent last time, used for slew rate limiting
+    double			lastThrottle[MOTOR_MAX];
+};
 
-// each motor implementation have to implement following three
+void motorThrottleStageInit(struct motorThrottleStage *s, struct motorCommandRange *range);
+void motorThrottleStageSet3dMode(struct motorThrottleStage *s, int mode3dFlag);
+void motorThrottleStageSetSlewRate(struct motorThrottleStage *s, double slewRate);
+void motorThrottleStageSetThrustLinearization(struct motorThrottleStage *s, double k);
+int motorThrottleStageSetCalibration(struct motorThrottleStage *s, int motor, double points[], int pointsMax);
+void motorThrottleStageReset(struct motorThrottleStage *s, double throttle[]);
+void motorThrottleStageCompute(struct motorThrottleStage *s, double throttle[], double dtSec, int command[]);
+
+// each motor implementation have to implement following five
 // functions
 
 void motorImplementationInitialize(int motorPins[], int motorMax);
 void motorImplementationFinalize(int motorPins[], int motorMax);
+void motorImplementationGetCommandRange(struct motorCommandRange *range);
 void motorImplementationSet3dModeAndSpinDirection(int motorPins[], int motorMax, int mode3dFlag, int reverseDirectionFlag) ;
-void motorImplementationSendThrottles(int motorPins[], int motorMax, double motorThrottle[]);
-
-
+void motorImplementationSendThrottles(int motorPins[], int motorMax, int motorCommand[]);
 
 
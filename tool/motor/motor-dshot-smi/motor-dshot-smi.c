@@ -102,6 +102,7 @@
 #include <unistd.h>
 #include <time.h>
 #include "rpi_dma_utils.h"
+#include "../motor-common.h"
 
 #include <assert.h>
 
@@ -581,7 +582,17 @@ void motorImplementationFinalize(int motorPins[], int motorMax) {
    
 }
 
-void motorImplementationSendThrottles(int motorPins[], int motorMax, double motorThrottle[]) {
+// Dshot throttle values are 48 - 2047. In 3D mode, 48 - 1047 is reverse and 1048 - 2047 forward rotation.
+void motorImplementationGetCommandRange(struct motorCommandRange *range) {
+    range->min = 48;
+    range->max = 2047;
+    range->min3d = 1048;
+    range->max3d = 2047;
+    range->min3dReverse = 48;
+    range->max3dReverse = 1047;
+}
+
+void motorImplementationSendThrottles(int motorPins[], int motorMax, int motorCommand[]) {
     int         i;
     unsigned    frame[DSHOT_NUM_PINS+1];
     int         val;
@@ -589,18 +600,9 @@ void motorImplementationSendThrottles(int motorPins[], int motorMax, double moto
     assert(motorMax < DSHOT_NUM_PINS);
 
     for(i=0; i<motorMax; i++) {
-        if (dshot3dMode) {
-            // translate double throttles ranging <-1, 1> to dshot frames.
-            if (motorThrottle[i] >= 0) {
-                val = motorThrottle[i] * 999 + 1048;
-            } else {
-                val = -motorThrottle[i] * 999 + 48;
-            }
-        } else {
-            // translate double throttles ranging <0, 1> to dshot frames.
-            val = motorThrottle[i] * 1999 + 48;
-        }
-	// printf("val == %d\n", val);
+        val = motorCommand[i];
+        // we used command 0 for zero thrust which should be used as arming sequence as well.
+        // but in 3d mode we have to be carefull it seems to reset the motor.
         if (val < 48 || val >= 2048) val = DSHOT_CMD_MOTOR_STOP;
         frame[i] = dshotAddChecksumAndTelemetry(val, 0);
     }
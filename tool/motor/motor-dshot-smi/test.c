@@ -4,13 +4,16 @@
 
 extern void motorImplementationInitialize(int motorPins[], int motorMax) ;
 extern void motorImplementationFinalize(int motorPins[], int motorMax) ;
-extern void motorImplementationSendThrottles(int motorPins[], int motorMax, double motorThrottle[]) ;
+extern void motorImplementationSendThrottles(int motorPins[], int motorMax, int motorCommand[]) ;
+
+// translate throttle <0,1> to dshot command
+#define THROTTLE_TO_DSHOT(t)	((int)((t) * 1999 + 48))
 
 
 #define MAXN 	40
 
 int motorPins[MAXN];
-double throttles[MAXN];
+int throttles[MAXN];
 
 int main(int argc, char **argv) {
     int i, n;
@@ -36,7 +39,7 @@ int main(int argc, char **argv) {
     printf("Initializing ESC / Arm, waiting 5 seconds.\n");
     fflush(stdout);
     // send 0 throttle during 5 seconds
-    for(i=0; i<n; i++) throttles[i] = 0;
+    for(i=0; i<n; i++) throttles[i] = THROTTLE_TO_DSHOT(0);
     for(i=0; i<5000; i++) {
         motorImplementationSendThrottles(motorPins, n, throttles);
         usleep(1000);
@@ -45,7 +48,7 @@ int main(int argc, char **argv) {
     printf("Spinning.\n");
     fflush(stdout);
     // make motors spinning on 15% throttle during 5 seconds
-    for(i=0; i<n; i++) throttles[i] = 0.15;
+    for(i=0; i<n; i++) throttles[i] = THROTTLE_TO_DSHOT(0.15);
     for(i=0; i<5000; i++) {
 	motorImplementationSendThrottles(motorPins, n, throttles);
 	usleep(1000);
@@ -54,7 +57,7 @@ int main(int argc, char **argv) {
     printf("Stop.\n");
     fflush(stdout);
     // stop motors
-    for(i=0; i<n; i++) throttles[i] = 0;
+    for(i=0; i<n; i++) throttles[i] = THROTTLE_TO_DSHOT(0);
     motorImplementationSendThrottles(motorPins, n, throttles);
 
     // finalize
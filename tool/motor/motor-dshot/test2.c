@@ -7,14 +7,17 @@
 
 extern void motorImplementationInitialize(int motorPins[], int motorMax) ;
 extern void motorImplementationFinalize(int motorPins[], int motorMax) ;
-extern void motorImplementationSendThrottles(int motorPins[], int motorMax, double motorThrottle[]) ;
+extern void motorImplementationSendThrottles(int motorPins[], int motorMax, int motorCommand[]) ;
+
+// translate throttle <0,1> to dshot command
+#define THROTTLE_TO_DSHOT(t)	((int)((t) * 1999 + 48))
 extern void motorImplementationSet3dModeAndSpinDirection(int motorPins[], int motorMax, int mode3dFlag, int reverseDirectionFlag) ;
 
 #define MAXN 64
 
 int n;
 int motorPins[MAXN];
-double throttles[MAXN];
+int throttles[MAXN];
 
 int main(int argc, char **argv) {
     int i, k;
@@ -39,29 +42,29 @@ int main(int argc, char **argv) {
     // motorImplementationSet3dModeAndSpinDirection(motorPins, n, 1, 0);
 
     // make spinning 1 motor after another
-    for(i=0; i<n; i++) throttles[i] = 0;
+    for(i=0; i<n; i++) throttles[i] = THROTTLE_TO_DSHOT(0);
     for(k=0;k<12;k++) {
 	// spin
-	throttles[k%4] = 0.1;
+	throttles[k%4] = THROTTLE_TO_DSHOT(0.1);
 	for(i=0; i<100; i++) {
 	    motorImplementationSendThrottles(motorPins, n, throttles);
 	    usleep(10000);
 	}
 	// stop
-	throttles[k%4] = 0;
+	throttles[k%4] = THROTTLE_TO_DSHOT(0);
 	for(i=0; i<100; i++) {
 	    motorImplementationSendThrottles(motorPins, n, throttles);
 	    usleep(10000);
 	}
 #if 0	
 	// inverse spin
-	throttles[k%4] = -0.1;
+	throttles[k%4] = (int)(0.1 * 999 + 48);  // reverse rotation in 3D mode
 	for(i=0; i<100; i++) {
 	    motorImplementationSendThrottles(motorPins, n, throttles);
 	    usleep(10000);
 	}
 	// stop
-	throttles[k%4] = 0;
+	throttles[k%4] = THROTTLE_TO_DSHOT(0);
 	for(i=0; i<100; i++) {
 	    motorImplementationSendThrottles(motorPins, n, throttles);
 	    usleep(10000);
@@ -70,7 +73,7 @@ int main(int argc, char **argv) {
     }
     
     // stop motors
-    for(i=0; i<n; i++) throttles[i] = 0;
+    for(i=0; i<n; i++) throttles[i] = THROTTLE_TO_DSHOT(0);
     motorImplementationSendThrottles(motorPins, n, throttles);
 
     // finalize
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "../motor-common.h"
+
 void motorImplementationInitialize(int motorPins[], int motorMax) {
 }
 
@@ -11,5 +13,13 @@ void motorImplementationFinalize(int motorPins[], int motorMax) {
 void motorImplementationSet3dModeAndSpinDirection(int motorPins[], int motorMax, int mode3dFlag, int reverseDirectionFlag) {
 }
 
-void motorImplementationSendThrottles(int motorPins[], int motorMax, double motorThrottle[]) {
+void motorImplementationGetCommandRange(struct motorCommandRange *range) {
+    range->min = range->min3d = 0;
+    range->max = range->max3d = 1000;
+    // like the other drivers, reverse commands grow with reverse thrust
+    range->min3dReverse = 0;
+    range->max3dReverse = 1000;
+}
+
+void motorImplementationSendThrottles(int motorPins[], int motorMax, int motorCommand[]) {
 }
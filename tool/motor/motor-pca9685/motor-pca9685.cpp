@@ -8,7 +8,9 @@
 
 // Check your ESC documentation to learn the max frequency at which it can work
 #define MOTOR_PWM_FREQUENCY_HZ 		200
-#define THROTTLE_TO_ACTIVE_TICKS(t)   	(((t) * 6 + 3) * MOTOR_PWM_FREQUENCY_HZ)
+// Active ticks for zero and full throttle, i.e. ((t) * 6 + 3) * MOTOR_PWM_FREQUENCY_HZ
+#define MOTOR_MIN_ACTIVE_TICKS   	(3 * MOTOR_PWM_FREQUENCY_HZ)
+#define MOTOR_MAX_ACTIVE_TICKS   	(9 * MOTOR_PWM_FREQUENCY_HZ)
 
 Adafruit_PWMServoDriver pwm;
 
@@ -47,8 +49,14 @@ void motorImplementationSet3dModeAndSpinDirection(int motorPins[], int motorMax,
     }
 }
 
-void motorImplementationSendThrottles(int motorPins[], int motorMax, double motorThrottle[]) {
+void motorImplementationGetCommandRange(struct motorCommandRange *range) {
+    // no reverse rotation, negative throttles in 3D mode stop the motor
+    range->min = range->min3d = range->min3dReverse = range->max3dReverse = MOTOR_MIN_ACTIVE_TICKS;
+    range->max = range->max3d = MOTOR_MAX_ACTIVE_TICKS;
+}
+
+void motorImplementationSendThrottles(int motorPins[], int motorMax, int motorCommand[]) {
   int i;
-  for(i=0; i<motorMax; i++) pwm.setPin(motorPins[i], THROTTLE_TO_ACTIVE_TICKS(motorThrottle[i]), false);
+  for(i=0; i<motorMax; i++) pwm.setPin(motorPins[i], motorCommand[i], false);
 }
 
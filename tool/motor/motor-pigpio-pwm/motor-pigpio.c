@@ -12,8 +12,6 @@
 #define MOTOR_PWM_MIN_WIDTH             1100
 #define MOTOR_PWM_MAX_WIDTH             1900
 
-#define THROTTLE_TO_PWM(t) 		((t) * (MOTOR_PWM_MAX_WIDTH - MOTOR_PWM_MIN_WIDTH) + MOTOR_PWM_MIN_WIDTH)
-
 
 static void motorIgnoreInterrupt(int signum) {
     printf("debug %s:%d: Ingored interrupt %d received.\n", __FILE__, __LINE__, signum);
@@ -58,10 +56,17 @@ void motorImplementationSet3dModeAndSpinDirection(int motorPins[], int motorMax,
     }
 }
 
-void motorImplementationSendThrottles(int motorPins[], int motorMax, double motorThrottle[]) {
+// Commands are pulse widths in microseconds
+void motorImplementationGetCommandRange(struct motorCommandRange *range) {
+    // no reverse rotation, negative throttles in 3D mode stop the motor
+    range->min = range->min3d = range->min3dReverse = range->max3dReverse = MOTOR_PWM_MIN_WIDTH;
+    range->max = range->max3d = MOTOR_PWM_MAX_WIDTH;
+}
+
+void motorImplementationSendThrottles(int motorPins[], int motorMax, int motorCommand[]) {
   int i;
   for(i=0; i<motorMax; i++) {
-      // printf("debug sending %g --> %d to pin %d\n", motorThrottle[i], (int)(THROTTLE_TO_PWM(motorThrottle[i])), motorPins[i]); fflush(stdout);
-      gpioPWM(motorPins[i], (int)(THROTTLE_TO_PWM(motorThrottle[i])));
+      // printf("debug sending %d to pin %d\n", motorCommand[i], motorPins[i]); fflush(stdout);
+      gpioPWM(motorPins[i], motorCommand[i]);
   }
 }
@@ -0,0 +1,93 @@
+/*
+  Benchmark of the throttle stage from motor-common.c compared to the per
+  motor mapping previously done by each motor implementation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../motor-common.h"
+
+#define FRAMES		1024
+#define ITERATIONS	200000
+
+double frames[FRAMES][MOTOR_MAX];
+int command[MOTOR_MAX];
+volatile int sink;
+
+static int64_t nanoseconds() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec * 1000000000LL + tt.tv_nsec);
+}
+
+// what motor-dshot.c used to do in motorImplementationSendThrottles
+static void legacyDshotMapping(int motorMax, double motorThrottle[], int val[]) {
+    int i;
+    for(i=0; i<motorMax; i++) {
+	val[i] = motorThrottle[i] * 1999 + 48;
+	if (val[i] < 48 || val[i] >= 2048) val[i] = 0;
+    }
+}
+
+static void report(char *name, int motors, int64_t t) {
+    double ns;
+    ns = (double) t / ITERATIONS;
+    printf("%-36s %3d motors: %8.1f ns/pass %6.2f ns/motor\n", name, motors, ns, ns / motors);
+}
+
+int main() {
+    struct motorThrottleStage	s;
+    struct motorCommandRange	range = {48, 2047, 1048, 2047, 48, 1047};
+    double			cal[] = {0.05, 0.3, 0.55, 0.8, 1};
+    int				i, j;
+    int64_t			t0;
+
+    srand(1);
+    for(i=0; i<FRAMES; i++) {
+	for(j=0; j<MOTOR_MAX; j++) frames[i][j] = (double) rand() / RAND_MAX;
+    }
+
+    t0 = nanoseconds();
+    for(i=0; i<ITERATIONS; i++) {
+	legacyDshotMapping(4, frames[i % FRAMES], command);
+	sink += command[0];
+    }
+    report("legacy per motor mapping", 4, nanoseconds() - t0);
+
+    t0 = nanoseconds();
+    for(i=0; i<ITERATIONS; i++) {
+	legacyDshotMapping(MOTOR_MAX, frames[i % FRAMES], command);
+	sink += command[0];
+    }
+    report("legacy per motor mapping", MOTOR_MAX, nanoseconds() - t0);
+
+    motorThrottleStageInit(&s, &range);
+    t0 = nanoseconds();
+    for(i=0; i<ITERATIONS; i++) {
+	motorThrottleStageCompute(&s, frames[i % FRAMES], 0.001, command);
+	sink += command[0];
+    }
+    report("throttle stage, defaults", MOTOR_MAX, nanoseconds() - t0);
+
+    motorThrottleStageSetThrustLinearization(&s, 0.5);
+    for(j=0; j<MOTOR_MAX; j++) motorThrottleStageSetCalibration(&s, j, cal, 5);
+    motorThrottleStageSetSlewRate(&s, 100);
+    t0 = nanoseconds();
+    for(i=0; i<ITERATIONS; i++) {
+	motorThrottleStageCompute(&s, frames[i % FRAMES], 0.001, command);
+	sink += command[0];
+    }
+    report("throttle stage, curve+lut+slew", MOTOR_MAX, nanoseconds() - t0);
+
+    motorThrottleStageSet3dMode(&s, 1);
+    t0 = nanoseconds();
+    for(i=0; i<ITERATIONS; i++) {
+	motorThrottleStageCompute(&s, frames[i % FRAMES], 0.001, command);
+	sink += command[0];
+    }
+    report("throttle stage, 3D mode", MOTOR_MAX, nanoseconds() - t0);
+
+    return(0);
+}
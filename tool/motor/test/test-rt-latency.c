@@ -0,0 +1,117 @@
+/*
+  Wakeup latency of a 1 kHz control loop, with or without motor-common
+  real time mode, while all cores are loaded by synthetic CPU stress
+  threads. Each iteration runs the throttle stage and every 10th one
+  writes a debug line, as motor-common main loop does with debug on.
+
+  usage:   ./test-rt-latency [-rt <cpu>] [<stress_threads> [<seconds>]]
+  example: sudo ./test-rt-latency -rt 2 8 10
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../motor-common.h"
+
+#define PERIOD_NS		1000000LL
+#define HISTOGRAM_US		20000
+#define STRESS_BUFFER_SIZE	(4*1024*1024)
+
+int stressStop = 0;
+int histogram[HISTOGRAM_US+1];
+
+static int64_t nanoseconds() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec * 1000000000LL + tt.tv_nsec);
+}
+
+// burn cpu and pollute caches
+static void *stressThread(void *arg) {
+    char	*buf;
+    double	x;
+    int		i;
+
+    buf = (char *) malloc(STRESS_BUFFER_SIZE);
+    x = 1;
+    while (! __atomic_load_n(&stressStop, __ATOMIC_RELAXED)) {
+	for(i=0; i<STRESS_BUFFER_SIZE; i+=64) buf[i] += i;
+	for(i=0; i<100000; i++) x = x * 1.0000001 + 0.0000001;
+    }
+    free(buf);
+    return(NULL);
+}
+
+static int percentile(int samples, double p) {
+    int i, n;
+    n = 0;
+    for(i=0; i<=HISTOGRAM_US; i++) {
+	n += histogram[i];
+	if (n >= samples * p) return(i);
+    }
+    return(HISTOGRAM_US);
+}
+
+int main(int argc, char **argv) {
+    struct motorThrottleStage	s;
+    struct motorCommandRange	range = {48, 2047, 1048, 2047, 48, 1047};
+    double			throttle[MOTOR_MAX];
+    int				command[MOTOR_MAX];
+    pthread_t			stress[256];
+    int				i, rtCpu, stressMax, seconds, samples, us;
+    int64_t			next, now, latency, maxLatency, sumLatency;
+    struct timespec		tt;
+
+    rtCpu = -1;
+    if (argc >= 3 && strcmp(argv[1], "-rt") == 0) {
+	rtCpu = atoi(argv[2]);
+	argc -= 2;
+	argv += 2;
+    }
+    stressMax = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    seconds = argc > 2 ? atoi(argv[2]) : 5;
+    if (stressMax > 256) stressMax = 256;
+
+    for(i=0; i<stressMax; i++) pthread_create(&stress[i], NULL, stressThread, NULL);
+    if (rtCpu >= 0 && motorRealTimeInit(rtCpu, 80) != 0) {
+	fprintf(stderr, "Warning: real time mode only partially activated, are you root?\n");
+    }
+
+    motorThrottleStageInit(&s, &range);
+    for(i=0; i<MOTOR_MAX; i++) throttle[i] = 0.15;
+    samples = seconds * (1000000000LL / PERIOD_NS);
+    maxLatency = sumLatency = 0;
+    next = nanoseconds() + PERIOD_NS;
+    for(i=0; i<samples; i++) {
+	tt.tv_sec = next / 1000000000LL;
+	tt.tv_nsec = next % 1000000000LL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tt, NULL);
+	now = nanoseconds();
+	latency = now - next;
+	if (latency > maxLatency) maxLatency = latency;
+	sumLatency += latency;
+	us = latency / 1000;
+	histogram[us > HISTOGRAM_US ? HISTOGRAM_US : us] ++;
+
+	throttle[i % MOTOR_MAX] = (i % 1000) / 1000.0;
+	motorThrottleStageCompute(&s, throttle, PERIOD_NS / 1e9, command);
+	if (i % 10 == 0) motorDebugPrintf("debug iteration %d: command %d, latency %lld ns\n", i, command[0], (long long) latency);
+	next += PERIOD_NS;
+	// do not accumulate delay if we were preempted for longer than a period
+	if (next < now) next = now + PERIOD_NS;
+    }
+
+    motorRealTimeFinalize();
+    __atomic_store_n(&stressStop, 1, __ATOMIC_RELAXED);
+    for(i=0; i<stressMax; i++) pthread_join(stress[i], NULL);
+
+    // debug lines go to stdout, so report to stderr
+    fprintf(stderr, "mode %s, %d stress threads, %d samples\n", rtCpu >= 0 ? "real time" : "normal", stressMax, samples);
+    fprintf(stderr, "latency avg %.1f us, p99 %d us, p99.9 %d us, max %.1f us\n",
+	   sumLatency / 1000.0 / samples, percentile(samples, 0.99), percentile(samples, 0.999), maxLatency / 1000.0);
+    return(0);
+}
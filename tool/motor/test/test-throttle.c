@@ -0,0 +1,153 @@
+/*
+  Golden output tests of the throttle stage from motor-common.c. Expected
+  commands for default settings are those produced by the per backend
+  mappings used before the throttle stage existed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../motor-common.h"
+
+#define N 9
+
+// command ranges of motor implementations
+struct motorCommandRange dshotRange = {48, 2047, 1048, 2047, 48, 1047};
+struct motorCommandRange pigpioRange = {1100, 1900, 1100, 1900, 1100, 1100};
+struct motorCommandRange pca9685Range = {600, 1800, 600, 1800, 600, 600};
+struct motorCommandRange unitRange = {0, 1000, 0, 1000, 0, -1000};
+
+double throttles[N] = {0, 0.001, 0.1, 0.15, 0.333, 0.5, 0.667, 0.999, 1};
+double throttles3d[N] = {-1, -0.5, -0.15, -0.001, 0, 0.001, 0.15, 0.5, 1};
+
+int dshotGolden[N] = {48, 49, 247, 347, 713, 1047, 1381, 2045, 2047};
+int dshot3dGolden[N] = {1047, 547, 197, 48, 1048, 1048, 1197, 1547, 2047};
+int pigpioGolden[N] = {1100, 1100, 1180, 1220, 1366, 1500, 1633, 1899, 1900};
+int pca9685Golden[N] = {600, 601, 720, 780, 999, 1200, 1400, 1798, 1800};
+
+int failures = 0;
+
+static void check(char *name, int index, int value, int expected) {
+    if (value != expected) {
+	printf("FAIL %s[%d]: got %d, expected %d\n", name, index, value, expected);
+	failures ++;
+    }
+}
+
+// feed each test throttle to a different motor, all in one pass
+static void checkGolden(char *name, struct motorCommandRange *range, int mode3d, double *in, int *golden) {
+    struct motorThrottleStage	s;
+    double			throttle[MOTOR_MAX];
+    int				command[MOTOR_MAX];
+    int				i;
+
+    motorThrottleStageInit(&s, range);
+    motorThrottleStageSet3dMode(&s, mode3d);
+    for(i=0; i<MOTOR_MAX; i++) throttle[i] = in[i % N];
+    motorThrottleStageCompute(&s, throttle, 0.001, command);
+    for(i=0; i<MOTOR_MAX; i++) check(name, i, command[i], golden[i % N]);
+}
+
+static void checkSlewRate() {
+    struct motorThrottleStage	s;
+    double			throttle[MOTOR_MAX];
+    int				command[MOTOR_MAX];
+    int				i, j;
+    int				golden[] = {250, 500, 750, 1000, 1000};
+
+    motorThrottleStageInit(&s, &unitRange);
+    motorThrottleStageSetSlewRate(&s, 2.0);
+    for(i=0; i<MOTOR_MAX; i++) throttle[i] = 1;
+    for(j=0; j<5; j++) {
+	motorThrottleStageCompute(&s, throttle, 0.125, command);
+	for(i=0; i<MOTOR_MAX; i++) check("slew up", j, command[i], golden[j]);
+    }
+    // going down is limited as well
+    for(i=0; i<MOTOR_MAX; i++) throttle[i] = 0;
+    motorThrottleStageCompute(&s, throttle, 0.125, command);
+    check("slew down", 0, command[0], 750);
+    // reset bypasses the limit
+    motorThrottleStageReset(&s, throttle);
+    motorThrottleStageCompute(&s, throttle, 0.125, command);
+    check("slew reset", 0, command[0], 0);
+    // unknown time step does not limit
+    throttle[0] = 1;
+    motorThrottleStageCompute(&s, throttle, -1, command);
+    check("slew unknown dt", 0, command[0], 1000);
+}
+
+static void checkLeaving3dMode() {
+    struct motorThrottleStage	s;
+    double			throttle[MOTOR_MAX];
+    int				command[MOTOR_MAX];
+    int				i;
+
+    motorThrottleStageInit(&s, &dshotRange);
+    motorThrottleStageSetSlewRate(&s, 2.0);
+    motorThrottleStageSet3dMode(&s, 1);
+    for(i=0; i<MOTOR_MAX; i++) throttle[i] = -1;
+    motorThrottleStageReset(&s, throttle);
+    motorThrottleStageSet3dMode(&s, 0);
+    // full reverse must not come out as forward thrust
+    motorThrottleStageCompute(&s, throttle, 0.125, command);
+    check("3d off", 0, command[0], 48);
+}
+
+static void checkThrustLinearization() {
+    struct motorThrottleStage	s;
+    double			throttle[MOTOR_MAX];
+    int				command[MOTOR_MAX];
+    int				i;
+
+    motorThrottleStageInit(&s, &unitRange);
+    motorThrottleStageSetThrustLinearization(&s, 1.0);
+    for(i=0; i<MOTOR_MAX; i++) throttle[i] = 0;
+    throttle[0] = 0.25;
+    throttle[1] = 0.5;
+    throttle[2] = 1;
+    motorThrottleStageCompute(&s, throttle, 0.001, command);
+    check("tlin", 0, command[0], 500);
+    check("tlin", 1, command[1], 707);
+    check("tlin", 2, command[2], 1000);
+    check("tlin", 3, command[3], 0);
+}
+
+static void checkCalibration() {
+    struct motorThrottleStage	s;
+    double			throttle[MOTOR_MAX];
+    int				command[MOTOR_MAX];
+    double			idle[] = {0.25, 1};
+    double			wrong[] = {0.5, 0.25, 1};
+    int				i;
+
+    motorThrottleStageInit(&s, &unitRange);
+    check("mcal", 0, motorThrottleStageSetCalibration(&s, 1, idle, 2), 0);
+    check("mcal wrong", 0, motorThrottleStageSetCalibration(&s, 2, wrong, 3), -1);
+    check("mcal wrong", 1, motorThrottleStageSetCalibration(&s, MOTOR_MAX, idle, 2), -1);
+    for(i=0; i<MOTOR_MAX; i++) throttle[i] = 0.5;
+    throttle[3] = NAN;
+    throttle[4] = 7;
+    motorThrottleStageCompute(&s, throttle, 0.001, command);
+    check("mcal", 0, command[0], 500);
+    check("mcal", 1, command[1], 625);
+    check("mcal", 2, command[2], 500);
+    check("nan", 3, command[3], 0);
+    check("clamp", 4, command[4], 1000);
+}
+
+int main() {
+    checkGolden("dshot", &dshotRange, 0, throttles, dshotGolden);
+    checkGolden("dshot 3d", &dshotRange, 1, throttles3d, dshot3dGolden);
+    checkGolden("pigpio", &pigpioRange, 0, throttles, pigpioGolden);
+    checkGolden("pca9685", &pca9685Range, 0, throttles, pca9685Golden);
+    checkSlewRate();
+    checkLeaving3dMode();
+    checkThrustLinearization();
+    checkCalibration();
+    if (failures) {
+	printf("%d failures\n", failures);
+	return(1);
+    }
+    printf("ok\n");
+    return(0);
+}
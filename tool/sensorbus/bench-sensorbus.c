@@ -0,0 +1,227 @@
+/*
+  Latency and throughput benchmark of the sensor bus with multiple
+  readers. Readers are threads, each with its own mapping of the ring, as
+  if they were separate processes.
+
+  1) The writer publishes at 1kHz, readers spin on the ring and measure
+     the delay between publishing and reading a sample.
+  2) The writer publishes as fast as it can, readers count torn and
+     lost samples.
+  3) Cost of publishing a sample in text mode (to /dev/null) and in
+     shared memory mode.
+
+  Samples carry consecutive values so that readers can detect torn reads,
+  any torn read is a failure. Timestamps are CLOCK_MONOTONIC here.
+
+  usage: bench-sensorbus [<readers> [<seconds>]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "sensorbus.h"
+
+#define BENCH_CHANNEL		"sensorbus-bench.rpy"
+#define BENCH_MAX_READERS	64
+// latency histogram, 1us buckets
+#define BENCH_HISTOGRAM		1000
+
+struct benchReader {
+    pthread_t	thread;
+    long long	samples;
+    long long	torn;
+    long long	lost;
+    double	latencySum;
+    double	latencyMax;
+    long long	histogram[BENCH_HISTOGRAM+1];
+};
+
+struct benchReader	readers[BENCH_MAX_READERS];
+int			readersReady;
+int			stopFlag;
+
+static double monotonicTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+static void *readerThread(void *arg) {
+    struct benchReader		*b;
+    struct sensorBusReader	r;
+    struct sensorBusSample	s;
+    double			latency;
+    int				i, k;
+
+    b = (struct benchReader *) arg;
+    if (sensorBusReaderOpen(&r, BENCH_CHANNEL) != 0) {
+	printf("%s:%d: Can't open channel %s.\n", __FILE__, __LINE__, BENCH_CHANNEL);
+	exit(-1);
+    }
+    __atomic_add_fetch(&readersReady, 1, __ATOMIC_SEQ_CST);
+    while (! __atomic_load_n(&stopFlag, __ATOMIC_ACQUIRE)) {
+	if (sensorBusRead(&r, &s) == 0) {
+	    // be nice when there are more readers than cores
+	    sched_yield();
+	    continue;
+	}
+	latency = monotonicTime() - s.timestamp;
+	b->samples ++;
+	for(i=1; i<3; i++) {
+	    if (s.value[i] != s.value[0] + i) {
+		b->torn ++;
+		break;
+	    }
+	}
+	b->latencySum += latency;
+	if (latency > b->latencyMax) b->latencyMax = latency;
+	k = latency * 1e6;
+	if (k > BENCH_HISTOGRAM || k < 0) k = BENCH_HISTOGRAM;
+	b->histogram[k] ++;
+    }
+    b->lost = r.lost;
+    sensorBusReaderClose(&r);
+    return(NULL);
+}
+
+static double percentile(long long *histogram, long long total, double p) {
+    long long	sum;
+    int		i;
+
+    sum = 0;
+    for(i=0; i<BENCH_HISTOGRAM; i++) {
+	sum += histogram[i];
+	if (sum >= total * p) return(i + 1);
+    }
+    return(BENCH_HISTOGRAM);
+}
+
+// Returns number of torn reads.
+static long long runReaders(char *title, struct sensorBusChannel *ch, int readerCount, double seconds, double rate) {
+    struct benchReader	total;
+    struct timespec	next;
+    double		v[3], t0, t;
+    long long		i, published, torn;
+    int			j, k;
+
+    memset(readers, 0, sizeof(readers));
+    readersReady = stopFlag = 0;
+    for(j=0; j<readerCount; j++) pthread_create(&readers[j].thread, NULL, readerThread, &readers[j]);
+    while (__atomic_load_n(&readersReady, __ATOMIC_SEQ_CST) < readerCount) sched_yield();
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    t0 = monotonicTime();
+    for(i=0; ; i++) {
+	if ((i & 0xff) == 0 && monotonicTime() - t0 > seconds) break;
+	if (rate > 0) {
+	    next.tv_nsec += 1000000000.0 / rate;
+	    while (next.tv_nsec >= 1000000000) {
+		next.tv_nsec -= 1000000000;
+		next.tv_sec ++;
+	    }
+	    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	    if (monotonicTime() - t0 > seconds) break;
+	}
+	v[0] = i;
+	v[1] = i+1;
+	v[2] = i+2;
+	sensorBusPublish(ch, monotonicTime(), 1.0, v);
+    }
+    published = i;
+    t = monotonicTime() - t0;
+    // let readers drain
+    usleep(10000);
+    __atomic_store_n(&stopFlag, 1, __ATOMIC_RELEASE);
+
+    memset(&total, 0, sizeof(total));
+    for(j=0; j<readerCount; j++) {
+	pthread_join(readers[j].thread, NULL);
+	total.samples += readers[j].samples;
+	total.torn += readers[j].torn;
+	total.lost += readers[j].lost;
+	total.latencySum += readers[j].latencySum;
+	if (readers[j].latencyMax > total.latencyMax) total.latencyMax = readers[j].latencyMax;
+	for(k=0; k<=BENCH_HISTOGRAM; k++) total.histogram[k] += readers[j].histogram[k];
+    }
+    torn = total.torn;
+
+    printf("%s: %d readers, published %lld samples (%.0f/s), read %lld, lost %lld, torn %lld\n",
+	   title, readerCount, published, published / t, total.samples, total.lost, torn);
+    if (total.samples != 0) {
+	printf("    latency avg %.2f us, p50 %.0f us, p99 %.0f us, max %.1f us\n",
+	       total.latencySum / total.samples * 1e6,
+	       percentile(total.histogram, total.samples, 0.5),
+	       percentile(total.histogram, total.samples, 0.99),
+	       total.latencyMax * 1e6
+	    );
+    }
+    return(torn);
+}
+
+static double publishCost(struct sensorBusChannel *ch, long long n) {
+    double	v[3], t0;
+    long long	i;
+
+    t0 = monotonicTime();
+    for(i=0; i<n; i++) {
+	v[0] = i * 1e-6;
+	v[1] = v[0] + 0.1;
+	v[2] = v[0] + 0.2;
+	sensorBusPublish(ch, t0, 1.0, v);
+    }
+    return((monotonicTime() - t0) / n);
+}
+
+int main(int argc, char **argv) {
+    struct sensorBusChannel	*ch, *textCh;
+    int				readerCount, savedStdout, nullFd;
+    double			seconds, shmCost, textCost;
+    long long			torn;
+
+    readerCount = 4;
+    seconds = 2;
+    if (argc > 1) readerCount = atoi(argv[1]);
+    if (argc > 2) seconds = strtod(argv[2], NULL);
+    if (readerCount < 1) readerCount = 1;
+    if (readerCount > BENCH_MAX_READERS) readerCount = BENCH_MAX_READERS;
+
+    sensorBusMode = SENSOR_BUS_SHM;
+    ch = sensorBusOpen(BENCH_CHANNEL, SENSOR_BUS_RPY);
+    if (ch == NULL) exit(-1);
+
+    torn = runReaders((char*)"1kHz writer", ch, readerCount, seconds, 1000);
+    torn += runReaders((char*)"unthrottled writer", ch, readerCount, seconds, 0);
+
+    shmCost = publishCost(ch, 1000000);
+    sensorBusClose(ch);
+    shm_unlink("/" BENCH_CHANNEL);
+
+    // text mode prints to stdout, send it to /dev/null for the measurement
+    fflush(stdout);
+    savedStdout = dup(1);
+    nullFd = open("/dev/null", O_WRONLY);
+    if (savedStdout < 0 || nullFd < 0) exit(-1);
+    dup2(nullFd, 1);
+    sensorBusMode = SENSOR_BUS_TEXT;
+    textCh = sensorBusOpen(BENCH_CHANNEL, SENSOR_BUS_RPY);
+    textCost = publishCost(textCh, 200000);
+    sensorBusClose(textCh);
+    fflush(stdout);
+    dup2(savedStdout, 1);
+    close(nullFd);
+    close(savedStdout);
+
+    printf("publish cost: shm %.0f ns/sample, text %.0f ns/sample\n", shmCost * 1e9, textCost * 1e9);
+    if (torn != 0) {
+	printf("FAIL: %lld torn reads\n", torn);
+	return(1);
+    }
+    return(0);
+}
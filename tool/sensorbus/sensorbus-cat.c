@@ -0,0 +1,62 @@
+/*
+  Read sensor bus shared memory channels and print their samples as text
+  lines. It can be used to feed a text consumer from tools running in
+  SENSOR_BUS_SHM mode, or just to watch a channel.
+
+  usage: sensorbus-cat [-t] [-p <poll_usec>] <channel> ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sensorbus.h"
+
+#define SENSOR_BUS_CAT_MAX_CHANNELS	32
+
+int main(int argc, char **argv) {
+    struct sensorBusReader	reader[SENSOR_BUS_CAT_MAX_CHANNELS];
+    struct sensorBusSample	sample;
+    char			buf[256];
+    int				i, n, count, optTimestamps, optPollUsec;
+
+    optTimestamps = 0;
+    optPollUsec = 1000;
+    n = 0;
+    for(i=1; i<argc; i++) {
+	if (strcmp(argv[i], "-t") == 0) {
+	    // prefix lines with sample timestamps
+	    optTimestamps = 1;
+	} else if (strcmp(argv[i], "-p") == 0 && i+1 < argc) {
+	    optPollUsec = atoi(argv[++i]);
+	} else if (argv[i][0] == '-' || n >= SENSOR_BUS_CAT_MAX_CHANNELS) {
+	    printf("usage: %s [-t] [-p <poll_usec>] <channel> ...\n", argv[0]);
+	    exit(-1);
+	} else {
+	    if (sensorBusReaderOpen(&reader[n], argv[i]) != 0) {
+		printf("%s:%d: Can't open sensor bus channel %s.\n", __FILE__, __LINE__, argv[i]);
+		exit(-1);
+	    }
+	    n ++;
+	}
+    }
+    if (n == 0) {
+	printf("usage: %s [-t] [-p <poll_usec>] <channel> ...\n", argv[0]);
+	exit(-1);
+    }
+
+    for(;;) {
+	count = 0;
+	for(i=0; i<n; i++) {
+	    while (sensorBusRead(&reader[i], &sample)) {
+		if (sensorBusFormatText(&sample, buf, sizeof(buf)) < 0) continue;
+		if (optTimestamps) printf("%.6f ", sample.timestamp);
+		fputs(buf, stdout);
+		count ++;
+	    }
+	}
+	if (count != 0) fflush(stdout);
+	else usleep(optPollUsec);
+    }
+}
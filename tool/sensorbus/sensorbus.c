@@ -0,0 +1,316 @@
+/*
+  Sensor bus, see sensorbus.h.
+
+  The file is compiled by both gcc and g++ (most sensor tools are C++
+  programs), so it uses GCC __atomic builtins instead of stdatomic.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "sensorbus.h"
+
+#ifdef SHM
+#include "raspilotshm.h"
+#endif
+
+struct sensorBusTypeInfo {
+    int		type;
+    const char	*textName;
+    int		valueCount;
+    const char	*valueFormat;
+    // if not NULL, confidence is printed after values
+    const char	*confidenceFormat;
+};
+
+static struct sensorBusTypeInfo sensorBusTypeTable[SENSOR_BUS_TYPE_MAX] = {
+    {SENSOR_BUS_NONE,			"none",		0,	"%g",		NULL},
+    {SENSOR_BUS_RPY,			"rpy",		3,	"%9.7f",	NULL},
+    {SENSOR_BUS_LINEAR_ACCELERATION,	"lacc",		3,	"%9.7f",	NULL},
+    {SENSOR_BUS_EARTH_ACCELERATION,	"eacc",		3,	"%9.7f",	NULL},
+    {SENSOR_BUS_QUATERNION,		"quat",		4,	"%9.7f",	NULL},
+    {SENSOR_BUS_POSITION,		"pose",		3,	"%f",		NULL},
+    {SENSOR_BUS_ALTITUDE,		"alt",		1,	"%9.7f",	NULL},
+    {SENSOR_BUS_TEMPERATURE,		"temp",		1,	"%9.7f",	NULL},
+    {SENSOR_BUS_MAGNETIC_FIELD,		"mag",		3,	"%.0f",		NULL},
+    {SENSOR_BUS_HEADING,		"heading",	1,	"%f",		NULL},
+    {SENSOR_BUS_DISTANCE,		"dist",		1,	"%6.4f",	NULL},
+    {SENSOR_BUS_RANGE,			"range",	1,	"%5.3f",	"%4.2f"},
+    {SENSOR_BUS_MOTION,			"motion",	2,	"%5.3f",	"%4.2f"},
+    {SENSOR_BUS_PWM,			"pwm",		2,	"%.0f",		NULL},
+};
+
+int sensorBusMode = SENSOR_BUS_DEFAULT;
+int sensorBusTextAutoFlush = 1;
+
+static int sensorBusResolveMode() {
+    char *s;
+
+    if (sensorBusMode != SENSOR_BUS_DEFAULT) return(sensorBusMode);
+    s = getenv("RASPILOT_SENSOR_BUS");
+    if (s != NULL && strcmp(s, "text") == 0) {
+	sensorBusMode = SENSOR_BUS_TEXT;
+    } else if (s != NULL && strcmp(s, "shm") == 0) {
+	sensorBusMode = SENSOR_BUS_SHM;
+    } else if (s != NULL && strcmp(s, "raspilot") == 0) {
+	sensorBusMode = SENSOR_BUS_RASPILOT;
+    } else {
+#ifdef SHM
+	sensorBusMode = SENSOR_BUS_RASPILOT;
+#else
+	sensorBusMode = SENSOR_BUS_TEXT;
+#endif
+    }
+    return(sensorBusMode);
+}
+
+double sensorBusCurrentTime() {
+    struct timespec tt;
+    clock_gettime(CLOCK_REALTIME, &tt);
+    return(tt.tv_sec + tt.tv_nsec/1000000000.0);
+}
+
+int sensorBusTypeValueCount(int type) {
+    if (type < 0 || type >= SENSOR_BUS_TYPE_MAX) return(0);
+    return(sensorBusTypeTable[type].valueCount);
+}
+
+const char *sensorBusTypeTextName(int type) {
+    if (type < 0 || type >= SENSOR_BUS_TYPE_MAX) return("none");
+    return(sensorBusTypeTable[type].textName);
+}
+
+// shm_open wants names starting with a slash
+static void sensorBusShmName(const char *name, char *res, int size) {
+    snprintf(res, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static struct sensorBusRing *sensorBusRingCreate(const char *name, int type) {
+    struct sensorBusRing	*ring;
+    char			shmName[SENSOR_BUS_NAME_MAX+1];
+    int				fd;
+
+    sensorBusShmName(name, shmName, sizeof(shmName));
+    fd = shm_open(shmName, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return(NULL);
+    if (ftruncate(fd, sizeof(struct sensorBusRing)) != 0) {
+	close(fd);
+	return(NULL);
+    }
+    ring = (struct sensorBusRing *) mmap(NULL, sizeof(struct sensorBusRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) return(NULL);
+
+    // A restarted writer continues an existing compatible ring, so that attached readers keep working.
+    if (ring->magic != SENSOR_BUS_MAGIC || ring->version != SENSOR_BUS_VERSION || ring->type != type || ring->capacity != SENSOR_BUS_CAPACITY) {
+	__atomic_store_n(&ring->magic, 0, __ATOMIC_RELEASE);
+	memset(ring, 0, sizeof(*ring));
+	ring->version = SENSOR_BUS_VERSION;
+	ring->type = type;
+	ring->valueCount = sensorBusTypeValueCount(type);
+	ring->capacity = SENSOR_BUS_CAPACITY;
+	strncpy(ring->name, name, SENSOR_BUS_NAME_MAX-1);
+	__atomic_store_n(&ring->magic, SENSOR_BUS_MAGIC, __ATOMIC_RELEASE);
+    }
+    return(ring);
+}
+
+struct sensorBusChannel *sensorBusOpen(const char *name, int type) {
+    struct sensorBusChannel	*ch;
+
+    if (type <= SENSOR_BUS_NONE || type >= SENSOR_BUS_TYPE_MAX) {
+	fprintf(stderr, "%s:%d: Invalid sensor bus type %d of channel %s.\n", __FILE__, __LINE__, type, name);
+	return(NULL);
+    }
+    ch = (struct sensorBusChannel *) calloc(1, sizeof(*ch));
+    if (ch == NULL) return(NULL);
+    strncpy(ch->name, name, SENSOR_BUS_NAME_MAX-1);
+    ch->type = type;
+    ch->mode = sensorBusResolveMode();
+
+    switch (ch->mode) {
+    case SENSOR_BUS_SHM:
+	ch->ring = sensorBusRingCreate(name, type);
+	if (ch->ring == NULL) {
+	    fprintf(stderr, "%s:%d: Can't create shared memory for channel %s: %s\n", __FILE__, __LINE__, name, strerror(errno));
+	    free(ch);
+	    return(NULL);
+	}
+	break;
+    case SENSOR_BUS_RASPILOT:
+#ifdef SHM
+	ch->raspilotBuffer = raspilotShmConnect((char *) name);
+	if (ch->raspilotBuffer == NULL) {
+	    free(ch);
+	    return(NULL);
+	}
+#else
+	fprintf(stderr, "%s:%d: Raspilot shared memory not compiled in, channel %s.\n", __FILE__, __LINE__, name);
+	free(ch);
+	return(NULL);
+#endif
+	break;
+    default:
+	break;
+    }
+    return(ch);
+}
+
+static int sensorBusFormatTextAs(struct sensorBusSample *sample, const char *textName, const char *valueFormat, char *buf, int size) {
+    struct sensorBusTypeInfo	*ti;
+    int				i, n;
+
+    if (sample->type <= SENSOR_BUS_NONE || sample->type >= SENSOR_BUS_TYPE_MAX) return(-1);
+    ti = &sensorBusTypeTable[sample->type];
+    n = snprintf(buf, size, "%s", textName != NULL ? textName : ti->textName);
+    for(i=0; i<ti->valueCount && n < size; i++) {
+	buf[n++] = ' ';
+	n += snprintf(buf+n, size-n, valueFormat != NULL ? valueFormat : ti->valueFormat, sample->value[i]);
+    }
+    if (ti->confidenceFormat != NULL && n < size) {
+	buf[n++] = ' ';
+	n += snprintf(buf+n, size-n, ti->confidenceFormat, sample->confidence);
+    }
+    if (n >= size-1) return(-1);
+    buf[n++] = '\n';
+    buf[n] = 0;
+    return(n);
+}
+
+int sensorBusFormatText(struct sensorBusSample *sample, char *buf, int size) {
+    return(sensorBusFormatTextAs(sample, NULL, NULL, buf, size));
+}
+
+void sensorBusSetTextFormat(struct sensorBusChannel *ch, const char *textName, const char *valueFormat) {
+    if (ch == NULL) return;
+    ch->textName = textName;
+    ch->textValueFormat = valueFormat;
+}
+
+static void sensorBusRingPush(struct sensorBusRing *ring, struct sensorBusSample *sample) {
+    struct sensorBusSlot	*slot;
+    uint64_t			index;
+    uint32_t			sequence;
+
+    // we are the only writer
+    index = ring->head;
+    slot = &ring->slot[index & (SENSOR_BUS_CAPACITY-1)];
+    sequence = slot->sequence;
+    __atomic_store_n(&slot->sequence, sequence+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->index = index;
+    slot->sample = *sample;
+    __atomic_store_n(&slot->sequence, sequence+2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, index+1, __ATOMIC_RELEASE);
+}
+
+int sensorBusPublish(struct sensorBusChannel *ch, double timestamp, double confidence, double *value) {
+    struct sensorBusSample	sample;
+    char			buf[256];
+    int				i, n;
+
+    n = sensorBusTypeValueCount(ch->type);
+    switch (ch->mode) {
+    case SENSOR_BUS_SHM:
+	sample.timestamp = timestamp;
+	sample.confidence = confidence;
+	sample.type = ch->type;
+	for(i=0; i<n; i++) sample.value[i] = value[i];
+	for(; i<SENSOR_BUS_MAX_VALUES; i++) sample.value[i] = 0;
+	sensorBusRingPush(ch->ring, &sample);
+	return(0);
+    case SENSOR_BUS_RASPILOT:
+#ifdef SHM
+	((struct raspilotInputBuffer *)ch->raspilotBuffer)->confidence = confidence;
+	return(raspilotShmPush((struct raspilotInputBuffer *)ch->raspilotBuffer, timestamp, value, n));
+#else
+	return(-1);
+#endif
+    default:
+	sample.confidence = confidence;
+	sample.type = ch->type;
+	for(i=0; i<n; i++) sample.value[i] = value[i];
+	if (sensorBusFormatTextAs(&sample, ch->textName, ch->textValueFormat, buf, sizeof(buf)) < 0) return(-1);
+	fputs(buf, stdout);
+	if (sensorBusTextAutoFlush) fflush(stdout);
+	return(0);
+    }
+}
+
+void sensorBusFlush() {
+    if (sensorBusMode == SENSOR_BUS_TEXT) fflush(stdout);
+}
+
+void sensorBusClose(struct sensorBusChannel *ch) {
+    if (ch == NULL) return;
+    if (ch->ring != NULL) munmap(ch->ring, sizeof(struct sensorBusRing));
+    free(ch);
+}
+
+int sensorBusReaderOpen(struct sensorBusReader *r, const char *name) {
+    struct stat		st;
+    char		shmName[SENSOR_BUS_NAME_MAX+1];
+    int			fd;
+
+    memset(r, 0, sizeof(*r));
+    sensorBusShmName(name, shmName, sizeof(shmName));
+    fd = shm_open(shmName, O_RDONLY, 0);
+    if (fd < 0) return(-1);
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct sensorBusRing)) {
+	close(fd);
+	return(-1);
+    }
+    r->ring = (struct sensorBusRing *) mmap(NULL, sizeof(struct sensorBusRing), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->ring == MAP_FAILED) {
+	r->ring = NULL;
+	return(-1);
+    }
+    if (__atomic_load_n(&r->ring->magic, __ATOMIC_ACQUIRE) != SENSOR_BUS_MAGIC || r->ring->version != SENSOR_BUS_VERSION) {
+	sensorBusReaderClose(r);
+	return(-1);
+    }
+    // start with samples published from now on
+    r->next = __atomic_load_n(&r->ring->head, __ATOMIC_ACQUIRE);
+    return(0);
+}
+
+// Returns 1 and the next sample, or 0 if there is no new sample. Never blocks the writer.
+int sensorBusRead(struct sensorBusReader *r, struct sensorBusSample *sample) {
+    struct sensorBusSlot	*slot;
+    uint64_t			head, index;
+    uint32_t			s1, s2;
+
+    for(;;) {
+	head = __atomic_load_n(&r->ring->head, __ATOMIC_ACQUIRE);
+	if (r->next >= head) return(0);
+	if (head - r->next > SENSOR_BUS_CAPACITY) {
+	    // overrun, skip to the oldest sample still in the ring
+	    r->lost += head - SENSOR_BUS_CAPACITY - r->next;
+	    r->next = head - SENSOR_BUS_CAPACITY;
+	}
+	slot = &r->ring->slot[r->next & (SENSOR_BUS_CAPACITY-1)];
+	s1 = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+	// odd sequence means the writer is just overwriting the slot, we were lapped
+	if (s1 & 1) continue;
+	index = slot->index;
+	*sample = slot->sample;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	s2 = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	if (s1 != s2 || index != r->next) continue;
+	r->next ++;
+	return(1);
+    }
+}
+
+void sensorBusReaderClose(struct sensorBusReader *r) {
+    if (r->ring != NULL) munmap(r->ring, sizeof(struct sensorBusRing));
+    r->ring = NULL;
+}
@@ -0,0 +1,133 @@
+/*
+  Sensor bus, a small library used by sensor tools to publish their
+  measurements.
+
+  A channel is named, typed and carries timestamped samples of a fixed
+  number of values. Depending on the mode, samples are:
+
+  SENSOR_BUS_TEXT	printed to stdout as text lines (e.g. "rpy 0.01 0.02 0.03"),
+  			the traditional format read by raspilot through a pipe.
+  			Tools whose lines differ from the type's form set their own
+  			with sensorBusSetTextFormat(), so the lines stay unchanged.
+  SENSOR_BUS_SHM	stored in binary form into a POSIX shared memory ring named by
+  			the channel. Each slot is protected by a sequence counter
+  			(seqlock), the writer never waits for readers and any number of
+  			readers may follow the ring.
+  SENSOR_BUS_RASPILOT	pushed to raspilot's own shared memory input buffer
+  			(raspilotshm.h). Available only when compiled with -DSHM.
+
+  The mode is global for the process. If not set by the tool, it is taken
+  from the environment variable RASPILOT_SENSOR_BUS ("text", "shm" or
+  "raspilot"). The default is SENSOR_BUS_RASPILOT when compiled with -DSHM
+  and SENSOR_BUS_TEXT otherwise.
+ */
+
+#ifndef SENSORBUS_H
+#define SENSORBUS_H
+
+#include <stdint.h>
+
+#define SENSOR_BUS_MAGIC		0x73756273	// "sbus"
+#define SENSOR_BUS_VERSION		1
+// must be a power of 2
+#define SENSOR_BUS_CAPACITY		256
+#define SENSOR_BUS_MAX_VALUES		7
+#define SENSOR_BUS_NAME_MAX		64
+
+enum sensorBusModes {
+    SENSOR_BUS_DEFAULT = 0,
+    SENSOR_BUS_TEXT,
+    SENSOR_BUS_SHM,
+    SENSOR_BUS_RASPILOT,
+};
+
+// Types determine the number of values and the text form of a sample.
+enum sensorBusTypes {
+    SENSOR_BUS_NONE = 0,
+    SENSOR_BUS_RPY,			// roll, pitch, yaw in radians
+    SENSOR_BUS_LINEAR_ACCELERATION,	// lacc x, y, z in g
+    SENSOR_BUS_EARTH_ACCELERATION,	// eacc x, y, z in g
+    SENSOR_BUS_QUATERNION,		// quat x, y, z, w
+    SENSOR_BUS_POSITION,		// pose x, y, z in meters
+    SENSOR_BUS_ALTITUDE,		// alt in meters
+    SENSOR_BUS_TEMPERATURE,		// temp in degrees Celsius
+    SENSOR_BUS_MAGNETIC_FIELD,		// mag x, y, z in raw sensor units
+    SENSOR_BUS_HEADING,			// heading in radians
+    SENSOR_BUS_DISTANCE,		// dist in meters, -1 when out of range
+    SENSOR_BUS_RANGE,			// range in meters, text form includes confidence
+    SENSOR_BUS_MOTION,			// motion x, y in radians, text form includes confidence
+    SENSOR_BUS_PWM,			// pwm c0, c1 servo values 0 - 10000, read by hw-pwm
+    SENSOR_BUS_TYPE_MAX,
+};
+
+struct sensorBusSample {
+    // seconds, CLOCK_REALTIME like other raspilot timestamps
+    double		timestamp;
+    // 0 - 1
+    float		confidence;
+    int32_t		type;
+    double		value[SENSOR_BUS_MAX_VALUES];
+};
+
+struct sensorBusSlot {
+    // odd while the slot is being written
+    uint32_t			sequence;
+    uint32_t			reserved;
+    // index of the sample stored in the slot
+    uint64_t			index;
+    struct sensorBusSample	sample;
+};
+
+struct sensorBusRing {
+    uint32_t			magic;
+    uint32_t			version;
+    int32_t			type;
+    int32_t			valueCount;
+    uint32_t			capacity;
+    uint32_t			reserved;
+    char			name[SENSOR_BUS_NAME_MAX];
+    // number of samples ever published, on its own cache line
+    uint64_t			head __attribute__((aligned(64)));
+    struct sensorBusSlot	slot[SENSOR_BUS_CAPACITY] __attribute__((aligned(64)));
+};
+
+struct sensorBusChannel {
+    char			name[SENSOR_BUS_NAME_MAX];
+    int				type;
+    int				mode;
+    struct sensorBusRing	*ring;
+    void			*raspilotBuffer;
+    // text form overriding the type's one, NULL for the type's one
+    const char			*textName;
+    const char			*textValueFormat;
+};
+
+struct sensorBusReader {
+    struct sensorBusRing	*ring;
+    // index of the next sample to read
+    uint64_t			next;
+    // samples overwritten before we could read them
+    uint64_t			lost;
+};
+
+extern int sensorBusMode;
+// In text mode, flush stdout after each sample. Tools publishing bursts of samples may clear it
+// and call sensorBusFlush() after the burst.
+extern int sensorBusTextAutoFlush;
+
+double sensorBusCurrentTime();
+int sensorBusTypeValueCount(int type);
+const char *sensorBusTypeTextName(int type);
+
+struct sensorBusChannel *sensorBusOpen(const char *name, int type);
+int sensorBusPublish(struct sensorBusChannel *ch, double timestamp, double confidence, double *value);
+void sensorBusSetTextFormat(struct sensorBusChannel *ch, const char *textName, const char *valueFormat);
+void sensorBusFlush();
+void sensorBusClose(struct sensorBusChannel *ch);
+
+int sensorBusReaderOpen(struct sensorBusReader *r, const char *name);
+int sensorBusRead(struct sensorBusReader *r, struct sensorBusSample *sample);
+void sensorBusReaderClose(struct sensorBusReader *r);
+int sensorBusFormatText(struct sensorBusSample *sample, char *buf, int size);
+
+#endif
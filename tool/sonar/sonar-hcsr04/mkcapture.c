@@ -0,0 +1,79 @@
+/*
+  Generate a synthetic capture of HC-SR04 edges in the format recorded
+  by sonar-hcsr04 -record, for replay. Sensors are triggered round
+  robin, each looks at a fixed distance (0.5m, 1m, 1.5m, ...) with 3mm
+  noise. Some echoes are outliers (spurious reflections), some are
+  missing (echo held high for 38ms) and some edges come from another
+  sensor (crosstalk). Ticks start just before the 32 bit wrap.
+
+  usage: ./mkcapture <seconds> [<sensors> [<trigger_rate>]] > capture.bin
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sonar.h"
+
+static void emit(uint32_t tick, int sensor, int level) {
+    struct sonarEdge r;
+
+    memset(&r, 0, sizeof(r));
+    r.tick = tick;
+    r.sensor = sensor;
+    r.level = level;
+    fwrite(&r, sizeof(r), 1, stdout);
+}
+
+static double uniform() {
+    return(rand() / (RAND_MAX + 1.0));
+}
+
+static double gaussian() {
+    return(sqrt(-2.0 * log(uniform() + 1e-12)) * cos(2 * M_PI * uniform()));
+}
+
+int main(int argc, char **argv) {
+    double      seconds, rate, c, dist;
+    int         sensors, k, other;
+    uint32_t    tick, start, rise, fall, width, period, next;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <seconds> [<sensors> [<trigger_rate>]] > capture.bin\n", argv[0]);
+        exit(-1);
+    }
+    seconds = strtod(argv[1], NULL);
+    sensors = argc > 2 ? atoi(argv[2]) : 4;
+    rate = argc > 3 ? strtod(argv[3], NULL) : 100;
+    if (sensors < 1 || sensors > SONAR_MAX_SENSORS) sensors = 4;
+    c = sonarSoundSpeed(20.0);
+    period = 1000000 / rate;
+    srand(1);
+
+    start = tick = 0xffffffff - 2000000;
+    for(k=0; (uint32_t)(tick - start) < seconds * 1e6; k = (k + 1) % sensors) {
+        emit(tick, k, SONAR_TRIGGER);
+        rise = tick + 10 + 450;
+        if (uniform() < 0.02) {
+            // no echo
+            width = 38000;
+        } else {
+            dist = 0.5 * (k + 1) + 0.003 * gaussian();
+            if (uniform() < 0.05) dist = 0.05 + 3.8 * uniform();
+            width = 2 * dist / c * 1e6;
+        }
+        fall = rise + width;
+        emit(rise, k, 1);
+        if (sensors > 1 && uniform() < 0.03) {
+            // a short pulse on another sensor in the middle of the echo
+            other = (k + 1) % sensors;
+            emit(rise + width / 3, other, 1);
+            emit(rise + width / 3 + 100, other, 0);
+        }
+        emit(fall, k, 0);
+        next = tick + period;
+        if ((int32_t)(fall + SONAR_GUARD_US - next) > 0) next = fall + SONAR_GUARD_US;
+        tick = next;
+    }
+    return(0);
+}
@@ -0,0 +1,201 @@
+/*
+  Replay a recorded stream of sonar edges (see option -record of
+  sonar-hcsr04, or mkcapture) through the sonar engine. A producer
+  thread pushes edges into the lock-free queue as the GPIO callback
+  would, at the recorded pace, with ticks of the replay clock. The main
+  thread runs the engine and reports the output rate, the latency from
+  the end of an echo to its filtered distance and, per sensor, the
+  spread of raw and filtered distances (sensors of mkcapture look at
+  fixed distances).
+
+  With -f edges are pushed as fast as possible to measure throughput.
+
+  usage: ./replay [-f] [-t <air_temperature_C>] <capture_file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "sonar.h"
+
+struct sensorStats {
+    long long   outputs;
+    long long   valid;
+    double      rawSum, rawSum2;
+    double      filteredSum, filteredSum2;
+};
+
+struct sonarEngine  engine;
+struct sensorStats  stats[SONAR_MAX_SENSORS];
+struct sonarEdge    *edges;
+long                edgeCount;
+int                 optFast;
+volatile int        producerDone;
+uint32_t            replayStart;
+long long           latencyCount;
+double              latencySum, latencyMax;
+
+static uint32_t replayTick() {
+    struct timespec tt;
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    return((uint32_t)(tt.tv_sec * 1000000LL + tt.tv_nsec / 1000));
+}
+
+static void *producer(void *arg) {
+    struct timespec ts;
+    uint32_t        tick;
+    int32_t         wait;
+    long            i;
+
+    for(i=0; i<edgeCount; i++) {
+        tick = replayStart + (edges[i].tick - edges[0].tick);
+        if (! optFast) {
+            wait = tick - replayTick();
+            if (wait > 0) {
+                ts.tv_sec = wait / 1000000;
+                ts.tv_nsec = (wait % 1000000) * 1000;
+                nanosleep(&ts, NULL);
+            }
+        }
+        if (optFast) {
+            // wait for the consumer instead of dropping
+            while (engine.queue.head - __atomic_load_n(&engine.queue.tail, __ATOMIC_ACQUIRE) >= SONAR_QUEUE_SIZE) sched_yield();
+        }
+        sonarQueuePush(&engine.queue, tick, edges[i].sensor, edges[i].level);
+    }
+    producerDone = 1;
+    return(NULL);
+}
+
+static void collect(struct sonarEngine *e, int sensor, uint32_t tick, double raw, double filtered) {
+    struct sensorStats  *s;
+    double              latency;
+
+    s = &stats[sensor];
+    s->outputs ++;
+    if (raw < 0) return;
+    s->valid ++;
+    s->rawSum += raw;
+    s->rawSum2 += raw * raw;
+    s->filteredSum += filtered;
+    s->filteredSum2 += filtered * filtered;
+    // tick is the middle of the echo, the echo ended half of its width later
+    latency = (int32_t)(replayTick() - tick) - raw / e->soundSpeed * 1e6;
+    latencyCount ++;
+    latencySum += latency;
+    if (latency > latencyMax) latencyMax = latency;
+}
+
+static double spread(double sum, double sum2, long long n) {
+    double mean = sum / n;
+    return(sqrt(fabs(sum2 / n - mean * mean)));
+}
+
+int main(int argc, char **argv) {
+    FILE            *ff;
+    char            *path;
+    long            size, i;
+    int             sensors, failures;
+    long long       outputs;
+    double          optTemperature, recorded, elapsed, t0;
+    struct pollfd   pfd;
+    pthread_t       thread;
+    uint64_t        wakeups;
+    struct timespec tt;
+
+    optFast = 0;
+    optTemperature = 20.0;
+    path = NULL;
+    for(i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            optFast = 1;
+        } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+            optTemperature = strtod(argv[++i], NULL);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) {
+        printf("usage: %s [-f] [-t <air_temperature_C>] <capture_file>\n", argv[0]);
+        exit(-1);
+    }
+
+    ff = fopen(path, "r");
+    if (ff == NULL) {
+        printf("Can't open %s\n", path);
+        exit(-1);
+    }
+    fseek(ff, 0, SEEK_END);
+    size = ftell(ff);
+    fseek(ff, 0, SEEK_SET);
+    edges = (struct sonarEdge *) malloc(size + sizeof(struct sonarEdge));
+    edgeCount = size / sizeof(struct sonarEdge);
+    if (edgeCount == 0 || fread(edges, sizeof(struct sonarEdge), edgeCount, ff) != edgeCount) {
+        printf("Can't read %s\n", path);
+        exit(-1);
+    }
+    fclose(ff);
+
+    sensors = 0;
+    for(i=0; i<edgeCount; i++) {
+        if (edges[i].sensor >= sensors) sensors = edges[i].sensor + 1;
+    }
+    if (sensors > SONAR_MAX_SENSORS) sensors = SONAR_MAX_SENSORS;
+    recorded = (edges[edgeCount-1].tick - edges[0].tick) / 1e6;
+
+    sonarEngineInit(&engine, sensors, 0);
+    sonarEngineSetTemperature(&engine, optTemperature);
+    engine.output = collect;
+    engine.queue.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pfd.fd = engine.queue.wakeFd;
+    pfd.events = POLLIN;
+
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    t0 = tt.tv_sec + tt.tv_nsec / 1e9;
+    replayStart = replayTick() + 1000;
+    pthread_create(&thread, NULL, producer, NULL);
+    while (! producerDone || __atomic_load_n(&engine.queue.head, __ATOMIC_ACQUIRE) != engine.queue.tail) {
+        sonarEngineStep(&engine, replayTick());
+        if (optFast) continue;
+        if (poll(&pfd, 1, 10) > 0) {
+            if (read(engine.queue.wakeFd, &wakeups, sizeof(wakeups)) < 0) wakeups = 0;
+        }
+    }
+    pthread_join(thread, NULL);
+    sonarEngineStep(&engine, replayTick());
+    clock_gettime(CLOCK_MONOTONIC, &tt);
+    elapsed = tt.tv_sec + tt.tv_nsec / 1e9 - t0;
+
+    outputs = 0;
+    failures = 0;
+    for(i=0; i<sensors; i++) {
+        outputs += stats[i].outputs;
+        printf("sensor %ld: %lld outputs (%lld out of range, %lld crosstalk edges), raw %.4f +- %.4f m, filtered %.4f +- %.4f m\n",
+               i, stats[i].outputs, engine.sensor[i].outOfRange, engine.sensor[i].crosstalk,
+               stats[i].rawSum / stats[i].valid, spread(stats[i].rawSum, stats[i].rawSum2, stats[i].valid),
+               stats[i].filteredSum / stats[i].valid, spread(stats[i].filteredSum, stats[i].filteredSum2, stats[i].valid));
+        if (stats[i].valid == 0 || spread(stats[i].filteredSum, stats[i].filteredSum2, stats[i].valid) >= spread(stats[i].rawSum, stats[i].rawSum2, stats[i].valid)) {
+            printf("FAIL: filter does not reduce spread of sensor %ld\n", i);
+            failures ++;
+        }
+    }
+    printf("%ld edges, %.1f s recorded, replayed in %.3f s: %.1f outputs/s recorded, %.0f outputs/s replayed, queue drops %lld\n",
+           edgeCount, recorded, elapsed, outputs / recorded, outputs / elapsed, engine.queue.drops);
+    if (! optFast) {
+        printf("latency from echo end to output: avg %.0f us, max %.0f us\n", latencySum / latencyCount, latencyMax);
+        if (engine.queue.drops != 0) {
+            printf("FAIL: edges dropped\n");
+            failures ++;
+        }
+    }
+    if (failures) return(1);
+    printf("ok\n");
+    return(0);
+}
@@ -1,66 +1,148 @@
 /*
-  Meassure the distance using HC-SR04 sensor and Raspberry Pi.
+  Meassure the distance using HC-SR04 sensors and Raspberry Pi.
   This program uses pigpio library.
+
+  Any number of sensors can be connected, they are triggered round
+  robin (see sonar.h). Echo edges are timestamped by pigpio and queued
+  by the alert callback, distances are computed and filtered in the
+  main thread. Sensor 0 publishes to raspilot.sonar-hcsr04.dist, sensor
+  N > 0 to raspilot.sonar-hcsr04-N.dist.
+
+  usage: sonar-hcsr04 [-r <trigger_rate_Hz>] [-t <air_temperature_C>] [-record <file>] [-v]
+                      sending_pin receiving_pin [sending_pin receiving_pin ...]
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <pigpio.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
-void sonarReceiveAlertFunction(int gpio, int level, uint32_t tick) {
-    static uint32_t     setTick;
-    
-    uint32_t    diff;
-    double      dist;
-    
-    // printf("GPIO %2d became %d at %d\n", gpio, level, tick);
-    if (level == 1) {
-        setTick = tick;
-    } else if (level == 0 && setTick != 0) {
-        diff =  tick - setTick;
-        // diff is in microseconds, speed of sound is 343 m/s and the
-        // distance is half of the signal trip
-        dist = diff * 343.0 / 1000000.0 / 2;
-        if (dist < 0) dist = 0;
-        if (dist > 50) dist = -1;
-        printf("dist %6.4f\n", dist); fflush(stdout);
-        setTick = 0;
-    }
-}
+#include "sensorbus.h"
+#include "sonar.h"
+
+struct sensorBusChannel *busdist[SONAR_MAX_SENSORS];
+struct sonarEngine      engine;
 
 void taskStop(int signum) {
     gpioTerminate();
+    if (engine.record != NULL) fclose(engine.record);
     exit(0);
 }
 
+void sonarReceiveAlertFunction(int gpio, int level, uint32_t tick, void *userdata) {
+    // level 2 is a watchdog timeout, not an edge
+    if (level > 1) return;
+    sonarQueuePush(&engine.queue, tick, (int)(intptr_t) userdata, level);
+}
+
+static int sonarTrigger(struct sonarEngine *e, int sensor) {
+    return(gpioTrigger(e->sensor[sensor].triggerPin, 10, 1) == 0 ? 0 : -1);
+}
+
+static void sonarPublish(struct sonarEngine *e, int sensor, uint32_t tick, double raw, double filtered) {
+    double t;
+
+    // sensor bus time of the echo
+    t = sensorBusCurrentTime() - (int32_t)(gpioTick() - tick) / 1e6;
+    if (sensorBusPublish(busdist[sensor], t, 1.0, &filtered) != 0) taskStop(0);
+}
+
 int main(int argc, char **argv) {
-    int pinSend;
-    int pinReceive;
+    int             i, n, wait, optVerbose;
+    double          optRate, optTemperature, nextReport;
+    char            *optRecord;
+    char            name[64];
+    int             pins[2*SONAR_MAX_SENSORS];
+    struct pollfd   pfd;
+    struct timespec ts;
+    uint64_t        wakeups;
 
-    if (argc < 3) {
-        printf("Usage: sonar-hcsr04 sending_pin receiving_pin\n");
+    optRate = 100.0;
+    optTemperature = 20.0;
+    optRecord = NULL;
+    optVerbose = 0;
+    n = 0;
+    for(i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i+1 < argc) {
+            // triggers per second of all sensors together
+            optRate = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+            optTemperature = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-record") == 0 && i+1 < argc) {
+            optRecord = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            optVerbose = 1;
+        } else if (n < 2*SONAR_MAX_SENSORS) {
+            pins[n++] = atoi(argv[i]);
+        }
+    }
+    if (n < 2 || n % 2 != 0) {
+        printf("Usage: sonar-hcsr04 [-r rate] [-t temperature] [-record file] [-v] sending_pin receiving_pin [sending_pin receiving_pin ...]\n");
         exit(-1);
     }
-    pinSend = atoi(argv[1]);
-    pinReceive = atoi(argv[2]);
+
+    sonarEngineInit(&engine, n/2, optRate);
+    sonarEngineSetTemperature(&engine, optTemperature);
+    engine.trigger = sonarTrigger;
+    engine.output = sonarPublish;
+    engine.queue.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (optRecord != NULL) {
+        engine.record = fopen(optRecord, "w");
+        if (engine.record == NULL) {
+            printf("%s:%d: Can't open %s\n", __FILE__, __LINE__, optRecord);
+            exit(-1);
+        }
+    }
 
     if (gpioInitialise() < 0) {
         printf("debug Error: Initialisation of the GPIO Failed.\n");
         exit(-1);
     }
 
+    for(i=0; i<engine.sensorCount; i++) {
+        if (i == 0) {
+            strcpy(name, "raspilot.sonar-hcsr04.dist");
+        } else {
+            snprintf(name, sizeof(name), "raspilot.sonar-hcsr04-%d.dist", i);
+        }
+        busdist[i] = sensorBusOpen(name, SENSOR_BUS_DISTANCE);
+        if (busdist[i] == NULL) {
+            gpioTerminate();
+            exit(-1);
+        }
+    }
+
     signal(SIGINT, taskStop);
-  
-    gpioSetAlertFunc(pinReceive, sonarReceiveAlertFunction);
-  
+
+    for(i=0; i<engine.sensorCount; i++) {
+        engine.sensor[i].triggerPin = pins[2*i];
+        engine.sensor[i].echoPin = pins[2*i+1];
+        gpioSetMode(engine.sensor[i].triggerPin, PI_OUTPUT);
+        gpioWrite(engine.sensor[i].triggerPin, 0);
+        gpioSetMode(engine.sensor[i].echoPin, PI_INPUT);
+        gpioSetAlertFuncEx(engine.sensor[i].echoPin, sonarReceiveAlertFunction, (void *)(intptr_t) i);
+    }
+
+    nextReport = sensorBusCurrentTime() + 10;
+    pfd.fd = engine.queue.wakeFd;
+    pfd.events = POLLIN;
     for(;;) {
-        // Do samples at (around) 100Hz 
-        usleep(9800);
-        gpioWrite(pinSend, 1);
-        usleep(10);
-        gpioWrite(pinSend, 0);
+        wait = sonarEngineStep(&engine, gpioTick());
+        // sleep until the next trigger or a finished echo
+        ts.tv_sec = wait / 1000000;
+        ts.tv_nsec = (wait % 1000000) * 1000;
+        if (ppoll(&pfd, 1, &ts, NULL) > 0) {
+            if (read(engine.queue.wakeFd, &wakeups, sizeof(wakeups)) < 0) wakeups = 0;
+        }
+        if (optVerbose && sensorBusCurrentTime() > nextReport) {
+            sonarEngineReport(&engine, stderr);
+            nextReport += 10;
+        }
     }
-    
+
     taskStop(0);
 }
@@ -0,0 +1,251 @@
+/*
+  Multi sensor sonar engine, see sonar.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "sonar.h"
+
+/////////////////////////////////////////////////////////////////////////
+// lock-free edge queue
+
+int sonarQueuePush(struct sonarQueue *q, uint32_t tick, int sensor, int level) {
+    struct sonarEdge    *e;
+    unsigned            head, tail;
+    uint64_t            one;
+
+    head = q->head;
+    tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= SONAR_QUEUE_SIZE) {
+        q->drops ++;
+        return(-1);
+    }
+    e = &q->edge[head & (SONAR_QUEUE_SIZE-1)];
+    e->tick = tick;
+    e->sensor = sensor;
+    e->level = level;
+    e->reserved = 0;
+    __atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+    // wake up the consumer when a measurement is complete
+    if (level == 0 && q->wakeFd >= 0) {
+        one = 1;
+        if (write(q->wakeFd, &one, sizeof(one)) < 0) q->drops ++;
+    }
+    return(0);
+}
+
+int sonarQueuePop(struct sonarQueue *q, struct sonarEdge *e) {
+    unsigned head, tail;
+
+    tail = q->tail;
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return(0);
+    *e = q->edge[tail & (SONAR_QUEUE_SIZE-1)];
+    __atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+    return(1);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// filters
+
+double sonarSoundSpeed(double temperature) {
+    return(331.3 * sqrt(1.0 + temperature / 273.15));
+}
+
+static double sonarMedian(struct sonarSensor *s, double value) {
+    double  w[SONAR_MEDIAN], t;
+    int     i, j;
+
+    s->window[s->windowIndex] = value;
+    s->windowIndex = (s->windowIndex + 1) % SONAR_MEDIAN;
+    if (s->windowCount < SONAR_MEDIAN) s->windowCount ++;
+
+    for(i=0; i<s->windowCount; i++) {
+        t = s->window[i];
+        for(j=i; j>0 && w[j-1] > t; j--) w[j] = w[j-1];
+        w[j] = t;
+    }
+    return(w[s->windowCount / 2]);
+}
+
+static double sonarKalman(struct sonarEngine *e, struct sonarSensor *s, uint32_t tick, double z) {
+    double dt, q, r, p00, p01, p10, p11, sInv, k0, k1, y;
+
+    dt = (int32_t)(tick - s->lastTick) / 1e6;
+    s->lastTick = tick;
+    r = e->measurementNoise;
+    if (! s->kalmanValid || dt <= 0 || dt > 0.5) {
+        s->kalmanValid = 1;
+        s->d = z;
+        s->v = 0;
+        s->p[0][0] = r;
+        s->p[0][1] = s->p[1][0] = 0;
+        s->p[1][1] = 1.0;
+        return(z);
+    }
+
+    // predict, constant velocity model with white noise acceleration
+    q = e->processNoise;
+    s->d += s->v * dt;
+    p00 = s->p[0][0] + dt * (s->p[1][0] + s->p[0][1]) + dt * dt * s->p[1][1] + q * dt * dt * dt / 3;
+    p01 = s->p[0][1] + dt * s->p[1][1] + q * dt * dt / 2;
+    p10 = s->p[1][0] + dt * s->p[1][1] + q * dt * dt / 2;
+    p11 = s->p[1][1] + q * dt;
+
+    // update
+    y = z - s->d;
+    sInv = 1.0 / (p00 + r);
+    k0 = p00 * sInv;
+    k1 = p10 * sInv;
+    s->d += k0 * y;
+    s->v += k1 * y;
+    s->p[0][0] = (1 - k0) * p00;
+    s->p[0][1] = (1 - k0) * p01;
+    s->p[1][0] = p10 - k1 * p00;
+    s->p[1][1] = p11 - k1 * p01;
+    return(s->d);
+}
+
+/////////////////////////////////////////////////////////////////////////
+// engine
+
+static void sonarRecord(struct sonarEngine *e, uint32_t tick, int sensor, int level) {
+    struct sonarEdge r;
+
+    if (e->record == NULL) return;
+    memset(&r, 0, sizeof(r));
+    r.tick = tick;
+    r.sensor = sensor;
+    r.level = level;
+    fwrite(&r, sizeof(r), 1, e->record);
+}
+
+static void sonarOutput(struct sonarEngine *e, int sensor, uint32_t tick, double raw, double filtered) {
+    if (e->output != NULL) e->output(e, sensor, tick, raw, filtered);
+}
+
+static void sonarMeasurement(struct sonarEngine *e, int sensor, uint32_t riseTick, uint32_t width) {
+    struct sonarSensor  *s;
+    double              raw, median;
+
+    s = &e->sensor[sensor];
+    raw = width * 1e-6 * e->soundSpeed / 2;
+    if (raw < SONAR_MIN_RANGE || raw > SONAR_MAX_RANGE) {
+        s->outOfRange ++;
+        sonarOutput(e, sensor, riseTick + width / 2, -1, -1);
+        return;
+    }
+    s->measurements ++;
+    median = sonarMedian(s, raw);
+    sonarOutput(e, sensor, riseTick + width / 2, raw, sonarKalman(e, s, riseTick + width / 2, median));
+}
+
+static void sonarScheduleNext(struct sonarEngine *e, uint32_t doneTick) {
+    uint32_t next;
+
+    e->waiting = 0;
+    next = e->triggerTick + e->period;
+    if ((int32_t)(doneTick + SONAR_GUARD_US - next) > 0) next = doneTick + SONAR_GUARD_US;
+    e->nextTriggerTick = next;
+}
+
+static void sonarTriggered(struct sonarEngine *e, int sensor, uint32_t tick) {
+    if (e->waiting) {
+        // previous sensor did not finish its echo
+        e->sensor[e->active].outOfRange ++;
+        sonarOutput(e, e->active, e->triggerTick, -1, -1);
+    }
+    e->active = sensor;
+    e->waiting = 1;
+    e->triggerTick = tick;
+    e->sensor[sensor].echoHigh = 0;
+    sonarRecord(e, tick, sensor, SONAR_TRIGGER);
+}
+
+static void sonarEdgeProcess(struct sonarEngine *e, struct sonarEdge *edge) {
+    struct sonarSensor *s;
+
+    if (edge->sensor >= e->sensorCount) return;
+    if (edge->level == SONAR_TRIGGER) {
+        sonarTriggered(e, edge->sensor, edge->tick);
+        return;
+    }
+    sonarRecord(e, edge->tick, edge->sensor, edge->level);
+    s = &e->sensor[edge->sensor];
+    if (! e->waiting || edge->sensor != e->active || (int32_t)(edge->tick - e->triggerTick) < 0) {
+        // echo of another sensor or of a previous round
+        s->crosstalk ++;
+        return;
+    }
+    if (edge->level == 1) {
+        s->echoHigh = 1;
+        s->riseTick = edge->tick;
+        return;
+    }
+    if (! s->echoHigh) {
+        s->crosstalk ++;
+        return;
+    }
+    s->echoHigh = 0;
+    sonarMeasurement(e, edge->sensor, s->riseTick, edge->tick - s->riseTick);
+    sonarScheduleNext(e, edge->tick);
+}
+
+void sonarEngineSetTemperature(struct sonarEngine *e, double temperature) {
+    e->temperature = temperature;
+    e->soundSpeed = sonarSoundSpeed(temperature);
+}
+
+void sonarEngineInit(struct sonarEngine *e, int sensorCount, double rate) {
+    memset(e, 0, sizeof(*e));
+    if (sensorCount > SONAR_MAX_SENSORS) sensorCount = SONAR_MAX_SENSORS;
+    e->sensorCount = sensorCount;
+    e->queue.wakeFd = -1;
+    e->period = rate > 0 ? 1000000 / rate : 0;
+    // HC-SR04 resolution is around 3mm
+    e->measurementNoise = 0.003 * 0.003;
+    e->processNoise = 1.0;
+    // the first round robin step triggers sensor 0
+    e->active = sensorCount - 1;
+    sonarEngineSetTemperature(e, 20.0);
+}
+
+int sonarEngineStep(struct sonarEngine *e, uint32_t now) {
+    struct sonarEdge    edge;
+    int32_t             elapsed;
+
+    while (sonarQueuePop(&e->queue, &edge)) sonarEdgeProcess(e, &edge);
+
+    // in replays triggers come from the queue
+    if (e->trigger == NULL) return(SONAR_TIMEOUT_US);
+
+    if (e->waiting) {
+        elapsed = now - e->triggerTick;
+        if (elapsed < SONAR_TIMEOUT_US) return(SONAR_TIMEOUT_US - elapsed);
+        // no echo at all, the sensor is probably disconnected
+        e->sensor[e->active].outOfRange ++;
+        sonarOutput(e, e->active, e->triggerTick, -1, -1);
+        sonarScheduleNext(e, now);
+    }
+    if ((int32_t)(now - e->nextTriggerTick) < 0) return(e->nextTriggerTick - now);
+    sonarTriggered(e, (e->active + 1) % e->sensorCount, now);
+    if (e->trigger(e, e->active) < 0) {
+        printf("%s:%d: Can't trigger sonar %d\n", __FILE__, __LINE__, e->active);
+    }
+    return(SONAR_TIMEOUT_US);
+}
+
+void sonarEngineReport(struct sonarEngine *e, FILE *ff) {
+    struct sonarSensor  *s;
+    int                 i;
+
+    for(i=0; i<e->sensorCount; i++) {
+        s = &e->sensor[i];
+        fprintf(ff, "info: sonar %d: %lld measurements, %lld out of range, %lld crosstalk edges\n", i, s->measurements, s->outOfRange, s->crosstalk);
+    }
+    fprintf(ff, "info: sonar queue drops: %lld\n", e->queue.drops);
+    fflush(ff);
+}
@@ -0,0 +1,123 @@
+/*
+  Multi sensor engine for HC-SR04 like sonars.
+
+  Sensors are triggered one at a time (round robin), the next trigger
+  comes only after the echo of the previous one ended (or timed out)
+  and a guard time passed, so a sensor never hears the ping of another
+  one.
+
+  Echo edges are captured by the GPIO callback (pigpio thread) into a
+  single producer single consumer lock-free queue and processed by the
+  engine in the main thread. The callback does nothing but push the
+  edge with its hardware tick, so measurements are not disturbed by
+  filtering or publishing.
+
+  Each sensor has a median filter rejecting outliers (spurious echoes)
+  followed by a constant velocity Kalman filter. Distance is computed
+  with the speed of sound at the given air temperature.
+
+  Ticks are microseconds (pigpio gpioTick), wrapping at 2^32.
+ */
+
+#ifndef SONAR_H
+#define SONAR_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SONAR_MAX_SENSORS           8
+// must be a power of 2
+#define SONAR_QUEUE_SIZE            256
+#define SONAR_MEDIAN                5
+
+// HC-SR04 range is 2cm - 4m, without echo it holds echo high for 38ms
+#define SONAR_MIN_RANGE             0.02
+#define SONAR_MAX_RANGE             4.0
+#define SONAR_TIMEOUT_US            40000
+// quiet time after an echo before triggering the next sensor
+#define SONAR_GUARD_US              2000
+
+// level of queued edge records reporting a trigger (used by replays)
+#define SONAR_TRIGGER               2
+
+struct sonarEdge {
+    uint32_t    tick;
+    uint8_t     sensor;
+    uint8_t     level;
+    uint16_t    reserved;
+};
+
+struct sonarQueue {
+    struct sonarEdge    edge[SONAR_QUEUE_SIZE];
+    // head is written by the producer only, tail by the consumer only
+    unsigned            head;
+    unsigned            tail;
+    // edges lost because the queue was full, written by the producer
+    long long           drops;
+    // eventfd signalled on falling edges, -1 if not used
+    int                 wakeFd;
+};
+
+struct sonarSensor {
+    int         triggerPin;
+    int         echoPin;
+    int         echoHigh;
+    uint32_t    riseTick;
+
+    // last valid distances for the median filter
+    double      window[SONAR_MEDIAN];
+    int         windowCount;
+    int         windowIndex;
+
+    // Kalman filter, state is distance and velocity
+    int         kalmanValid;
+    double      d, v;
+    double      p[2][2];
+    uint32_t    lastTick;
+
+    // statistics
+    long long   measurements;
+    long long   outOfRange;
+    long long   crosstalk;
+};
+
+struct sonarEngine {
+    struct sonarSensor  sensor[SONAR_MAX_SENSORS];
+    int                 sensorCount;
+    struct sonarQueue   queue;
+
+    double              temperature;
+    double              soundSpeed;
+    // Kalman filter noises, acceleration (m/s^2)^2/Hz and measurement m^2
+    double              processNoise;
+    double              measurementNoise;
+
+    // trigger period of the whole round, i.e. each sensor is triggered at rate/sensorCount
+    uint32_t            period;
+    int                 active;
+    int                 waiting;
+    uint32_t            triggerTick;
+    uint32_t            nextTriggerTick;
+
+    // Trigger the sensor. If NULL, triggers are SONAR_TRIGGER records in the queue (replay).
+    int                 (*trigger)(struct sonarEngine *e, int sensor);
+    // Called for each measurement, raw and filtered are -1 if out of range. Tick is the middle of the echo.
+    void                (*output)(struct sonarEngine *e, int sensor, uint32_t tick, double raw, double filtered);
+    void                *arg;
+    // if not NULL, triggers and edges are recorded here for replays
+    FILE                *record;
+};
+
+// Producer side, safe to call from the GPIO callback thread. Returns -1 if the queue is full.
+int sonarQueuePush(struct sonarQueue *q, uint32_t tick, int sensor, int level);
+// Consumer side. Returns 0 if the queue is empty.
+int sonarQueuePop(struct sonarQueue *q, struct sonarEdge *e);
+
+double sonarSoundSpeed(double temperature);
+void sonarEngineInit(struct sonarEngine *e, int sensorCount, double rate);
+void sonarEngineSetTemperature(struct sonarEngine *e, double temperature);
+// Process queued edges and trigger the next sensor when due. Returns microseconds until the next trigger.
+int sonarEngineStep(struct sonarEngine *e, uint32_t now);
+void sonarEngineReport(struct sonarEngine *e, FILE *ff);
+
+#endif